@@ -384,6 +384,7 @@ unsigned int sleep(unsigned int seconds);
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -397,8 +398,13 @@ unsigned int sleep(unsigned int seconds);
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <asm/socket.h> /* SO_PEERCRED, hidden by _XOPEN_SOURCE */
+#endif
+
 #ifdef __APPLE__
 #include <machine/endian.h>
 #ifndef BYTE_ORDER
@@ -524,6 +530,9 @@ typedef struct stat cs_stat_t;
 
 #define MG_LWIP 1
 
+/* For CONFIG_* options, e.g. CONFIG_MBEDTLS_HARDWARE_SHA */
+#include "sdkconfig.h"
+
 #ifndef MG_NET_IF
 #define MG_NET_IF MG_NET_IF_SOCKET
 #endif
@@ -1718,9 +1727,31 @@ typedef struct stat cs_stat_t;
 typedef int sock_t;
 
 #if MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL
+/*
+ * Let mg_mgr_poll() sleep on a FreeRTOS semaphore until LWIP posts a signal
+ * or the nearest timer is due. Mongoose then provides
+ * mg_lwip_mgr_schedule_poll(), platforms that schedule polls themselves
+ * must leave this off. If the semaphore can't be allocated, mg_mgr_poll()
+ * sleeps out its timeout and signals are handled on the next poll.
+ */
+#ifndef MG_ENABLE_LWIP_TASK_WAIT
+#define MG_ENABLE_LWIP_TASK_WAIT 0
+#endif
+
 struct mg_mgr;
 struct mg_connection;
 uint32_t mg_lwip_get_poll_delay_ms(struct mg_mgr *mgr);
+
+/*
+ * Signals from LWIP callbacks to the Mongoose task. There is no queue limit:
+ * signals of a connection that are already pending are coalesced.
+ */
+struct mg_lwip_sig_stats {
+  unsigned long num_posted;    /* Signals posted */
+  unsigned long num_coalesced; /* Of them, merged with a pending one */
+  unsigned long max_batch;     /* Most connections signalled in one poll */
+};
+void mg_lwip_get_sig_stats(struct mg_mgr *mgr, struct mg_lwip_sig_stats *st);
 void mg_lwip_set_keepalive_params(struct mg_connection *nc, int idle,
                                   int interval, int count);
 #endif
@@ -1788,15 +1819,38 @@ void cs_md5_final(unsigned char *md, cs_md5_ctx *c);
 
 /* Amalgamated: #include "common/platform.h" */
 
+/*
+ * On ESP32, SHA1 can be offloaded to the hardware SHA engine through the
+ * ESP-IDF mbedTLS port (enabled by CONFIG_MBEDTLS_HARDWARE_SHA). The port
+ * arbitrates access to the engine and falls back to software when it is busy.
+ */
+#ifndef CS_ENABLE_SHA1_MBEDTLS
+#if CS_PLATFORM == CS_P_ESP32 && defined(CONFIG_MBEDTLS_HARDWARE_SHA)
+#define CS_ENABLE_SHA1_MBEDTLS 1
+#else
+#define CS_ENABLE_SHA1_MBEDTLS 0
+#endif
+#endif
+
+#if CS_ENABLE_SHA1_MBEDTLS
+#include <mbedtls/sha1.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
+#if CS_ENABLE_SHA1_MBEDTLS
+typedef struct {
+  mbedtls_sha1_context mbedtls;
+} cs_sha1_ctx;
+#else
 typedef struct {
   uint32_t state[5];
   uint32_t count[2];
   unsigned char buffer[64];
 } cs_sha1_ctx;
+#endif
 
 void cs_sha1_init(cs_sha1_ctx *);
 void cs_sha1_update(cs_sha1_ctx *, const unsigned char *data, uint32_t len);
@@ -1952,6 +2006,7 @@ const char *mg_strstr(const struct mg_str haystack, const struct mg_str needle);
 #ifndef CS_COMMON_MBUF_H_
 #define CS_COMMON_MBUF_H_
 
+#include <stdarg.h>
 #include <stdlib.h>
 /* Amalgamated: #include "common/platform.h" */
 
@@ -2009,6 +2064,27 @@ void mbuf_resize(struct mbuf *, size_t new_size);
 /* Shrinks an Mbuf by resizing its `size` to `len`. */
 void mbuf_trim(struct mbuf *);
 
+/*
+ * Appends `printf`-style formatted data to the Mbuf.
+ *
+ * Output is formatted directly into the spare capacity of the buffer, which
+ * is grown at most once if the output doesn't fit. Formats that only use
+ * `%d`, `%s`, `%.*s` and `%%` are handled without calling `vsnprintf()`.
+ *
+ * Returns the number of bytes appended or -1 on error.
+ */
+int mbuf_vprintf(struct mbuf *, const char *fmt, va_list ap);
+
+/*
+ * Returns the number of bytes `mbuf_vprintf()` would append, or -1 if it
+ * can't be told. Only calls `vsnprintf()` for the formats `mbuf_vprintf()`
+ * passes to it.
+ */
+int mbuf_vprintf_len(const char *fmt, va_list ap);
+
+/* Same as `mbuf_vprintf()`, but takes a variable argument list. */
+int mbuf_printf(struct mbuf *, const char *fmt, ...);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
@@ -2064,6 +2140,87 @@ int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len);
 
 #endif /* CS_COMMON_CS_BASE64_H_ */
 #ifdef MG_MODULE_LINES
+#line 1 "common/cs_gzip.h"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_COMMON_CS_GZIP_H_
+#define CS_COMMON_CS_GZIP_H_
+
+#ifndef CS_DISABLE_GZIP
+#define CS_DISABLE_GZIP 0
+#endif
+
+#if !CS_DISABLE_GZIP
+
+/* Amalgamated: #include "common/mbuf.h" */
+/* Amalgamated: #include "common/platform.h" */
+
+/*
+ * Log2 of the LZ77 window, 9 to 14. The compressor state takes about
+ * 6 << (CS_GZIP_WINDOW_BITS - 10) KB.
+ */
+#ifndef CS_GZIP_WINDOW_BITS
+#define CS_GZIP_WINDOW_BITS 10
+#endif
+
+/*
+ * How many earlier occurrences of a string are tried when looking for a
+ * match. Higher is slower, and compresses a little better.
+ */
+#ifndef CS_GZIP_MAX_CHAIN
+#define CS_GZIP_MAX_CHAIN 8
+#endif
+
+#define CS_GZIP_WINDOW_SIZE (1U << CS_GZIP_WINDOW_BITS)
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * Streaming gzip (RFC 1952) compressor. Output is deflate with fixed
+ * Huffman codes, which needs no per-block tables and so keeps the state
+ * small.
+ */
+typedef struct {
+  uint32_t crc;
+  uint32_t size;  /* Of the input, mod 2^32 */
+  uint32_t bits;  /* Output bits not yet written out */
+  int num_bits;
+  int started;  /* Header is written */
+  int in_block; /* Compressed block is open */
+  size_t len;   /* Bytes in the window buffer */
+  size_t pos;   /* Next byte of the window buffer to compress */
+  unsigned char window[2 * CS_GZIP_WINDOW_SIZE];
+  uint16_t head[CS_GZIP_WINDOW_SIZE]; /* By hash, last position + 1 */
+  uint16_t prev[CS_GZIP_WINDOW_SIZE]; /* Previous position + 1, by position */
+} cs_gzip_ctx;
+
+void cs_gzip_init(cs_gzip_ctx *ctx);
+
+/*
+ * Compresses `len` bytes, appending output to `out`. Some of the input may
+ * be held back to look for matches; with `flush`, all of it is written out,
+ * at the cost of a few bytes, so that the receiver can decompress it.
+ */
+void cs_gzip_update(cs_gzip_ctx *ctx, const void *data, size_t len, int flush,
+                    struct mbuf *out);
+
+/* Writes out the rest of the stream. */
+void cs_gzip_finish(cs_gzip_ctx *ctx, struct mbuf *out);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !CS_DISABLE_GZIP */
+
+#endif /* CS_COMMON_CS_GZIP_H_ */
+#ifdef MG_MODULE_LINES
 #line 1 "common/str_util.h"
 #endif
 /*
@@ -3078,6 +3235,14 @@ struct {								\
 #define MG_ENABLE_HTTP_CGI 0
 #endif
 
+#ifndef MG_ENABLE_HTTP_GZIP
+#define MG_ENABLE_HTTP_GZIP 0
+#endif
+
+#ifndef MG_ENABLE_HTTP_SSE
+#define MG_ENABLE_HTTP_SSE 0
+#endif
+
 #ifndef MG_ENABLE_HTTP_SSI
 #define MG_ENABLE_HTTP_SSI MG_ENABLE_FILESYSTEM
 #endif
@@ -3098,10 +3263,37 @@ struct {								\
 #define MG_ENABLE_HTTP_WEBSOCKET MG_ENABLE_HTTP
 #endif
 
+#ifndef MG_ENABLE_HTTP2
+#define MG_ENABLE_HTTP2 0
+#endif
+
 #ifndef MG_ENABLE_IPV6
 #define MG_ENABLE_IPV6 0
 #endif
 
+#ifndef MG_ENABLE_UNIX_SOCKETS
+#define MG_ENABLE_UNIX_SOCKETS 0
+#endif
+
+#ifndef MG_ENABLE_LISTENER_HANDOFF
+#define MG_ENABLE_LISTENER_HANDOFF 0
+#endif
+
+/* Moving connections between managers; needs GCC-style __atomic builtins */
+#ifndef MG_ENABLE_CONN_MIGRATION
+#define MG_ENABLE_CONN_MIGRATION 0
+#endif
+
+/* Flat array of connections for poll loops to scan, see mg_mgr::conn_table */
+#ifndef MG_ENABLE_CONN_TABLE
+#define MG_ENABLE_CONN_TABLE 0
+#endif
+
+/* Weighted priority classes for connections, see MG_PRIO_NORMAL */
+#ifndef MG_ENABLE_CONN_PRIORITY
+#define MG_ENABLE_CONN_PRIORITY 0
+#endif
+
 #ifndef MG_ENABLE_MQTT
 #define MG_ENABLE_MQTT 1
 #endif
@@ -3165,6 +3357,14 @@ struct {								\
 #define MG_ENABLE_EXTRA_ERRORS_DESC 0
 #endif
 
+#ifndef MG_ENABLE_MEM_PROFILER
+#define MG_ENABLE_MEM_PROFILER 0
+#endif
+
+#ifndef MG_ENABLE_NET_IF_URING
+#define MG_ENABLE_NET_IF_URING 0
+#endif
+
 #ifndef MG_ENABLE_CALLBACK_USERDATA
 #define MG_ENABLE_CALLBACK_USERDATA 0
 #endif
@@ -3207,6 +3407,10 @@ extern "C" {
 
 #define MG_MAIN_IFACE 0
 
+#ifndef MG_MAX_WAIT_SOCKS
+#define MG_MAX_WAIT_SOCKS 8
+#endif
+
 struct mg_mgr;
 struct mg_connection;
 union socket_address;
@@ -3253,12 +3457,40 @@ struct mg_iface_vtable {
   /* Put connection's address into *sa, local (remote = 0) or remote. */
   void (*get_conn_addr)(struct mg_connection *nc, int remote,
                         union socket_address *sa);
+
+  /*
+   * Optional. Return the buffer tcp_send() appends to, so that the core can
+   * produce output directly into it. Data appended to this buffer must be
+   * treated as if it was passed to tcp_send(). NULL if not supported.
+   */
+  struct mbuf *(*tcp_send_mbuf)(struct mg_connection *nc);
+
+  /*
+   * Optional. Used when the manager has several interfaces, to block in the
+   * main one only; called right before it does. Return 1 if the interface
+   * has work to do right away. Otherwise return 0 and put into *sock a
+   * socket that becomes readable when it will have some, or INVALID_SOCKET.
+   * Interfaces without it are handled when the main one wakes up for other
+   * reasons, or times out. The socket interface provides it on Linux only,
+   * as an epoll instance. SOCKS interfaces need none: the manager does not
+   * poll them, the main interface handles their connections.
+   */
+  int (*get_wait_sock)(struct mg_iface *iface, sock_t *sock);
+
+  /*
+   * Optional, for connections with MG_F_RECV_VIEW. Put up to `max_iov`
+   * pieces of data received but not yet consumed into `iov`, in order,
+   * and return their number. Data must stay valid until consumed.
+   */
+  int (*recv_view)(struct mg_connection *nc, struct mg_str *iov, int max_iov);
+  /* Release and acknowledge `len` bytes from the start of the view. */
+  void (*recv_consume)(struct mg_connection *nc, size_t len);
 };
 
 extern const struct mg_iface_vtable *mg_ifaces[];
 extern int mg_num_ifaces;
 
-/* Creates a new interface instance. */
+/* Creates a new interface instance. Returns NULL if out of memory. */
 struct mg_iface *mg_if_create_iface(const struct mg_iface_vtable *vtable,
                                     struct mg_mgr *mgr);
 
@@ -3279,6 +3511,21 @@ struct mg_connection *mg_if_accept_new_conn(struct mg_connection *lc);
 void mg_if_accept_tcp_cb(struct mg_connection *nc, union socket_address *sa,
                          size_t sa_len);
 
+/*
+ * Returns 1 if `iface` is to do I/O and deliver POLL and TIMER events for
+ * `nc`: the connection is bound to it, or to an interface the manager does
+ * not poll (e.g. SOCKS) and `iface` is the main one.
+ */
+int mg_if_owns_conn(struct mg_iface *iface, struct mg_connection *nc);
+
+/*
+ * For the interface blocking in poll(): puts into `socks` up to `max_socks`
+ * sockets reported by the other interfaces of the manager, see
+ * `get_wait_sock`. Returns their number, or -1 if one of the interfaces
+ * has work to do already, in which case poll() must not block.
+ */
+int mg_if_get_wait_socks(struct mg_iface *iface, sock_t *socks, int max_socks);
+
 /* Callback invoked by connect methods. err = 0 -> ok, != 0 -> error. */
 void mg_if_connect_cb(struct mg_connection *nc, int err);
 /* Callback that reports that data has been put on the wire. */
@@ -3290,6 +3537,12 @@ void mg_if_sent_cb(struct mg_connection *nc, int num_sent);
  * Core will acknowledge consumption by calling iface::recved.
  */
 void mg_if_recv_tcp_cb(struct mg_connection *nc, void *buf, int len, int own);
+/*
+ * Receive callback for connections with MG_F_RECV_VIEW: `len` more bytes
+ * can be obtained with iface::recv_view. Core will release them by calling
+ * iface::recv_consume.
+ */
+void mg_if_recv_view_cb(struct mg_connection *nc, size_t len);
 /*
  * Receive callback.
  * buf must be heap-allocated and ownership is transferred to the core.
@@ -3312,6 +3565,53 @@ void mg_if_timer(struct mg_connection *c, double now);
 
 #endif /* CS_MONGOOSE_SRC_NET_IF_H_ */
 #ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_net_if_uring.h"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_MONGOOSE_SRC_NET_IF_URING_H_
+#define CS_MONGOOSE_SRC_NET_IF_URING_H_
+
+/* Amalgamated: #include "mg_net_if.h" */
+
+#if MG_ENABLE_NET_IF_URING
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * Linux io_uring interface. Plain TCP connections use multishot accept,
+ * multishot receive into a ring of provided buffers and asynchronous send;
+ * UDP and SSL connections are polled through the ring and handled by the
+ * socket interface code. All submissions and the wait for completions are
+ * done with a single io_uring_enter() call per poll.
+ *
+ * Select it with `mg_mgr_init_opt()`:
+ *
+ * ```c
+ *   struct mg_mgr_init_opts opts;
+ *   memset(&opts, 0, sizeof(opts));
+ *   opts.main_iface = &mg_uring_iface_vtable;
+ *   mg_mgr_init_opt(&mgr, NULL, opts);
+ * ```
+ *
+ * Requires Linux 6.0 or later. On older kernels, or if io_uring is disabled,
+ * the manager transparently falls back to the socket interface.
+ */
+extern const struct mg_iface_vtable mg_uring_iface_vtable;
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* MG_ENABLE_NET_IF_URING */
+
+#endif /* CS_MONGOOSE_SRC_NET_IF_URING_H_ */
+#ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_ssl_if.h"
 #endif
 /*
@@ -3362,6 +3662,12 @@ enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc);
 int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size);
 int mg_ssl_if_write(struct mg_connection *nc, const void *data, size_t len);
 
+/*
+ * Set protocols to offer via ALPN on a listening connection, in order of
+ * preference. The array is NULL-terminated and must outlive the connection.
+ */
+void mg_ssl_if_set_alpn(struct mg_connection *nc, const char **protos);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -3430,6 +3736,9 @@ union socket_address {
 #else
   struct sockaddr sin6;
 #endif
+#if MG_ENABLE_UNIX_SOCKETS
+  struct sockaddr_un un;
+#endif
 };
 
 struct mg_connection;
@@ -3449,12 +3758,67 @@ typedef void (*mg_event_handler_t)(struct mg_connection *nc, int ev,
 #define MG_EV_SEND 4    /* Data has been written to a socket. int *num_bytes */
 #define MG_EV_CLOSE 5   /* Connection is closed. NULL */
 #define MG_EV_TIMER 6   /* now >= conn->ev_timer_time. double * */
+#define MG_EV_DRAIN 7   /* mg_mgr_drain() was called. NULL */
+
+/*
+ * Event masks, see `mg_connection::ev_mask`. Only the events above can be
+ * masked, protocol-specific events are always delivered.
+ */
+#define MG_EV_MASK(ev) (1U << (ev))
+#define MG_EV_MASK_ALL (~0U)
+
+#ifndef MG_MAX_HANDOFF_SOCKS
+#define MG_MAX_HANDOFF_SOCKS 16
+#endif
+
+#if MG_ENABLE_CONN_PRIORITY
+/*
+ * Priority classes of connections, set with `mg_bind_opts::prio` (inherited
+ * by accepted connections), `mg_connect_opts::prio` or by changing
+ * `mg_connection::prio` at any time, e.g. to make a file download bulk.
+ *
+ * When connections of more than one class have I/O ready in the same poll,
+ * the socket interface services them class by class, interactive first,
+ * using deficit round-robin: each poll, a class may read and write up to
+ * `weight * MG_PRIO_QUANTUM` bytes, plus whatever it has left over from
+ * earlier polls. Connections beyond that get only their `MG_EV_POLL` and
+ * timers, and go first in their class on the next poll, which does not
+ * block since their I/O is still ready. When a single class has I/O ready,
+ * all of it is serviced.
+ */
+#define MG_PRIO_NORMAL 0      /* The default */
+#define MG_PRIO_INTERACTIVE 1 /* Control channels, e.g. WebSocket, MQTT */
+#define MG_PRIO_BULK 2        /* File transfers, uploads */
+#define MG_NUM_PRIO 3
+
+/* Bytes per unit of mg_prio_class::weight and poll */
+#ifndef MG_PRIO_QUANTUM
+#define MG_PRIO_QUANTUM 16384
+#endif
+
+struct mg_prio_stats {
+  unsigned long serviced; /* Times a connection's I/O was serviced */
+  unsigned long deferred; /* Times it was left for the next poll */
+  unsigned long bytes;    /* Bytes read and written */
+  double delay_sum;       /* Seconds from I/O ready to serviced, summed up */
+  double delay_max;       /* Worst such delay, seconds */
+};
+
+struct mg_prio_class {
+  int weight;   /* Share of the I/O, 8, 4 and 1 by default */
+  long deficit; /* Bytes the class may still move */
+  struct mg_prio_stats stats;
+};
+#endif
 
 /*
  * Mongoose event manager.
  */
 struct mg_mgr {
   struct mg_connection *active_connections;
+  LIST_HEAD(mg_closing_conns, mg_connection) closing; /* Flagged for close */
+  LIST_HEAD(mg_writing_conns, mg_connection) writing; /* Have data to send */
+  LIST_HEAD(mg_work_conns, mg_connection) work;       /* See mg_mark_work() */
 #if MG_ENABLE_HEXDUMP
   const char *hexdump_file; /* Debug hexdump file path */
 #endif
@@ -3465,42 +3829,88 @@ struct mg_mgr {
   int num_ifaces;
   struct mg_iface **ifaces; /* network interfaces */
   const char *nameserver;   /* DNS server to use */
+  double drain_deadline;    /* Set by mg_mgr_drain(): when to force-close */
+  int call_depth;           /* Nesting of event handler calls, see mg_call() */
+#if MG_ENABLE_LISTENER_HANDOFF
+  /* Listening sockets from the previous process, not yet bound again */
+  sock_t handoff_socks[MG_MAX_HANDOFF_SOCKS];
+  int num_handoff_socks;
+#endif
+#if MG_ENABLE_CONN_MIGRATION
+  int num_conns;                   /* Load metric, read by other threads */
+  struct mg_connection *migrated;  /* Pushed by mg_conn_migrate() */
+  struct mg_connection *migrating; /* Leaving at the end of the poll */
+#endif
+#if MG_ENABLE_CONN_TABLE
+  /*
+   * The connections again, in no particular order, indexed by
+   * mg_connection::id. Loops that look at every connection on every poll
+   * walk this array instead of chasing `next` pointers. NULL if growing it
+   * has failed, in which case the list is used.
+   */
+  struct mg_connection **conn_table;
+  int conn_table_len;
+  int conn_table_size; /* -1 once growing has failed */
+#endif
+#if MG_ENABLE_CONN_PRIORITY
+  struct mg_prio_class prio[MG_NUM_PRIO]; /* Indexed by MG_PRIO_* */
+  unsigned long prio_io_bytes;            /* Bytes moved, to charge classes */
+#endif
 };
 
 /*
- * Mongoose connection.
+ * Socket options for `mg_bind_opt()` and `mg_connect_opt()`. Zero fields
+ * leave the system defaults in place. Connections accepted by a listener
+ * get the listener's options. Options that the platform lacks are ignored.
  */
-struct mg_connection {
-  struct mg_connection *next, *prev; /* mg_mgr::active_connections linkage */
-  struct mg_connection *listener;    /* Set only for accept()-ed connections */
-  struct mg_mgr *mgr;                /* Pointer to containing manager */
+struct mg_sock_opts {
+  int sndbuf; /* SO_SNDBUF, bytes */
+  int rcvbuf; /* SO_RCVBUF, bytes */
+  /*
+   * TCP Fast Open. For listeners, the length of the queue of pending TFO
+   * requests. For clients, non-zero enables TCP_FASTOPEN_CONNECT, data sent
+   * before the connection is established goes out with the SYN.
+   */
+  int fastopen;
+  unsigned short defer_accept; /* TCP_DEFER_ACCEPT for listeners, seconds */
+  unsigned short backlog;      /* listen() backlog, SOMAXCONN by default */
+  unsigned char nodelay; /* Set TCP_NODELAY, disabling Nagle's algorithm */
+  /*
+   * Keep TCP_CORK on while there is data to send, so that e.g. the headers
+   * and body of an HTTP response go out in full segments. The cork is
+   * released whenever the send buffer drains and handlers add nothing more,
+   * not at the end of the response: a response streamed in pieces is
+   * flushed each time the application falls behind.
+   */
+  unsigned char cork;
+};
 
-  sock_t sock; /* Socket to the remote peer */
-  int err;
-  union socket_address sa; /* Remote peer address */
-  size_t recv_mbuf_limit;  /* Max size of recv buffer */
-  struct mbuf recv_mbuf;   /* Received data */
-  struct mbuf send_mbuf;   /* Data scheduled for sending */
-  time_t last_io_time;     /* Timestamp of the last socket IO */
-  double ev_timer_time;    /* Timestamp of the future MG_EV_TIMER */
-#if MG_ENABLE_SSL
-  void *ssl_if_data; /* SSL library data. */
+/*
+ * TCP data is read in chunks that start at MG_RECV_SIZE_MIN and double, up to
+ * MG_RECV_SIZE_MAX, while reads keep filling them. Chunks shrink again when
+ * reads come back mostly empty. A connection reads at most MG_RECV_BUDGET
+ * bytes per poll, so that a busy one does not starve the others.
+ */
+#ifndef MG_RECV_SIZE_MIN
+#define MG_RECV_SIZE_MIN 1024
 #endif
-  mg_event_handler_t proto_handler; /* Protocol-specific event handler */
-  void *proto_data;                 /* Protocol-specific data */
-  void (*proto_data_destructor)(void *proto_data);
-  mg_event_handler_t handler; /* Event handler function */
-  void *user_data;            /* User-specific data */
-  union {
-    void *v;
-    /*
-     * the C standard is fussy about fitting function pointers into
-     * void pointers, since some archs might have fat pointers for functions.
-     */
-    mg_event_handler_t f;
-  } priv_1;
-  void *priv_2;
-  void *mgr_data; /* Implementation-specific event manager's data. */
+
+#ifndef MG_RECV_SIZE_MAX
+#define MG_RECV_SIZE_MAX 16384
+#endif
+
+#ifndef MG_RECV_BUDGET
+#define MG_RECV_BUDGET 65536
+#endif
+
+/*
+ * Mongoose connection.
+ *
+ * The fields that poll loops and `mg_call()` read for every connection are
+ * grouped at the front; the rest follow in no particular order.
+ */
+struct mg_connection {
+  struct mg_connection *next; /* mg_mgr::active_connections linkage */
   struct mg_iface *iface;
   unsigned long flags;
 /* Flags set by Mongoose */
@@ -3513,6 +3923,8 @@ struct mg_connection {
 #define MG_F_WANT_READ (1 << 6)          /* SSL specific */
 #define MG_F_WANT_WRITE (1 << 7)         /* SSL specific */
 #define MG_F_IS_WEBSOCKET (1 << 8)       /* Websocket specific */
+#define MG_F_HANDED_OFF (1 << 9)         /* Listener passed to a new process */
+#define MG_F_IS_H2 (1 << 18)             /* Switched to HTTP/2 */
 
 /* Flags that are settable by user */
 #define MG_F_SEND_AND_CLOSE (1 << 10)      /* Push remaining data and close  */
@@ -3520,6 +3932,9 @@ struct mg_connection {
 #define MG_F_WEBSOCKET_NO_DEFRAG (1 << 12) /* Websocket specific */
 #define MG_F_DELETE_CHUNK (1 << 13)        /* HTTP specific */
 #define MG_F_ENABLE_BROADCAST (1 << 14)    /* Allow broadcast address usage */
+#define MG_F_RECV_VIEW (1 << 15)           /* Receive with mg_recv_view() */
+#define MG_F_WRITE_THROUGH (1 << 16)       /* Send replies without waiting */
+#define MG_F_MIGRATABLE (1 << 17)          /* mg_mgr_rebalance() may move it */
 
 #define MG_F_USER_1 (1 << 20) /* Flags left for application */
 #define MG_F_USER_2 (1 << 21)
@@ -3527,6 +3942,62 @@ struct mg_connection {
 #define MG_F_USER_4 (1 << 23)
 #define MG_F_USER_5 (1 << 24)
 #define MG_F_USER_6 (1 << 25)
+  sock_t sock;            /* Socket to the remote peer */
+  double ev_timer_time;   /* Timestamp of the future MG_EV_TIMER */
+  struct mbuf recv_mbuf;  /* Received data */
+  struct mbuf send_mbuf;  /* Data scheduled for sending */
+  size_t recv_mbuf_limit; /* Max size of recv buffer */
+  /*
+   * Events the handlers are called for, MG_EV_MASK_ALL by default. An event
+   * the protocol handler does not take goes straight to the user handler.
+   * Accepted connections inherit the masks of the listener.
+   */
+  unsigned int ev_mask;             /* Events passed to `handler` */
+  unsigned int proto_ev_mask;       /* Events passed to `proto_handler` */
+  mg_event_handler_t proto_handler; /* Protocol-specific event handler */
+  mg_event_handler_t handler;       /* Event handler function */
+
+  struct mg_connection *prev;
+  struct mg_connection *listener; /* Set only for accept()-ed connections */
+  struct mg_mgr *mgr;             /* Pointer to containing manager */
+  LIST_ENTRY(mg_connection) closing_link; /* mg_mgr::closing linkage */
+  LIST_ENTRY(mg_connection) writing_link; /* mg_mgr::writing linkage */
+  LIST_ENTRY(mg_connection) work_link;    /* mg_mgr::work linkage */
+  void *proto_data;                       /* Protocol-specific data */
+  void (*proto_data_destructor)(void *proto_data);
+  void *user_data;     /* User-specific data */
+  time_t last_io_time; /* Timestamp of the last socket IO */
+  size_t recv_size;    /* Current read chunk size, see MG_RECV_SIZE_MIN */
+  int err;
+#if MG_ENABLE_CONN_TABLE
+  int id; /* Index in mg_mgr::conn_table */
+#endif
+#if MG_ENABLE_CONN_MIGRATION
+  struct mg_mgr *migrate_to;          /* Set by mg_conn_migrate() */
+  struct mg_connection *migrate_next; /* In mg_mgr::migrating */
+#endif
+  union socket_address sa; /* Remote peer address */
+#if MG_ENABLE_SSL
+  void *ssl_if_data; /* SSL library data. */
+#endif
+  struct mg_sock_opts sock_opts; /* Socket options, see mg_bind_opt() */
+#if MG_ENABLE_CONN_PRIORITY
+  double prio_ready_time;          /* When I/O was found ready, or 0 */
+  struct mg_connection *prio_next; /* Ready list linkage */
+  int prio_fd_flags;               /* The ready I/O, while on the list */
+  unsigned char prio;              /* Priority class, MG_PRIO_NORMAL etc. */
+#endif
+  /* Deprecated: not used by Mongoose, kept for existing applications */
+  union {
+    void *v;
+    /*
+     * the C standard is fussy about fitting function pointers into
+     * void pointers, since some archs might have fat pointers for functions.
+     */
+    mg_event_handler_t f;
+  } priv_1;
+  void *priv_2;
+  void *mgr_data; /* Implementation-specific event manager's data. */
 };
 
 /*
@@ -3587,6 +4058,106 @@ void mg_mgr_free(struct mg_mgr *);
  */
 time_t mg_mgr_poll(struct mg_mgr *, int milli);
 
+/*
+ * Starts a graceful shutdown. Listeners are closed at once, so no new
+ * connections are accepted, and every other connection gets `MG_EV_DRAIN`:
+ *
+ * - HTTP server connections are closed as soon as they are idle, i.e. when
+ *   the request being served, if any, has been replied to. A reply started
+ *   with `mg_send_head()` is complete once its Content-Length bytes, or its
+ *   last chunk, have been sent. Other replies are complete once the send
+ *   buffer has been flushed and no file, CGI or proxied response is being
+ *   streamed.
+ * - WebSocket connections are sent a Close frame (1001, going away).
+ * - HTTP/2 connections are sent GOAWAY and closed when their streams end.
+ *
+ * Other connections are left to the event handler, which can close them
+ * on `MG_EV_DRAIN`. Whatever is still open `timeout` seconds later is closed
+ * by `mg_mgr_poll()`. Keep polling until `mgr->active_connections` is NULL,
+ * then call `mg_mgr_free()`.
+ */
+void mg_mgr_drain(struct mg_mgr *mgr, double timeout);
+
+#if MG_ENABLE_LISTENER_HANDOFF
+/*
+ * Listener handoff, for restarts without refusing clients. Listening sockets
+ * handed to a new process are not used until `mg_bind_opt()` asks for the
+ * same address: it then adopts the inherited socket instead of creating a
+ * new one. Sockets that are not bound again are closed by `mg_mgr_free()`.
+ * After a handoff, the old process should call `mg_mgr_drain()`.
+ */
+
+/* Environment variable with the listening sockets a new process inherits */
+#define MG_LISTEN_FDS_ENV "MG_LISTEN_FDS"
+
+/*
+ * Prepares listening sockets to be inherited by a process started with
+ * fork() and exec(): clears their close-on-exec flag and lists them in the
+ * `MG_LISTEN_FDS` environment variable. The new process picks them up in
+ * its first `mg_mgr_init()`, and only there.
+ *
+ * Returns the number of sockets exported.
+ */
+int mg_mgr_export_listeners(struct mg_mgr *mgr);
+
+/*
+ * Passes listening sockets to another process over a connected Unix-domain
+ * socket `sock`, using `SCM_RIGHTS`. The receiver calls
+ * `mg_mgr_recv_listeners()`.
+ *
+ * Returns the number of sockets sent, or -1 on error.
+ */
+int mg_mgr_send_listeners(struct mg_mgr *mgr, sock_t sock);
+
+/*
+ * Receives listening sockets sent by `mg_mgr_send_listeners()`.
+ *
+ * Returns the number of sockets received, or -1 on error.
+ */
+int mg_mgr_recv_listeners(struct mg_mgr *mgr, sock_t sock);
+#endif
+
+#if MG_ENABLE_CONN_MIGRATION
+/*
+ * Moves connection `nc` to manager `to`, which may be polled by another
+ * thread. Must be called from the thread that polls `nc->mgr`, typically
+ * from `nc`'s event handler. The move itself is deferred until the end of
+ * the current `mg_mgr_poll()` of `nc->mgr` (or the next one, when called
+ * between polls), after all of `nc`'s events have been dispatched; it is
+ * dropped if by then the connection is no longer quiescent (see below).
+ * The socket, buffers, protocol data, handlers and user data go with the
+ * connection; `to` starts polling it on its next `mg_mgr_poll()`, so a
+ * target blocked in poll picks it up when its poll timeout expires. From
+ * then on, `nc` belongs to `to`'s thread, and whatever its handlers touch
+ * must be safe to use from there.
+ *
+ * Only quiescent connections on the socket interface can be moved: not
+ * listening, not UDP, connected, SSL handshake finished, nothing buffered
+ * and not being closed. `to` must have a socket interface too. Connections
+ * that share state with others in their manager must not be moved: HTTP/2,
+ * MQTT broker sessions, and HTTP connections streaming a CGI or proxied
+ * reply. `nc->listener`, if any, must outlive the connection.
+ *
+ * Returns 0 if the move is scheduled, -1 if the connection cannot be moved
+ * or is already being moved.
+ */
+int mg_conn_migrate(struct mg_connection *nc, struct mg_mgr *to);
+
+/*
+ * Evens out the number of connections among `mgrs`, an array of `num_mgrs`
+ * managers that `mgr` may be a member of. Meant to be called periodically
+ * by each manager's own thread. When `mgr` is the busiest one, its
+ * connections flagged with `MG_F_MIGRATABLE` are moved, one at a time, to
+ * the least loaded manager until the two differ by at most one, or
+ * `max_moves` connections have been moved. Other managers are left alone:
+ * only their own threads can move their connections.
+ *
+ * Returns the number of connections moved.
+ */
+int mg_mgr_rebalance(struct mg_mgr *mgr, struct mg_mgr **mgrs, int num_mgrs,
+                     int max_moves);
+#endif
+
 #if MG_ENABLE_BROADCAST
 /*
  * Passes a message of a given length to all connections.
@@ -3689,6 +4260,10 @@ struct mg_bind_opts {
    * If NULL, a reasonable default is used.
    */
   const char *ssl_cipher_suites;
+#endif
+  struct mg_sock_opts sock_opts; /* Socket options */
+#if MG_ENABLE_CONN_PRIORITY
+  int prio; /* Priority class, MG_PRIO_NORMAL etc. */
 #endif
 };
 
@@ -3712,6 +4287,10 @@ struct mg_connection *mg_bind(struct mg_mgr *mgr, const char *address,
  * format: `[PROTO://][IP_ADDRESS]:PORT`, where `PROTO` could be `tcp` or
  * `udp`.
  *
+ * With `-DMG_ENABLE_UNIX_SOCKETS`, `unix://PATH` and `unixgram://PATH` listen
+ * on a Unix-domain socket instead. A stale socket file at `PATH` is removed
+ * before binding, and the file is removed again when the listener is closed.
+ *
  * See the `mg_bind_opts` structure for a description of the optional
  * parameters.
  *
@@ -3775,6 +4354,10 @@ struct mg_connect_opts {
    */
   const char *ssl_psk_identity;
   const char *ssl_psk_key;
+#endif
+  struct mg_sock_opts sock_opts; /* Socket options */
+#if MG_ENABLE_CONN_PRIORITY
+  int prio; /* Priority class, MG_PRIO_NORMAL etc. */
 #endif
 };
 
@@ -3797,6 +4380,12 @@ struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *address,
  * of valid addresses: `google.com:80`, `udp://1.2.3.4:53`, `10.0.0.1:443`,
  * `[::1]:80`
  *
+ * If compiled with `-DMG_ENABLE_UNIX_SOCKETS`, `unix://PATH` (stream) and
+ * `unixgram://PATH` (datagram) connect to a Unix-domain socket. A `PATH`
+ * starting with `@` names a Linux abstract socket, e.g. `unix://@gateway`.
+ * Any protocol handler can be attached to such a connection, e.g.
+ * `mg_set_protocol_http_websocket()` before sending a request by hand.
+ *
  * See the `mg_connect_opts` structure for a description of the optional
  * parameters.
  *
@@ -3884,6 +4473,33 @@ int mg_printf(struct mg_connection *, const char *fmt, ...);
 /* Same as `mg_printf()`, but takes `va_list ap` as an argument. */
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 
+/*
+ * Zero-copy receive.
+ *
+ * If `MG_F_RECV_VIEW` is set on a connection, e.g. on `MG_EV_CONNECT` or
+ * `MG_EV_ACCEPT`, and its interface supports it (LWIP), received data is not
+ * copied to `recv_mbuf`. `MG_EV_RECV` reports the number of new bytes, which
+ * stay in network buffers until released with `mg_recv_consume()`.
+ *
+ * `mg_recv_view()` puts up to `max_iov` pieces of unconsumed data into `iov`,
+ * in order, and returns their number; 0 if there is none or the connection
+ * is not in this mode.
+ *
+ * LWIP keeps at most `MG_LWIP_RX_CHAIN_MAX_PBUFS` (4) pool buffers per
+ * connection: data received while that many are unconsumed is copied once
+ * into heap-allocated buffers, so consume promptly to stay zero-copy.
+ */
+int mg_recv_view(struct mg_connection *nc, struct mg_str *iov, int max_iov);
+
+/* Releases `len` bytes from the start of the receive view. */
+void mg_recv_consume(struct mg_connection *nc, size_t len);
+
+/*
+ * For handlers that need contiguous data: moves up to `len` bytes from the
+ * receive view to the end of `recv_mbuf`. Returns the number of bytes moved.
+ */
+size_t mg_recv_pullup(struct mg_connection *nc, size_t len);
+
 /*
  * Creates a socket pair.
  * `sock_type` can be either `SOCK_STREAM` or `SOCK_DGRAM`.
@@ -4184,6 +4800,25 @@ void mg_sock_to_str(sock_t sock, char *buf, size_t len, int flags);
 int mg_sock_addr_to_str(const union socket_address *sa, char *buf, size_t len,
                         int flags);
 
+#if MG_ENABLE_UNIX_SOCKETS
+/* Credentials of the process at the other end of a Unix-domain socket */
+struct mg_peer_cred {
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+};
+
+/*
+ * Fetches the peer's credentials of a connection accepted on, or made to, a
+ * `unix://` address. They are checked by the kernel, so can be used instead
+ * of TLS to authenticate local clients.
+ *
+ * Returns 0 on success, -1 if the connection is a listener, not a
+ * Unix-domain one, or the platform does not support `SO_PEERCRED`.
+ */
+int mg_conn_get_peer_cred(struct mg_connection *nc, struct mg_peer_cred *cred);
+#endif
+
 #if MG_ENABLE_HEXDUMP
 /*
  * Generates a human-readable hexdump of memory chunk.
@@ -4284,6 +4919,21 @@ extern "C" {
 #define MG_CGI_ENVIRONMENT_SIZE 8192
 #endif
 
+#if MG_ENABLE_HTTP_GZIP
+/* Responses known to be smaller than this are sent uncompressed. */
+#ifndef MG_HTTP_GZIP_MIN_SIZE
+#define MG_HTTP_GZIP_MIN_SIZE 256
+#endif
+
+/* Content types that are not worth compressing, see mg_match_prefix(). */
+#ifndef MG_HTTP_GZIP_SKIP_TYPES
+#define MG_HTTP_GZIP_SKIP_TYPES                                        \
+  "image/png|image/jpeg|image/gif|image/webp|video/|audio/|font/woff|" \
+  "application/zip|application/gzip|application/x-gzip|"               \
+  "application/octet-stream"
+#endif
+#endif
+
 /* HTTP message */
 struct http_message {
   struct mg_str message; /* Whole message: request line + headers + body */
@@ -5143,6 +5793,11 @@ void mg_http_send_redirect(struct mg_connection *nc, int status_code,
  * Otherwise, `mg_send()` or `mg_printf()` must be used.
  * Extra headers could be set through `extra_headers`. Note `extra_headers`
  * must NOT be terminated by a new line.
+ *
+ * With `MG_ENABLE_HTTP_GZIP`, a chunked response to a request that accepts
+ * gzip is compressed transparently, unless `extra_headers` already set
+ * `Content-Encoding` or a `Content-Type` listed in `MG_HTTP_GZIP_SKIP_TYPES`.
+ * The final empty chunk must then be sent to flush the compressor.
  */
 void mg_send_head(struct mg_connection *n, int status_code,
                   int64_t content_length, const char *extra_headers);
@@ -5241,6 +5896,164 @@ int mg_http_create_digest_auth_header(char *buf, size_t buf_len,
 #endif /* __cplusplus */
 #endif /* CS_MONGOOSE_SRC_HTTP_CLIENT_H_ */
 #ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http_sse.h"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * === Server-Sent Events
+ *
+ * A channel fans events out to any number of `text/event-stream`
+ * subscribers. Each event is formatted once, kept in a small per-channel
+ * replay buffer and queued on every subscriber that keeps up.
+ *
+ * A subscriber whose send buffer holds more than `MG_SSE_MAX_BACKLOG` bytes
+ * is not given new events. Once it drains, it catches up from the replay
+ * buffer, and events that have meanwhile fallen out of it are skipped.
+ * The same happens when a client reconnects with `Last-Event-ID`.
+ */
+
+#ifndef CS_MONGOOSE_SRC_HTTP_SSE_H_
+#define CS_MONGOOSE_SRC_HTTP_SSE_H_
+
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_SSE
+
+/* Amalgamated: #include "common/queue.h" */
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Bytes of recent events each channel keeps for catching up. */
+#ifndef MG_SSE_REPLAY_SIZE
+#define MG_SSE_REPLAY_SIZE 2048
+#endif
+
+/* Subscribers with more than this queued are not given new events. */
+#ifndef MG_SSE_MAX_BACKLOG
+#define MG_SSE_MAX_BACKLOG 2048
+#endif
+
+struct mg_sse_sub;
+
+/* Event channel. Must be initialised with `mg_sse_channel_init()`. */
+struct mg_sse_channel {
+  LIST_HEAD(_mg_sse_subs, mg_sse_sub) subs; /* Subscribed connections */
+  struct mbuf replay;    /* Recent events, oldest first */
+  unsigned long last_id; /* ID of the latest event, 0 if none yet */
+};
+
+/* Initialises an event channel. */
+void mg_sse_channel_init(struct mg_sse_channel *ch);
+
+/*
+ * Frees the channel's replay buffer. Its subscribers are detached and
+ * closed once their queued events are sent.
+ */
+void mg_sse_channel_free(struct mg_sse_channel *ch);
+
+/*
+ * Registers an endpoint that subscribes its clients to `ch`.
+ *
+ * The endpoint `handler`, if not NULL, first gets `MG_EV_HTTP_REQUEST` as
+ * for `mg_register_http_endpoint()`, e.g. to check credentials. If it
+ * sends nothing and does not close the connection, the client is
+ * subscribed: it is sent the `text/event-stream` head and, if its request
+ * has `Last-Event-ID`, the later events still kept by the channel.
+ *
+ * Example:
+ *
+ * ```c
+ * static struct mg_sse_channel s_status;
+ *
+ * mg_sse_channel_init(&s_status);
+ * mg_register_sse_endpoint(nc, "/events", &s_status, NULL);
+ * ...
+ * mg_sse_publish(&s_status, "temperature", "21.5");
+ * ```
+ */
+void mg_register_sse_endpoint(struct mg_connection *nc, const char *uri_path,
+                              struct mg_sse_channel *ch,
+                              MG_CB(mg_event_handler_t handler,
+                                    void *user_data));
+
+/*
+ * Subscribes the connection which made request `hm` to `ch`, as
+ * `mg_register_sse_endpoint()` does. A connection can be subscribed to
+ * one channel only.
+ */
+void mg_sse_subscribe(struct mg_connection *nc, struct mg_sse_channel *ch,
+                      struct http_message *hm);
+
+/*
+ * Publishes an event to all subscribers of `ch`. `event` is the event
+ * type, or NULL for the default ("message"). Each line of `data`, ended
+ * by CR, LF or CRLF, becomes a data line of the event. Returns the ID given
+ * to the event.
+ */
+unsigned long mg_sse_publish(struct mg_sse_channel *ch, const char *event,
+                             const char *data);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_SSE */
+
+#endif /* CS_MONGOOSE_SRC_HTTP_SSE_H_ */
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http2.h"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * === HTTP/2 server
+ *
+ * When built with `MG_ENABLE_HTTP2`, connections that use
+ * `mg_set_protocol_http_websocket()` also accept HTTP/2: on TLS listeners
+ * "h2" is offered via ALPN, and cleartext clients can start with the
+ * HTTP/2 connection preface (prior knowledge).
+ *
+ * Each HTTP/2 stream is presented to the event handler as a connection of
+ * its own: it gets `MG_EV_ACCEPT`, then `MG_EV_HTTP_REQUEST` (or whatever
+ * the endpoint registered with `mg_register_http_endpoint()` gets), and is
+ * answered in the usual way, e.g. with `mg_send_head()` and
+ * `mg_printf_http_chunk()`. The response is translated into HTTP/2 frames,
+ * and is over when its body is, or when the stream connection is closed.
+ * Responses of different streams are interleaved according to the stream
+ * priorities and the flow control windows.
+ */
+
+#ifndef CS_MONGOOSE_SRC_HTTP2_H_
+#define CS_MONGOOSE_SRC_HTTP2_H_
+
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP2
+
+/* Max number of concurrent streams per connection. */
+#ifndef MG_H2_MAX_STREAMS
+#define MG_H2_MAX_STREAMS 8
+#endif
+
+/* Stream receive window: how much request body a client can send ahead. */
+#ifndef MG_H2_STREAM_WINDOW
+#define MG_H2_STREAM_WINDOW 16384
+#endif
+
+/* Size of the HPACK dynamic table used to decode request headers. */
+#ifndef MG_H2_HPACK_TABLE_SIZE
+#define MG_H2_HPACK_TABLE_SIZE 4096
+#endif
+
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP2 */
+
+#endif /* CS_MONGOOSE_SRC_HTTP2_H_ */
+#ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_mqtt.h"
 #endif
 /*
@@ -5572,6 +6385,28 @@ void mg_mqtt_broker(struct mg_connection *brk, int ev, void *data);
 struct mg_mqtt_session *mg_mqtt_next(struct mg_mqtt_broker *brk,
                                      struct mg_mqtt_session *s);
 
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET
+/*
+ * Serves MQTT over WebSocket from `brk` on HTTP connection `nc`, at
+ * `uri_path`.
+ *
+ * Clients must negotiate the "mqtt" subprotocol. Their sessions live in
+ * `brk` along with those of plain MQTT clients: binary websocket messages
+ * are parsed as MQTT packets directly, and packets to the client are sent
+ * as one binary message each.
+ *
+ * ```c
+ * mg_mqtt_broker_init(&brk, NULL);
+ * nc = mg_bind(&mgr, "8000", ev_handler);
+ * mg_set_protocol_http_websocket(nc);
+ * mg_register_mqtt_ws_endpoint(nc, "/mqtt", &brk);
+ * ```
+ */
+void mg_register_mqtt_ws_endpoint(struct mg_connection *nc,
+                                  const char *uri_path,
+                                  struct mg_mqtt_broker *brk);
+#endif
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -6169,6 +7004,14 @@ struct mg_connection *mg_sntp_get_time(struct mg_mgr *mgr,
 #define MG_SOCKS_HANDSHAKE_DONE MG_F_USER_1
 #define MG_SOCKS_CONNECT_DONE MG_F_USER_2
 
+/*
+ * Relayed data is held back while the receiving side has this much queued,
+ * so memory per relayed connection stays bounded by a few times this.
+ */
+#ifndef MG_SOCKS_RELAY_WATERMARK
+#define MG_SOCKS_RELAY_WATERMARK 8192
+#endif
+
 /* SOCKS5 handshake methods */
 enum mg_socks_handshake_method {
   MG_SOCKS_HANDSHAKE_NOAUTH = 0,     /* Handshake method - no authentication */
@@ -6220,3 +7063,109 @@ struct mg_iface *mg_socks_mk_iface(struct mg_mgr *, const char *proxy_addr);
 
 #endif
 #endif
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_mem_prof.h"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * === Allocation profiler
+ *
+ * When built with `MG_ENABLE_MEM_PROFILER=1`, all allocations made through
+ * `MG_MALLOC`, `MG_CALLOC`, `MG_REALLOC` and `MBUF_REALLOC` are accounted to
+ * the subsystem that made them. Live and peak bytes, as well as allocation
+ * counters, are tracked per subsystem.
+ *
+ * Live allocations are kept in a fixed-size table of
+ * `MG_MEM_PROF_TABLE_SIZE` entries, no memory is added to the allocations
+ * themselves. Memory allocated elsewhere and freed with `MG_FREE` (and vice
+ * versa) is safe, it is just not accounted for.
+ *
+ * The underlying allocator can be changed by defining `MG_MEM_PROF_MALLOC`,
+ * `MG_MEM_PROF_CALLOC`, `MG_MEM_PROF_REALLOC` and `MG_MEM_PROF_FREE`.
+ */
+
+#ifndef CS_MONGOOSE_SRC_MEM_PROF_H_
+#define CS_MONGOOSE_SRC_MEM_PROF_H_
+
+/* Amalgamated: #include "mg_net.h" */
+
+#if MG_ENABLE_MEM_PROFILER
+
+#ifndef MG_MEM_PROF_TABLE_SIZE
+#define MG_MEM_PROF_TABLE_SIZE 512 /* Must be a power of 2 */
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Subsystems allocations are accounted to */
+enum mg_mem_tag {
+  MG_MEM_TAG_OTHER, /* Everything not listed below */
+  MG_MEM_TAG_MBUF,  /* Mbuf data, e.g. connection IO buffers */
+  MG_MEM_TAG_CONN,  /* Connections, managers and interfaces */
+  MG_MEM_TAG_HTTP,  /* HTTP protocol data, endpoints, CGI, WebSocket */
+  MG_MEM_TAG_MQTT,  /* MQTT client and broker sessions */
+  MG_MEM_TAG_DNS,   /* DNS and the async resolver */
+  MG_MEM_TAG_SSL,   /* SSL contexts (and the SSL library, if hooked) */
+  MG_MEM_NUM_TAGS
+};
+
+struct mg_mem_prof_stats {
+  size_t live_bytes;         /* Currently allocated */
+  size_t peak_bytes;         /* Maximum value of live_bytes */
+  unsigned long live_allocs; /* Number of live allocations */
+  unsigned long num_allocs;  /* Total number of allocations */
+  unsigned long num_bytes;   /* Total number of bytes allocated, wraps */
+  unsigned long num_failed;  /* Number of failed allocations */
+};
+
+struct mg_mem_prof_snapshot {
+  double time; /* mg_time() when the snapshot was taken */
+  struct mg_mem_prof_stats total;
+  struct mg_mem_prof_stats tags[MG_MEM_NUM_TAGS];
+  /* Allocations not tracked because the table was full */
+  unsigned long num_untracked;
+  /* Frees of memory that wasn't allocated through the profiler */
+  unsigned long num_unknown_frees;
+};
+
+/* Allocation functions `MG_MALLOC` and friends are mapped to. */
+void *mg_mem_prof_malloc(int tag, size_t size);
+void *mg_mem_prof_calloc(int tag, size_t count, size_t size);
+void *mg_mem_prof_realloc(int tag, void *ptr, size_t size);
+void mg_mem_prof_free(void *ptr);
+
+/* Copies current counters into `s`. */
+void mg_mem_prof_snapshot(struct mg_mem_prof_snapshot *s);
+
+/* Resets peak values to the current live values. */
+void mg_mem_prof_reset_peak(void);
+
+/* Returns the name of the tag, e.g. "mbuf". */
+const char *mg_mem_prof_tag_name(int tag);
+
+#if MG_ENABLE_HTTP
+/*
+ * HTTP endpoint handler that serves current counters as JSON, along with
+ * allocation rates since the previous request. Example:
+ *
+ * ```c
+ *   mg_register_http_endpoint(nc, "/debug/mem", mg_mem_prof_http_handler);
+ * ```
+ */
+void mg_mem_prof_http_handler(struct mg_connection *nc, int ev,
+                              void *ev_data MG_UD_ARG(void *user_data));
+#endif
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* MG_ENABLE_MEM_PROFILER */
+
+#endif /* CS_MONGOOSE_SRC_MEM_PROF_H_ */
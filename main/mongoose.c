@@ -13,8 +13,13 @@
 /* Amalgamated: #include "common/mg_mem.h" */
 
 #ifndef MBUF_REALLOC
+#if MG_ENABLE_MEM_PROFILER
+#define MBUF_REALLOC(ptr, size) \
+  mg_mem_prof_realloc(MG_MEM_TAG_MBUF, ptr, size)
+#else
 #define MBUF_REALLOC MG_REALLOC
 #endif
+#endif
 
 #ifndef MBUF_FREE
 #define MBUF_FREE MG_FREE
@@ -51,8 +56,31 @@ MG_INTERNAL void mg_call(struct mg_connection *nc,
                          mg_event_handler_t ev_handler, void *user_data, int ev,
                          void *ev_data);
 void mg_forward(struct mg_connection *from, struct mg_connection *to);
+#if MG_ENABLE_SOCKS
+MG_INTERNAL size_t mg_relay(struct mbuf *from, struct mg_connection *to,
+                            size_t watermark);
+#endif
+MG_INTERNAL size_t mg_recv_size(struct mg_connection *nc);
+MG_INTERNAL void mg_recv_size_update(struct mg_connection *nc, size_t asked,
+                                     size_t got);
 MG_INTERNAL void mg_add_conn(struct mg_mgr *mgr, struct mg_connection *c);
 MG_INTERNAL void mg_remove_conn(struct mg_connection *c);
+#define MG_F_CLOSING_MASK (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE)
+MG_INTERNAL void mg_mark_closing(struct mg_connection *nc);
+MG_INTERNAL void mg_mark_writing(struct mg_connection *nc);
+MG_INTERNAL void mg_unmark_writing(struct mg_connection *nc);
+MG_INTERNAL void mg_mark_work(struct mg_connection *nc);
+MG_INTERNAL void mg_unmark_work(struct mg_connection *nc);
+MG_INTERNAL void mg_close_flagged(struct mg_iface *iface);
+#if MG_ENABLE_CONN_MIGRATION
+MG_INTERNAL void mg_migrate_cancel(struct mg_connection *nc);
+MG_INTERNAL void mg_migrate_flagged(struct mg_mgr *mgr);
+#endif
+MG_INTERNAL struct mbuf *mg_send_mbuf(struct mg_connection *nc);
+MG_INTERNAL size_t mg_send_pending(struct mg_connection *nc);
+#if MG_ENABLE_NET_IF_URING
+MG_INTERNAL size_t mg_uring_in_flight(struct mg_connection *nc);
+#endif
 MG_INTERNAL struct mg_connection *mg_create_connection(
     struct mg_mgr *mgr, mg_event_handler_t callback,
     struct mg_add_sock_opts opts);
@@ -146,6 +174,19 @@ MG_INTERNAL void mg_ws_handler(struct mg_connection *nc, int ev,
 MG_INTERNAL void mg_ws_handshake(struct mg_connection *nc,
                                  const struct mg_str *key,
                                  struct http_message *);
+MG_INTERNAL int mg_ws_build_header(unsigned char *header, int op, size_t len);
+#endif
+#if MG_ENABLE_HTTP2
+MG_INTERNAL int mg_h2_check_preface(const struct mbuf *io);
+MG_INTERNAL void mg_h2_accept(struct mg_connection *nc);
+#if MG_ENABLE_SSL
+MG_INTERNAL void mg_h2_set_alpn(struct mg_connection *nc);
+#endif
+#endif
+#if MG_ENABLE_HTTP_SSE
+struct mg_sse_sub;
+MG_INTERNAL void mg_sse_send_pending(struct mg_sse_sub *sub);
+MG_INTERNAL void mg_sse_unsubscribe(struct mg_sse_sub *sub);
 #endif
 #endif /* MG_ENABLE_HTTP */
 
@@ -174,6 +215,25 @@ MG_INTERNAL int mg_sntp_parse_reply(const char *buf, int len,
 extern "C" {
 #endif
 
+#if MG_ENABLE_MEM_PROFILER
+
+#if defined(MG_MALLOC) || defined(MG_CALLOC) || defined(MG_REALLOC) || \
+    defined(MG_FREE)
+#error "Set MG_MEM_PROF_* instead of MG_* allocators with the profiler"
+#endif
+
+/* Subsystem the allocations are accounted to, redefined by modules. */
+#ifndef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
+#endif
+
+#define MG_MALLOC(size) mg_mem_prof_malloc(MG_MEM_TAG, size)
+#define MG_CALLOC(count, size) mg_mem_prof_calloc(MG_MEM_TAG, count, size)
+#define MG_REALLOC(ptr, size) mg_mem_prof_realloc(MG_MEM_TAG, ptr, size)
+#define MG_FREE(ptr) mg_mem_prof_free(ptr)
+
+#endif /* MG_ENABLE_MEM_PROFILER */
+
 #ifndef MG_MALLOC
 #define MG_MALLOC malloc
 #endif
@@ -196,6 +256,86 @@ extern "C" {
 
 #endif /* CS_COMMON_MG_MEM_H_ */
 #ifdef MG_MODULE_LINES
+#line 1 "common/cs_accel.h"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#ifndef CS_COMMON_CS_ACCEL_H_
+#define CS_COMMON_CS_ACCEL_H_
+
+/*
+ * Instruction set extensions used by the hash and base64 primitives.
+ * Only x86-64 host builds are dispatched at runtime, all other targets use
+ * the portable code (or a fixed hardware engine, see cs_sha1.h).
+ */
+#ifndef CS_ENABLE_X86_ACCEL
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CS_ENABLE_X86_ACCEL 1
+#else
+#define CS_ENABLE_X86_ACCEL 0
+#endif
+#endif
+
+#if CS_ENABLE_X86_ACCEL
+
+#include <immintrin.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CS_CPU_SSSE3 (1 << 0)
+#define CS_CPU_SSE41 (1 << 1)
+#define CS_CPU_SHA (1 << 2)
+
+/* Returns a bitmask of CS_CPU_* features supported by the host CPU. */
+int cs_cpu_features(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CS_ENABLE_X86_ACCEL */
+
+#endif /* CS_COMMON_CS_ACCEL_H_ */
+#ifdef MG_MODULE_LINES
+#line 1 "common/cs_accel.c"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/* Amalgamated: #include "common/cs_accel.h" */
+
+#if CS_ENABLE_X86_ACCEL && !defined(EXCLUDE_COMMON)
+
+#include <cpuid.h>
+
+int cs_cpu_features(void) {
+  /* Benign race: every thread computes the same value. */
+  static int features = -1;
+  if (features < 0) {
+    unsigned int a, b, c, d;
+    int f = 0;
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+      if (c & (1 << 9)) f |= CS_CPU_SSSE3;
+      if (c & (1 << 19)) f |= CS_CPU_SSE41;
+    }
+    if (__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, a, b, c, d);
+      if (b & (1 << 29)) f |= CS_CPU_SHA;
+    }
+    features = f;
+  }
+  return features;
+}
+
+#endif /* CS_ENABLE_X86_ACCEL && !defined(EXCLUDE_COMMON) */
+#ifdef MG_MODULE_LINES
 #line 1 "common/cs_base64.c"
 #endif
 /*
@@ -209,6 +349,7 @@ extern "C" {
 
 #include <string.h>
 
+/* Amalgamated: #include "common/cs_accel.h" */
 /* Amalgamated: #include "common/cs_dbg.h" */
 
 /* ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/ */
@@ -317,8 +458,101 @@ void cs_base64_finish(struct cs_base64_ctx *ctx) {
     dst[j++] = '\0';   \
   } while (0)
 
+#if CS_ENABLE_X86_ACCEL
+/*
+ * SSSE3 encoder: 12 input bytes -> 16 output chars per iteration.
+ * Each iteration loads 16 bytes, so it stops while at least 16 remain;
+ * the tail is handled by the scalar code. Returns number of bytes consumed.
+ */
+__attribute__((target("ssse3"))) static int cs_base64_encode_ssse3(
+    const unsigned char *src, int src_len, char *dst) {
+  const __m128i shuf =
+      _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4,
+                                    -4, -4, -19, -16, 0, 0);
+  int i;
+  for (i = 0; src_len - i >= 16; i += 12) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i t0, t1, t2, t3, idx, mask;
+    /* Spread 3 bytes into 4 6-bit values, one per output byte. */
+    in = _mm_shuffle_epi8(in, shuf);
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    in = _mm_or_si128(t1, t3);
+    /* Translate 6-bit values into the alphabet. */
+    idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+    idx = _mm_sub_epi8(idx, mask);
+    in = _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+    _mm_storeu_si128((__m128i *) (dst + i / 3 * 4), in);
+  }
+  return i;
+}
+
+/*
+ * SSSE3 decoder: 16 input chars -> 12 output bytes per iteration.
+ * Stops at the first block that contains anything but the 64 alphabet
+ * characters (padding included), leaving it to the scalar code, which then
+ * produces exactly the same result as if it had run on its own.
+ * Returns number of chars consumed.
+ */
+__attribute__((target("ssse3"))) static int cs_base64_decode_ssse3(
+    const unsigned char *s, int len, char *dst) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B,
+                                       0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04,
+                                       0x08, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                       0x10, 0x10, 0x10);
+  const __m128i lut_roll =
+      _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                     -1, -1, -1, -1);
+  int i;
+  for (i = 0; len - i >= 16; i += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i roll, out;
+    char *d = dst + i / 4 * 3;
+    int tail;
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128())) != 0) {
+      break;
+    }
+    roll = _mm_shuffle_epi8(
+        lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+    in = _mm_add_epi8(in, roll);
+    /* Pack 4 6-bit values into 3 bytes. */
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(in, pack);
+    /* Store exactly 12 bytes, dst is not guaranteed to have more room. */
+    _mm_storel_epi64((__m128i *) d, out);
+    tail = _mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+    memcpy(d + 8, &tail, 4);
+  }
+  return i;
+}
+#endif /* CS_ENABLE_X86_ACCEL */
+
 void cs_base64_encode(const unsigned char *src, int src_len, char *dst) {
-  BASE64_ENCODE_BODY;
+#if CS_ENABLE_X86_ACCEL
+  if (cs_cpu_features() & CS_CPU_SSSE3) {
+    int n = cs_base64_encode_ssse3(src, src_len, dst);
+    src += n;
+    src_len -= n;
+    dst += n / 3 * 4;
+  }
+#endif
+  {
+    BASE64_ENCODE_BODY;
+  }
 }
 
 #undef BASE64_OUT
@@ -385,6 +619,14 @@ int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len) {
   unsigned char a, b, c, d;
   int orig_len = len;
   char *orig_dst = dst;
+#if CS_ENABLE_X86_ACCEL
+  if (cs_cpu_features() & CS_CPU_SSSE3) {
+    int n = cs_base64_decode_ssse3(s, len, dst);
+    s += n;
+    len -= n;
+    dst += n / 4 * 3;
+  }
+#endif
   while (len >= 4 && (a = from_b64(s[0])) != 255 &&
          (b = from_b64(s[1])) != 255 && (c = from_b64(s[2])) != 255 &&
          (d = from_b64(s[3])) != 255) {
@@ -404,6 +646,251 @@ int cs_base64_decode(const unsigned char *s, int len, char *dst, int *dec_len) {
 
 #endif /* EXCLUDE_COMMON */
 #ifdef MG_MODULE_LINES
+#line 1 "common/cs_gzip.c"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/* Amalgamated: #include "common/cs_gzip.h" */
+
+#if !CS_DISABLE_GZIP && !defined(EXCLUDE_COMMON)
+
+#define CS_GZIP_MIN_MATCH 3
+#define CS_GZIP_MAX_MATCH 258
+#define CS_GZIP_MASK (CS_GZIP_WINDOW_SIZE - 1)
+
+static const uint16_t s_gzip_len_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char s_gzip_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_gzip_dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char s_gzip_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static uint32_t cs_gzip_crc32(uint32_t crc, const unsigned char *p,
+                              size_t len) {
+  /* Nibble at a time, to keep the table small */
+  static const uint32_t t[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+      0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  crc = ~crc;
+  while (len-- > 0) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ t[crc & 15];
+    crc = (crc >> 4) ^ t[crc & 15];
+  }
+  return ~crc;
+}
+
+/* Bits go out least significant first, RFC 1951 3.1.1 */
+static void cs_gzip_put_bits(cs_gzip_ctx *ctx, uint32_t v, int n,
+                             struct mbuf *out) {
+  ctx->bits |= v << ctx->num_bits;
+  ctx->num_bits += n;
+  while (ctx->num_bits >= 8) {
+    char c = (char) (ctx->bits & 0xff);
+    mbuf_append(out, &c, 1);
+    ctx->bits >>= 8;
+    ctx->num_bits -= 8;
+  }
+}
+
+/* Huffman codes go out most significant bit first. */
+static void cs_gzip_put_code(cs_gzip_ctx *ctx, uint32_t code, int n,
+                             struct mbuf *out) {
+  uint32_t rev = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    rev = (rev << 1) | ((code >> i) & 1);
+  }
+  cs_gzip_put_bits(ctx, rev, n, out);
+}
+
+/* Literal/length symbol, with the fixed code of RFC 1951 3.2.6 */
+static void cs_gzip_put_sym(cs_gzip_ctx *ctx, int sym, struct mbuf *out) {
+  if (!ctx->in_block) {
+    /* BFINAL = 0, BTYPE = 01 */
+    cs_gzip_put_bits(ctx, 2, 3, out);
+    ctx->in_block = 1;
+  }
+  if (sym < 144) {
+    cs_gzip_put_code(ctx, 0x30 + sym, 8, out);
+  } else if (sym < 256) {
+    cs_gzip_put_code(ctx, 0x190 + sym - 144, 9, out);
+  } else if (sym < 280) {
+    cs_gzip_put_code(ctx, sym - 256, 7, out);
+  } else {
+    cs_gzip_put_code(ctx, 0xc0 + sym - 280, 8, out);
+  }
+}
+
+static void cs_gzip_put_match(cs_gzip_ctx *ctx, size_t len, size_t dist,
+                              struct mbuf *out) {
+  int i;
+  for (i = 28; s_gzip_len_base[i] > len; i--) {
+  }
+  cs_gzip_put_sym(ctx, 257 + i, out);
+  cs_gzip_put_bits(ctx, len - s_gzip_len_base[i], s_gzip_len_extra[i], out);
+  for (i = 29; s_gzip_dist_base[i] > dist; i--) {
+  }
+  cs_gzip_put_code(ctx, i, 5, out);
+  cs_gzip_put_bits(ctx, dist - s_gzip_dist_base[i], s_gzip_dist_extra[i], out);
+}
+
+static void cs_gzip_put_u32(uint32_t v, struct mbuf *out) {
+  unsigned char buf[4];
+  buf[0] = (unsigned char) v;
+  buf[1] = (unsigned char) (v >> 8);
+  buf[2] = (unsigned char) (v >> 16);
+  buf[3] = (unsigned char) (v >> 24);
+  mbuf_append(out, buf, sizeof(buf));
+}
+
+static void cs_gzip_start(cs_gzip_ctx *ctx, struct mbuf *out) {
+  /* No name, no mtime, unknown OS */
+  static const unsigned char hdr[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  if (!ctx->started) {
+    mbuf_append(out, hdr, sizeof(hdr));
+    ctx->started = 1;
+  }
+}
+
+static size_t cs_gzip_hash(const unsigned char *p) {
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & CS_GZIP_MASK;
+}
+
+static void cs_gzip_insert(cs_gzip_ctx *ctx, size_t pos) {
+  size_t h = cs_gzip_hash(ctx->window + pos);
+  ctx->prev[pos & CS_GZIP_MASK] = ctx->head[h];
+  ctx->head[h] = (uint16_t) (pos + 1);
+}
+
+/* Finds the longest match for the current position, returns its length. */
+static size_t cs_gzip_find_match(cs_gzip_ctx *ctx, size_t *dist) {
+  const unsigned char *s = ctx->window + ctx->pos;
+  size_t max = ctx->len - ctx->pos, best = 0, n, cand;
+  int chain = CS_GZIP_MAX_CHAIN;
+  if (max > CS_GZIP_MAX_MATCH) max = CS_GZIP_MAX_MATCH;
+  cand = ctx->head[cs_gzip_hash(s)];
+  /* Positions are off by one, so that 0 means none */
+  while (cand > 0 && cand - 1 < ctx->pos &&
+         ctx->pos - (cand - 1) < CS_GZIP_WINDOW_SIZE && chain-- > 0) {
+    const unsigned char *m = ctx->window + cand - 1;
+    if (m[best] == s[best]) {
+      for (n = 0; n < max && m[n] == s[n]; n++) {
+      }
+      if (n > best) {
+        best = n;
+        *dist = ctx->pos - (cand - 1);
+        if (n == max) break;
+      }
+    }
+    cand = ctx->prev[(cand - 1) & CS_GZIP_MASK];
+  }
+  return best;
+}
+
+/* Compresses the buffered input, up to `end`. */
+static void cs_gzip_deflate(cs_gzip_ctx *ctx, size_t end, struct mbuf *out) {
+  size_t len, dist = 0;
+  while (ctx->pos < end) {
+    if (ctx->len - ctx->pos < CS_GZIP_MIN_MATCH) {
+      cs_gzip_put_sym(ctx, ctx->window[ctx->pos++], out);
+      continue;
+    }
+    len = cs_gzip_find_match(ctx, &dist);
+    if (len < CS_GZIP_MIN_MATCH) {
+      cs_gzip_insert(ctx, ctx->pos);
+      cs_gzip_put_sym(ctx, ctx->window[ctx->pos++], out);
+      continue;
+    }
+    cs_gzip_put_match(ctx, len, dist, out);
+    while (len-- > 0) {
+      if (ctx->len - ctx->pos >= CS_GZIP_MIN_MATCH) {
+        cs_gzip_insert(ctx, ctx->pos);
+      }
+      ctx->pos++;
+    }
+  }
+}
+
+/* Drops the older half of the window. */
+static void cs_gzip_slide(cs_gzip_ctx *ctx) {
+  size_t i;
+  memmove(ctx->window, ctx->window + CS_GZIP_WINDOW_SIZE,
+          ctx->len - CS_GZIP_WINDOW_SIZE);
+  ctx->len -= CS_GZIP_WINDOW_SIZE;
+  ctx->pos -= CS_GZIP_WINDOW_SIZE;
+  for (i = 0; i < CS_GZIP_WINDOW_SIZE; i++) {
+    ctx->head[i] = (ctx->head[i] > CS_GZIP_WINDOW_SIZE
+                        ? ctx->head[i] - CS_GZIP_WINDOW_SIZE
+                        : 0);
+    ctx->prev[i] = (ctx->prev[i] > CS_GZIP_WINDOW_SIZE
+                        ? ctx->prev[i] - CS_GZIP_WINDOW_SIZE
+                        : 0);
+  }
+}
+
+void cs_gzip_init(cs_gzip_ctx *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void cs_gzip_update(cs_gzip_ctx *ctx, const void *data, size_t len, int flush,
+                    struct mbuf *out) {
+  const unsigned char *p = (const unsigned char *) data;
+  size_t n;
+  cs_gzip_start(ctx, out);
+  ctx->crc = cs_gzip_crc32(ctx->crc, p, len);
+  ctx->size += (uint32_t) len;
+  while (len > 0) {
+    if (ctx->len == sizeof(ctx->window)) cs_gzip_slide(ctx);
+    n = sizeof(ctx->window) - ctx->len;
+    if (n > len) n = len;
+    memcpy(ctx->window + ctx->len, p, n);
+    ctx->len += n;
+    p += n;
+    len -= n;
+    /* Keep enough lookahead for the longest match */
+    if (ctx->len > CS_GZIP_MAX_MATCH) {
+      cs_gzip_deflate(ctx, ctx->len - CS_GZIP_MAX_MATCH, out);
+    }
+  }
+  if (flush) {
+    cs_gzip_deflate(ctx, ctx->len, out);
+    if (ctx->in_block) {
+      /* End of block, then an empty stored block to get byte-aligned */
+      cs_gzip_put_sym(ctx, 256, out);
+      ctx->in_block = 0;
+      cs_gzip_put_bits(ctx, 0, 3, out);
+      if (ctx->num_bits > 0) cs_gzip_put_bits(ctx, 0, 8 - ctx->num_bits, out);
+      mbuf_append(out, "\x00\x00\xff\xff", 4);
+    }
+  }
+}
+
+void cs_gzip_finish(cs_gzip_ctx *ctx, struct mbuf *out) {
+  cs_gzip_start(ctx, out);
+  cs_gzip_deflate(ctx, ctx->len, out);
+  if (ctx->in_block) cs_gzip_put_sym(ctx, 256, out);
+  /* Empty final block */
+  cs_gzip_put_bits(ctx, 3, 3, out);
+  cs_gzip_put_code(ctx, 0, 7, out);
+  if (ctx->num_bits > 0) cs_gzip_put_bits(ctx, 0, 8 - ctx->num_bits, out);
+  cs_gzip_put_u32(ctx->crc, out);
+  cs_gzip_put_u32(ctx->size, out);
+}
+
+#endif /* !CS_DISABLE_GZIP && !EXCLUDE_COMMON */
+#ifdef MG_MODULE_LINES
 #line 1 "common/cs_dbg.h"
 #endif
 /*
@@ -1149,6 +1636,26 @@ void cs_md5_final(unsigned char digest[16], cs_md5_ctx *ctx) {
 
 #if !CS_DISABLE_SHA1 && !defined(EXCLUDE_COMMON)
 
+#if CS_ENABLE_SHA1_MBEDTLS
+
+void cs_sha1_init(cs_sha1_ctx *context) {
+  mbedtls_sha1_init(&context->mbedtls);
+  mbedtls_sha1_starts(&context->mbedtls);
+}
+
+void cs_sha1_update(cs_sha1_ctx *context, const unsigned char *data,
+                    uint32_t len) {
+  mbedtls_sha1_update(&context->mbedtls, data, len);
+}
+
+void cs_sha1_final(unsigned char digest[20], cs_sha1_ctx *context) {
+  mbedtls_sha1_finish(&context->mbedtls, digest);
+  mbedtls_sha1_free(&context->mbedtls);
+}
+
+#else /* !CS_ENABLE_SHA1_MBEDTLS */
+
+/* Amalgamated: #include "common/cs_accel.h" */
 /* Amalgamated: #include "common/cs_endian.h" */
 
 #define SHA1HANDSOFF
@@ -1200,7 +1707,8 @@ static uint32_t blk0(union char64long16 *block, int i) {
   z += (w ^ x ^ y) + blk(i) + 0xCA62C1D6 + rol(v, 5); \
   w = rol(w, 30);
 
-void cs_sha1_transform(uint32_t state[5], const unsigned char buffer[64]) {
+static void cs_sha1_transform_c(uint32_t state[5],
+                                const unsigned char buffer[64]) {
   uint32_t a, b, c, d, e;
   union char64long16 block[1];
 
@@ -1306,6 +1814,94 @@ void cs_sha1_transform(uint32_t state[5], const unsigned char buffer[64]) {
   (void) e;
 }
 
+#if CS_ENABLE_X86_ACCEL
+/*
+ * One group of 4 SHA-NI rounds. Message words live in m[g % 4]: m[g] is
+ * consumed by group g and the schedule for groups g + 1..g + 3 is advanced
+ * in the same step. `e` alternates between two registers, `e_next` receives
+ * the rotated copy of ABCD for the next group.
+ */
+#define CS_SHA1_NI_M(k) m[(k) % 4]
+#define CS_SHA1_NI_GROUP(g, e, e_next)                                      \
+  do {                                                                      \
+    if ((g) == 0) {                                                         \
+      e = _mm_add_epi32(e, CS_SHA1_NI_M(g));                                \
+    } else {                                                                \
+      e = _mm_sha1nexte_epu32(e, CS_SHA1_NI_M(g));                          \
+    }                                                                       \
+    e_next = abcd;                                                          \
+    if ((g) >= 3 && (g) <= 18) {                                            \
+      CS_SHA1_NI_M(g + 1) =                                                 \
+          _mm_sha1msg2_epu32(CS_SHA1_NI_M(g + 1), CS_SHA1_NI_M(g));         \
+    }                                                                       \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5);                           \
+    if ((g) >= 1 && (g) <= 16) {                                            \
+      CS_SHA1_NI_M(g + 3) =                                                 \
+          _mm_sha1msg1_epu32(CS_SHA1_NI_M(g + 3), CS_SHA1_NI_M(g));         \
+    }                                                                       \
+    if ((g) >= 2 && (g) <= 17) {                                            \
+      CS_SHA1_NI_M(g + 2) =                                                 \
+          _mm_xor_si128(CS_SHA1_NI_M(g + 2), CS_SHA1_NI_M(g));              \
+    }                                                                       \
+  } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3"))) static void cs_sha1_transform_ni(
+    uint32_t state[5], const unsigned char buffer[64]) {
+  const __m128i bswap =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1, m[4];
+  int i;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+  e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+  abcd_save = abcd;
+  e0_save = e0;
+  for (i = 0; i < 4; i++) {
+    m[i] = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *) (buffer + i * 16)), bswap);
+  }
+
+  CS_SHA1_NI_GROUP(0, e0, e1);
+  CS_SHA1_NI_GROUP(1, e1, e0);
+  CS_SHA1_NI_GROUP(2, e0, e1);
+  CS_SHA1_NI_GROUP(3, e1, e0);
+  CS_SHA1_NI_GROUP(4, e0, e1);
+  CS_SHA1_NI_GROUP(5, e1, e0);
+  CS_SHA1_NI_GROUP(6, e0, e1);
+  CS_SHA1_NI_GROUP(7, e1, e0);
+  CS_SHA1_NI_GROUP(8, e0, e1);
+  CS_SHA1_NI_GROUP(9, e1, e0);
+  CS_SHA1_NI_GROUP(10, e0, e1);
+  CS_SHA1_NI_GROUP(11, e1, e0);
+  CS_SHA1_NI_GROUP(12, e0, e1);
+  CS_SHA1_NI_GROUP(13, e1, e0);
+  CS_SHA1_NI_GROUP(14, e0, e1);
+  CS_SHA1_NI_GROUP(15, e1, e0);
+  CS_SHA1_NI_GROUP(16, e0, e1);
+  CS_SHA1_NI_GROUP(17, e1, e0);
+  CS_SHA1_NI_GROUP(18, e0, e1);
+  CS_SHA1_NI_GROUP(19, e1, e0);
+
+  e0 = _mm_sha1nexte_epu32(e0, e0_save);
+  abcd = _mm_add_epi32(abcd, abcd_save);
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+#undef CS_SHA1_NI_GROUP
+#undef CS_SHA1_NI_M
+#endif /* CS_ENABLE_X86_ACCEL */
+
+void cs_sha1_transform(uint32_t state[5], const unsigned char buffer[64]) {
+#if CS_ENABLE_X86_ACCEL
+  if ((cs_cpu_features() & (CS_CPU_SHA | CS_CPU_SSE41 | CS_CPU_SSSE3)) ==
+      (CS_CPU_SHA | CS_CPU_SSE41 | CS_CPU_SSSE3)) {
+    cs_sha1_transform_ni(state, buffer);
+    return;
+  }
+#endif
+  cs_sha1_transform_c(state, buffer);
+}
+
 void cs_sha1_init(cs_sha1_ctx *context) {
   context->state[0] = 0x67452301;
   context->state[1] = 0xEFCDAB89;
@@ -1359,6 +1955,8 @@ void cs_sha1_final(unsigned char digest[20], cs_sha1_ctx *context) {
   memset(&finalcount, '\0', sizeof(finalcount));
 }
 
+#endif /* CS_ENABLE_SHA1_MBEDTLS */
+
 void cs_hmac_sha1(const unsigned char *key, size_t keylen,
                   const unsigned char *data, size_t datalen,
                   unsigned char out[20]) {
@@ -1406,6 +2004,8 @@ void cs_hmac_sha1(const unsigned char *key, size_t keylen,
 #ifndef EXCLUDE_COMMON
 
 #include <assert.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
 /* Amalgamated: #include "common/mbuf.h" */
 
@@ -1498,6 +2098,161 @@ void mbuf_remove(struct mbuf *mb, size_t n) {
   }
 }
 
+#ifndef MBUF_PRINTF_MIN_SPARE
+#define MBUF_PRINTF_MIN_SPARE 64
+#endif
+
+/*
+ * Formats an int into the end of `buf` (which must hold at least 11 chars).
+ * Returns a pointer to the first digit.
+ */
+static char *mbuf_fmt_int(char *end, int v) {
+  unsigned int u = (v < 0 ? 0U - (unsigned int) v : (unsigned int) v);
+  do {
+    *--end = (char) ('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  if (v < 0) *--end = '-';
+  return end;
+}
+
+/*
+ * Walks a format string that only uses %d, %s, %.*s and %%. If `dst` is
+ * NULL, only computes the output length. Returns -1 if `fmt` uses anything
+ * else; in that case no arguments have been consumed from `ap` when `dst` is
+ * NULL.
+ */
+static int mbuf_simple_vprintf(char *dst, const char *fmt, va_list ap) {
+  const char *p;
+  size_t n = 0;
+  if (dst == NULL) {
+    /* Validate first, so that we don't consume arguments in vain. */
+    for (p = fmt; *p != '\0'; p++) {
+      if (*p != '%') continue;
+      if (p[1] == 'd' || p[1] == 's' || p[1] == '%') {
+        p++;
+      } else if (p[1] == '.' && p[2] == '*' && p[3] == 's') {
+        p += 3;
+      } else {
+        return -1;
+      }
+    }
+  }
+  for (p = fmt; *p != '\0'; p++) {
+    const char *s;
+    size_t len;
+    char num[12];
+    if (*p != '%') {
+      const char *q = p;
+      while (q[1] != '\0' && q[1] != '%') q++;
+      s = p;
+      len = q - p + 1;
+      p = q;
+    } else if (p[1] == '%') {
+      s = p++;
+      len = 1;
+    } else if (p[1] == 'd') {
+      s = mbuf_fmt_int(num + sizeof(num), va_arg(ap, int));
+      len = num + sizeof(num) - s;
+      p++;
+    } else {
+      int prec = -1;
+      if (p[1] == '.') {
+        prec = va_arg(ap, int);
+        p += 2;
+      }
+      p++;
+      if ((s = va_arg(ap, const char *)) == NULL) s = "(null)";
+      if (prec < 0) {
+        len = strlen(s);
+      } else {
+        for (len = 0; len < (size_t) prec && s[len] != '\0'; len++) {
+        }
+      }
+    }
+    if (dst != NULL) memcpy(dst + n, s, len);
+    n += len;
+    if (n > INT_MAX) return -1;
+  }
+  return (int) n;
+}
+
+/*
+ * Makes sure there are at least `n` spare bytes, growing the buffer the same
+ * way `mbuf_insert()` does. Returns the number of spare bytes.
+ */
+static size_t mbuf_reserve(struct mbuf *mb, size_t n) {
+  if (mb->size - mb->len < n) {
+    mbuf_resize(mb, (size_t)((mb->len + n) * MBUF_SIZE_MULTIPLIER));
+    if (mb->size - mb->len < n) mbuf_resize(mb, mb->len + n);
+  }
+  return mb->size - mb->len;
+}
+
+int mbuf_vprintf(struct mbuf *mb, const char *fmt, va_list ap) WEAK;
+int mbuf_vprintf(struct mbuf *mb, const char *fmt, va_list ap) {
+  va_list ap_copy;
+  size_t avail;
+  int n;
+
+  va_copy(ap_copy, ap);
+  n = mbuf_simple_vprintf(NULL, fmt, ap_copy);
+  va_end(ap_copy);
+  if (n >= 0) {
+    if (mbuf_reserve(mb, n) < (size_t) n) return -1;
+    va_copy(ap_copy, ap);
+    mbuf_simple_vprintf(mb->buf + mb->len, fmt, ap_copy);
+    va_end(ap_copy);
+    mb->len += n;
+    return n;
+  }
+
+  /* Generic format: let vsnprintf() write straight into the spare space. */
+  mbuf_reserve(mb, MBUF_PRINTF_MIN_SPARE);
+  for (;;) {
+    avail = mb->size - mb->len;
+    if (avail == 0) return -1;
+    va_copy(ap_copy, ap);
+    n = vsnprintf(mb->buf + mb->len, avail, fmt, ap_copy);
+    va_end(ap_copy);
+    if (n >= 0 && (size_t) n < avail) break;
+    /*
+     * Output didn't fit. Standard vsnprintf() tells us the size, so grow once.
+     * Non-compliant ones (eCos, Windows) return -1, keep doubling for them.
+     */
+    if (mbuf_reserve(mb, n >= 0 ? (size_t) n + 1 : avail * 2) <= avail) {
+      return -1;
+    }
+  }
+  mb->len += n;
+  return n;
+}
+
+int mbuf_vprintf_len(const char *fmt, va_list ap) WEAK;
+int mbuf_vprintf_len(const char *fmt, va_list ap) {
+  va_list ap_copy;
+  int n;
+  va_copy(ap_copy, ap);
+  n = mbuf_simple_vprintf(NULL, fmt, ap_copy);
+  va_end(ap_copy);
+  if (n < 0) {
+    va_copy(ap_copy, ap);
+    n = vsnprintf(NULL, 0, fmt, ap_copy);
+    va_end(ap_copy);
+  }
+  return n;
+}
+
+int mbuf_printf(struct mbuf *mb, const char *fmt, ...) WEAK;
+int mbuf_printf(struct mbuf *mb, const char *fmt, ...) {
+  int len;
+  va_list ap;
+  va_start(ap, fmt);
+  len = mbuf_vprintf(mb, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
 #endif /* EXCLUDE_COMMON */
 #ifdef MG_MODULE_LINES
 #line 1 "common/mg_str.c"
@@ -2166,6 +2921,9 @@ size_t mg_match_prefix(const char *pattern, int pattern_len, const char *str) {
  * license, as set out in <https://www.cesanta.com/license>.
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_CONN
+
 /* Amalgamated: #include "common/cs_time.h" */
 /* Amalgamated: #include "mg_dns.h" */
 /* Amalgamated: #include "mg_internal.h" */
@@ -2180,17 +2938,52 @@ size_t mg_match_prefix(const char *pattern, int pattern_len, const char *str) {
 /* Which flags can be pre-set by the user at connection creation time. */
 #define _MG_ALLOWED_CONNECT_FLAGS_MASK                                   \
   (MG_F_USER_1 | MG_F_USER_2 | MG_F_USER_3 | MG_F_USER_4 | MG_F_USER_5 | \
-   MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_ENABLE_BROADCAST)
+   MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_ENABLE_BROADCAST |      \
+   MG_F_RECV_VIEW | MG_F_WRITE_THROUGH | MG_F_MIGRATABLE)
 /* Which flags should be modifiable by user's callbacks. */
 #define _MG_CALLBACK_MODIFIABLE_FLAGS_MASK                               \
   (MG_F_USER_1 | MG_F_USER_2 | MG_F_USER_3 | MG_F_USER_4 | MG_F_USER_5 | \
    MG_F_USER_6 | MG_F_WEBSOCKET_NO_DEFRAG | MG_F_SEND_AND_CLOSE |        \
-   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK)
+   MG_F_CLOSE_IMMEDIATELY | MG_F_IS_WEBSOCKET | MG_F_DELETE_CHUNK |      \
+   MG_F_RECV_VIEW | MG_F_WRITE_THROUGH | MG_F_MIGRATABLE)
 
 #ifndef intptr_t
 #define intptr_t long
 #endif
 
+#if MG_ENABLE_CONN_TABLE
+static void mg_conn_table_add(struct mg_mgr *mgr, struct mg_connection *c) {
+  if (mgr->conn_table_size < 0) return;
+  if (mgr->conn_table_len == mgr->conn_table_size) {
+    int size = mgr->conn_table_size == 0 ? 16 : mgr->conn_table_size * 2;
+    struct mg_connection **table = (struct mg_connection **) MG_REALLOC(
+        mgr->conn_table, size * sizeof(*table));
+    if (table == NULL) {
+      /* Poll loops fall back to the list from now on */
+      DBG(("%p OOM, dropping the connection table", mgr));
+      MG_FREE(mgr->conn_table);
+      mgr->conn_table = NULL;
+      mgr->conn_table_len = 0;
+      mgr->conn_table_size = -1;
+      return;
+    }
+    mgr->conn_table = table;
+    mgr->conn_table_size = size;
+  }
+  c->id = mgr->conn_table_len++;
+  mgr->conn_table[c->id] = c;
+}
+
+static void mg_conn_table_remove(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  struct mg_connection *last;
+  if (mgr->conn_table == NULL) return;
+  last = mgr->conn_table[--mgr->conn_table_len];
+  mgr->conn_table[c->id] = last;
+  last->id = c->id;
+}
+#endif
+
 MG_INTERNAL void mg_add_conn(struct mg_mgr *mgr, struct mg_connection *c) {
   DBG(("%p %p", mgr, c));
   c->mgr = mgr;
@@ -2201,28 +2994,111 @@ MG_INTERNAL void mg_add_conn(struct mg_mgr *mgr, struct mg_connection *c) {
   if (c->sock != INVALID_SOCKET) {
     c->iface->vtable->add_conn(c);
   }
+#if MG_ENABLE_CONN_MIGRATION
+  __atomic_fetch_add(&mgr->num_conns, 1, __ATOMIC_RELAXED);
+#endif
+#if MG_ENABLE_CONN_TABLE
+  mg_conn_table_add(mgr, c);
+#endif
 }
 
-MG_INTERNAL void mg_remove_conn(struct mg_connection *conn) {
-  if (conn->prev == NULL) conn->mgr->active_connections = conn->next;
-  if (conn->prev) conn->prev->next = conn->next;
-  if (conn->next) conn->next->prev = conn->prev;
-  conn->prev = conn->next = NULL;
-  conn->iface->vtable->remove_conn(conn);
+/*
+ * Connections flagged with MG_F_CLOSE_IMMEDIATELY or MG_F_SEND_AND_CLOSE are
+ * kept on mg_mgr::closing, so that polls can close them without walking all
+ * of the connections, see mg_close_flagged(). mg_call() adds the connection
+ * it dispatched to; code that flags some other connection must add it too.
+ * Applications may still flag any connection directly, so interfaces also
+ * check the flags when they walk their connections to wait for I/O.
+ */
+MG_INTERNAL void mg_mark_closing(struct mg_connection *nc) {
+  if (nc->closing_link.le_prev == NULL) {
+    LIST_INSERT_HEAD(&nc->mgr->closing, nc, closing_link);
+  }
 }
 
-MG_INTERNAL void mg_call(struct mg_connection *nc,
-                         mg_event_handler_t ev_handler, void *user_data, int ev,
-                         void *ev_data) {
-  static int nesting_level = 0;
-  nesting_level++;
-  if (ev_handler == NULL) {
+static void mg_unmark_closing(struct mg_connection *nc) {
+  if (nc->closing_link.le_prev != NULL) {
+    LIST_REMOVE(nc, closing_link);
+    nc->closing_link.le_prev = NULL;
+  }
+}
+
+/*
+ * Connections that may have data to send are kept on mg_mgr::writing, see
+ * mg_send() and mg_call(). Interfaces take them off once the send buffer
+ * is empty.
+ */
+MG_INTERNAL void mg_mark_writing(struct mg_connection *nc) {
+  if (nc->writing_link.le_prev == NULL) {
+    LIST_INSERT_HEAD(&nc->mgr->writing, nc, writing_link);
+  }
+}
+
+MG_INTERNAL void mg_unmark_writing(struct mg_connection *nc) {
+  if (nc->writing_link.le_prev != NULL) {
+    LIST_REMOVE(nc, writing_link);
+    nc->writing_link.le_prev = NULL;
+  }
+}
+
+/*
+ * Connections whose interface state may need updating are kept on
+ * mg_mgr::work: those with I/O completions, new connections and those with
+ * a new timer. Completion-based interfaces (io_uring) look at this list and
+ * mg_mgr::writing instead of every connection before they wait.
+ */
+MG_INTERNAL void mg_mark_work(struct mg_connection *nc) {
+  if (nc->work_link.le_prev == NULL) {
+    LIST_INSERT_HEAD(&nc->mgr->work, nc, work_link);
+  }
+}
+
+MG_INTERNAL void mg_unmark_work(struct mg_connection *nc) {
+  if (nc->work_link.le_prev != NULL) {
+    LIST_REMOVE(nc, work_link);
+    nc->work_link.le_prev = NULL;
+  }
+}
+
+MG_INTERNAL void mg_remove_conn(struct mg_connection *conn) {
+  if (conn->prev == NULL) conn->mgr->active_connections = conn->next;
+  if (conn->prev) conn->prev->next = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+  conn->prev = conn->next = NULL;
+  mg_unmark_closing(conn);
+  mg_unmark_writing(conn);
+  mg_unmark_work(conn);
+#if MG_ENABLE_CONN_TABLE
+  mg_conn_table_remove(conn);
+#endif
+  conn->iface->vtable->remove_conn(conn);
+#if MG_ENABLE_CONN_MIGRATION
+  if (conn->migrate_to != NULL) mg_migrate_cancel(conn);
+  __atomic_fetch_sub(&conn->mgr->num_conns, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static int mg_ev_wanted(unsigned int mask, int ev) {
+  return ev < MG_EV_POLL || ev > MG_EV_TIMER || (mask & MG_EV_MASK(ev));
+}
+
+MG_INTERNAL void mg_call(struct mg_connection *nc,
+                         mg_event_handler_t ev_handler, void *user_data, int ev,
+                         void *ev_data) {
+  struct mg_mgr *mgr = nc->mgr;
+  if (ev_handler == NULL) {
     /*
      * If protocol handler is specified, call it. Otherwise, call user-specified
-     * event handler.
+     * event handler. Events the protocol handler has opted out of would only
+     * be passed on by it, so they go to the user handler directly.
      */
-    ev_handler = nc->proto_handler ? nc->proto_handler : nc->handler;
+    ev_handler = nc->proto_handler;
+    if (ev_handler == NULL || !mg_ev_wanted(nc->proto_ev_mask, ev)) {
+      ev_handler = nc->handler;
+    }
   }
+  if (ev_handler == nc->handler && !mg_ev_wanted(nc->ev_mask, ev)) return;
+  mgr->call_depth++;
   if (ev != MG_EV_POLL) {
     DBG(("%p %s ev=%d ev_data=%p flags=%lu rmbl=%d smbl=%d", nc,
          ev_handler == nc->handler ? "user" : "proto", ev, ev_data, nc->flags,
@@ -2237,9 +3113,11 @@ MG_INTERNAL void mg_call(struct mg_connection *nc,
 #endif
   if (ev_handler != NULL) {
     unsigned long flags_before = nc->flags;
-    size_t recv_mbuf_before = nc->recv_mbuf.len, recved;
+    size_t recv_mbuf_before = nc->recv_mbuf.len, recved = 0;
     ev_handler(nc, ev, ev_data MG_UD_ARG(user_data));
-    recved = (recv_mbuf_before - nc->recv_mbuf.len);
+    if (nc->recv_mbuf.len < recv_mbuf_before) {
+      recved = (recv_mbuf_before - nc->recv_mbuf.len);
+    }
     /* Prevent user handler from fiddling with system flags. */
     if (ev_handler == nc->handler && nc->flags != flags_before) {
       nc->flags = (flags_before & ~_MG_CALLBACK_MODIFIABLE_FLAGS_MASK) |
@@ -2247,17 +3125,24 @@ MG_INTERNAL void mg_call(struct mg_connection *nc,
     }
     /* It's important to not double-count recved bytes, and since mg_call can be
      * called recursively (e.g. proto_handler invokes user handler), we keep
-     * track of recursion and only report received bytes at the top level. */
-    if (nesting_level == 1 && recved > 0 && !(nc->flags & MG_F_UDP)) {
+     * track of recursion and only report received bytes at the top level.
+     * In receive view mode, data is acknowledged by mg_recv_consume(). */
+    if (mgr->call_depth == 1 && recved > 0 &&
+        !(nc->flags & (MG_F_UDP | MG_F_RECV_VIEW))) {
       nc->iface->vtable->recved(nc, recved);
     }
+    if ((nc->flags & MG_F_CLOSING_MASK) && ev != MG_EV_CLOSE) {
+      mg_mark_closing(nc);
+    }
+    /* Handlers may have appended to send_mbuf directly */
+    if (nc->send_mbuf.len > 0 && ev != MG_EV_CLOSE) mg_mark_writing(nc);
   }
   if (ev != MG_EV_POLL) {
     DBG(("%p after %s flags=%lu rmbl=%d smbl=%d", nc,
          ev_handler == nc->handler ? "user" : "proto", nc->flags,
          (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
   }
-  nesting_level--;
+  mgr->call_depth--;
 #if !MG_ENABLE_CALLBACK_USERDATA
   (void) user_data;
 #endif
@@ -2278,6 +3163,9 @@ void mg_if_poll(struct mg_connection *nc, time_t now) {
 }
 
 void mg_destroy_conn(struct mg_connection *conn, int destroy_if) {
+  mg_unmark_closing(conn);
+  mg_unmark_writing(conn);
+  mg_unmark_work(conn);
   if (destroy_if) conn->iface->vtable->destroy_conn(conn);
   if (conn->proto_data != NULL && conn->proto_data_destructor != NULL) {
     conn->proto_data_destructor(conn->proto_data);
@@ -2305,12 +3193,33 @@ void mg_close_conn(struct mg_connection *conn) {
   mg_destroy_conn(conn, 0 /* destroy_if */);
 }
 
+/*
+ * Closes the connections of `iface` on the closing list that are due: those
+ * with MG_F_CLOSE_IMMEDIATELY, and those with MG_F_SEND_AND_CLOSE that have
+ * nothing left to send.
+ */
+MG_INTERNAL void mg_close_flagged(struct mg_iface *iface) {
+  struct mg_connection *nc, *tmp;
+  for (nc = LIST_FIRST(&iface->mgr->closing); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, closing_link);
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if ((nc->flags & MG_F_CLOSE_IMMEDIATELY) ||
+        (nc->send_mbuf.len == 0 && (nc->flags & MG_F_SEND_AND_CLOSE))) {
+      mg_close_conn(nc);
+    }
+  }
+}
+
 void mg_mgr_init(struct mg_mgr *m, void *user_data) {
   struct mg_mgr_init_opts opts;
   memset(&opts, 0, sizeof(opts));
   mg_mgr_init_opt(m, user_data, opts);
 }
 
+#if MG_ENABLE_LISTENER_HANDOFF
+static int s_handoff_env_taken;
+#endif
+
 void mg_mgr_init_opt(struct mg_mgr *m, void *user_data,
                      struct mg_mgr_init_opts opts) {
   memset(m, 0, sizeof(*m));
@@ -2318,6 +3227,11 @@ void mg_mgr_init_opt(struct mg_mgr *m, void *user_data,
   m->ctl[0] = m->ctl[1] = INVALID_SOCKET;
 #endif
   m->user_data = user_data;
+#if MG_ENABLE_CONN_PRIORITY
+  m->prio[MG_PRIO_INTERACTIVE].weight = 8;
+  m->prio[MG_PRIO_NORMAL].weight = 4;
+  m->prio[MG_PRIO_BULK].weight = 1;
+#endif
 
 #ifdef _WIN32
   {
@@ -2351,7 +3265,7 @@ void mg_mgr_init_opt(struct mg_mgr *m, void *user_data,
     m->num_ifaces = opts.num_ifaces;
     m->ifaces =
         (struct mg_iface **) MG_MALLOC(sizeof(*m->ifaces) * opts.num_ifaces);
-    for (i = 0; i < mg_num_ifaces; i++) {
+    for (i = 0; i < opts.num_ifaces; i++) {
       m->ifaces[i] = mg_if_create_iface(opts.ifaces[i], m);
       m->ifaces[i]->vtable->init(m->ifaces[i]);
     }
@@ -2359,6 +3273,25 @@ void mg_mgr_init_opt(struct mg_mgr *m, void *user_data,
   if (opts.nameserver != NULL) {
     m->nameserver = strdup(opts.nameserver);
   }
+#if MG_ENABLE_LISTENER_HANDOFF
+  /*
+   * Listeners exported by the previous process, adopted by mg_bind_opt().
+   * Only the first manager takes them: by the time others are initialised,
+   * the variable may hold what this process has exported for its children.
+   */
+  if (!__atomic_exchange_n(&s_handoff_env_taken, 1, __ATOMIC_RELAXED)) {
+    const char *fds = getenv(MG_LISTEN_FDS_ENV);
+    char *end;
+    while (fds != NULL && m->num_handoff_socks < MG_MAX_HANDOFF_SOCKS) {
+      long fd = strtol(fds, &end, 10);
+      if (end == fds) break;
+      m->handoff_socks[m->num_handoff_socks++] = (sock_t) fd;
+      fds = (*end == ',' ? end + 1 : NULL);
+    }
+    /* The descriptors mean nothing to our own children, e.g. CGI scripts */
+    unsetenv(MG_LISTEN_FDS_ENV);
+  }
+#endif
   DBG(("=================================="));
   DBG(("init mgr=%p", m));
 }
@@ -2382,6 +3315,17 @@ void mg_mgr_free(struct mg_mgr *m) {
     mg_close_conn(conn);
   }
 
+#if MG_ENABLE_LISTENER_HANDOFF
+  while (m->num_handoff_socks > 0) {
+    closesocket(m->handoff_socks[--m->num_handoff_socks]);
+  }
+#endif
+#if MG_ENABLE_CONN_TABLE
+  MG_FREE(m->conn_table);
+  m->conn_table = NULL;
+  m->conn_table_len = m->conn_table_size = 0;
+#endif
+
   {
     int i;
     for (i = 0; i < m->num_ifaces; i++) {
@@ -2403,16 +3347,57 @@ time_t mg_mgr_poll(struct mg_mgr *m, int timeout_ms) {
     return 0;
   }
 
+  /*
+   * Only the main interface blocks, waking up when any of the others has
+   * work to do (see get_wait_sock). The rest are then polled without
+   * blocking, so that everything that is ready is handled in one go.
+   */
   for (i = 0; i < m->num_ifaces; i++) {
-    now = m->ifaces[i]->vtable->poll(m->ifaces[i], timeout_ms);
+    now = m->ifaces[i]->vtable->poll(m->ifaces[i],
+                                     i == MG_MAIN_IFACE ? timeout_ms : 0);
+  }
+
+  if (m->drain_deadline > 0 && mg_time() >= m->drain_deadline) {
+    struct mg_connection *nc, *tmp;
+    for (nc = m->active_connections; nc != NULL; nc = tmp) {
+      tmp = nc->next;
+      DBG(("%p still open at the drain deadline", nc));
+      mg_close_conn(nc);
+    }
   }
+#if MG_ENABLE_CONN_MIGRATION
+  if (m->migrating != NULL) mg_migrate_flagged(m);
+#endif
   return now;
 }
 
+void mg_mgr_drain(struct mg_mgr *m, double timeout) {
+  struct mg_connection *nc, *tmp;
+  if (m->drain_deadline > 0) return;
+  m->drain_deadline = mg_time() + timeout;
+  for (nc = m->active_connections; nc != NULL; nc = tmp) {
+    tmp = nc->next;
+    if ((nc->flags & MG_F_LISTENING) ||
+        ((nc->flags & MG_F_UDP) && nc->listener != NULL)) {
+      /* UDP peers use the listener's socket, they cannot outlive it */
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mg_mark_closing(nc);
+    } else {
+      mg_call(nc, NULL, nc->user_data, MG_EV_DRAIN, NULL);
+    }
+  }
+}
+
 int mg_vprintf(struct mg_connection *nc, const char *fmt, va_list ap) {
   char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
+  struct mbuf *mb;
   int len;
 
+  /* Format straight into the send buffer, if the interface allows that. */
+  if ((mb = mg_send_mbuf(nc)) != NULL) {
+    return mbuf_vprintf(mb, fmt, ap);
+  }
+
   if ((len = mg_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
     mg_send(nc, buf, len);
   }
@@ -2484,6 +3469,7 @@ MG_INTERNAL struct mg_connection *mg_create_connection_base(
         (opts.iface != NULL ? opts.iface : mgr->ifaces[MG_MAIN_IFACE]);
     conn->flags = opts.flags & _MG_ALLOWED_CONNECT_FLAGS_MASK;
     conn->user_data = opts.user_data;
+    conn->ev_mask = conn->proto_ev_mask = MG_EV_MASK_ALL;
     /*
      * SIZE_MAX is defined as a long long constant in
      * system headers on some platforms and so it
@@ -2544,6 +3530,20 @@ MG_INTERNAL int mg_parse_address(const char *str, union socket_address *sa,
 
   *proto = SOCK_STREAM;
 
+#if MG_ENABLE_UNIX_SOCKETS
+  if (strncmp(str, "unix://", 7) == 0 || strncmp(str, "unixgram://", 11) == 0) {
+    if (str[4] == 'g') *proto = SOCK_DGRAM;
+    str = strchr(str, '/') + 2;
+    len = (int) strlen(str);
+    if (len == 0 || len >= (int) sizeof(sa->un.sun_path)) return -1;
+    sa->un.sun_family = AF_UNIX;
+    memcpy(sa->un.sun_path, str, len);
+    /* "@name" is a Linux abstract socket, it has no file in the filesystem */
+    if (str[0] == '@') sa->un.sun_path[0] = '\0';
+    return len;
+  }
+#endif
+
   if (strncmp(str, "udp://", 6) == 0) {
     str += 6;
     *proto = SOCK_DGRAM;
@@ -2607,14 +3607,21 @@ struct mg_connection *mg_if_accept_new_conn(struct mg_connection *lc) {
   struct mg_add_sock_opts opts;
   struct mg_connection *nc;
   memset(&opts, 0, sizeof(opts));
+  opts.iface = lc->iface;
   nc = mg_create_connection(lc->mgr, lc->handler, opts);
   if (nc == NULL) return NULL;
   nc->listener = lc;
   nc->proto_handler = lc->proto_handler;
   nc->user_data = lc->user_data;
   nc->recv_mbuf_limit = lc->recv_mbuf_limit;
-  nc->iface = lc->iface;
+  nc->ev_mask = lc->ev_mask;
+  nc->proto_ev_mask = lc->proto_ev_mask;
+  nc->sock_opts = lc->sock_opts;
   if (lc->flags & MG_F_SSL) nc->flags |= MG_F_SSL;
+  nc->flags |= lc->flags & (MG_F_WRITE_THROUGH | MG_F_MIGRATABLE);
+#if MG_ENABLE_CONN_PRIORITY
+  nc->prio = lc->prio;
+#endif
   mg_add_conn(nc->mgr, nc);
   DBG(("%p %p %d %d", lc, nc, nc->sock, (int) nc->flags));
   return nc;
@@ -2633,7 +3640,26 @@ void mg_send(struct mg_connection *nc, const void *buf, int len) {
     nc->iface->vtable->udp_send(nc, buf, len);
   } else {
     nc->iface->vtable->tcp_send(nc, buf, len);
+    if (nc->send_mbuf.len > 0) mg_mark_writing(nc);
+  }
+}
+
+MG_INTERNAL struct mbuf *mg_send_mbuf(struct mg_connection *nc) {
+  if ((nc->flags & MG_F_UDP) || nc->iface->vtable->tcp_send_mbuf == NULL) {
+    return NULL;
   }
+  nc->last_io_time = (time_t) mg_time();
+  mg_mark_writing(nc); /* Before it is appended to */
+  return nc->iface->vtable->tcp_send_mbuf(nc);
+}
+
+/* Bytes queued for sending that MG_EV_SEND has not reported yet */
+MG_INTERNAL size_t mg_send_pending(struct mg_connection *nc) {
+#if MG_ENABLE_NET_IF_URING
+  return nc->send_mbuf.len + mg_uring_in_flight(nc);
+#else
+  return nc->send_mbuf.len;
+#endif
 }
 
 void mg_if_sent_cb(struct mg_connection *nc, int num_sent) {
@@ -2693,6 +3719,66 @@ void mg_if_recv_tcp_cb(struct mg_connection *nc, void *buf, int len, int own) {
   mg_recv_common(nc, buf, len, own);
 }
 
+MG_INTERNAL size_t mg_recv_size(struct mg_connection *nc) {
+  return nc->recv_size < MG_RECV_SIZE_MIN ? MG_RECV_SIZE_MIN : nc->recv_size;
+}
+
+/*
+ * Adjusts the read chunk size after a read of `got` bytes into `asked`: a
+ * full chunk means more is likely waiting, a mostly empty one that the
+ * connection is trickling or idle.
+ */
+MG_INTERNAL void mg_recv_size_update(struct mg_connection *nc, size_t asked,
+                                     size_t got) {
+  size_t size = mg_recv_size(nc);
+  if (got >= asked && asked >= size) {
+    size = MIN(size * 2, MG_RECV_SIZE_MAX);
+  } else if (got < size / 4) {
+    size = size / 2 < MG_RECV_SIZE_MIN ? MG_RECV_SIZE_MIN : size / 2;
+  }
+  nc->recv_size = size;
+}
+
+void mg_if_recv_view_cb(struct mg_connection *nc, size_t len) {
+  int num = (int) len;
+  DBG(("%p %d view", nc, num));
+  if (nc->flags & MG_F_CLOSE_IMMEDIATELY) return;
+  nc->last_io_time = (time_t) mg_time();
+  mg_call(nc, NULL, nc->user_data, MG_EV_RECV, &num);
+}
+
+int mg_recv_view(struct mg_connection *nc, struct mg_str *iov, int max_iov) {
+  if (!(nc->flags & MG_F_RECV_VIEW) || nc->iface->vtable->recv_view == NULL) {
+    return 0;
+  }
+  return nc->iface->vtable->recv_view(nc, iov, max_iov);
+}
+
+void mg_recv_consume(struct mg_connection *nc, size_t len) {
+  if (len > 0 && (nc->flags & MG_F_RECV_VIEW) &&
+      nc->iface->vtable->recv_consume != NULL) {
+    nc->iface->vtable->recv_consume(nc, len);
+  }
+}
+
+size_t mg_recv_pullup(struct mg_connection *nc, size_t len) {
+  struct mg_str iov[4];
+  size_t moved = 0;
+  int i, n;
+  while (moved < len && (n = mg_recv_view(nc, iov, ARRAY_SIZE(iov))) > 0) {
+    size_t chunk = 0;
+    for (i = 0; i < n && moved + chunk < len; i++) {
+      size_t l = MIN(iov[i].len, len - moved - chunk);
+      if (mbuf_append(&nc->recv_mbuf, iov[i].p, l) != l) break;
+      chunk += l;
+    }
+    if (chunk == 0) break;
+    mg_recv_consume(nc, chunk);
+    moved += chunk;
+  }
+  return moved;
+}
+
 void mg_if_recv_udp_cb(struct mg_connection *nc, void *buf, int len,
                        union socket_address *sa, size_t sa_len) {
   assert(nc->flags & MG_F_UDP);
@@ -2860,6 +3946,10 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
 
   nc->flags |= opts.flags & _MG_ALLOWED_CONNECT_FLAGS_MASK;
   nc->flags |= (proto == SOCK_DGRAM) ? MG_F_UDP : 0;
+  nc->sock_opts = opts.sock_opts;
+#if MG_ENABLE_CONN_PRIORITY
+  nc->prio = (unsigned char) opts.prio;
+#endif
 #if MG_ENABLE_CALLBACK_USERDATA
   nc->user_data = user_data;
 #else
@@ -2978,6 +4068,10 @@ struct mg_connection *mg_bind_opt(struct mg_mgr *mgr, const char *address,
   nc->sa = sa;
   nc->flags |= MG_F_LISTENING;
   if (proto == SOCK_DGRAM) nc->flags |= MG_F_UDP;
+  nc->sock_opts = opts.sock_opts;
+#if MG_ENABLE_CONN_PRIORITY
+  nc->prio = (unsigned char) opts.prio;
+#endif
 
 #if MG_ENABLE_SSL
   DBG(("%p %s %s,%s,%s", nc, address, (opts.ssl_cert ? opts.ssl_cert : "-"),
@@ -3102,9 +4196,33 @@ void mg_forward(struct mg_connection *from, struct mg_connection *to) {
   mbuf_remove(&from->recv_mbuf, from->recv_mbuf.len);
 }
 
+#if MG_ENABLE_SOCKS
+/*
+ * Moves the contents of `from` to the send queue of `to`, unless that holds
+ * `watermark` bytes or more already. When nothing is queued, the buffer is
+ * handed over instead of being copied. Returns the number of bytes moved.
+ */
+MG_INTERNAL size_t mg_relay(struct mbuf *from, struct mg_connection *to,
+                            size_t watermark) {
+  struct mbuf *mb = mg_send_mbuf(to), tmp;
+  size_t n = from->len;
+  if (n == 0 || to->send_mbuf.len >= watermark) return 0;
+  if (mb != NULL && mb->len == 0) {
+    tmp = *mb;
+    *mb = *from;
+    *from = tmp;
+  } else {
+    mg_send(to, from->buf, n);
+    from->len = 0;
+  }
+  return n;
+}
+#endif
+
 double mg_set_timer(struct mg_connection *c, double timestamp) {
   double result = c->ev_timer_time;
   c->ev_timer_time = timestamp;
+  mg_mark_work(c);
   /*
    * If this connection is resolving, it's not in the list of active
    * connections, so not processed yet. It has a DNS resolver connection
@@ -3114,6 +4232,7 @@ double mg_set_timer(struct mg_connection *c, double timestamp) {
        (unsigned long) timestamp));
   if ((c->flags & MG_F_RESOLVING) && c->priv_2 != NULL) {
     ((struct mg_connection *) c->priv_2)->ev_timer_time = timestamp;
+    mg_mark_work((struct mg_connection *) c->priv_2);
   }
   return result;
 }
@@ -3156,6 +4275,9 @@ struct mg_connection *mg_add_sock(struct mg_mgr *s, sock_t sock,
 double mg_time(void) {
   return cs_time();
 }
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_net_if_socket.h"
 #endif
@@ -3179,6 +4301,29 @@ extern "C" {
 
 extern const struct mg_iface_vtable mg_socket_iface_vtable;
 
+#define _MG_F_FD_CAN_READ 1
+#define _MG_F_FD_CAN_WRITE 1 << 1
+#define _MG_F_FD_ERROR 1 << 2
+
+/* Parts of the socket interface reused by other interfaces. */
+void mg_socket_if_init(struct mg_iface *iface);
+int mg_socket_if_listen_tcp(struct mg_connection *nc, union socket_address *sa);
+int mg_socket_if_listen_udp(struct mg_connection *nc, union socket_address *sa);
+void mg_socket_if_connect_tcp(struct mg_connection *nc,
+                              const union socket_address *sa);
+void mg_socket_if_connect_udp(struct mg_connection *nc);
+void mg_socket_if_udp_send(struct mg_connection *nc, const void *buf,
+                           size_t len);
+void mg_socket_if_sock_set(struct mg_connection *nc, sock_t sock);
+void mg_socket_if_get_conn_addr(struct mg_connection *nc, int remote,
+                                union socket_address *sa);
+
+/* Handles readiness events `fd_flags` and delivers POLL and TIMER events. */
+void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now);
+#if MG_ENABLE_BROADCAST
+void mg_mgr_handle_ctl_sock(struct mg_mgr *mgr);
+#endif
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -3227,6 +4372,7 @@ int mg_num_ifaces = (int) (sizeof(mg_ifaces) / sizeof(mg_ifaces[0]));
 struct mg_iface *mg_if_create_iface(const struct mg_iface_vtable *vtable,
                                     struct mg_mgr *mgr) {
   struct mg_iface *iface = (struct mg_iface *) MG_CALLOC(1, sizeof(*iface));
+  if (iface == NULL) return NULL;
   iface->mgr = mgr;
   iface->data = NULL;
   iface->vtable = vtable;
@@ -3253,6 +4399,30 @@ struct mg_iface *mg_find_iface(struct mg_mgr *mgr,
   }
   return NULL;
 }
+
+int mg_if_owns_conn(struct mg_iface *iface, struct mg_connection *nc) {
+  struct mg_mgr *mgr = iface->mgr;
+  int i;
+  if (nc->iface == iface) return 1;
+  for (i = 0; i < mgr->num_ifaces; i++) {
+    if (mgr->ifaces[i] == nc->iface) return 0;
+  }
+  return iface == mgr->ifaces[MG_MAIN_IFACE];
+}
+
+int mg_if_get_wait_socks(struct mg_iface *iface, sock_t *socks,
+                         int max_socks) {
+  struct mg_mgr *mgr = iface->mgr;
+  int i, n = 0;
+  for (i = 0; i < mgr->num_ifaces; i++) {
+    struct mg_iface *other = mgr->ifaces[i];
+    sock_t sock = INVALID_SOCKET;
+    if (other == iface || other->vtable->get_wait_sock == NULL) continue;
+    if (other->vtable->get_wait_sock(other, &sock)) return -1;
+    if (sock != INVALID_SOCKET && n < max_socks) socks[n++] = sock;
+  }
+  return n;
+}
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_net_if_socket.c"
 #endif
@@ -3261,16 +4431,39 @@ struct mg_iface *mg_find_iface(struct mg_mgr *mgr,
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_CONN
+
 #if MG_ENABLE_NET_IF_SOCKET
 
 /* Amalgamated: #include "mg_net_if_socket.h" */
 /* Amalgamated: #include "mg_internal.h" */
 /* Amalgamated: #include "mg_util.h" */
 
-#define MG_TCP_RECV_BUFFER_SIZE 1024
 #define MG_UDP_RECV_BUFFER_SIZE 1500
 
-static sock_t mg_open_listening_socket(union socket_address *sa, int type,
+#if defined(__linux__) && !MG_LWIP
+#include <sys/epoll.h>
+#define MG_SOCKET_IF_EPOLL 1
+
+/* Allocated when the interface is first asked for a wait socket */
+struct mg_socket_if_data {
+  int epfd; /* Holds the sockets select() would wait for */
+};
+#endif
+
+/* Bytes read or written, charged to the priority class being serviced */
+#if MG_ENABLE_CONN_PRIORITY
+#define MG_PRIO_COUNT_IO(nc, n)                              \
+  do {                                                       \
+    if ((n) > 0) (nc)->mgr->prio_io_bytes += (unsigned) (n); \
+  } while (0)
+#else
+#define MG_PRIO_COUNT_IO(nc, n)
+#endif
+
+static sock_t mg_open_listening_socket(struct mg_connection *nc,
+                                       union socket_address *sa, int type,
                                        int proto);
 #if MG_ENABLE_SSL
 static void mg_ssl_begin(struct mg_connection *nc);
@@ -3298,10 +4491,63 @@ static int mg_is_error(void) {
       ;
 }
 
+/* Length of the address to pass to connect(), bind() and sendto() */
+static socklen_t mg_sa_len(const union socket_address *sa) {
+#if MG_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) {
+    /* Abstract names are not NUL-terminated: their length is part of them */
+    const char *path = sa->un.sun_path;
+    size_t n = 1, path_off = sizeof(sa->un) - sizeof(sa->un.sun_path);
+    while (n < sizeof(sa->un.sun_path) && path[n] != '\0') n++;
+    if (path[0] != '\0' && n < sizeof(sa->un.sun_path)) n++;
+    return (socklen_t)(path_off + n);
+  }
+#endif
+  return sa->sa.sa_family == AF_INET ? sizeof(sa->sin) : sizeof(sa->sin6);
+}
+
+static void mg_set_sock_opt(sock_t sock, int level, int name, int value) {
+  int rc = setsockopt(sock, level, name, (const char *) &value, sizeof(value));
+  if (rc != 0) {
+    DBG(("%d: option %d/%d = %d failed: %d", (int) sock, level, name, value,
+         mg_get_errno()));
+  }
+}
+
+/*
+ * Applies `nc->sock_opts` that work the same for all kinds of sockets.
+ * Options are best effort, failing to set one is not an error.
+ */
+static int mg_apply_sock_opts(struct mg_connection *nc, sock_t sock) {
+  const struct mg_sock_opts *so = &nc->sock_opts;
+#ifdef SO_SNDBUF
+  if (so->sndbuf > 0) mg_set_sock_opt(sock, SOL_SOCKET, SO_SNDBUF, so->sndbuf);
+#endif
+#ifdef SO_RCVBUF
+  if (so->rcvbuf > 0) mg_set_sock_opt(sock, SOL_SOCKET, SO_RCVBUF, so->rcvbuf);
+#endif
+  if (nc->flags & MG_F_UDP) return 0;
+#if MG_ENABLE_UNIX_SOCKETS
+  /* Accepted connections get their address later, the listener's will do */
+  if ((nc->listener != NULL ? nc->listener : nc)->sa.sa.sa_family == AF_UNIX) {
+    return 0;
+  }
+#endif
+#ifdef TCP_NODELAY
+  if (so->nodelay) mg_set_sock_opt(sock, IPPROTO_TCP, TCP_NODELAY, 1);
+#endif
+#ifdef TCP_CORK
+  if (so->cork && !(nc->flags & MG_F_LISTENING)) {
+    mg_set_sock_opt(sock, IPPROTO_TCP, TCP_CORK, 1);
+  }
+#endif
+  return 0;
+}
+
 void mg_socket_if_connect_tcp(struct mg_connection *nc,
                               const union socket_address *sa) {
   int rc, proto = 0;
-  nc->sock = socket(AF_INET, SOCK_STREAM, proto);
+  nc->sock = socket(sa->sa.sa_family, SOCK_STREAM, proto);
   if (nc->sock == INVALID_SOCKET) {
     nc->err = mg_get_errno() ? mg_get_errno() : 1;
     return;
@@ -3309,18 +4555,33 @@ void mg_socket_if_connect_tcp(struct mg_connection *nc,
 #if !defined(MG_ESP8266)
   mg_set_non_blocking_mode(nc->sock);
 #endif
-  rc = connect(nc->sock, &sa->sa, sizeof(sa->sin));
+  mg_apply_sock_opts(nc, nc->sock);
+#ifdef TCP_FASTOPEN_CONNECT
+  if (nc->sock_opts.fastopen) {
+    mg_set_sock_opt(nc->sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+  }
+#endif
+  rc = connect(nc->sock, &sa->sa, mg_sa_len(sa));
   nc->err = rc < 0 && mg_is_error() ? mg_get_errno() : 0;
   DBG(("%p sock %d rc %d errno %d err %d", nc, nc->sock, rc, mg_get_errno(),
        nc->err));
 }
 
 void mg_socket_if_connect_udp(struct mg_connection *nc) {
-  nc->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  nc->sock = socket(nc->sa.sa.sa_family, SOCK_DGRAM, 0);
   if (nc->sock == INVALID_SOCKET) {
     nc->err = mg_get_errno() ? mg_get_errno() : 1;
     return;
   }
+#if MG_ENABLE_UNIX_SOCKETS && defined(__linux__)
+  if (nc->sa.sa.sa_family == AF_UNIX) {
+    /* Autobind to an abstract name, otherwise the peer cannot reply */
+    union socket_address sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.un.sun_family = AF_UNIX;
+    (void) bind(nc->sock, &sa.sa, sizeof(sa.un.sun_family));
+  }
+#endif
   if (nc->flags & MG_F_ENABLE_BROADCAST) {
     int optval = 1;
     if (setsockopt(nc->sock, SOL_SOCKET, SO_BROADCAST, (const char *) &optval,
@@ -3335,7 +4596,7 @@ void mg_socket_if_connect_udp(struct mg_connection *nc) {
 int mg_socket_if_listen_tcp(struct mg_connection *nc,
                             union socket_address *sa) {
   int proto = 0;
-  sock_t sock = mg_open_listening_socket(sa, SOCK_STREAM, proto);
+  sock_t sock = mg_open_listening_socket(nc, sa, SOCK_STREAM, proto);
   if (sock == INVALID_SOCKET) {
     return (mg_get_errno() ? mg_get_errno() : 1);
   }
@@ -3345,7 +4606,7 @@ int mg_socket_if_listen_tcp(struct mg_connection *nc,
 
 int mg_socket_if_listen_udp(struct mg_connection *nc,
                             union socket_address *sa) {
-  sock_t sock = mg_open_listening_socket(sa, SOCK_DGRAM, 0);
+  sock_t sock = mg_open_listening_socket(nc, sa, SOCK_DGRAM, 0);
   if (sock == INVALID_SOCKET) return (mg_get_errno() ? mg_get_errno() : 1);
   mg_sock_set(nc, sock);
   return 0;
@@ -3356,6 +4617,10 @@ void mg_socket_if_tcp_send(struct mg_connection *nc, const void *buf,
   mbuf_append(&nc->send_mbuf, buf, len);
 }
 
+struct mbuf *mg_socket_if_tcp_send_mbuf(struct mg_connection *nc) {
+  return &nc->send_mbuf;
+}
+
 void mg_socket_if_udp_send(struct mg_connection *nc, const void *buf,
                            size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
@@ -3379,6 +4644,13 @@ void mg_socket_if_destroy_conn(struct mg_connection *nc) {
     /* Only close outgoing UDP sockets or listeners. */
     if (nc->listener == NULL) closesocket(nc->sock);
   }
+#if MG_ENABLE_UNIX_SOCKETS
+  /* After a handoff, the socket file belongs to the new process */
+  if ((nc->flags & MG_F_LISTENING) && !(nc->flags & MG_F_HANDED_OFF) &&
+      nc->sa.sa.sa_family == AF_UNIX && nc->sa.un.sun_path[0] != '\0') {
+    unlink(nc->sa.un.sun_path);
+  }
+#endif
   nc->sock = INVALID_SOCKET;
 }
 
@@ -3386,8 +4658,13 @@ static int mg_accept_conn(struct mg_connection *lc) {
   struct mg_connection *nc;
   union socket_address sa;
   socklen_t sa_len = sizeof(sa);
+  sock_t sock;
+  /* Leave clients queued to a listener being closed, e.g. by mg_mgr_drain() */
+  if (lc->flags & MG_F_CLOSE_IMMEDIATELY) return 0;
+  /* Unix-domain peers are usually unbound, so accept() fills in no path */
+  memset(&sa, 0, sizeof(sa));
   /* NOTE(lsm): on Windows, sock is always > FD_SETSIZE */
-  sock_t sock = accept(lc->sock, &sa.sa, &sa_len);
+  sock = accept(lc->sock, &sa.sa, &sa_len);
   if (sock == INVALID_SOCKET) {
     if (mg_is_error()) DBG(("%p: failed to accept: %d", lc, mg_get_errno()));
     return 0;
@@ -3411,15 +4688,96 @@ static int mg_accept_conn(struct mg_connection *lc) {
   return 1;
 }
 
+static int mg_listen(struct mg_connection *nc, sock_t sock, int backlog) {
+#ifdef TCP_FASTOPEN
+  if (nc->sock_opts.fastopen > 0) {
+    mg_set_sock_opt(sock, IPPROTO_TCP, TCP_FASTOPEN, nc->sock_opts.fastopen);
+  }
+#endif
+#ifdef TCP_DEFER_ACCEPT
+  if (nc->sock_opts.defer_accept > 0) {
+    mg_set_sock_opt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                    nc->sock_opts.defer_accept);
+  }
+#endif
+  (void) nc;
+  return listen(sock, backlog);
+}
+
+#if MG_ENABLE_LISTENER_HANDOFF
+/* Takes an inherited listening socket bound to `sa`, if there is one */
+static sock_t mg_handoff_take(struct mg_mgr *mgr,
+                              const union socket_address *sa, int type) {
+  int i;
+  for (i = 0; i < mgr->num_handoff_socks; i++) {
+    sock_t sock = mgr->handoff_socks[i];
+    union socket_address a;
+    socklen_t len = sizeof(a);
+    int t = 0;
+    socklen_t t_len = sizeof(t);
+    memset(&a, 0, sizeof(a));
+    if (getsockname(sock, &a.sa, &len) != 0 ||
+        getsockopt(sock, SOL_SOCKET, SO_TYPE, (char *) &t, &t_len) != 0 ||
+        t != type || a.sa.sa_family != sa->sa.sa_family) {
+      continue;
+    }
+    if (a.sa.sa_family == AF_INET) {
+      if (a.sin.sin_port != sa->sin.sin_port ||
+          a.sin.sin_addr.s_addr != sa->sin.sin_addr.s_addr) {
+        continue;
+      }
+#if MG_ENABLE_IPV6
+    } else if (a.sa.sa_family == AF_INET6) {
+      if (a.sin6.sin6_port != sa->sin6.sin6_port ||
+          memcmp(&a.sin6.sin6_addr, &sa->sin6.sin6_addr,
+                 sizeof(a.sin6.sin6_addr)) != 0) {
+        continue;
+      }
+#endif
+#if MG_ENABLE_UNIX_SOCKETS
+    } else if (a.sa.sa_family == AF_UNIX) {
+      if (memcmp(a.un.sun_path, sa->un.sun_path, sizeof(a.un.sun_path)) != 0) {
+        continue;
+      }
+#endif
+    } else {
+      continue;
+    }
+    mgr->handoff_socks[i] = mgr->handoff_socks[--mgr->num_handoff_socks];
+    DBG(("adopted inherited listener %d", (int) sock));
+    return sock;
+  }
+  return INVALID_SOCKET;
+}
+#endif /* MG_ENABLE_LISTENER_HANDOFF */
+
 /* 'sa' must be an initialized address to bind to */
-static sock_t mg_open_listening_socket(union socket_address *sa, int type,
+static sock_t mg_open_listening_socket(struct mg_connection *nc,
+                                       union socket_address *sa, int type,
                                        int proto) {
-  socklen_t sa_len =
-      (sa->sa.sa_family == AF_INET) ? sizeof(sa->sin) : sizeof(sa->sin6);
+  socklen_t sa_len = mg_sa_len(sa);
   sock_t sock = INVALID_SOCKET;
+  int backlog = nc->sock_opts.backlog > 0 ? nc->sock_opts.backlog : SOMAXCONN;
 #if !MG_LWIP
   int on = 1;
 #endif
+#if MG_ENABLE_UNIX_SOCKETS
+  struct stat st;
+#endif
+
+#if MG_ENABLE_LISTENER_HANDOFF
+  if ((sock = mg_handoff_take(nc->mgr, sa, type)) != INVALID_SOCKET) {
+    mg_set_non_blocking_mode(sock);
+    return sock;
+  }
+#endif
+#if MG_ENABLE_UNIX_SOCKETS
+  /* A socket file left behind by a previous run would make bind() fail */
+  if (sa->sa.sa_family == AF_UNIX && sa->un.sun_path[0] != '\0' &&
+      lstat(sa->un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(sa->un.sun_path);
+  }
+#endif
 
   if ((sock = socket(sa->sa.sa_family, type, proto)) != INVALID_SOCKET &&
 #if !MG_LWIP /* LWIP doesn't support either */
@@ -3443,8 +4801,9 @@ static sock_t mg_open_listening_socket(union socket_address *sa, int type,
 #endif
 #endif /* !MG_LWIP */
 
-      !bind(sock, &sa->sa, sa_len) &&
-      (type == SOCK_DGRAM || listen(sock, SOMAXCONN) == 0)) {
+      /* Buffer sizes must be known before the SYN-ACK, for window scaling */
+      !mg_apply_sock_opts(nc, sock) && !bind(sock, &sa->sa, sa_len) &&
+      (type == SOCK_DGRAM || mg_listen(nc, sock, backlog) == 0)) {
 #if !MG_LWIP
     mg_set_non_blocking_mode(sock);
     /* In case port was set to 0, get the real port number */
@@ -3458,6 +4817,25 @@ static sock_t mg_open_listening_socket(union socket_address *sa, int type,
   return sock;
 }
 
+/*
+ * To be called after mg_if_sent_cb(): once all is sent and MG_EV_SEND
+ * handlers have added nothing, flushes the last partial segment instead of
+ * leaving it to the kernel's cork timeout (200ms on Linux). The cork goes
+ * back on for whatever comes next.
+ */
+static void mg_sock_uncork(struct mg_connection *nc, int num_sent) {
+#ifdef TCP_CORK
+  if (nc->sock_opts.cork && num_sent > 0 && nc->send_mbuf.len == 0 &&
+      nc->sock != INVALID_SOCKET) {
+    mg_set_sock_opt(nc->sock, IPPROTO_TCP, TCP_CORK, 0);
+    mg_set_sock_opt(nc->sock, IPPROTO_TCP, TCP_CORK, 1);
+  }
+#else
+  (void) nc;
+  (void) num_sent;
+#endif
+}
+
 static void mg_write_to_socket(struct mg_connection *nc) {
   struct mbuf *io = &nc->send_mbuf;
   int n = 0;
@@ -3471,9 +4849,10 @@ static void mg_write_to_socket(struct mg_connection *nc) {
 
   if (nc->flags & MG_F_UDP) {
     int n =
-        sendto(nc->sock, io->buf, io->len, 0, &nc->sa.sa, sizeof(nc->sa.sin));
+        sendto(nc->sock, io->buf, io->len, 0, &nc->sa.sa, mg_sa_len(&nc->sa));
     DBG(("%p %d %d %d %s:%hu", nc, nc->sock, n, mg_get_errno(),
          inet_ntoa(nc->sa.sin.sin_addr), ntohs(nc->sa.sin.sin_port)));
+    MG_PRIO_COUNT_IO(nc, n);
     mg_if_sent_cb(nc, n);
     return;
   }
@@ -3501,9 +4880,13 @@ static void mg_write_to_socket(struct mg_connection *nc) {
   {
     n = (int) MG_SEND_FUNC(nc->sock, io->buf, io->len, 0);
     DBG(("%p %d bytes -> %d", nc, n, nc->sock));
+    /* Would block, e.g. on a write-through: retry when select() says so */
+    if (n < 0 && !mg_is_error()) return;
   }
 
+  MG_PRIO_COUNT_IO(nc, n);
   mg_if_sent_cb(nc, n);
+  mg_sock_uncork(nc, n);
 }
 
 MG_INTERNAL size_t recv_avail_size(struct mg_connection *conn, size_t max) {
@@ -3513,54 +4896,70 @@ MG_INTERNAL size_t recv_avail_size(struct mg_connection *conn, size_t max) {
   return avail > max ? max : avail;
 }
 
+/*
+ * Reads in chunks of mg_recv_size() until the socket runs dry (a short read),
+ * the receive buffer is full or MG_RECV_BUDGET bytes have been read.
+ * SSL connections are read until the library wants more: it may have more
+ * bytes ready than we ask for, and select() would not report them.
+ */
 static void mg_handle_tcp_read(struct mg_connection *conn) {
-  int n = 0;
-  char *buf = (char *) MG_MALLOC(MG_TCP_RECV_BUFFER_SIZE);
+  size_t budget = MG_RECV_BUDGET, size;
+  int n = 0, ssl = 0;
+  char *buf;
 
-  if (buf == NULL) {
-    DBG(("OOM"));
+#if MG_ENABLE_SSL
+  if ((conn->flags & MG_F_SSL) && !(conn->flags & MG_F_SSL_HANDSHAKE_DONE)) {
+    mg_ssl_begin(conn);
     return;
   }
+  ssl = (conn->flags & MG_F_SSL) != 0;
+#endif
 
-#if MG_ENABLE_SSL
-  if (conn->flags & MG_F_SSL) {
-    if (conn->flags & MG_F_SSL_HANDSHAKE_DONE) {
-      /* SSL library may have more bytes ready to read than we ask to read.
-       * Therefore, read in a loop until we read everything. Without the loop,
-       * we skip to the next select() cycle which can just timeout. */
-      while ((n = mg_ssl_if_read(conn, buf, MG_TCP_RECV_BUFFER_SIZE)) > 0) {
-        DBG(("%p %d bytes <- %d (SSL)", conn, n, conn->sock));
-        mg_if_recv_tcp_cb(conn, buf, n, 1 /* own */);
-        buf = NULL;
-        if (conn->flags & MG_F_CLOSE_IMMEDIATELY) break;
-        /* buf has been freed, we need a new one. */
-        buf = (char *) MG_MALLOC(MG_TCP_RECV_BUFFER_SIZE);
-        if (buf == NULL) break;
-      }
-      MG_FREE(buf);
-      if (n < 0 && n != MG_SSL_WANT_READ) conn->flags |= MG_F_CLOSE_IMMEDIATELY;
-    } else {
-      MG_FREE(buf);
-      mg_ssl_begin(conn);
+  do {
+    size = mg_recv_size(conn);
+    if (!ssl) size = recv_avail_size(conn, size);
+    if (size == 0) break;
+    if ((buf = (char *) MG_MALLOC(size)) == NULL) {
+      DBG(("OOM"));
       return;
     }
-  } else
+#if MG_ENABLE_SSL
+    if (ssl) {
+      n = mg_ssl_if_read(conn, buf, size);
+      DBG(("%p %d bytes <- %d (SSL)", conn, n, conn->sock));
+    } else
 #endif
-  {
-    n = (int) MG_RECV_FUNC(conn->sock, buf,
-                           recv_avail_size(conn, MG_TCP_RECV_BUFFER_SIZE), 0);
-    DBG(("%p %d bytes (PLAIN) <- %d", conn, n, conn->sock));
+    {
+      n = (int) MG_RECV_FUNC(conn->sock, buf, size, 0);
+      DBG(("%p %d bytes (PLAIN) <- %d", conn, n, conn->sock));
+    }
     if (n > 0) {
+      mg_recv_size_update(conn, size, (size_t) n);
+      if ((size_t) n < size / 2) {
+        /* recv_mbuf may adopt buf as is, don't let it keep the slack. */
+        char *p = (char *) MG_REALLOC(buf, n);
+        if (p != NULL) buf = p;
+      }
+      MG_PRIO_COUNT_IO(conn, n);
       mg_if_recv_tcp_cb(conn, buf, n, 1 /* own */);
+      budget -= MIN(budget, (size_t) n);
     } else {
       MG_FREE(buf);
     }
-    if (n == 0) {
-      /* Orderly shutdown of the socket, try flushing output. */
-      conn->flags |= MG_F_SEND_AND_CLOSE;
-    } else if (n < 0 && mg_is_error()) {
-      conn->flags |= MG_F_CLOSE_IMMEDIATELY;
-    }
+  } while (n > 0 && !(conn->flags & MG_F_CLOSE_IMMEDIATELY) &&
+           (ssl || (n == (int) size && budget > 0)));
+
+#if MG_ENABLE_SSL
+  if (ssl) {
+    if (n < 0 && n != MG_SSL_WANT_READ) conn->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+#endif
+  if (n == 0 && size > 0) {
+    /* Orderly shutdown of the socket, try flushing output. */
+    conn->flags |= MG_F_SEND_AND_CLOSE;
+  } else if (n < 0 && mg_is_error()) {
+    conn->flags |= MG_F_CLOSE_IMMEDIATELY;
   }
 }
 
@@ -3584,9 +4983,12 @@ static void mg_handle_udp_read(struct mg_connection *nc) {
   char *buf = NULL;
   union socket_address sa;
   socklen_t sa_len = sizeof(sa);
-  int n = mg_recvfrom(nc, &sa, &sa_len, &buf);
+  int n;
+  memset(&sa, 0, sizeof(sa)); /* mg_sa_len() looks past sa_len for AF_UNIX */
+  n = mg_recvfrom(nc, &sa, &sa_len, &buf);
   DBG(("%p %d bytes from %s:%d", nc, n, inet_ntoa(nc->sa.sin.sin_addr),
        ntohs(nc->sa.sin.sin_port)));
+  MG_PRIO_COUNT_IO(nc, n);
   mg_if_recv_udp_cb(nc, buf, n, &sa, sa_len);
 }
 
@@ -3617,13 +5019,11 @@ static void mg_ssl_begin(struct mg_connection *nc) {
 }
 #endif /* MG_ENABLE_SSL */
 
-#define _MG_F_FD_CAN_READ 1
-#define _MG_F_FD_CAN_WRITE 1 << 1
-#define _MG_F_FD_ERROR 1 << 2
-
 void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now) {
   int worth_logging =
       fd_flags != 0 || (nc->flags & (MG_F_WANT_READ | MG_F_WANT_WRITE));
+  /* Nothing left unsent means the socket was writable at the last write */
+  int was_writable = (nc->send_mbuf.len == 0);
   if (worth_logging) {
     DBG(("%p fd=%d fd_flags=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock,
          fd_flags, nc->flags, (int) nc->recv_mbuf.len,
@@ -3682,6 +5082,15 @@ void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now) {
   }
 
   if (!(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    /*
+     * With MG_F_WRITE_THROUGH, what handlers have just queued is sent right
+     * away instead of after the next select().
+     */
+    if ((nc->flags & MG_F_WRITE_THROUGH) && was_writable &&
+        !(nc->flags & (MG_F_CONNECTING | MG_F_LISTENING)) &&
+        (!(nc->flags & MG_F_SSL) || (nc->flags & MG_F_SSL_HANDSHAKE_DONE))) {
+      fd_flags |= _MG_F_FD_CAN_WRITE;
+    }
     if ((fd_flags & _MG_F_FD_CAN_WRITE) && nc->send_mbuf.len > 0) {
       mg_write_to_socket(nc);
     }
@@ -3696,7 +5105,7 @@ void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now) {
 }
 
 #if MG_ENABLE_BROADCAST
-static void mg_mgr_handle_ctl_sock(struct mg_mgr *mgr) {
+void mg_mgr_handle_ctl_sock(struct mg_mgr *mgr) {
   struct ctl_msg ctl_msg;
   int len =
       (int) MG_RECV_FUNC(mgr->ctl[1], (char *) &ctl_msg, sizeof(ctl_msg), 0);
@@ -3717,6 +5126,8 @@ static void mg_mgr_handle_ctl_sock(struct mg_mgr *mgr) {
 void mg_socket_if_sock_set(struct mg_connection *nc, sock_t sock) {
   mg_set_non_blocking_mode(sock);
   mg_set_close_on_exec(sock);
+  /* Listeners have had theirs applied before bind() */
+  if (!(nc->flags & MG_F_LISTENING)) mg_apply_sock_opts(nc, sock);
   nc->sock = sock;
   DBG(("%p %d", nc, sock));
 }
@@ -3730,7 +5141,16 @@ void mg_socket_if_init(struct mg_iface *iface) {
 }
 
 void mg_socket_if_free(struct mg_iface *iface) {
+#if MG_SOCKET_IF_EPOLL
+  struct mg_socket_if_data *d = (struct mg_socket_if_data *) iface->data;
+  if (d != NULL) {
+    close(d->epfd);
+    MG_FREE(d);
+    iface->data = NULL;
+  }
+#else
   (void) iface;
+#endif
 }
 
 void mg_socket_if_add_conn(struct mg_connection *nc) {
@@ -3754,6 +5174,228 @@ void mg_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
   }
 }
 
+/*
+ * Steps through all connections of `mgr`, starting with `nc` == NULL and
+ * `*i` == 0. Walks mg_mgr::conn_table when there is one, so the loop body
+ * must not add or remove connections.
+ */
+static struct mg_connection *mg_next_conn(struct mg_mgr *mgr,
+                                          struct mg_connection *nc, int *i) {
+#if MG_ENABLE_CONN_TABLE
+  if (mgr->conn_table != NULL) {
+    return *i < mgr->conn_table_len ? mgr->conn_table[(*i)++] : NULL;
+  }
+#endif
+  (void) i;
+  return nc == NULL ? mgr->active_connections : nc->next;
+}
+
+#if MG_ENABLE_CONN_MIGRATION
+time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms);
+
+static int mg_is_socket_iface(const struct mg_iface *iface) {
+  return iface->vtable->poll == mg_socket_if_poll;
+}
+
+static int mg_conn_is_quiescent(const struct mg_connection *nc) {
+  /* HTTP/2 streams are tied to the manager their connection came from */
+  unsigned long busy = MG_F_LISTENING | MG_F_UDP | MG_F_RESOLVING |
+                       MG_F_CONNECTING | MG_F_WANT_READ | MG_F_WANT_WRITE |
+                       MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY |
+                       MG_F_IS_H2;
+  if (nc->flags & busy) return 0;
+  if ((nc->flags & MG_F_SSL) && !(nc->flags & MG_F_SSL_HANDSHAKE_DONE)) {
+    return 0;
+  }
+  return nc->sock != INVALID_SOCKET && nc->recv_mbuf.len == 0 &&
+         nc->send_mbuf.len == 0 && mg_is_socket_iface(nc->iface);
+}
+
+static struct mg_iface *mg_socket_iface_of(struct mg_mgr *mgr) {
+  int i;
+  for (i = 0; i < mgr->num_ifaces; i++) {
+    if (mg_is_socket_iface(mgr->ifaces[i])) return mgr->ifaces[i];
+  }
+  return NULL;
+}
+
+/*
+ * Only records the move: the poll that is running may still dispatch events
+ * to `nc`, or write to it, with `nc->mgr` and `nc->iface` as they are. The
+ * connection leaves in mg_migrate_flagged(), but is counted in `to` right
+ * away, so that rebalancers do not overload it.
+ */
+int mg_conn_migrate(struct mg_connection *nc, struct mg_mgr *to) {
+  if (nc->mgr == to || nc->migrate_to != NULL || !mg_conn_is_quiescent(nc) ||
+      mg_socket_iface_of(to) == NULL) {
+    return -1;
+  }
+  DBG(("%p %p -> %p", nc, nc->mgr, to));
+  nc->migrate_to = to;
+  nc->migrate_next = nc->mgr->migrating;
+  nc->mgr->migrating = nc;
+  __atomic_fetch_sub(&nc->mgr->num_conns, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->num_conns, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Undoes mg_conn_migrate(), `nc` stays where it is */
+MG_INTERNAL void mg_migrate_cancel(struct mg_connection *nc) {
+  struct mg_connection **p = &nc->mgr->migrating;
+  while (*p != nc) p = &(*p)->migrate_next;
+  *p = nc->migrate_next;
+  __atomic_fetch_add(&nc->mgr->num_conns, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&nc->migrate_to->num_conns, 1, __ATOMIC_RELAXED);
+  nc->migrate_to = NULL;
+  nc->migrate_next = NULL;
+}
+
+/* Called by mg_mgr_poll() once all events of the poll have been handled */
+MG_INTERNAL void mg_migrate_flagged(struct mg_mgr *mgr) {
+  struct mg_connection *nc, *head;
+  struct mg_mgr *to;
+
+  while ((nc = mgr->migrating) != NULL) {
+    to = nc->migrate_to;
+    mg_migrate_cancel(nc);
+    if (!mg_conn_is_quiescent(nc)) {
+      DBG(("%p busy again, stays in %p", nc, mgr));
+      continue;
+    }
+    mg_remove_conn(nc);
+    nc->mgr = to;
+    nc->iface = mg_socket_iface_of(to);
+    __atomic_fetch_add(&to->num_conns, 1, __ATOMIC_RELAXED);
+
+    /* Lock-free push, `to` takes the whole list in mg_attach_migrated() */
+    head = __atomic_load_n(&to->migrated, __ATOMIC_RELAXED);
+    do {
+      nc->next = head;
+    } while (!__atomic_compare_exchange_n(&to->migrated, &head, nc, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+static void mg_attach_migrated(struct mg_mgr *mgr) {
+  struct mg_connection *nc, *tmp;
+  if (__atomic_load_n(&mgr->migrated, __ATOMIC_RELAXED) == NULL) return;
+  nc = __atomic_exchange_n(&mgr->migrated, NULL, __ATOMIC_ACQUIRE);
+  for (; nc != NULL; nc = tmp) {
+    tmp = nc->next;
+    mg_add_conn(mgr, nc);
+    /* Already counted by mg_migrate_flagged() */
+    __atomic_fetch_sub(&mgr->num_conns, 1, __ATOMIC_RELAXED);
+  }
+}
+
+int mg_mgr_rebalance(struct mg_mgr *mgr, struct mg_mgr **mgrs, int num_mgrs,
+                     int max_moves) {
+  struct mg_connection *nc, *tmp;
+  struct mg_mgr *least;
+  int i, n, load, least_load = 0, moved = 0;
+
+  for (nc = mgr->active_connections; nc != NULL && moved < max_moves;
+       nc = tmp) {
+    tmp = nc->next;
+    if (!(nc->flags & MG_F_MIGRATABLE)) continue;
+    load = __atomic_load_n(&mgr->num_conns, __ATOMIC_RELAXED);
+    least = NULL;
+    for (i = 0; i < num_mgrs; i++) {
+      if (mgrs[i] == mgr) continue;
+      n = __atomic_load_n(&mgrs[i]->num_conns, __ATOMIC_RELAXED);
+      if (n > load) return moved; /* Up to the busiest manager's thread */
+      if (least == NULL || n < least_load) {
+        least = mgrs[i];
+        least_load = n;
+      }
+    }
+    if (least == NULL || load - least_load <= 1) break;
+    if (mg_conn_migrate(nc, least) == 0) moved++;
+  }
+  return moved;
+}
+#endif /* MG_ENABLE_CONN_MIGRATION */
+
+#if MG_ENABLE_CONN_PRIORITY
+/* Connections of one class with I/O ready, see MG_PRIO_NORMAL */
+struct mg_prio_queue {
+  struct mg_connection *head, *tail;
+  struct mg_connection *last_deferred; /* Deferred ones go first, in order */
+};
+
+/* Classes in the order they are serviced */
+static const int s_prio_order[MG_NUM_PRIO] = {
+    MG_PRIO_INTERACTIVE, MG_PRIO_NORMAL, MG_PRIO_BULK};
+
+static void mg_prio_enqueue(struct mg_prio_queue *queues,
+                            struct mg_connection *nc, int fd_flags,
+                            double now) {
+  struct mg_prio_queue *q =
+      &queues[nc->prio < MG_NUM_PRIO ? nc->prio : MG_PRIO_NORMAL];
+  struct mg_connection **p;
+  nc->prio_fd_flags = fd_flags;
+  if (nc->prio_ready_time > 0) {
+    p = q->last_deferred != NULL ? &q->last_deferred->prio_next : &q->head;
+    q->last_deferred = nc;
+  } else {
+    p = q->tail != NULL ? &q->tail->prio_next : &q->head;
+    nc->prio_ready_time = now;
+  }
+  nc->prio_next = *p;
+  *p = nc;
+  if (nc->prio_next == NULL) q->tail = nc;
+}
+
+static void mg_prio_service(struct mg_connection *nc,
+                            struct mg_prio_class *pc, double now) {
+  struct mg_mgr *mgr = nc->mgr;
+  unsigned long bytes = mgr->prio_io_bytes;
+  double delay = mg_time() - nc->prio_ready_time;
+  nc->prio_ready_time = 0;
+  mg_mgr_handle_conn(nc, nc->prio_fd_flags, now);
+  bytes = mgr->prio_io_bytes - bytes;
+  pc->deficit -= (long) bytes;
+  pc->stats.serviced++;
+  pc->stats.bytes += bytes;
+  pc->stats.delay_sum += delay;
+  if (delay > pc->stats.delay_max) pc->stats.delay_max = delay;
+}
+
+/*
+ * Services the connections queued by mg_prio_enqueue(), with deficit
+ * round-robin among the classes when more than one has I/O ready.
+ */
+static void mg_prio_dispatch(struct mg_mgr *mgr, struct mg_prio_queue *queues,
+                             double now) {
+  struct mg_connection *nc, *next;
+  int i, num_ready = 0;
+
+  for (i = 0; i < MG_NUM_PRIO; i++) num_ready += (queues[i].head != NULL);
+  for (i = 0; i < MG_NUM_PRIO; i++) {
+    struct mg_prio_class *pc = &mgr->prio[s_prio_order[i]];
+    int weight = pc->weight > 0 ? pc->weight : 1, deferred = 0;
+    nc = queues[s_prio_order[i]].head;
+    if (nc != NULL && num_ready > 1) {
+      pc->deficit += (long) weight * MG_PRIO_QUANTUM;
+    }
+    for (; nc != NULL; nc = next) {
+      next = nc->prio_next;
+      if (num_ready < 2 || pc->deficit > 0) {
+        mg_prio_service(nc, pc, now);
+      } else {
+        /* Over budget: I/O waits for the next poll */
+        pc->stats.deferred++;
+        deferred++;
+        mg_mgr_handle_conn(nc, 0, now);
+      }
+      if (nc->flags & MG_F_CLOSING_MASK) mg_mark_closing(nc);
+    }
+    /* Nothing left waiting, or nothing to share: nothing to save up for */
+    if (num_ready < 2 || deferred == 0) pc->deficit = 0;
+  }
+}
+#endif /* MG_ENABLE_CONN_PRIORITY */
+
 time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
   struct mg_mgr *mgr = iface->mgr;
   double now = mg_time();
@@ -3762,16 +5404,30 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
   struct timeval tv;
   fd_set read_set, write_set, err_set;
   sock_t max_fd = INVALID_SOCKET;
-  int num_fds, num_ev, num_timers = 0;
+  sock_t wait_socks[MG_MAX_WAIT_SOCKS];
+  int num_fds, num_ev, num_timers = 0, num_wait_socks = 0, i;
+  int ci = 0;
+#if MG_ENABLE_CONN_PRIORITY
+  struct mg_prio_queue ready[MG_NUM_PRIO];
+#endif
 #ifdef __unix__
   int try_dup = 1;
 #endif
 
+#if MG_ENABLE_CONN_MIGRATION
+  mg_attach_migrated(mgr);
+#endif
+
   FD_ZERO(&read_set);
   FD_ZERO(&write_set);
   FD_ZERO(&err_set);
+#if MG_ENABLE_CONN_PRIORITY
+  memset(ready, 0, sizeof(ready));
+#endif
 #if MG_ENABLE_BROADCAST
-  mg_add_to_set(mgr->ctl[1], &read_set, &max_fd);
+  if (iface == mgr->ifaces[MG_MAIN_IFACE]) {
+    mg_add_to_set(mgr->ctl[1], &read_set, &max_fd);
+  }
 #endif
 
   /*
@@ -3779,8 +5435,14 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
    * e.g. timer-only "connections".
    */
   min_timer = 0;
-  for (nc = mgr->active_connections, num_fds = 0; nc != NULL; nc = tmp) {
-    tmp = nc->next;
+  num_fds = 0;
+  for (nc = mg_next_conn(mgr, NULL, &ci); nc != NULL;
+       nc = mg_next_conn(mgr, nc, &ci)) {
+    if (!mg_if_owns_conn(iface, nc)) continue;
+
+    /* Could have been flagged, or sent to, by another connection's handler */
+    if (nc->flags & MG_F_CLOSING_MASK) mg_mark_closing(nc);
+    if (nc->send_mbuf.len > 0) mg_mark_writing(nc);
 
     if (nc->sock != INVALID_SOCKET) {
       num_fds++;
@@ -3811,8 +5473,8 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
         mg_add_to_set(nc->sock, &read_set, &max_fd);
       }
 
-      if (((nc->flags & MG_F_CONNECTING) && !(nc->flags & MG_F_WANT_READ)) ||
-          (nc->send_mbuf.len > 0 && !(nc->flags & MG_F_CONNECTING))) {
+      /* The rest of write_set comes from mg_mgr::writing below */
+      if ((nc->flags & MG_F_CONNECTING) && !(nc->flags & MG_F_WANT_READ)) {
         mg_add_to_set(nc->sock, &write_set, &max_fd);
         mg_add_to_set(nc->sock, &err_set, &max_fd);
       }
@@ -3826,6 +5488,22 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
     }
   }
 
+  for (nc = LIST_FIRST(&mgr->writing); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, writing_link);
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if (nc->send_mbuf.len == 0 || nc->sock == INVALID_SOCKET) {
+      mg_unmark_writing(nc);
+    } else if (!(nc->flags & MG_F_CONNECTING)) {
+      mg_add_to_set(nc->sock, &write_set, &max_fd);
+      mg_add_to_set(nc->sock, &err_set, &max_fd);
+    }
+  }
+  /* Readiness of every socket is checked anyway, nothing to do here */
+  for (nc = LIST_FIRST(&mgr->work); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, work_link);
+    if (mg_if_owns_conn(iface, nc)) mg_unmark_work(nc);
+  }
+
   /*
    * If there is a timer to be fired earlier than the requested timeout,
    * adjust the timeout.
@@ -3836,6 +5514,15 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
       timeout_ms = (int) timer_timeout_ms;
     }
   }
+
+  /* Wake up when other interfaces of the manager have work to do. */
+  if (mgr->num_ifaces > 1) {
+    num_wait_socks = mg_if_get_wait_socks(iface, wait_socks, MG_MAX_WAIT_SOCKS);
+    if (num_wait_socks < 0) timeout_ms = 0;
+    for (i = 0; i < num_wait_socks; i++) {
+      mg_add_to_set(wait_socks[i], &read_set, &max_fd);
+    }
+  }
   if (timeout_ms < 0) timeout_ms = 0;
 
   tv.tv_sec = timeout_ms / 1000;
@@ -3850,13 +5537,15 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
 
 #if MG_ENABLE_BROADCAST
   if (num_ev > 0 && mgr->ctl[1] != INVALID_SOCKET &&
-      FD_ISSET(mgr->ctl[1], &read_set)) {
+      iface == mgr->ifaces[MG_MAIN_IFACE] && FD_ISSET(mgr->ctl[1], &read_set)) {
     mg_mgr_handle_ctl_sock(mgr);
   }
 #endif
 
   for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
     int fd_flags = 0;
+    tmp = nc->next;
+    if (!mg_if_owns_conn(iface, nc)) continue;
     if (nc->sock != INVALID_SOCKET) {
       if (num_ev > 0) {
         fd_flags = (FD_ISSET(nc->sock, &read_set) &&
@@ -3873,17 +5562,21 @@ time_t mg_socket_if_poll(struct mg_iface *iface, int timeout_ms) {
       }
 #endif
     }
-    tmp = nc->next;
+#if MG_ENABLE_CONN_PRIORITY
+    if (fd_flags != 0) {
+      mg_prio_enqueue(ready, nc, fd_flags, now);
+      continue;
+    }
+    nc->prio_ready_time = 0;
+#endif
     mg_mgr_handle_conn(nc, fd_flags, now);
+    if (nc->flags & MG_F_CLOSING_MASK) mg_mark_closing(nc);
   }
+#if MG_ENABLE_CONN_PRIORITY
+  mg_prio_dispatch(mgr, ready, now);
+#endif
 
-  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
-    tmp = nc->next;
-    if ((nc->flags & MG_F_CLOSE_IMMEDIATELY) ||
-        (nc->send_mbuf.len == 0 && (nc->flags & MG_F_SEND_AND_CLOSE))) {
-      mg_close_conn(nc);
-    }
-  }
+  mg_close_flagged(iface);
 
   return (time_t) now;
 }
@@ -3951,6 +5644,103 @@ int mg_socketpair(sock_t sp[2], int sock_type) {
 }
 #endif /* MG_ENABLE_BROADCAST */
 
+#if MG_ENABLE_LISTENER_HANDOFF
+/* Collects the listening sockets to hand off, marking them as handed off */
+static int mg_handoff_collect(struct mg_mgr *mgr, int *fds) {
+  struct mg_connection *nc;
+  int n = 0;
+  for (nc = mgr->active_connections; nc != NULL; nc = nc->next) {
+    if (!(nc->flags & MG_F_LISTENING) || nc->sock == INVALID_SOCKET ||
+        n >= MG_MAX_HANDOFF_SOCKS) {
+      continue;
+    }
+    nc->flags |= MG_F_HANDED_OFF;
+    fds[n++] = (int) nc->sock;
+  }
+  return n;
+}
+
+int mg_mgr_export_listeners(struct mg_mgr *mgr) {
+  int fds[MG_MAX_HANDOFF_SOCKS], i, n = mg_handoff_collect(mgr, fds);
+  char buf[MG_MAX_HANDOFF_SOCKS * 12] = "";
+  size_t len = 0;
+  for (i = 0; i < n; i++) {
+    fcntl(fds[i], F_SETFD, fcntl(fds[i], F_GETFD) & ~FD_CLOEXEC);
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%d", i ? "," : "", fds[i]);
+  }
+  setenv(MG_LISTEN_FDS_ENV, buf, 1);
+  return n;
+}
+
+int mg_mgr_send_listeners(struct mg_mgr *mgr, sock_t sock) {
+  int fds[MG_MAX_HANDOFF_SOCKS], n = mg_handoff_collect(mgr, fds);
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } ctl;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char count = (unsigned char) n;
+
+  /* One byte of payload: some systems do not pass ancillary data alone */
+  iov.iov_base = &count;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  memset(&ctl, 0, sizeof(ctl));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (n > 0) {
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+  }
+  return sendmsg(sock, &msg, 0) == 1 ? n : -1;
+}
+
+int mg_mgr_recv_listeners(struct mg_mgr *mgr, sock_t sock) {
+  int fds[MG_MAX_HANDOFF_SOCKS], i, n = 0;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } ctl;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned char count;
+
+  iov.iov_base = &count;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  if (recvmsg(sock, &msg, 0) != 1) return -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+  }
+  for (i = 0; i < n; i++) {
+    mg_set_close_on_exec(fds[i]);
+    if (mgr->num_handoff_socks < MG_MAX_HANDOFF_SOCKS) {
+      mgr->handoff_socks[mgr->num_handoff_socks++] = fds[i];
+    } else {
+      closesocket(fds[i]);
+    }
+  }
+  return n;
+}
+#endif /* MG_ENABLE_LISTENER_HANDOFF */
+
 static void mg_sock_get_addr(sock_t sock, int remote,
                              union socket_address *sa) {
   socklen_t slen = sizeof(*sa);
@@ -3968,6 +5758,70 @@ void mg_sock_to_str(sock_t sock, char *buf, size_t len, int flags) {
   mg_sock_addr_to_str(&sa, buf, len, flags);
 }
 
+#if MG_SOCKET_IF_EPOLL
+/*
+ * Exports an epoll instance that becomes readable when one of the sockets
+ * that mg_socket_if_poll() would select() on is ready. Interest is brought
+ * up to date on every call, at the cost of an epoll_ctl() per socket; this
+ * only happens for interfaces other than the main one.
+ */
+int mg_socket_if_get_wait_sock(struct mg_iface *iface, sock_t *sock) {
+  struct mg_mgr *mgr = iface->mgr;
+  struct mg_socket_if_data *d = (struct mg_socket_if_data *) iface->data;
+  struct mg_connection *nc;
+  struct epoll_event ev;
+  double now = mg_time();
+  int ci = 0;
+
+  if (d == NULL) {
+    if ((d = (struct mg_socket_if_data *) MG_CALLOC(1, sizeof(*d))) == NULL) {
+      return 0;
+    }
+    if ((d->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      MG_FREE(d);
+      return 0;
+    }
+    iface->data = d;
+  }
+
+  for (nc = mg_next_conn(mgr, NULL, &ci); nc != NULL;
+       nc = mg_next_conn(mgr, nc, &ci)) {
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if ((nc->flags & MG_F_CLOSING_MASK) ||
+        (nc->ev_timer_time > 0 && nc->ev_timer_time <= now)) {
+      return 1;
+    }
+    /* UDP peers share their listener's socket */
+    if (nc->sock == INVALID_SOCKET ||
+        ((nc->flags & MG_F_UDP) && nc->listener != NULL)) {
+      continue;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = nc->sock;
+    if (nc->flags & MG_F_CONNECTING) {
+      if (!(nc->flags & MG_F_WANT_READ)) ev.events |= EPOLLOUT;
+    } else if (nc->send_mbuf.len > 0) {
+      ev.events |= EPOLLOUT;
+    }
+    if (!(nc->flags & MG_F_WANT_WRITE) &&
+        nc->recv_mbuf.len < nc->recv_mbuf_limit) {
+      ev.events |= EPOLLIN;
+    }
+    if (ev.events == 0) {
+      epoll_ctl(d->epfd, EPOLL_CTL_DEL, nc->sock, &ev);
+    } else if (epoll_ctl(d->epfd, EPOLL_CTL_MOD, nc->sock, &ev) != 0 &&
+               errno == ENOENT) {
+      epoll_ctl(d->epfd, EPOLL_CTL_ADD, nc->sock, &ev);
+    }
+  }
+  *sock = d->epfd;
+  return 0;
+}
+#define MG_SOCKET_IF_GET_WAIT_SOCK mg_socket_if_get_wait_sock
+#else
+#define MG_SOCKET_IF_GET_WAIT_SOCK NULL
+#endif
+
 void mg_socket_if_get_conn_addr(struct mg_connection *nc, int remote,
                                 union socket_address *sa) {
   if ((nc->flags & MG_F_UDP) && remote) {
@@ -3996,6 +5850,10 @@ void mg_socket_if_get_conn_addr(struct mg_connection *nc, int remote,
     mg_socket_if_destroy_conn,                                          \
     mg_socket_if_sock_set,                                              \
     mg_socket_if_get_conn_addr,                                         \
+    mg_socket_if_tcp_send_mbuf,                                         \
+    MG_SOCKET_IF_GET_WAIT_SOCK,                                         \
+    NULL /* recv_view */,                                               \
+    NULL /* recv_consume */,                                            \
   }
 /* clang-format on */
 
@@ -4005,5945 +5863,9093 @@ const struct mg_iface_vtable mg_default_iface_vtable = MG_SOCKET_IFACE_VTABLE;
 #endif
 
 #endif /* MG_ENABLE_NET_IF_SOCKET */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_net_if_socks.c"
+#line 1 "mongoose/src/mg_net_if_uring.c"
 #endif
 /*
- * Copyright (c) 2014-2016 Cesanta Software Limited
+ * Copyright (c) 2014-2018 Cesanta Software Limited
  * All rights reserved
  */
 
-#if MG_ENABLE_SOCKS
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_CONN
 
-struct socksdata {
-  char *proxy_addr;        /* HOST:PORT of the socks5 proxy server */
-  struct mg_connection *s; /* Respective connection to the server */
-  struct mg_connection *c; /* Connection to the client */
-  struct mbuf tmp;         /* Temporary buffer for sent data */
+#if MG_ENABLE_NET_IF_URING && MG_ENABLE_NET_IF_SOCKET
+
+/* Amalgamated: #include "mg_net_if_uring.h" */
+/* Amalgamated: #include "mg_net_if_socket.h" */
+/* Amalgamated: #include "mg_internal.h" */
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0x8000
+#endif
+
+/* Not declared with strict _XOPEN_SOURCE */
+long syscall(long number, ...);
+
+#ifndef MG_URING_ENTRIES
+#define MG_URING_ENTRIES 256
+#endif
+
+/* Number of provided receive buffers, must be a power of 2 */
+#ifndef MG_URING_NUM_BUFS
+#define MG_URING_NUM_BUFS 64
+#endif
+
+#ifndef MG_URING_RECV_BUFFER_SIZE
+#define MG_URING_RECV_BUFFER_SIZE 4096
+#endif
+
+#define MG_URING_BGID 0
+
+/* Operation is encoded in the low bits of user_data */
+#define MG_URING_OP_ACCEPT 1
+#define MG_URING_OP_RECV 2
+#define MG_URING_OP_SEND 3
+#define MG_URING_OP_CONNECT 4
+#define MG_URING_OP_POLL 5
+#define MG_URING_OP_CTL 6
+#define MG_URING_OP_WAIT 7 /* Slot index in the upper bits */
+#define MG_URING_OP_MASK 7
+
+struct mg_uring_conn {
+  struct mg_connection *nc; /* NULL once the connection is destroyed */
+  struct mg_uring_conn *next; /* Destroyed, waiting for completions */
+  struct mbuf tx;             /* Data being sent, taken from send_mbuf */
+  union socket_address sa;    /* Connect address, must outlive the SQE */
+  int ops;                    /* Bit mask of operations in flight */
+  int cancelled;              /* Bit mask of operations being cancelled */
+  int poll_events;            /* Events the poll in flight waits for */
+  int fd_flags;               /* Readiness received during this poll */
 };
 
-static void socks_if_disband(struct socksdata *d) {
-  LOG(LL_DEBUG, ("disbanding proxy %p %p", d->c, d->s));
-  if (d->c) d->c->flags |= MG_F_SEND_AND_CLOSE;
-  if (d->s) d->s->flags |= MG_F_SEND_AND_CLOSE;
-  d->c = d->s = NULL;
+struct mg_uring_if_data {
+  int fd;
+  unsigned sq_entries, sq_tail;
+  unsigned *sq_khead, *sq_ktail, *sq_kmask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_khead, *cq_ktail, *cq_kmask;
+  struct io_uring_cqe *cqes;
+  void *ring;
+  size_t ring_size;
+
+  /* Provided buffers, bufs[bid] is handed to the core on receive */
+  struct io_uring_buf_ring *br;
+  unsigned short br_tail;
+  char *bufs[MG_URING_NUM_BUFS];
+
+  struct mg_uring_conn *zombies;
+  int ctl_armed, ctl_ready;
+
+  /* Earliest timer as of the last dispatch, see mg_uring_arm_all() */
+  double min_timer;
+  int num_timers;
+
+  /* Sockets of other interfaces being waited for */
+  sock_t wait_socks[MG_MAX_WAIT_SOCKS];
+};
+
+#define MG_URING_OP_BIT(op) (1 << (op))
+
+static int mg_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
 }
 
-static void socks_if_handler(struct mg_connection *c, int ev, void *ev_data) {
-  struct socksdata *d = (struct socksdata *) c->user_data;
-  if (ev == MG_EV_CONNECT) {
-    int res = *(int *) ev_data;
-    if (res == 0) {
-      /* Send handshake to the proxy server */
-      unsigned char buf[] = {MG_SOCKS_VERSION, 1, MG_SOCKS_HANDSHAKE_NOAUTH};
-      mg_send(d->s, buf, sizeof(buf));
-      LOG(LL_DEBUG, ("Sent handshake to %s", d->proxy_addr));
-    } else {
-      LOG(LL_ERROR, ("Cannot connect to %s: %d", d->proxy_addr, res));
-      d->c->flags |= MG_F_CLOSE_IMMEDIATELY;
-    }
-  } else if (ev == MG_EV_CLOSE) {
-    socks_if_disband(d);
-  } else if (ev == MG_EV_RECV) {
-    /* Handle handshake reply */
-    if (!(c->flags & MG_SOCKS_HANDSHAKE_DONE)) {
-      /* TODO(lsm): process IPv6 too */
-      unsigned char buf[10] = {MG_SOCKS_VERSION, MG_SOCKS_CMD_CONNECT, 0,
-                               MG_SOCKS_ADDR_IPV4};
-      if (c->recv_mbuf.len < 2) return;
-      if ((unsigned char) c->recv_mbuf.buf[1] == MG_SOCKS_HANDSHAKE_FAILURE) {
-        LOG(LL_ERROR, ("Server kicked us out"));
-        socks_if_disband(d);
-        return;
-      }
-      mbuf_remove(&c->recv_mbuf, 2);
-      c->flags |= MG_SOCKS_HANDSHAKE_DONE;
+static int mg_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void *arg, size_t argsz) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, arg, argsz);
+}
 
-      /* Send connect request */
-      memcpy(buf + 4, &d->c->sa.sin.sin_addr, 4);
-      memcpy(buf + 8, &d->c->sa.sin.sin_port, 2);
-      mg_send(c, buf, sizeof(buf));
-    }
-    /* Process connect request */
-    if ((c->flags & MG_SOCKS_HANDSHAKE_DONE) &&
-        !(c->flags & MG_SOCKS_CONNECT_DONE)) {
-      if (c->recv_mbuf.len < 10) return;
-      if (c->recv_mbuf.buf[1] != MG_SOCKS_SUCCESS) {
-        LOG(LL_ERROR, ("Socks connection error: %d", c->recv_mbuf.buf[1]));
-        socks_if_disband(d);
-        return;
-      }
-      mbuf_remove(&c->recv_mbuf, 10);
-      c->flags |= MG_SOCKS_CONNECT_DONE;
-      /* Connected. Move sent data from client, if any, to server */
-      if (d->s && d->c) {
-        mbuf_append(&d->s->send_mbuf, d->tmp.buf, d->tmp.len);
-        mbuf_free(&d->tmp);
-      }
-    }
-    /* All flags are set, we're in relay mode */
-    if ((c->flags & MG_SOCKS_CONNECT_DONE) && d->c && d->s) {
-      mbuf_append(&d->c->recv_mbuf, d->s->recv_mbuf.buf, d->s->recv_mbuf.len);
-      mbuf_remove(&d->s->recv_mbuf, d->s->recv_mbuf.len);
-    }
-  }
+static int mg_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
 }
 
-static void mg_socks_if_connect_tcp(struct mg_connection *c,
-                                    const union socket_address *sa) {
-  struct socksdata *d = (struct socksdata *) c->iface->data;
-  d->c = c;
-  d->s = mg_connect(c->mgr, d->proxy_addr, socks_if_handler);
-  d->s->user_data = d;
-  LOG(LL_DEBUG, ("%p %s", c, d->proxy_addr));
-  (void) sa;
+/* Submits prepared SQEs without waiting. Returns the number submitted. */
+static int mg_uring_flush(struct mg_uring_if_data *d) {
+  unsigned pending =
+      d->sq_tail - __atomic_load_n(d->sq_khead, __ATOMIC_ACQUIRE);
+  __atomic_store_n(d->sq_ktail, d->sq_tail, __ATOMIC_RELEASE);
+  return pending > 0 ? mg_uring_enter(d->fd, pending, 0, 0, NULL, 0) : 0;
 }
 
-static void mg_socks_if_connect_udp(struct mg_connection *c) {
-  (void) c;
-}
-
-static int mg_socks_if_listen_tcp(struct mg_connection *c,
-                                  union socket_address *sa) {
-  (void) c;
-  (void) sa;
-  return 0;
+static struct io_uring_sqe *mg_uring_get_sqe(struct mg_uring_if_data *d) {
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+  if (d->sq_tail - __atomic_load_n(d->sq_khead, __ATOMIC_ACQUIRE) >=
+      d->sq_entries) {
+    /* Queue is full, that's rare: submit what we have. */
+    if (mg_uring_flush(d) <= 0) return NULL;
+  }
+  idx = d->sq_tail & *d->sq_kmask;
+  sqe = &d->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  d->sq_array[idx] = idx;
+  d->sq_tail++;
+  return sqe;
 }
 
-static int mg_socks_if_listen_udp(struct mg_connection *c,
-                                  union socket_address *sa) {
-  (void) c;
-  (void) sa;
-  return -1;
+static struct io_uring_sqe *mg_uring_prep(struct mg_uring_if_data *d,
+                                          struct mg_uring_conn *cs, int op,
+                                          int opcode, int fd) {
+  struct io_uring_sqe *sqe = mg_uring_get_sqe(d);
+  if (sqe == NULL) return NULL;
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uintptr_t) cs | op;
+  cs->ops |= MG_URING_OP_BIT(op);
+  cs->cancelled &= ~MG_URING_OP_BIT(op);
+  return sqe;
 }
 
-static void mg_socks_if_tcp_send(struct mg_connection *c, const void *buf,
-                                 size_t len) {
-  struct socksdata *d = (struct socksdata *) c->iface->data;
-  LOG(LL_DEBUG, ("%p -> %p %d %d", c, buf, (int) len, (int) c->send_mbuf.len));
-  if (d && d->s && d->s->flags & MG_SOCKS_CONNECT_DONE) {
-    mbuf_append(&d->s->send_mbuf, d->tmp.buf, d->tmp.len);
-    mbuf_append(&d->s->send_mbuf, buf, len);
-    mbuf_free(&d->tmp);
-  } else {
-    mbuf_append(&d->tmp, buf, len);
+static void mg_uring_cancel(struct mg_uring_if_data *d,
+                            struct mg_uring_conn *cs, int op) {
+  struct io_uring_sqe *sqe;
+  if (!(cs->ops & MG_URING_OP_BIT(op)) ||
+      (cs->cancelled & MG_URING_OP_BIT(op)) ||
+      (sqe = mg_uring_get_sqe(d)) == NULL) {
+    return;
   }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t) cs | op;
+  sqe->user_data = 0; /* Completion is ignored */
+  cs->cancelled |= MG_URING_OP_BIT(op);
 }
 
-static void mg_socks_if_udp_send(struct mg_connection *c, const void *buf,
-                                 size_t len) {
-  (void) c;
-  (void) buf;
-  (void) len;
+static void mg_uring_add_buf(struct mg_uring_if_data *d, unsigned short bid) {
+  struct io_uring_buf *b =
+      &d->br->bufs[d->br_tail & (MG_URING_NUM_BUFS - 1)];
+  b->addr = (uintptr_t) d->bufs[bid];
+  b->len = MG_URING_RECV_BUFFER_SIZE;
+  b->bid = bid;
+  d->br_tail++;
 }
 
-static void mg_socks_if_recved(struct mg_connection *c, size_t len) {
-  (void) c;
-  (void) len;
+/* Allocates buffers that were handed to the core or failed to allocate. */
+static void mg_uring_refill_bufs(struct mg_uring_if_data *d) {
+  unsigned short bid;
+  for (bid = 0; bid < MG_URING_NUM_BUFS; bid++) {
+    if (d->bufs[bid] != NULL) continue;
+    if ((d->bufs[bid] = (char *) MG_MALLOC(MG_URING_RECV_BUFFER_SIZE)) == NULL) {
+      break;
+    }
+    mg_uring_add_buf(d, bid);
+  }
+  __atomic_store_n(&d->br->tail, d->br_tail, __ATOMIC_RELEASE);
 }
 
-static int mg_socks_if_create_conn(struct mg_connection *c) {
-  (void) c;
-  return 1;
+/* Plain TCP connections use native io_uring operations. */
+static int mg_uring_is_native(struct mg_connection *nc) {
+  return nc->sock != INVALID_SOCKET &&
+         !(nc->flags & (MG_F_UDP | MG_F_SSL | MG_F_RESOLVING));
 }
 
-static void mg_socks_if_destroy_conn(struct mg_connection *c) {
-  c->iface->vtable->free(c->iface);
-  MG_FREE(c->iface);
-  c->iface = NULL;
-  LOG(LL_DEBUG, ("%p", c));
+static struct mg_uring_conn *mg_uring_conn_state(struct mg_connection *nc) {
+  /* Connections made with mg_add_sock() don't go through create_conn. */
+  if (nc->mgr_data == NULL && nc->iface->vtable == &mg_uring_iface_vtable) {
+    struct mg_uring_conn *cs =
+        (struct mg_uring_conn *) MG_CALLOC(1, sizeof(*cs));
+    if (cs == NULL) return NULL;
+    cs->nc = nc;
+    nc->mgr_data = cs;
+  }
+  return (struct mg_uring_conn *) nc->mgr_data;
 }
 
-static void mg_socks_if_sock_set(struct mg_connection *c, sock_t sock) {
-  (void) c;
-  (void) sock;
+/* Taken from send_mbuf by a send that has not completed yet */
+MG_INTERNAL size_t mg_uring_in_flight(struct mg_connection *nc) {
+  struct mg_uring_conn *cs = (struct mg_uring_conn *) nc->mgr_data;
+  if (cs == NULL || nc->iface->vtable != &mg_uring_iface_vtable) return 0;
+  return cs->tx.len;
 }
 
-static void mg_socks_if_init(struct mg_iface *iface) {
-  (void) iface;
+static void mg_uring_free_conn_state(struct mg_uring_conn *cs) {
+  mbuf_free(&cs->tx);
+  MG_FREE(cs);
 }
 
-static void mg_socks_if_free(struct mg_iface *iface) {
-  struct socksdata *d = (struct socksdata *) iface->data;
-  LOG(LL_DEBUG, ("%p", iface));
-  if (d != NULL) {
-    socks_if_disband(d);
-    mbuf_free(&d->tmp);
-    MG_FREE(d->proxy_addr);
-    MG_FREE(d);
-    iface->data = NULL;
-  }
-}
+void mg_uring_if_init(struct mg_iface *iface) {
+  struct mg_uring_if_data *d;
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  struct utsname u;
+  int major = 0, minor = 0, i;
+  const unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                        IORING_FEAT_EXT_ARG;
 
-static void mg_socks_if_add_conn(struct mg_connection *c) {
-  c->sock = INVALID_SOCKET;
-}
+  mg_socket_if_init(iface);
 
-static void mg_socks_if_remove_conn(struct mg_connection *c) {
-  (void) c;
-}
+  /* Multishot receive, the newest feature we use, appeared in 6.0 */
+  if (uname(&u) != 0 || sscanf(u.release, "%d.%d", &major, &minor) != 2 ||
+      major < 6 || (d = (struct mg_uring_if_data *) MG_CALLOC(
+                        1, sizeof(*d))) == NULL) {
+    goto fallback;
+  }
+  memset(&p, 0, sizeof(p));
+  if ((d->fd = mg_uring_setup(MG_URING_ENTRIES, &p)) < 0) {
+    MG_FREE(d);
+    goto fallback;
+  }
+  d->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  if (d->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(*d->cqes)) {
+    d->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(*d->cqes);
+  }
+  d->sq_entries = p.sq_entries;
+  d->ring = d->br = NULL;
+  d->sqes = NULL;
+  if ((p.features & need) != need ||
+      (d->ring = mmap(NULL, d->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, d->fd, IORING_OFF_SQ_RING)) ==
+          MAP_FAILED ||
+      (d->sqes = (struct io_uring_sqe *) mmap(
+           NULL, p.sq_entries * sizeof(*d->sqes), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, d->fd, IORING_OFF_SQES)) ==
+          MAP_FAILED ||
+      (d->br = (struct io_uring_buf_ring *) mmap(
+           NULL, MG_URING_NUM_BUFS * sizeof(struct io_uring_buf),
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) ==
+          MAP_FAILED) {
+    goto fail;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t) d->br;
+  reg.ring_entries = MG_URING_NUM_BUFS;
+  reg.bgid = MG_URING_BGID;
+  if (mg_uring_register(d->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    goto fail;
+  }
+
+  d->sq_khead = (unsigned *) ((char *) d->ring + p.sq_off.head);
+  d->sq_ktail = (unsigned *) ((char *) d->ring + p.sq_off.tail);
+  d->sq_kmask = (unsigned *) ((char *) d->ring + p.sq_off.ring_mask);
+  d->sq_array = (unsigned *) ((char *) d->ring + p.sq_off.array);
+  d->cq_khead = (unsigned *) ((char *) d->ring + p.cq_off.head);
+  d->cq_ktail = (unsigned *) ((char *) d->ring + p.cq_off.tail);
+  d->cq_kmask = (unsigned *) ((char *) d->ring + p.cq_off.ring_mask);
+  d->cqes = (struct io_uring_cqe *) ((char *) d->ring + p.cq_off.cqes);
+  d->sq_tail = *d->sq_ktail;
+  for (i = 0; i < MG_MAX_WAIT_SOCKS; i++) d->wait_socks[i] = INVALID_SOCKET;
+  mg_uring_refill_bufs(d);
+
+  iface->data = d;
+  DBG(("%p using io_uring, %u entries", iface->mgr, p.sq_entries));
+  return;
+
+fail:
+  if (d->br != NULL && d->br != MAP_FAILED) {
+    munmap(d->br, MG_URING_NUM_BUFS * sizeof(struct io_uring_buf));
+  }
+  if (d->sqes != NULL && d->sqes != MAP_FAILED) {
+    munmap(d->sqes, d->sq_entries * sizeof(*d->sqes));
+  }
+  if (d->ring != NULL && d->ring != MAP_FAILED) munmap(d->ring, d->ring_size);
+  close(d->fd);
+  MG_FREE(d);
+fallback:
+  LOG(LL_INFO, ("io_uring is not available, falling back to select()"));
+  iface->vtable = &mg_socket_iface_vtable;
+}
+
+static void mg_uring_handle_cqe(struct mg_uring_if_data *d,
+                                struct io_uring_cqe *cqe);
+
+static void mg_uring_reap(struct mg_uring_if_data *d) {
+  unsigned head = *d->cq_khead;
+  while (head != __atomic_load_n(d->cq_ktail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = d->cqes[head & *d->cq_kmask];
+    __atomic_store_n(d->cq_khead, ++head, __ATOMIC_RELEASE);
+    mg_uring_handle_cqe(d, &cqe);
+  }
+  mg_uring_refill_bufs(d);
+}
+
+void mg_uring_if_free(struct mg_iface *iface) {
+  struct mg_uring_if_data *d = (struct mg_uring_if_data *) iface->data;
+  struct io_uring_sqe *sqe;
+  unsigned short bid;
+  int i;
+  if (d == NULL) return;
 
-static time_t mg_socks_if_poll(struct mg_iface *iface, int timeout_ms) {
-  LOG(LL_DEBUG, ("%p", iface));
-  (void) iface;
-  (void) timeout_ms;
-  return (time_t) cs_time();
+  /*
+   * Kernel may still be using send buffers of destroyed connections.
+   * Cancel everything and wait for it to settle before freeing them.
+   */
+  if (d->zombies != NULL && (sqe = mg_uring_get_sqe(d)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  }
+  mg_uring_flush(d);
+  for (i = 0; i < 100 && d->zombies != NULL; i++) {
+    struct __kernel_timespec ts = {0, 10000000};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uintptr_t) &ts;
+    mg_uring_enter(d->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg));
+    mg_uring_reap(d);
+  }
+  close(d->fd);
+  while (d->zombies != NULL) {
+    struct mg_uring_conn *cs = d->zombies;
+    d->zombies = cs->next;
+    mg_uring_free_conn_state(cs);
+  }
+  for (bid = 0; bid < MG_URING_NUM_BUFS; bid++) MG_FREE(d->bufs[bid]);
+  munmap(d->br, MG_URING_NUM_BUFS * sizeof(struct io_uring_buf));
+  munmap(d->sqes, d->sq_entries * sizeof(*d->sqes));
+  munmap(d->ring, d->ring_size);
+  MG_FREE(d);
+  iface->data = NULL;
 }
 
-static void mg_socks_if_get_conn_addr(struct mg_connection *c, int remote,
-                                      union socket_address *sa) {
-  LOG(LL_DEBUG, ("%p", c));
-  (void) c;
-  (void) remote;
-  (void) sa;
+void mg_uring_if_add_conn(struct mg_connection *nc) {
+  mg_mark_work(nc);
 }
 
-const struct mg_iface_vtable mg_socks_iface_vtable = {
-    mg_socks_if_init,        mg_socks_if_free,
-    mg_socks_if_add_conn,    mg_socks_if_remove_conn,
-    mg_socks_if_poll,        mg_socks_if_listen_tcp,
-    mg_socks_if_listen_udp,  mg_socks_if_connect_tcp,
-    mg_socks_if_connect_udp, mg_socks_if_tcp_send,
-    mg_socks_if_udp_send,    mg_socks_if_recved,
-    mg_socks_if_create_conn, mg_socks_if_destroy_conn,
-    mg_socks_if_sock_set,    mg_socks_if_get_conn_addr,
-};
-
-struct mg_iface *mg_socks_mk_iface(struct mg_mgr *mgr, const char *proxy_addr) {
-  struct mg_iface *iface = mg_if_create_iface(&mg_socks_iface_vtable, mgr);
-  iface->data = MG_CALLOC(1, sizeof(struct socksdata));
-  ((struct socksdata *) iface->data)->proxy_addr = strdup(proxy_addr);
-  return iface;
+void mg_uring_if_remove_conn(struct mg_connection *nc) {
+  (void) nc;
 }
 
-#endif
-#ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_ssl_if_openssl.c"
-#endif
-/*
- * Copyright (c) 2014-2016 Cesanta Software Limited
- * All rights reserved
- */
+int mg_uring_if_listen_tcp(struct mg_connection *nc, union socket_address *sa) {
+  return mg_socket_if_listen_tcp(nc, sa);
+}
 
-#if MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_OPENSSL
+void mg_uring_if_connect_tcp(struct mg_connection *nc,
+                             const union socket_address *sa) {
+  struct mg_uring_if_data *d = (struct mg_uring_if_data *) nc->iface->data;
+  struct mg_uring_conn *cs = mg_uring_conn_state(nc);
+  struct io_uring_sqe *sqe;
 
-#ifdef __APPLE__
-#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+  if (nc->flags & MG_F_SSL) {
+    /* SSL is driven by readiness, same as with the socket interface. */
+    mg_socket_if_connect_tcp(nc, sa);
+    return;
+  }
+  if (cs == NULL ||
+      (nc->sock = socket(sa->sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) ==
+          INVALID_SOCKET) {
+    nc->err = mg_get_errno() ? mg_get_errno() : 1;
+    return;
+  }
+  mg_set_non_blocking_mode(nc->sock);
+  mg_apply_sock_opts(nc, nc->sock);
+#ifdef TCP_FASTOPEN_CONNECT
+  if (nc->sock_opts.fastopen) {
+    mg_set_sock_opt(nc->sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+  }
 #endif
+  cs->sa = *sa;
+  sqe = mg_uring_prep(d, cs, MG_URING_OP_CONNECT, IORING_OP_CONNECT, nc->sock);
+  if (sqe == NULL) {
+    nc->err = EAGAIN;
+    return;
+  }
+  sqe->addr = (uintptr_t) &cs->sa.sa;
+  sqe->off = mg_sa_len(&cs->sa);
+  nc->err = 0;
+}
 
-#include <openssl/ssl.h>
+void mg_uring_if_tcp_send(struct mg_connection *nc, const void *buf,
+                          size_t len) {
+  mbuf_append(&nc->send_mbuf, buf, len);
+}
 
-struct mg_ssl_if_ctx {
-  SSL *ssl;
-  SSL_CTX *ssl_ctx;
-  struct mbuf psk;
-  size_t identity_len;
-};
+struct mbuf *mg_uring_if_tcp_send_mbuf(struct mg_connection *nc) {
+  return &nc->send_mbuf;
+}
 
-void mg_ssl_if_init() {
-  SSL_library_init();
+void mg_uring_if_recved(struct mg_connection *nc, size_t len) {
+  (void) nc;
+  (void) len;
 }
 
-enum mg_ssl_if_result mg_ssl_if_conn_accept(struct mg_connection *nc,
-                                            struct mg_connection *lc) {
-  struct mg_ssl_if_ctx *ctx =
-      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
-  struct mg_ssl_if_ctx *lc_ctx = (struct mg_ssl_if_ctx *) lc->ssl_if_data;
-  nc->ssl_if_data = ctx;
-  if (ctx == NULL || lc_ctx == NULL) return MG_SSL_ERROR;
-  ctx->ssl_ctx = lc_ctx->ssl_ctx;
-  if ((ctx->ssl = SSL_new(ctx->ssl_ctx)) == NULL) {
-    return MG_SSL_ERROR;
-  }
-  return MG_SSL_OK;
+int mg_uring_if_create_conn(struct mg_connection *nc) {
+  return mg_uring_conn_state(nc) != NULL;
 }
 
-static enum mg_ssl_if_result mg_use_cert(SSL_CTX *ctx, const char *cert,
-                                         const char *key, const char **err_msg);
-static enum mg_ssl_if_result mg_use_ca_cert(SSL_CTX *ctx, const char *cert);
-static enum mg_ssl_if_result mg_set_cipher_list(SSL_CTX *ctx, const char *cl);
-static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
-                                                    const char *identity,
-                                                    const char *key_str);
+void mg_uring_if_destroy_conn(struct mg_connection *nc) {
+  struct mg_uring_if_data *d = (struct mg_uring_if_data *) nc->iface->data;
+  struct mg_uring_conn *cs = (struct mg_uring_conn *) nc->mgr_data;
+  /* UDP "connections" of a listener share its socket. */
+  int own_sock = !((nc->flags & MG_F_UDP) && nc->listener != NULL);
+  int op;
 
-enum mg_ssl_if_result mg_ssl_if_conn_init(
-    struct mg_connection *nc, const struct mg_ssl_if_conn_params *params,
-    const char **err_msg) {
-  struct mg_ssl_if_ctx *ctx =
-      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
-  DBG(("%p %s,%s,%s", nc, (params->cert ? params->cert : ""),
-       (params->key ? params->key : ""),
-       (params->ca_cert ? params->ca_cert : "")));
-  if (ctx == NULL) {
-    MG_SET_PTRPTR(err_msg, "Out of memory");
-    return MG_SSL_ERROR;
-  }
-  nc->ssl_if_data = ctx;
-  if (nc->flags & MG_F_LISTENING) {
-    ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
-  } else {
-    ctx->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  if (cs != NULL) {
+    nc->mgr_data = NULL;
+    cs->nc = NULL;
+    if (cs->ops == 0) {
+      mg_uring_free_conn_state(cs);
+    } else {
+      for (op = MG_URING_OP_ACCEPT; op <= MG_URING_OP_POLL; op++) {
+        mg_uring_cancel(d, cs, op);
+      }
+      /* Wakes up operations if cancellation could not be queued. */
+      if (own_sock && nc->sock != INVALID_SOCKET) shutdown(nc->sock, SHUT_RDWR);
+      cs->next = d->zombies;
+      d->zombies = cs;
+    }
   }
-  if (ctx->ssl_ctx == NULL) {
-    MG_SET_PTRPTR(err_msg, "Failed to create SSL context");
-    return MG_SSL_ERROR;
+  if (nc->sock != INVALID_SOCKET && own_sock) closesocket(nc->sock);
+#if MG_ENABLE_UNIX_SOCKETS
+  if ((nc->flags & MG_F_LISTENING) && !(nc->flags & MG_F_HANDED_OFF) &&
+      nc->sa.sa.sa_family == AF_UNIX && nc->sa.un.sun_path[0] != '\0') {
+    unlink(nc->sa.un.sun_path);
   }
-
-#ifndef KR_VERSION
-  /* Disable deprecated protocols. */
-  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv2);
-  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv3);
-  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_TLSv1);
-#ifdef MG_SSL_OPENSSL_NO_COMPRESSION
-  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_COMPRESSION);
-#endif
-#ifdef MG_SSL_OPENSSL_CIPHER_SERVER_PREFERENCE
-  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
-#endif
-#else
-/* Krypton only supports TLSv1.2 anyway. */
 #endif
+  nc->sock = INVALID_SOCKET;
+}
 
-  if (params->cert != NULL &&
-      mg_use_cert(ctx->ssl_ctx, params->cert, params->key, err_msg) !=
-          MG_SSL_OK) {
-    return MG_SSL_ERROR;
-  }
+void mg_uring_if_sock_set(struct mg_connection *nc, sock_t sock) {
+  mg_socket_if_sock_set(nc, sock);
+  mg_mark_work(nc);
+}
 
-  if (params->ca_cert != NULL &&
-      mg_use_ca_cert(ctx->ssl_ctx, params->ca_cert) != MG_SSL_OK) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL CA cert");
-    return MG_SSL_ERROR;
+static void mg_uring_accept(struct mg_connection *lc, int sock) {
+  struct mg_connection *nc = mg_if_accept_new_conn(lc);
+  union socket_address sa;
+  socklen_t sa_len = sizeof(sa);
+  if (nc == NULL) {
+    closesocket(sock);
+    return;
   }
+  mg_sock_set(nc, sock);
+  memset(&sa, 0, sizeof(sa));
+  getpeername(sock, &sa.sa, &sa_len);
+  mg_if_accept_tcp_cb(nc, &sa, sa_len);
+}
 
-  if (params->server_name != NULL) {
-#ifdef KR_VERSION
-    SSL_CTX_kr_set_verify_name(ctx->ssl_ctx, params->server_name);
-#else
-/* TODO(rojer): Implement server name verification on OpenSSL. */
-#endif
-  }
+static void mg_uring_sent(struct mg_connection *nc, struct mg_uring_conn *cs,
+                          int res) {
+  struct mbuf *io = &nc->send_mbuf;
+  /* Put in-flight data back in front of whatever was queued meanwhile. */
+  if (io->len > 0) {
+    mbuf_append(&cs->tx, io->buf, io->len);
+    if (cs->tx.len < io->len) res = -1; /* OOM */
+  }
+  mbuf_free(io);
+  *io = cs->tx;
+  mbuf_init(&cs->tx, 0);
+  mg_if_sent_cb(nc, res < 0 ? -1 : res);
+  mg_sock_uncork(nc, res);
+}
+
+static void mg_uring_handle_cqe(struct mg_uring_if_data *d,
+                                struct io_uring_cqe *cqe) {
+  struct mg_uring_conn *cs =
+      (struct mg_uring_conn *) (uintptr_t)(cqe->user_data & ~MG_URING_OP_MASK);
+  struct mg_connection *nc;
+  int op = (int) (cqe->user_data & MG_URING_OP_MASK), res = cqe->res;
+  int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  char *buf = NULL;
 
-  if (mg_set_cipher_list(ctx->ssl_ctx, params->cipher_suites) != MG_SSL_OK) {
-    MG_SET_PTRPTR(err_msg, "Invalid cipher suite list");
-    return MG_SSL_ERROR;
+  if (op == MG_URING_OP_CTL) {
+    d->ctl_armed = 0;
+    d->ctl_ready = 1;
+    return;
+  } else if (op == MG_URING_OP_WAIT) {
+    d->wait_socks[cqe->user_data >> 3] = INVALID_SOCKET;
+    return;
   }
+  if (cs == NULL || op == 0) return; /* Cancellation */
+  nc = cs->nc;
+  if (nc != NULL) mg_mark_work(nc);
 
-  mbuf_init(&ctx->psk, 0);
-  if (mg_ssl_if_ossl_set_psk(ctx, params->psk_identity, params->psk_key) !=
-      MG_SSL_OK) {
-    MG_SET_PTRPTR(err_msg, "Invalid PSK settings");
-    return MG_SSL_ERROR;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    buf = d->bufs[bid];
+    if (nc != NULL && res > 0) {
+      d->bufs[bid] = NULL; /* Handed to the core, replaced on refill */
+    } else {
+      mg_uring_add_buf(d, bid);
+      buf = NULL;
+    }
   }
+  if (!more) cs->ops &= ~MG_URING_OP_BIT(op);
 
-  if (!(nc->flags & MG_F_LISTENING) &&
-      (ctx->ssl = SSL_new(ctx->ssl_ctx)) == NULL) {
-    MG_SET_PTRPTR(err_msg, "Failed to create SSL session");
-    return MG_SSL_ERROR;
+  if (nc == NULL) {
+    if (op == MG_URING_OP_ACCEPT && res >= 0) closesocket(res);
+    if (cs->ops == 0) {
+      struct mg_uring_conn **p = &d->zombies;
+      while (*p != cs) p = &(*p)->next;
+      *p = cs->next;
+      mg_uring_free_conn_state(cs);
+    }
+    return;
   }
 
-  nc->flags |= MG_F_SSL;
-
-  return MG_SSL_OK;
-}
-
-static enum mg_ssl_if_result mg_ssl_if_ssl_err(struct mg_connection *nc,
-                                               int res) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int err = SSL_get_error(ctx->ssl, res);
-  if (err == SSL_ERROR_WANT_READ) return MG_SSL_WANT_READ;
-  if (err == SSL_ERROR_WANT_WRITE) return MG_SSL_WANT_WRITE;
-  DBG(("%p %p SSL error: %d %d", nc, ctx->ssl_ctx, res, err));
-  nc->err = err;
-  return MG_SSL_ERROR;
+  switch (op) {
+    case MG_URING_OP_ACCEPT:
+      if (res >= 0) {
+        mg_uring_accept(nc, res);
+      } else if (res != -ECANCELED) {
+        DBG(("%p failed to accept: %d", nc, -res));
+      }
+      break;
+    case MG_URING_OP_RECV:
+      DBG(("%p %d bytes (URING) <- %d", nc, res, nc->sock));
+      if (res > 0) {
+        mg_if_recv_tcp_cb(nc, buf, res, 1 /* own */);
+      } else if (res == 0) {
+        /* Orderly shutdown of the socket, try flushing output. */
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+      } else if (res != -ECANCELED && res != -ENOBUFS) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      break;
+    case MG_URING_OP_SEND:
+      DBG(("%p %d bytes -> %d (URING)", nc, res, nc->sock));
+      mg_uring_sent(nc, cs, res);
+      break;
+    case MG_URING_OP_CONNECT:
+      mg_if_connect_cb(nc, res < 0 ? -res : 0);
+      break;
+    case MG_URING_OP_POLL:
+      cs->poll_events = 0;
+      if (res > 0) {
+        cs->fd_flags |= (res & (POLLIN | POLLHUP | POLLERR) ? _MG_F_FD_CAN_READ
+                                                            : 0) |
+                        (res & POLLOUT ? _MG_F_FD_CAN_WRITE : 0) |
+                        (res & POLLERR ? _MG_F_FD_ERROR : 0);
+      }
+      break;
+  }
 }
 
-enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int server_side = (nc->listener != NULL);
-  int res;
-  /* If descriptor is not yet set, do it now. */
-  if (SSL_get_fd(ctx->ssl) < 0) {
-    if (SSL_set_fd(ctx->ssl, nc->sock) != 1) return MG_SSL_ERROR;
+/*
+ * Queues operations the connection needs and that aren't in flight yet.
+ * Returns 1 if it has to be looked at again before the next wait even
+ * without a completion: its receive buffer is full, or the SQ was.
+ */
+static int mg_uring_arm(struct mg_uring_if_data *d, struct mg_connection *nc) {
+  struct mg_uring_conn *cs = mg_uring_conn_state(nc);
+  struct io_uring_sqe *sqe;
+  int events = 0, again = 0;
+
+  if (cs == NULL || nc->sock == INVALID_SOCKET ||
+      (nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    return 0;
   }
-  res = server_side ? SSL_accept(ctx->ssl) : SSL_connect(ctx->ssl);
-  if (res != 1) return mg_ssl_if_ssl_err(nc, res);
-  return MG_SSL_OK;
-}
 
-int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int n = SSL_read(ctx->ssl, buf, buf_size);
-  DBG(("%p %d -> %d", nc, (int) buf_size, n));
-  if (n < 0) return mg_ssl_if_ssl_err(nc, n);
-  if (n == 0) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-  return n;
-}
+  if (!mg_uring_is_native(nc)) {
+    /* Same conditions as select() sets of the socket interface */
+    if (!(nc->flags & MG_F_WANT_WRITE) &&
+        nc->recv_mbuf.len < nc->recv_mbuf_limit &&
+        (!(nc->flags & MG_F_UDP) || nc->listener == NULL)) {
+      events |= POLLIN;
+    }
+    again = nc->recv_mbuf.len >= nc->recv_mbuf_limit;
+    if (((nc->flags & MG_F_CONNECTING) && !(nc->flags & MG_F_WANT_READ)) ||
+        (nc->send_mbuf.len > 0 && !(nc->flags & MG_F_CONNECTING))) {
+      events |= POLLOUT;
+    }
+    if (events == 0 || (events & ~cs->poll_events) == 0) return again;
+    if (cs->ops & MG_URING_OP_BIT(MG_URING_OP_POLL)) {
+      /* Widen the poll in flight */
+      if ((sqe = mg_uring_get_sqe(d)) == NULL) return 1;
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = (uintptr_t) cs | MG_URING_OP_POLL;
+      sqe->len = IORING_POLL_UPDATE_EVENTS;
+      sqe->poll32_events = events | cs->poll_events;
+      sqe->user_data = 0;
+    } else {
+      sqe = mg_uring_prep(d, cs, MG_URING_OP_POLL, IORING_OP_POLL_ADD,
+                          nc->sock);
+      if (sqe == NULL) return 1;
+      sqe->poll32_events = events;
+    }
+    cs->poll_events |= events;
+    return again;
+  }
 
-int mg_ssl_if_write(struct mg_connection *nc, const void *data, size_t len) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int n = SSL_write(ctx->ssl, data, len);
-  DBG(("%p %d -> %d", nc, (int) len, n));
-  if (n <= 0) return mg_ssl_if_ssl_err(nc, n);
-  return n;
-}
+  if (nc->flags & MG_F_LISTENING) {
+    if (!(cs->ops & MG_URING_OP_BIT(MG_URING_OP_ACCEPT))) {
+      sqe = mg_uring_prep(d, cs, MG_URING_OP_ACCEPT, IORING_OP_ACCEPT,
+                          nc->sock);
+      if (sqe == NULL) return 1;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_CLOEXEC;
+    }
+    return 0;
+  }
+  if (nc->flags & MG_F_CONNECTING) return 0;
 
-void mg_ssl_if_conn_close_notify(struct mg_connection *nc) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  if (ctx == NULL) return;
-  SSL_shutdown(ctx->ssl);
+  if (nc->recv_mbuf.len < nc->recv_mbuf_limit) {
+    if (!(cs->ops & MG_URING_OP_BIT(MG_URING_OP_RECV))) {
+      sqe = mg_uring_prep(d, cs, MG_URING_OP_RECV, IORING_OP_RECV, nc->sock);
+      if (sqe == NULL) return 1;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = MG_URING_BGID;
+    }
+  } else {
+    /* Receive buffer is full, stop reading until it's consumed. */
+    mg_uring_cancel(d, cs, MG_URING_OP_RECV);
+    again = 1;
+  }
+
+  if (nc->send_mbuf.len > 0 && !(cs->ops & MG_URING_OP_BIT(MG_URING_OP_SEND))) {
+    sqe = mg_uring_prep(d, cs, MG_URING_OP_SEND, IORING_OP_SEND, nc->sock);
+    if (sqe == NULL) return 1;
+    /*
+     * Core may append to (and reallocate) send_mbuf while the kernel is
+     * sending, so the buffer is taken over until the send completes.
+     */
+    cs->tx = nc->send_mbuf;
+    mbuf_init(&nc->send_mbuf, 0);
+    sqe->addr = (uintptr_t) cs->tx.buf;
+    sqe->len = cs->tx.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  return again;
 }
 
-void mg_ssl_if_conn_free(struct mg_connection *nc) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  if (ctx == NULL) return;
-  nc->ssl_if_data = NULL;
-  if (ctx->ssl != NULL) SSL_free(ctx->ssl);
-  if (ctx->ssl_ctx != NULL && nc->listener == NULL) SSL_CTX_free(ctx->ssl_ctx);
-  mbuf_free(&ctx->psk);
-  memset(ctx, 0, sizeof(*ctx));
-  MG_FREE(ctx);
+static int mg_uring_sending(struct mg_connection *nc) {
+  struct mg_uring_conn *cs = (struct mg_uring_conn *) nc->mgr_data;
+  return cs != NULL && (cs->ops & MG_URING_OP_BIT(MG_URING_OP_SEND));
 }
 
 /*
- * Cipher suite options used for TLS negotiation.
- * https://wiki.mozilla.org/Security/Server_Side_TLS#Recommended_configurations
+ * Polls sockets of the other interfaces of the manager. Returns 0 if the
+ * wait must not block.
  */
-static const char mg_s_cipher_list[] =
-#if defined(MG_SSL_CRYPTO_MODERN)
-    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
-    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
-    "DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:"
-    "ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:"
-    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:"
-    "ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:"
-    "DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:"
-    "DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:"
-    "!aNULL:!eNULL:!EXPORT:!DES:!RC4:!3DES:!MD5:!PSK"
-#elif defined(MG_SSL_CRYPTO_OLD)
-    "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:"
-    "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:"
-    "DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:"
-    "ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:"
-    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:"
-    "ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:"
-    "DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:"
-    "DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:ECDHE-RSA-DES-CBC3-SHA:"
-    "ECDHE-ECDSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:"
-    "AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:AES:DES-CBC3-SHA:"
-    "HIGH:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK:!aECDH:"
-    "!EDH-DSS-DES-CBC3-SHA:!EDH-RSA-DES-CBC3-SHA:!KRB5-DES-CBC3-SHA"
-#else /* Default - intermediate. */
-    "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:"
-    "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:"
-    "DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:"
-    "ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:"
-    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:"
-    "ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:"
-    "DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:"
-    "DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:"
-    "AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:AES:CAMELLIA:"
-    "DES-CBC3-SHA:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK:!aECDH:"
-    "!EDH-DSS-DES-CBC3-SHA:!EDH-RSA-DES-CBC3-SHA:!KRB5-DES-CBC3-SHA"
-#endif
-    ;
+static int mg_uring_arm_wait_socks(struct mg_uring_if_data *d,
+                                   struct mg_iface *iface) {
+  sock_t socks[MG_MAX_WAIT_SOCKS];
+  struct io_uring_sqe *sqe;
+  int i, n = mg_if_get_wait_socks(iface, socks, MG_MAX_WAIT_SOCKS), ok = 1;
+  for (i = 0; i < MG_MAX_WAIT_SOCKS; i++) {
+    sock_t sock = i < n ? socks[i] : INVALID_SOCKET;
+    if (d->wait_socks[i] == sock) continue;
+    if (d->wait_socks[i] != INVALID_SOCKET) {
+      /* Socket has changed, slot will be reused once the poll is gone. */
+      if ((sqe = mg_uring_get_sqe(d)) != NULL) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ((uint64_t) i << 3) | MG_URING_OP_WAIT;
+      }
+      ok = 0;
+    } else if ((sqe = mg_uring_get_sqe(d)) != NULL) {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = sock;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = ((uint64_t) i << 3) | MG_URING_OP_WAIT;
+      d->wait_socks[i] = sock;
+    }
+  }
+  return n >= 0 && ok;
+}
 
 /*
- * Default DH params for PFS cipher negotiation. This is a 2048-bit group.
- * Will be used if none are provided by the user in the certificate file.
+ * Arms the connections that may need it: those on mg_mgr::work and
+ * mg_mgr::writing. Idle connections keep their multishot operations and
+ * are not looked at. Returns the number of timers, the earliest in
+ * `*min_timer`.
  */
-#if !MG_DISABLE_PFS && !defined(KR_VERSION)
-static const char mg_s_default_dh_params[] =
-    "\
------BEGIN DH PARAMETERS-----\n\
-MIIBCAKCAQEAlvbgD/qh9znWIlGFcV0zdltD7rq8FeShIqIhkQ0C7hYFThrBvF2E\n\
-Z9bmgaP+sfQwGpVlv9mtaWjvERbu6mEG7JTkgmVUJrUt/wiRzwTaCXBqZkdUO8Tq\n\
-+E6VOEQAilstG90ikN1Tfo+K6+X68XkRUIlgawBTKuvKVwBhuvlqTGerOtnXWnrt\n\
-ym//hd3cd5PBYGBix0i7oR4xdghvfR2WLVu0LgdThTBb6XP7gLd19cQ1JuBtAajZ\n\
-wMuPn7qlUkEFDIkAZy59/Hue/H2Q2vU/JsvVhHWCQBL4F1ofEAt50il6ZxR1QfFK\n\
-9VGKDC4oOgm9DlxwwBoC2FjqmvQlqVV3kwIBAg==\n\
------END DH PARAMETERS-----\n";
+static int mg_uring_arm_all(struct mg_iface *iface, double *min_timer) {
+  struct mg_uring_if_data *d = (struct mg_uring_if_data *) iface->data;
+  struct mg_mgr *mgr = iface->mgr;
+  struct mg_connection *nc, *tmp;
+  int num_timers = d->num_timers;
+
+  *min_timer = d->min_timer;
+#if MG_ENABLE_BROADCAST
+  if (!d->ctl_armed && mgr->ctl[1] != INVALID_SOCKET &&
+      iface == mgr->ifaces[MG_MAIN_IFACE]) {
+    struct io_uring_sqe *sqe = mg_uring_get_sqe(d);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = mgr->ctl[1];
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = MG_URING_OP_CTL;
+      d->ctl_armed = 1;
+    }
+  }
 #endif
 
-static enum mg_ssl_if_result mg_use_ca_cert(SSL_CTX *ctx, const char *cert) {
-  if (cert == NULL || strcmp(cert, "*") == 0) {
-    return MG_SSL_OK;
+  for (nc = LIST_FIRST(&mgr->work); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, work_link);
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if (!mg_uring_arm(d, nc)) mg_unmark_work(nc);
+    /* Timers set since the last dispatch */
+    if (nc->ev_timer_time > 0) {
+      if (num_timers == 0 || nc->ev_timer_time < *min_timer) {
+        *min_timer = nc->ev_timer_time;
+      }
+      num_timers++;
+    }
   }
-  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, 0);
-  return SSL_CTX_load_verify_locations(ctx, cert, NULL) == 1 ? MG_SSL_OK
-                                                             : MG_SSL_ERROR;
+  for (nc = LIST_FIRST(&mgr->writing); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, writing_link);
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if (mg_uring_arm(d, nc)) mg_mark_work(nc);
+    /* Send completions put whatever is left back on the work list */
+    if (nc->send_mbuf.len == 0 || mg_uring_sending(nc)) {
+      mg_unmark_writing(nc);
+    }
+  }
+  return num_timers;
 }
 
-static enum mg_ssl_if_result mg_use_cert(SSL_CTX *ctx, const char *cert,
-                                         const char *key,
-                                         const char **err_msg) {
-  if (key == NULL) key = cert;
-  if (cert == NULL || cert[0] == '\0' || key == NULL || key[0] == '\0') {
-    return MG_SSL_OK;
-  } else if (SSL_CTX_use_certificate_file(ctx, cert, 1) == 0) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL cert");
-    return MG_SSL_ERROR;
-  } else if (SSL_CTX_use_PrivateKey_file(ctx, key, 1) == 0) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL key");
-    return MG_SSL_ERROR;
-  } else if (SSL_CTX_use_certificate_chain_file(ctx, cert) == 0) {
-    MG_SET_PTRPTR(err_msg, "Invalid CA bundle");
-    return MG_SSL_ERROR;
-  } else {
-    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
-#if !MG_DISABLE_PFS && !defined(KR_VERSION)
-    BIO *bio = NULL;
-    DH *dh = NULL;
+time_t mg_uring_if_poll(struct mg_iface *iface, int timeout_ms) {
+  struct mg_uring_if_data *d = (struct mg_uring_if_data *) iface->data;
+  struct mg_mgr *mgr = iface->mgr;
+  struct mg_connection *nc, *tmp;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  double now, min_timer = 0;
+  int num_timers = mg_uring_arm_all(iface, &min_timer);
+  unsigned to_submit;
 
-    /* Try to read DH parameters from the cert/key file. */
-    bio = BIO_new_file(cert, "r");
-    if (bio != NULL) {
-      dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-      BIO_free(bio);
+  if (num_timers > 0) {
+    double timer_timeout_ms = (min_timer - mg_time()) * 1000 + 1 /* rounding */;
+    if (timer_timeout_ms < timeout_ms) {
+      timeout_ms = (int) timer_timeout_ms;
     }
-    /*
-     * If there are no DH params in the file, fall back to hard-coded ones.
-     * Not ideal, but better than nothing.
-     */
-    if (dh == NULL) {
-      bio = BIO_new_mem_buf((void *) mg_s_default_dh_params, -1);
-      dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
-      BIO_free(bio);
+  }
+  if (mgr->num_ifaces > 1 && !mg_uring_arm_wait_socks(d, iface)) {
+    timeout_ms = 0;
+  }
+  if (timeout_ms < 0) timeout_ms = 0;
+
+  /* Submit everything and wait, in one go. */
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uintptr_t) &ts;
+  to_submit = d->sq_tail - __atomic_load_n(d->sq_khead, __ATOMIC_ACQUIRE);
+  __atomic_store_n(d->sq_ktail, d->sq_tail, __ATOMIC_RELEASE);
+  mg_uring_enter(d->fd, to_submit, timeout_ms > 0 ? 1 : 0,
+                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                 sizeof(arg));
+  now = mg_time();
+
+  mg_uring_reap(d);
+
+#if MG_ENABLE_BROADCAST
+  if (d->ctl_ready) {
+    d->ctl_ready = 0;
+    mg_mgr_handle_ctl_sock(mgr);
+  }
+#endif
+
+  d->num_timers = 0;
+  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+    struct mg_uring_conn *cs = (struct mg_uring_conn *) nc->mgr_data;
+    tmp = nc->next;
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if (nc->iface != iface) cs = NULL;
+    if (!mg_uring_is_native(nc)) {
+      int fd_flags = 0;
+      if (cs != NULL) {
+        fd_flags = cs->fd_flags;
+        cs->fd_flags = 0;
+      }
+      mg_mgr_handle_conn(nc, fd_flags, now);
+    } else {
+      if ((nc->flags & MG_F_CONNECTING) && nc->err != 0 &&
+          !(cs != NULL && (cs->ops & MG_URING_OP_BIT(MG_URING_OP_CONNECT)))) {
+        mg_if_connect_cb(nc, nc->err);
+      }
+      if (!(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+        mg_if_poll(nc, (time_t) now);
+        mg_if_timer(nc, now);
+      }
     }
-    if (dh != NULL) {
-      SSL_CTX_set_tmp_dh(ctx, dh);
-      SSL_CTX_set_options(ctx, SSL_OP_SINGLE_DH_USE);
-      DH_free(dh);
+    if (nc->flags & MG_F_CLOSING_MASK) mg_mark_closing(nc);
+    /* Could have been sent to by another connection's handler */
+    if (nc->send_mbuf.len > 0) mg_mark_writing(nc);
+    if (nc->ev_timer_time > 0) {
+      if (d->num_timers == 0 || nc->ev_timer_time < d->min_timer) {
+        d->min_timer = nc->ev_timer_time;
+      }
+      d->num_timers++;
     }
-#if OPENSSL_VERSION_NUMBER > 0x10002000L
-    SSL_CTX_set_ecdh_auto(ctx, 1);
-#endif
-#endif
   }
-  return MG_SSL_OK;
+
+  for (nc = LIST_FIRST(&mgr->closing); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, closing_link);
+    if (!mg_if_owns_conn(iface, nc)) continue;
+    if ((nc->flags & MG_F_CLOSE_IMMEDIATELY) ||
+        (nc->send_mbuf.len == 0 && !mg_uring_sending(nc) &&
+         (nc->flags & MG_F_SEND_AND_CLOSE))) {
+      mg_close_conn(nc);
+    }
+  }
+
+  return (time_t) now;
 }
 
-static enum mg_ssl_if_result mg_set_cipher_list(SSL_CTX *ctx, const char *cl) {
-  return (SSL_CTX_set_cipher_list(ctx, cl ? cl : mg_s_cipher_list) == 1
-              ? MG_SSL_OK
-              : MG_SSL_ERROR);
+int mg_uring_if_get_wait_sock(struct mg_iface *iface, sock_t *sock) {
+  struct mg_uring_if_data *d = (struct mg_uring_if_data *) iface->data;
+  double min_timer = 0;
+  /*
+   * Start I/O that became possible since our last poll, e.g. receiving on
+   * a connection that has just been accepted. Ring becomes readable when
+   * there are completions to reap.
+   */
+  mg_uring_arm_all(iface, &min_timer);
+  mg_uring_flush(d);
+  *sock = d->fd;
+  return *d->cq_khead != __atomic_load_n(d->cq_ktail, __ATOMIC_ACQUIRE);
 }
 
-#ifndef KR_VERSION
-static unsigned int mg_ssl_if_ossl_psk_cb(SSL *ssl, const char *hint,
-                                          char *identity,
-                                          unsigned int max_identity_len,
-                                          unsigned char *psk,
-                                          unsigned int max_psk_len) {
-  struct mg_ssl_if_ctx *ctx =
-      (struct mg_ssl_if_ctx *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
-  size_t key_len = ctx->psk.len - ctx->identity_len - 1;
-  DBG(("hint: '%s'", (hint ? hint : "")));
-  if (ctx->identity_len + 1 > max_identity_len) {
-    DBG(("identity too long"));
-    return 0;
+/* clang-format off */
+#define MG_URING_IFACE_VTABLE                                           \
+  {                                                                     \
+    mg_uring_if_init,                                                   \
+    mg_uring_if_free,                                                   \
+    mg_uring_if_add_conn,                                               \
+    mg_uring_if_remove_conn,                                            \
+    mg_uring_if_poll,                                                   \
+    mg_uring_if_listen_tcp,                                             \
+    mg_socket_if_listen_udp,                                            \
+    mg_uring_if_connect_tcp,                                            \
+    mg_socket_if_connect_udp,                                           \
+    mg_uring_if_tcp_send,                                               \
+    mg_socket_if_udp_send,                                              \
+    mg_uring_if_recved,                                                 \
+    mg_uring_if_create_conn,                                            \
+    mg_uring_if_destroy_conn,                                           \
+    mg_uring_if_sock_set,                                               \
+    mg_socket_if_get_conn_addr,                                         \
+    mg_uring_if_tcp_send_mbuf,                                          \
+    mg_uring_if_get_wait_sock,                                          \
+    NULL /* recv_view */,                                               \
+    NULL /* recv_consume */,                                            \
   }
-  if (key_len > max_psk_len) {
-    DBG(("key too long"));
-    return 0;
-  }
-  memcpy(identity, ctx->psk.buf, ctx->identity_len + 1);
-  memcpy(psk, ctx->psk.buf + ctx->identity_len + 1, key_len);
-  (void) ssl;
-  return key_len;
-}
+/* clang-format on */
 
-static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
-                                                    const char *identity,
-                                                    const char *key_str) {
-  unsigned char key[32];
-  size_t key_len;
-  size_t i = 0;
-  if (identity == NULL && key_str == NULL) return MG_SSL_OK;
-  if (identity == NULL || key_str == NULL) return MG_SSL_ERROR;
-  key_len = strlen(key_str);
-  if (key_len != 32 && key_len != 64) return MG_SSL_ERROR;
-  memset(key, 0, sizeof(key));
-  key_len = 0;
-  for (i = 0; key_str[i] != '\0'; i++) {
-    unsigned char c;
-    char hc = tolower((int) key_str[i]);
-    if (hc >= '0' && hc <= '9') {
-      c = hc - '0';
-    } else if (hc >= 'a' && hc <= 'f') {
-      c = hc - 'a' + 0xa;
-    } else {
-      return MG_SSL_ERROR;
-    }
-    key_len = i / 2;
-    key[key_len] <<= 4;
-    key[key_len] |= c;
-  }
-  key_len++;
-  DBG(("identity = '%s', key = (%u)", identity, (unsigned int) key_len));
-  ctx->identity_len = strlen(identity);
-  mbuf_append(&ctx->psk, identity, ctx->identity_len + 1);
-  mbuf_append(&ctx->psk, key, key_len);
-  SSL_CTX_set_psk_client_callback(ctx->ssl_ctx, mg_ssl_if_ossl_psk_cb);
-  SSL_CTX_set_app_data(ctx->ssl_ctx, ctx);
-  return MG_SSL_OK;
-}
-#else
-static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
-                                                    const char *identity,
-                                                    const char *key_str) {
-  (void) ctx;
-  (void) identity;
-  (void) key_str;
-  /* Krypton does not support PSK. */
-  return MG_SSL_ERROR;
-}
-#endif /* defined(KR_VERSION) */
+const struct mg_iface_vtable mg_uring_iface_vtable = MG_URING_IFACE_VTABLE;
 
-const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
-                       const char *ca_cert) {
-  const char *err_msg = NULL;
-  struct mg_ssl_if_conn_params params;
-  memset(&params, 0, sizeof(params));
-  params.cert = cert;
-  params.ca_cert = ca_cert;
-  if (mg_ssl_if_conn_init(nc, &params, &err_msg) != MG_SSL_OK) {
-    return err_msg;
-  }
-  return NULL;
-}
+#endif /* MG_ENABLE_NET_IF_URING && MG_ENABLE_NET_IF_SOCKET */
 
-#endif /* MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_OPENSSL */
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_ssl_if_mbedtls.c"
+#line 1 "mongoose/src/mg_net_if_socks.c"
 #endif
 /*
  * Copyright (c) 2014-2016 Cesanta Software Limited
  * All rights reserved
  */
 
-#if MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_MBEDTLS
+#if MG_ENABLE_SOCKS
 
-#include <mbedtls/debug.h>
-#include <mbedtls/ecp.h>
-#include <mbedtls/platform.h>
-#include <mbedtls/ssl.h>
-#include <mbedtls/x509_crt.h>
+struct socksdata {
+  char *proxy_addr;        /* HOST:PORT of the socks5 proxy server */
+  struct mg_connection *s; /* Respective connection to the server */
+  struct mg_connection *c; /* Connection to the client */
+};
 
-static void mg_ssl_mbed_log(void *ctx, int level, const char *file, int line,
-                            const char *str) {
-  enum cs_log_level cs_level;
-  switch (level) {
-    case 1:
-      cs_level = LL_ERROR;
-      break;
-    case 2:
-    case 3:
-      cs_level = LL_DEBUG;
-      break;
-    default:
-      cs_level = LL_VERBOSE_DEBUG;
+static void socks_if_disband(struct socksdata *d) {
+  LOG(LL_DEBUG, ("disbanding proxy %p %p", d->c, d->s));
+  if (d->c) {
+    d->c->flags |= MG_F_SEND_AND_CLOSE;
+    mg_mark_closing(d->c);
   }
-  /* mbedTLS passes strings with \n at the end, strip it. */
-  LOG(cs_level, ("%p %.*s", ctx, (int) (strlen(str) - 1), str));
-  (void) file;
-  (void) line;
+  if (d->s) {
+    /* `d` goes away with the client's iface, the server may outlive it */
+    d->s->flags |= MG_F_SEND_AND_CLOSE;
+    mg_mark_closing(d->s);
+    d->s->user_data = NULL;
+  }
+  d->c = d->s = NULL;
 }
 
-struct mg_ssl_if_ctx {
-  mbedtls_ssl_config *conf;
-  mbedtls_ssl_context *ssl;
-  mbedtls_x509_crt *cert;
-  mbedtls_pk_context *key;
-  mbedtls_x509_crt *ca_cert;
-  struct mbuf cipher_suites;
-};
-
-/* Must be provided by the platform. ctx is struct mg_connection. */
-extern int mg_ssl_if_mbed_random(void *ctx, unsigned char *buf, size_t len);
-
-void mg_ssl_if_init() {
+/*
+ * Passes data between the client and the proxy server connections. Received
+ * data is handed to the client in its buffer, as much as the client's
+ * recv_mbuf_limit allows; the rest stays with the server connection, whose
+ * own limit then stops reads from the proxy. Data the client sends is queued
+ * in its send buffer while the server connection has a full send queue.
+ */
+static void socks_if_relay(struct socksdata *d) {
+  struct mg_connection *c = d->c, *s = d->s;
+  size_t room = c->recv_mbuf_limit > c->recv_mbuf.len
+                    ? c->recv_mbuf_limit - c->recv_mbuf.len
+                    : 0;
+  int n;
+  if (s->recv_mbuf.len > 0 && room >= s->recv_mbuf.len) {
+    char *buf = s->recv_mbuf.buf;
+    n = (int) s->recv_mbuf.len;
+    mbuf_init(&s->recv_mbuf, 0);
+    mg_if_recv_tcp_cb(c, buf, n, 1 /* own */);
+  } else if (s->recv_mbuf.len > 0 && room > 0) {
+    n = (int) room;
+    mg_if_recv_tcp_cb(c, s->recv_mbuf.buf, n, 0 /* own */);
+    mbuf_remove(&s->recv_mbuf, room);
+  }
+  if ((n = (int) mg_relay(&c->send_mbuf, s, MG_SOCKS_RELAY_WATERMARK)) > 0) {
+    mbuf_trim(&c->send_mbuf);
+    mg_call(c, NULL, c->user_data, MG_EV_SEND, &n);
+  }
 }
 
-enum mg_ssl_if_result mg_ssl_if_conn_accept(struct mg_connection *nc,
-                                            struct mg_connection *lc) {
-  struct mg_ssl_if_ctx *ctx =
-      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
-  struct mg_ssl_if_ctx *lc_ctx = (struct mg_ssl_if_ctx *) lc->ssl_if_data;
-  nc->ssl_if_data = ctx;
-  if (ctx == NULL || lc_ctx == NULL) return MG_SSL_ERROR;
-  ctx->ssl = (mbedtls_ssl_context *) MG_CALLOC(1, sizeof(*ctx->ssl));
-  if (mbedtls_ssl_setup(ctx->ssl, lc_ctx->conf) != 0) {
-    return MG_SSL_ERROR;
+static void socks_if_handler(struct mg_connection *c, int ev, void *ev_data) {
+  struct socksdata *d = (struct socksdata *) c->user_data;
+  if (d == NULL) return; /* Disbanded, closing */
+  if (ev == MG_EV_CONNECT) {
+    int res = *(int *) ev_data;
+    if (res == 0) {
+      /* Send handshake to the proxy server */
+      unsigned char buf[] = {MG_SOCKS_VERSION, 1, MG_SOCKS_HANDSHAKE_NOAUTH};
+      mg_send(d->s, buf, sizeof(buf));
+      LOG(LL_DEBUG, ("Sent handshake to %s", d->proxy_addr));
+    } else {
+      LOG(LL_ERROR, ("Cannot connect to %s: %d", d->proxy_addr, res));
+      d->c->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mg_mark_closing(d->c);
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    socks_if_disband(d);
+  } else if (ev == MG_EV_RECV) {
+    /* Handle handshake reply */
+    if (!(c->flags & MG_SOCKS_HANDSHAKE_DONE)) {
+      /* TODO(lsm): process IPv6 too */
+      unsigned char buf[10] = {MG_SOCKS_VERSION, MG_SOCKS_CMD_CONNECT, 0,
+                               MG_SOCKS_ADDR_IPV4};
+      if (c->recv_mbuf.len < 2) return;
+      if ((unsigned char) c->recv_mbuf.buf[1] == MG_SOCKS_HANDSHAKE_FAILURE) {
+        LOG(LL_ERROR, ("Server kicked us out"));
+        socks_if_disband(d);
+        return;
+      }
+      mbuf_remove(&c->recv_mbuf, 2);
+      c->flags |= MG_SOCKS_HANDSHAKE_DONE;
+
+      /* Send connect request */
+      memcpy(buf + 4, &d->c->sa.sin.sin_addr, 4);
+      memcpy(buf + 8, &d->c->sa.sin.sin_port, 2);
+      mg_send(c, buf, sizeof(buf));
+    }
+    /* Process connect request */
+    if ((c->flags & MG_SOCKS_HANDSHAKE_DONE) &&
+        !(c->flags & MG_SOCKS_CONNECT_DONE)) {
+      if (c->recv_mbuf.len < 10) return;
+      if (c->recv_mbuf.buf[1] != MG_SOCKS_SUCCESS) {
+        LOG(LL_ERROR, ("Socks connection error: %d", c->recv_mbuf.buf[1]));
+        socks_if_disband(d);
+        return;
+      }
+      mbuf_remove(&c->recv_mbuf, 10);
+      c->flags |= MG_SOCKS_CONNECT_DONE;
+      if (c->recv_mbuf_limit > MG_SOCKS_RELAY_WATERMARK) {
+        c->recv_mbuf_limit = MG_SOCKS_RELAY_WATERMARK;
+      }
+      if (d->c != NULL) mg_if_connect_cb(d->c, 0);
+    }
+    /* All flags are set, we're in relay mode */
+    if ((c->flags & MG_SOCKS_CONNECT_DONE) && d->c && d->s) {
+      socks_if_relay(d);
+    }
+  } else if (ev == MG_EV_SEND || ev == MG_EV_POLL) {
+    /* Resume what was held back */
+    if ((c->flags & MG_SOCKS_CONNECT_DONE) && d != NULL && d->c && d->s) {
+      socks_if_relay(d);
+    }
   }
-  return MG_SSL_OK;
 }
 
-static enum mg_ssl_if_result mg_use_cert(struct mg_ssl_if_ctx *ctx,
-                                         const char *cert, const char *key,
-                                         const char **err_msg);
-static enum mg_ssl_if_result mg_use_ca_cert(struct mg_ssl_if_ctx *ctx,
-                                            const char *cert);
-static enum mg_ssl_if_result mg_set_cipher_list(struct mg_ssl_if_ctx *ctx,
-                                                const char *ciphers);
-static enum mg_ssl_if_result mg_ssl_if_mbed_set_psk(struct mg_ssl_if_ctx *ctx,
-                                                    const char *identity,
-                                                    const char *key);
+static void mg_socks_if_connect_tcp(struct mg_connection *c,
+                                    const union socket_address *sa) {
+  struct socksdata *d = (struct socksdata *) c->iface->data;
+  d->c = c;
+  d->s = mg_connect(c->mgr, d->proxy_addr, socks_if_handler);
+  d->s->user_data = d;
+  LOG(LL_DEBUG, ("%p %s", c, d->proxy_addr));
+  (void) sa;
+}
 
-enum mg_ssl_if_result mg_ssl_if_conn_init(
-    struct mg_connection *nc, const struct mg_ssl_if_conn_params *params,
-    const char **err_msg) {
-  struct mg_ssl_if_ctx *ctx =
-      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
-  DBG(("%p %s,%s,%s", nc, (params->cert ? params->cert : ""),
-       (params->key ? params->key : ""),
-       (params->ca_cert ? params->ca_cert : "")));
+static void mg_socks_if_connect_udp(struct mg_connection *c) {
+  (void) c;
+}
 
-  if (ctx == NULL) {
-    MG_SET_PTRPTR(err_msg, "Out of memory");
-    return MG_SSL_ERROR;
-  }
-  nc->ssl_if_data = ctx;
-  ctx->conf = (mbedtls_ssl_config *) MG_CALLOC(1, sizeof(*ctx->conf));
-  mbuf_init(&ctx->cipher_suites, 0);
-  mbedtls_ssl_config_init(ctx->conf);
-  mbedtls_ssl_conf_dbg(ctx->conf, mg_ssl_mbed_log, nc);
-  if (mbedtls_ssl_config_defaults(
-          ctx->conf, (nc->flags & MG_F_LISTENING ? MBEDTLS_SSL_IS_SERVER
-                                                 : MBEDTLS_SSL_IS_CLIENT),
-          MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
-    MG_SET_PTRPTR(err_msg, "Failed to init SSL config");
-    return MG_SSL_ERROR;
-  }
+static int mg_socks_if_listen_tcp(struct mg_connection *c,
+                                  union socket_address *sa) {
+  (void) c;
+  (void) sa;
+  return 0;
+}
 
-  /* TLS 1.2 and up */
-  mbedtls_ssl_conf_min_version(ctx->conf, MBEDTLS_SSL_MAJOR_VERSION_3,
-                               MBEDTLS_SSL_MINOR_VERSION_3);
-  mbedtls_ssl_conf_rng(ctx->conf, mg_ssl_if_mbed_random, nc);
+static int mg_socks_if_listen_udp(struct mg_connection *c,
+                                  union socket_address *sa) {
+  (void) c;
+  (void) sa;
+  return -1;
+}
 
-  if (params->cert != NULL &&
-      mg_use_cert(ctx, params->cert, params->key, err_msg) != MG_SSL_OK) {
-    return MG_SSL_ERROR;
+static void mg_socks_if_tcp_send(struct mg_connection *c, const void *buf,
+                                 size_t len) {
+  struct socksdata *d = (struct socksdata *) c->iface->data;
+  LOG(LL_DEBUG, ("%p -> %p %d %d", c, buf, (int) len, (int) c->send_mbuf.len));
+  if (d && d->s && d->s->flags & MG_SOCKS_CONNECT_DONE &&
+      c->send_mbuf.len == 0 &&
+      d->s->send_mbuf.len < MG_SOCKS_RELAY_WATERMARK) {
+    mg_send(d->s, buf, len);
+  } else {
+    /* Not connected yet, or held back: socks_if_relay() passes it on */
+    mbuf_append(&c->send_mbuf, buf, len);
   }
+}
 
-  if (params->ca_cert != NULL &&
-      mg_use_ca_cert(ctx, params->ca_cert) != MG_SSL_OK) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL CA cert");
-    return MG_SSL_ERROR;
-  }
-
-  if (mg_set_cipher_list(ctx, params->cipher_suites) != MG_SSL_OK) {
-    MG_SET_PTRPTR(err_msg, "Invalid cipher suite list");
-    return MG_SSL_ERROR;
-  }
-
-  if (mg_ssl_if_mbed_set_psk(ctx, params->psk_identity, params->psk_key) !=
-      MG_SSL_OK) {
-    MG_SET_PTRPTR(err_msg, "Invalid PSK settings");
-    return MG_SSL_ERROR;
-  }
-
-  if (!(nc->flags & MG_F_LISTENING)) {
-    ctx->ssl = (mbedtls_ssl_context *) MG_CALLOC(1, sizeof(*ctx->ssl));
-    mbedtls_ssl_init(ctx->ssl);
-    if (mbedtls_ssl_setup(ctx->ssl, ctx->conf) != 0) {
-      MG_SET_PTRPTR(err_msg, "Failed to create SSL session");
-      return MG_SSL_ERROR;
-    }
-    if (params->server_name != NULL &&
-        mbedtls_ssl_set_hostname(ctx->ssl, params->server_name) != 0) {
-      return MG_SSL_ERROR;
-    }
-  }
-
-#ifdef MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN
-  if (mbedtls_ssl_conf_max_frag_len(ctx->conf,
-#if MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 512
-                                    MBEDTLS_SSL_MAX_FRAG_LEN_512
-#elif MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 1024
-                                    MBEDTLS_SSL_MAX_FRAG_LEN_1024
-#elif MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 2048
-                                    MBEDTLS_SSL_MAX_FRAG_LEN_2048
-#elif MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 4096
-                                    MBEDTLS_SSL_MAX_FRAG_LEN_4096
-#else
-#error Invalid MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN
-#endif
-                                    ) != 0) {
-    return MG_SSL_ERROR;
-  }
-#endif
+static void mg_socks_if_udp_send(struct mg_connection *c, const void *buf,
+                                 size_t len) {
+  (void) c;
+  (void) buf;
+  (void) len;
+}
 
-  nc->flags |= MG_F_SSL;
+static void mg_socks_if_recved(struct mg_connection *c, size_t len) {
+  (void) c;
+  (void) len;
+}
 
-  return MG_SSL_OK;
+static int mg_socks_if_create_conn(struct mg_connection *c) {
+  (void) c;
+  return 1;
 }
 
-#if MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL
-int ssl_socket_send(void *ctx, const unsigned char *buf, size_t len);
-int ssl_socket_recv(void *ctx, unsigned char *buf, size_t len);
-#else
-static int ssl_socket_send(void *ctx, const unsigned char *buf, size_t len) {
-  struct mg_connection *nc = (struct mg_connection *) ctx;
-  int n = (int) MG_SEND_FUNC(nc->sock, buf, len, 0);
-  LOG(LL_DEBUG, ("%p %d -> %d", nc, (int) len, n));
-  if (n >= 0) return n;
-  n = mg_get_errno();
-  return ((n == EAGAIN || n == EINPROGRESS) ? MBEDTLS_ERR_SSL_WANT_WRITE : -1);
+static void mg_socks_if_destroy_conn(struct mg_connection *c) {
+  c->iface->vtable->free(c->iface);
+  MG_FREE(c->iface);
+  c->iface = NULL;
+  LOG(LL_DEBUG, ("%p", c));
 }
 
-static int ssl_socket_recv(void *ctx, unsigned char *buf, size_t len) {
-  struct mg_connection *nc = (struct mg_connection *) ctx;
-  int n = (int) MG_RECV_FUNC(nc->sock, buf, len, 0);
-  LOG(LL_DEBUG, ("%p %d <- %d", nc, (int) len, n));
-  if (n >= 0) return n;
-  n = mg_get_errno();
-  return ((n == EAGAIN || n == EINPROGRESS) ? MBEDTLS_ERR_SSL_WANT_READ : -1);
+static void mg_socks_if_sock_set(struct mg_connection *c, sock_t sock) {
+  (void) c;
+  (void) sock;
 }
-#endif
 
-static enum mg_ssl_if_result mg_ssl_if_mbed_err(struct mg_connection *nc,
-                                                int ret) {
-  if (ret == MBEDTLS_ERR_SSL_WANT_READ) return MG_SSL_WANT_READ;
-  if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) return MG_SSL_WANT_WRITE;
-  if (ret !=
-      MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) { /* CLOSE_NOTIFY = Normal shutdown */
-    LOG(LL_ERROR, ("%p SSL error: %d", nc, ret));
-  }
-  nc->err = ret;
-  nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-  return MG_SSL_ERROR;
+static void mg_socks_if_init(struct mg_iface *iface) {
+  (void) iface;
 }
 
-static void mg_ssl_if_mbed_free_certs_and_keys(struct mg_ssl_if_ctx *ctx) {
-  if (ctx->cert != NULL) {
-    mbedtls_x509_crt_free(ctx->cert);
-    MG_FREE(ctx->cert);
-    ctx->cert = NULL;
-    mbedtls_pk_free(ctx->key);
-    MG_FREE(ctx->key);
-    ctx->key = NULL;
-  }
-  if (ctx->ca_cert != NULL) {
-    mbedtls_ssl_conf_ca_chain(ctx->conf, NULL, NULL);
-#ifdef MBEDTLS_X509_CA_CHAIN_ON_DISK
-    if (ctx->ca_cert->ca_chain_file != NULL) {
-      MG_FREE((void *) ctx->ca_cert->ca_chain_file);
-      ctx->ca_cert->ca_chain_file = NULL;
-    }
-#endif
-    mbedtls_x509_crt_free(ctx->ca_cert);
-    MG_FREE(ctx->ca_cert);
-    ctx->ca_cert = NULL;
+static void mg_socks_if_free(struct mg_iface *iface) {
+  struct socksdata *d = (struct socksdata *) iface->data;
+  LOG(LL_DEBUG, ("%p", iface));
+  if (d != NULL) {
+    socks_if_disband(d);
+    MG_FREE(d->proxy_addr);
+    MG_FREE(d);
+    iface->data = NULL;
   }
 }
 
-enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int err;
-  /* If bio is not yet set, do it now. */
-  if (ctx->ssl->p_bio == NULL) {
-    mbedtls_ssl_set_bio(ctx->ssl, nc, ssl_socket_send, ssl_socket_recv, NULL);
-  }
-  err = mbedtls_ssl_handshake(ctx->ssl);
-  if (err != 0) return mg_ssl_if_mbed_err(nc, err);
-#ifdef MG_SSL_IF_MBEDTLS_FREE_CERTS
-  /*
-   * Free the peer certificate, we don't need it after handshake.
-   * Note that this effectively disables renegotiation.
-   */
-  mbedtls_x509_crt_free(ctx->ssl->session->peer_cert);
-  mbedtls_free(ctx->ssl->session->peer_cert);
-  ctx->ssl->session->peer_cert = NULL;
-  /* On a client connection we can also free our own and CA certs. */
-  if (nc->listener == NULL) {
-    if (ctx->conf->key_cert != NULL) {
-      /* Note that this assumes one key_cert entry, which matches our init. */
-      MG_FREE(ctx->conf->key_cert);
-      ctx->conf->key_cert = NULL;
-    }
-    mbedtls_ssl_conf_ca_chain(ctx->conf, NULL, NULL);
-    mg_ssl_if_mbed_free_certs_and_keys(ctx);
-  }
-#endif
-  return MG_SSL_OK;
+static void mg_socks_if_add_conn(struct mg_connection *c) {
+  c->sock = INVALID_SOCKET;
 }
 
-int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int n = mbedtls_ssl_read(ctx->ssl, (unsigned char *) buf, buf_size);
-  DBG(("%p %d -> %d", nc, (int) buf_size, n));
-  if (n < 0) return mg_ssl_if_mbed_err(nc, n);
-  if (n == 0) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-  return n;
+static void mg_socks_if_remove_conn(struct mg_connection *c) {
+  (void) c;
 }
 
-int mg_ssl_if_write(struct mg_connection *nc, const void *data, size_t len) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  int n = mbedtls_ssl_write(ctx->ssl, (const unsigned char *) data, len);
-  DBG(("%p %d -> %d", nc, (int) len, n));
-  if (n < 0) return mg_ssl_if_mbed_err(nc, n);
-  return n;
+static time_t mg_socks_if_poll(struct mg_iface *iface, int timeout_ms) {
+  LOG(LL_DEBUG, ("%p", iface));
+  (void) iface;
+  (void) timeout_ms;
+  return (time_t) cs_time();
 }
 
-void mg_ssl_if_conn_close_notify(struct mg_connection *nc) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  if (ctx == NULL) return;
-  mbedtls_ssl_close_notify(ctx->ssl);
+static void mg_socks_if_get_conn_addr(struct mg_connection *c, int remote,
+                                      union socket_address *sa) {
+  LOG(LL_DEBUG, ("%p", c));
+  (void) c;
+  (void) remote;
+  (void) sa;
 }
 
-void mg_ssl_if_conn_free(struct mg_connection *nc) {
-  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
-  if (ctx == NULL) return;
-  nc->ssl_if_data = NULL;
-  if (ctx->ssl != NULL) {
-    mbedtls_ssl_free(ctx->ssl);
-    MG_FREE(ctx->ssl);
-  }
-  mg_ssl_if_mbed_free_certs_and_keys(ctx);
-  if (ctx->conf != NULL) {
-    mbedtls_ssl_config_free(ctx->conf);
-    MG_FREE(ctx->conf);
-  }
-  mbuf_free(&ctx->cipher_suites);
-  memset(ctx, 0, sizeof(*ctx));
-  MG_FREE(ctx);
+const struct mg_iface_vtable mg_socks_iface_vtable = {
+    mg_socks_if_init,        mg_socks_if_free,
+    mg_socks_if_add_conn,    mg_socks_if_remove_conn,
+    mg_socks_if_poll,        mg_socks_if_listen_tcp,
+    mg_socks_if_listen_udp,  mg_socks_if_connect_tcp,
+    mg_socks_if_connect_udp, mg_socks_if_tcp_send,
+    mg_socks_if_udp_send,    mg_socks_if_recved,
+    mg_socks_if_create_conn, mg_socks_if_destroy_conn,
+    mg_socks_if_sock_set,    mg_socks_if_get_conn_addr,
+    NULL /* tcp_send_mbuf */,
+    NULL /* get_wait_sock */,
+    NULL /* recv_view */,
+    NULL /* recv_consume */,
+};
+
+struct mg_iface *mg_socks_mk_iface(struct mg_mgr *mgr, const char *proxy_addr) {
+  struct mg_iface *iface = mg_if_create_iface(&mg_socks_iface_vtable, mgr);
+  iface->data = MG_CALLOC(1, sizeof(struct socksdata));
+  ((struct socksdata *) iface->data)->proxy_addr = strdup(proxy_addr);
+  return iface;
 }
 
-static enum mg_ssl_if_result mg_use_ca_cert(struct mg_ssl_if_ctx *ctx,
-                                            const char *ca_cert) {
-  if (ca_cert == NULL || strcmp(ca_cert, "*") == 0) {
-    mbedtls_ssl_conf_authmode(ctx->conf, MBEDTLS_SSL_VERIFY_NONE);
-    return MG_SSL_OK;
-  }
-  ctx->ca_cert = (mbedtls_x509_crt *) MG_CALLOC(1, sizeof(*ctx->ca_cert));
-  mbedtls_x509_crt_init(ctx->ca_cert);
-#ifdef MBEDTLS_X509_CA_CHAIN_ON_DISK
-  ca_cert = strdup(ca_cert);
-  if (mbedtls_x509_crt_set_ca_chain_file(ctx->ca_cert, ca_cert) != 0) {
-    return MG_SSL_ERROR;
-  }
-#else
-  if (mbedtls_x509_crt_parse_file(ctx->ca_cert, ca_cert) != 0) {
-    return MG_SSL_ERROR;
-  }
 #endif
-  mbedtls_ssl_conf_ca_chain(ctx->conf, ctx->ca_cert, NULL);
-  mbedtls_ssl_conf_authmode(ctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-  return MG_SSL_OK;
-}
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_ssl_if_openssl.c"
+#endif
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
 
-static enum mg_ssl_if_result mg_use_cert(struct mg_ssl_if_ctx *ctx,
-                                         const char *cert, const char *key,
-                                         const char **err_msg) {
-  if (key == NULL) key = cert;
-  if (cert == NULL || cert[0] == '\0' || key == NULL || key[0] == '\0') {
-    return MG_SSL_OK;
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_SSL
+
+#if MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_OPENSSL
+
+#ifdef __APPLE__
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+#include <openssl/ssl.h>
+
+struct mg_ssl_if_ctx {
+  SSL *ssl;
+  SSL_CTX *ssl_ctx;
+  struct mbuf psk;
+  size_t identity_len;
+};
+
+void mg_ssl_if_init() {
+  SSL_library_init();
+}
+
+enum mg_ssl_if_result mg_ssl_if_conn_accept(struct mg_connection *nc,
+                                            struct mg_connection *lc) {
+  struct mg_ssl_if_ctx *ctx =
+      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
+  struct mg_ssl_if_ctx *lc_ctx = (struct mg_ssl_if_ctx *) lc->ssl_if_data;
+  nc->ssl_if_data = ctx;
+  if (ctx == NULL || lc_ctx == NULL) return MG_SSL_ERROR;
+  ctx->ssl_ctx = lc_ctx->ssl_ctx;
+  if ((ctx->ssl = SSL_new(ctx->ssl_ctx)) == NULL) {
+    return MG_SSL_ERROR;
   }
-  ctx->cert = (mbedtls_x509_crt *) MG_CALLOC(1, sizeof(*ctx->cert));
-  mbedtls_x509_crt_init(ctx->cert);
-  ctx->key = (mbedtls_pk_context *) MG_CALLOC(1, sizeof(*ctx->key));
-  mbedtls_pk_init(ctx->key);
-  if (mbedtls_x509_crt_parse_file(ctx->cert, cert) != 0) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL cert");
+  return MG_SSL_OK;
+}
+
+static enum mg_ssl_if_result mg_use_cert(SSL_CTX *ctx, const char *cert,
+                                         const char *key, const char **err_msg);
+static enum mg_ssl_if_result mg_use_ca_cert(SSL_CTX *ctx, const char *cert);
+static enum mg_ssl_if_result mg_set_cipher_list(SSL_CTX *ctx, const char *cl);
+static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
+                                                    const char *identity,
+                                                    const char *key_str);
+
+enum mg_ssl_if_result mg_ssl_if_conn_init(
+    struct mg_connection *nc, const struct mg_ssl_if_conn_params *params,
+    const char **err_msg) {
+  struct mg_ssl_if_ctx *ctx =
+      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
+  DBG(("%p %s,%s,%s", nc, (params->cert ? params->cert : ""),
+       (params->key ? params->key : ""),
+       (params->ca_cert ? params->ca_cert : "")));
+  if (ctx == NULL) {
+    MG_SET_PTRPTR(err_msg, "Out of memory");
     return MG_SSL_ERROR;
   }
-  if (mbedtls_pk_parse_keyfile(ctx->key, key, NULL) != 0) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL key");
+  nc->ssl_if_data = ctx;
+  if (nc->flags & MG_F_LISTENING) {
+    ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+  } else {
+    ctx->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  }
+  if (ctx->ssl_ctx == NULL) {
+    MG_SET_PTRPTR(err_msg, "Failed to create SSL context");
     return MG_SSL_ERROR;
   }
-  if (mbedtls_ssl_conf_own_cert(ctx->conf, ctx->cert, ctx->key) != 0) {
-    MG_SET_PTRPTR(err_msg, "Invalid SSL key or cert");
+
+#ifndef KR_VERSION
+  /* Disable deprecated protocols. */
+  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv2);
+  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv3);
+  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_TLSv1);
+#ifdef MG_SSL_OPENSSL_NO_COMPRESSION
+  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_COMPRESSION);
+#endif
+#ifdef MG_SSL_OPENSSL_CIPHER_SERVER_PREFERENCE
+  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+#endif
+#else
+/* Krypton only supports TLSv1.2 anyway. */
+#endif
+
+  if (params->cert != NULL &&
+      mg_use_cert(ctx->ssl_ctx, params->cert, params->key, err_msg) !=
+          MG_SSL_OK) {
     return MG_SSL_ERROR;
   }
-  return MG_SSL_OK;
-}
 
-static const int mg_s_cipher_list[] = {
-#if CS_PLATFORM != CS_P_ESP8266
-    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_DHE_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_DHE_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA,
-    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA,
-    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+  if (params->ca_cert != NULL &&
+      mg_use_ca_cert(ctx->ssl_ctx, params->ca_cert) != MG_SSL_OK) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL CA cert");
+    return MG_SSL_ERROR;
+  }
+
+  if (params->server_name != NULL) {
+#ifdef KR_VERSION
+    SSL_CTX_kr_set_verify_name(ctx->ssl_ctx, params->server_name);
 #else
-    /*
-     * ECDHE is way too slow on ESP8266 w/o cryptochip, this sometimes results
-     * in WiFi STA deauths. Use weaker but faster cipher suites. Sad but true.
-     * Disable DHE completely because it's just hopelessly slow.
-     */
-    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA,
-    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_GCM_SHA256,
-    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA256,
-    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA,
-    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
-#endif /* CS_PLATFORM != CS_P_ESP8266 */
-    0,
-};
+/* TODO(rojer): Implement server name verification on OpenSSL. */
+#endif
+  }
 
-/*
- * Ciphers can be specified as a colon-separated list of cipher suite names.
- * These can be found in
- * https://github.com/ARMmbed/mbedtls/blob/development/library/ssl_ciphersuites.c#L267
- * E.g.: TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256:TLS-DHE-RSA-WITH-AES-256-CCM
- */
-static enum mg_ssl_if_result mg_set_cipher_list(struct mg_ssl_if_ctx *ctx,
-                                                const char *ciphers) {
-  if (ciphers != NULL) {
-    int l, id;
-    const char *s = ciphers, *e;
-    char tmp[50];
-    while (s != NULL) {
-      e = strchr(s, ':');
-      l = (e != NULL ? (e - s) : (int) strlen(s));
-      strncpy(tmp, s, l);
-      tmp[l] = '\0';
-      id = mbedtls_ssl_get_ciphersuite_id(tmp);
-      DBG(("%s -> %04x", tmp, id));
-      if (id != 0) {
-        mbuf_append(&ctx->cipher_suites, &id, sizeof(id));
-      }
-      s = (e != NULL ? e + 1 : NULL);
-    }
-    if (ctx->cipher_suites.len == 0) return MG_SSL_ERROR;
-    id = 0;
-    mbuf_append(&ctx->cipher_suites, &id, sizeof(id));
-    mbuf_trim(&ctx->cipher_suites);
-    mbedtls_ssl_conf_ciphersuites(ctx->conf,
-                                  (const int *) ctx->cipher_suites.buf);
-  } else {
-    mbedtls_ssl_conf_ciphersuites(ctx->conf, mg_s_cipher_list);
+  if (mg_set_cipher_list(ctx->ssl_ctx, params->cipher_suites) != MG_SSL_OK) {
+    MG_SET_PTRPTR(err_msg, "Invalid cipher suite list");
+    return MG_SSL_ERROR;
   }
-  return MG_SSL_OK;
-}
 
-static enum mg_ssl_if_result mg_ssl_if_mbed_set_psk(struct mg_ssl_if_ctx *ctx,
-                                                    const char *identity,
-                                                    const char *key_str) {
-  unsigned char key[32];
-  size_t key_len;
-  if (identity == NULL && key_str == NULL) return MG_SSL_OK;
-  if (identity == NULL || key_str == NULL) return MG_SSL_ERROR;
-  key_len = strlen(key_str);
-  if (key_len != 32 && key_len != 64) return MG_SSL_ERROR;
-  size_t i = 0;
-  memset(key, 0, sizeof(key));
-  key_len = 0;
-  for (i = 0; key_str[i] != '\0'; i++) {
-    unsigned char c;
-    char hc = tolower((int) key_str[i]);
-    if (hc >= '0' && hc <= '9') {
-      c = hc - '0';
-    } else if (hc >= 'a' && hc <= 'f') {
-      c = hc - 'a' + 0xa;
-    } else {
-      return MG_SSL_ERROR;
-    }
-    key_len = i / 2;
-    key[key_len] <<= 4;
-    key[key_len] |= c;
+  mbuf_init(&ctx->psk, 0);
+  if (mg_ssl_if_ossl_set_psk(ctx, params->psk_identity, params->psk_key) !=
+      MG_SSL_OK) {
+    MG_SET_PTRPTR(err_msg, "Invalid PSK settings");
+    return MG_SSL_ERROR;
   }
-  key_len++;
-  DBG(("identity = '%s', key = (%u)", identity, (unsigned int) key_len));
-  /* mbedTLS makes copies of psk and identity. */
-  if (mbedtls_ssl_conf_psk(ctx->conf, (const unsigned char *) key, key_len,
-                           (const unsigned char *) identity,
-                           strlen(identity)) != 0) {
+
+  if (!(nc->flags & MG_F_LISTENING) &&
+      (ctx->ssl = SSL_new(ctx->ssl_ctx)) == NULL) {
+    MG_SET_PTRPTR(err_msg, "Failed to create SSL session");
     return MG_SSL_ERROR;
   }
+
+  nc->flags |= MG_F_SSL;
+
   return MG_SSL_OK;
 }
 
-const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
-                       const char *ca_cert) {
-  const char *err_msg = NULL;
-  struct mg_ssl_if_conn_params params;
-  memset(&params, 0, sizeof(params));
-  params.cert = cert;
-  params.ca_cert = ca_cert;
-  if (mg_ssl_if_conn_init(nc, &params, &err_msg) != MG_SSL_OK) {
-    return err_msg;
+static enum mg_ssl_if_result mg_ssl_if_ssl_err(struct mg_connection *nc,
+                                               int res) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int err = SSL_get_error(ctx->ssl, res);
+  if (err == SSL_ERROR_WANT_READ) return MG_SSL_WANT_READ;
+  if (err == SSL_ERROR_WANT_WRITE) return MG_SSL_WANT_WRITE;
+  DBG(("%p %p SSL error: %d %d", nc, ctx->ssl_ctx, res, err));
+  nc->err = err;
+  return MG_SSL_ERROR;
+}
+
+enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int server_side = (nc->listener != NULL);
+  int res;
+  /* If descriptor is not yet set, do it now. */
+  if (SSL_get_fd(ctx->ssl) < 0) {
+    if (SSL_set_fd(ctx->ssl, nc->sock) != 1) return MG_SSL_ERROR;
   }
-  return NULL;
+  res = server_side ? SSL_accept(ctx->ssl) : SSL_connect(ctx->ssl);
+  if (res != 1) return mg_ssl_if_ssl_err(nc, res);
+  return MG_SSL_OK;
 }
 
-/* Lazy RNG. Warning: it would be a bad idea to do this in production! */
-#ifdef MG_SSL_MBED_DUMMY_RANDOM
-int mg_ssl_if_mbed_random(void *ctx, unsigned char *buf, size_t len) {
-  (void) ctx;
-  while (len--) *buf++ = rand();
-  return 0;
+int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int n = SSL_read(ctx->ssl, buf, buf_size);
+  DBG(("%p %d -> %d", nc, (int) buf_size, n));
+  if (n < 0) return mg_ssl_if_ssl_err(nc, n);
+  if (n == 0) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  return n;
+}
+
+int mg_ssl_if_write(struct mg_connection *nc, const void *data, size_t len) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int n = SSL_write(ctx->ssl, data, len);
+  DBG(("%p %d -> %d", nc, (int) len, n));
+  if (n <= 0) return mg_ssl_if_ssl_err(nc, n);
+  return n;
+}
+
+void mg_ssl_if_conn_close_notify(struct mg_connection *nc) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  if (ctx == NULL) return;
+  SSL_shutdown(ctx->ssl);
+}
+
+void mg_ssl_if_conn_free(struct mg_connection *nc) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  if (ctx == NULL) return;
+  nc->ssl_if_data = NULL;
+  if (ctx->ssl != NULL) SSL_free(ctx->ssl);
+  if (ctx->ssl_ctx != NULL && nc->listener == NULL) SSL_CTX_free(ctx->ssl_ctx);
+  mbuf_free(&ctx->psk);
+  memset(ctx, 0, sizeof(*ctx));
+  MG_FREE(ctx);
+}
+
+#if !defined(KR_VERSION) && OPENSSL_VERSION_NUMBER >= 0x10002000L
+static int mg_ssl_if_alpn_select_cb(SSL *ssl, const unsigned char **out,
+                                    unsigned char *outlen,
+                                    const unsigned char *in,
+                                    unsigned int inlen, void *arg) {
+  const char **protos = (const char **) arg;
+  unsigned int i;
+  size_t len;
+  /* Our preference wins */
+  for (; *protos != NULL; protos++) {
+    len = strlen(*protos);
+    for (i = 0; i < inlen; i += in[i] + 1) {
+      if (in[i] == len && i + 1 + len <= inlen &&
+          memcmp(in + i + 1, *protos, len) == 0) {
+        *out = in + i + 1;
+        *outlen = (unsigned char) len;
+        return SSL_TLSEXT_ERR_OK;
+      }
+    }
+  }
+  (void) ssl;
+  return SSL_TLSEXT_ERR_NOACK;
 }
 #endif
 
-#endif /* MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_MBEDTLS */
-#ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_uri.c"
+void mg_ssl_if_set_alpn(struct mg_connection *nc, const char **protos) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  if (ctx == NULL || ctx->ssl_ctx == NULL) return;
+#if !defined(KR_VERSION) && OPENSSL_VERSION_NUMBER >= 0x10002000L
+  SSL_CTX_set_alpn_select_cb(ctx->ssl_ctx, mg_ssl_if_alpn_select_cb,
+                             (void *) protos);
+#else
+  (void) protos;
 #endif
+}
+
 /*
- * Copyright (c) 2014 Cesanta Software Limited
- * All rights reserved
+ * Cipher suite options used for TLS negotiation.
+ * https://wiki.mozilla.org/Security/Server_Side_TLS#Recommended_configurations
  */
-
-/* Amalgamated: #include "mg_internal.h" */
-/* Amalgamated: #include "mg_uri.h" */
+static const char mg_s_cipher_list[] =
+#if defined(MG_SSL_CRYPTO_MODERN)
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+    "DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:"
+    "ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:"
+    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:"
+    "ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:"
+    "DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:"
+    "DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:"
+    "!aNULL:!eNULL:!EXPORT:!DES:!RC4:!3DES:!MD5:!PSK"
+#elif defined(MG_SSL_CRYPTO_OLD)
+    "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:"
+    "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:"
+    "DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:"
+    "ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:"
+    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:"
+    "ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:"
+    "DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:"
+    "DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:ECDHE-RSA-DES-CBC3-SHA:"
+    "ECDHE-ECDSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:"
+    "AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:AES:DES-CBC3-SHA:"
+    "HIGH:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK:!aECDH:"
+    "!EDH-DSS-DES-CBC3-SHA:!EDH-RSA-DES-CBC3-SHA:!KRB5-DES-CBC3-SHA"
+#else /* Default - intermediate. */
+    "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:"
+    "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:"
+    "DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:"
+    "ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:"
+    "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:"
+    "ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:"
+    "DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:"
+    "DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:"
+    "AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:AES:CAMELLIA:"
+    "DES-CBC3-SHA:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK:!aECDH:"
+    "!EDH-DSS-DES-CBC3-SHA:!EDH-RSA-DES-CBC3-SHA:!KRB5-DES-CBC3-SHA"
+#endif
+    ;
 
 /*
- * scan string until encountering one of `seps`, keeping track of component
- * boundaries in `res`.
- *
- * `p` will point to the char after the separator or it will be `end`.
+ * Default DH params for PFS cipher negotiation. This is a 2048-bit group.
+ * Will be used if none are provided by the user in the certificate file.
  */
-static void parse_uri_component(const char **p, const char *end,
-                                const char *seps, struct mg_str *res) {
-  const char *q;
-  res->p = *p;
-  for (; *p < end; (*p)++) {
-    for (q = seps; *q != '\0'; q++) {
-      if (**p == *q) break;
+#if !MG_DISABLE_PFS && !defined(KR_VERSION)
+static const char mg_s_default_dh_params[] =
+    "\
+-----BEGIN DH PARAMETERS-----\n\
+MIIBCAKCAQEAlvbgD/qh9znWIlGFcV0zdltD7rq8FeShIqIhkQ0C7hYFThrBvF2E\n\
+Z9bmgaP+sfQwGpVlv9mtaWjvERbu6mEG7JTkgmVUJrUt/wiRzwTaCXBqZkdUO8Tq\n\
++E6VOEQAilstG90ikN1Tfo+K6+X68XkRUIlgawBTKuvKVwBhuvlqTGerOtnXWnrt\n\
+ym//hd3cd5PBYGBix0i7oR4xdghvfR2WLVu0LgdThTBb6XP7gLd19cQ1JuBtAajZ\n\
+wMuPn7qlUkEFDIkAZy59/Hue/H2Q2vU/JsvVhHWCQBL4F1ofEAt50il6ZxR1QfFK\n\
+9VGKDC4oOgm9DlxwwBoC2FjqmvQlqVV3kwIBAg==\n\
+-----END DH PARAMETERS-----\n";
+#endif
+
+static enum mg_ssl_if_result mg_use_ca_cert(SSL_CTX *ctx, const char *cert) {
+  if (cert == NULL || strcmp(cert, "*") == 0) {
+    return MG_SSL_OK;
+  }
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, 0);
+  return SSL_CTX_load_verify_locations(ctx, cert, NULL) == 1 ? MG_SSL_OK
+                                                             : MG_SSL_ERROR;
+}
+
+static enum mg_ssl_if_result mg_use_cert(SSL_CTX *ctx, const char *cert,
+                                         const char *key,
+                                         const char **err_msg) {
+  if (key == NULL) key = cert;
+  if (cert == NULL || cert[0] == '\0' || key == NULL || key[0] == '\0') {
+    return MG_SSL_OK;
+  } else if (SSL_CTX_use_certificate_file(ctx, cert, 1) == 0) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL cert");
+    return MG_SSL_ERROR;
+  } else if (SSL_CTX_use_PrivateKey_file(ctx, key, 1) == 0) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL key");
+    return MG_SSL_ERROR;
+  } else if (SSL_CTX_use_certificate_chain_file(ctx, cert) == 0) {
+    MG_SET_PTRPTR(err_msg, "Invalid CA bundle");
+    return MG_SSL_ERROR;
+  } else {
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#if !MG_DISABLE_PFS && !defined(KR_VERSION)
+    BIO *bio = NULL;
+    DH *dh = NULL;
+
+    /* Try to read DH parameters from the cert/key file. */
+    bio = BIO_new_file(cert, "r");
+    if (bio != NULL) {
+      dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+      BIO_free(bio);
     }
-    if (*q != '\0') break;
+    /*
+     * If there are no DH params in the file, fall back to hard-coded ones.
+     * Not ideal, but better than nothing.
+     */
+    if (dh == NULL) {
+      bio = BIO_new_mem_buf((void *) mg_s_default_dh_params, -1);
+      dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+      BIO_free(bio);
+    }
+    if (dh != NULL) {
+      SSL_CTX_set_tmp_dh(ctx, dh);
+      SSL_CTX_set_options(ctx, SSL_OP_SINGLE_DH_USE);
+      DH_free(dh);
+    }
+#if OPENSSL_VERSION_NUMBER > 0x10002000L
+    SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+#endif
   }
-  res->len = (*p) - res->p;
-  if (*p < end) (*p)++;
+  return MG_SSL_OK;
 }
 
-int mg_parse_uri(const struct mg_str uri, struct mg_str *scheme,
-                 struct mg_str *user_info, struct mg_str *host,
-                 unsigned int *port, struct mg_str *path, struct mg_str *query,
-                 struct mg_str *fragment) {
-  struct mg_str rscheme = {0, 0}, ruser_info = {0, 0}, rhost = {0, 0},
-                rpath = {0, 0}, rquery = {0, 0}, rfragment = {0, 0};
-  unsigned int rport = 0;
-  enum {
-    P_START,
-    P_SCHEME_OR_PORT,
-    P_USER_INFO,
-    P_HOST,
-    P_PORT,
-    P_REST
-  } state = P_START;
+static enum mg_ssl_if_result mg_set_cipher_list(SSL_CTX *ctx, const char *cl) {
+  return (SSL_CTX_set_cipher_list(ctx, cl ? cl : mg_s_cipher_list) == 1
+              ? MG_SSL_OK
+              : MG_SSL_ERROR);
+}
 
-  const char *p = uri.p, *end = p + uri.len;
-  while (p < end) {
-    switch (state) {
-      case P_START:
-        /*
-         * expecting on of:
-         * - `scheme://xxxx`
-         * - `xxxx:port`
-         * - `[a:b:c]:port`
-         * - `xxxx/path`
-         */
-        if (*p == '[') {
-          state = P_HOST;
-          break;
-        }
-        for (; p < end; p++) {
-          if (*p == ':') {
-            state = P_SCHEME_OR_PORT;
-            break;
-          } else if (*p == '/') {
-            state = P_REST;
-            break;
-          }
-        }
-        if (state == P_START || state == P_REST) {
-          rhost.p = uri.p;
-          rhost.len = p - uri.p;
-        }
-        break;
-      case P_SCHEME_OR_PORT:
-        if (end - p >= 3 && strncmp(p, "://", 3) == 0) {
-          rscheme.p = uri.p;
-          rscheme.len = p - uri.p;
-          state = P_USER_INFO;
-          p += 3;
-        } else {
-          rhost.p = uri.p;
-          rhost.len = p - uri.p;
-          state = P_PORT;
-        }
-        break;
-      case P_USER_INFO:
-        ruser_info.p = p;
-        for (; p < end; p++) {
-          if (*p == '@' || *p == '[' || *p == '/') {
-            break;
-          }
-        }
-        if (p == end || *p == '/' || *p == '[') {
-          /* backtrack and parse as host */
-          p = ruser_info.p;
-        }
-        ruser_info.len = p - ruser_info.p;
-        state = P_HOST;
-        break;
-      case P_HOST:
-        if (*p == '@') p++;
-        rhost.p = p;
-        if (*p == '[') {
-          int found = 0;
-          for (; !found && p < end; p++) {
-            found = (*p == ']');
-          }
-          if (!found) return -1;
-        } else {
-          for (; p < end; p++) {
-            if (*p == ':' || *p == '/') break;
-          }
-        }
-        rhost.len = p - rhost.p;
-        if (p < end) {
-          if (*p == ':') {
-            state = P_PORT;
-            break;
-          } else if (*p == '/') {
-            state = P_REST;
-            break;
-          }
-        }
-        break;
-      case P_PORT:
-        p++;
-        for (; p < end; p++) {
-          if (*p == '/') {
-            state = P_REST;
-            break;
-          }
-          rport *= 10;
-          rport += *p - '0';
-        }
-        break;
-      case P_REST:
-        /* `p` points to separator. `path` includes the separator */
-        parse_uri_component(&p, end, "?#", &rpath);
-        if (p < end && *(p - 1) == '?') {
-          parse_uri_component(&p, end, "#", &rquery);
-        }
-        parse_uri_component(&p, end, "", &rfragment);
-        break;
-    }
-  }
-
-  if (scheme != 0) *scheme = rscheme;
-  if (user_info != 0) *user_info = ruser_info;
-  if (host != 0) *host = rhost;
-  if (port != 0) *port = rport;
-  if (path != 0) *path = rpath;
-  if (query != 0) *query = rquery;
-  if (fragment != 0) *fragment = rfragment;
-
-  return 0;
-}
-
-/* Normalize the URI path. Remove/resolve "." and "..". */
-int mg_normalize_uri_path(const struct mg_str *in, struct mg_str *out) {
-  const char *s = in->p, *se = s + in->len;
-  char *cp = (char *) out->p, *d;
-
-  if (in->len == 0 || *s != '/') {
-    out->len = 0;
+#ifndef KR_VERSION
+static unsigned int mg_ssl_if_ossl_psk_cb(SSL *ssl, const char *hint,
+                                          char *identity,
+                                          unsigned int max_identity_len,
+                                          unsigned char *psk,
+                                          unsigned int max_psk_len) {
+  struct mg_ssl_if_ctx *ctx =
+      (struct mg_ssl_if_ctx *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+  size_t key_len = ctx->psk.len - ctx->identity_len - 1;
+  DBG(("hint: '%s'", (hint ? hint : "")));
+  if (ctx->identity_len + 1 > max_identity_len) {
+    DBG(("identity too long"));
     return 0;
   }
-
-  d = cp;
-
-  while (s < se) {
-    const char *next = s;
-    struct mg_str component;
-    parse_uri_component(&next, se, "/", &component);
-    if (mg_vcmp(&component, ".") == 0) {
-      /* Yum. */
-    } else if (mg_vcmp(&component, "..") == 0) {
-      /* Backtrack to previous slash. */
-      if (d > cp + 1 && *(d - 1) == '/') d--;
-      while (d > cp && *(d - 1) != '/') d--;
-    } else {
-      memmove(d, s, next - s);
-      d += next - s;
-    }
-    s = next;
+  if (key_len > max_psk_len) {
+    DBG(("key too long"));
+    return 0;
   }
-  if (d == cp) *d++ = '/';
-
-  out->p = cp;
-  out->len = d - cp;
-  return 1;
+  memcpy(identity, ctx->psk.buf, ctx->identity_len + 1);
+  memcpy(psk, ctx->psk.buf + ctx->identity_len + 1, key_len);
+  (void) ssl;
+  return key_len;
 }
 
-int mg_assemble_uri(const struct mg_str *scheme, const struct mg_str *user_info,
-                    const struct mg_str *host, unsigned int port,
-                    const struct mg_str *path, const struct mg_str *query,
-                    const struct mg_str *fragment, int normalize_path,
-                    struct mg_str *uri) {
-  int result = -1;
-  struct mbuf out;
-  mbuf_init(&out, 0);
-
-  if (scheme != NULL && scheme->len > 0) {
-    mbuf_append(&out, scheme->p, scheme->len);
-    mbuf_append(&out, "://", 3);
-  }
-
-  if (user_info != NULL && user_info->len > 0) {
-    mbuf_append(&out, user_info->p, user_info->len);
-    mbuf_append(&out, "@", 1);
-  }
-
-  if (host != NULL && host->len > 0) {
-    mbuf_append(&out, host->p, host->len);
-  }
-
-  if (port != 0) {
-    char port_str[20];
-    int port_str_len = sprintf(port_str, ":%u", port);
-    mbuf_append(&out, port_str, port_str_len);
-  }
-
-  if (path != NULL && path->len > 0) {
-    if (normalize_path) {
-      struct mg_str npath = mg_strdup(*path);
-      if (npath.len != path->len) goto out;
-      if (!mg_normalize_uri_path(path, &npath)) {
-        free((void *) npath.p);
-        goto out;
-      }
-      mbuf_append(&out, npath.p, npath.len);
-      free((void *) npath.p);
+static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
+                                                    const char *identity,
+                                                    const char *key_str) {
+  unsigned char key[32];
+  size_t key_len;
+  size_t i = 0;
+  if (identity == NULL && key_str == NULL) return MG_SSL_OK;
+  if (identity == NULL || key_str == NULL) return MG_SSL_ERROR;
+  key_len = strlen(key_str);
+  if (key_len != 32 && key_len != 64) return MG_SSL_ERROR;
+  memset(key, 0, sizeof(key));
+  key_len = 0;
+  for (i = 0; key_str[i] != '\0'; i++) {
+    unsigned char c;
+    char hc = tolower((int) key_str[i]);
+    if (hc >= '0' && hc <= '9') {
+      c = hc - '0';
+    } else if (hc >= 'a' && hc <= 'f') {
+      c = hc - 'a' + 0xa;
     } else {
-      mbuf_append(&out, path->p, path->len);
+      return MG_SSL_ERROR;
     }
-  } else if (normalize_path) {
-    mbuf_append(&out, "/", 1);
-  }
-
-  if (query != NULL && query->len > 0) {
-    mbuf_append(&out, "?", 1);
-    mbuf_append(&out, query->p, query->len);
+    key_len = i / 2;
+    key[key_len] <<= 4;
+    key[key_len] |= c;
   }
+  key_len++;
+  DBG(("identity = '%s', key = (%u)", identity, (unsigned int) key_len));
+  ctx->identity_len = strlen(identity);
+  mbuf_append(&ctx->psk, identity, ctx->identity_len + 1);
+  mbuf_append(&ctx->psk, key, key_len);
+  SSL_CTX_set_psk_client_callback(ctx->ssl_ctx, mg_ssl_if_ossl_psk_cb);
+  SSL_CTX_set_app_data(ctx->ssl_ctx, ctx);
+  return MG_SSL_OK;
+}
+#else
+static enum mg_ssl_if_result mg_ssl_if_ossl_set_psk(struct mg_ssl_if_ctx *ctx,
+                                                    const char *identity,
+                                                    const char *key_str) {
+  (void) ctx;
+  (void) identity;
+  (void) key_str;
+  /* Krypton does not support PSK. */
+  return MG_SSL_ERROR;
+}
+#endif /* defined(KR_VERSION) */
 
-  if (fragment != NULL && fragment->len > 0) {
-    mbuf_append(&out, "#", 1);
-    mbuf_append(&out, fragment->p, fragment->len);
+const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
+                       const char *ca_cert) {
+  const char *err_msg = NULL;
+  struct mg_ssl_if_conn_params params;
+  memset(&params, 0, sizeof(params));
+  params.cert = cert;
+  params.ca_cert = ca_cert;
+  if (mg_ssl_if_conn_init(nc, &params, &err_msg) != MG_SSL_OK) {
+    return err_msg;
   }
+  return NULL;
+}
 
-  result = 0;
+#endif /* MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_OPENSSL */
 
-out:
-  if (result == 0) {
-    uri->p = out.buf;
-    uri->len = out.len;
-  } else {
-    mbuf_free(&out);
-    uri->p = NULL;
-    uri->len = 0;
-  }
-  return result;
-}
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_http.c"
+#line 1 "mongoose/src/mg_ssl_if_mbedtls.c"
 #endif
 /*
- * Copyright (c) 2014 Cesanta Software Limited
+ * Copyright (c) 2014-2016 Cesanta Software Limited
  * All rights reserved
  */
 
-#if MG_ENABLE_HTTP
-
-/* Amalgamated: #include "common/cs_md5.h" */
-/* Amalgamated: #include "mg_internal.h" */
-/* Amalgamated: #include "mg_util.h" */
-
-/* altbuf {{{ */
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_SSL
 
-/*
- * Alternate buffer: fills the client-provided buffer with data; and if it's
- * not large enough, allocates another buffer (via mbuf), similar to asprintf.
- */
-struct altbuf {
-  struct mbuf m;
-  char *user_buf;
-  size_t len;
-  size_t user_buf_size;
-};
+#if MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_MBEDTLS
 
-/*
- * Initializes altbuf; `buf`, `buf_size` is the client-provided buffer.
- */
-MG_INTERNAL void altbuf_init(struct altbuf *ab, char *buf, size_t buf_size) {
-  mbuf_init(&ab->m, 0);
-  ab->user_buf = buf;
-  ab->user_buf_size = buf_size;
-  ab->len = 0;
-}
+#include <mbedtls/debug.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
 
-/*
- * Appends a single char to the altbuf.
- */
-MG_INTERNAL void altbuf_append(struct altbuf *ab, char c) {
-  if (ab->len < ab->user_buf_size) {
-    /* The data fits into the original buffer */
-    ab->user_buf[ab->len++] = c;
-  } else {
-    /* The data can't fit into the original buffer, so write it to mbuf.  */
-
-    /*
-     * First of all, see if that's the first byte which overflows the original
-     * buffer: if so, copy the existing data from there to a newly allocated
-     * mbuf.
-     */
-    if (ab->len > 0 && ab->m.len == 0) {
-      mbuf_append(&ab->m, ab->user_buf, ab->len);
-    }
-
-    mbuf_append(&ab->m, &c, 1);
-    ab->len = ab->m.len;
+static void mg_ssl_mbed_log(void *ctx, int level, const char *file, int line,
+                            const char *str) {
+  enum cs_log_level cs_level;
+  switch (level) {
+    case 1:
+      cs_level = LL_ERROR;
+      break;
+    case 2:
+    case 3:
+      cs_level = LL_DEBUG;
+      break;
+    default:
+      cs_level = LL_VERBOSE_DEBUG;
   }
+  /* mbedTLS passes strings with \n at the end, strip it. */
+  LOG(cs_level, ("%p %.*s", ctx, (int) (strlen(str) - 1), str));
+  (void) file;
+  (void) line;
 }
 
-/*
- * Resets any data previously appended to altbuf.
- */
-MG_INTERNAL void altbuf_reset(struct altbuf *ab) {
-  mbuf_free(&ab->m);
-  ab->len = 0;
+struct mg_ssl_if_ctx {
+  mbedtls_ssl_config *conf;
+  mbedtls_ssl_context *ssl;
+  mbedtls_x509_crt *cert;
+  mbedtls_pk_context *key;
+  mbedtls_x509_crt *ca_cert;
+  struct mbuf cipher_suites;
+};
+
+/* Must be provided by the platform. ctx is struct mg_connection. */
+extern int mg_ssl_if_mbed_random(void *ctx, unsigned char *buf, size_t len);
+
+#if MG_ENABLE_MEM_PROFILER && defined(MBEDTLS_PLATFORM_MEMORY) && \
+    !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+#define MG_SSL_MBED_PROF_MEMORY 1
+static void *mg_ssl_mbed_calloc(size_t count, size_t size) {
+  return mg_mem_prof_calloc(MG_MEM_TAG_SSL, count, size);
 }
+#endif
 
-/*
- * Returns whether the additional buffer was allocated (and thus the data
- * is in the mbuf, not the client-provided buffer)
- */
-MG_INTERNAL int altbuf_reallocated(struct altbuf *ab) {
-  return ab->len > ab->user_buf_size;
+void mg_ssl_if_init() {
+#ifdef MG_SSL_MBED_PROF_MEMORY
+  /* Record buffers and handshake state are the bulk of SSL memory use. */
+  mbedtls_platform_set_calloc_free(mg_ssl_mbed_calloc, mg_mem_prof_free);
+#endif
 }
 
-/*
- * Returns the actual buffer with data, either the client-provided or a newly
- * allocated one. If `trim` is non-zero, mbuf-backed buffer is trimmed first.
- */
-MG_INTERNAL char *altbuf_get_buf(struct altbuf *ab, int trim) {
-  if (altbuf_reallocated(ab)) {
-    if (trim) {
-      mbuf_trim(&ab->m);
-    }
-    return ab->m.buf;
-  } else {
-    return ab->user_buf;
+enum mg_ssl_if_result mg_ssl_if_conn_accept(struct mg_connection *nc,
+                                            struct mg_connection *lc) {
+  struct mg_ssl_if_ctx *ctx =
+      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
+  struct mg_ssl_if_ctx *lc_ctx = (struct mg_ssl_if_ctx *) lc->ssl_if_data;
+  nc->ssl_if_data = ctx;
+  if (ctx == NULL || lc_ctx == NULL) return MG_SSL_ERROR;
+  ctx->ssl = (mbedtls_ssl_context *) MG_CALLOC(1, sizeof(*ctx->ssl));
+  if (mbedtls_ssl_setup(ctx->ssl, lc_ctx->conf) != 0) {
+    return MG_SSL_ERROR;
   }
+  return MG_SSL_OK;
 }
 
-/* }}} */
-
-static const char *mg_version_header = "Mongoose/" MG_VERSION;
-
-enum mg_http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT };
-
-struct mg_http_proto_data_file {
-  FILE *fp;      /* Opened file. */
-  int64_t cl;    /* Content-Length. How many bytes to send. */
-  int64_t sent;  /* How many bytes have been already sent. */
-  int keepalive; /* Keep connection open after sending. */
-  enum mg_http_proto_data_type type;
-};
+static enum mg_ssl_if_result mg_use_cert(struct mg_ssl_if_ctx *ctx,
+                                         const char *cert, const char *key,
+                                         const char **err_msg);
+static enum mg_ssl_if_result mg_use_ca_cert(struct mg_ssl_if_ctx *ctx,
+                                            const char *cert);
+static enum mg_ssl_if_result mg_set_cipher_list(struct mg_ssl_if_ctx *ctx,
+                                                const char *ciphers);
+static enum mg_ssl_if_result mg_ssl_if_mbed_set_psk(struct mg_ssl_if_ctx *ctx,
+                                                    const char *identity,
+                                                    const char *key);
 
-#if MG_ENABLE_HTTP_CGI
-struct mg_http_proto_data_cgi {
-  struct mg_connection *cgi_nc;
-};
-#endif
+enum mg_ssl_if_result mg_ssl_if_conn_init(
+    struct mg_connection *nc, const struct mg_ssl_if_conn_params *params,
+    const char **err_msg) {
+  struct mg_ssl_if_ctx *ctx =
+      (struct mg_ssl_if_ctx *) MG_CALLOC(1, sizeof(*ctx));
+  DBG(("%p %s,%s,%s", nc, (params->cert ? params->cert : ""),
+       (params->key ? params->key : ""),
+       (params->ca_cert ? params->ca_cert : "")));
 
-struct mg_http_proto_data_chuncked {
-  int64_t body_len; /* How many bytes of chunked body was reassembled. */
-};
+  if (ctx == NULL) {
+    MG_SET_PTRPTR(err_msg, "Out of memory");
+    return MG_SSL_ERROR;
+  }
+  nc->ssl_if_data = ctx;
+  ctx->conf = (mbedtls_ssl_config *) MG_CALLOC(1, sizeof(*ctx->conf));
+  mbuf_init(&ctx->cipher_suites, 0);
+  mbedtls_ssl_config_init(ctx->conf);
+  mbedtls_ssl_conf_dbg(ctx->conf, mg_ssl_mbed_log, nc);
+  if (mbedtls_ssl_config_defaults(
+          ctx->conf, (nc->flags & MG_F_LISTENING ? MBEDTLS_SSL_IS_SERVER
+                                                 : MBEDTLS_SSL_IS_CLIENT),
+          MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+    MG_SET_PTRPTR(err_msg, "Failed to init SSL config");
+    return MG_SSL_ERROR;
+  }
 
-struct mg_http_endpoint {
-  struct mg_http_endpoint *next;
-  struct mg_str uri_pattern; /* owned */
-  char *auth_domain;         /* owned */
-  char *auth_file;           /* owned */
+  /* TLS 1.2 and up */
+  mbedtls_ssl_conf_min_version(ctx->conf, MBEDTLS_SSL_MAJOR_VERSION_3,
+                               MBEDTLS_SSL_MINOR_VERSION_3);
+  mbedtls_ssl_conf_rng(ctx->conf, mg_ssl_if_mbed_random, nc);
 
-  mg_event_handler_t handler;
-#if MG_ENABLE_CALLBACK_USERDATA
-  void *user_data;
-#endif
-};
+  if (params->cert != NULL &&
+      mg_use_cert(ctx, params->cert, params->key, err_msg) != MG_SSL_OK) {
+    return MG_SSL_ERROR;
+  }
 
-enum mg_http_multipart_stream_state {
-  MPS_BEGIN,
-  MPS_WAITING_FOR_BOUNDARY,
-  MPS_WAITING_FOR_CHUNK,
-  MPS_GOT_CHUNK,
-  MPS_GOT_BOUNDARY,
-  MPS_FINALIZE,
-  MPS_FINISHED
-};
+  if (params->ca_cert != NULL &&
+      mg_use_ca_cert(ctx, params->ca_cert) != MG_SSL_OK) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL CA cert");
+    return MG_SSL_ERROR;
+  }
 
-struct mg_http_multipart_stream {
-  const char *boundary;
-  int boundary_len;
-  const char *var_name;
-  const char *file_name;
-  void *user_data;
-  int prev_io_len;
-  enum mg_http_multipart_stream_state state;
-  int processing_part;
-};
+  if (mg_set_cipher_list(ctx, params->cipher_suites) != MG_SSL_OK) {
+    MG_SET_PTRPTR(err_msg, "Invalid cipher suite list");
+    return MG_SSL_ERROR;
+  }
 
-struct mg_reverse_proxy_data {
-  struct mg_connection *linked_conn;
-};
+  if (mg_ssl_if_mbed_set_psk(ctx, params->psk_identity, params->psk_key) !=
+      MG_SSL_OK) {
+    MG_SET_PTRPTR(err_msg, "Invalid PSK settings");
+    return MG_SSL_ERROR;
+  }
 
-struct mg_ws_proto_data {
-  /*
-   * Defragmented size of the frame so far.
-   *
-   * First byte of nc->recv_mbuf.buf is an op, the rest of the data is
-   * defragmented data.
-   */
-  size_t reass_len;
-};
+  if (!(nc->flags & MG_F_LISTENING)) {
+    ctx->ssl = (mbedtls_ssl_context *) MG_CALLOC(1, sizeof(*ctx->ssl));
+    mbedtls_ssl_init(ctx->ssl);
+    if (mbedtls_ssl_setup(ctx->ssl, ctx->conf) != 0) {
+      MG_SET_PTRPTR(err_msg, "Failed to create SSL session");
+      return MG_SSL_ERROR;
+    }
+    if (params->server_name != NULL &&
+        mbedtls_ssl_set_hostname(ctx->ssl, params->server_name) != 0) {
+      return MG_SSL_ERROR;
+    }
+  }
 
-struct mg_http_proto_data {
-#if MG_ENABLE_FILESYSTEM
-  struct mg_http_proto_data_file file;
-#endif
-#if MG_ENABLE_HTTP_CGI
-  struct mg_http_proto_data_cgi cgi;
-#endif
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-  struct mg_http_multipart_stream mp_stream;
+#ifdef MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN
+  if (mbedtls_ssl_conf_max_frag_len(ctx->conf,
+#if MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 512
+                                    MBEDTLS_SSL_MAX_FRAG_LEN_512
+#elif MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 1024
+                                    MBEDTLS_SSL_MAX_FRAG_LEN_1024
+#elif MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 2048
+                                    MBEDTLS_SSL_MAX_FRAG_LEN_2048
+#elif MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN == 4096
+                                    MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#else
+#error Invalid MG_SSL_IF_MBEDTLS_MAX_FRAG_LEN
 #endif
-#if MG_ENABLE_HTTP_WEBSOCKET
-  struct mg_ws_proto_data ws_data;
+                                    ) != 0) {
+    return MG_SSL_ERROR;
+  }
 #endif
-  struct mg_http_proto_data_chuncked chunk;
-  struct mg_http_endpoint *endpoints;
-  mg_event_handler_t endpoint_handler;
-  struct mg_reverse_proxy_data reverse_proxy_data;
-  size_t rcvd; /* How many bytes we have received. */
-};
 
-static void mg_http_conn_destructor(void *proto_data);
-struct mg_connection *mg_connect_http_base(
-    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
-    struct mg_connect_opts opts, const char *scheme1, const char *scheme2,
-    const char *scheme_ssl1, const char *scheme_ssl2, const char *url,
-    struct mg_str *path, struct mg_str *user_info, struct mg_str *host);
+  nc->flags |= MG_F_SSL;
 
-static struct mg_http_proto_data *mg_http_get_proto_data(
-    struct mg_connection *c) {
-  if (c->proto_data == NULL) {
-    c->proto_data = MG_CALLOC(1, sizeof(struct mg_http_proto_data));
-    c->proto_data_destructor = mg_http_conn_destructor;
-  }
-
-  return (struct mg_http_proto_data *) c->proto_data;
+  return MG_SSL_OK;
 }
 
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-static void mg_http_free_proto_data_mp_stream(
-    struct mg_http_multipart_stream *mp) {
-  MG_FREE((void *) mp->boundary);
-  MG_FREE((void *) mp->var_name);
-  MG_FREE((void *) mp->file_name);
-  memset(mp, 0, sizeof(*mp));
+#if MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL
+int ssl_socket_send(void *ctx, const unsigned char *buf, size_t len);
+int ssl_socket_recv(void *ctx, unsigned char *buf, size_t len);
+#else
+static int ssl_socket_send(void *ctx, const unsigned char *buf, size_t len) {
+  struct mg_connection *nc = (struct mg_connection *) ctx;
+  int n = (int) MG_SEND_FUNC(nc->sock, buf, len, 0);
+  LOG(LL_DEBUG, ("%p %d -> %d", nc, (int) len, n));
+  if (n >= 0) return n;
+  n = mg_get_errno();
+  return ((n == EAGAIN || n == EINPROGRESS) ? MBEDTLS_ERR_SSL_WANT_WRITE : -1);
 }
-#endif
 
-#if MG_ENABLE_FILESYSTEM
-static void mg_http_free_proto_data_file(struct mg_http_proto_data_file *d) {
-  if (d != NULL) {
-    if (d->fp != NULL) {
-      fclose(d->fp);
-    }
-    memset(d, 0, sizeof(struct mg_http_proto_data_file));
-  }
+static int ssl_socket_recv(void *ctx, unsigned char *buf, size_t len) {
+  struct mg_connection *nc = (struct mg_connection *) ctx;
+  int n = (int) MG_RECV_FUNC(nc->sock, buf, len, 0);
+  LOG(LL_DEBUG, ("%p %d <- %d", nc, (int) len, n));
+  if (n >= 0) return n;
+  n = mg_get_errno();
+  return ((n == EAGAIN || n == EINPROGRESS) ? MBEDTLS_ERR_SSL_WANT_READ : -1);
 }
 #endif
 
-static void mg_http_free_proto_data_endpoints(struct mg_http_endpoint **ep) {
-  struct mg_http_endpoint *current = *ep;
-
-  while (current != NULL) {
-    struct mg_http_endpoint *tmp = current->next;
-    MG_FREE((void *) current->uri_pattern.p);
-    MG_FREE((void *) current->auth_domain);
-    MG_FREE((void *) current->auth_file);
-    MG_FREE(current);
-    current = tmp;
+static enum mg_ssl_if_result mg_ssl_if_mbed_err(struct mg_connection *nc,
+                                                int ret) {
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ) return MG_SSL_WANT_READ;
+  if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) return MG_SSL_WANT_WRITE;
+  if (ret !=
+      MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) { /* CLOSE_NOTIFY = Normal shutdown */
+    LOG(LL_ERROR, ("%p SSL error: %d", nc, ret));
   }
-
-  ep = NULL;
+  nc->err = ret;
+  nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  return MG_SSL_ERROR;
 }
 
-static void mg_http_free_reverse_proxy_data(struct mg_reverse_proxy_data *rpd) {
-  if (rpd->linked_conn != NULL) {
-    /*
-     * Connection has linked one, we have to unlink & close it
-     * since _this_ connection is going to die and
-     * it doesn't make sense to keep another one
-     */
-    struct mg_http_proto_data *pd = mg_http_get_proto_data(rpd->linked_conn);
-    if (pd->reverse_proxy_data.linked_conn != NULL) {
-      pd->reverse_proxy_data.linked_conn->flags |= MG_F_SEND_AND_CLOSE;
-      pd->reverse_proxy_data.linked_conn = NULL;
+static void mg_ssl_if_mbed_free_certs_and_keys(struct mg_ssl_if_ctx *ctx) {
+  if (ctx->cert != NULL) {
+    mbedtls_x509_crt_free(ctx->cert);
+    MG_FREE(ctx->cert);
+    ctx->cert = NULL;
+    mbedtls_pk_free(ctx->key);
+    MG_FREE(ctx->key);
+    ctx->key = NULL;
+  }
+  if (ctx->ca_cert != NULL) {
+    mbedtls_ssl_conf_ca_chain(ctx->conf, NULL, NULL);
+#ifdef MBEDTLS_X509_CA_CHAIN_ON_DISK
+    if (ctx->ca_cert->ca_chain_file != NULL) {
+      MG_FREE((void *) ctx->ca_cert->ca_chain_file);
+      ctx->ca_cert->ca_chain_file = NULL;
     }
-    rpd->linked_conn = NULL;
+#endif
+    mbedtls_x509_crt_free(ctx->ca_cert);
+    MG_FREE(ctx->ca_cert);
+    ctx->ca_cert = NULL;
   }
 }
 
-static void mg_http_conn_destructor(void *proto_data) {
-  struct mg_http_proto_data *pd = (struct mg_http_proto_data *) proto_data;
-#if MG_ENABLE_FILESYSTEM
-  mg_http_free_proto_data_file(&pd->file);
-#endif
-#if MG_ENABLE_HTTP_CGI
-  mg_http_free_proto_data_cgi(&pd->cgi);
-#endif
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-  mg_http_free_proto_data_mp_stream(&pd->mp_stream);
+enum mg_ssl_if_result mg_ssl_if_handshake(struct mg_connection *nc) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int err;
+  /* If bio is not yet set, do it now. */
+  if (ctx->ssl->p_bio == NULL) {
+    mbedtls_ssl_set_bio(ctx->ssl, nc, ssl_socket_send, ssl_socket_recv, NULL);
+  }
+  err = mbedtls_ssl_handshake(ctx->ssl);
+  if (err != 0) return mg_ssl_if_mbed_err(nc, err);
+#ifdef MG_SSL_IF_MBEDTLS_FREE_CERTS
+  /*
+   * Free the peer certificate, we don't need it after handshake.
+   * Note that this effectively disables renegotiation.
+   */
+  mbedtls_x509_crt_free(ctx->ssl->session->peer_cert);
+  mbedtls_free(ctx->ssl->session->peer_cert);
+  ctx->ssl->session->peer_cert = NULL;
+  /* On a client connection we can also free our own and CA certs. */
+  if (nc->listener == NULL) {
+    if (ctx->conf->key_cert != NULL) {
+      /* Note that this assumes one key_cert entry, which matches our init. */
+      MG_FREE(ctx->conf->key_cert);
+      ctx->conf->key_cert = NULL;
+    }
+    mbedtls_ssl_conf_ca_chain(ctx->conf, NULL, NULL);
+    mg_ssl_if_mbed_free_certs_and_keys(ctx);
+  }
 #endif
-  mg_http_free_proto_data_endpoints(&pd->endpoints);
-  mg_http_free_reverse_proxy_data(&pd->reverse_proxy_data);
-  MG_FREE(proto_data);
+  return MG_SSL_OK;
 }
 
-#if MG_ENABLE_FILESYSTEM
-
-#define MIME_ENTRY(_ext, _type) \
-  { _ext, sizeof(_ext) - 1, _type }
-static const struct {
-  const char *extension;
-  size_t ext_len;
-  const char *mime_type;
-} mg_static_builtin_mime_types[] = {
-    MIME_ENTRY("html", "text/html"),
-    MIME_ENTRY("html", "text/html"),
-    MIME_ENTRY("htm", "text/html"),
-    MIME_ENTRY("shtm", "text/html"),
-    MIME_ENTRY("shtml", "text/html"),
-    MIME_ENTRY("css", "text/css"),
-    MIME_ENTRY("js", "application/x-javascript"),
-    MIME_ENTRY("ico", "image/x-icon"),
-    MIME_ENTRY("gif", "image/gif"),
-    MIME_ENTRY("jpg", "image/jpeg"),
-    MIME_ENTRY("jpeg", "image/jpeg"),
-    MIME_ENTRY("png", "image/png"),
-    MIME_ENTRY("svg", "image/svg+xml"),
-    MIME_ENTRY("txt", "text/plain"),
-    MIME_ENTRY("torrent", "application/x-bittorrent"),
-    MIME_ENTRY("wav", "audio/x-wav"),
-    MIME_ENTRY("mp3", "audio/x-mp3"),
-    MIME_ENTRY("mid", "audio/mid"),
-    MIME_ENTRY("m3u", "audio/x-mpegurl"),
-    MIME_ENTRY("ogg", "application/ogg"),
-    MIME_ENTRY("ram", "audio/x-pn-realaudio"),
-    MIME_ENTRY("xml", "text/xml"),
-    MIME_ENTRY("ttf", "application/x-font-ttf"),
-    MIME_ENTRY("json", "application/json"),
-    MIME_ENTRY("xslt", "application/xml"),
-    MIME_ENTRY("xsl", "application/xml"),
-    MIME_ENTRY("ra", "audio/x-pn-realaudio"),
-    MIME_ENTRY("doc", "application/msword"),
-    MIME_ENTRY("exe", "application/octet-stream"),
-    MIME_ENTRY("zip", "application/x-zip-compressed"),
-    MIME_ENTRY("xls", "application/excel"),
-    MIME_ENTRY("tgz", "application/x-tar-gz"),
-    MIME_ENTRY("tar", "application/x-tar"),
-    MIME_ENTRY("gz", "application/x-gunzip"),
-    MIME_ENTRY("arj", "application/x-arj-compressed"),
-    MIME_ENTRY("rar", "application/x-rar-compressed"),
-    MIME_ENTRY("rtf", "application/rtf"),
-    MIME_ENTRY("pdf", "application/pdf"),
-    MIME_ENTRY("swf", "application/x-shockwave-flash"),
-    MIME_ENTRY("mpg", "video/mpeg"),
-    MIME_ENTRY("webm", "video/webm"),
-    MIME_ENTRY("mpeg", "video/mpeg"),
-    MIME_ENTRY("mov", "video/quicktime"),
-    MIME_ENTRY("mp4", "video/mp4"),
-    MIME_ENTRY("m4v", "video/x-m4v"),
-    MIME_ENTRY("asf", "video/x-ms-asf"),
-    MIME_ENTRY("avi", "video/x-msvideo"),
-    MIME_ENTRY("bmp", "image/bmp"),
-    {NULL, 0, NULL}};
+int mg_ssl_if_read(struct mg_connection *nc, void *buf, size_t buf_size) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int n = mbedtls_ssl_read(ctx->ssl, (unsigned char *) buf, buf_size);
+  DBG(("%p %d -> %d", nc, (int) buf_size, n));
+  if (n < 0) return mg_ssl_if_mbed_err(nc, n);
+  if (n == 0) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  return n;
+}
 
-static struct mg_str mg_get_mime_type(const char *path, const char *dflt,
-                                      const struct mg_serve_http_opts *opts) {
-  const char *ext, *overrides;
-  size_t i, path_len;
-  struct mg_str r, k, v;
+int mg_ssl_if_write(struct mg_connection *nc, const void *data, size_t len) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  int n = mbedtls_ssl_write(ctx->ssl, (const unsigned char *) data, len);
+  DBG(("%p %d -> %d", nc, (int) len, n));
+  if (n < 0) return mg_ssl_if_mbed_err(nc, n);
+  return n;
+}
 
-  path_len = strlen(path);
+void mg_ssl_if_conn_close_notify(struct mg_connection *nc) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  if (ctx == NULL) return;
+  mbedtls_ssl_close_notify(ctx->ssl);
+}
 
-  overrides = opts->custom_mime_types;
-  while ((overrides = mg_next_comma_list_entry(overrides, &k, &v)) != NULL) {
-    ext = path + (path_len - k.len);
-    if (path_len > k.len && mg_vcasecmp(&k, ext) == 0) {
-      return v;
-    }
+void mg_ssl_if_conn_free(struct mg_connection *nc) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  if (ctx == NULL) return;
+  nc->ssl_if_data = NULL;
+  if (ctx->ssl != NULL) {
+    mbedtls_ssl_free(ctx->ssl);
+    MG_FREE(ctx->ssl);
   }
-
-  for (i = 0; mg_static_builtin_mime_types[i].extension != NULL; i++) {
-    ext = path + (path_len - mg_static_builtin_mime_types[i].ext_len);
-    if (path_len > mg_static_builtin_mime_types[i].ext_len && ext[-1] == '.' &&
-        mg_casecmp(ext, mg_static_builtin_mime_types[i].extension) == 0) {
-      r.p = mg_static_builtin_mime_types[i].mime_type;
-      r.len = strlen(r.p);
-      return r;
-    }
+  mg_ssl_if_mbed_free_certs_and_keys(ctx);
+  if (ctx->conf != NULL) {
+    mbedtls_ssl_config_free(ctx->conf);
+    MG_FREE(ctx->conf);
   }
-
-  r.p = dflt;
-  r.len = strlen(r.p);
-  return r;
+  mbuf_free(&ctx->cipher_suites);
+  memset(ctx, 0, sizeof(*ctx));
+  MG_FREE(ctx);
 }
-#endif
 
-/*
- * Check whether full request is buffered. Return:
- *   -1  if request is malformed
- *    0  if request is not yet fully buffered
- *   >0  actual request length, including last \r\n\r\n
- */
-static int mg_http_get_request_len(const char *s, int buf_len) {
-  const unsigned char *buf = (unsigned char *) s;
-  int i;
+void mg_ssl_if_set_alpn(struct mg_connection *nc, const char **protos) {
+  struct mg_ssl_if_ctx *ctx = (struct mg_ssl_if_ctx *) nc->ssl_if_data;
+  if (ctx == NULL || ctx->conf == NULL) return;
+#ifdef MBEDTLS_SSL_ALPN
+  /* Accepted connections are set up with the listener's config */
+  mbedtls_ssl_conf_alpn_protocols(ctx->conf, protos);
+#else
+  (void) protos;
+#endif
+}
 
-  for (i = 0; i < buf_len; i++) {
-    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
-      return -1;
-    } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
-      return i + 2;
-    } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
-               buf[i + 2] == '\n') {
-      return i + 3;
-    }
+static enum mg_ssl_if_result mg_use_ca_cert(struct mg_ssl_if_ctx *ctx,
+                                            const char *ca_cert) {
+  if (ca_cert == NULL || strcmp(ca_cert, "*") == 0) {
+    mbedtls_ssl_conf_authmode(ctx->conf, MBEDTLS_SSL_VERIFY_NONE);
+    return MG_SSL_OK;
   }
-
-  return 0;
+  ctx->ca_cert = (mbedtls_x509_crt *) MG_CALLOC(1, sizeof(*ctx->ca_cert));
+  mbedtls_x509_crt_init(ctx->ca_cert);
+#ifdef MBEDTLS_X509_CA_CHAIN_ON_DISK
+  ca_cert = strdup(ca_cert);
+  if (mbedtls_x509_crt_set_ca_chain_file(ctx->ca_cert, ca_cert) != 0) {
+    return MG_SSL_ERROR;
+  }
+#else
+  if (mbedtls_x509_crt_parse_file(ctx->ca_cert, ca_cert) != 0) {
+    return MG_SSL_ERROR;
+  }
+#endif
+  mbedtls_ssl_conf_ca_chain(ctx->conf, ctx->ca_cert, NULL);
+  mbedtls_ssl_conf_authmode(ctx->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  return MG_SSL_OK;
 }
 
-static const char *mg_http_parse_headers(const char *s, const char *end,
-                                         int len, struct http_message *req) {
-  int i = 0;
-  while (i < (int) ARRAY_SIZE(req->header_names) - 1) {
-    struct mg_str *k = &req->header_names[i], *v = &req->header_values[i];
-
-    s = mg_skip(s, end, ": ", k);
-    s = mg_skip(s, end, "\r\n", v);
-
-    while (v->len > 0 && v->p[v->len - 1] == ' ') {
-      v->len--; /* Trim trailing spaces in header value */
-    }
+static enum mg_ssl_if_result mg_use_cert(struct mg_ssl_if_ctx *ctx,
+                                         const char *cert, const char *key,
+                                         const char **err_msg) {
+  if (key == NULL) key = cert;
+  if (cert == NULL || cert[0] == '\0' || key == NULL || key[0] == '\0') {
+    return MG_SSL_OK;
+  }
+  ctx->cert = (mbedtls_x509_crt *) MG_CALLOC(1, sizeof(*ctx->cert));
+  mbedtls_x509_crt_init(ctx->cert);
+  ctx->key = (mbedtls_pk_context *) MG_CALLOC(1, sizeof(*ctx->key));
+  mbedtls_pk_init(ctx->key);
+  if (mbedtls_x509_crt_parse_file(ctx->cert, cert) != 0) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL cert");
+    return MG_SSL_ERROR;
+  }
+  if (mbedtls_pk_parse_keyfile(ctx->key, key, NULL) != 0) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL key");
+    return MG_SSL_ERROR;
+  }
+  if (mbedtls_ssl_conf_own_cert(ctx->conf, ctx->cert, ctx->key) != 0) {
+    MG_SET_PTRPTR(err_msg, "Invalid SSL key or cert");
+    return MG_SSL_ERROR;
+  }
+  return MG_SSL_OK;
+}
 
+static const int mg_s_cipher_list[] = {
+#if CS_PLATFORM != CS_P_ESP8266
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_DHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_DHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+#else
     /*
-     * If header value is empty - skip it and go to next (if any).
-     * NOTE: Do not add it to headers_values because such addition changes API
-     * behaviour
+     * ECDHE is way too slow on ESP8266 w/o cryptochip, this sometimes results
+     * in WiFi STA deauths. Use weaker but faster cipher suites. Sad but true.
+     * Disable DHE completely because it's just hopelessly slow.
      */
-    if (k->len != 0 && v->len == 0) {
-      continue;
-    }
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDH_ECDSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDH_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+#endif /* CS_PLATFORM != CS_P_ESP8266 */
+    0,
+};
 
-    if (k->len == 0 || v->len == 0) {
-      k->p = v->p = NULL;
-      k->len = v->len = 0;
-      break;
+/*
+ * Ciphers can be specified as a colon-separated list of cipher suite names.
+ * These can be found in
+ * https://github.com/ARMmbed/mbedtls/blob/development/library/ssl_ciphersuites.c#L267
+ * E.g.: TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256:TLS-DHE-RSA-WITH-AES-256-CCM
+ */
+static enum mg_ssl_if_result mg_set_cipher_list(struct mg_ssl_if_ctx *ctx,
+                                                const char *ciphers) {
+  if (ciphers != NULL) {
+    int l, id;
+    const char *s = ciphers, *e;
+    char tmp[50];
+    while (s != NULL) {
+      e = strchr(s, ':');
+      l = (e != NULL ? (e - s) : (int) strlen(s));
+      strncpy(tmp, s, l);
+      tmp[l] = '\0';
+      id = mbedtls_ssl_get_ciphersuite_id(tmp);
+      DBG(("%s -> %04x", tmp, id));
+      if (id != 0) {
+        mbuf_append(&ctx->cipher_suites, &id, sizeof(id));
+      }
+      s = (e != NULL ? e + 1 : NULL);
     }
+    if (ctx->cipher_suites.len == 0) return MG_SSL_ERROR;
+    id = 0;
+    mbuf_append(&ctx->cipher_suites, &id, sizeof(id));
+    mbuf_trim(&ctx->cipher_suites);
+    mbedtls_ssl_conf_ciphersuites(ctx->conf,
+                                  (const int *) ctx->cipher_suites.buf);
+  } else {
+    mbedtls_ssl_conf_ciphersuites(ctx->conf, mg_s_cipher_list);
+  }
+  return MG_SSL_OK;
+}
 
-    if (!mg_ncasecmp(k->p, "Content-Length", 14)) {
-      req->body.len = (size_t) to64(v->p);
-      req->message.len = len + req->body.len;
+static enum mg_ssl_if_result mg_ssl_if_mbed_set_psk(struct mg_ssl_if_ctx *ctx,
+                                                    const char *identity,
+                                                    const char *key_str) {
+  unsigned char key[32];
+  size_t key_len;
+  if (identity == NULL && key_str == NULL) return MG_SSL_OK;
+  if (identity == NULL || key_str == NULL) return MG_SSL_ERROR;
+  key_len = strlen(key_str);
+  if (key_len != 32 && key_len != 64) return MG_SSL_ERROR;
+  size_t i = 0;
+  memset(key, 0, sizeof(key));
+  key_len = 0;
+  for (i = 0; key_str[i] != '\0'; i++) {
+    unsigned char c;
+    char hc = tolower((int) key_str[i]);
+    if (hc >= '0' && hc <= '9') {
+      c = hc - '0';
+    } else if (hc >= 'a' && hc <= 'f') {
+      c = hc - 'a' + 0xa;
+    } else {
+      return MG_SSL_ERROR;
     }
-
-    i++;
+    key_len = i / 2;
+    key[key_len] <<= 4;
+    key[key_len] |= c;
   }
-
-  return s;
+  key_len++;
+  DBG(("identity = '%s', key = (%u)", identity, (unsigned int) key_len));
+  /* mbedTLS makes copies of psk and identity. */
+  if (mbedtls_ssl_conf_psk(ctx->conf, (const unsigned char *) key, key_len,
+                           (const unsigned char *) identity,
+                           strlen(identity)) != 0) {
+    return MG_SSL_ERROR;
+  }
+  return MG_SSL_OK;
 }
 
-int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
-  const char *end, *qs;
-  int len = mg_http_get_request_len(s, n);
+const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
+                       const char *ca_cert) {
+  const char *err_msg = NULL;
+  struct mg_ssl_if_conn_params params;
+  memset(&params, 0, sizeof(params));
+  params.cert = cert;
+  params.ca_cert = ca_cert;
+  if (mg_ssl_if_conn_init(nc, &params, &err_msg) != MG_SSL_OK) {
+    return err_msg;
+  }
+  return NULL;
+}
 
-  if (len <= 0) return len;
+/* Lazy RNG. Warning: it would be a bad idea to do this in production! */
+#ifdef MG_SSL_MBED_DUMMY_RANDOM
+int mg_ssl_if_mbed_random(void *ctx, unsigned char *buf, size_t len) {
+  (void) ctx;
+  while (len--) *buf++ = rand();
+  return 0;
+}
+#endif
 
-  memset(hm, 0, sizeof(*hm));
-  hm->message.p = s;
-  hm->body.p = s + len;
-  hm->message.len = hm->body.len = (size_t) ~0;
-  end = s + len;
+#endif /* MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_MBEDTLS */
 
-  /* Request is fully buffered. Skip leading whitespaces. */
-  while (s < end && isspace(*(unsigned char *) s)) s++;
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_uri.c"
+#endif
+/*
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
+ */
 
-  if (is_req) {
-    /* Parse request line: method, URI, proto */
-    s = mg_skip(s, end, " ", &hm->method);
-    s = mg_skip(s, end, " ", &hm->uri);
-    s = mg_skip(s, end, "\r\n", &hm->proto);
-    if (hm->uri.p <= hm->method.p || hm->proto.p <= hm->uri.p) return -1;
+/* Amalgamated: #include "mg_internal.h" */
+/* Amalgamated: #include "mg_uri.h" */
 
-    /* If URI contains '?' character, initialize query_string */
-    if ((qs = (char *) memchr(hm->uri.p, '?', hm->uri.len)) != NULL) {
-      hm->query_string.p = qs + 1;
-      hm->query_string.len = &hm->uri.p[hm->uri.len] - (qs + 1);
-      hm->uri.len = qs - hm->uri.p;
-    }
-  } else {
-    s = mg_skip(s, end, " ", &hm->proto);
-    if (end - s < 4 || s[3] != ' ') return -1;
-    hm->resp_code = atoi(s);
-    if (hm->resp_code < 100 || hm->resp_code >= 600) return -1;
-    s += 4;
-    s = mg_skip(s, end, "\r\n", &hm->resp_status_msg);
+/*
+ * scan string until encountering one of `seps`, keeping track of component
+ * boundaries in `res`.
+ *
+ * `p` will point to the char after the separator or it will be `end`.
+ */
+static void parse_uri_component(const char **p, const char *end,
+                                const char *seps, struct mg_str *res) {
+  const char *q;
+  res->p = *p;
+  for (; *p < end; (*p)++) {
+    for (q = seps; *q != '\0'; q++) {
+      if (**p == *q) break;
+    }
+    if (*q != '\0') break;
   }
+  res->len = (*p) - res->p;
+  if (*p < end) (*p)++;
+}
 
-  s = mg_http_parse_headers(s, end, len, hm);
+int mg_parse_uri(const struct mg_str uri, struct mg_str *scheme,
+                 struct mg_str *user_info, struct mg_str *host,
+                 unsigned int *port, struct mg_str *path, struct mg_str *query,
+                 struct mg_str *fragment) {
+  struct mg_str rscheme = {0, 0}, ruser_info = {0, 0}, rhost = {0, 0},
+                rpath = {0, 0}, rquery = {0, 0}, rfragment = {0, 0};
+  unsigned int rport = 0;
+  enum {
+    P_START,
+    P_SCHEME_OR_PORT,
+    P_USER_INFO,
+    P_HOST,
+    P_PORT,
+    P_REST
+  } state = P_START;
 
-  /*
-   * mg_parse_http() is used to parse both HTTP requests and HTTP
-   * responses. If HTTP response does not have Content-Length set, then
-   * body is read until socket is closed, i.e. body.len is infinite (~0).
-   *
-   * For HTTP requests though, according to
-   * http://tools.ietf.org/html/rfc7231#section-8.1.3,
-   * only POST and PUT methods have defined body semantics.
-   * Therefore, if Content-Length is not specified and methods are
-   * not one of PUT or POST, set body length to 0.
-   *
-   * So,
-   * if it is HTTP request, and Content-Length is not set,
-   * and method is not (PUT or POST) then reset body length to zero.
-   */
-  if (hm->body.len == (size_t) ~0 && is_req &&
-      mg_vcasecmp(&hm->method, "PUT") != 0 &&
-      mg_vcasecmp(&hm->method, "POST") != 0) {
-    hm->body.len = 0;
-    hm->message.len = len;
+  const char *p = uri.p, *end = p + uri.len;
+  while (p < end) {
+    switch (state) {
+      case P_START:
+        /*
+         * expecting on of:
+         * - `scheme://xxxx`
+         * - `xxxx:port`
+         * - `[a:b:c]:port`
+         * - `xxxx/path`
+         */
+        if (*p == '[') {
+          state = P_HOST;
+          break;
+        }
+        for (; p < end; p++) {
+          if (*p == ':') {
+            state = P_SCHEME_OR_PORT;
+            break;
+          } else if (*p == '/') {
+            state = P_REST;
+            break;
+          }
+        }
+        if (state == P_START || state == P_REST) {
+          rhost.p = uri.p;
+          rhost.len = p - uri.p;
+        }
+        break;
+      case P_SCHEME_OR_PORT:
+        if (end - p >= 3 && strncmp(p, "://", 3) == 0) {
+          rscheme.p = uri.p;
+          rscheme.len = p - uri.p;
+          state = P_USER_INFO;
+          p += 3;
+        } else {
+          rhost.p = uri.p;
+          rhost.len = p - uri.p;
+          state = P_PORT;
+        }
+        break;
+      case P_USER_INFO:
+        ruser_info.p = p;
+        for (; p < end; p++) {
+          if (*p == '@' || *p == '[' || *p == '/') {
+            break;
+          }
+        }
+        if (p == end || *p == '/' || *p == '[') {
+          /* backtrack and parse as host */
+          p = ruser_info.p;
+        }
+        ruser_info.len = p - ruser_info.p;
+        state = P_HOST;
+        break;
+      case P_HOST:
+        if (*p == '@') p++;
+        rhost.p = p;
+        if (*p == '[') {
+          int found = 0;
+          for (; !found && p < end; p++) {
+            found = (*p == ']');
+          }
+          if (!found) return -1;
+        } else {
+          for (; p < end; p++) {
+            if (*p == ':' || *p == '/') break;
+          }
+        }
+        rhost.len = p - rhost.p;
+        if (p < end) {
+          if (*p == ':') {
+            state = P_PORT;
+            break;
+          } else if (*p == '/') {
+            state = P_REST;
+            break;
+          }
+        }
+        break;
+      case P_PORT:
+        p++;
+        for (; p < end; p++) {
+          if (*p == '/') {
+            state = P_REST;
+            break;
+          }
+          rport *= 10;
+          rport += *p - '0';
+        }
+        break;
+      case P_REST:
+        /* `p` points to separator. `path` includes the separator */
+        parse_uri_component(&p, end, "?#", &rpath);
+        if (p < end && *(p - 1) == '?') {
+          parse_uri_component(&p, end, "#", &rquery);
+        }
+        parse_uri_component(&p, end, "", &rfragment);
+        break;
+    }
   }
 
-  return len;
+  if (scheme != 0) *scheme = rscheme;
+  if (user_info != 0) *user_info = ruser_info;
+  if (host != 0) *host = rhost;
+  if (port != 0) *port = rport;
+  if (path != 0) *path = rpath;
+  if (query != 0) *query = rquery;
+  if (fragment != 0) *fragment = rfragment;
+
+  return 0;
 }
 
-struct mg_str *mg_get_http_header(struct http_message *hm, const char *name) {
-  size_t i, len = strlen(name);
+/* Normalize the URI path. Remove/resolve "." and "..". */
+int mg_normalize_uri_path(const struct mg_str *in, struct mg_str *out) {
+  const char *s = in->p, *se = s + in->len;
+  char *cp = (char *) out->p, *d;
 
-  for (i = 0; hm->header_names[i].len > 0; i++) {
-    struct mg_str *h = &hm->header_names[i], *v = &hm->header_values[i];
-    if (h->p != NULL && h->len == len && !mg_ncasecmp(h->p, name, len))
-      return v;
+  if (in->len == 0 || *s != '/') {
+    out->len = 0;
+    return 0;
   }
 
-  return NULL;
-}
-
-#if MG_ENABLE_FILESYSTEM
-static void mg_http_transfer_file_data(struct mg_connection *nc) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  char buf[MG_MAX_HTTP_SEND_MBUF];
-  size_t n = 0, to_read = 0, left = (size_t)(pd->file.cl - pd->file.sent);
+  d = cp;
 
-  if (pd->file.type == DATA_FILE) {
-    struct mbuf *io = &nc->send_mbuf;
-    if (io->len >= MG_MAX_HTTP_SEND_MBUF) {
-      to_read = 0;
-    } else {
-      to_read = MG_MAX_HTTP_SEND_MBUF - io->len;
-    }
-    if (to_read > left) {
-      to_read = left;
-    }
-    if (to_read > 0) {
-      n = mg_fread(buf, 1, to_read, pd->file.fp);
-      if (n > 0) {
-        mg_send(nc, buf, n);
-        pd->file.sent += n;
-        DBG(("%p sent %d (total %d)", nc, (int) n, (int) pd->file.sent));
-      }
-    } else {
-      /* Rate-limited */
-    }
-    if (pd->file.sent >= pd->file.cl) {
-      LOG(LL_DEBUG, ("%p done, %d bytes", nc, (int) pd->file.sent));
-      if (!pd->file.keepalive) nc->flags |= MG_F_SEND_AND_CLOSE;
-      mg_http_free_proto_data_file(&pd->file);
-    }
-  } else if (pd->file.type == DATA_PUT) {
-    struct mbuf *io = &nc->recv_mbuf;
-    size_t to_write = left <= 0 ? 0 : left < io->len ? (size_t) left : io->len;
-    size_t n = mg_fwrite(io->buf, 1, to_write, pd->file.fp);
-    if (n > 0) {
-      mbuf_remove(io, n);
-      pd->file.sent += n;
-    }
-    if (n == 0 || pd->file.sent >= pd->file.cl) {
-      if (!pd->file.keepalive) nc->flags |= MG_F_SEND_AND_CLOSE;
-      mg_http_free_proto_data_file(&pd->file);
-    }
-  }
-#if MG_ENABLE_HTTP_CGI
-  else if (pd->cgi.cgi_nc != NULL) {
-    /* This is POST data that needs to be forwarded to the CGI process */
-    if (pd->cgi.cgi_nc != NULL) {
-      mg_forward(nc, pd->cgi.cgi_nc);
+  while (s < se) {
+    const char *next = s;
+    struct mg_str component;
+    parse_uri_component(&next, se, "/", &component);
+    if (mg_vcmp(&component, ".") == 0) {
+      /* Yum. */
+    } else if (mg_vcmp(&component, "..") == 0) {
+      /* Backtrack to previous slash. */
+      if (d > cp + 1 && *(d - 1) == '/') d--;
+      while (d > cp && *(d - 1) != '/') d--;
     } else {
-      nc->flags |= MG_F_SEND_AND_CLOSE;
+      memmove(d, s, next - s);
+      d += next - s;
     }
+    s = next;
   }
-#endif
+  if (d == cp) *d++ = '/';
+
+  out->p = cp;
+  out->len = d - cp;
+  return 1;
 }
-#endif /* MG_ENABLE_FILESYSTEM */
 
-/*
- * Parse chunked-encoded buffer. Return 0 if the buffer is not encoded, or
- * if it's incomplete. If the chunk is fully buffered, return total number of
- * bytes in a chunk, and store data in `data`, `data_len`.
- */
-static size_t mg_http_parse_chunk(char *buf, size_t len, char **chunk_data,
-                                  size_t *chunk_len) {
-  unsigned char *s = (unsigned char *) buf;
-  size_t n = 0; /* scanned chunk length */
-  size_t i = 0; /* index in s */
+int mg_assemble_uri(const struct mg_str *scheme, const struct mg_str *user_info,
+                    const struct mg_str *host, unsigned int port,
+                    const struct mg_str *path, const struct mg_str *query,
+                    const struct mg_str *fragment, int normalize_path,
+                    struct mg_str *uri) {
+  int result = -1;
+  struct mbuf out;
+  mbuf_init(&out, 0);
 
-  /* Scan chunk length. That should be a hexadecimal number. */
-  while (i < len && isxdigit(s[i])) {
-    n *= 16;
-    n += (s[i] >= '0' && s[i] <= '9') ? s[i] - '0' : tolower(s[i]) - 'a' + 10;
-    i++;
+  if (scheme != NULL && scheme->len > 0) {
+    mbuf_append(&out, scheme->p, scheme->len);
+    mbuf_append(&out, "://", 3);
   }
 
-  /* Skip new line */
-  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
-    return 0;
+  if (user_info != NULL && user_info->len > 0) {
+    mbuf_append(&out, user_info->p, user_info->len);
+    mbuf_append(&out, "@", 1);
   }
-  i += 2;
-
-  /* Record where the data is */
-  *chunk_data = (char *) s + i;
-  *chunk_len = n;
-
-  /* Skip data */
-  i += n;
 
-  /* Skip new line */
-  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
-    return 0;
+  if (host != NULL && host->len > 0) {
+    mbuf_append(&out, host->p, host->len);
   }
-  return i + 2;
-}
-
-MG_INTERNAL size_t mg_handle_chunked(struct mg_connection *nc,
-                                     struct http_message *hm, char *buf,
-                                     size_t blen) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  char *data;
-  size_t i, n, data_len, body_len, zero_chunk_received = 0;
-  /* Find out piece of received data that is not yet reassembled */
-  body_len = (size_t) pd->chunk.body_len;
-  assert(blen >= body_len);
 
-  /* Traverse all fully buffered chunks */
-  for (i = body_len;
-       (n = mg_http_parse_chunk(buf + i, blen - i, &data, &data_len)) > 0;
-       i += n) {
-    /* Collapse chunk data to the rest of HTTP body */
-    memmove(buf + body_len, data, data_len);
-    body_len += data_len;
-    hm->body.len = body_len;
+  if (port != 0) {
+    char port_str[20];
+    int port_str_len = sprintf(port_str, ":%u", port);
+    mbuf_append(&out, port_str, port_str_len);
+  }
 
-    if (data_len == 0) {
-      zero_chunk_received = 1;
-      i += n;
-      break;
+  if (path != NULL && path->len > 0) {
+    if (normalize_path) {
+      struct mg_str npath = mg_strdup(*path);
+      if (npath.len != path->len) goto out;
+      if (!mg_normalize_uri_path(path, &npath)) {
+        free((void *) npath.p);
+        goto out;
+      }
+      mbuf_append(&out, npath.p, npath.len);
+      free((void *) npath.p);
+    } else {
+      mbuf_append(&out, path->p, path->len);
     }
+  } else if (normalize_path) {
+    mbuf_append(&out, "/", 1);
   }
 
-  if (i > body_len) {
-    /* Shift unparsed content to the parsed body */
-    assert(i <= blen);
-    memmove(buf + body_len, buf + i, blen - i);
-    memset(buf + body_len + blen - i, 0, i - body_len);
-    nc->recv_mbuf.len -= i - body_len;
-    pd->chunk.body_len = body_len;
+  if (query != NULL && query->len > 0) {
+    mbuf_append(&out, "?", 1);
+    mbuf_append(&out, query->p, query->len);
+  }
 
-    /* Send MG_EV_HTTP_CHUNK event */
-    nc->flags &= ~MG_F_DELETE_CHUNK;
-    mg_call(nc, nc->handler, nc->user_data, MG_EV_HTTP_CHUNK, hm);
+  if (fragment != NULL && fragment->len > 0) {
+    mbuf_append(&out, "#", 1);
+    mbuf_append(&out, fragment->p, fragment->len);
+  }
 
-    /* Delete processed data if user set MG_F_DELETE_CHUNK flag */
-    if (nc->flags & MG_F_DELETE_CHUNK) {
-      memset(buf, 0, body_len);
-      memmove(buf, buf + body_len, blen - i);
-      nc->recv_mbuf.len -= body_len;
-      hm->body.len = 0;
-      pd->chunk.body_len = 0;
-    }
+  result = 0;
 
-    if (zero_chunk_received) {
-      /* Total message size is len(body) + len(headers) */
-      hm->message.len =
-          (size_t) pd->chunk.body_len + blen - i + (hm->body.p - hm->message.p);
-    }
+out:
+  if (result == 0) {
+    uri->p = out.buf;
+    uri->len = out.len;
+  } else {
+    mbuf_free(&out);
+    uri->p = NULL;
+    uri->len = 0;
   }
-
-  return body_len;
+  return result;
 }
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http.c"
+#endif
+/*
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
+ */
 
-struct mg_http_endpoint *mg_http_get_endpoint_handler(struct mg_connection *nc,
-                                                      struct mg_str *uri_path) {
-  struct mg_http_proto_data *pd;
-  struct mg_http_endpoint *ret = NULL;
-  int matched, matched_max = 0;
-  struct mg_http_endpoint *ep;
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
 
-  if (nc == NULL) {
-    return NULL;
-  }
+#if MG_ENABLE_HTTP
 
-  pd = mg_http_get_proto_data(nc);
+/* Amalgamated: #include "common/cs_md5.h" */
+/* Amalgamated: #include "mg_internal.h" */
+/* Amalgamated: #include "mg_util.h" */
 
-  ep = pd->endpoints;
-  while (ep != NULL) {
-    if ((matched = mg_match_prefix_n(ep->uri_pattern, *uri_path)) > 0) {
-      if (matched > matched_max) {
-        /* Looking for the longest suitable handler */
-        ret = ep;
-        matched_max = matched;
-      }
-    }
+/* altbuf {{{ */
 
-    ep = ep->next;
-  }
+/*
+ * Alternate buffer: fills the client-provided buffer with data; and if it's
+ * not large enough, allocates another buffer (via mbuf), similar to asprintf.
+ */
+struct altbuf {
+  struct mbuf m;
+  char *user_buf;
+  size_t len;
+  size_t user_buf_size;
+};
 
-  return ret;
+/*
+ * Initializes altbuf; `buf`, `buf_size` is the client-provided buffer.
+ */
+MG_INTERNAL void altbuf_init(struct altbuf *ab, char *buf, size_t buf_size) {
+  mbuf_init(&ab->m, 0);
+  ab->user_buf = buf;
+  ab->user_buf_size = buf_size;
+  ab->len = 0;
 }
 
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-static void mg_http_multipart_continue(struct mg_connection *nc);
-
-static void mg_http_multipart_begin(struct mg_connection *nc,
-                                    struct http_message *hm, int req_len);
+/*
+ * Appends a single char to the altbuf.
+ */
+MG_INTERNAL void altbuf_append(struct altbuf *ab, char c) {
+  if (ab->len < ab->user_buf_size) {
+    /* The data fits into the original buffer */
+    ab->user_buf[ab->len++] = c;
+  } else {
+    /* The data can't fit into the original buffer, so write it to mbuf.  */
 
-#endif
+    /*
+     * First of all, see if that's the first byte which overflows the original
+     * buffer: if so, copy the existing data from there to a newly allocated
+     * mbuf.
+     */
+    if (ab->len > 0 && ab->m.len == 0) {
+      mbuf_append(&ab->m, ab->user_buf, ab->len);
+    }
 
-static void mg_http_call_endpoint_handler(struct mg_connection *nc, int ev,
-                                          struct http_message *hm);
+    mbuf_append(&ab->m, &c, 1);
+    ab->len = ab->m.len;
+  }
+}
 
-static void deliver_chunk(struct mg_connection *c, struct http_message *hm,
-                          int req_len) {
-  /* Incomplete message received. Send MG_EV_HTTP_CHUNK event */
-  hm->body.len = c->recv_mbuf.len - req_len;
-  c->flags &= ~MG_F_DELETE_CHUNK;
-  mg_call(c, c->handler, c->user_data, MG_EV_HTTP_CHUNK, hm);
-  /* Delete processed data if user set MG_F_DELETE_CHUNK flag */
-  if (c->flags & MG_F_DELETE_CHUNK) c->recv_mbuf.len = req_len;
+/*
+ * Resets any data previously appended to altbuf.
+ */
+MG_INTERNAL void altbuf_reset(struct altbuf *ab) {
+  mbuf_free(&ab->m);
+  ab->len = 0;
 }
 
 /*
- * lx106 compiler has a bug (TODO(mkm) report and insert tracking bug here)
- * If a big structure is declared in a big function, lx106 gcc will make it
- * even bigger (round up to 4k, from 700 bytes of actual size).
+ * Returns whether the additional buffer was allocated (and thus the data
+ * is in the mbuf, not the client-provided buffer)
  */
-#ifdef __xtensa__
-static void mg_http_handler2(struct mg_connection *nc, int ev,
-                             void *ev_data MG_UD_ARG(void *user_data),
-                             struct http_message *hm) __attribute__((noinline));
+MG_INTERNAL int altbuf_reallocated(struct altbuf *ab) {
+  return ab->len > ab->user_buf_size;
+}
 
-void mg_http_handler(struct mg_connection *nc, int ev,
-                     void *ev_data MG_UD_ARG(void *user_data)) {
-  struct http_message hm;
-  mg_http_handler2(nc, ev, ev_data MG_UD_ARG(user_data), &hm);
+/*
+ * Returns the actual buffer with data, either the client-provided or a newly
+ * allocated one. If `trim` is non-zero, mbuf-backed buffer is trimmed first.
+ */
+MG_INTERNAL char *altbuf_get_buf(struct altbuf *ab, int trim) {
+  if (altbuf_reallocated(ab)) {
+    if (trim) {
+      mbuf_trim(&ab->m);
+    }
+    return ab->m.buf;
+  } else {
+    return ab->user_buf;
+  }
 }
 
-static void mg_http_handler2(struct mg_connection *nc, int ev,
-                             void *ev_data MG_UD_ARG(void *user_data),
-                             struct http_message *hm) {
-#else  /* !__XTENSA__ */
-void mg_http_handler(struct mg_connection *nc, int ev,
-                     void *ev_data MG_UD_ARG(void *user_data)) {
-  struct http_message shm, *hm = &shm;
-#endif /* __XTENSA__ */
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  struct mbuf *io = &nc->recv_mbuf;
-  int req_len;
-  const int is_req = (nc->listener != NULL);
-#if MG_ENABLE_HTTP_WEBSOCKET
-  struct mg_str *vec;
+/* }}} */
+
+static const char *mg_version_header = "Mongoose/" MG_VERSION;
+
+enum mg_http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT };
+
+struct mg_http_proto_data_file {
+  FILE *fp;      /* Opened file. */
+  int64_t cl;    /* Content-Length. How many bytes to send. */
+  int64_t sent;  /* How many bytes have been already sent. */
+  int keepalive; /* Keep connection open after sending. */
+  enum mg_http_proto_data_type type;
+};
+
+#if MG_ENABLE_HTTP_CGI
+struct mg_http_proto_data_cgi {
+  struct mg_connection *cgi_nc;
+};
+#endif
+
+struct mg_http_proto_data_chuncked {
+  int64_t body_len; /* How many bytes of chunked body was reassembled. */
+};
+
+struct mg_http_endpoint {
+  struct mg_http_endpoint *next;
+  struct mg_str uri_pattern; /* owned */
+  char *auth_domain;         /* owned */
+  char *auth_file;           /* owned */
+
+  mg_event_handler_t handler;
+#if MG_ENABLE_CALLBACK_USERDATA
+  void *user_data;
+#endif
+#if MG_ENABLE_HTTP_SSE
+  struct mg_sse_channel *sse_channel; /* Set for event stream endpoints */
+#endif
+#if MG_ENABLE_HTTP_WEBSOCKET && MG_ENABLE_MQTT_BROKER
+  struct mg_mqtt_broker *mqtt_broker; /* Set for MQTT over WebSocket */
+#endif
+};
+
+enum mg_http_multipart_stream_state {
+  MPS_BEGIN,
+  MPS_WAITING_FOR_BOUNDARY,
+  MPS_WAITING_FOR_CHUNK,
+  MPS_GOT_CHUNK,
+  MPS_GOT_BOUNDARY,
+  MPS_FINALIZE,
+  MPS_FINISHED
+};
+
+struct mg_http_multipart_stream {
+  const char *boundary;
+  int boundary_len;
+  const char *var_name;
+  const char *file_name;
+  void *user_data;
+  int prev_io_len;
+  enum mg_http_multipart_stream_state state;
+  int processing_part;
+};
+
+struct mg_reverse_proxy_data {
+  struct mg_connection *linked_conn;
+};
+
+struct mg_ws_proto_data {
+  /*
+   * Defragmented size of the frame so far.
+   *
+   * First byte of nc->recv_mbuf.buf is an op, the rest of the data is
+   * defragmented data.
+   */
+  size_t reass_len;
+#if MG_ENABLE_MQTT_BROKER
+  struct mg_mqtt_broker *mqtt_broker; /* Set when bridged to a broker */
+  struct mbuf mqtt_buf; /* MQTT packet split across websocket frames */
+#endif
+};
+
+struct mg_http_proto_data {
+#if MG_ENABLE_FILESYSTEM
+  struct mg_http_proto_data_file file;
 #endif
-  if (ev == MG_EV_CLOSE) {
 #if MG_ENABLE_HTTP_CGI
-    /* Close associated CGI forwarder connection */
-    if (pd->cgi.cgi_nc != NULL) {
-      pd->cgi.cgi_nc->user_data = NULL;
-      pd->cgi.cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-    }
+  struct mg_http_proto_data_cgi cgi;
 #endif
 #if MG_ENABLE_HTTP_STREAMING_MULTIPART
-    if (pd->mp_stream.boundary != NULL) {
-      /*
-       * Multipart message is in progress, but connection is closed.
-       * Finish part and request with an error flag.
-       */
-      struct mg_http_multipart_part mp;
-      memset(&mp, 0, sizeof(mp));
-      mp.status = -1;
-      mp.var_name = pd->mp_stream.var_name;
-      mp.file_name = pd->mp_stream.file_name;
-      mg_call(nc, (pd->endpoint_handler ? pd->endpoint_handler : nc->handler),
-              nc->user_data, MG_EV_HTTP_PART_END, &mp);
-      mp.var_name = NULL;
-      mp.file_name = NULL;
-      mg_call(nc, (pd->endpoint_handler ? pd->endpoint_handler : nc->handler),
-              nc->user_data, MG_EV_HTTP_MULTIPART_REQUEST_END, &mp);
-    } else
+  struct mg_http_multipart_stream mp_stream;
 #endif
-        if (io->len > 0 &&
-            (req_len = mg_parse_http(io->buf, io->len, hm, is_req)) > 0) {
-      /*
-      * For HTTP messages without Content-Length, always send HTTP message
-      * before MG_EV_CLOSE message.
-      */
-      int ev2 = is_req ? MG_EV_HTTP_REQUEST : MG_EV_HTTP_REPLY;
-      hm->message.len = io->len;
-      hm->body.len = io->buf + io->len - hm->body.p;
-      deliver_chunk(nc, hm, req_len);
-      mg_http_call_endpoint_handler(nc, ev2, hm);
-    }
-    pd->rcvd = 0;
+#if MG_ENABLE_HTTP_WEBSOCKET
+  struct mg_ws_proto_data ws_data;
+#endif
+  struct mg_http_proto_data_chuncked chunk;
+  struct mg_http_endpoint *endpoints;
+  mg_event_handler_t endpoint_handler;
+  struct mg_reverse_proxy_data reverse_proxy_data;
+  size_t rcvd; /* How many bytes we have received. */
+#if MG_ENABLE_HTTP_GZIP
+  cs_gzip_ctx *gzip; /* Set while the response body is being compressed */
+  int accept_gzip;   /* Client of the current request accepts gzip */
+#endif
+#if MG_ENABLE_HTTP_SSE
+  struct mg_sse_sub *sse; /* Set once subscribed to an event channel */
+#endif
+  int in_flight;     /* Request dispatched, its reply not yet complete */
+  int head_request;  /* The request in flight is a HEAD */
+  int64_t sent;      /* Bytes sent on the connection, see MG_EV_SEND */
+  int64_t reply_end; /* Value of `sent` at the end of the reply, see below */
+};
+
+/*
+ * mg_http_proto_data::reply_end values other than offsets. The end of a
+ * reply is known once its headers are out, from mg_send_head(), or once
+ * its last chunk is queued.
+ */
+#define MG_HTTP_REPLY_UNKNOWN 0  /* Ends when the send buffer drains */
+#define MG_HTTP_REPLY_CHUNKED -1 /* Ends with the last chunk */
+
+static void mg_http_conn_destructor(void *proto_data);
+static void mg_http_reply_ends(struct mg_connection *nc, int64_t body_len);
+struct mg_connection *mg_connect_http_base(
+    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
+    struct mg_connect_opts opts, const char *scheme1, const char *scheme2,
+    const char *scheme_ssl1, const char *scheme_ssl2, const char *url,
+    struct mg_str *path, struct mg_str *user_info, struct mg_str *host);
+
+static struct mg_http_proto_data *mg_http_get_proto_data(
+    struct mg_connection *c) {
+  if (c->proto_data == NULL) {
+    c->proto_data = MG_CALLOC(1, sizeof(struct mg_http_proto_data));
+    c->proto_data_destructor = mg_http_conn_destructor;
   }
 
+  return (struct mg_http_proto_data *) c->proto_data;
+}
+
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+static void mg_http_free_proto_data_mp_stream(
+    struct mg_http_multipart_stream *mp) {
+  MG_FREE((void *) mp->boundary);
+  MG_FREE((void *) mp->var_name);
+  MG_FREE((void *) mp->file_name);
+  memset(mp, 0, sizeof(*mp));
+}
+#endif
+
 #if MG_ENABLE_FILESYSTEM
-  if (pd->file.fp != NULL) {
-    mg_http_transfer_file_data(nc);
+static void mg_http_free_proto_data_file(struct mg_http_proto_data_file *d) {
+  if (d != NULL) {
+    if (d->fp != NULL) {
+      fclose(d->fp);
+    }
+    memset(d, 0, sizeof(struct mg_http_proto_data_file));
   }
+}
 #endif
 
-  mg_call(nc, nc->handler, nc->user_data, ev, ev_data);
-
-  if (ev == MG_EV_RECV) {
-    struct mg_str *s;
-    pd->rcvd += *(int *) ev_data;
+static void mg_http_free_proto_data_endpoints(struct mg_http_endpoint **ep) {
+  struct mg_http_endpoint *current = *ep;
 
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-    if (pd->mp_stream.boundary != NULL) {
-      mg_http_multipart_continue(nc);
-      return;
-    }
-#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+  while (current != NULL) {
+    struct mg_http_endpoint *tmp = current->next;
+    MG_FREE((void *) current->uri_pattern.p);
+    MG_FREE((void *) current->auth_domain);
+    MG_FREE((void *) current->auth_file);
+    MG_FREE(current);
+    current = tmp;
+  }
 
-    req_len = mg_parse_http(io->buf, io->len, hm, is_req);
+  ep = NULL;
+}
 
-    if (req_len > 0 &&
-        (s = mg_get_http_header(hm, "Transfer-Encoding")) != NULL &&
-        mg_vcasecmp(s, "chunked") == 0) {
-      mg_handle_chunked(nc, hm, io->buf + req_len, io->len - req_len);
+static void mg_http_free_reverse_proxy_data(struct mg_reverse_proxy_data *rpd) {
+  if (rpd->linked_conn != NULL) {
+    /*
+     * Connection has linked one, we have to unlink & close it
+     * since _this_ connection is going to die and
+     * it doesn't make sense to keep another one
+     */
+    struct mg_http_proto_data *pd = mg_http_get_proto_data(rpd->linked_conn);
+    if (pd->reverse_proxy_data.linked_conn != NULL) {
+      pd->reverse_proxy_data.linked_conn->flags |= MG_F_SEND_AND_CLOSE;
+      mg_mark_closing(pd->reverse_proxy_data.linked_conn);
+      pd->reverse_proxy_data.linked_conn = NULL;
     }
+    rpd->linked_conn = NULL;
+  }
+}
 
+static void mg_http_conn_destructor(void *proto_data) {
+  struct mg_http_proto_data *pd = (struct mg_http_proto_data *) proto_data;
+#if MG_ENABLE_FILESYSTEM
+  mg_http_free_proto_data_file(&pd->file);
+#endif
+#if MG_ENABLE_HTTP_CGI
+  mg_http_free_proto_data_cgi(&pd->cgi);
+#endif
 #if MG_ENABLE_HTTP_STREAMING_MULTIPART
-    if (req_len > 0 && (s = mg_get_http_header(hm, "Content-Type")) != NULL &&
-        s->len >= 9 && strncmp(s->p, "multipart", 9) == 0) {
-      mg_http_multipart_begin(nc, hm, req_len);
-      mg_http_multipart_continue(nc);
-      return;
-    }
-#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+  mg_http_free_proto_data_mp_stream(&pd->mp_stream);
+#endif
+  mg_http_free_proto_data_endpoints(&pd->endpoints);
+  mg_http_free_reverse_proxy_data(&pd->reverse_proxy_data);
+#if MG_ENABLE_HTTP_GZIP
+  MG_FREE(pd->gzip);
+#endif
+#if MG_ENABLE_HTTP_SSE
+  mg_sse_unsubscribe(pd->sse);
+#endif
+#if MG_ENABLE_HTTP_WEBSOCKET && MG_ENABLE_MQTT_BROKER
+  mbuf_free(&pd->ws_data.mqtt_buf);
+#endif
+  MG_FREE(proto_data);
+}
 
-    /* TODO(alashkin): refactor this ifelseifelseifelseifelse */
-    if ((req_len < 0 ||
-         (req_len == 0 && io->len >= MG_MAX_HTTP_REQUEST_SIZE))) {
-      DBG(("invalid request"));
-      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-    } else if (req_len == 0) {
-      /* Do nothing, request is not yet fully buffered */
+#if MG_ENABLE_HTTP_GZIP
+/* Checks whether Accept-Encoding has gzip, and not with q=0. */
+static int mg_http_accepts_gzip(struct http_message *hm) {
+  struct mg_str *hdr = mg_get_http_header(hm, "Accept-Encoding");
+  const char *p, *end, *e, *q;
+  size_t n;
+  if (hdr == NULL) return 0;
+  for (p = hdr->p, end = hdr->p + hdr->len; p < end; p = e + 1) {
+    e = (const char *) memchr(p, ',', end - p);
+    if (e == NULL) e = end;
+    while (p < e && *p == ' ') p++;
+    for (n = 0; p + n < e && p[n] != ';' && p[n] != ' '; n++) {
+    }
+    if (!((n == 4 && mg_ncasecmp(p, "gzip", 4) == 0) ||
+          (n == 1 && *p == '*'))) {
+      continue;
     }
-#if MG_ENABLE_HTTP_WEBSOCKET
-    else if (nc->listener == NULL &&
-             mg_get_http_header(hm, "Sec-WebSocket-Accept")) {
-      /* We're websocket client, got handshake response from server. */
-      /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
-      mbuf_remove(io, req_len);
-      nc->proto_handler = mg_ws_handler;
-      nc->flags |= MG_F_IS_WEBSOCKET;
-      mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_DONE,
-              NULL);
-      mg_ws_handler(nc, MG_EV_RECV, ev_data MG_UD_ARG(user_data));
-    } else if (nc->listener != NULL &&
-               (vec = mg_get_http_header(hm, "Sec-WebSocket-Key")) != NULL) {
-      struct mg_http_endpoint *ep;
-
-      /* This is a websocket request. Switch protocol handlers. */
-      mbuf_remove(io, req_len);
-      nc->proto_handler = mg_ws_handler;
-      nc->flags |= MG_F_IS_WEBSOCKET;
-
-      /*
-       * If we have a handler set up with mg_register_http_endpoint(),
-       * deliver subsequent websocket events to this handler after the
-       * protocol switch.
-       */
-      ep = mg_http_get_endpoint_handler(nc->listener, &hm->uri);
-      if (ep != NULL) {
-        nc->handler = ep->handler;
-#if MG_ENABLE_CALLBACK_USERDATA
-        nc->user_data = ep->user_data;
-#endif
-      }
-
-      /* Send handshake */
-      mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_REQUEST,
-              hm);
-      if (!(nc->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE))) {
-        if (nc->send_mbuf.len == 0) {
-          mg_ws_handshake(nc, vec, hm);
-        }
-        mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_DONE,
-                NULL);
-        mg_ws_handler(nc, MG_EV_RECV, ev_data MG_UD_ARG(user_data));
-      }
+    /* Any non-zero weight will do */
+    for (q = p + n; q + 1 < e && mg_ncasecmp(q, "q=", 2) != 0; q++) {
     }
-#endif /* MG_ENABLE_HTTP_WEBSOCKET */
-    else if (hm->message.len > pd->rcvd) {
-      /* Not yet received all HTTP body, deliver MG_EV_HTTP_CHUNK */
-      deliver_chunk(nc, hm, req_len);
-      if (nc->recv_mbuf_limit > 0 && nc->recv_mbuf.len >= nc->recv_mbuf_limit) {
-        LOG(LL_ERROR, ("%p recv buffer (%lu bytes) exceeds the limit "
-                       "%lu bytes, and not drained, closing",
-                       nc, (unsigned long) nc->recv_mbuf.len,
-                       (unsigned long) nc->recv_mbuf_limit));
-        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-      }
-    } else {
-      /* We did receive all HTTP body. */
-      int trigger_ev = nc->listener ? MG_EV_HTTP_REQUEST : MG_EV_HTTP_REPLY;
-      char addr[32];
-      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr),
-                          MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
-      DBG(("%p %s %.*s %.*s", nc, addr, (int) hm->method.len, hm->method.p,
-           (int) hm->uri.len, hm->uri.p));
-      deliver_chunk(nc, hm, req_len);
-      /* Whole HTTP message is fully buffered, call event handler */
-      mg_http_call_endpoint_handler(nc, trigger_ev, hm);
-      mbuf_remove(io, hm->message.len);
-      pd->rcvd = 0;
+    if (q + 1 >= e) return 1;
+    for (q += 2; q < e && (*q == '0' || *q == '.'); q++) {
     }
+    return q < e && *q >= '1' && *q <= '9';
   }
+  return 0;
 }
 
-static size_t mg_get_line_len(const char *buf, size_t buf_len) {
-  size_t len = 0;
-  while (len < buf_len && buf[len] != '\n') len++;
-  return len == buf_len ? 0 : len + 1;
+/* Response of unknown length is given as -1. */
+static int mg_http_gzip_wanted(const struct mg_str content_type, int64_t len) {
+  if (len >= 0 && len < MG_HTTP_GZIP_MIN_SIZE) return 0;
+  return mg_match_prefix_n(mg_mk_str(MG_HTTP_GZIP_SKIP_TYPES),
+                           content_type) == 0;
 }
 
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-static void mg_http_multipart_begin(struct mg_connection *nc,
-                                    struct http_message *hm, int req_len) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  struct mg_str *ct;
-  struct mbuf *io = &nc->recv_mbuf;
-
-  char boundary_buf[100];
-  char *boundary = boundary_buf;
-  int boundary_len;
+static int mg_http_gzip_begin(struct mg_http_proto_data *pd) {
+  MG_FREE(pd->gzip);
+  pd->gzip = (cs_gzip_ctx *) MG_MALLOC(sizeof(*pd->gzip));
+  if (pd->gzip == NULL) return 0;
+  cs_gzip_init(pd->gzip);
+  return 1;
+}
 
-  ct = mg_get_http_header(hm, "Content-Type");
-  if (ct == NULL) {
-    /* We need more data - or it isn't multipart mesage */
-    goto exit_mp;
+static cs_gzip_ctx *mg_http_get_gzip(struct mg_connection *nc) {
+  struct mg_http_proto_data *pd = (struct mg_http_proto_data *) nc->proto_data;
+  if (pd == NULL || nc->proto_data_destructor != mg_http_conn_destructor) {
+    return NULL;
   }
+  return pd->gzip;
+}
 
-  /* Content-type should start with "multipart" */
-  if (ct->len < 9 || strncmp(ct->p, "multipart", 9) != 0) {
-    goto exit_mp;
+/*
+ * Compresses data into a chunk, with sync flush if `flush` is set. With
+ * `flush` > 1, finishes the stream and sends the terminating chunk.
+ */
+static void mg_http_send_gzip_chunk(struct mg_connection *nc, const void *buf,
+                                    size_t len, int flush) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  struct mbuf tmp, *mb = mg_send_mbuf(nc);
+  char chunk_size[11];
+  size_t off;
+
+  if (mb == NULL) {
+    mbuf_init(&tmp, 0);
+    mb = &tmp;
+  }
+  /* Size is filled in when known, as in mg_vprintf_http_chunk_direct() */
+  off = mb->len;
+  mbuf_append(mb, NULL, 10);
+  if (mb->len == off + 10) {
+    cs_gzip_update(pd->gzip, buf, len, flush == 1, mb);
+    if (flush > 1) cs_gzip_finish(pd->gzip, mb);
+    if (mb->len == off + 10) {
+      mb->len = off;
+    } else {
+      snprintf(chunk_size, sizeof(chunk_size), "%08lX\r\n",
+               (unsigned long) (mb->len - off - 10));
+      memcpy(mb->buf + off, chunk_size, 10);
+      mbuf_append(mb, "\r\n", 2);
+    }
   }
-
-  boundary_len =
-      mg_http_parse_header2(ct, "boundary", &boundary, sizeof(boundary_buf));
-  if (boundary_len == 0) {
-    /*
-     * Content type is multipart, but there is no boundary,
-     * probably malformed request
-     */
-    nc->flags = MG_F_CLOSE_IMMEDIATELY;
-    DBG(("invalid request"));
-    goto exit_mp;
+  if (flush > 1) {
+    mbuf_append(mb, "0\r\n\r\n", 5);
+    MG_FREE(pd->gzip);
+    pd->gzip = NULL;
+  }
+  if (mb == &tmp) {
+    mg_send(nc, tmp.buf, (int) tmp.len);
+    mbuf_free(&tmp);
   }
+  if (flush > 1) mg_http_reply_ends(nc, 0);
+}
+#endif /* MG_ENABLE_HTTP_GZIP */
 
-  /* If we reach this place - that is multipart request */
+#if MG_ENABLE_FILESYSTEM
 
-  if (pd->mp_stream.boundary != NULL) {
-    /*
-     * Another streaming request was in progress,
-     * looks like protocol error
-     */
-    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-  } else {
-    struct mg_http_endpoint *ep = NULL;
-    pd->mp_stream.state = MPS_BEGIN;
-    pd->mp_stream.boundary = strdup(boundary);
-    pd->mp_stream.boundary_len = strlen(boundary);
-    pd->mp_stream.var_name = pd->mp_stream.file_name = NULL;
-    pd->endpoint_handler = nc->handler;
+#define MIME_ENTRY(_ext, _type) \
+  { _ext, sizeof(_ext) - 1, _type }
+static const struct {
+  const char *extension;
+  size_t ext_len;
+  const char *mime_type;
+} mg_static_builtin_mime_types[] = {
+    MIME_ENTRY("html", "text/html"),
+    MIME_ENTRY("html", "text/html"),
+    MIME_ENTRY("htm", "text/html"),
+    MIME_ENTRY("shtm", "text/html"),
+    MIME_ENTRY("shtml", "text/html"),
+    MIME_ENTRY("css", "text/css"),
+    MIME_ENTRY("js", "application/x-javascript"),
+    MIME_ENTRY("ico", "image/x-icon"),
+    MIME_ENTRY("gif", "image/gif"),
+    MIME_ENTRY("jpg", "image/jpeg"),
+    MIME_ENTRY("jpeg", "image/jpeg"),
+    MIME_ENTRY("png", "image/png"),
+    MIME_ENTRY("svg", "image/svg+xml"),
+    MIME_ENTRY("txt", "text/plain"),
+    MIME_ENTRY("torrent", "application/x-bittorrent"),
+    MIME_ENTRY("wav", "audio/x-wav"),
+    MIME_ENTRY("mp3", "audio/x-mp3"),
+    MIME_ENTRY("mid", "audio/mid"),
+    MIME_ENTRY("m3u", "audio/x-mpegurl"),
+    MIME_ENTRY("ogg", "application/ogg"),
+    MIME_ENTRY("ram", "audio/x-pn-realaudio"),
+    MIME_ENTRY("xml", "text/xml"),
+    MIME_ENTRY("ttf", "application/x-font-ttf"),
+    MIME_ENTRY("json", "application/json"),
+    MIME_ENTRY("xslt", "application/xml"),
+    MIME_ENTRY("xsl", "application/xml"),
+    MIME_ENTRY("ra", "audio/x-pn-realaudio"),
+    MIME_ENTRY("doc", "application/msword"),
+    MIME_ENTRY("exe", "application/octet-stream"),
+    MIME_ENTRY("zip", "application/x-zip-compressed"),
+    MIME_ENTRY("xls", "application/excel"),
+    MIME_ENTRY("tgz", "application/x-tar-gz"),
+    MIME_ENTRY("tar", "application/x-tar"),
+    MIME_ENTRY("gz", "application/x-gunzip"),
+    MIME_ENTRY("arj", "application/x-arj-compressed"),
+    MIME_ENTRY("rar", "application/x-rar-compressed"),
+    MIME_ENTRY("rtf", "application/rtf"),
+    MIME_ENTRY("pdf", "application/pdf"),
+    MIME_ENTRY("swf", "application/x-shockwave-flash"),
+    MIME_ENTRY("mpg", "video/mpeg"),
+    MIME_ENTRY("webm", "video/webm"),
+    MIME_ENTRY("mpeg", "video/mpeg"),
+    MIME_ENTRY("mov", "video/quicktime"),
+    MIME_ENTRY("mp4", "video/mp4"),
+    MIME_ENTRY("m4v", "video/x-m4v"),
+    MIME_ENTRY("asf", "video/x-ms-asf"),
+    MIME_ENTRY("avi", "video/x-msvideo"),
+    MIME_ENTRY("bmp", "image/bmp"),
+    {NULL, 0, NULL}};
 
-    ep = mg_http_get_endpoint_handler(nc->listener, &hm->uri);
-    if (ep != NULL) {
-      pd->endpoint_handler = ep->handler;
-    }
+static struct mg_str mg_get_mime_type(const char *path, const char *dflt,
+                                      const struct mg_serve_http_opts *opts) {
+  const char *ext, *overrides;
+  size_t i, path_len;
+  struct mg_str r, k, v;
 
-    mg_http_call_endpoint_handler(nc, MG_EV_HTTP_MULTIPART_REQUEST, hm);
+  path_len = strlen(path);
 
-    mbuf_remove(io, req_len);
+  overrides = opts->custom_mime_types;
+  while ((overrides = mg_next_comma_list_entry(overrides, &k, &v)) != NULL) {
+    ext = path + (path_len - k.len);
+    if (path_len > k.len && mg_vcasecmp(&k, ext) == 0) {
+      return v;
+    }
   }
-exit_mp:
-  if (boundary != boundary_buf) MG_FREE(boundary);
-}
-
-#define CONTENT_DISPOSITION "Content-Disposition: "
 
-static void mg_http_multipart_call_handler(struct mg_connection *c, int ev,
-                                           const char *data, size_t data_len) {
-  struct mg_http_multipart_part mp;
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
-  memset(&mp, 0, sizeof(mp));
+  for (i = 0; mg_static_builtin_mime_types[i].extension != NULL; i++) {
+    ext = path + (path_len - mg_static_builtin_mime_types[i].ext_len);
+    if (path_len > mg_static_builtin_mime_types[i].ext_len && ext[-1] == '.' &&
+        mg_casecmp(ext, mg_static_builtin_mime_types[i].extension) == 0) {
+      r.p = mg_static_builtin_mime_types[i].mime_type;
+      r.len = strlen(r.p);
+      return r;
+    }
+  }
 
-  mp.var_name = pd->mp_stream.var_name;
-  mp.file_name = pd->mp_stream.file_name;
-  mp.user_data = pd->mp_stream.user_data;
-  mp.data.p = data;
-  mp.data.len = data_len;
-  mg_call(c, pd->endpoint_handler, c->user_data, ev, &mp);
-  pd->mp_stream.user_data = mp.user_data;
+  r.p = dflt;
+  r.len = strlen(r.p);
+  return r;
 }
+#endif
 
-static int mg_http_multipart_got_chunk(struct mg_connection *c) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
-  struct mbuf *io = &c->recv_mbuf;
+/*
+ * Check whether full request is buffered. Return:
+ *   -1  if request is malformed
+ *    0  if request is not yet fully buffered
+ *   >0  actual request length, including last \r\n\r\n
+ */
+static int mg_http_get_request_len(const char *s, int buf_len) {
+  const unsigned char *buf = (unsigned char *) s;
+  int i;
 
-  mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_DATA, io->buf,
-                                 pd->mp_stream.prev_io_len);
-  mbuf_remove(io, pd->mp_stream.prev_io_len);
-  pd->mp_stream.prev_io_len = 0;
-  pd->mp_stream.state = MPS_WAITING_FOR_CHUNK;
+  for (i = 0; i < buf_len; i++) {
+    if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
+      return -1;
+    } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
+      return i + 2;
+    } else if (buf[i] == '\n' && i + 2 < buf_len && buf[i + 1] == '\r' &&
+               buf[i + 2] == '\n') {
+      return i + 3;
+    }
+  }
 
   return 0;
 }
 
-static int mg_http_multipart_finalize(struct mg_connection *c) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
-
-  mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_END, NULL, 0);
-  MG_FREE((void *) pd->mp_stream.file_name);
-  pd->mp_stream.file_name = NULL;
-  MG_FREE((void *) pd->mp_stream.var_name);
-  pd->mp_stream.var_name = NULL;
-  mg_http_multipart_call_handler(c, MG_EV_HTTP_MULTIPART_REQUEST_END, NULL, 0);
-  mg_http_free_proto_data_mp_stream(&pd->mp_stream);
-  pd->mp_stream.state = MPS_FINISHED;
-
-  return 1;
-}
+static const char *mg_http_parse_headers(const char *s, const char *end,
+                                         int len, struct http_message *req) {
+  int i = 0;
+  while (i < (int) ARRAY_SIZE(req->header_names) - 1) {
+    struct mg_str *k = &req->header_names[i], *v = &req->header_values[i];
 
-static int mg_http_multipart_wait_for_boundary(struct mg_connection *c) {
-  const char *boundary;
-  struct mbuf *io = &c->recv_mbuf;
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+    s = mg_skip(s, end, ": ", k);
+    s = mg_skip(s, end, "\r\n", v);
 
-  if (pd->mp_stream.boundary == NULL) {
-    pd->mp_stream.state = MPS_FINALIZE;
-    DBG(("Invalid request: boundary not initialized"));
-    return 0;
-  }
+    while (v->len > 0 && v->p[v->len - 1] == ' ') {
+      v->len--; /* Trim trailing spaces in header value */
+    }
 
-  if ((int) io->len < pd->mp_stream.boundary_len + 2) {
-    return 0;
-  }
+    /*
+     * If header value is empty - skip it and go to next (if any).
+     * NOTE: Do not add it to headers_values because such addition changes API
+     * behaviour
+     */
+    if (k->len != 0 && v->len == 0) {
+      continue;
+    }
 
-  boundary = c_strnstr(io->buf, pd->mp_stream.boundary, io->len);
-  if (boundary != NULL) {
-    const char *boundary_end = (boundary + pd->mp_stream.boundary_len);
-    if (io->len - (boundary_end - io->buf) < 4) {
-      return 0;
+    if (k->len == 0 || v->len == 0) {
+      k->p = v->p = NULL;
+      k->len = v->len = 0;
+      break;
     }
-    if (strncmp(boundary_end, "--\r\n", 4) == 0) {
-      pd->mp_stream.state = MPS_FINALIZE;
-      mbuf_remove(io, (boundary_end - io->buf) + 4);
-    } else {
-      pd->mp_stream.state = MPS_GOT_BOUNDARY;
+
+    if (!mg_ncasecmp(k->p, "Content-Length", 14)) {
+      req->body.len = (size_t) to64(v->p);
+      req->message.len = len + req->body.len;
     }
-  } else {
-    return 0;
+
+    i++;
   }
 
-  return 1;
+  return s;
 }
 
-static void mg_http_parse_header_internal(struct mg_str *hdr,
-                                          const char *var_name,
-                                          struct altbuf *ab);
-
-static int mg_http_multipart_process_boundary(struct mg_connection *c) {
-  int data_size;
-  const char *boundary, *block_begin;
-  struct mbuf *io = &c->recv_mbuf;
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
-  struct altbuf ab_file_name, ab_var_name;
-  int line_len;
-  boundary = c_strnstr(io->buf, pd->mp_stream.boundary, io->len);
-  block_begin = boundary + pd->mp_stream.boundary_len + 2;
-  data_size = io->len - (block_begin - io->buf);
-
-  altbuf_init(&ab_file_name, NULL, 0);
-  altbuf_init(&ab_var_name, NULL, 0);
-
-  while (data_size > 0 &&
-         (line_len = mg_get_line_len(block_begin, data_size)) != 0) {
-    if (line_len > (int) sizeof(CONTENT_DISPOSITION) &&
-        mg_ncasecmp(block_begin, CONTENT_DISPOSITION,
-                    sizeof(CONTENT_DISPOSITION) - 1) == 0) {
-      struct mg_str header;
-
-      header.p = block_begin + sizeof(CONTENT_DISPOSITION) - 1;
-      header.len = line_len - sizeof(CONTENT_DISPOSITION) - 1;
-
-      altbuf_reset(&ab_var_name);
-      mg_http_parse_header_internal(&header, "name", &ab_var_name);
-
-      altbuf_reset(&ab_file_name);
-      mg_http_parse_header_internal(&header, "filename", &ab_file_name);
-
-      block_begin += line_len;
-      data_size -= line_len;
-
-      continue;
-    }
+int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
+  const char *end, *qs;
+  int len = mg_http_get_request_len(s, n);
 
-    if (line_len == 2 && mg_ncasecmp(block_begin, "\r\n", 2) == 0) {
-      mbuf_remove(io, block_begin - io->buf + 2);
+  if (len <= 0) return len;
 
-      if (pd->mp_stream.processing_part != 0) {
-        mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_END, NULL, 0);
-      }
+  memset(hm, 0, sizeof(*hm));
+  hm->message.p = s;
+  hm->body.p = s + len;
+  hm->message.len = hm->body.len = (size_t) ~0;
+  end = s + len;
 
-      /* Reserve 2 bytes for "\r\n" in file_name and var_name */
-      altbuf_append(&ab_file_name, '\0');
-      altbuf_append(&ab_file_name, '\0');
-      altbuf_append(&ab_var_name, '\0');
-      altbuf_append(&ab_var_name, '\0');
+  /* Request is fully buffered. Skip leading whitespaces. */
+  while (s < end && isspace(*(unsigned char *) s)) s++;
 
-      MG_FREE((void *) pd->mp_stream.file_name);
-      pd->mp_stream.file_name = altbuf_get_buf(&ab_file_name, 1 /* trim */);
-      MG_FREE((void *) pd->mp_stream.var_name);
-      pd->mp_stream.var_name = altbuf_get_buf(&ab_var_name, 1 /* trim */);
+  if (is_req) {
+    /* Parse request line: method, URI, proto */
+    s = mg_skip(s, end, " ", &hm->method);
+    s = mg_skip(s, end, " ", &hm->uri);
+    s = mg_skip(s, end, "\r\n", &hm->proto);
+    if (hm->uri.p <= hm->method.p || hm->proto.p <= hm->uri.p) return -1;
 
-      mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_BEGIN, NULL, 0);
-      pd->mp_stream.state = MPS_WAITING_FOR_CHUNK;
-      pd->mp_stream.processing_part++;
-      return 1;
+    /* If URI contains '?' character, initialize query_string */
+    if ((qs = (char *) memchr(hm->uri.p, '?', hm->uri.len)) != NULL) {
+      hm->query_string.p = qs + 1;
+      hm->query_string.len = &hm->uri.p[hm->uri.len] - (qs + 1);
+      hm->uri.len = qs - hm->uri.p;
     }
-
-    block_begin += line_len;
+  } else {
+    s = mg_skip(s, end, " ", &hm->proto);
+    if (end - s < 4 || s[3] != ' ') return -1;
+    hm->resp_code = atoi(s);
+    if (hm->resp_code < 100 || hm->resp_code >= 600) return -1;
+    s += 4;
+    s = mg_skip(s, end, "\r\n", &hm->resp_status_msg);
   }
 
-  pd->mp_stream.state = MPS_WAITING_FOR_BOUNDARY;
+  s = mg_http_parse_headers(s, end, len, hm);
 
-  altbuf_reset(&ab_var_name);
-  altbuf_reset(&ab_file_name);
+  /*
+   * mg_parse_http() is used to parse both HTTP requests and HTTP
+   * responses. If HTTP response does not have Content-Length set, then
+   * body is read until socket is closed, i.e. body.len is infinite (~0).
+   *
+   * For HTTP requests though, according to
+   * http://tools.ietf.org/html/rfc7231#section-8.1.3,
+   * only POST and PUT methods have defined body semantics.
+   * Therefore, if Content-Length is not specified and methods are
+   * not one of PUT or POST, set body length to 0.
+   *
+   * So,
+   * if it is HTTP request, and Content-Length is not set,
+   * and method is not (PUT or POST) then reset body length to zero.
+   */
+  if (hm->body.len == (size_t) ~0 && is_req &&
+      mg_vcasecmp(&hm->method, "PUT") != 0 &&
+      mg_vcasecmp(&hm->method, "POST") != 0) {
+    hm->body.len = 0;
+    hm->message.len = len;
+  }
 
-  return 0;
+  return len;
 }
 
-static int mg_http_multipart_continue_wait_for_chunk(struct mg_connection *c) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
-  struct mbuf *io = &c->recv_mbuf;
+struct mg_str *mg_get_http_header(struct http_message *hm, const char *name) {
+  size_t i, len = strlen(name);
 
-  const char *boundary;
-  if ((int) io->len < pd->mp_stream.boundary_len + 6 /* \r\n, --, -- */) {
-    return 0;
+  for (i = 0; hm->header_names[i].len > 0; i++) {
+    struct mg_str *h = &hm->header_names[i], *v = &hm->header_values[i];
+    if (h->p != NULL && h->len == len && !mg_ncasecmp(h->p, name, len))
+      return v;
   }
 
-  boundary = c_strnstr(io->buf, pd->mp_stream.boundary, io->len);
-  if (boundary == NULL && pd->mp_stream.prev_io_len == 0) {
-    pd->mp_stream.prev_io_len = io->len;
-    return 0;
-  } else if (boundary == NULL &&
-             (int) io->len >
-                 pd->mp_stream.prev_io_len + pd->mp_stream.boundary_len + 4) {
-    pd->mp_stream.state = MPS_GOT_CHUNK;
-    return 1;
-  } else if (boundary != NULL) {
-    int data_size = (boundary - io->buf - 4);
-    mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_DATA, io->buf, data_size);
-    mbuf_remove(io, (boundary - io->buf));
-    pd->mp_stream.prev_io_len = 0;
-    pd->mp_stream.state = MPS_WAITING_FOR_BOUNDARY;
-    return 1;
-  } else {
-    return 0;
-  }
+  return NULL;
 }
 
-static void mg_http_multipart_continue(struct mg_connection *c) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
-  while (1) {
-    switch (pd->mp_stream.state) {
-      case MPS_BEGIN: {
-        pd->mp_stream.state = MPS_WAITING_FOR_BOUNDARY;
-        break;
-      }
-      case MPS_WAITING_FOR_BOUNDARY: {
-        if (mg_http_multipart_wait_for_boundary(c) == 0) {
-          return;
-        }
-        break;
-      }
-      case MPS_GOT_BOUNDARY: {
-        if (mg_http_multipart_process_boundary(c) == 0) {
-          return;
-        }
-        break;
-      }
-      case MPS_WAITING_FOR_CHUNK: {
-        if (mg_http_multipart_continue_wait_for_chunk(c) == 0) {
-          return;
-        }
-        break;
-      }
-      case MPS_GOT_CHUNK: {
-        if (mg_http_multipart_got_chunk(c) == 0) {
-          return;
-        }
-        break;
-      }
-      case MPS_FINALIZE: {
-        if (mg_http_multipart_finalize(c) == 0) {
-          return;
-        }
-        break;
-      }
-      case MPS_FINISHED: {
-        mbuf_remove(&c->recv_mbuf, c->recv_mbuf.len);
-        return;
+#if MG_ENABLE_FILESYSTEM
+static void mg_http_transfer_file_data(struct mg_connection *nc) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  char buf[MG_MAX_HTTP_SEND_MBUF];
+  size_t n = 0, to_read = 0, left = (size_t)(pd->file.cl - pd->file.sent);
+
+  if (pd->file.type == DATA_FILE) {
+    struct mbuf *io = &nc->send_mbuf;
+    if (io->len >= MG_MAX_HTTP_SEND_MBUF) {
+      to_read = 0;
+    } else {
+      to_read = MG_MAX_HTTP_SEND_MBUF - io->len;
+    }
+    if (to_read > left) {
+      to_read = left;
+    }
+    if (to_read > 0) {
+      n = mg_fread(buf, 1, to_read, pd->file.fp);
+      if (n > 0) {
+#if MG_ENABLE_HTTP_GZIP
+        if (pd->gzip != NULL) {
+          mg_http_send_gzip_chunk(nc, buf, n, 0);
+        } else
+#endif
+          mg_send(nc, buf, n);
+        pd->file.sent += n;
+        DBG(("%p sent %d (total %d)", nc, (int) n, (int) pd->file.sent));
       }
+    } else {
+      /* Rate-limited */
+    }
+    if (pd->file.sent >= pd->file.cl) {
+      LOG(LL_DEBUG, ("%p done, %d bytes", nc, (int) pd->file.sent));
+#if MG_ENABLE_HTTP_GZIP
+      if (pd->gzip != NULL) mg_http_send_gzip_chunk(nc, NULL, 0, 2);
+#endif
+      if (!pd->file.keepalive) nc->flags |= MG_F_SEND_AND_CLOSE;
+      mg_http_free_proto_data_file(&pd->file);
+    }
+  } else if (pd->file.type == DATA_PUT) {
+    struct mbuf *io = &nc->recv_mbuf;
+    size_t to_write = left <= 0 ? 0 : left < io->len ? (size_t) left : io->len;
+    size_t n = mg_fwrite(io->buf, 1, to_write, pd->file.fp);
+    if (n > 0) {
+      mbuf_remove(io, n);
+      pd->file.sent += n;
+    }
+    if (n == 0 || pd->file.sent >= pd->file.cl) {
+      if (!pd->file.keepalive) nc->flags |= MG_F_SEND_AND_CLOSE;
+      mg_http_free_proto_data_file(&pd->file);
+    }
+  }
+#if MG_ENABLE_HTTP_CGI
+  else if (pd->cgi.cgi_nc != NULL) {
+    /* This is POST data that needs to be forwarded to the CGI process */
+    if (pd->cgi.cgi_nc != NULL) {
+      mg_forward(nc, pd->cgi.cgi_nc);
+    } else {
+      nc->flags |= MG_F_SEND_AND_CLOSE;
     }
   }
+#endif
 }
+#endif /* MG_ENABLE_FILESYSTEM */
 
-struct file_upload_state {
-  char *lfn;
-  size_t num_recd;
-  FILE *fp;
-};
+/*
+ * Parse chunked-encoded buffer. Return 0 if the buffer is not encoded, or
+ * if it's incomplete. If the chunk is fully buffered, return total number of
+ * bytes in a chunk, and store data in `data`, `data_len`.
+ */
+static size_t mg_http_parse_chunk(char *buf, size_t len, char **chunk_data,
+                                  size_t *chunk_len) {
+  unsigned char *s = (unsigned char *) buf;
+  size_t n = 0; /* scanned chunk length */
+  size_t i = 0; /* index in s */
 
-#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+  /* Scan chunk length. That should be a hexadecimal number. */
+  while (i < len && isxdigit(s[i])) {
+    n *= 16;
+    n += (s[i] >= '0' && s[i] <= '9') ? s[i] - '0' : tolower(s[i]) - 'a' + 10;
+    i++;
+  }
 
-void mg_set_protocol_http_websocket(struct mg_connection *nc) {
-  nc->proto_handler = mg_http_handler;
+  /* Skip new line */
+  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
+    return 0;
+  }
+  i += 2;
+
+  /* Record where the data is */
+  *chunk_data = (char *) s + i;
+  *chunk_len = n;
+
+  /* Skip data */
+  i += n;
+
+  /* Skip new line */
+  if (i == 0 || i + 2 > len || s[i] != '\r' || s[i + 1] != '\n') {
+    return 0;
+  }
+  return i + 2;
 }
 
-const char *mg_status_message(int status_code) {
-  switch (status_code) {
-    case 206:
-      return "Partial Content";
-    case 301:
-      return "Moved";
-    case 302:
-      return "Found";
-    case 400:
-      return "Bad Request";
-    case 401:
-      return "Unauthorized";
-    case 403:
-      return "Forbidden";
-    case 404:
-      return "Not Found";
-    case 416:
-      return "Requested Range Not Satisfiable";
-    case 418:
-      return "I'm a teapot";
-    case 500:
-      return "Internal Server Error";
-    case 502:
-      return "Bad Gateway";
-    case 503:
-      return "Service Unavailable";
+MG_INTERNAL size_t mg_handle_chunked(struct mg_connection *nc,
+                                     struct http_message *hm, char *buf,
+                                     size_t blen) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  char *data;
+  size_t i, n, data_len, body_len, zero_chunk_received = 0;
+  /* Find out piece of received data that is not yet reassembled */
+  body_len = (size_t) pd->chunk.body_len;
+  assert(blen >= body_len);
 
-#if MG_ENABLE_EXTRA_ERRORS_DESC
-    case 100:
-      return "Continue";
-    case 101:
-      return "Switching Protocols";
-    case 102:
-      return "Processing";
-    case 200:
-      return "OK";
-    case 201:
-      return "Created";
-    case 202:
-      return "Accepted";
-    case 203:
-      return "Non-Authoritative Information";
-    case 204:
-      return "No Content";
-    case 205:
-      return "Reset Content";
-    case 207:
-      return "Multi-Status";
-    case 208:
-      return "Already Reported";
-    case 226:
-      return "IM Used";
-    case 300:
-      return "Multiple Choices";
-    case 303:
-      return "See Other";
-    case 304:
-      return "Not Modified";
-    case 305:
-      return "Use Proxy";
-    case 306:
-      return "Switch Proxy";
-    case 307:
-      return "Temporary Redirect";
-    case 308:
-      return "Permanent Redirect";
-    case 402:
-      return "Payment Required";
-    case 405:
-      return "Method Not Allowed";
-    case 406:
-      return "Not Acceptable";
-    case 407:
-      return "Proxy Authentication Required";
-    case 408:
-      return "Request Timeout";
-    case 409:
-      return "Conflict";
-    case 410:
-      return "Gone";
-    case 411:
-      return "Length Required";
-    case 412:
-      return "Precondition Failed";
-    case 413:
-      return "Payload Too Large";
-    case 414:
-      return "URI Too Long";
-    case 415:
-      return "Unsupported Media Type";
-    case 417:
-      return "Expectation Failed";
-    case 422:
-      return "Unprocessable Entity";
-    case 423:
-      return "Locked";
-    case 424:
-      return "Failed Dependency";
-    case 426:
-      return "Upgrade Required";
-    case 428:
-      return "Precondition Required";
-    case 429:
-      return "Too Many Requests";
-    case 431:
-      return "Request Header Fields Too Large";
-    case 451:
-      return "Unavailable For Legal Reasons";
-    case 501:
-      return "Not Implemented";
-    case 504:
-      return "Gateway Timeout";
-    case 505:
-      return "HTTP Version Not Supported";
-    case 506:
-      return "Variant Also Negotiates";
-    case 507:
-      return "Insufficient Storage";
-    case 508:
-      return "Loop Detected";
-    case 510:
-      return "Not Extended";
-    case 511:
-      return "Network Authentication Required";
-#endif /* MG_ENABLE_EXTRA_ERRORS_DESC */
+  /* Traverse all fully buffered chunks */
+  for (i = body_len;
+       (n = mg_http_parse_chunk(buf + i, blen - i, &data, &data_len)) > 0;
+       i += n) {
+    /* Collapse chunk data to the rest of HTTP body */
+    memmove(buf + body_len, data, data_len);
+    body_len += data_len;
+    hm->body.len = body_len;
 
-    default:
-      return "OK";
+    if (data_len == 0) {
+      zero_chunk_received = 1;
+      i += n;
+      break;
+    }
+  }
+
+  if (i > body_len) {
+    /* Shift unparsed content to the parsed body */
+    assert(i <= blen);
+    memmove(buf + body_len, buf + i, blen - i);
+    memset(buf + body_len + blen - i, 0, i - body_len);
+    nc->recv_mbuf.len -= i - body_len;
+    pd->chunk.body_len = body_len;
+
+    /* Send MG_EV_HTTP_CHUNK event */
+    nc->flags &= ~MG_F_DELETE_CHUNK;
+    mg_call(nc, nc->handler, nc->user_data, MG_EV_HTTP_CHUNK, hm);
+
+    /* Delete processed data if user set MG_F_DELETE_CHUNK flag */
+    if (nc->flags & MG_F_DELETE_CHUNK) {
+      memset(buf, 0, body_len);
+      memmove(buf, buf + body_len, blen - i);
+      nc->recv_mbuf.len -= body_len;
+      hm->body.len = 0;
+      pd->chunk.body_len = 0;
+    }
+
+    if (zero_chunk_received) {
+      /* Total message size is len(body) + len(headers) */
+      hm->message.len =
+          (size_t) pd->chunk.body_len + blen - i + (hm->body.p - hm->message.p);
+    }
+  }
+
+  return body_len;
+}
+
+struct mg_http_endpoint *mg_http_get_endpoint_handler(struct mg_connection *nc,
+                                                      struct mg_str *uri_path) {
+  struct mg_http_proto_data *pd;
+  struct mg_http_endpoint *ret = NULL;
+  int matched, matched_max = 0;
+  struct mg_http_endpoint *ep;
+
+  if (nc == NULL) {
+    return NULL;
+  }
+
+  pd = mg_http_get_proto_data(nc);
+
+  ep = pd->endpoints;
+  while (ep != NULL) {
+    if ((matched = mg_match_prefix_n(ep->uri_pattern, *uri_path)) > 0) {
+      if (matched > matched_max) {
+        /* Looking for the longest suitable handler */
+        ret = ep;
+        matched_max = matched;
+      }
+    }
+
+    ep = ep->next;
+  }
+
+  return ret;
+}
+
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+static void mg_http_multipart_continue(struct mg_connection *nc);
+
+static void mg_http_multipart_begin(struct mg_connection *nc,
+                                    struct http_message *hm, int req_len);
+
+#endif
+
+static void mg_http_call_endpoint_handler(struct mg_connection *nc, int ev,
+                                          struct http_message *hm);
+
+static void deliver_chunk(struct mg_connection *c, struct http_message *hm,
+                          int req_len) {
+  /* Incomplete message received. Send MG_EV_HTTP_CHUNK event */
+  hm->body.len = c->recv_mbuf.len - req_len;
+  c->flags &= ~MG_F_DELETE_CHUNK;
+  mg_call(c, c->handler, c->user_data, MG_EV_HTTP_CHUNK, hm);
+  /* Delete processed data if user set MG_F_DELETE_CHUNK flag */
+  if (c->flags & MG_F_DELETE_CHUNK) c->recv_mbuf.len = req_len;
+}
+
+/*
+ * While the manager drains, server connections are closed once idle: no
+ * request partially received, no reply pending, being sent or streamed.
+ */
+static void mg_http_drain(struct mg_connection *nc,
+                          struct mg_http_proto_data *pd) {
+  if (nc->listener == NULL || pd->in_flight || nc->recv_mbuf.len > 0 ||
+      nc->send_mbuf.len > 0 || pd->reverse_proxy_data.linked_conn != NULL) {
+    return;
+  }
+#if MG_ENABLE_FILESYSTEM
+  if (pd->file.fp != NULL) return;
+#endif
+#if MG_ENABLE_HTTP_CGI
+  if (pd->cgi.cgi_nc != NULL) return;
+#endif
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+  if (pd->mp_stream.boundary != NULL) return;
+#endif
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/*
+ * lx106 compiler has a bug (TODO(mkm) report and insert tracking bug here)
+ * If a big structure is declared in a big function, lx106 gcc will make it
+ * even bigger (round up to 4k, from 700 bytes of actual size).
+ */
+#ifdef __xtensa__
+static void mg_http_handler2(struct mg_connection *nc, int ev,
+                             void *ev_data MG_UD_ARG(void *user_data),
+                             struct http_message *hm) __attribute__((noinline));
+
+void mg_http_handler(struct mg_connection *nc, int ev,
+                     void *ev_data MG_UD_ARG(void *user_data)) {
+  struct http_message hm;
+  mg_http_handler2(nc, ev, ev_data MG_UD_ARG(user_data), &hm);
+}
+
+static void mg_http_handler2(struct mg_connection *nc, int ev,
+                             void *ev_data MG_UD_ARG(void *user_data),
+                             struct http_message *hm) {
+#else  /* !__XTENSA__ */
+void mg_http_handler(struct mg_connection *nc, int ev,
+                     void *ev_data MG_UD_ARG(void *user_data)) {
+  struct http_message shm, *hm = &shm;
+#endif /* __XTENSA__ */
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  struct mbuf *io = &nc->recv_mbuf;
+  int req_len;
+  const int is_req = (nc->listener != NULL);
+#if MG_ENABLE_HTTP_WEBSOCKET
+  struct mg_str *vec;
+#endif
+  if (ev == MG_EV_CLOSE) {
+#if MG_ENABLE_HTTP_CGI
+    /* Close associated CGI forwarder connection */
+    if (pd->cgi.cgi_nc != NULL) {
+      pd->cgi.cgi_nc->user_data = NULL;
+      pd->cgi.cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mg_mark_closing(pd->cgi.cgi_nc);
+    }
+#endif
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+    if (pd->mp_stream.boundary != NULL) {
+      /*
+       * Multipart message is in progress, but connection is closed.
+       * Finish part and request with an error flag.
+       */
+      struct mg_http_multipart_part mp;
+      memset(&mp, 0, sizeof(mp));
+      mp.status = -1;
+      mp.var_name = pd->mp_stream.var_name;
+      mp.file_name = pd->mp_stream.file_name;
+      mg_call(nc, (pd->endpoint_handler ? pd->endpoint_handler : nc->handler),
+              nc->user_data, MG_EV_HTTP_PART_END, &mp);
+      mp.var_name = NULL;
+      mp.file_name = NULL;
+      mg_call(nc, (pd->endpoint_handler ? pd->endpoint_handler : nc->handler),
+              nc->user_data, MG_EV_HTTP_MULTIPART_REQUEST_END, &mp);
+    } else
+#endif
+        if (io->len > 0 &&
+            (req_len = mg_parse_http(io->buf, io->len, hm, is_req)) > 0) {
+      /*
+      * For HTTP messages without Content-Length, always send HTTP message
+      * before MG_EV_CLOSE message.
+      */
+      int ev2 = is_req ? MG_EV_HTTP_REQUEST : MG_EV_HTTP_REPLY;
+      hm->message.len = io->len;
+      hm->body.len = io->buf + io->len - hm->body.p;
+      deliver_chunk(nc, hm, req_len);
+      mg_http_call_endpoint_handler(nc, ev2, hm);
+    }
+    pd->rcvd = 0;
+  }
+
+#if MG_ENABLE_FILESYSTEM
+  if (pd->file.fp != NULL) {
+    mg_http_transfer_file_data(nc);
+  }
+#endif
+#if MG_ENABLE_HTTP_SSE
+  if (pd->sse != NULL && (ev == MG_EV_SEND || ev == MG_EV_POLL)) {
+    mg_sse_send_pending(pd->sse);
+  }
+#endif
+
+  mg_call(nc, nc->handler, nc->user_data, ev, ev_data);
+
+  if (ev == MG_EV_SEND) {
+    if (*(int *) ev_data > 0) pd->sent += *(int *) ev_data;
+    if (nc->send_mbuf.len == 0 && pd->reply_end != MG_HTTP_REPLY_CHUNKED &&
+        pd->sent >= pd->reply_end) {
+      pd->in_flight = 0;
+    }
+  }
+  if (nc->mgr->drain_deadline > 0 &&
+      (ev == MG_EV_DRAIN || ev == MG_EV_SEND || ev == MG_EV_POLL)) {
+    mg_http_drain(nc, pd);
+  }
+
+  if (ev == MG_EV_RECV) {
+    struct mg_str *s;
+#if MG_ENABLE_HTTP2
+    if (is_req && pd->rcvd == 0) {
+      int h2 = mg_h2_check_preface(io);
+      if (h2 < 0) return; /* Wait for the rest of the preface */
+      if (h2 > 0) {
+        mg_h2_accept(nc);
+        return;
+      }
+    }
+#endif
+    pd->rcvd += *(int *) ev_data;
+
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+    if (pd->mp_stream.boundary != NULL) {
+      mg_http_multipart_continue(nc);
+      return;
+    }
+#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+
+    req_len = mg_parse_http(io->buf, io->len, hm, is_req);
+
+    if (req_len > 0 &&
+        (s = mg_get_http_header(hm, "Transfer-Encoding")) != NULL &&
+        mg_vcasecmp(s, "chunked") == 0) {
+      mg_handle_chunked(nc, hm, io->buf + req_len, io->len - req_len);
+    }
+
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+    if (req_len > 0 && (s = mg_get_http_header(hm, "Content-Type")) != NULL &&
+        s->len >= 9 && strncmp(s->p, "multipart", 9) == 0) {
+      mg_http_multipart_begin(nc, hm, req_len);
+      mg_http_multipart_continue(nc);
+      return;
+    }
+#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+
+    /* TODO(alashkin): refactor this ifelseifelseifelseifelse */
+    if ((req_len < 0 ||
+         (req_len == 0 && io->len >= MG_MAX_HTTP_REQUEST_SIZE))) {
+      DBG(("invalid request"));
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    } else if (req_len == 0) {
+      /* Do nothing, request is not yet fully buffered */
+    }
+#if MG_ENABLE_HTTP_WEBSOCKET
+    else if (nc->listener == NULL &&
+             mg_get_http_header(hm, "Sec-WebSocket-Accept")) {
+      /* We're websocket client, got handshake response from server. */
+      /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
+      mbuf_remove(io, req_len);
+      nc->proto_handler = mg_ws_handler;
+      nc->flags |= MG_F_IS_WEBSOCKET;
+      mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_DONE,
+              NULL);
+      mg_ws_handler(nc, MG_EV_RECV, ev_data MG_UD_ARG(user_data));
+    } else if (nc->listener != NULL &&
+               (vec = mg_get_http_header(hm, "Sec-WebSocket-Key")) != NULL) {
+      struct mg_http_endpoint *ep;
+
+      /* This is a websocket request. Switch protocol handlers. */
+      mbuf_remove(io, req_len);
+      nc->proto_handler = mg_ws_handler;
+      nc->flags |= MG_F_IS_WEBSOCKET;
+
+      /*
+       * If we have a handler set up with mg_register_http_endpoint(),
+       * deliver subsequent websocket events to this handler after the
+       * protocol switch.
+       */
+      ep = mg_http_get_endpoint_handler(nc->listener, &hm->uri);
+      if (ep != NULL) {
+        nc->handler = ep->handler;
+#if MG_ENABLE_CALLBACK_USERDATA
+        nc->user_data = ep->user_data;
+#endif
+#if MG_ENABLE_MQTT_BROKER
+        pd->ws_data.mqtt_broker = ep->mqtt_broker;
+#endif
+      }
+
+      /* Send handshake */
+      mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_REQUEST,
+              hm);
+      if (!(nc->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE))) {
+        if (nc->send_mbuf.len == 0) {
+          mg_ws_handshake(nc, vec, hm);
+        }
+        mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_HANDSHAKE_DONE,
+                NULL);
+        mg_ws_handler(nc, MG_EV_RECV, ev_data MG_UD_ARG(user_data));
+      }
+    }
+#endif /* MG_ENABLE_HTTP_WEBSOCKET */
+    else if (hm->message.len > pd->rcvd) {
+      /* Not yet received all HTTP body, deliver MG_EV_HTTP_CHUNK */
+      deliver_chunk(nc, hm, req_len);
+      if (nc->recv_mbuf_limit > 0 && nc->recv_mbuf.len >= nc->recv_mbuf_limit) {
+        LOG(LL_ERROR, ("%p recv buffer (%lu bytes) exceeds the limit "
+                       "%lu bytes, and not drained, closing",
+                       nc, (unsigned long) nc->recv_mbuf.len,
+                       (unsigned long) nc->recv_mbuf_limit));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+    } else {
+      /* We did receive all HTTP body. */
+      int trigger_ev = nc->listener ? MG_EV_HTTP_REQUEST : MG_EV_HTTP_REPLY;
+      char addr[32];
+      mg_sock_addr_to_str(&nc->sa, addr, sizeof(addr),
+                          MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+      DBG(("%p %s %.*s %.*s", nc, addr, (int) hm->method.len, hm->method.p,
+           (int) hm->uri.len, hm->uri.p));
+      deliver_chunk(nc, hm, req_len);
+#if MG_ENABLE_HTTP_GZIP
+      pd->accept_gzip = (nc->listener != NULL && mg_http_accepts_gzip(hm));
+#endif
+      /* Whole HTTP message is fully buffered, call event handler */
+      if (trigger_ev == MG_EV_HTTP_REQUEST) {
+        pd->in_flight = 1;
+        pd->head_request = (mg_vcmp(&hm->method, "HEAD") == 0);
+        pd->reply_end = MG_HTTP_REPLY_UNKNOWN;
+      }
+      mg_http_call_endpoint_handler(nc, trigger_ev, hm);
+      mbuf_remove(io, hm->message.len);
+      pd->rcvd = 0;
+    }
+  }
+}
+
+static size_t mg_get_line_len(const char *buf, size_t buf_len) {
+  size_t len = 0;
+  while (len < buf_len && buf[len] != '\n') len++;
+  return len == buf_len ? 0 : len + 1;
+}
+
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+static void mg_http_multipart_begin(struct mg_connection *nc,
+                                    struct http_message *hm, int req_len) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  struct mg_str *ct;
+  struct mbuf *io = &nc->recv_mbuf;
+
+  char boundary_buf[100];
+  char *boundary = boundary_buf;
+  int boundary_len;
+
+  ct = mg_get_http_header(hm, "Content-Type");
+  if (ct == NULL) {
+    /* We need more data - or it isn't multipart mesage */
+    goto exit_mp;
+  }
+
+  /* Content-type should start with "multipart" */
+  if (ct->len < 9 || strncmp(ct->p, "multipart", 9) != 0) {
+    goto exit_mp;
+  }
+
+  boundary_len =
+      mg_http_parse_header2(ct, "boundary", &boundary, sizeof(boundary_buf));
+  if (boundary_len == 0) {
+    /*
+     * Content type is multipart, but there is no boundary,
+     * probably malformed request
+     */
+    nc->flags = MG_F_CLOSE_IMMEDIATELY;
+    DBG(("invalid request"));
+    goto exit_mp;
+  }
+
+  /* If we reach this place - that is multipart request */
+
+  if (pd->mp_stream.boundary != NULL) {
+    /*
+     * Another streaming request was in progress,
+     * looks like protocol error
+     */
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  } else {
+    struct mg_http_endpoint *ep = NULL;
+    pd->mp_stream.state = MPS_BEGIN;
+    pd->mp_stream.boundary = strdup(boundary);
+    pd->mp_stream.boundary_len = strlen(boundary);
+    pd->mp_stream.var_name = pd->mp_stream.file_name = NULL;
+    pd->endpoint_handler = nc->handler;
+
+    ep = mg_http_get_endpoint_handler(nc->listener, &hm->uri);
+    if (ep != NULL) {
+      pd->endpoint_handler = ep->handler;
+    }
+
+    mg_http_call_endpoint_handler(nc, MG_EV_HTTP_MULTIPART_REQUEST, hm);
+
+    mbuf_remove(io, req_len);
+  }
+exit_mp:
+  if (boundary != boundary_buf) MG_FREE(boundary);
+}
+
+#define CONTENT_DISPOSITION "Content-Disposition: "
+
+static void mg_http_multipart_call_handler(struct mg_connection *c, int ev,
+                                           const char *data, size_t data_len) {
+  struct mg_http_multipart_part mp;
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+  memset(&mp, 0, sizeof(mp));
+
+  mp.var_name = pd->mp_stream.var_name;
+  mp.file_name = pd->mp_stream.file_name;
+  mp.user_data = pd->mp_stream.user_data;
+  mp.data.p = data;
+  mp.data.len = data_len;
+  mg_call(c, pd->endpoint_handler, c->user_data, ev, &mp);
+  pd->mp_stream.user_data = mp.user_data;
+}
+
+static int mg_http_multipart_got_chunk(struct mg_connection *c) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+  struct mbuf *io = &c->recv_mbuf;
+
+  mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_DATA, io->buf,
+                                 pd->mp_stream.prev_io_len);
+  mbuf_remove(io, pd->mp_stream.prev_io_len);
+  pd->mp_stream.prev_io_len = 0;
+  pd->mp_stream.state = MPS_WAITING_FOR_CHUNK;
+
+  return 0;
+}
+
+static int mg_http_multipart_finalize(struct mg_connection *c) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+
+  mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_END, NULL, 0);
+  MG_FREE((void *) pd->mp_stream.file_name);
+  pd->mp_stream.file_name = NULL;
+  MG_FREE((void *) pd->mp_stream.var_name);
+  pd->mp_stream.var_name = NULL;
+  mg_http_multipart_call_handler(c, MG_EV_HTTP_MULTIPART_REQUEST_END, NULL, 0);
+  mg_http_free_proto_data_mp_stream(&pd->mp_stream);
+  pd->mp_stream.state = MPS_FINISHED;
+
+  return 1;
+}
+
+static int mg_http_multipart_wait_for_boundary(struct mg_connection *c) {
+  const char *boundary;
+  struct mbuf *io = &c->recv_mbuf;
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+
+  if (pd->mp_stream.boundary == NULL) {
+    pd->mp_stream.state = MPS_FINALIZE;
+    DBG(("Invalid request: boundary not initialized"));
+    return 0;
+  }
+
+  if ((int) io->len < pd->mp_stream.boundary_len + 2) {
+    return 0;
+  }
+
+  boundary = c_strnstr(io->buf, pd->mp_stream.boundary, io->len);
+  if (boundary != NULL) {
+    const char *boundary_end = (boundary + pd->mp_stream.boundary_len);
+    if (io->len - (boundary_end - io->buf) < 4) {
+      return 0;
+    }
+    if (strncmp(boundary_end, "--\r\n", 4) == 0) {
+      pd->mp_stream.state = MPS_FINALIZE;
+      mbuf_remove(io, (boundary_end - io->buf) + 4);
+    } else {
+      pd->mp_stream.state = MPS_GOT_BOUNDARY;
+    }
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+static void mg_http_parse_header_internal(struct mg_str *hdr,
+                                          const char *var_name,
+                                          struct altbuf *ab);
+
+static int mg_http_multipart_process_boundary(struct mg_connection *c) {
+  int data_size;
+  const char *boundary, *block_begin;
+  struct mbuf *io = &c->recv_mbuf;
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+  struct altbuf ab_file_name, ab_var_name;
+  int line_len;
+  boundary = c_strnstr(io->buf, pd->mp_stream.boundary, io->len);
+  block_begin = boundary + pd->mp_stream.boundary_len + 2;
+  data_size = io->len - (block_begin - io->buf);
+
+  altbuf_init(&ab_file_name, NULL, 0);
+  altbuf_init(&ab_var_name, NULL, 0);
+
+  while (data_size > 0 &&
+         (line_len = mg_get_line_len(block_begin, data_size)) != 0) {
+    if (line_len > (int) sizeof(CONTENT_DISPOSITION) &&
+        mg_ncasecmp(block_begin, CONTENT_DISPOSITION,
+                    sizeof(CONTENT_DISPOSITION) - 1) == 0) {
+      struct mg_str header;
+
+      header.p = block_begin + sizeof(CONTENT_DISPOSITION) - 1;
+      header.len = line_len - sizeof(CONTENT_DISPOSITION) - 1;
+
+      altbuf_reset(&ab_var_name);
+      mg_http_parse_header_internal(&header, "name", &ab_var_name);
+
+      altbuf_reset(&ab_file_name);
+      mg_http_parse_header_internal(&header, "filename", &ab_file_name);
+
+      block_begin += line_len;
+      data_size -= line_len;
+
+      continue;
+    }
+
+    if (line_len == 2 && mg_ncasecmp(block_begin, "\r\n", 2) == 0) {
+      mbuf_remove(io, block_begin - io->buf + 2);
+
+      if (pd->mp_stream.processing_part != 0) {
+        mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_END, NULL, 0);
+      }
+
+      /* Reserve 2 bytes for "\r\n" in file_name and var_name */
+      altbuf_append(&ab_file_name, '\0');
+      altbuf_append(&ab_file_name, '\0');
+      altbuf_append(&ab_var_name, '\0');
+      altbuf_append(&ab_var_name, '\0');
+
+      MG_FREE((void *) pd->mp_stream.file_name);
+      pd->mp_stream.file_name = altbuf_get_buf(&ab_file_name, 1 /* trim */);
+      MG_FREE((void *) pd->mp_stream.var_name);
+      pd->mp_stream.var_name = altbuf_get_buf(&ab_var_name, 1 /* trim */);
+
+      mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_BEGIN, NULL, 0);
+      pd->mp_stream.state = MPS_WAITING_FOR_CHUNK;
+      pd->mp_stream.processing_part++;
+      return 1;
+    }
+
+    block_begin += line_len;
+  }
+
+  pd->mp_stream.state = MPS_WAITING_FOR_BOUNDARY;
+
+  altbuf_reset(&ab_var_name);
+  altbuf_reset(&ab_file_name);
+
+  return 0;
+}
+
+static int mg_http_multipart_continue_wait_for_chunk(struct mg_connection *c) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+  struct mbuf *io = &c->recv_mbuf;
+
+  const char *boundary;
+  if ((int) io->len < pd->mp_stream.boundary_len + 6 /* \r\n, --, -- */) {
+    return 0;
+  }
+
+  boundary = c_strnstr(io->buf, pd->mp_stream.boundary, io->len);
+  if (boundary == NULL && pd->mp_stream.prev_io_len == 0) {
+    pd->mp_stream.prev_io_len = io->len;
+    return 0;
+  } else if (boundary == NULL &&
+             (int) io->len >
+                 pd->mp_stream.prev_io_len + pd->mp_stream.boundary_len + 4) {
+    pd->mp_stream.state = MPS_GOT_CHUNK;
+    return 1;
+  } else if (boundary != NULL) {
+    int data_size = (boundary - io->buf - 4);
+    mg_http_multipart_call_handler(c, MG_EV_HTTP_PART_DATA, io->buf, data_size);
+    mbuf_remove(io, (boundary - io->buf));
+    pd->mp_stream.prev_io_len = 0;
+    pd->mp_stream.state = MPS_WAITING_FOR_BOUNDARY;
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+static void mg_http_multipart_continue(struct mg_connection *c) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(c);
+  while (1) {
+    switch (pd->mp_stream.state) {
+      case MPS_BEGIN: {
+        pd->mp_stream.state = MPS_WAITING_FOR_BOUNDARY;
+        break;
+      }
+      case MPS_WAITING_FOR_BOUNDARY: {
+        if (mg_http_multipart_wait_for_boundary(c) == 0) {
+          return;
+        }
+        break;
+      }
+      case MPS_GOT_BOUNDARY: {
+        if (mg_http_multipart_process_boundary(c) == 0) {
+          return;
+        }
+        break;
+      }
+      case MPS_WAITING_FOR_CHUNK: {
+        if (mg_http_multipart_continue_wait_for_chunk(c) == 0) {
+          return;
+        }
+        break;
+      }
+      case MPS_GOT_CHUNK: {
+        if (mg_http_multipart_got_chunk(c) == 0) {
+          return;
+        }
+        break;
+      }
+      case MPS_FINALIZE: {
+        if (mg_http_multipart_finalize(c) == 0) {
+          return;
+        }
+        break;
+      }
+      case MPS_FINISHED: {
+        mbuf_remove(&c->recv_mbuf, c->recv_mbuf.len);
+        return;
+      }
+    }
+  }
+}
+
+struct file_upload_state {
+  char *lfn;
+  size_t num_recd;
+  FILE *fp;
+};
+
+#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+
+void mg_set_protocol_http_websocket(struct mg_connection *nc) {
+  nc->proto_handler = mg_http_handler;
+#if MG_ENABLE_HTTP2 && MG_ENABLE_SSL
+  if ((nc->flags & MG_F_LISTENING) && (nc->flags & MG_F_SSL)) {
+    mg_h2_set_alpn(nc);
+  }
+#endif
+}
+
+const char *mg_status_message(int status_code) {
+  switch (status_code) {
+    case 206:
+      return "Partial Content";
+    case 301:
+      return "Moved";
+    case 302:
+      return "Found";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 416:
+      return "Requested Range Not Satisfiable";
+    case 418:
+      return "I'm a teapot";
+    case 500:
+      return "Internal Server Error";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+
+#if MG_ENABLE_EXTRA_ERRORS_DESC
+    case 100:
+      return "Continue";
+    case 101:
+      return "Switching Protocols";
+    case 102:
+      return "Processing";
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 202:
+      return "Accepted";
+    case 203:
+      return "Non-Authoritative Information";
+    case 204:
+      return "No Content";
+    case 205:
+      return "Reset Content";
+    case 207:
+      return "Multi-Status";
+    case 208:
+      return "Already Reported";
+    case 226:
+      return "IM Used";
+    case 300:
+      return "Multiple Choices";
+    case 303:
+      return "See Other";
+    case 304:
+      return "Not Modified";
+    case 305:
+      return "Use Proxy";
+    case 306:
+      return "Switch Proxy";
+    case 307:
+      return "Temporary Redirect";
+    case 308:
+      return "Permanent Redirect";
+    case 402:
+      return "Payment Required";
+    case 405:
+      return "Method Not Allowed";
+    case 406:
+      return "Not Acceptable";
+    case 407:
+      return "Proxy Authentication Required";
+    case 408:
+      return "Request Timeout";
+    case 409:
+      return "Conflict";
+    case 410:
+      return "Gone";
+    case 411:
+      return "Length Required";
+    case 412:
+      return "Precondition Failed";
+    case 413:
+      return "Payload Too Large";
+    case 414:
+      return "URI Too Long";
+    case 415:
+      return "Unsupported Media Type";
+    case 417:
+      return "Expectation Failed";
+    case 422:
+      return "Unprocessable Entity";
+    case 423:
+      return "Locked";
+    case 424:
+      return "Failed Dependency";
+    case 426:
+      return "Upgrade Required";
+    case 428:
+      return "Precondition Required";
+    case 429:
+      return "Too Many Requests";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 451:
+      return "Unavailable For Legal Reasons";
+    case 501:
+      return "Not Implemented";
+    case 504:
+      return "Gateway Timeout";
+    case 505:
+      return "HTTP Version Not Supported";
+    case 506:
+      return "Variant Also Negotiates";
+    case 507:
+      return "Insufficient Storage";
+    case 508:
+      return "Loop Detected";
+    case 510:
+      return "Not Extended";
+    case 511:
+      return "Network Authentication Required";
+#endif /* MG_ENABLE_EXTRA_ERRORS_DESC */
+
+    default:
+      return "OK";
+  }
+}
+
+void mg_send_response_line_s(struct mg_connection *nc, int status_code,
+                             const struct mg_str extra_headers) {
+  mg_printf(nc, "HTTP/1.1 %d %s\r\nServer: %s\r\n", status_code,
+            mg_status_message(status_code), mg_version_header);
+  if (extra_headers.len > 0) {
+    mg_printf(nc, "%.*s\r\n", (int) extra_headers.len, extra_headers.p);
+  }
+}
+
+void mg_send_response_line(struct mg_connection *nc, int status_code,
+                           const char *extra_headers) {
+  mg_send_response_line_s(nc, status_code, mg_mk_str(extra_headers));
+}
+
+void mg_http_send_redirect(struct mg_connection *nc, int status_code,
+                           const struct mg_str location,
+                           const struct mg_str extra_headers) {
+  char bbody[100], *pbody = bbody;
+  int bl = mg_asprintf(&pbody, sizeof(bbody),
+                       "<p>Moved <a href='%.*s'>here</a>.\r\n",
+                       (int) location.len, location.p);
+  char bhead[150], *phead = bhead;
+  mg_asprintf(&phead, sizeof(bhead),
+              "Location: %.*s\r\n"
+              "Content-Type: text/html\r\n"
+              "Content-Length: %d\r\n"
+              "Cache-Control: no-cache\r\n"
+              "%.*s%s",
+              (int) location.len, location.p, bl, (int) extra_headers.len,
+              extra_headers.p, (extra_headers.len > 0 ? "\r\n" : ""));
+  mg_send_response_line(nc, status_code, phead);
+  if (phead != bhead) MG_FREE(phead);
+  mg_send(nc, pbody, bl);
+  if (pbody != bbody) MG_FREE(pbody);
+}
+
+#if MG_ENABLE_HTTP_GZIP
+/* Looks up a header in `extra_headers`, i.e. lines without the last CRLF. */
+static struct mg_str mg_http_extra_header(const char *extra_headers,
+                                          const char *name) {
+  struct mg_str v = MG_NULL_STR;
+  size_t n = strlen(name);
+  const char *p = extra_headers;
+  while (p != NULL && *p != '\0') {
+    if (mg_ncasecmp(p, name, n) == 0 && p[n] == ':') {
+      for (p += n + 1; *p == ' '; p++) {
+      }
+      for (v.p = p; p[v.len] != '\0' && p[v.len] != '\r' && p[v.len] != '\n';
+           v.len++) {
+      }
+      break;
+    }
+    p = strchr(p, '\n');
+    if (p != NULL) p++;
+  }
+  return v;
+}
+
+/* Decides whether to compress a chunked response, and sets up if so. */
+static int mg_http_gzip_response(struct mg_connection *c, int status_code,
+                                 const char *extra_headers) {
+  struct mg_http_proto_data *pd = (struct mg_http_proto_data *) c->proto_data;
+  if (pd == NULL || c->proto_data_destructor != mg_http_conn_destructor ||
+      !pd->accept_gzip || status_code < 200 || status_code == 204 ||
+      status_code == 304) {
+    return 0;
+  }
+  /* One response per request */
+  pd->accept_gzip = 0;
+  if (extra_headers != NULL &&
+      (mg_http_extra_header(extra_headers, "Content-Encoding").p != NULL ||
+       !mg_http_gzip_wanted(
+           mg_http_extra_header(extra_headers, "Content-Type"), -1))) {
+    return 0;
+  }
+  return mg_http_gzip_begin(pd);
+}
+#endif
+
+/*
+ * Records where the reply to the request in flight ends: `body_len` bytes
+ * after what is queued now, or with the last chunk if `body_len` is
+ * negative. Until then, mg_http_drain() leaves the connection alone.
+ */
+static void mg_http_reply_ends(struct mg_connection *nc, int64_t body_len) {
+  struct mg_http_proto_data *pd = (struct mg_http_proto_data *) nc->proto_data;
+  if (pd == NULL || nc->proto_data_destructor != mg_http_conn_destructor ||
+      !pd->in_flight) {
+    return;
+  }
+  pd->reply_end = body_len < 0 ? MG_HTTP_REPLY_CHUNKED
+                               : pd->sent + (int64_t) mg_send_pending(nc) +
+                                     body_len;
+}
+
+/* Replies to HEAD, 1xx, 204 and 304 have no body, whatever the headers say */
+static int mg_http_reply_has_body(struct mg_connection *nc, int status_code) {
+  struct mg_http_proto_data *pd = (struct mg_http_proto_data *) nc->proto_data;
+  if (status_code < 200 || status_code == 204 || status_code == 304) return 0;
+  return pd == NULL || nc->proto_data_destructor != mg_http_conn_destructor ||
+         !pd->head_request;
+}
+
+void mg_send_head(struct mg_connection *c, int status_code,
+                  int64_t content_length, const char *extra_headers) {
+  mg_send_response_line(c, status_code, extra_headers);
+  if (content_length < 0) {
+#if MG_ENABLE_HTTP_GZIP
+    if (mg_http_gzip_response(c, status_code, extra_headers)) {
+      mg_printf(c, "%s", "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+    }
+#endif
+    mg_printf(c, "%s", "Transfer-Encoding: chunked\r\n");
+  } else {
+    mg_printf(c, "Content-Length: %" INT64_FMT "\r\n", content_length);
+  }
+  mg_send(c, "\r\n", 2);
+  mg_http_reply_ends(
+      c, mg_http_reply_has_body(c, status_code) ? content_length : 0);
+}
+
+void mg_http_send_error(struct mg_connection *nc, int code,
+                        const char *reason) {
+  if (!reason) reason = mg_status_message(code);
+  LOG(LL_DEBUG, ("%p %d %s", nc, code, reason));
+  mg_send_head(nc, code, strlen(reason),
+               "Content-Type: text/plain\r\nConnection: close");
+  mg_send(nc, reason, strlen(reason));
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+#if MG_ENABLE_FILESYSTEM
+static void mg_http_construct_etag(char *buf, size_t buf_len,
+                                   const cs_stat_t *st) {
+  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"", (unsigned long) st->st_mtime,
+           (int64_t) st->st_size);
+}
+
+#ifndef WINCE
+static void mg_gmt_time_string(char *buf, size_t buf_len, time_t *t) {
+  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
+}
+#else
+/* Look wince_lib.c for WindowsCE implementation */
+static void mg_gmt_time_string(char *buf, size_t buf_len, time_t *t);
+#endif
+
+static int mg_http_parse_range_header(const struct mg_str *header, int64_t *a,
+                                      int64_t *b) {
+  /*
+   * There is no snscanf. Headers are not guaranteed to be NUL-terminated,
+   * so we have this. Ugh.
+   */
+  int result;
+  char *p = (char *) MG_MALLOC(header->len + 1);
+  if (p == NULL) return 0;
+  memcpy(p, header->p, header->len);
+  p[header->len] = '\0';
+  result = sscanf(p, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
+  MG_FREE(p);
+  return result;
+}
+
+void mg_http_serve_file(struct mg_connection *nc, struct http_message *hm,
+                        const char *path, const struct mg_str mime_type,
+                        const struct mg_str extra_headers) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  cs_stat_t st;
+  LOG(LL_DEBUG, ("%p [%s] %.*s", nc, path, (int) mime_type.len, mime_type.p));
+  if (mg_stat(path, &st) != 0 || (pd->file.fp = mg_fopen(path, "rb")) == NULL) {
+    int code, err = mg_get_errno();
+    switch (err) {
+      case EACCES:
+        code = 403;
+        break;
+      case ENOENT:
+        code = 404;
+        break;
+      default:
+        code = 500;
+    };
+    mg_http_send_error(nc, code, "Open failed");
+  } else {
+    char etag[50], current_time[50], last_modified[50], range[70];
+    char length[80];
+    time_t t = (time_t) mg_time();
+    int64_t r1 = 0, r2 = 0, cl = st.st_size;
+    struct mg_str *range_hdr = mg_get_http_header(hm, "Range");
+    int n, status_code = 200;
+
+    /* Handle Range header */
+    range[0] = '\0';
+    if (range_hdr != NULL &&
+        (n = mg_http_parse_range_header(range_hdr, &r1, &r2)) > 0 && r1 >= 0 &&
+        r2 >= 0) {
+      /* If range is specified like "400-", set second limit to content len */
+      if (n == 1) {
+        r2 = cl - 1;
+      }
+      if (r1 > r2 || r2 >= cl) {
+        status_code = 416;
+        cl = 0;
+        snprintf(range, sizeof(range),
+                 "Content-Range: bytes */%" INT64_FMT "\r\n",
+                 (int64_t) st.st_size);
+      } else {
+        status_code = 206;
+        cl = r2 - r1 + 1;
+        snprintf(range, sizeof(range), "Content-Range: bytes %" INT64_FMT
+                                       "-%" INT64_FMT "/%" INT64_FMT "\r\n",
+                 r1, r1 + cl - 1, (int64_t) st.st_size);
+#if _FILE_OFFSET_BITS == 64 || _POSIX_C_SOURCE >= 200112L || \
+    _XOPEN_SOURCE >= 600
+        fseeko(pd->file.fp, r1, SEEK_SET);
+#else
+        fseek(pd->file.fp, (long) r1, SEEK_SET);
+#endif
+      }
+    }
+
+#if !MG_DISABLE_HTTP_KEEP_ALIVE
+    {
+      struct mg_str *conn_hdr = mg_get_http_header(hm, "Connection");
+      if (conn_hdr != NULL) {
+        pd->file.keepalive = (mg_vcasecmp(conn_hdr, "keep-alive") == 0);
+      } else {
+        pd->file.keepalive = (mg_vcmp(&hm->proto, "HTTP/1.1") == 0);
+      }
+    }
+#endif
+
+    mg_http_construct_etag(etag, sizeof(etag), &st);
+    /*
+     * Content length casted to size_t because:
+     * 1) that's the maximum buffer size anyway
+     * 2) ESP8266 RTOS SDK newlib vprintf cannot contain a 64bit arg at non-last
+     *    position
+     * TODO(mkm): fix ESP8266 RTOS SDK
+     */
+    snprintf(length, sizeof(length), "Content-Length: %" SIZE_T_FMT "\r\n",
+             (size_t) cl);
+#if MG_ENABLE_HTTP_GZIP
+    if (status_code == 200 && mg_http_accepts_gzip(hm) &&
+        mg_http_gzip_wanted(mime_type, cl) && mg_http_gzip_begin(pd)) {
+      /* Compressed body is a different entity, but equivalent */
+      memmove(etag + 2, etag, strlen(etag) + 1);
+      memcpy(etag, "W/", 2);
+      snprintf(length, sizeof(length), "%s",
+               "Content-Encoding: gzip\r\n"
+               "Vary: Accept-Encoding\r\n"
+               "Transfer-Encoding: chunked\r\n");
+    }
+#endif
+    mg_gmt_time_string(current_time, sizeof(current_time), &t);
+    mg_gmt_time_string(last_modified, sizeof(last_modified), &st.st_mtime);
+    mg_send_response_line_s(nc, status_code, extra_headers);
+    mg_printf(nc,
+              "Date: %s\r\n"
+              "Last-Modified: %s\r\n"
+              "Accept-Ranges: bytes\r\n"
+              "Content-Type: %.*s\r\n"
+              "Connection: %s\r\n"
+              "%s%sEtag: %s\r\n\r\n",
+              current_time, last_modified, (int) mime_type.len, mime_type.p,
+              (pd->file.keepalive ? "keep-alive" : "close"), length, range,
+              etag);
+
+    pd->file.cl = cl;
+    pd->file.type = DATA_FILE;
+    mg_http_transfer_file_data(nc);
+  }
+}
+
+static void mg_http_serve_file2(struct mg_connection *nc, const char *path,
+                                struct http_message *hm,
+                                struct mg_serve_http_opts *opts) {
+#if MG_ENABLE_HTTP_SSI
+  if (mg_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern), path) > 0) {
+    mg_handle_ssi_request(nc, hm, path, opts);
+    return;
+  }
+#endif
+  mg_http_serve_file(nc, hm, path, mg_get_mime_type(path, "text/plain", opts),
+                     mg_mk_str(opts->extra_headers));
+}
+
+#endif
+
+int mg_url_decode(const char *src, int src_len, char *dst, int dst_len,
+                  int is_form_url_encoded) {
+  int i, j, a, b;
+#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
+
+  for (i = j = 0; i < src_len && j < dst_len - 1; i++, j++) {
+    if (src[i] == '%') {
+      if (i < src_len - 2 && isxdigit(*(const unsigned char *) (src + i + 1)) &&
+          isxdigit(*(const unsigned char *) (src + i + 2))) {
+        a = tolower(*(const unsigned char *) (src + i + 1));
+        b = tolower(*(const unsigned char *) (src + i + 2));
+        dst[j] = (char) ((HEXTOI(a) << 4) | HEXTOI(b));
+        i += 2;
+      } else {
+        return -1;
+      }
+    } else if (is_form_url_encoded && src[i] == '+') {
+      dst[j] = ' ';
+    } else {
+      dst[j] = src[i];
+    }
+  }
+
+  dst[j] = '\0'; /* Null-terminate the destination */
+
+  return i >= src_len ? j : -1;
+}
+
+int mg_get_http_var(const struct mg_str *buf, const char *name, char *dst,
+                    size_t dst_len) {
+  const char *p, *e, *s;
+  size_t name_len;
+  int len;
+
+  /*
+   * According to the documentation function returns negative
+   * value in case of error. For debug purposes it returns:
+   * -1 - src is wrong (NUUL)
+   * -2 - dst is wrong (NULL)
+   * -3 - failed to decode url or dst is to small
+   * -4 - name does not exist
+   */
+  if (dst == NULL || dst_len == 0) {
+    len = -2;
+  } else if (buf->p == NULL || name == NULL || buf->len == 0) {
+    len = -1;
+    dst[0] = '\0';
+  } else {
+    name_len = strlen(name);
+    e = buf->p + buf->len;
+    len = -4;
+    dst[0] = '\0';
+
+    for (p = buf->p; p + name_len < e; p++) {
+      if ((p == buf->p || p[-1] == '&') && p[name_len] == '=' &&
+          !mg_ncasecmp(name, p, name_len)) {
+        p += name_len + 1;
+        s = (const char *) memchr(p, '&', (size_t)(e - p));
+        if (s == NULL) {
+          s = e;
+        }
+        len = mg_url_decode(p, (size_t)(s - p), dst, dst_len, 1);
+        /* -1 means: failed to decode or dst is too small */
+        if (len == -1) {
+          len = -3;
+        }
+        break;
+      }
+    }
+  }
+
+  return len;
+}
+
+void mg_send_http_chunk(struct mg_connection *nc, const char *buf, size_t len) {
+  char chunk_size[50];
+  int n;
+
+#if MG_ENABLE_HTTP_GZIP
+  if (mg_http_get_gzip(nc) != NULL) {
+    /* Empty chunk ends the response, and the compressed stream */
+    mg_http_send_gzip_chunk(nc, buf, len, len > 0 ? 1 : 2);
+    return;
+  }
+#endif
+
+  n = snprintf(chunk_size, sizeof(chunk_size), "%lX\r\n", (unsigned long) len);
+  mg_send(nc, chunk_size, n);
+  mg_send(nc, buf, len);
+  mg_send(nc, "\r\n", 2);
+  if (len == 0) mg_http_reply_ends(nc, 0);
+}
+
+/*
+ * Formats a chunk directly into the send buffer. Chunk size is written
+ * zero-padded into space reserved up front, so no data has to be moved.
+ */
+static int mg_vprintf_http_chunk_direct(struct mbuf *mb, const char *fmt,
+                                        va_list ap) {
+  char chunk_size[11];
+  size_t off = mb->len;
+  int len;
+
+  mbuf_append(mb, NULL, 10);
+  if (mb->len != off + 10 || (len = mbuf_vprintf(mb, fmt, ap)) < 0) {
+    mb->len = off;
+    return -1;
+  }
+  snprintf(chunk_size, sizeof(chunk_size), "%08lX\r\n", (unsigned long) len);
+  memcpy(mb->buf + off, chunk_size, 10);
+  mbuf_append(mb, "\r\n", 2);
+  return len;
+}
+
+void mg_printf_http_chunk(struct mg_connection *nc, const char *fmt, ...) {
+  char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
+  struct mbuf *mb;
+  int len;
+  va_list ap;
+
+  if ((mb = mg_send_mbuf(nc)) != NULL
+#if MG_ENABLE_HTTP_GZIP
+      && mg_http_get_gzip(nc) == NULL
+#endif
+      ) {
+    va_start(ap, fmt);
+    len = mg_vprintf_http_chunk_direct(mb, fmt, ap);
+    va_end(ap);
+    if (len == 0) mg_http_reply_ends(nc, 0);
+    return;
+  }
+
+  va_start(ap, fmt);
+  len = mg_avprintf(&buf, sizeof(mem), fmt, ap);
+  va_end(ap);
+
+  if (len >= 0) {
+    mg_send_http_chunk(nc, buf, len);
+  }
+
+  /* LCOV_EXCL_START */
+  if (buf != mem && buf != NULL) {
+    MG_FREE(buf);
+  }
+  /* LCOV_EXCL_STOP */
+}
+
+void mg_printf_html_escape(struct mg_connection *nc, const char *fmt, ...) {
+  char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
+  int i, j, len;
+  va_list ap;
+
+  va_start(ap, fmt);
+  len = mg_avprintf(&buf, sizeof(mem), fmt, ap);
+  va_end(ap);
+
+  if (len >= 0) {
+    for (i = j = 0; i < len; i++) {
+      if (buf[i] == '<' || buf[i] == '>') {
+        mg_send(nc, buf + j, i - j);
+        mg_send(nc, buf[i] == '<' ? "&lt;" : "&gt;", 4);
+        j = i + 1;
+      }
+    }
+    mg_send(nc, buf + j, i - j);
+  }
+
+  /* LCOV_EXCL_START */
+  if (buf != mem && buf != NULL) {
+    MG_FREE(buf);
+  }
+  /* LCOV_EXCL_STOP */
+}
+
+static void mg_http_parse_header_internal(struct mg_str *hdr,
+                                          const char *var_name,
+                                          struct altbuf *ab) {
+  int ch = ' ', ch1 = ',', n = strlen(var_name);
+  const char *p, *end = hdr ? hdr->p + hdr->len : NULL, *s = NULL;
+
+  /* Find where variable starts */
+  for (s = hdr->p; s != NULL && s + n < end; s++) {
+    if ((s == hdr->p || s[-1] == ch || s[-1] == ch1 || s[-1] == ';') &&
+        s[n] == '=' && !strncmp(s, var_name, n))
+      break;
+  }
+
+  if (s != NULL && &s[n + 1] < end) {
+    s += n + 1;
+    if (*s == '"' || *s == '\'') {
+      ch = ch1 = *s++;
+    }
+    p = s;
+    while (p < end && p[0] != ch && p[0] != ch1) {
+      if (ch != ' ' && p[0] == '\\' && p[1] == ch) p++;
+      altbuf_append(ab, *p++);
+    }
+
+    if (ch != ' ' && *p != ch) {
+      altbuf_reset(ab);
+    }
+  }
+
+  /* If there is some data, append a NUL. */
+  if (ab->len > 0) {
+    altbuf_append(ab, '\0');
+  }
+}
+
+int mg_http_parse_header2(struct mg_str *hdr, const char *var_name, char **buf,
+                          size_t buf_size) {
+  struct altbuf ab;
+  altbuf_init(&ab, *buf, buf_size);
+  if (hdr == NULL) return 0;
+  if (*buf != NULL && buf_size > 0) *buf[0] = '\0';
+
+  mg_http_parse_header_internal(hdr, var_name, &ab);
+
+  /*
+   * Get a (trimmed) buffer, and return a len without a NUL byte which might
+   * have been added.
+   */
+  *buf = altbuf_get_buf(&ab, 1 /* trim */);
+  return ab.len > 0 ? ab.len - 1 : 0;
+}
+
+int mg_http_parse_header(struct mg_str *hdr, const char *var_name, char *buf,
+                         size_t buf_size) {
+  char *buf2 = buf;
+
+  int len = mg_http_parse_header2(hdr, var_name, &buf2, buf_size);
+
+  if (buf2 != buf) {
+    /* Buffer was not enough and was reallocated: free it and just return 0 */
+    MG_FREE(buf2);
+    return 0;
+  }
+
+  return len;
+}
+
+int mg_get_http_basic_auth(struct http_message *hm, char *user, size_t user_len,
+                           char *pass, size_t pass_len) {
+  struct mg_str *hdr = mg_get_http_header(hm, "Authorization");
+  if (hdr == NULL) return -1;
+  return mg_parse_http_basic_auth(hdr, user, user_len, pass, pass_len);
+}
+
+int mg_parse_http_basic_auth(struct mg_str *hdr, char *user, size_t user_len,
+                             char *pass, size_t pass_len) {
+  char *buf = NULL;
+  char fmt[64];
+  int res = 0;
+
+  if (mg_strncmp(*hdr, mg_mk_str("Basic "), 6) != 0) return -1;
+
+  buf = (char *) MG_MALLOC(hdr->len);
+  cs_base64_decode((unsigned char *) hdr->p + 6, hdr->len, buf, NULL);
+
+  /* e.g. "%123[^:]:%321[^\n]" */
+  snprintf(fmt, sizeof(fmt), "%%%" SIZE_T_FMT "[^:]:%%%" SIZE_T_FMT "[^\n]",
+           user_len - 1, pass_len - 1);
+  if (sscanf(buf, fmt, user, pass) == 0) {
+    res = -1;
+  }
+
+  MG_FREE(buf);
+  return res;
+}
+
+#if MG_ENABLE_FILESYSTEM
+static int mg_is_file_hidden(const char *path,
+                             const struct mg_serve_http_opts *opts,
+                             int exclude_specials) {
+  const char *p1 = opts->per_directory_auth_file;
+  const char *p2 = opts->hidden_file_pattern;
+
+  /* Strip directory path from the file name */
+  const char *pdir = strrchr(path, DIRSEP);
+  if (pdir != NULL) {
+    path = pdir + 1;
+  }
+
+  return (exclude_specials && (!strcmp(path, ".") || !strcmp(path, ".."))) ||
+         (p1 != NULL && mg_match_prefix(p1, strlen(p1), path) == strlen(p1)) ||
+         (p2 != NULL && mg_match_prefix(p2, strlen(p2), path) > 0);
+}
+
+#if !MG_DISABLE_HTTP_DIGEST_AUTH
+
+#ifndef MG_EXT_MD5
+void mg_hash_md5_v(size_t num_msgs, const uint8_t *msgs[],
+                   const size_t *msg_lens, uint8_t *digest) {
+  size_t i;
+  cs_md5_ctx md5_ctx;
+  cs_md5_init(&md5_ctx);
+  for (i = 0; i < num_msgs; i++) {
+    cs_md5_update(&md5_ctx, msgs[i], msg_lens[i]);
+  }
+  cs_md5_final(digest, &md5_ctx);
+}
+#else
+extern void mg_hash_md5_v(size_t num_msgs, const uint8_t *msgs[],
+                          const size_t *msg_lens, uint8_t *digest);
+#endif
+
+void cs_md5(char buf[33], ...) {
+  unsigned char hash[16];
+  const uint8_t *msgs[20], *p;
+  size_t msg_lens[20];
+  size_t num_msgs = 0;
+  va_list ap;
+
+  va_start(ap, buf);
+  while ((p = va_arg(ap, const unsigned char *) ) != NULL) {
+    msgs[num_msgs] = p;
+    msg_lens[num_msgs] = va_arg(ap, size_t);
+    num_msgs++;
+  }
+  va_end(ap);
+
+  mg_hash_md5_v(num_msgs, msgs, msg_lens, hash);
+  cs_to_hex(buf, hash, sizeof(hash));
+}
+
+static void mg_mkmd5resp(const char *method, size_t method_len, const char *uri,
+                         size_t uri_len, const char *ha1, size_t ha1_len,
+                         const char *nonce, size_t nonce_len, const char *nc,
+                         size_t nc_len, const char *cnonce, size_t cnonce_len,
+                         const char *qop, size_t qop_len, char *resp) {
+  static const char colon[] = ":";
+  static const size_t one = 1;
+  char ha2[33];
+  cs_md5(ha2, method, method_len, colon, one, uri, uri_len, NULL);
+  cs_md5(resp, ha1, ha1_len, colon, one, nonce, nonce_len, colon, one, nc,
+         nc_len, colon, one, cnonce, cnonce_len, colon, one, qop, qop_len,
+         colon, one, ha2, sizeof(ha2) - 1, NULL);
+}
+
+int mg_http_create_digest_auth_header(char *buf, size_t buf_len,
+                                      const char *method, const char *uri,
+                                      const char *auth_domain, const char *user,
+                                      const char *passwd, const char *nonce) {
+  static const char colon[] = ":", qop[] = "auth";
+  static const size_t one = 1;
+  char ha1[33], resp[33], cnonce[40];
+
+  snprintf(cnonce, sizeof(cnonce), "%lx", (unsigned long) mg_time());
+  cs_md5(ha1, user, (size_t) strlen(user), colon, one, auth_domain,
+         (size_t) strlen(auth_domain), colon, one, passwd,
+         (size_t) strlen(passwd), NULL);
+  mg_mkmd5resp(method, strlen(method), uri, strlen(uri), ha1, sizeof(ha1) - 1,
+               nonce, strlen(nonce), "1", one, cnonce, strlen(cnonce), qop,
+               sizeof(qop) - 1, resp);
+  return snprintf(buf, buf_len,
+                  "Authorization: Digest username=\"%s\","
+                  "realm=\"%s\",uri=\"%s\",qop=%s,nc=1,cnonce=%s,"
+                  "nonce=%s,response=%s\r\n",
+                  user, auth_domain, uri, qop, cnonce, nonce, resp);
+}
+
+/*
+ * Check for authentication timeout.
+ * Clients send time stamp encoded in nonce. Make sure it is not too old,
+ * to prevent replay attacks.
+ * Assumption: nonce is a hexadecimal number of seconds since 1970.
+ */
+static int mg_check_nonce(const char *nonce) {
+  unsigned long now = (unsigned long) mg_time();
+  unsigned long val = (unsigned long) strtoul(nonce, NULL, 16);
+  return (now >= val) && (now - val < 60 * 60);
+}
+
+int mg_http_check_digest_auth(struct http_message *hm, const char *auth_domain,
+                              FILE *fp) {
+  int ret = 0;
+  struct mg_str *hdr;
+  char username_buf[50], cnonce_buf[64], response_buf[40], uri_buf[200],
+      qop_buf[20], nc_buf[20], nonce_buf[16];
+
+  char *username = username_buf, *cnonce = cnonce_buf, *response = response_buf,
+       *uri = uri_buf, *qop = qop_buf, *nc = nc_buf, *nonce = nonce_buf;
+
+  /* Parse "Authorization:" header, fail fast on parse error */
+  if (hm == NULL || fp == NULL ||
+      (hdr = mg_get_http_header(hm, "Authorization")) == NULL ||
+      mg_http_parse_header2(hdr, "username", &username, sizeof(username_buf)) ==
+          0 ||
+      mg_http_parse_header2(hdr, "cnonce", &cnonce, sizeof(cnonce_buf)) == 0 ||
+      mg_http_parse_header2(hdr, "response", &response, sizeof(response_buf)) ==
+          0 ||
+      mg_http_parse_header2(hdr, "uri", &uri, sizeof(uri_buf)) == 0 ||
+      mg_http_parse_header2(hdr, "qop", &qop, sizeof(qop_buf)) == 0 ||
+      mg_http_parse_header2(hdr, "nc", &nc, sizeof(nc_buf)) == 0 ||
+      mg_http_parse_header2(hdr, "nonce", &nonce, sizeof(nonce_buf)) == 0 ||
+      mg_check_nonce(nonce) == 0) {
+    ret = 0;
+    goto clean;
+  }
+
+  /* NOTE(lsm): due to a bug in MSIE, we do not compare URIs */
+
+  ret = mg_check_digest_auth(
+      hm->method,
+      mg_mk_str_n(
+          hm->uri.p,
+          hm->uri.len + (hm->query_string.len ? hm->query_string.len + 1 : 0)),
+      mg_mk_str(username), mg_mk_str(cnonce), mg_mk_str(response),
+      mg_mk_str(qop), mg_mk_str(nc), mg_mk_str(nonce), mg_mk_str(auth_domain),
+      fp);
+
+clean:
+  if (username != username_buf) MG_FREE(username);
+  if (cnonce != cnonce_buf) MG_FREE(cnonce);
+  if (response != response_buf) MG_FREE(response);
+  if (uri != uri_buf) MG_FREE(uri);
+  if (qop != qop_buf) MG_FREE(qop);
+  if (nc != nc_buf) MG_FREE(nc);
+  if (nonce != nonce_buf) MG_FREE(nonce);
+
+  return ret;
+}
+
+int mg_check_digest_auth(struct mg_str method, struct mg_str uri,
+                         struct mg_str username, struct mg_str cnonce,
+                         struct mg_str response, struct mg_str qop,
+                         struct mg_str nc, struct mg_str nonce,
+                         struct mg_str auth_domain, FILE *fp) {
+  char buf[128], f_user[sizeof(buf)], f_ha1[sizeof(buf)], f_domain[sizeof(buf)];
+  char expected_response[33];
+
+  /*
+   * Read passwords file line by line. If should have htdigest format,
+   * i.e. each line should be a colon-separated sequence:
+   * USER_NAME:DOMAIN_NAME:HA1_HASH_OF_USER_DOMAIN_AND_PASSWORD
+   */
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    if (sscanf(buf, "%[^:]:%[^:]:%s", f_user, f_domain, f_ha1) == 3 &&
+        mg_vcmp(&username, f_user) == 0 &&
+        mg_vcmp(&auth_domain, f_domain) == 0) {
+      /* Username and domain matched, check the password */
+      mg_mkmd5resp(method.p, method.len, uri.p, uri.len, f_ha1, strlen(f_ha1),
+                   nonce.p, nonce.len, nc.p, nc.len, cnonce.p, cnonce.len,
+                   qop.p, qop.len, expected_response);
+      LOG(LL_DEBUG,
+          ("%.*s %s %.*s %s", (int) username.len, username.p, f_domain,
+           (int) response.len, response.p, expected_response));
+      return mg_ncasecmp(response.p, expected_response, response.len) == 0;
+    }
+  }
+
+  /* None of the entries in the passwords file matched - return failure */
+  return 0;
+}
+
+int mg_http_is_authorized(struct http_message *hm, struct mg_str path,
+                          const char *domain, const char *passwords_file,
+                          int flags) {
+  char buf[MG_MAX_PATH];
+  const char *p;
+  FILE *fp;
+  int authorized = 1;
+
+  if (domain != NULL && passwords_file != NULL) {
+    if (flags & MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE) {
+      fp = mg_fopen(passwords_file, "r");
+    } else if (flags & MG_AUTH_FLAG_IS_DIRECTORY) {
+      snprintf(buf, sizeof(buf), "%.*s%c%s", (int) path.len, path.p, DIRSEP,
+               passwords_file);
+      fp = mg_fopen(buf, "r");
+    } else {
+      p = strrchr(path.p, DIRSEP);
+      if (p == NULL) p = path.p;
+      snprintf(buf, sizeof(buf), "%.*s%c%s", (int) (p - path.p), path.p, DIRSEP,
+               passwords_file);
+      fp = mg_fopen(buf, "r");
+    }
+
+    if (fp != NULL) {
+      authorized = mg_http_check_digest_auth(hm, domain, fp);
+      fclose(fp);
+    } else if (!(flags & MG_AUTH_FLAG_ALLOW_MISSING_FILE)) {
+      authorized = 0;
+    }
+  }
+
+  LOG(LL_DEBUG, ("%.*s %s %x %d", (int) path.len, path.p,
+                 passwords_file ? passwords_file : "", flags, authorized));
+  return authorized;
+}
+#else
+int mg_http_is_authorized(struct http_message *hm, const struct mg_str path,
+                          const char *domain, const char *passwords_file,
+                          int flags) {
+  (void) hm;
+  (void) path;
+  (void) domain;
+  (void) passwords_file;
+  (void) flags;
+  return 1;
+}
+#endif
+
+#if MG_ENABLE_DIRECTORY_LISTING
+static void mg_escape(const char *src, char *dst, size_t dst_len) {
+  size_t n = 0;
+  while (*src != '\0' && n + 5 < dst_len) {
+    unsigned char ch = *(unsigned char *) src++;
+    if (ch == '<') {
+      n += snprintf(dst + n, dst_len - n, "%s", "&lt;");
+    } else {
+      dst[n++] = ch;
+    }
+  }
+  dst[n] = '\0';
+}
+
+static void mg_print_dir_entry(struct mg_connection *nc, const char *file_name,
+                               cs_stat_t *stp) {
+  char size[64], mod[64], path[MG_MAX_PATH];
+  int64_t fsize = stp->st_size;
+  int is_dir = S_ISDIR(stp->st_mode);
+  const char *slash = is_dir ? "/" : "";
+  struct mg_str href;
+
+  if (is_dir) {
+    snprintf(size, sizeof(size), "%s", "[DIRECTORY]");
+  } else {
+    /*
+     * We use (double) cast below because MSVC 6 compiler cannot
+     * convert unsigned __int64 to double.
+     */
+    if (fsize < 1024) {
+      snprintf(size, sizeof(size), "%d", (int) fsize);
+    } else if (fsize < 0x100000) {
+      snprintf(size, sizeof(size), "%.1fk", (double) fsize / 1024.0);
+    } else if (fsize < 0x40000000) {
+      snprintf(size, sizeof(size), "%.1fM", (double) fsize / 1048576);
+    } else {
+      snprintf(size, sizeof(size), "%.1fG", (double) fsize / 1073741824);
+    }
+  }
+  strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", localtime(&stp->st_mtime));
+  mg_escape(file_name, path, sizeof(path));
+  href = mg_url_encode(mg_mk_str(file_name));
+  mg_printf_http_chunk(nc,
+                       "<tr><td><a href=\"%s%s\">%s%s</a></td>"
+                       "<td>%s</td><td name=%" INT64_FMT ">%s</td></tr>\n",
+                       href.p, slash, path, slash, mod, is_dir ? -1 : fsize,
+                       size);
+  free((void *) href.p);
+}
+
+static void mg_scan_directory(struct mg_connection *nc, const char *dir,
+                              const struct mg_serve_http_opts *opts,
+                              void (*func)(struct mg_connection *, const char *,
+                                           cs_stat_t *)) {
+  char path[MG_MAX_PATH];
+  cs_stat_t st;
+  struct dirent *dp;
+  DIR *dirp;
+
+  LOG(LL_DEBUG, ("%p [%s]", nc, dir));
+  if ((dirp = (opendir(dir))) != NULL) {
+    while ((dp = readdir(dirp)) != NULL) {
+      /* Do not show current dir and hidden files */
+      if (mg_is_file_hidden((const char *) dp->d_name, opts, 1)) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+      if (mg_stat(path, &st) == 0) {
+        func(nc, (const char *) dp->d_name, &st);
+      }
+    }
+    closedir(dirp);
+  } else {
+    LOG(LL_DEBUG, ("%p opendir(%s) -> %d", nc, dir, mg_get_errno()));
+  }
+}
+
+static void mg_send_directory_listing(struct mg_connection *nc, const char *dir,
+                                      struct http_message *hm,
+                                      struct mg_serve_http_opts *opts) {
+  static const char *sort_js_code =
+      "<script>function srt(tb, sc, so, d) {"
+      "var tr = Array.prototype.slice.call(tb.rows, 0),"
+      "tr = tr.sort(function (a, b) { var c1 = a.cells[sc], c2 = b.cells[sc],"
+      "n1 = c1.getAttribute('name'), n2 = c2.getAttribute('name'), "
+      "t1 = a.cells[2].getAttribute('name'), "
+      "t2 = b.cells[2].getAttribute('name'); "
+      "return so * (t1 < 0 && t2 >= 0 ? -1 : t2 < 0 && t1 >= 0 ? 1 : "
+      "n1 ? parseInt(n2) - parseInt(n1) : "
+      "c1.textContent.trim().localeCompare(c2.textContent.trim())); });";
+  static const char *sort_js_code2 =
+      "for (var i = 0; i < tr.length; i++) tb.appendChild(tr[i]); "
+      "if (!d) window.location.hash = ('sc=' + sc + '&so=' + so); "
+      "};"
+      "window.onload = function() {"
+      "var tb = document.getElementById('tb');"
+      "var m = /sc=([012]).so=(1|-1)/.exec(window.location.hash) || [0, 2, 1];"
+      "var sc = m[1], so = m[2]; document.onclick = function(ev) { "
+      "var c = ev.target.rel; if (c) {if (c == sc) so *= -1; srt(tb, c, so); "
+      "sc = c; ev.preventDefault();}};"
+      "srt(tb, sc, so, true);"
+      "}"
+      "</script>";
+
+  mg_send_response_line(nc, 200, opts->extra_headers);
+  mg_printf(nc, "%s: %s\r\n%s: %s\r\n\r\n", "Transfer-Encoding", "chunked",
+            "Content-Type", "text/html; charset=utf-8");
+
+  mg_printf_http_chunk(
+      nc,
+      "<html><head><title>Index of %.*s</title>%s%s"
+      "<style>th,td {text-align: left; padding-right: 1em; "
+      "font-family: monospace; }</style></head>\n"
+      "<body><h1>Index of %.*s</h1>\n<table cellpadding=0><thead>"
+      "<tr><th><a href=# rel=0>Name</a></th><th>"
+      "<a href=# rel=1>Modified</a</th>"
+      "<th><a href=# rel=2>Size</a></th></tr>"
+      "<tr><td colspan=3><hr></td></tr>\n"
+      "</thead>\n"
+      "<tbody id=tb>",
+      (int) hm->uri.len, hm->uri.p, sort_js_code, sort_js_code2,
+      (int) hm->uri.len, hm->uri.p);
+  mg_scan_directory(nc, dir, opts, mg_print_dir_entry);
+  mg_printf_http_chunk(nc,
+                       "</tbody><tr><td colspan=3><hr></td></tr>\n"
+                       "</table>\n"
+                       "<address>%s</address>\n"
+                       "</body></html>",
+                       mg_version_header);
+  mg_send_http_chunk(nc, "", 0);
+  /* TODO(rojer): Remove when cesanta/dev/issues/197 is fixed. */
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+#endif /* MG_ENABLE_DIRECTORY_LISTING */
+
+/*
+ * Given a directory path, find one of the files specified in the
+ * comma-separated list of index files `list`.
+ * First found index file wins. If an index file is found, then gets
+ * appended to the `path`, stat-ed, and result of `stat()` passed to `stp`.
+ * If index file is not found, then `path` and `stp` remain unchanged.
+ */
+MG_INTERNAL void mg_find_index_file(const char *path, const char *list,
+                                    char **index_file, cs_stat_t *stp) {
+  struct mg_str vec;
+  size_t path_len = strlen(path);
+  int found = 0;
+  *index_file = NULL;
+
+  /* Traverse index files list. For each entry, append it to the given */
+  /* path and see if the file exists. If it exists, break the loop */
+  while ((list = mg_next_comma_list_entry(list, &vec, NULL)) != NULL) {
+    cs_stat_t st;
+    size_t len = path_len + 1 + vec.len + 1;
+    *index_file = (char *) MG_REALLOC(*index_file, len);
+    if (*index_file == NULL) break;
+    snprintf(*index_file, len, "%s%c%.*s", path, DIRSEP, (int) vec.len, vec.p);
+
+    /* Does it exist? Is it a file? */
+    if (mg_stat(*index_file, &st) == 0 && S_ISREG(st.st_mode)) {
+      /* Yes it does, break the loop */
+      *stp = st;
+      found = 1;
+      break;
+    }
+  }
+  if (!found) {
+    MG_FREE(*index_file);
+    *index_file = NULL;
+  }
+  LOG(LL_DEBUG, ("[%s] [%s]", path, (*index_file ? *index_file : "")));
+}
+
+#if MG_ENABLE_HTTP_URL_REWRITES
+static int mg_http_send_port_based_redirect(
+    struct mg_connection *c, struct http_message *hm,
+    const struct mg_serve_http_opts *opts) {
+  const char *rewrites = opts->url_rewrites;
+  struct mg_str a, b;
+  char local_port[20] = {'%'};
+
+  mg_conn_addr_to_str(c, local_port + 1, sizeof(local_port) - 1,
+                      MG_SOCK_STRINGIFY_PORT);
+
+  while ((rewrites = mg_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
+    if (mg_vcmp(&a, local_port) == 0) {
+      mg_send_response_line(c, 301, NULL);
+      mg_printf(c, "Content-Length: 0\r\nLocation: %.*s%.*s\r\n\r\n",
+                (int) b.len, b.p, (int) (hm->proto.p - hm->uri.p - 1),
+                hm->uri.p);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void mg_reverse_proxy_handler(struct mg_connection *nc, int ev,
+                                     void *ev_data MG_UD_ARG(void *user_data)) {
+  struct http_message *hm = (struct http_message *) ev_data;
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+
+  if (pd == NULL || pd->reverse_proxy_data.linked_conn == NULL) {
+    DBG(("%p: upstream closed", nc));
+    return;
+  }
+
+  switch (ev) {
+    case MG_EV_CONNECT:
+      if (*(int *) ev_data != 0) {
+        mg_http_send_error(pd->reverse_proxy_data.linked_conn, 502, NULL);
+      }
+      break;
+    /* TODO(mkm): handle streaming */
+    case MG_EV_HTTP_REPLY:
+      mg_send(pd->reverse_proxy_data.linked_conn, hm->message.p,
+              hm->message.len);
+      pd->reverse_proxy_data.linked_conn->flags |= MG_F_SEND_AND_CLOSE;
+      mg_mark_closing(pd->reverse_proxy_data.linked_conn);
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      break;
+    case MG_EV_CLOSE:
+      pd->reverse_proxy_data.linked_conn->flags |= MG_F_SEND_AND_CLOSE;
+      mg_mark_closing(pd->reverse_proxy_data.linked_conn);
+      break;
+  }
+
+#if MG_ENABLE_CALLBACK_USERDATA
+  (void) user_data;
+#endif
+}
+
+void mg_http_reverse_proxy(struct mg_connection *nc,
+                           const struct http_message *hm, struct mg_str mount,
+                           struct mg_str upstream) {
+  struct mg_connection *be;
+  char burl[256], *purl = burl;
+  int i;
+  const char *error;
+  struct mg_connect_opts opts;
+  struct mg_str path = MG_NULL_STR, user_info = MG_NULL_STR, host = MG_NULL_STR;
+  memset(&opts, 0, sizeof(opts));
+  opts.error_string = &error;
+
+  mg_asprintf(&purl, sizeof(burl), "%.*s%.*s", (int) upstream.len, upstream.p,
+              (int) (hm->uri.len - mount.len), hm->uri.p + mount.len);
+
+  be = mg_connect_http_base(nc->mgr, MG_CB(mg_reverse_proxy_handler, NULL),
+                            opts, "http", NULL, "https", NULL, purl, &path,
+                            &user_info, &host);
+  LOG(LL_DEBUG, ("Proxying %.*s to %s (rule: %.*s)", (int) hm->uri.len,
+                 hm->uri.p, purl, (int) mount.len, mount.p));
+
+  if (be == NULL) {
+    LOG(LL_ERROR, ("Error connecting to %s: %s", purl, error));
+    mg_http_send_error(nc, 502, NULL);
+    goto cleanup;
+  }
+
+  /* link connections to each other, they must live and die together */
+  mg_http_get_proto_data(be)->reverse_proxy_data.linked_conn = nc;
+  mg_http_get_proto_data(nc)->reverse_proxy_data.linked_conn = be;
+
+  /* send request upstream */
+  mg_printf(be, "%.*s %.*s HTTP/1.1\r\n", (int) hm->method.len, hm->method.p,
+            (int) path.len, path.p);
+
+  mg_printf(be, "Host: %.*s\r\n", (int) host.len, host.p);
+  for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->header_names[i].len > 0; i++) {
+    struct mg_str hn = hm->header_names[i];
+    struct mg_str hv = hm->header_values[i];
+
+    /* we rewrite the host header */
+    if (mg_vcasecmp(&hn, "Host") == 0) continue;
+    /*
+     * Don't pass chunked transfer encoding to the client because hm->body is
+     * already dechunked when we arrive here.
+     */
+    if (mg_vcasecmp(&hn, "Transfer-encoding") == 0 &&
+        mg_vcasecmp(&hv, "chunked") == 0) {
+      mg_printf(be, "Content-Length: %" SIZE_T_FMT "\r\n", hm->body.len);
+      continue;
+    }
+    /* We don't support proxying Expect: 100-continue. */
+    if (mg_vcasecmp(&hn, "Expect") == 0 &&
+        mg_vcasecmp(&hv, "100-continue") == 0) {
+      continue;
+    }
+
+    mg_printf(be, "%.*s: %.*s\r\n", (int) hn.len, hn.p, (int) hv.len, hv.p);
+  }
+
+  mg_send(be, "\r\n", 2);
+  mg_send(be, hm->body.p, hm->body.len);
+
+cleanup:
+  if (purl != burl) MG_FREE(purl);
+}
+
+static int mg_http_handle_forwarding(struct mg_connection *nc,
+                                     struct http_message *hm,
+                                     const struct mg_serve_http_opts *opts) {
+  const char *rewrites = opts->url_rewrites;
+  struct mg_str a, b;
+  struct mg_str p1 = MG_MK_STR("http://"), p2 = MG_MK_STR("https://");
+
+  while ((rewrites = mg_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
+    if (mg_strncmp(a, hm->uri, a.len) == 0) {
+      if (mg_strncmp(b, p1, p1.len) == 0 || mg_strncmp(b, p2, p2.len) == 0) {
+        mg_http_reverse_proxy(nc, hm, a, b);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+#endif /* MG_ENABLE_FILESYSTEM */
+
+MG_INTERNAL int mg_uri_to_local_path(struct http_message *hm,
+                                     const struct mg_serve_http_opts *opts,
+                                     char **local_path,
+                                     struct mg_str *remainder) {
+  int ok = 1;
+  const char *cp = hm->uri.p, *cp_end = hm->uri.p + hm->uri.len;
+  struct mg_str root = {NULL, 0};
+  const char *file_uri_start = cp;
+  *local_path = NULL;
+  remainder->p = NULL;
+  remainder->len = 0;
+
+  { /* 1. Determine which root to use. */
+
+#if MG_ENABLE_HTTP_URL_REWRITES
+    const char *rewrites = opts->url_rewrites;
+#else
+    const char *rewrites = "";
+#endif
+    struct mg_str *hh = mg_get_http_header(hm, "Host");
+    struct mg_str a, b;
+    /* Check rewrites first. */
+    while ((rewrites = mg_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
+      if (a.len > 1 && a.p[0] == '@') {
+        /* Host rewrite. */
+        if (hh != NULL && hh->len == a.len - 1 &&
+            mg_ncasecmp(a.p + 1, hh->p, a.len - 1) == 0) {
+          root = b;
+          break;
+        }
+      } else {
+        /* Regular rewrite, URI=directory */
+        size_t match_len = mg_match_prefix_n(a, hm->uri);
+        if (match_len > 0) {
+          file_uri_start = hm->uri.p + match_len;
+          if (*file_uri_start == '/' || file_uri_start == cp_end) {
+            /* Match ended at component boundary, ok. */
+          } else if (*(file_uri_start - 1) == '/') {
+            /* Pattern ends with '/', backtrack. */
+            file_uri_start--;
+          } else {
+            /* No match: must fall on the component boundary. */
+            continue;
+          }
+          root = b;
+          break;
+        }
+      }
+    }
+    /* If no rewrite rules matched, use DAV or regular document root. */
+    if (root.p == NULL) {
+#if MG_ENABLE_HTTP_WEBDAV
+      if (opts->dav_document_root != NULL && mg_is_dav_request(&hm->method)) {
+        root.p = opts->dav_document_root;
+        root.len = strlen(opts->dav_document_root);
+      } else
+#endif
+      {
+        root.p = opts->document_root;
+        root.len = strlen(opts->document_root);
+      }
+    }
+    assert(root.p != NULL && root.len > 0);
+  }
+
+  { /* 2. Find where in the canonical URI path the local path ends. */
+    const char *u = file_uri_start + 1;
+    char *lp = (char *) MG_MALLOC(root.len + hm->uri.len + 1);
+    char *lp_end = lp + root.len + hm->uri.len + 1;
+    char *p = lp, *ps;
+    int exists = 1;
+    if (lp == NULL) {
+      ok = 0;
+      goto out;
+    }
+    memcpy(p, root.p, root.len);
+    p += root.len;
+    if (*(p - 1) == DIRSEP) p--;
+    *p = '\0';
+    ps = p;
+
+    /* Chop off URI path components one by one and build local path. */
+    while (u <= cp_end) {
+      const char *next = u;
+      struct mg_str component;
+      if (exists) {
+        cs_stat_t st;
+        exists = (mg_stat(lp, &st) == 0);
+        if (exists && S_ISREG(st.st_mode)) {
+          /* We found the terminal, the rest of the URI (if any) is path_info.
+           */
+          if (*(u - 1) == '/') u--;
+          break;
+        }
+      }
+      if (u >= cp_end) break;
+      parse_uri_component((const char **) &next, cp_end, "/", &component);
+      if (component.len > 0) {
+        int len;
+        memmove(p + 1, component.p, component.len);
+        len = mg_url_decode(p + 1, component.len, p + 1, lp_end - p - 1, 0);
+        if (len <= 0) {
+          ok = 0;
+          break;
+        }
+        component.p = p + 1;
+        component.len = len;
+        if (mg_vcmp(&component, ".") == 0) {
+          /* Yum. */
+        } else if (mg_vcmp(&component, "..") == 0) {
+          while (p > ps && *p != DIRSEP) p--;
+          *p = '\0';
+        } else {
+          size_t i;
+#ifdef _WIN32
+          /* On Windows, make sure it's valid Unicode (no funny stuff). */
+          wchar_t buf[MG_MAX_PATH * 2];
+          if (to_wchar(component.p, buf, MG_MAX_PATH) == 0) {
+            DBG(("[%.*s] smells funny", (int) component.len, component.p));
+            ok = 0;
+            break;
+          }
+#endif
+          *p++ = DIRSEP;
+          /* No NULs and DIRSEPs in the component (percent-encoded). */
+          for (i = 0; i < component.len; i++, p++) {
+            if (*p == '\0' || *p == DIRSEP
+#ifdef _WIN32
+                /* On Windows, "/" is also accepted, so check for that too. */
+                ||
+                *p == '/'
+#endif
+                ) {
+              ok = 0;
+              break;
+            }
+          }
+        }
+      }
+      u = next;
+    }
+    if (ok) {
+      *local_path = lp;
+      if (u > cp_end) u = cp_end;
+      remainder->p = u;
+      remainder->len = cp_end - u;
+    } else {
+      MG_FREE(lp);
+    }
   }
-}
 
-void mg_send_response_line_s(struct mg_connection *nc, int status_code,
-                             const struct mg_str extra_headers) {
-  mg_printf(nc, "HTTP/1.1 %d %s\r\nServer: %s\r\n", status_code,
-            mg_status_message(status_code), mg_version_header);
-  if (extra_headers.len > 0) {
-    mg_printf(nc, "%.*s\r\n", (int) extra_headers.len, extra_headers.p);
-  }
+out:
+  LOG(LL_DEBUG,
+      ("'%.*s' -> '%s' + '%.*s'", (int) hm->uri.len, hm->uri.p,
+       *local_path ? *local_path : "", (int) remainder->len, remainder->p));
+  return ok;
 }
 
-void mg_send_response_line(struct mg_connection *nc, int status_code,
-                           const char *extra_headers) {
-  mg_send_response_line_s(nc, status_code, mg_mk_str(extra_headers));
-}
+static int mg_get_month_index(const char *s) {
+  static const char *month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  size_t i;
 
-void mg_http_send_redirect(struct mg_connection *nc, int status_code,
-                           const struct mg_str location,
-                           const struct mg_str extra_headers) {
-  char bbody[100], *pbody = bbody;
-  int bl = mg_asprintf(&pbody, sizeof(bbody),
-                       "<p>Moved <a href='%.*s'>here</a>.\r\n",
-                       (int) location.len, location.p);
-  char bhead[150], *phead = bhead;
-  mg_asprintf(&phead, sizeof(bhead),
-              "Location: %.*s\r\n"
-              "Content-Type: text/html\r\n"
-              "Content-Length: %d\r\n"
-              "Cache-Control: no-cache\r\n"
-              "%.*s%s",
-              (int) location.len, location.p, bl, (int) extra_headers.len,
-              extra_headers.p, (extra_headers.len > 0 ? "\r\n" : ""));
-  mg_send_response_line(nc, status_code, phead);
-  if (phead != bhead) MG_FREE(phead);
-  mg_send(nc, pbody, bl);
-  if (pbody != bbody) MG_FREE(pbody);
-}
+  for (i = 0; i < ARRAY_SIZE(month_names); i++)
+    if (!strcmp(s, month_names[i])) return (int) i;
 
-void mg_send_head(struct mg_connection *c, int status_code,
-                  int64_t content_length, const char *extra_headers) {
-  mg_send_response_line(c, status_code, extra_headers);
-  if (content_length < 0) {
-    mg_printf(c, "%s", "Transfer-Encoding: chunked\r\n");
-  } else {
-    mg_printf(c, "Content-Length: %" INT64_FMT "\r\n", content_length);
-  }
-  mg_send(c, "\r\n", 2);
+  return -1;
 }
 
-void mg_http_send_error(struct mg_connection *nc, int code,
-                        const char *reason) {
-  if (!reason) reason = mg_status_message(code);
-  LOG(LL_DEBUG, ("%p %d %s", nc, code, reason));
-  mg_send_head(nc, code, strlen(reason),
-               "Content-Type: text/plain\r\nConnection: close");
-  mg_send(nc, reason, strlen(reason));
-  nc->flags |= MG_F_SEND_AND_CLOSE;
+static int mg_num_leap_years(int year) {
+  return year / 4 - year / 100 + year / 400;
 }
 
-#if MG_ENABLE_FILESYSTEM
-static void mg_http_construct_etag(char *buf, size_t buf_len,
-                                   const cs_stat_t *st) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"", (unsigned long) st->st_mtime,
-           (int64_t) st->st_size);
-}
+/* Parse UTC date-time string, and return the corresponding time_t value. */
+MG_INTERNAL time_t mg_parse_date_string(const char *datetime) {
+  static const unsigned short days_before_month[] = {
+      0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  char month_str[32];
+  int second, minute, hour, day, month, year, leap_days, days;
+  time_t result = (time_t) 0;
 
-#ifndef WINCE
-static void mg_gmt_time_string(char *buf, size_t buf_len, time_t *t) {
-  strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
-}
-#else
-/* Look wince_lib.c for WindowsCE implementation */
-static void mg_gmt_time_string(char *buf, size_t buf_len, time_t *t);
-#endif
+  if (((sscanf(datetime, "%d/%3s/%d %d:%d:%d", &day, month_str, &year, &hour,
+               &minute, &second) == 6) ||
+       (sscanf(datetime, "%d %3s %d %d:%d:%d", &day, month_str, &year, &hour,
+               &minute, &second) == 6) ||
+       (sscanf(datetime, "%*3s, %d %3s %d %d:%d:%d", &day, month_str, &year,
+               &hour, &minute, &second) == 6) ||
+       (sscanf(datetime, "%d-%3s-%d %d:%d:%d", &day, month_str, &year, &hour,
+               &minute, &second) == 6)) &&
+      year > 1970 && (month = mg_get_month_index(month_str)) != -1) {
+    leap_days = mg_num_leap_years(year) - mg_num_leap_years(1970);
+    year -= 1970;
+    days = year * 365 + days_before_month[month] + (day - 1) + leap_days;
+    result = days * 24 * 3600 + hour * 3600 + minute * 60 + second;
+  }
 
-static int mg_http_parse_range_header(const struct mg_str *header, int64_t *a,
-                                      int64_t *b) {
-  /*
-   * There is no snscanf. Headers are not guaranteed to be NUL-terminated,
-   * so we have this. Ugh.
-   */
-  int result;
-  char *p = (char *) MG_MALLOC(header->len + 1);
-  if (p == NULL) return 0;
-  memcpy(p, header->p, header->len);
-  p[header->len] = '\0';
-  result = sscanf(p, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
-  MG_FREE(p);
   return result;
 }
 
-void mg_http_serve_file(struct mg_connection *nc, struct http_message *hm,
-                        const char *path, const struct mg_str mime_type,
-                        const struct mg_str extra_headers) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  cs_stat_t st;
-  LOG(LL_DEBUG, ("%p [%s] %.*s", nc, path, (int) mime_type.len, mime_type.p));
-  if (mg_stat(path, &st) != 0 || (pd->file.fp = mg_fopen(path, "rb")) == NULL) {
-    int code, err = mg_get_errno();
-    switch (err) {
-      case EACCES:
-        code = 403;
-        break;
-      case ENOENT:
-        code = 404;
-        break;
-      default:
-        code = 500;
-    };
-    mg_http_send_error(nc, code, "Open failed");
-  } else {
-    char etag[50], current_time[50], last_modified[50], range[70];
-    time_t t = (time_t) mg_time();
-    int64_t r1 = 0, r2 = 0, cl = st.st_size;
-    struct mg_str *range_hdr = mg_get_http_header(hm, "Range");
-    int n, status_code = 200;
-
-    /* Handle Range header */
-    range[0] = '\0';
-    if (range_hdr != NULL &&
-        (n = mg_http_parse_range_header(range_hdr, &r1, &r2)) > 0 && r1 >= 0 &&
-        r2 >= 0) {
-      /* If range is specified like "400-", set second limit to content len */
-      if (n == 1) {
-        r2 = cl - 1;
-      }
-      if (r1 > r2 || r2 >= cl) {
-        status_code = 416;
-        cl = 0;
-        snprintf(range, sizeof(range),
-                 "Content-Range: bytes */%" INT64_FMT "\r\n",
-                 (int64_t) st.st_size);
-      } else {
-        status_code = 206;
-        cl = r2 - r1 + 1;
-        snprintf(range, sizeof(range), "Content-Range: bytes %" INT64_FMT
-                                       "-%" INT64_FMT "/%" INT64_FMT "\r\n",
-                 r1, r1 + cl - 1, (int64_t) st.st_size);
-#if _FILE_OFFSET_BITS == 64 || _POSIX_C_SOURCE >= 200112L || \
-    _XOPEN_SOURCE >= 600
-        fseeko(pd->file.fp, r1, SEEK_SET);
-#else
-        fseek(pd->file.fp, (long) r1, SEEK_SET);
-#endif
-      }
-    }
-
-#if !MG_DISABLE_HTTP_KEEP_ALIVE
-    {
-      struct mg_str *conn_hdr = mg_get_http_header(hm, "Connection");
-      if (conn_hdr != NULL) {
-        pd->file.keepalive = (mg_vcasecmp(conn_hdr, "keep-alive") == 0);
-      } else {
-        pd->file.keepalive = (mg_vcmp(&hm->proto, "HTTP/1.1") == 0);
-      }
+MG_INTERNAL int mg_is_not_modified(struct http_message *hm, cs_stat_t *st) {
+  struct mg_str *hdr;
+  if ((hdr = mg_get_http_header(hm, "If-None-Match")) != NULL) {
+    char etag[64];
+    struct mg_str tag = *hdr;
+    mg_http_construct_etag(etag, sizeof(etag), st);
+    /* Weak comparison, RFC 7232 3.2 */
+    if (tag.len > 2 && memcmp(tag.p, "W/", 2) == 0) {
+      tag.p += 2;
+      tag.len -= 2;
     }
-#endif
-
-    mg_http_construct_etag(etag, sizeof(etag), &st);
-    mg_gmt_time_string(current_time, sizeof(current_time), &t);
-    mg_gmt_time_string(last_modified, sizeof(last_modified), &st.st_mtime);
-    /*
-     * Content length casted to size_t because:
-     * 1) that's the maximum buffer size anyway
-     * 2) ESP8266 RTOS SDK newlib vprintf cannot contain a 64bit arg at non-last
-     *    position
-     * TODO(mkm): fix ESP8266 RTOS SDK
-     */
-    mg_send_response_line_s(nc, status_code, extra_headers);
-    mg_printf(nc,
-              "Date: %s\r\n"
-              "Last-Modified: %s\r\n"
-              "Accept-Ranges: bytes\r\n"
-              "Content-Type: %.*s\r\n"
-              "Connection: %s\r\n"
-              "Content-Length: %" SIZE_T_FMT
-              "\r\n"
-              "%sEtag: %s\r\n\r\n",
-              current_time, last_modified, (int) mime_type.len, mime_type.p,
-              (pd->file.keepalive ? "keep-alive" : "close"), (size_t) cl, range,
-              etag);
-
-    pd->file.cl = cl;
-    pd->file.type = DATA_FILE;
-    mg_http_transfer_file_data(nc);
+    return mg_vcasecmp(&tag, etag) == 0;
+  } else if ((hdr = mg_get_http_header(hm, "If-Modified-Since")) != NULL) {
+    return st->st_mtime <= mg_parse_date_string(hdr->p);
+  } else {
+    return 0;
   }
 }
 
-static void mg_http_serve_file2(struct mg_connection *nc, const char *path,
-                                struct http_message *hm,
-                                struct mg_serve_http_opts *opts) {
-#if MG_ENABLE_HTTP_SSI
-  if (mg_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern), path) > 0) {
-    mg_handle_ssi_request(nc, hm, path, opts);
-    return;
-  }
+void mg_http_send_digest_auth_request(struct mg_connection *c,
+                                      const char *domain) {
+  mg_printf(c,
+            "HTTP/1.1 401 Unauthorized\r\n"
+            "WWW-Authenticate: Digest qop=\"auth\", "
+            "realm=\"%s\", nonce=\"%lx\"\r\n"
+            "Content-Length: 0\r\n\r\n",
+            domain, (unsigned long) mg_time());
+}
+
+static void mg_http_send_options(struct mg_connection *nc) {
+  mg_printf(nc, "%s",
+            "HTTP/1.1 200 OK\r\nAllow: GET, POST, HEAD, CONNECT, OPTIONS"
+#if MG_ENABLE_HTTP_WEBDAV
+            ", MKCOL, PUT, DELETE, PROPFIND, MOVE\r\nDAV: 1,2"
 #endif
-  mg_http_serve_file(nc, hm, path, mg_get_mime_type(path, "text/plain", opts),
-                     mg_mk_str(opts->extra_headers));
+            "\r\n\r\n");
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+static int mg_is_creation_request(const struct http_message *hm) {
+  return mg_vcmp(&hm->method, "MKCOL") == 0 || mg_vcmp(&hm->method, "PUT") == 0;
 }
 
+MG_INTERNAL void mg_send_http_file(struct mg_connection *nc, char *path,
+                                   const struct mg_str *path_info,
+                                   struct http_message *hm,
+                                   struct mg_serve_http_opts *opts) {
+  int exists, is_directory, is_cgi;
+#if MG_ENABLE_HTTP_WEBDAV
+  int is_dav = mg_is_dav_request(&hm->method);
+#else
+  int is_dav = 0;
 #endif
+  char *index_file = NULL;
+  cs_stat_t st;
 
-int mg_url_decode(const char *src, int src_len, char *dst, int dst_len,
-                  int is_form_url_encoded) {
-  int i, j, a, b;
-#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
+  exists = (mg_stat(path, &st) == 0);
+  is_directory = exists && S_ISDIR(st.st_mode);
 
-  for (i = j = 0; i < src_len && j < dst_len - 1; i++, j++) {
-    if (src[i] == '%') {
-      if (i < src_len - 2 && isxdigit(*(const unsigned char *) (src + i + 1)) &&
-          isxdigit(*(const unsigned char *) (src + i + 2))) {
-        a = tolower(*(const unsigned char *) (src + i + 1));
-        b = tolower(*(const unsigned char *) (src + i + 2));
-        dst[j] = (char) ((HEXTOI(a) << 4) | HEXTOI(b));
-        i += 2;
-      } else {
-        return -1;
-      }
-    } else if (is_form_url_encoded && src[i] == '+') {
-      dst[j] = ' ';
-    } else {
-      dst[j] = src[i];
-    }
-  }
+  if (is_directory)
+    mg_find_index_file(path, opts->index_files, &index_file, &st);
 
-  dst[j] = '\0'; /* Null-terminate the destination */
+  is_cgi =
+      (mg_match_prefix(opts->cgi_file_pattern, strlen(opts->cgi_file_pattern),
+                       index_file ? index_file : path) > 0);
 
-  return i >= src_len ? j : -1;
-}
+  LOG(LL_DEBUG,
+      ("%p %.*s [%s] exists=%d is_dir=%d is_dav=%d is_cgi=%d index=%s", nc,
+       (int) hm->method.len, hm->method.p, path, exists, is_directory, is_dav,
+       is_cgi, index_file ? index_file : ""));
 
-int mg_get_http_var(const struct mg_str *buf, const char *name, char *dst,
-                    size_t dst_len) {
-  const char *p, *e, *s;
-  size_t name_len;
-  int len;
+  if (is_directory && hm->uri.p[hm->uri.len - 1] != '/' && !is_dav) {
+    mg_printf(nc,
+              "HTTP/1.1 301 Moved\r\nLocation: %.*s/\r\n"
+              "Content-Length: 0\r\n\r\n",
+              (int) hm->uri.len, hm->uri.p);
+    MG_FREE(index_file);
+    return;
+  }
 
-  /*
-   * According to the documentation function returns negative
-   * value in case of error. For debug purposes it returns:
-   * -1 - src is wrong (NUUL)
-   * -2 - dst is wrong (NULL)
-   * -3 - failed to decode url or dst is to small
-   * -4 - name does not exist
-   */
-  if (dst == NULL || dst_len == 0) {
-    len = -2;
-  } else if (buf->p == NULL || name == NULL || buf->len == 0) {
-    len = -1;
-    dst[0] = '\0';
-  } else {
-    name_len = strlen(name);
-    e = buf->p + buf->len;
-    len = -4;
-    dst[0] = '\0';
+  /* If we have path_info, the only way to handle it is CGI. */
+  if (path_info->len > 0 && !is_cgi) {
+    mg_http_send_error(nc, 501, NULL);
+    MG_FREE(index_file);
+    return;
+  }
 
-    for (p = buf->p; p + name_len < e; p++) {
-      if ((p == buf->p || p[-1] == '&') && p[name_len] == '=' &&
-          !mg_ncasecmp(name, p, name_len)) {
-        p += name_len + 1;
-        s = (const char *) memchr(p, '&', (size_t)(e - p));
-        if (s == NULL) {
-          s = e;
-        }
-        len = mg_url_decode(p, (size_t)(s - p), dst, dst_len, 1);
-        /* -1 means: failed to decode or dst is too small */
-        if (len == -1) {
-          len = -3;
-        }
-        break;
-      }
+  if (is_dav && opts->dav_document_root == NULL) {
+    mg_http_send_error(nc, 501, NULL);
+  } else if (!mg_http_is_authorized(
+                 hm, mg_mk_str(path), opts->auth_domain, opts->global_auth_file,
+                 ((is_directory ? MG_AUTH_FLAG_IS_DIRECTORY : 0) |
+                  MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE |
+                  MG_AUTH_FLAG_ALLOW_MISSING_FILE)) ||
+             !mg_http_is_authorized(
+                 hm, mg_mk_str(path), opts->auth_domain,
+                 opts->per_directory_auth_file,
+                 ((is_directory ? MG_AUTH_FLAG_IS_DIRECTORY : 0) |
+                  MG_AUTH_FLAG_ALLOW_MISSING_FILE))) {
+    mg_http_send_digest_auth_request(nc, opts->auth_domain);
+  } else if (is_cgi) {
+#if MG_ENABLE_HTTP_CGI
+    mg_handle_cgi(nc, index_file ? index_file : path, path_info, hm, opts);
+#else
+    mg_http_send_error(nc, 501, NULL);
+#endif /* MG_ENABLE_HTTP_CGI */
+  } else if ((!exists ||
+              mg_is_file_hidden(path, opts, 0 /* specials are ok */)) &&
+             !mg_is_creation_request(hm)) {
+    mg_http_send_error(nc, 404, NULL);
+#if MG_ENABLE_HTTP_WEBDAV
+  } else if (!mg_vcmp(&hm->method, "PROPFIND")) {
+    mg_handle_propfind(nc, path, &st, hm, opts);
+#if !MG_DISABLE_DAV_AUTH
+  } else if (is_dav &&
+             (opts->dav_auth_file == NULL ||
+              (strcmp(opts->dav_auth_file, "-") != 0 &&
+               !mg_http_is_authorized(
+                   hm, mg_mk_str(path), opts->auth_domain, opts->dav_auth_file,
+                   ((is_directory ? MG_AUTH_FLAG_IS_DIRECTORY : 0) |
+                    MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE |
+                    MG_AUTH_FLAG_ALLOW_MISSING_FILE))))) {
+    mg_http_send_digest_auth_request(nc, opts->auth_domain);
+#endif
+  } else if (!mg_vcmp(&hm->method, "MKCOL")) {
+    mg_handle_mkcol(nc, path, hm);
+  } else if (!mg_vcmp(&hm->method, "DELETE")) {
+    mg_handle_delete(nc, opts, path);
+  } else if (!mg_vcmp(&hm->method, "PUT")) {
+    mg_handle_put(nc, path, hm);
+  } else if (!mg_vcmp(&hm->method, "MOVE")) {
+    mg_handle_move(nc, opts, path, hm);
+#if MG_ENABLE_FAKE_DAVLOCK
+  } else if (!mg_vcmp(&hm->method, "LOCK")) {
+    mg_handle_lock(nc, path);
+#endif
+#endif /* MG_ENABLE_HTTP_WEBDAV */
+  } else if (!mg_vcmp(&hm->method, "OPTIONS")) {
+    mg_http_send_options(nc);
+  } else if (is_directory && index_file == NULL) {
+#if MG_ENABLE_DIRECTORY_LISTING
+    if (strcmp(opts->enable_directory_listing, "yes") == 0) {
+      mg_send_directory_listing(nc, path, hm, opts);
+    } else {
+      mg_http_send_error(nc, 403, NULL);
     }
+#else
+    mg_http_send_error(nc, 501, NULL);
+#endif
+  } else if (mg_is_not_modified(hm, &st)) {
+    mg_http_send_error(nc, 304, "Not Modified");
+  } else {
+    mg_http_serve_file2(nc, index_file ? index_file : path, hm, opts);
   }
-
-  return len;
+  MG_FREE(index_file);
 }
 
-void mg_send_http_chunk(struct mg_connection *nc, const char *buf, size_t len) {
-  char chunk_size[50];
-  int n;
-
-  n = snprintf(chunk_size, sizeof(chunk_size), "%lX\r\n", (unsigned long) len);
-  mg_send(nc, chunk_size, n);
-  mg_send(nc, buf, len);
-  mg_send(nc, "\r\n", 2);
-}
+void mg_serve_http(struct mg_connection *nc, struct http_message *hm,
+                   struct mg_serve_http_opts opts) {
+  char *path = NULL;
+  struct mg_str *hdr, path_info;
+  uint32_t remote_ip = ntohl(*(uint32_t *) &nc->sa.sin.sin_addr);
 
-void mg_printf_http_chunk(struct mg_connection *nc, const char *fmt, ...) {
-  char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
-  int len;
-  va_list ap;
+  if (mg_check_ip_acl(opts.ip_acl, remote_ip) != 1) {
+    /* Not allowed to connect */
+    mg_http_send_error(nc, 403, NULL);
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+    return;
+  }
 
-  va_start(ap, fmt);
-  len = mg_avprintf(&buf, sizeof(mem), fmt, ap);
-  va_end(ap);
+#if MG_ENABLE_HTTP_URL_REWRITES
+  if (mg_http_handle_forwarding(nc, hm, &opts)) {
+    return;
+  }
 
-  if (len >= 0) {
-    mg_send_http_chunk(nc, buf, len);
+  if (mg_http_send_port_based_redirect(nc, hm, &opts)) {
+    return;
   }
+#endif
 
-  /* LCOV_EXCL_START */
-  if (buf != mem && buf != NULL) {
-    MG_FREE(buf);
+  if (opts.document_root == NULL) {
+    opts.document_root = ".";
+  }
+  if (opts.per_directory_auth_file == NULL) {
+    opts.per_directory_auth_file = ".htpasswd";
+  }
+  if (opts.enable_directory_listing == NULL) {
+    opts.enable_directory_listing = "yes";
+  }
+  if (opts.cgi_file_pattern == NULL) {
+    opts.cgi_file_pattern = "**.cgi$|**.php$";
+  }
+  if (opts.ssi_pattern == NULL) {
+    opts.ssi_pattern = "**.shtml$|**.shtm$";
+  }
+  if (opts.index_files == NULL) {
+    opts.index_files = "index.html,index.htm,index.shtml,index.cgi,index.php";
+  }
+  /* Normalize path - resolve "." and ".." (in-place). */
+  if (!mg_normalize_uri_path(&hm->uri, &hm->uri)) {
+    mg_http_send_error(nc, 400, NULL);
+    return;
   }
-  /* LCOV_EXCL_STOP */
-}
-
-void mg_printf_html_escape(struct mg_connection *nc, const char *fmt, ...) {
-  char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
-  int i, j, len;
-  va_list ap;
-
-  va_start(ap, fmt);
-  len = mg_avprintf(&buf, sizeof(mem), fmt, ap);
-  va_end(ap);
-
-  if (len >= 0) {
-    for (i = j = 0; i < len; i++) {
-      if (buf[i] == '<' || buf[i] == '>') {
-        mg_send(nc, buf + j, i - j);
-        mg_send(nc, buf[i] == '<' ? "&lt;" : "&gt;", 4);
-        j = i + 1;
-      }
-    }
-    mg_send(nc, buf + j, i - j);
+  if (mg_uri_to_local_path(hm, &opts, &path, &path_info) == 0) {
+    mg_http_send_error(nc, 404, NULL);
+    return;
   }
+  mg_send_http_file(nc, path, &path_info, hm, &opts);
 
-  /* LCOV_EXCL_START */
-  if (buf != mem && buf != NULL) {
-    MG_FREE(buf);
+  MG_FREE(path);
+  path = NULL;
+
+  /* Close connection for non-keep-alive requests */
+  if (mg_vcmp(&hm->proto, "HTTP/1.1") != 0 ||
+      ((hdr = mg_get_http_header(hm, "Connection")) != NULL &&
+       mg_vcmp(hdr, "keep-alive") != 0)) {
+#if 0
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+#endif
   }
-  /* LCOV_EXCL_STOP */
 }
 
-static void mg_http_parse_header_internal(struct mg_str *hdr,
-                                          const char *var_name,
-                                          struct altbuf *ab) {
-  int ch = ' ', ch1 = ',', n = strlen(var_name);
-  const char *p, *end = hdr ? hdr->p + hdr->len : NULL, *s = NULL;
-
-  /* Find where variable starts */
-  for (s = hdr->p; s != NULL && s + n < end; s++) {
-    if ((s == hdr->p || s[-1] == ch || s[-1] == ch1 || s[-1] == ';') &&
-        s[n] == '=' && !strncmp(s, var_name, n))
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+void mg_file_upload_handler(struct mg_connection *nc, int ev, void *ev_data,
+                            mg_fu_fname_fn local_name_fn
+                                MG_UD_ARG(void *user_data)) {
+  switch (ev) {
+    case MG_EV_HTTP_PART_BEGIN: {
+      struct mg_http_multipart_part *mp =
+          (struct mg_http_multipart_part *) ev_data;
+      struct file_upload_state *fus =
+          (struct file_upload_state *) MG_CALLOC(1, sizeof(*fus));
+      struct mg_str lfn = local_name_fn(nc, mg_mk_str(mp->file_name));
+      mp->user_data = NULL;
+      if (lfn.p == NULL || lfn.len == 0) {
+        LOG(LL_ERROR, ("%p Not allowed to upload %s", nc, mp->file_name));
+        mg_printf(nc,
+                  "HTTP/1.1 403 Not Allowed\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "Connection: close\r\n\r\n"
+                  "Not allowed to upload %s\r\n",
+                  mp->file_name);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+      }
+      fus->lfn = (char *) MG_MALLOC(lfn.len + 1);
+      memcpy(fus->lfn, lfn.p, lfn.len);
+      fus->lfn[lfn.len] = '\0';
+      if (lfn.p != mp->file_name) MG_FREE((char *) lfn.p);
+      LOG(LL_DEBUG,
+          ("%p Receiving file %s -> %s", nc, mp->file_name, fus->lfn));
+      fus->fp = mg_fopen(fus->lfn, "w");
+      if (fus->fp == NULL) {
+        mg_printf(nc,
+                  "HTTP/1.1 500 Internal Server Error\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "Connection: close\r\n\r\n");
+        LOG(LL_ERROR, ("Failed to open %s: %d\n", fus->lfn, mg_get_errno()));
+        mg_printf(nc, "Failed to open %s: %d\n", fus->lfn, mg_get_errno());
+        /* Do not close the connection just yet, discard remainder of the data.
+         * This is because at the time of writing some browsers (Chrome) fail to
+         * render response before all the data is sent. */
+      }
+      mp->user_data = (void *) fus;
       break;
-  }
-
-  if (s != NULL && &s[n + 1] < end) {
-    s += n + 1;
-    if (*s == '"' || *s == '\'') {
-      ch = ch1 = *s++;
     }
-    p = s;
-    while (p < end && p[0] != ch && p[0] != ch1) {
-      if (ch != ' ' && p[0] == '\\' && p[1] == ch) p++;
-      altbuf_append(ab, *p++);
+    case MG_EV_HTTP_PART_DATA: {
+      struct mg_http_multipart_part *mp =
+          (struct mg_http_multipart_part *) ev_data;
+      struct file_upload_state *fus =
+          (struct file_upload_state *) mp->user_data;
+      if (fus == NULL || fus->fp == NULL) break;
+      if (mg_fwrite(mp->data.p, 1, mp->data.len, fus->fp) != mp->data.len) {
+        LOG(LL_ERROR, ("Failed to write to %s: %d, wrote %d", fus->lfn,
+                       mg_get_errno(), (int) fus->num_recd));
+        if (mg_get_errno() == ENOSPC
+#ifdef SPIFFS_ERR_FULL
+            || mg_get_errno() == SPIFFS_ERR_FULL
+#endif
+            ) {
+          mg_printf(nc,
+                    "HTTP/1.1 413 Payload Too Large\r\n"
+                    "Content-Type: text/plain\r\n"
+                    "Connection: close\r\n\r\n");
+          mg_printf(nc, "Failed to write to %s: no space left; wrote %d\r\n",
+                    fus->lfn, (int) fus->num_recd);
+        } else {
+          mg_printf(nc,
+                    "HTTP/1.1 500 Internal Server Error\r\n"
+                    "Content-Type: text/plain\r\n"
+                    "Connection: close\r\n\r\n");
+          mg_printf(nc, "Failed to write to %s: %d, wrote %d", mp->file_name,
+                    mg_get_errno(), (int) fus->num_recd);
+        }
+        fclose(fus->fp);
+        remove(fus->lfn);
+        fus->fp = NULL;
+        /* Do not close the connection just yet, discard remainder of the data.
+         * This is because at the time of writing some browsers (Chrome) fail to
+         * render response before all the data is sent. */
+        return;
+      }
+      fus->num_recd += mp->data.len;
+      LOG(LL_DEBUG, ("%p rec'd %d bytes, %d total", nc, (int) mp->data.len,
+                     (int) fus->num_recd));
+      break;
     }
-
-    if (ch != ' ' && *p != ch) {
-      altbuf_reset(ab);
+    case MG_EV_HTTP_PART_END: {
+      struct mg_http_multipart_part *mp =
+          (struct mg_http_multipart_part *) ev_data;
+      struct file_upload_state *fus =
+          (struct file_upload_state *) mp->user_data;
+      if (fus == NULL) break;
+      if (mp->status >= 0 && fus->fp != NULL) {
+        LOG(LL_DEBUG, ("%p Uploaded %s (%s), %d bytes", nc, mp->file_name,
+                       fus->lfn, (int) fus->num_recd));
+        mg_printf(nc,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "Connection: close\r\n\r\n"
+                  "Ok, %s - %d bytes.\r\n",
+                  mp->file_name, (int) fus->num_recd);
+      } else {
+        LOG(LL_ERROR, ("Failed to store %s (%s)", mp->file_name, fus->lfn));
+        /*
+         * mp->status < 0 means connection was terminated, so no reason to send
+         * HTTP reply
+         */
+      }
+      if (fus->fp != NULL) fclose(fus->fp);
+      MG_FREE(fus->lfn);
+      MG_FREE(fus);
+      mp->user_data = NULL;
+      nc->flags |= MG_F_SEND_AND_CLOSE;
+      break;
     }
   }
 
-  /* If there is some data, append a NUL. */
-  if (ab->len > 0) {
-    altbuf_append(ab, '\0');
-  }
-}
-
-int mg_http_parse_header2(struct mg_str *hdr, const char *var_name, char **buf,
-                          size_t buf_size) {
-  struct altbuf ab;
-  altbuf_init(&ab, *buf, buf_size);
-  if (hdr == NULL) return 0;
-  if (*buf != NULL && buf_size > 0) *buf[0] = '\0';
-
-  mg_http_parse_header_internal(hdr, var_name, &ab);
-
-  /*
-   * Get a (trimmed) buffer, and return a len without a NUL byte which might
-   * have been added.
-   */
-  *buf = altbuf_get_buf(&ab, 1 /* trim */);
-  return ab.len > 0 ? ab.len - 1 : 0;
+#if MG_ENABLE_CALLBACK_USERDATA
+  (void) user_data;
+#endif
 }
 
-int mg_http_parse_header(struct mg_str *hdr, const char *var_name, char *buf,
-                         size_t buf_size) {
-  char *buf2 = buf;
+#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
+#endif /* MG_ENABLE_FILESYSTEM */
 
-  int len = mg_http_parse_header2(hdr, var_name, &buf2, buf_size);
+struct mg_connection *mg_connect_http_base(
+    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
+    struct mg_connect_opts opts, const char *scheme1, const char *scheme2,
+    const char *scheme_ssl1, const char *scheme_ssl2, const char *url,
+    struct mg_str *path, struct mg_str *user_info, struct mg_str *host) {
+  struct mg_connection *nc = NULL;
+  unsigned int port_i = 0;
+  int use_ssl = 0;
+  struct mg_str scheme, query, fragment;
+  char conn_addr_buf[2];
+  char *conn_addr = conn_addr_buf;
 
-  if (buf2 != buf) {
-    /* Buffer was not enough and was reallocated: free it and just return 0 */
-    MG_FREE(buf2);
-    return 0;
+  if (mg_parse_uri(mg_mk_str(url), &scheme, user_info, host, &port_i, path,
+                   &query, &fragment) != 0) {
+    MG_SET_PTRPTR(opts.error_string, "cannot parse url");
+    goto out;
   }
 
-  return len;
-}
-
-int mg_get_http_basic_auth(struct http_message *hm, char *user, size_t user_len,
-                           char *pass, size_t pass_len) {
-  struct mg_str *hdr = mg_get_http_header(hm, "Authorization");
-  if (hdr == NULL) return -1;
-  return mg_parse_http_basic_auth(hdr, user, user_len, pass, pass_len);
-}
-
-int mg_parse_http_basic_auth(struct mg_str *hdr, char *user, size_t user_len,
-                             char *pass, size_t pass_len) {
-  char *buf = NULL;
-  char fmt[64];
-  int res = 0;
-
-  if (mg_strncmp(*hdr, mg_mk_str("Basic "), 6) != 0) return -1;
-
-  buf = (char *) MG_MALLOC(hdr->len);
-  cs_base64_decode((unsigned char *) hdr->p + 6, hdr->len, buf, NULL);
+  /* If query is present, do not strip it. Pass to the caller. */
+  if (query.len > 0) path->len += query.len + 1;
 
-  /* e.g. "%123[^:]:%321[^\n]" */
-  snprintf(fmt, sizeof(fmt), "%%%" SIZE_T_FMT "[^:]:%%%" SIZE_T_FMT "[^\n]",
-           user_len - 1, pass_len - 1);
-  if (sscanf(buf, fmt, user, pass) == 0) {
-    res = -1;
+  if (scheme.len == 0 || mg_vcmp(&scheme, scheme1) == 0 ||
+      (scheme2 != NULL && mg_vcmp(&scheme, scheme2) == 0)) {
+    use_ssl = 0;
+    if (port_i == 0) port_i = 80;
+  } else if (mg_vcmp(&scheme, scheme_ssl1) == 0 ||
+             (scheme2 != NULL && mg_vcmp(&scheme, scheme_ssl2) == 0)) {
+    use_ssl = 1;
+    if (port_i == 0) port_i = 443;
+  } else {
+    goto out;
   }
 
-  MG_FREE(buf);
-  return res;
-}
+  mg_asprintf(&conn_addr, sizeof(conn_addr_buf), "tcp://%.*s:%u",
+              (int) host->len, host->p, port_i);
+  if (conn_addr == NULL) goto out;
 
-#if MG_ENABLE_FILESYSTEM
-static int mg_is_file_hidden(const char *path,
-                             const struct mg_serve_http_opts *opts,
-                             int exclude_specials) {
-  const char *p1 = opts->per_directory_auth_file;
-  const char *p2 = opts->hidden_file_pattern;
+  LOG(LL_DEBUG, ("%s use_ssl? %d %s", url, use_ssl, conn_addr));
+  if (use_ssl) {
+#if MG_ENABLE_SSL
+    /*
+     * Schema requires SSL, but no SSL parameters were provided in opts.
+     * In order to maintain backward compatibility, use a faux-SSL with no
+     * verification.
+     */
+    if (opts.ssl_ca_cert == NULL) {
+      opts.ssl_ca_cert = "*";
+    }
+#else
+    MG_SET_PTRPTR(opts.error_string, "ssl is disabled");
+    goto out;
+#endif
+  }
 
-  /* Strip directory path from the file name */
-  const char *pdir = strrchr(path, DIRSEP);
-  if (pdir != NULL) {
-    path = pdir + 1;
+  if ((nc = mg_connect_opt(mgr, conn_addr, MG_CB(ev_handler, user_data),
+                           opts)) != NULL) {
+    mg_set_protocol_http_websocket(nc);
   }
 
-  return (exclude_specials && (!strcmp(path, ".") || !strcmp(path, ".."))) ||
-         (p1 != NULL && mg_match_prefix(p1, strlen(p1), path) == strlen(p1)) ||
-         (p2 != NULL && mg_match_prefix(p2, strlen(p2), path) > 0);
+out:
+  if (conn_addr != NULL && conn_addr != conn_addr_buf) MG_FREE(conn_addr);
+  return nc;
 }
 
-#if !MG_DISABLE_HTTP_DIGEST_AUTH
+struct mg_connection *mg_connect_http_opt(
+    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
+    struct mg_connect_opts opts, const char *url, const char *extra_headers,
+    const char *post_data) {
+  struct mg_str user = MG_NULL_STR, null_str = MG_NULL_STR;
+  struct mg_str host = MG_NULL_STR, path = MG_NULL_STR;
+  struct mbuf auth;
+  struct mg_connection *nc =
+      mg_connect_http_base(mgr, MG_CB(ev_handler, user_data), opts, "http",
+                           NULL, "https", NULL, url, &path, &user, &host);
 
-#ifndef MG_EXT_MD5
-void mg_hash_md5_v(size_t num_msgs, const uint8_t *msgs[],
-                   const size_t *msg_lens, uint8_t *digest) {
-  size_t i;
-  cs_md5_ctx md5_ctx;
-  cs_md5_init(&md5_ctx);
-  for (i = 0; i < num_msgs; i++) {
-    cs_md5_update(&md5_ctx, msgs[i], msg_lens[i]);
+  if (nc == NULL) {
+    return NULL;
   }
-  cs_md5_final(digest, &md5_ctx);
-}
-#else
-extern void mg_hash_md5_v(size_t num_msgs, const uint8_t *msgs[],
-                          const size_t *msg_lens, uint8_t *digest);
-#endif
-
-void cs_md5(char buf[33], ...) {
-  unsigned char hash[16];
-  const uint8_t *msgs[20], *p;
-  size_t msg_lens[20];
-  size_t num_msgs = 0;
-  va_list ap;
 
-  va_start(ap, buf);
-  while ((p = va_arg(ap, const unsigned char *) ) != NULL) {
-    msgs[num_msgs] = p;
-    msg_lens[num_msgs] = va_arg(ap, size_t);
-    num_msgs++;
+  mbuf_init(&auth, 0);
+  if (user.len > 0) {
+    mg_basic_auth_header(user, null_str, &auth);
   }
-  va_end(ap);
-
-  mg_hash_md5_v(num_msgs, msgs, msg_lens, hash);
-  cs_to_hex(buf, hash, sizeof(hash));
-}
 
-static void mg_mkmd5resp(const char *method, size_t method_len, const char *uri,
-                         size_t uri_len, const char *ha1, size_t ha1_len,
-                         const char *nonce, size_t nonce_len, const char *nc,
-                         size_t nc_len, const char *cnonce, size_t cnonce_len,
-                         const char *qop, size_t qop_len, char *resp) {
-  static const char colon[] = ":";
-  static const size_t one = 1;
-  char ha2[33];
-  cs_md5(ha2, method, method_len, colon, one, uri, uri_len, NULL);
-  cs_md5(resp, ha1, ha1_len, colon, one, nonce, nonce_len, colon, one, nc,
-         nc_len, colon, one, cnonce, cnonce_len, colon, one, qop, qop_len,
-         colon, one, ha2, sizeof(ha2) - 1, NULL);
-}
+  if (post_data == NULL) post_data = "";
+  if (extra_headers == NULL) extra_headers = "";
+  if (path.len == 0) path = mg_mk_str("/");
+  if (host.len == 0) host = mg_mk_str("");
 
-int mg_http_create_digest_auth_header(char *buf, size_t buf_len,
-                                      const char *method, const char *uri,
-                                      const char *auth_domain, const char *user,
-                                      const char *passwd, const char *nonce) {
-  static const char colon[] = ":", qop[] = "auth";
-  static const size_t one = 1;
-  char ha1[33], resp[33], cnonce[40];
+  mg_printf(nc, "%s %.*s HTTP/1.1\r\nHost: %.*s\r\nContent-Length: %" SIZE_T_FMT
+                "\r\n%.*s%s\r\n%s",
+            (post_data[0] == '\0' ? "GET" : "POST"), (int) path.len, path.p,
+            (int) (path.p - host.p), host.p, strlen(post_data), (int) auth.len,
+            (auth.buf == NULL ? "" : auth.buf), extra_headers, post_data);
 
-  snprintf(cnonce, sizeof(cnonce), "%lx", (unsigned long) mg_time());
-  cs_md5(ha1, user, (size_t) strlen(user), colon, one, auth_domain,
-         (size_t) strlen(auth_domain), colon, one, passwd,
-         (size_t) strlen(passwd), NULL);
-  mg_mkmd5resp(method, strlen(method), uri, strlen(uri), ha1, sizeof(ha1) - 1,
-               nonce, strlen(nonce), "1", one, cnonce, strlen(cnonce), qop,
-               sizeof(qop) - 1, resp);
-  return snprintf(buf, buf_len,
-                  "Authorization: Digest username=\"%s\","
-                  "realm=\"%s\",uri=\"%s\",qop=%s,nc=1,cnonce=%s,"
-                  "nonce=%s,response=%s\r\n",
-                  user, auth_domain, uri, qop, cnonce, nonce, resp);
+  mbuf_free(&auth);
+  return nc;
 }
 
-/*
- * Check for authentication timeout.
- * Clients send time stamp encoded in nonce. Make sure it is not too old,
- * to prevent replay attacks.
- * Assumption: nonce is a hexadecimal number of seconds since 1970.
- */
-static int mg_check_nonce(const char *nonce) {
-  unsigned long now = (unsigned long) mg_time();
-  unsigned long val = (unsigned long) strtoul(nonce, NULL, 16);
-  return (now >= val) && (now - val < 60 * 60);
+struct mg_connection *mg_connect_http(
+    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
+    const char *url, const char *extra_headers, const char *post_data) {
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  return mg_connect_http_opt(mgr, MG_CB(ev_handler, user_data), opts, url,
+                             extra_headers, post_data);
 }
 
-int mg_http_check_digest_auth(struct http_message *hm, const char *auth_domain,
-                              FILE *fp) {
-  int ret = 0;
-  struct mg_str *hdr;
-  char username_buf[50], cnonce_buf[64], response_buf[40], uri_buf[200],
-      qop_buf[20], nc_buf[20], nonce_buf[16];
-
-  char *username = username_buf, *cnonce = cnonce_buf, *response = response_buf,
-       *uri = uri_buf, *qop = qop_buf, *nc = nc_buf, *nonce = nonce_buf;
-
-  /* Parse "Authorization:" header, fail fast on parse error */
-  if (hm == NULL || fp == NULL ||
-      (hdr = mg_get_http_header(hm, "Authorization")) == NULL ||
-      mg_http_parse_header2(hdr, "username", &username, sizeof(username_buf)) ==
-          0 ||
-      mg_http_parse_header2(hdr, "cnonce", &cnonce, sizeof(cnonce_buf)) == 0 ||
-      mg_http_parse_header2(hdr, "response", &response, sizeof(response_buf)) ==
-          0 ||
-      mg_http_parse_header2(hdr, "uri", &uri, sizeof(uri_buf)) == 0 ||
-      mg_http_parse_header2(hdr, "qop", &qop, sizeof(qop_buf)) == 0 ||
-      mg_http_parse_header2(hdr, "nc", &nc, sizeof(nc_buf)) == 0 ||
-      mg_http_parse_header2(hdr, "nonce", &nonce, sizeof(nonce_buf)) == 0 ||
-      mg_check_nonce(nonce) == 0) {
-    ret = 0;
-    goto clean;
-  }
-
-  /* NOTE(lsm): due to a bug in MSIE, we do not compare URIs */
-
-  ret = mg_check_digest_auth(
-      hm->method,
-      mg_mk_str_n(
-          hm->uri.p,
-          hm->uri.len + (hm->query_string.len ? hm->query_string.len + 1 : 0)),
-      mg_mk_str(username), mg_mk_str(cnonce), mg_mk_str(response),
-      mg_mk_str(qop), mg_mk_str(nc), mg_mk_str(nonce), mg_mk_str(auth_domain),
-      fp);
-
-clean:
-  if (username != username_buf) MG_FREE(username);
-  if (cnonce != cnonce_buf) MG_FREE(cnonce);
-  if (response != response_buf) MG_FREE(response);
-  if (uri != uri_buf) MG_FREE(uri);
-  if (qop != qop_buf) MG_FREE(qop);
-  if (nc != nc_buf) MG_FREE(nc);
-  if (nonce != nonce_buf) MG_FREE(nonce);
+size_t mg_parse_multipart(const char *buf, size_t buf_len, char *var_name,
+                          size_t var_name_len, char *file_name,
+                          size_t file_name_len, const char **data,
+                          size_t *data_len) {
+  static const char cd[] = "Content-Disposition: ";
+  size_t hl, bl, n, ll, pos, cdl = sizeof(cd) - 1;
+  int shl;
 
-  return ret;
-}
+  if (buf == NULL || buf_len <= 0) return 0;
+  if ((shl = mg_http_get_request_len(buf, buf_len)) <= 0) return 0;
+  hl = shl;
+  if (buf[0] != '-' || buf[1] != '-' || buf[2] == '\n') return 0;
 
-int mg_check_digest_auth(struct mg_str method, struct mg_str uri,
-                         struct mg_str username, struct mg_str cnonce,
-                         struct mg_str response, struct mg_str qop,
-                         struct mg_str nc, struct mg_str nonce,
-                         struct mg_str auth_domain, FILE *fp) {
-  char buf[128], f_user[sizeof(buf)], f_ha1[sizeof(buf)], f_domain[sizeof(buf)];
-  char expected_response[33];
+  /* Get boundary length */
+  bl = mg_get_line_len(buf, buf_len);
 
-  /*
-   * Read passwords file line by line. If should have htdigest format,
-   * i.e. each line should be a colon-separated sequence:
-   * USER_NAME:DOMAIN_NAME:HA1_HASH_OF_USER_DOMAIN_AND_PASSWORD
-   */
-  while (fgets(buf, sizeof(buf), fp) != NULL) {
-    if (sscanf(buf, "%[^:]:%[^:]:%s", f_user, f_domain, f_ha1) == 3 &&
-        mg_vcmp(&username, f_user) == 0 &&
-        mg_vcmp(&auth_domain, f_domain) == 0) {
-      /* Username and domain matched, check the password */
-      mg_mkmd5resp(method.p, method.len, uri.p, uri.len, f_ha1, strlen(f_ha1),
-                   nonce.p, nonce.len, nc.p, nc.len, cnonce.p, cnonce.len,
-                   qop.p, qop.len, expected_response);
-      LOG(LL_DEBUG,
-          ("%.*s %s %.*s %s", (int) username.len, username.p, f_domain,
-           (int) response.len, response.p, expected_response));
-      return mg_ncasecmp(response.p, expected_response, response.len) == 0;
+  /* Loop through headers, fetch variable name and file name */
+  var_name[0] = file_name[0] = '\0';
+  for (n = bl; (ll = mg_get_line_len(buf + n, hl - n)) > 0; n += ll) {
+    if (mg_ncasecmp(cd, buf + n, cdl) == 0) {
+      struct mg_str header;
+      header.p = buf + n + cdl;
+      header.len = ll - (cdl + 2);
+      {
+        char *var_name2 = var_name;
+        mg_http_parse_header2(&header, "name", &var_name2, var_name_len);
+        /* TODO: handle reallocated buffer correctly */
+        if (var_name2 != var_name) {
+          MG_FREE(var_name2);
+          var_name[0] = '\0';
+        }
+      }
+      {
+        char *file_name2 = file_name;
+        mg_http_parse_header2(&header, "filename", &file_name2, file_name_len);
+        /* TODO: handle reallocated buffer correctly */
+        if (file_name2 != file_name) {
+          MG_FREE(file_name2);
+          file_name[0] = '\0';
+        }
+      }
+    }
+  }
+
+  /* Scan through the body, search for terminating boundary */
+  for (pos = hl; pos + (bl - 2) < buf_len; pos++) {
+    if (buf[pos] == '-' && !strncmp(buf, &buf[pos], bl - 2)) {
+      if (data_len != NULL) *data_len = (pos - 2) - hl;
+      if (data != NULL) *data = buf + hl;
+      return pos;
     }
   }
 
-  /* None of the entries in the passwords file matched - return failure */
   return 0;
 }
 
-int mg_http_is_authorized(struct http_message *hm, struct mg_str path,
-                          const char *domain, const char *passwords_file,
-                          int flags) {
-  char buf[MG_MAX_PATH];
-  const char *p;
-  FILE *fp;
-  int authorized = 1;
+static struct mg_http_endpoint *mg_http_add_endpoint(
+    struct mg_connection *nc, const char *uri_path, mg_event_handler_t handler,
+    struct mg_http_endpoint_opts opts) {
+  struct mg_http_proto_data *pd = NULL;
+  struct mg_http_endpoint *new_ep = NULL;
 
-  if (domain != NULL && passwords_file != NULL) {
-    if (flags & MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE) {
-      fp = mg_fopen(passwords_file, "r");
-    } else if (flags & MG_AUTH_FLAG_IS_DIRECTORY) {
-      snprintf(buf, sizeof(buf), "%.*s%c%s", (int) path.len, path.p, DIRSEP,
-               passwords_file);
-      fp = mg_fopen(buf, "r");
-    } else {
-      p = strrchr(path.p, DIRSEP);
-      if (p == NULL) p = path.p;
-      snprintf(buf, sizeof(buf), "%.*s%c%s", (int) (p - path.p), path.p, DIRSEP,
-               passwords_file);
-      fp = mg_fopen(buf, "r");
-    }
+  if (nc == NULL) return NULL;
+  new_ep = (struct mg_http_endpoint *) MG_CALLOC(1, sizeof(*new_ep));
+  if (new_ep == NULL) return NULL;
 
-    if (fp != NULL) {
-      authorized = mg_http_check_digest_auth(hm, domain, fp);
-      fclose(fp);
-    } else if (!(flags & MG_AUTH_FLAG_ALLOW_MISSING_FILE)) {
-      authorized = 0;
-    }
+  pd = mg_http_get_proto_data(nc);
+  new_ep->uri_pattern = mg_strdup(mg_mk_str(uri_path));
+  if (opts.auth_domain != NULL && opts.auth_file != NULL) {
+    new_ep->auth_domain = strdup(opts.auth_domain);
+    new_ep->auth_file = strdup(opts.auth_file);
   }
-
-  LOG(LL_DEBUG, ("%.*s %s %x %d", (int) path.len, path.p,
-                 passwords_file ? passwords_file : "", flags, authorized));
-  return authorized;
-}
-#else
-int mg_http_is_authorized(struct http_message *hm, const struct mg_str path,
-                          const char *domain, const char *passwords_file,
-                          int flags) {
-  (void) hm;
-  (void) path;
-  (void) domain;
-  (void) passwords_file;
-  (void) flags;
-  return 1;
-}
+  new_ep->handler = handler;
+#if MG_ENABLE_CALLBACK_USERDATA
+  new_ep->user_data = opts.user_data;
 #endif
-
-#if MG_ENABLE_DIRECTORY_LISTING
-static void mg_escape(const char *src, char *dst, size_t dst_len) {
-  size_t n = 0;
-  while (*src != '\0' && n + 5 < dst_len) {
-    unsigned char ch = *(unsigned char *) src++;
-    if (ch == '<') {
-      n += snprintf(dst + n, dst_len - n, "%s", "&lt;");
-    } else {
-      dst[n++] = ch;
-    }
-  }
-  dst[n] = '\0';
+  new_ep->next = pd->endpoints;
+  pd->endpoints = new_ep;
+  return new_ep;
 }
 
-static void mg_print_dir_entry(struct mg_connection *nc, const char *file_name,
-                               cs_stat_t *stp) {
-  char size[64], mod[64], path[MG_MAX_PATH];
-  int64_t fsize = stp->st_size;
-  int is_dir = S_ISDIR(stp->st_mode);
-  const char *slash = is_dir ? "/" : "";
-  struct mg_str href;
-
-  if (is_dir) {
-    snprintf(size, sizeof(size), "%s", "[DIRECTORY]");
-  } else {
-    /*
-     * We use (double) cast below because MSVC 6 compiler cannot
-     * convert unsigned __int64 to double.
-     */
-    if (fsize < 1024) {
-      snprintf(size, sizeof(size), "%d", (int) fsize);
-    } else if (fsize < 0x100000) {
-      snprintf(size, sizeof(size), "%.1fk", (double) fsize / 1024.0);
-    } else if (fsize < 0x40000000) {
-      snprintf(size, sizeof(size), "%.1fM", (double) fsize / 1048576);
-    } else {
-      snprintf(size, sizeof(size), "%.1fG", (double) fsize / 1073741824);
-    }
-  }
-  strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M", localtime(&stp->st_mtime));
-  mg_escape(file_name, path, sizeof(path));
-  href = mg_url_encode(mg_mk_str(file_name));
-  mg_printf_http_chunk(nc,
-                       "<tr><td><a href=\"%s%s\">%s%s</a></td>"
-                       "<td>%s</td><td name=%" INT64_FMT ">%s</td></tr>\n",
-                       href.p, slash, path, slash, mod, is_dir ? -1 : fsize,
-                       size);
-  free((void *) href.p);
+void mg_register_http_endpoint_opt(struct mg_connection *nc,
+                                   const char *uri_path,
+                                   mg_event_handler_t handler,
+                                   struct mg_http_endpoint_opts opts) {
+  mg_http_add_endpoint(nc, uri_path, handler, opts);
 }
 
-static void mg_scan_directory(struct mg_connection *nc, const char *dir,
-                              const struct mg_serve_http_opts *opts,
-                              void (*func)(struct mg_connection *, const char *,
-                                           cs_stat_t *)) {
-  char path[MG_MAX_PATH];
-  cs_stat_t st;
-  struct dirent *dp;
-  DIR *dirp;
+static void mg_http_call_endpoint_handler(struct mg_connection *nc, int ev,
+                                          struct http_message *hm) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  void *user_data = nc->user_data;
 
-  LOG(LL_DEBUG, ("%p [%s]", nc, dir));
-  if ((dirp = (opendir(dir))) != NULL) {
-    while ((dp = readdir(dirp)) != NULL) {
-      /* Do not show current dir and hidden files */
-      if (mg_is_file_hidden((const char *) dp->d_name, opts, 1)) {
-        continue;
+  if (ev == MG_EV_HTTP_REQUEST
+#if MG_ENABLE_HTTP_STREAMING_MULTIPART
+      || ev == MG_EV_HTTP_MULTIPART_REQUEST
+#endif
+      ) {
+    struct mg_http_endpoint *ep =
+        mg_http_get_endpoint_handler(nc->listener, &hm->uri);
+    if (ep != NULL) {
+#if MG_ENABLE_FILESYSTEM && !MG_DISABLE_HTTP_DIGEST_AUTH
+      if (!mg_http_is_authorized(hm, hm->uri, ep->auth_domain, ep->auth_file,
+                                 MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE)) {
+        mg_http_send_digest_auth_request(nc, ep->auth_domain);
+        return;
       }
-      snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
-      if (mg_stat(path, &st) == 0) {
-        func(nc, (const char *) dp->d_name, &st);
+#endif
+      pd->endpoint_handler = ep->handler;
+#if MG_ENABLE_CALLBACK_USERDATA
+      user_data = ep->user_data;
+#endif
+#if MG_ENABLE_HTTP_SSE
+      if (ep->sse_channel != NULL && ev == MG_EV_HTTP_REQUEST) {
+        size_t len = nc->send_mbuf.len;
+        /* The handler may answer instead, e.g. to refuse the client */
+        if (ep->handler != NULL) mg_call(nc, ep->handler, user_data, ev, hm);
+        if (nc->send_mbuf.len == len &&
+            !(nc->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE))) {
+          mg_sse_subscribe(nc, ep->sse_channel, hm);
+        }
+        return;
       }
+#endif
     }
-    closedir(dirp);
-  } else {
-    LOG(LL_DEBUG, ("%p opendir(%s) -> %d", nc, dir, mg_get_errno()));
   }
+  mg_call(nc, pd->endpoint_handler ? pd->endpoint_handler : nc->handler,
+          user_data, ev, hm);
 }
 
-static void mg_send_directory_listing(struct mg_connection *nc, const char *dir,
-                                      struct http_message *hm,
-                                      struct mg_serve_http_opts *opts) {
-  static const char *sort_js_code =
-      "<script>function srt(tb, sc, so, d) {"
-      "var tr = Array.prototype.slice.call(tb.rows, 0),"
-      "tr = tr.sort(function (a, b) { var c1 = a.cells[sc], c2 = b.cells[sc],"
-      "n1 = c1.getAttribute('name'), n2 = c2.getAttribute('name'), "
-      "t1 = a.cells[2].getAttribute('name'), "
-      "t2 = b.cells[2].getAttribute('name'); "
-      "return so * (t1 < 0 && t2 >= 0 ? -1 : t2 < 0 && t1 >= 0 ? 1 : "
-      "n1 ? parseInt(n2) - parseInt(n1) : "
-      "c1.textContent.trim().localeCompare(c2.textContent.trim())); });";
-  static const char *sort_js_code2 =
-      "for (var i = 0; i < tr.length; i++) tb.appendChild(tr[i]); "
-      "if (!d) window.location.hash = ('sc=' + sc + '&so=' + so); "
-      "};"
-      "window.onload = function() {"
-      "var tb = document.getElementById('tb');"
-      "var m = /sc=([012]).so=(1|-1)/.exec(window.location.hash) || [0, 2, 1];"
-      "var sc = m[1], so = m[2]; document.onclick = function(ev) { "
-      "var c = ev.target.rel; if (c) {if (c == sc) so *= -1; srt(tb, c, so); "
-      "sc = c; ev.preventDefault();}};"
-      "srt(tb, sc, so, true);"
-      "}"
-      "</script>";
-
-  mg_send_response_line(nc, 200, opts->extra_headers);
-  mg_printf(nc, "%s: %s\r\n%s: %s\r\n\r\n", "Transfer-Encoding", "chunked",
-            "Content-Type", "text/html; charset=utf-8");
+void mg_register_http_endpoint(struct mg_connection *nc, const char *uri_path,
+                               MG_CB(mg_event_handler_t handler,
+                                     void *user_data)) {
+  struct mg_http_endpoint_opts opts;
+  memset(&opts, 0, sizeof(opts));
+#if MG_ENABLE_CALLBACK_USERDATA
+  opts.user_data = user_data;
+#endif
+  mg_register_http_endpoint_opt(nc, uri_path, handler, opts);
+}
 
-  mg_printf_http_chunk(
-      nc,
-      "<html><head><title>Index of %.*s</title>%s%s"
-      "<style>th,td {text-align: left; padding-right: 1em; "
-      "font-family: monospace; }</style></head>\n"
-      "<body><h1>Index of %.*s</h1>\n<table cellpadding=0><thead>"
-      "<tr><th><a href=# rel=0>Name</a></th><th>"
-      "<a href=# rel=1>Modified</a</th>"
-      "<th><a href=# rel=2>Size</a></th></tr>"
-      "<tr><td colspan=3><hr></td></tr>\n"
-      "</thead>\n"
-      "<tbody id=tb>",
-      (int) hm->uri.len, hm->uri.p, sort_js_code, sort_js_code2,
-      (int) hm->uri.len, hm->uri.p);
-  mg_scan_directory(nc, dir, opts, mg_print_dir_entry);
-  mg_printf_http_chunk(nc,
-                       "</tbody><tr><td colspan=3><hr></td></tr>\n"
-                       "</table>\n"
-                       "<address>%s</address>\n"
-                       "</body></html>",
-                       mg_version_header);
-  mg_send_http_chunk(nc, "", 0);
-  /* TODO(rojer): Remove when cesanta/dev/issues/197 is fixed. */
-  nc->flags |= MG_F_SEND_AND_CLOSE;
+#if MG_ENABLE_HTTP_SSE
+void mg_register_sse_endpoint(struct mg_connection *nc, const char *uri_path,
+                              struct mg_sse_channel *ch,
+                              MG_CB(mg_event_handler_t handler,
+                                    void *user_data)) {
+  struct mg_http_endpoint_opts opts;
+  struct mg_http_endpoint *ep;
+  memset(&opts, 0, sizeof(opts));
+#if MG_ENABLE_CALLBACK_USERDATA
+  opts.user_data = user_data;
+#endif
+  ep = mg_http_add_endpoint(nc, uri_path, handler, opts);
+  if (ep != NULL) ep->sse_channel = ch;
 }
-#endif /* MG_ENABLE_DIRECTORY_LISTING */
+#endif
+
+#endif /* MG_ENABLE_HTTP */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http_cgi.c"
+#endif
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_CGI
+
+#ifndef MG_MAX_CGI_ENVIR_VARS
+#define MG_MAX_CGI_ENVIR_VARS 64
+#endif
+
+#ifndef MG_ENV_EXPORT_TO_CGI
+#define MG_ENV_EXPORT_TO_CGI "MONGOOSE_CGI"
+#endif
+
+#define MG_F_HTTP_CGI_PARSE_HEADERS MG_F_USER_1
 
 /*
- * Given a directory path, find one of the files specified in the
- * comma-separated list of index files `list`.
- * First found index file wins. If an index file is found, then gets
- * appended to the `path`, stat-ed, and result of `stat()` passed to `stp`.
- * If index file is not found, then `path` and `stp` remain unchanged.
+ * This structure helps to create an environment for the spawned CGI program.
+ * Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
+ * last element must be NULL.
+ * However, on Windows there is a requirement that all these VARIABLE=VALUE\0
+ * strings must reside in a contiguous buffer. The end of the buffer is
+ * marked by two '\0' characters.
+ * We satisfy both worlds: we create an envp array (which is vars), all
+ * entries are actually pointers inside buf.
  */
-MG_INTERNAL void mg_find_index_file(const char *path, const char *list,
-                                    char **index_file, cs_stat_t *stp) {
-  struct mg_str vec;
-  size_t path_len = strlen(path);
-  int found = 0;
-  *index_file = NULL;
+struct mg_cgi_env_block {
+  struct mg_connection *nc;
+  char buf[MG_CGI_ENVIRONMENT_SIZE];       /* Environment buffer */
+  const char *vars[MG_MAX_CGI_ENVIR_VARS]; /* char *envp[] */
+  int len;                                 /* Space taken */
+  int nvars;                               /* Number of variables in envp[] */
+};
 
-  /* Traverse index files list. For each entry, append it to the given */
-  /* path and see if the file exists. If it exists, break the loop */
-  while ((list = mg_next_comma_list_entry(list, &vec, NULL)) != NULL) {
-    cs_stat_t st;
-    size_t len = path_len + 1 + vec.len + 1;
-    *index_file = (char *) MG_REALLOC(*index_file, len);
-    if (*index_file == NULL) break;
-    snprintf(*index_file, len, "%s%c%.*s", path, DIRSEP, (int) vec.len, vec.p);
+#ifdef _WIN32
+struct mg_threadparam {
+  sock_t s;
+  HANDLE hPipe;
+};
 
-    /* Does it exist? Is it a file? */
-    if (mg_stat(*index_file, &st) == 0 && S_ISREG(st.st_mode)) {
-      /* Yes it does, break the loop */
-      *stp = st;
-      found = 1;
-      break;
-    }
-  }
-  if (!found) {
-    MG_FREE(*index_file);
-    *index_file = NULL;
-  }
-  LOG(LL_DEBUG, ("[%s] [%s]", path, (*index_file ? *index_file : "")));
+static int mg_wait_until_ready(sock_t sock, int for_read) {
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(sock, &set);
+  return select(sock + 1, for_read ? &set : 0, for_read ? 0 : &set, 0, 0) == 1;
 }
 
-#if MG_ENABLE_HTTP_URL_REWRITES
-static int mg_http_send_port_based_redirect(
-    struct mg_connection *c, struct http_message *hm,
-    const struct mg_serve_http_opts *opts) {
-  const char *rewrites = opts->url_rewrites;
-  struct mg_str a, b;
-  char local_port[20] = {'%'};
-
-  mg_conn_addr_to_str(c, local_port + 1, sizeof(local_port) - 1,
-                      MG_SOCK_STRINGIFY_PORT);
+static void *mg_push_to_stdin(void *arg) {
+  struct mg_threadparam *tp = (struct mg_threadparam *) arg;
+  int n, sent, stop = 0;
+  DWORD k;
+  char buf[BUFSIZ];
 
-  while ((rewrites = mg_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
-    if (mg_vcmp(&a, local_port) == 0) {
-      mg_send_response_line(c, 301, NULL);
-      mg_printf(c, "Content-Length: 0\r\nLocation: %.*s%.*s\r\n\r\n",
-                (int) b.len, b.p, (int) (hm->proto.p - hm->uri.p - 1),
-                hm->uri.p);
-      return 1;
+  while (!stop && mg_wait_until_ready(tp->s, 1) &&
+         (n = recv(tp->s, buf, sizeof(buf), 0)) > 0) {
+    if (n == -1 && GetLastError() == WSAEWOULDBLOCK) continue;
+    for (sent = 0; !stop && sent < n; sent += k) {
+      if (!WriteFile(tp->hPipe, buf + sent, n - sent, &k, 0)) stop = 1;
     }
   }
-
-  return 0;
+  DBG(("%s", "FORWARED EVERYTHING TO CGI"));
+  CloseHandle(tp->hPipe);
+  MG_FREE(tp);
+  return NULL;
 }
 
-static void mg_reverse_proxy_handler(struct mg_connection *nc, int ev,
-                                     void *ev_data MG_UD_ARG(void *user_data)) {
-  struct http_message *hm = (struct http_message *) ev_data;
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+static void *mg_pull_from_stdout(void *arg) {
+  struct mg_threadparam *tp = (struct mg_threadparam *) arg;
+  int k = 0, stop = 0;
+  DWORD n, sent;
+  char buf[BUFSIZ];
 
-  if (pd == NULL || pd->reverse_proxy_data.linked_conn == NULL) {
-    DBG(("%p: upstream closed", nc));
-    return;
+  while (!stop && ReadFile(tp->hPipe, buf, sizeof(buf), &n, NULL)) {
+    for (sent = 0; !stop && sent < n; sent += k) {
+      if (mg_wait_until_ready(tp->s, 0) &&
+          (k = send(tp->s, buf + sent, n - sent, 0)) <= 0)
+        stop = 1;
+    }
   }
+  DBG(("%s", "EOF FROM CGI"));
+  CloseHandle(tp->hPipe);
+  shutdown(tp->s, 2);  // Without this, IO thread may get truncated data
+  closesocket(tp->s);
+  MG_FREE(tp);
+  return NULL;
+}
 
-  switch (ev) {
-    case MG_EV_CONNECT:
-      if (*(int *) ev_data != 0) {
-        mg_http_send_error(pd->reverse_proxy_data.linked_conn, 502, NULL);
-      }
-      break;
-    /* TODO(mkm): handle streaming */
-    case MG_EV_HTTP_REPLY:
-      mg_send(pd->reverse_proxy_data.linked_conn, hm->message.p,
-              hm->message.len);
-      pd->reverse_proxy_data.linked_conn->flags |= MG_F_SEND_AND_CLOSE;
-      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-      break;
-    case MG_EV_CLOSE:
-      pd->reverse_proxy_data.linked_conn->flags |= MG_F_SEND_AND_CLOSE;
-      break;
+static void mg_spawn_stdio_thread(sock_t sock, HANDLE hPipe,
+                                  void *(*func)(void *)) {
+  struct mg_threadparam *tp = (struct mg_threadparam *) MG_MALLOC(sizeof(*tp));
+  if (tp != NULL) {
+    tp->s = sock;
+    tp->hPipe = hPipe;
+    mg_start_thread(func, tp);
   }
+}
 
-#if MG_ENABLE_CALLBACK_USERDATA
-  (void) user_data;
-#endif
+static void mg_abs_path(const char *utf8_path, char *abs_path, size_t len) {
+  wchar_t buf[MG_MAX_PATH], buf2[MG_MAX_PATH];
+  to_wchar(utf8_path, buf, ARRAY_SIZE(buf));
+  GetFullPathNameW(buf, ARRAY_SIZE(buf2), buf2, NULL);
+  WideCharToMultiByte(CP_UTF8, 0, buf2, wcslen(buf2) + 1, abs_path, len, 0, 0);
 }
 
-void mg_http_reverse_proxy(struct mg_connection *nc,
-                           const struct http_message *hm, struct mg_str mount,
-                           struct mg_str upstream) {
-  struct mg_connection *be;
-  char burl[256], *purl = burl;
-  int i;
-  const char *error;
-  struct mg_connect_opts opts;
-  struct mg_str path = MG_NULL_STR, user_info = MG_NULL_STR, host = MG_NULL_STR;
-  memset(&opts, 0, sizeof(opts));
-  opts.error_string = &error;
+static int mg_start_process(const char *interp, const char *cmd,
+                            const char *env, const char *envp[],
+                            const char *dir, sock_t sock) {
+  STARTUPINFOW si;
+  PROCESS_INFORMATION pi;
+  HANDLE a[2], b[2], me = GetCurrentProcess();
+  wchar_t wcmd[MG_MAX_PATH], full_dir[MG_MAX_PATH];
+  char buf[MG_MAX_PATH], buf2[MG_MAX_PATH], buf5[MG_MAX_PATH],
+      buf4[MG_MAX_PATH], cmdline[MG_MAX_PATH];
+  DWORD flags = DUPLICATE_CLOSE_SOURCE | DUPLICATE_SAME_ACCESS;
+  FILE *fp;
 
-  mg_asprintf(&purl, sizeof(burl), "%.*s%.*s", (int) upstream.len, upstream.p,
-              (int) (hm->uri.len - mount.len), hm->uri.p + mount.len);
+  memset(&si, 0, sizeof(si));
+  memset(&pi, 0, sizeof(pi));
 
-  be = mg_connect_http_base(nc->mgr, MG_CB(mg_reverse_proxy_handler, NULL),
-                            opts, "http", NULL, "https", NULL, purl, &path,
-                            &user_info, &host);
-  LOG(LL_DEBUG, ("Proxying %.*s to %s (rule: %.*s)", (int) hm->uri.len,
-                 hm->uri.p, purl, (int) mount.len, mount.p));
+  si.cb = sizeof(si);
+  si.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+  si.wShowWindow = SW_HIDE;
+  si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
 
-  if (be == NULL) {
-    LOG(LL_ERROR, ("Error connecting to %s: %s", purl, error));
-    mg_http_send_error(nc, 502, NULL);
-    goto cleanup;
+  CreatePipe(&a[0], &a[1], NULL, 0);
+  CreatePipe(&b[0], &b[1], NULL, 0);
+  DuplicateHandle(me, a[0], me, &si.hStdInput, 0, TRUE, flags);
+  DuplicateHandle(me, b[1], me, &si.hStdOutput, 0, TRUE, flags);
+
+  if (interp == NULL && (fp = mg_fopen(cmd, "r")) != NULL) {
+    buf[0] = buf[1] = '\0';
+    fgets(buf, sizeof(buf), fp);
+    buf[sizeof(buf) - 1] = '\0';
+    if (buf[0] == '#' && buf[1] == '!') {
+      interp = buf + 2;
+      /* Trim leading spaces: https://github.com/cesanta/mongoose/issues/489 */
+      while (*interp != '\0' && isspace(*(unsigned char *) interp)) {
+        interp++;
+      }
+    }
+    fclose(fp);
   }
 
-  /* link connections to each other, they must live and die together */
-  mg_http_get_proto_data(be)->reverse_proxy_data.linked_conn = nc;
-  mg_http_get_proto_data(nc)->reverse_proxy_data.linked_conn = be;
+  snprintf(buf, sizeof(buf), "%s/%s", dir, cmd);
+  mg_abs_path(buf, buf2, ARRAY_SIZE(buf2));
 
-  /* send request upstream */
-  mg_printf(be, "%.*s %.*s HTTP/1.1\r\n", (int) hm->method.len, hm->method.p,
-            (int) path.len, path.p);
+  mg_abs_path(dir, buf5, ARRAY_SIZE(buf5));
+  to_wchar(dir, full_dir, ARRAY_SIZE(full_dir));
 
-  mg_printf(be, "Host: %.*s\r\n", (int) host.len, host.p);
-  for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->header_names[i].len > 0; i++) {
-    struct mg_str hn = hm->header_names[i];
-    struct mg_str hv = hm->header_values[i];
+  if (interp != NULL) {
+    mg_abs_path(interp, buf4, ARRAY_SIZE(buf4));
+    snprintf(cmdline, sizeof(cmdline), "%s \"%s\"", buf4, buf2);
+  } else {
+    snprintf(cmdline, sizeof(cmdline), "\"%s\"", buf2);
+  }
+  to_wchar(cmdline, wcmd, ARRAY_SIZE(wcmd));
 
-    /* we rewrite the host header */
-    if (mg_vcasecmp(&hn, "Host") == 0) continue;
-    /*
-     * Don't pass chunked transfer encoding to the client because hm->body is
-     * already dechunked when we arrive here.
-     */
-    if (mg_vcasecmp(&hn, "Transfer-encoding") == 0 &&
-        mg_vcasecmp(&hv, "chunked") == 0) {
-      mg_printf(be, "Content-Length: %" SIZE_T_FMT "\r\n", hm->body.len);
-      continue;
-    }
-    /* We don't support proxying Expect: 100-continue. */
-    if (mg_vcasecmp(&hn, "Expect") == 0 &&
-        mg_vcasecmp(&hv, "100-continue") == 0) {
-      continue;
-    }
+  if (CreateProcessW(NULL, wcmd, NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP,
+                     (void *) env, full_dir, &si, &pi) != 0) {
+    mg_spawn_stdio_thread(sock, a[1], mg_push_to_stdin);
+    mg_spawn_stdio_thread(sock, b[0], mg_pull_from_stdout);
 
-    mg_printf(be, "%.*s: %.*s\r\n", (int) hn.len, hn.p, (int) hv.len, hv.p);
-  }
+    CloseHandle(si.hStdOutput);
+    CloseHandle(si.hStdInput);
 
-  mg_send(be, "\r\n", 2);
-  mg_send(be, hm->body.p, hm->body.len);
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+  } else {
+    CloseHandle(a[1]);
+    CloseHandle(b[0]);
+    closesocket(sock);
+  }
+  DBG(("CGI command: [%ls] -> %p", wcmd, pi.hProcess));
 
-cleanup:
-  if (purl != burl) MG_FREE(purl);
+  /* Not closing a[0] and b[1] because we've used DUPLICATE_CLOSE_SOURCE */
+  (void) envp;
+  return (pi.hProcess != NULL);
 }
+#else
+static int mg_start_process(const char *interp, const char *cmd,
+                            const char *env, const char *envp[],
+                            const char *dir, sock_t sock) {
+  char buf[500];
+  pid_t pid = fork();
+  (void) env;
 
-static int mg_http_handle_forwarding(struct mg_connection *nc,
-                                     struct http_message *hm,
-                                     const struct mg_serve_http_opts *opts) {
-  const char *rewrites = opts->url_rewrites;
-  struct mg_str a, b;
-  struct mg_str p1 = MG_MK_STR("http://"), p2 = MG_MK_STR("https://");
+  if (pid == 0) {
+    /*
+     * In Linux `chdir` declared with `warn_unused_result` attribute
+     * To shutup compiler we have yo use result in some way
+     */
+    int tmp = chdir(dir);
+    (void) tmp;
+    (void) dup2(sock, 0);
+    (void) dup2(sock, 1);
+    closesocket(sock);
 
-  while ((rewrites = mg_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
-    if (mg_strncmp(a, hm->uri, a.len) == 0) {
-      if (mg_strncmp(b, p1, p1.len) == 0 || mg_strncmp(b, p2, p2.len) == 0) {
-        mg_http_reverse_proxy(nc, hm, a, b);
-        return 1;
-      }
+    /*
+     * After exec, all signal handlers are restored to their default values,
+     * with one exception of SIGCHLD. According to POSIX.1-2001 and Linux's
+     * implementation, SIGCHLD's handler will leave unchanged after exec
+     * if it was set to be ignored. Restore it to default action.
+     */
+    signal(SIGCHLD, SIG_DFL);
+
+    if (interp == NULL) {
+      execle(cmd, cmd, (char *) 0, envp); /* (char *) 0 to squash warning */
+    } else {
+      execle(interp, interp, cmd, (char *) 0, envp);
     }
+    snprintf(buf, sizeof(buf),
+             "Status: 500\r\n\r\n"
+             "500 Server Error: %s%s%s: %s",
+             interp == NULL ? "" : interp, interp == NULL ? "" : " ", cmd,
+             strerror(errno));
+    send(1, buf, strlen(buf), 0);
+    _exit(EXIT_FAILURE); /* exec call failed */
   }
 
-  return 0;
+  return (pid != 0);
 }
-#endif /* MG_ENABLE_FILESYSTEM */
+#endif /* _WIN32 */
 
-MG_INTERNAL int mg_uri_to_local_path(struct http_message *hm,
-                                     const struct mg_serve_http_opts *opts,
-                                     char **local_path,
-                                     struct mg_str *remainder) {
-  int ok = 1;
-  const char *cp = hm->uri.p, *cp_end = hm->uri.p + hm->uri.len;
-  struct mg_str root = {NULL, 0};
-  const char *file_uri_start = cp;
-  *local_path = NULL;
-  remainder->p = NULL;
-  remainder->len = 0;
+/*
+ * Append VARIABLE=VALUE\0 string to the buffer, and add a respective
+ * pointer into the vars array.
+ */
+static char *mg_addenv(struct mg_cgi_env_block *block, const char *fmt, ...) {
+  int n, space;
+  char *added = block->buf + block->len;
+  va_list ap;
 
-  { /* 1. Determine which root to use. */
+  /* Calculate how much space is left in the buffer */
+  space = sizeof(block->buf) - (block->len + 2);
+  if (space > 0) {
+    /* Copy VARIABLE=VALUE\0 string into the free space */
+    va_start(ap, fmt);
+    n = vsnprintf(added, (size_t) space, fmt, ap);
+    va_end(ap);
 
-#if MG_ENABLE_HTTP_URL_REWRITES
-    const char *rewrites = opts->url_rewrites;
-#else
-    const char *rewrites = "";
-#endif
-    struct mg_str *hh = mg_get_http_header(hm, "Host");
-    struct mg_str a, b;
-    /* Check rewrites first. */
-    while ((rewrites = mg_next_comma_list_entry(rewrites, &a, &b)) != NULL) {
-      if (a.len > 1 && a.p[0] == '@') {
-        /* Host rewrite. */
-        if (hh != NULL && hh->len == a.len - 1 &&
-            mg_ncasecmp(a.p + 1, hh->p, a.len - 1) == 0) {
-          root = b;
-          break;
-        }
-      } else {
-        /* Regular rewrite, URI=directory */
-        size_t match_len = mg_match_prefix_n(a, hm->uri);
-        if (match_len > 0) {
-          file_uri_start = hm->uri.p + match_len;
-          if (*file_uri_start == '/' || file_uri_start == cp_end) {
-            /* Match ended at component boundary, ok. */
-          } else if (*(file_uri_start - 1) == '/') {
-            /* Pattern ends with '/', backtrack. */
-            file_uri_start--;
-          } else {
-            /* No match: must fall on the component boundary. */
-            continue;
-          }
-          root = b;
-          break;
-        }
-      }
-    }
-    /* If no rewrite rules matched, use DAV or regular document root. */
-    if (root.p == NULL) {
-#if MG_ENABLE_HTTP_WEBDAV
-      if (opts->dav_document_root != NULL && mg_is_dav_request(&hm->method)) {
-        root.p = opts->dav_document_root;
-        root.len = strlen(opts->dav_document_root);
-      } else
-#endif
-      {
-        root.p = opts->document_root;
-        root.len = strlen(opts->document_root);
-      }
+    /* Make sure we do not overflow buffer and the envp array */
+    if (n > 0 && n + 1 < space &&
+        block->nvars < (int) ARRAY_SIZE(block->vars) - 2) {
+      /* Append a pointer to the added string into the envp array */
+      block->vars[block->nvars++] = added;
+      /* Bump up used length counter. Include \0 terminator */
+      block->len += n + 1;
     }
-    assert(root.p != NULL && root.len > 0);
   }
 
-  { /* 2. Find where in the canonical URI path the local path ends. */
-    const char *u = file_uri_start + 1;
-    char *lp = (char *) MG_MALLOC(root.len + hm->uri.len + 1);
-    char *lp_end = lp + root.len + hm->uri.len + 1;
-    char *p = lp, *ps;
-    int exists = 1;
-    if (lp == NULL) {
-      ok = 0;
-      goto out;
-    }
-    memcpy(p, root.p, root.len);
-    p += root.len;
-    if (*(p - 1) == DIRSEP) p--;
-    *p = '\0';
-    ps = p;
-
-    /* Chop off URI path components one by one and build local path. */
-    while (u <= cp_end) {
-      const char *next = u;
-      struct mg_str component;
-      if (exists) {
-        cs_stat_t st;
-        exists = (mg_stat(lp, &st) == 0);
-        if (exists && S_ISREG(st.st_mode)) {
-          /* We found the terminal, the rest of the URI (if any) is path_info.
-           */
-          if (*(u - 1) == '/') u--;
-          break;
-        }
-      }
-      if (u >= cp_end) break;
-      parse_uri_component((const char **) &next, cp_end, "/", &component);
-      if (component.len > 0) {
-        int len;
-        memmove(p + 1, component.p, component.len);
-        len = mg_url_decode(p + 1, component.len, p + 1, lp_end - p - 1, 0);
-        if (len <= 0) {
-          ok = 0;
-          break;
-        }
-        component.p = p + 1;
-        component.len = len;
-        if (mg_vcmp(&component, ".") == 0) {
-          /* Yum. */
-        } else if (mg_vcmp(&component, "..") == 0) {
-          while (p > ps && *p != DIRSEP) p--;
-          *p = '\0';
-        } else {
-          size_t i;
-#ifdef _WIN32
-          /* On Windows, make sure it's valid Unicode (no funny stuff). */
-          wchar_t buf[MG_MAX_PATH * 2];
-          if (to_wchar(component.p, buf, MG_MAX_PATH) == 0) {
-            DBG(("[%.*s] smells funny", (int) component.len, component.p));
-            ok = 0;
-            break;
-          }
-#endif
-          *p++ = DIRSEP;
-          /* No NULs and DIRSEPs in the component (percent-encoded). */
-          for (i = 0; i < component.len; i++, p++) {
-            if (*p == '\0' || *p == DIRSEP
-#ifdef _WIN32
-                /* On Windows, "/" is also accepted, so check for that too. */
-                ||
-                *p == '/'
-#endif
-                ) {
-              ok = 0;
-              break;
-            }
-          }
-        }
-      }
-      u = next;
-    }
-    if (ok) {
-      *local_path = lp;
-      if (u > cp_end) u = cp_end;
-      remainder->p = u;
-      remainder->len = cp_end - u;
-    } else {
-      MG_FREE(lp);
-    }
-  }
+  return added;
+}
 
-out:
-  LOG(LL_DEBUG,
-      ("'%.*s' -> '%s' + '%.*s'", (int) hm->uri.len, hm->uri.p,
-       *local_path ? *local_path : "", (int) remainder->len, remainder->p));
-  return ok;
+static void mg_addenv2(struct mg_cgi_env_block *blk, const char *name) {
+  const char *s;
+  if ((s = getenv(name)) != NULL) mg_addenv(blk, "%s=%s", name, s);
 }
 
-static int mg_get_month_index(const char *s) {
-  static const char *month_names[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                                      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static void mg_prepare_cgi_environment(struct mg_connection *nc,
+                                       const char *prog,
+                                       const struct mg_str *path_info,
+                                       const struct http_message *hm,
+                                       const struct mg_serve_http_opts *opts,
+                                       struct mg_cgi_env_block *blk) {
+  const char *s;
+  struct mg_str *h;
+  char *p;
   size_t i;
+  char buf[100];
+  size_t path_info_len = path_info != NULL ? path_info->len : 0;
 
-  for (i = 0; i < ARRAY_SIZE(month_names); i++)
-    if (!strcmp(s, month_names[i])) return (int) i;
+  blk->len = blk->nvars = 0;
+  blk->nc = nc;
 
-  return -1;
-}
+  if ((s = getenv("SERVER_NAME")) != NULL) {
+    mg_addenv(blk, "SERVER_NAME=%s", s);
+  } else {
+    mg_sock_to_str(nc->sock, buf, sizeof(buf), 3);
+    mg_addenv(blk, "SERVER_NAME=%s", buf);
+  }
+  mg_addenv(blk, "SERVER_ROOT=%s", opts->document_root);
+  mg_addenv(blk, "DOCUMENT_ROOT=%s", opts->document_root);
+  mg_addenv(blk, "SERVER_SOFTWARE=%s/%s", "Mongoose", MG_VERSION);
 
-static int mg_num_leap_years(int year) {
-  return year / 4 - year / 100 + year / 400;
-}
+  /* Prepare the environment block */
+  mg_addenv(blk, "%s", "GATEWAY_INTERFACE=CGI/1.1");
+  mg_addenv(blk, "%s", "SERVER_PROTOCOL=HTTP/1.1");
+  mg_addenv(blk, "%s", "REDIRECT_STATUS=200"); /* For PHP */
 
-/* Parse UTC date-time string, and return the corresponding time_t value. */
-MG_INTERNAL time_t mg_parse_date_string(const char *datetime) {
-  static const unsigned short days_before_month[] = {
-      0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
-  char month_str[32];
-  int second, minute, hour, day, month, year, leap_days, days;
-  time_t result = (time_t) 0;
+  mg_addenv(blk, "REQUEST_METHOD=%.*s", (int) hm->method.len, hm->method.p);
 
-  if (((sscanf(datetime, "%d/%3s/%d %d:%d:%d", &day, month_str, &year, &hour,
-               &minute, &second) == 6) ||
-       (sscanf(datetime, "%d %3s %d %d:%d:%d", &day, month_str, &year, &hour,
-               &minute, &second) == 6) ||
-       (sscanf(datetime, "%*3s, %d %3s %d %d:%d:%d", &day, month_str, &year,
-               &hour, &minute, &second) == 6) ||
-       (sscanf(datetime, "%d-%3s-%d %d:%d:%d", &day, month_str, &year, &hour,
-               &minute, &second) == 6)) &&
-      year > 1970 && (month = mg_get_month_index(month_str)) != -1) {
-    leap_days = mg_num_leap_years(year) - mg_num_leap_years(1970);
-    year -= 1970;
-    days = year * 365 + days_before_month[month] + (day - 1) + leap_days;
-    result = days * 24 * 3600 + hour * 3600 + minute * 60 + second;
-  }
+  mg_addenv(blk, "REQUEST_URI=%.*s%s%.*s", (int) hm->uri.len, hm->uri.p,
+            hm->query_string.len == 0 ? "" : "?", (int) hm->query_string.len,
+            hm->query_string.p);
 
-  return result;
-}
+  mg_conn_addr_to_str(nc, buf, sizeof(buf),
+                      MG_SOCK_STRINGIFY_REMOTE | MG_SOCK_STRINGIFY_IP);
+  mg_addenv(blk, "REMOTE_ADDR=%s", buf);
+  mg_conn_addr_to_str(nc, buf, sizeof(buf), MG_SOCK_STRINGIFY_PORT);
+  mg_addenv(blk, "SERVER_PORT=%s", buf);
 
-MG_INTERNAL int mg_is_not_modified(struct http_message *hm, cs_stat_t *st) {
-  struct mg_str *hdr;
-  if ((hdr = mg_get_http_header(hm, "If-None-Match")) != NULL) {
-    char etag[64];
-    mg_http_construct_etag(etag, sizeof(etag), st);
-    return mg_vcasecmp(hdr, etag) == 0;
-  } else if ((hdr = mg_get_http_header(hm, "If-Modified-Since")) != NULL) {
-    return st->st_mtime <= mg_parse_date_string(hdr->p);
+  s = hm->uri.p + hm->uri.len - path_info_len - 1;
+  if (*s == '/') {
+    const char *base_name = strrchr(prog, DIRSEP);
+    mg_addenv(blk, "SCRIPT_NAME=%.*s/%s", (int) (s - hm->uri.p), hm->uri.p,
+              (base_name != NULL ? base_name + 1 : prog));
   } else {
-    return 0;
+    mg_addenv(blk, "SCRIPT_NAME=%.*s", (int) (s - hm->uri.p + 1), hm->uri.p);
   }
-}
-
-void mg_http_send_digest_auth_request(struct mg_connection *c,
-                                      const char *domain) {
-  mg_printf(c,
-            "HTTP/1.1 401 Unauthorized\r\n"
-            "WWW-Authenticate: Digest qop=\"auth\", "
-            "realm=\"%s\", nonce=\"%lx\"\r\n"
-            "Content-Length: 0\r\n\r\n",
-            domain, (unsigned long) mg_time());
-}
-
-static void mg_http_send_options(struct mg_connection *nc) {
-  mg_printf(nc, "%s",
-            "HTTP/1.1 200 OK\r\nAllow: GET, POST, HEAD, CONNECT, OPTIONS"
-#if MG_ENABLE_HTTP_WEBDAV
-            ", MKCOL, PUT, DELETE, PROPFIND, MOVE\r\nDAV: 1,2"
-#endif
-            "\r\n\r\n");
-  nc->flags |= MG_F_SEND_AND_CLOSE;
-}
+  mg_addenv(blk, "SCRIPT_FILENAME=%s", prog);
 
-static int mg_is_creation_request(const struct http_message *hm) {
-  return mg_vcmp(&hm->method, "MKCOL") == 0 || mg_vcmp(&hm->method, "PUT") == 0;
-}
+  if (path_info != NULL && path_info->len > 0) {
+    mg_addenv(blk, "PATH_INFO=%.*s", (int) path_info->len, path_info->p);
+    /* Not really translated... */
+    mg_addenv(blk, "PATH_TRANSLATED=%.*s", (int) path_info->len, path_info->p);
+  }
 
-MG_INTERNAL void mg_send_http_file(struct mg_connection *nc, char *path,
-                                   const struct mg_str *path_info,
-                                   struct http_message *hm,
-                                   struct mg_serve_http_opts *opts) {
-  int exists, is_directory, is_cgi;
-#if MG_ENABLE_HTTP_WEBDAV
-  int is_dav = mg_is_dav_request(&hm->method);
+#if MG_ENABLE_SSL
+  mg_addenv(blk, "HTTPS=%s", (nc->flags & MG_F_SSL ? "on" : "off"));
 #else
-  int is_dav = 0;
+  mg_addenv(blk, "HTTPS=off");
 #endif
-  char *index_file = NULL;
-  cs_stat_t st;
-
-  exists = (mg_stat(path, &st) == 0);
-  is_directory = exists && S_ISDIR(st.st_mode);
-
-  if (is_directory)
-    mg_find_index_file(path, opts->index_files, &index_file, &st);
-
-  is_cgi =
-      (mg_match_prefix(opts->cgi_file_pattern, strlen(opts->cgi_file_pattern),
-                       index_file ? index_file : path) > 0);
 
-  LOG(LL_DEBUG,
-      ("%p %.*s [%s] exists=%d is_dir=%d is_dav=%d is_cgi=%d index=%s", nc,
-       (int) hm->method.len, hm->method.p, path, exists, is_directory, is_dav,
-       is_cgi, index_file ? index_file : ""));
+  if ((h = mg_get_http_header((struct http_message *) hm, "Content-Type")) !=
+      NULL) {
+    mg_addenv(blk, "CONTENT_TYPE=%.*s", (int) h->len, h->p);
+  }
 
-  if (is_directory && hm->uri.p[hm->uri.len - 1] != '/' && !is_dav) {
-    mg_printf(nc,
-              "HTTP/1.1 301 Moved\r\nLocation: %.*s/\r\n"
-              "Content-Length: 0\r\n\r\n",
-              (int) hm->uri.len, hm->uri.p);
-    MG_FREE(index_file);
-    return;
+  if (hm->query_string.len > 0) {
+    mg_addenv(blk, "QUERY_STRING=%.*s", (int) hm->query_string.len,
+              hm->query_string.p);
   }
 
-  /* If we have path_info, the only way to handle it is CGI. */
-  if (path_info->len > 0 && !is_cgi) {
-    mg_http_send_error(nc, 501, NULL);
-    MG_FREE(index_file);
-    return;
+  if ((h = mg_get_http_header((struct http_message *) hm, "Content-Length")) !=
+      NULL) {
+    mg_addenv(blk, "CONTENT_LENGTH=%.*s", (int) h->len, h->p);
   }
 
-  if (is_dav && opts->dav_document_root == NULL) {
-    mg_http_send_error(nc, 501, NULL);
-  } else if (!mg_http_is_authorized(
-                 hm, mg_mk_str(path), opts->auth_domain, opts->global_auth_file,
-                 ((is_directory ? MG_AUTH_FLAG_IS_DIRECTORY : 0) |
-                  MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE |
-                  MG_AUTH_FLAG_ALLOW_MISSING_FILE)) ||
-             !mg_http_is_authorized(
-                 hm, mg_mk_str(path), opts->auth_domain,
-                 opts->per_directory_auth_file,
-                 ((is_directory ? MG_AUTH_FLAG_IS_DIRECTORY : 0) |
-                  MG_AUTH_FLAG_ALLOW_MISSING_FILE))) {
-    mg_http_send_digest_auth_request(nc, opts->auth_domain);
-  } else if (is_cgi) {
-#if MG_ENABLE_HTTP_CGI
-    mg_handle_cgi(nc, index_file ? index_file : path, path_info, hm, opts);
+  mg_addenv2(blk, "PATH");
+  mg_addenv2(blk, "TMP");
+  mg_addenv2(blk, "TEMP");
+  mg_addenv2(blk, "TMPDIR");
+  mg_addenv2(blk, "PERLLIB");
+  mg_addenv2(blk, MG_ENV_EXPORT_TO_CGI);
+
+#ifdef _WIN32
+  mg_addenv2(blk, "COMSPEC");
+  mg_addenv2(blk, "SYSTEMROOT");
+  mg_addenv2(blk, "SystemDrive");
+  mg_addenv2(blk, "ProgramFiles");
+  mg_addenv2(blk, "ProgramFiles(x86)");
+  mg_addenv2(blk, "CommonProgramFiles(x86)");
 #else
-    mg_http_send_error(nc, 501, NULL);
-#endif /* MG_ENABLE_HTTP_CGI */
-  } else if ((!exists ||
-              mg_is_file_hidden(path, opts, 0 /* specials are ok */)) &&
-             !mg_is_creation_request(hm)) {
-    mg_http_send_error(nc, 404, NULL);
-#if MG_ENABLE_HTTP_WEBDAV
-  } else if (!mg_vcmp(&hm->method, "PROPFIND")) {
-    mg_handle_propfind(nc, path, &st, hm, opts);
-#if !MG_DISABLE_DAV_AUTH
-  } else if (is_dav &&
-             (opts->dav_auth_file == NULL ||
-              (strcmp(opts->dav_auth_file, "-") != 0 &&
-               !mg_http_is_authorized(
-                   hm, mg_mk_str(path), opts->auth_domain, opts->dav_auth_file,
-                   ((is_directory ? MG_AUTH_FLAG_IS_DIRECTORY : 0) |
-                    MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE |
-                    MG_AUTH_FLAG_ALLOW_MISSING_FILE))))) {
-    mg_http_send_digest_auth_request(nc, opts->auth_domain);
-#endif
-  } else if (!mg_vcmp(&hm->method, "MKCOL")) {
-    mg_handle_mkcol(nc, path, hm);
-  } else if (!mg_vcmp(&hm->method, "DELETE")) {
-    mg_handle_delete(nc, opts, path);
-  } else if (!mg_vcmp(&hm->method, "PUT")) {
-    mg_handle_put(nc, path, hm);
-  } else if (!mg_vcmp(&hm->method, "MOVE")) {
-    mg_handle_move(nc, opts, path, hm);
-#if MG_ENABLE_FAKE_DAVLOCK
-  } else if (!mg_vcmp(&hm->method, "LOCK")) {
-    mg_handle_lock(nc, path);
-#endif
-#endif /* MG_ENABLE_HTTP_WEBDAV */
-  } else if (!mg_vcmp(&hm->method, "OPTIONS")) {
-    mg_http_send_options(nc);
-  } else if (is_directory && index_file == NULL) {
-#if MG_ENABLE_DIRECTORY_LISTING
-    if (strcmp(opts->enable_directory_listing, "yes") == 0) {
-      mg_send_directory_listing(nc, path, hm, opts);
-    } else {
-      mg_http_send_error(nc, 403, NULL);
+  mg_addenv2(blk, "LD_LIBRARY_PATH");
+#endif /* _WIN32 */
+
+  /* Add all headers as HTTP_* variables */
+  for (i = 0; hm->header_names[i].len > 0; i++) {
+    p = mg_addenv(blk, "HTTP_%.*s=%.*s", (int) hm->header_names[i].len,
+                  hm->header_names[i].p, (int) hm->header_values[i].len,
+                  hm->header_values[i].p);
+
+    /* Convert variable name into uppercase, and change - to _ */
+    for (; *p != '=' && *p != '\0'; p++) {
+      if (*p == '-') *p = '_';
+      *p = (char) toupper(*(unsigned char *) p);
     }
-#else
-    mg_http_send_error(nc, 501, NULL);
-#endif
-  } else if (mg_is_not_modified(hm, &st)) {
-    mg_http_send_error(nc, 304, "Not Modified");
-  } else {
-    mg_http_serve_file2(nc, index_file ? index_file : path, hm, opts);
   }
-  MG_FREE(index_file);
+
+  blk->vars[blk->nvars++] = NULL;
+  blk->buf[blk->len++] = '\0';
 }
 
-void mg_serve_http(struct mg_connection *nc, struct http_message *hm,
-                   struct mg_serve_http_opts opts) {
-  char *path = NULL;
-  struct mg_str *hdr, path_info;
-  uint32_t remote_ip = ntohl(*(uint32_t *) &nc->sa.sin.sin_addr);
+static void mg_cgi_ev_handler(struct mg_connection *cgi_nc, int ev,
+                              void *ev_data MG_UD_ARG(void *user_data)) {
+#if !MG_ENABLE_CALLBACK_USERDATA
+  void *user_data = cgi_nc->user_data;
+#endif
+  struct mg_connection *nc = (struct mg_connection *) user_data;
+  (void) ev_data;
 
-  if (mg_check_ip_acl(opts.ip_acl, remote_ip) != 1) {
-    /* Not allowed to connect */
-    mg_http_send_error(nc, 403, NULL);
-    nc->flags |= MG_F_SEND_AND_CLOSE;
+  if (nc == NULL) {
+    /* The corresponding network connection was closed. */
+    cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
     return;
   }
 
-#if MG_ENABLE_HTTP_URL_REWRITES
-  if (mg_http_handle_forwarding(nc, hm, &opts)) {
-    return;
-  }
+  switch (ev) {
+    case MG_EV_RECV:
+      /*
+       * CGI script does not output reply line, like "HTTP/1.1 CODE XXXXX\n"
+       * It outputs headers, then body. Headers might include "Status"
+       * header, which changes CODE, and it might include "Location" header
+       * which changes CODE to 302.
+       *
+       * Therefore we do not send the output from the CGI script to the user
+       * until all CGI headers are received.
+       *
+       * Here we parse the output from the CGI script, and if all headers has
+       * been received, send appropriate reply line, and forward all
+       * received headers to the client.
+       */
+      if (nc->flags & MG_F_HTTP_CGI_PARSE_HEADERS) {
+        struct mbuf *io = &cgi_nc->recv_mbuf;
+        int len = mg_http_get_request_len(io->buf, io->len);
 
-  if (mg_http_send_port_based_redirect(nc, hm, &opts)) {
-    return;
+        if (len == 0) break;
+        if (len < 0 || io->len > MG_MAX_HTTP_REQUEST_SIZE) {
+          cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+          mg_http_send_error(nc, 500, "Bad headers");
+        } else {
+          struct http_message hm;
+          struct mg_str *h;
+          mg_http_parse_headers(io->buf, io->buf + io->len, io->len, &hm);
+          if (mg_get_http_header(&hm, "Location") != NULL) {
+            mg_printf(nc, "%s", "HTTP/1.1 302 Moved\r\n");
+          } else if ((h = mg_get_http_header(&hm, "Status")) != NULL) {
+            mg_printf(nc, "HTTP/1.1 %.*s\r\n", (int) h->len, h->p);
+          } else {
+            mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\n");
+          }
+        }
+        nc->flags &= ~MG_F_HTTP_CGI_PARSE_HEADERS;
+      }
+      if (!(nc->flags & MG_F_HTTP_CGI_PARSE_HEADERS)) {
+        mg_forward(cgi_nc, nc);
+      }
+      break;
+    case MG_EV_CLOSE:
+      DBG(("%p CLOSE", cgi_nc));
+      mg_http_free_proto_data_cgi(&mg_http_get_proto_data(nc)->cgi);
+      nc->flags |= MG_F_SEND_AND_CLOSE;
+      break;
   }
-#endif
+}
 
-  if (opts.document_root == NULL) {
-    opts.document_root = ".";
-  }
-  if (opts.per_directory_auth_file == NULL) {
-    opts.per_directory_auth_file = ".htpasswd";
-  }
-  if (opts.enable_directory_listing == NULL) {
-    opts.enable_directory_listing = "yes";
-  }
-  if (opts.cgi_file_pattern == NULL) {
-    opts.cgi_file_pattern = "**.cgi$|**.php$";
-  }
-  if (opts.ssi_pattern == NULL) {
-    opts.ssi_pattern = "**.shtml$|**.shtm$";
-  }
-  if (opts.index_files == NULL) {
-    opts.index_files = "index.html,index.htm,index.shtml,index.cgi,index.php";
-  }
-  /* Normalize path - resolve "." and ".." (in-place). */
-  if (!mg_normalize_uri_path(&hm->uri, &hm->uri)) {
-    mg_http_send_error(nc, 400, NULL);
-    return;
+MG_INTERNAL void mg_handle_cgi(struct mg_connection *nc, const char *prog,
+                               const struct mg_str *path_info,
+                               const struct http_message *hm,
+                               const struct mg_serve_http_opts *opts) {
+  struct mg_cgi_env_block blk;
+  char dir[MG_MAX_PATH];
+  const char *p;
+  sock_t fds[2];
+
+  DBG(("%p [%s]", nc, prog));
+  mg_prepare_cgi_environment(nc, prog, path_info, hm, opts, &blk);
+  /*
+   * CGI must be executed in its own directory. 'dir' must point to the
+   * directory containing executable program, 'p' must point to the
+   * executable program name relative to 'dir'.
+   */
+  if ((p = strrchr(prog, DIRSEP)) == NULL) {
+    snprintf(dir, sizeof(dir), "%s", ".");
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", (int) (p - prog), prog);
+    prog = p + 1;
   }
-  if (mg_uri_to_local_path(hm, &opts, &path, &path_info) == 0) {
-    mg_http_send_error(nc, 404, NULL);
+
+  if (!mg_socketpair(fds, SOCK_STREAM)) {
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
     return;
   }
-  mg_send_http_file(nc, path, &path_info, hm, &opts);
 
-  MG_FREE(path);
-  path = NULL;
+#ifndef _WIN32
+  struct sigaction sa;
 
-  /* Close connection for non-keep-alive requests */
-  if (mg_vcmp(&hm->proto, "HTTP/1.1") != 0 ||
-      ((hdr = mg_get_http_header(hm, "Connection")) != NULL &&
-       mg_vcmp(hdr, "keep-alive") != 0)) {
-#if 0
-    nc->flags |= MG_F_SEND_AND_CLOSE;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = 0;
+  sigaction(SIGCHLD, &sa, NULL);
 #endif
-  }
-}
 
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-void mg_file_upload_handler(struct mg_connection *nc, int ev, void *ev_data,
-                            mg_fu_fname_fn local_name_fn
-                                MG_UD_ARG(void *user_data)) {
-  switch (ev) {
-    case MG_EV_HTTP_PART_BEGIN: {
-      struct mg_http_multipart_part *mp =
-          (struct mg_http_multipart_part *) ev_data;
-      struct file_upload_state *fus =
-          (struct file_upload_state *) MG_CALLOC(1, sizeof(*fus));
-      struct mg_str lfn = local_name_fn(nc, mg_mk_str(mp->file_name));
-      mp->user_data = NULL;
-      if (lfn.p == NULL || lfn.len == 0) {
-        LOG(LL_ERROR, ("%p Not allowed to upload %s", nc, mp->file_name));
-        mg_printf(nc,
-                  "HTTP/1.1 403 Not Allowed\r\n"
-                  "Content-Type: text/plain\r\n"
-                  "Connection: close\r\n\r\n"
-                  "Not allowed to upload %s\r\n",
-                  mp->file_name);
-        nc->flags |= MG_F_SEND_AND_CLOSE;
-        return;
-      }
-      fus->lfn = (char *) MG_MALLOC(lfn.len + 1);
-      memcpy(fus->lfn, lfn.p, lfn.len);
-      fus->lfn[lfn.len] = '\0';
-      if (lfn.p != mp->file_name) MG_FREE((char *) lfn.p);
-      LOG(LL_DEBUG,
-          ("%p Receiving file %s -> %s", nc, mp->file_name, fus->lfn));
-      fus->fp = mg_fopen(fus->lfn, "w");
-      if (fus->fp == NULL) {
-        mg_printf(nc,
-                  "HTTP/1.1 500 Internal Server Error\r\n"
-                  "Content-Type: text/plain\r\n"
-                  "Connection: close\r\n\r\n");
-        LOG(LL_ERROR, ("Failed to open %s: %d\n", fus->lfn, mg_get_errno()));
-        mg_printf(nc, "Failed to open %s: %d\n", fus->lfn, mg_get_errno());
-        /* Do not close the connection just yet, discard remainder of the data.
-         * This is because at the time of writing some browsers (Chrome) fail to
-         * render response before all the data is sent. */
-      }
-      mp->user_data = (void *) fus;
-      break;
-    }
-    case MG_EV_HTTP_PART_DATA: {
-      struct mg_http_multipart_part *mp =
-          (struct mg_http_multipart_part *) ev_data;
-      struct file_upload_state *fus =
-          (struct file_upload_state *) mp->user_data;
-      if (fus == NULL || fus->fp == NULL) break;
-      if (mg_fwrite(mp->data.p, 1, mp->data.len, fus->fp) != mp->data.len) {
-        LOG(LL_ERROR, ("Failed to write to %s: %d, wrote %d", fus->lfn,
-                       mg_get_errno(), (int) fus->num_recd));
-        if (mg_get_errno() == ENOSPC
-#ifdef SPIFFS_ERR_FULL
-            || mg_get_errno() == SPIFFS_ERR_FULL
+  if (mg_start_process(opts->cgi_interpreter, prog, blk.buf, blk.vars, dir,
+                       fds[1]) != 0) {
+    size_t n = nc->recv_mbuf.len - (hm->message.len - hm->body.len);
+    struct mg_connection *cgi_nc =
+        mg_add_sock(nc->mgr, fds[0], mg_cgi_ev_handler MG_UD_ARG(nc));
+    struct mg_http_proto_data *cgi_pd = mg_http_get_proto_data(nc);
+    cgi_pd->cgi.cgi_nc = cgi_nc;
+#if !MG_ENABLE_CALLBACK_USERDATA
+    cgi_pd->cgi.cgi_nc->user_data = nc;
 #endif
-            ) {
-          mg_printf(nc,
-                    "HTTP/1.1 413 Payload Too Large\r\n"
-                    "Content-Type: text/plain\r\n"
-                    "Connection: close\r\n\r\n");
-          mg_printf(nc, "Failed to write to %s: no space left; wrote %d\r\n",
-                    fus->lfn, (int) fus->num_recd);
-        } else {
-          mg_printf(nc,
-                    "HTTP/1.1 500 Internal Server Error\r\n"
-                    "Content-Type: text/plain\r\n"
-                    "Connection: close\r\n\r\n");
-          mg_printf(nc, "Failed to write to %s: %d, wrote %d", mp->file_name,
-                    mg_get_errno(), (int) fus->num_recd);
-        }
-        fclose(fus->fp);
-        remove(fus->lfn);
-        fus->fp = NULL;
-        /* Do not close the connection just yet, discard remainder of the data.
-         * This is because at the time of writing some browsers (Chrome) fail to
-         * render response before all the data is sent. */
-        return;
-      }
-      fus->num_recd += mp->data.len;
-      LOG(LL_DEBUG, ("%p rec'd %d bytes, %d total", nc, (int) mp->data.len,
-                     (int) fus->num_recd));
-      break;
-    }
-    case MG_EV_HTTP_PART_END: {
-      struct mg_http_multipart_part *mp =
-          (struct mg_http_multipart_part *) ev_data;
-      struct file_upload_state *fus =
-          (struct file_upload_state *) mp->user_data;
-      if (fus == NULL) break;
-      if (mp->status >= 0 && fus->fp != NULL) {
-        LOG(LL_DEBUG, ("%p Uploaded %s (%s), %d bytes", nc, mp->file_name,
-                       fus->lfn, (int) fus->num_recd));
-        mg_printf(nc,
-                  "HTTP/1.1 200 OK\r\n"
-                  "Content-Type: text/plain\r\n"
-                  "Connection: close\r\n\r\n"
-                  "Ok, %s - %d bytes.\r\n",
-                  mp->file_name, (int) fus->num_recd);
-      } else {
-        LOG(LL_ERROR, ("Failed to store %s (%s)", mp->file_name, fus->lfn));
-        /*
-         * mp->status < 0 means connection was terminated, so no reason to send
-         * HTTP reply
-         */
-      }
-      if (fus->fp != NULL) fclose(fus->fp);
-      MG_FREE(fus->lfn);
-      MG_FREE(fus);
-      mp->user_data = NULL;
-      nc->flags |= MG_F_SEND_AND_CLOSE;
-      break;
+    nc->flags |= MG_F_HTTP_CGI_PARSE_HEADERS;
+    /* Push POST data to the CGI */
+    if (n > 0 && n < nc->recv_mbuf.len) {
+      mg_send(cgi_pd->cgi.cgi_nc, hm->body.p, n);
     }
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else {
+    closesocket(fds[0]);
+    mg_http_send_error(nc, 500, "CGI failure");
   }
 
-#if MG_ENABLE_CALLBACK_USERDATA
-  (void) user_data;
+#ifndef _WIN32
+  closesocket(fds[1]); /* On Windows, CGI stdio thread closes that socket */
 #endif
 }
 
-#endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
-#endif /* MG_ENABLE_FILESYSTEM */
+MG_INTERNAL void mg_http_free_proto_data_cgi(struct mg_http_proto_data_cgi *d) {
+  if (d == NULL) return;
+  if (d->cgi_nc != NULL) {
+    d->cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    mg_mark_closing(d->cgi_nc);
+    d->cgi_nc->user_data = NULL;
+  }
+  memset(d, 0, sizeof(*d));
+}
 
-struct mg_connection *mg_connect_http_base(
-    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
-    struct mg_connect_opts opts, const char *scheme1, const char *scheme2,
-    const char *scheme_ssl1, const char *scheme_ssl2, const char *url,
-    struct mg_str *path, struct mg_str *user_info, struct mg_str *host) {
-  struct mg_connection *nc = NULL;
-  unsigned int port_i = 0;
-  int use_ssl = 0;
-  struct mg_str scheme, query, fragment;
-  char conn_addr_buf[2];
-  char *conn_addr = conn_addr_buf;
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_CGI */
 
-  if (mg_parse_uri(mg_mk_str(url), &scheme, user_info, host, &port_i, path,
-                   &query, &fragment) != 0) {
-    MG_SET_PTRPTR(opts.error_string, "cannot parse url");
-    goto out;
-  }
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http_ssi.c"
+#endif
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ */
 
-  /* If query is present, do not strip it. Pass to the caller. */
-  if (query.len > 0) path->len += query.len + 1;
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
 
-  if (scheme.len == 0 || mg_vcmp(&scheme, scheme1) == 0 ||
-      (scheme2 != NULL && mg_vcmp(&scheme, scheme2) == 0)) {
-    use_ssl = 0;
-    if (port_i == 0) port_i = 80;
-  } else if (mg_vcmp(&scheme, scheme_ssl1) == 0 ||
-             (scheme2 != NULL && mg_vcmp(&scheme, scheme_ssl2) == 0)) {
-    use_ssl = 1;
-    if (port_i == 0) port_i = 443;
-  } else {
-    goto out;
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_SSI && MG_ENABLE_FILESYSTEM
+
+static void mg_send_ssi_file(struct mg_connection *nc, struct http_message *hm,
+                             const char *path, FILE *fp, int include_level,
+                             const struct mg_serve_http_opts *opts);
+
+static void mg_send_file_data(struct mg_connection *nc, FILE *fp) {
+  char buf[BUFSIZ];
+  size_t n;
+  while ((n = mg_fread(buf, 1, sizeof(buf), fp)) > 0) {
+    mg_send(nc, buf, n);
   }
+}
 
-  mg_asprintf(&conn_addr, sizeof(conn_addr_buf), "tcp://%.*s:%u",
-              (int) host->len, host->p, port_i);
-  if (conn_addr == NULL) goto out;
+static void mg_do_ssi_include(struct mg_connection *nc, struct http_message *hm,
+                              const char *ssi, char *tag, int include_level,
+                              const struct mg_serve_http_opts *opts) {
+  char file_name[MG_MAX_PATH], path[MG_MAX_PATH], *p;
+  FILE *fp;
 
-  LOG(LL_DEBUG, ("%s use_ssl? %d %s", url, use_ssl, conn_addr));
-  if (use_ssl) {
-#if MG_ENABLE_SSL
+  /*
+   * sscanf() is safe here, since send_ssi_file() also uses buffer
+   * of size MG_BUF_LEN to get the tag. So strlen(tag) is always < MG_BUF_LEN.
+   */
+  if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
+    /* File name is relative to the webserver root */
+    snprintf(path, sizeof(path), "%s/%s", opts->document_root, file_name);
+  } else if (sscanf(tag, " abspath=\"%[^\"]\"", file_name) == 1) {
     /*
-     * Schema requires SSL, but no SSL parameters were provided in opts.
-     * In order to maintain backward compatibility, use a faux-SSL with no
-     * verification.
+     * File name is relative to the webserver working directory
+     * or it is absolute system path
      */
-    if (opts.ssl_ca_cert == NULL) {
-      opts.ssl_ca_cert = "*";
+    snprintf(path, sizeof(path), "%s", file_name);
+  } else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1 ||
+             sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
+    /* File name is relative to the currect document */
+    snprintf(path, sizeof(path), "%s", ssi);
+    if ((p = strrchr(path, DIRSEP)) != NULL) {
+      p[1] = '\0';
     }
-#else
-    MG_SET_PTRPTR(opts.error_string, "ssl is disabled");
-    goto out;
-#endif
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", file_name);
+  } else {
+    mg_printf(nc, "Bad SSI #include: [%s]", tag);
+    return;
   }
 
-  if ((nc = mg_connect_opt(mgr, conn_addr, MG_CB(ev_handler, user_data),
-                           opts)) != NULL) {
-    mg_set_protocol_http_websocket(nc);
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    mg_printf(nc, "SSI include error: mg_fopen(%s): %s", path,
+              strerror(mg_get_errno()));
+  } else {
+    mg_set_close_on_exec((sock_t) fileno(fp));
+    if (mg_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern), path) >
+        0) {
+      mg_send_ssi_file(nc, hm, path, fp, include_level + 1, opts);
+    } else {
+      mg_send_file_data(nc, fp);
+    }
+    fclose(fp);
   }
-
-out:
-  if (conn_addr != NULL && conn_addr != conn_addr_buf) MG_FREE(conn_addr);
-  return nc;
 }
 
-struct mg_connection *mg_connect_http_opt(
-    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
-    struct mg_connect_opts opts, const char *url, const char *extra_headers,
-    const char *post_data) {
-  struct mg_str user = MG_NULL_STR, null_str = MG_NULL_STR;
-  struct mg_str host = MG_NULL_STR, path = MG_NULL_STR;
-  struct mbuf auth;
-  struct mg_connection *nc =
-      mg_connect_http_base(mgr, MG_CB(ev_handler, user_data), opts, "http",
-                           NULL, "https", NULL, url, &path, &user, &host);
-
-  if (nc == NULL) {
-    return NULL;
-  }
+#if MG_ENABLE_HTTP_SSI_EXEC
+static void do_ssi_exec(struct mg_connection *nc, char *tag) {
+  char cmd[BUFSIZ];
+  FILE *fp;
 
-  mbuf_init(&auth, 0);
-  if (user.len > 0) {
-    mg_basic_auth_header(user, null_str, &auth);
+  if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
+    mg_printf(nc, "Bad SSI #exec: [%s]", tag);
+  } else if ((fp = popen(cmd, "r")) == NULL) {
+    mg_printf(nc, "Cannot SSI #exec: [%s]: %s", cmd, strerror(mg_get_errno()));
+  } else {
+    mg_send_file_data(nc, fp);
+    pclose(fp);
   }
-
-  if (post_data == NULL) post_data = "";
-  if (extra_headers == NULL) extra_headers = "";
-  if (path.len == 0) path = mg_mk_str("/");
-  if (host.len == 0) host = mg_mk_str("");
-
-  mg_printf(nc, "%s %.*s HTTP/1.1\r\nHost: %.*s\r\nContent-Length: %" SIZE_T_FMT
-                "\r\n%.*s%s\r\n%s",
-            (post_data[0] == '\0' ? "GET" : "POST"), (int) path.len, path.p,
-            (int) (path.p - host.p), host.p, strlen(post_data), (int) auth.len,
-            (auth.buf == NULL ? "" : auth.buf), extra_headers, post_data);
-
-  mbuf_free(&auth);
-  return nc;
 }
+#endif /* MG_ENABLE_HTTP_SSI_EXEC */
 
-struct mg_connection *mg_connect_http(
-    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
-    const char *url, const char *extra_headers, const char *post_data) {
-  struct mg_connect_opts opts;
-  memset(&opts, 0, sizeof(opts));
-  return mg_connect_http_opt(mgr, MG_CB(ev_handler, user_data), opts, url,
-                             extra_headers, post_data);
-}
+/*
+ * SSI directive has the following format:
+ * <!--#directive parameter=value parameter=value -->
+ */
+static void mg_send_ssi_file(struct mg_connection *nc, struct http_message *hm,
+                             const char *path, FILE *fp, int include_level,
+                             const struct mg_serve_http_opts *opts) {
+  static const struct mg_str btag = MG_MK_STR("<!--#");
+  static const struct mg_str d_include = MG_MK_STR("include");
+  static const struct mg_str d_call = MG_MK_STR("call");
+#if MG_ENABLE_HTTP_SSI_EXEC
+  static const struct mg_str d_exec = MG_MK_STR("exec");
+#endif
+  char buf[BUFSIZ], *p = buf + btag.len; /* p points to SSI directive */
+  int ch, len, in_ssi_tag;
 
-size_t mg_parse_multipart(const char *buf, size_t buf_len, char *var_name,
-                          size_t var_name_len, char *file_name,
-                          size_t file_name_len, const char **data,
-                          size_t *data_len) {
-  static const char cd[] = "Content-Disposition: ";
-  size_t hl, bl, n, ll, pos, cdl = sizeof(cd) - 1;
-  int shl;
+  if (include_level > 10) {
+    mg_printf(nc, "SSI #include level is too deep (%s)", path);
+    return;
+  }
 
-  if (buf == NULL || buf_len <= 0) return 0;
-  if ((shl = mg_http_get_request_len(buf, buf_len)) <= 0) return 0;
-  hl = shl;
-  if (buf[0] != '-' || buf[1] != '-' || buf[2] == '\n') return 0;
+  in_ssi_tag = len = 0;
+  while ((ch = fgetc(fp)) != EOF) {
+    if (in_ssi_tag && ch == '>' && buf[len - 1] == '-' && buf[len - 2] == '-') {
+      size_t i = len - 2;
+      in_ssi_tag = 0;
 
-  /* Get boundary length */
-  bl = mg_get_line_len(buf, buf_len);
+      /* Trim closing --> */
+      buf[i--] = '\0';
+      while (i > 0 && buf[i] == ' ') {
+        buf[i--] = '\0';
+      }
 
-  /* Loop through headers, fetch variable name and file name */
-  var_name[0] = file_name[0] = '\0';
-  for (n = bl; (ll = mg_get_line_len(buf + n, hl - n)) > 0; n += ll) {
-    if (mg_ncasecmp(cd, buf + n, cdl) == 0) {
-      struct mg_str header;
-      header.p = buf + n + cdl;
-      header.len = ll - (cdl + 2);
-      {
-        char *var_name2 = var_name;
-        mg_http_parse_header2(&header, "name", &var_name2, var_name_len);
-        /* TODO: handle reallocated buffer correctly */
-        if (var_name2 != var_name) {
-          MG_FREE(var_name2);
-          var_name[0] = '\0';
-        }
+      /* Handle known SSI directives */
+      if (strncmp(p, d_include.p, d_include.len) == 0) {
+        mg_do_ssi_include(nc, hm, path, p + d_include.len + 1, include_level,
+                          opts);
+      } else if (strncmp(p, d_call.p, d_call.len) == 0) {
+        struct mg_ssi_call_ctx cctx;
+        memset(&cctx, 0, sizeof(cctx));
+        cctx.req = hm;
+        cctx.file = mg_mk_str(path);
+        cctx.arg = mg_mk_str(p + d_call.len + 1);
+        mg_call(nc, NULL, nc->user_data, MG_EV_SSI_CALL,
+                (void *) cctx.arg.p); /* NUL added above */
+        mg_call(nc, NULL, nc->user_data, MG_EV_SSI_CALL_CTX, &cctx);
+#if MG_ENABLE_HTTP_SSI_EXEC
+      } else if (strncmp(p, d_exec.p, d_exec.len) == 0) {
+        do_ssi_exec(nc, p + d_exec.len + 1);
+#endif
+      } else {
+        /* Silently ignore unknown SSI directive. */
+      }
+      len = 0;
+    } else if (ch == '<') {
+      in_ssi_tag = 1;
+      if (len > 0) {
+        mg_send(nc, buf, (size_t) len);
       }
-      {
-        char *file_name2 = file_name;
-        mg_http_parse_header2(&header, "filename", &file_name2, file_name_len);
-        /* TODO: handle reallocated buffer correctly */
-        if (file_name2 != file_name) {
-          MG_FREE(file_name2);
-          file_name[0] = '\0';
-        }
+      len = 0;
+      buf[len++] = ch & 0xff;
+    } else if (in_ssi_tag) {
+      if (len == (int) btag.len && strncmp(buf, btag.p, btag.len) != 0) {
+        /* Not an SSI tag */
+        in_ssi_tag = 0;
+      } else if (len == (int) sizeof(buf) - 2) {
+        mg_printf(nc, "%s: SSI tag is too large", path);
+        len = 0;
+      }
+      buf[len++] = ch & 0xff;
+    } else {
+      buf[len++] = ch & 0xff;
+      if (len == (int) sizeof(buf)) {
+        mg_send(nc, buf, (size_t) len);
+        len = 0;
       }
     }
   }
 
-  /* Scan through the body, search for terminating boundary */
-  for (pos = hl; pos + (bl - 2) < buf_len; pos++) {
-    if (buf[pos] == '-' && !strncmp(buf, &buf[pos], bl - 2)) {
-      if (data_len != NULL) *data_len = (pos - 2) - hl;
-      if (data != NULL) *data = buf + hl;
-      return pos;
-    }
+  /* Send the rest of buffered data */
+  if (len > 0) {
+    mg_send(nc, buf, (size_t) len);
   }
-
-  return 0;
 }
 
-void mg_register_http_endpoint_opt(struct mg_connection *nc,
-                                   const char *uri_path,
-                                   mg_event_handler_t handler,
-                                   struct mg_http_endpoint_opts opts) {
-  struct mg_http_proto_data *pd = NULL;
-  struct mg_http_endpoint *new_ep = NULL;
-
-  if (nc == NULL) return;
-  new_ep = (struct mg_http_endpoint *) MG_CALLOC(1, sizeof(*new_ep));
-  if (new_ep == NULL) return;
-
-  pd = mg_http_get_proto_data(nc);
-  new_ep->uri_pattern = mg_strdup(mg_mk_str(uri_path));
-  if (opts.auth_domain != NULL && opts.auth_file != NULL) {
-    new_ep->auth_domain = strdup(opts.auth_domain);
-    new_ep->auth_file = strdup(opts.auth_file);
-  }
-  new_ep->handler = handler;
-#if MG_ENABLE_CALLBACK_USERDATA
-  new_ep->user_data = opts.user_data;
-#endif
-  new_ep->next = pd->endpoints;
-  pd->endpoints = new_ep;
-}
+MG_INTERNAL void mg_handle_ssi_request(struct mg_connection *nc,
+                                       struct http_message *hm,
+                                       const char *path,
+                                       const struct mg_serve_http_opts *opts) {
+  FILE *fp;
+  struct mg_str mime_type;
+  DBG(("%p %s", nc, path));
 
-static void mg_http_call_endpoint_handler(struct mg_connection *nc, int ev,
-                                          struct http_message *hm) {
-  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  void *user_data = nc->user_data;
+  if ((fp = mg_fopen(path, "rb")) == NULL) {
+    mg_http_send_error(nc, 404, NULL);
+  } else {
+    mg_set_close_on_exec((sock_t) fileno(fp));
 
-  if (ev == MG_EV_HTTP_REQUEST
-#if MG_ENABLE_HTTP_STREAMING_MULTIPART
-      || ev == MG_EV_HTTP_MULTIPART_REQUEST
-#endif
-      ) {
-    struct mg_http_endpoint *ep =
-        mg_http_get_endpoint_handler(nc->listener, &hm->uri);
-    if (ep != NULL) {
-#if MG_ENABLE_FILESYSTEM && !MG_DISABLE_HTTP_DIGEST_AUTH
-      if (!mg_http_is_authorized(hm, hm->uri, ep->auth_domain, ep->auth_file,
-                                 MG_AUTH_FLAG_IS_GLOBAL_PASS_FILE)) {
-        mg_http_send_digest_auth_request(nc, ep->auth_domain);
-        return;
-      }
-#endif
-      pd->endpoint_handler = ep->handler;
-#if MG_ENABLE_CALLBACK_USERDATA
-      user_data = ep->user_data;
-#endif
-    }
+    mime_type = mg_get_mime_type(path, "text/plain", opts);
+    mg_send_response_line(nc, 200, opts->extra_headers);
+    mg_printf(nc,
+              "Content-Type: %.*s\r\n"
+              "Connection: close\r\n\r\n",
+              (int) mime_type.len, mime_type.p);
+    mg_send_ssi_file(nc, hm, path, fp, 0, opts);
+    fclose(fp);
+    nc->flags |= MG_F_SEND_AND_CLOSE;
   }
-  mg_call(nc, pd->endpoint_handler ? pd->endpoint_handler : nc->handler,
-          user_data, ev, hm);
 }
 
-void mg_register_http_endpoint(struct mg_connection *nc, const char *uri_path,
-                               MG_CB(mg_event_handler_t handler,
-                                     void *user_data)) {
-  struct mg_http_endpoint_opts opts;
-  memset(&opts, 0, sizeof(opts));
-#if MG_ENABLE_CALLBACK_USERDATA
-  opts.user_data = user_data;
-#endif
-  mg_register_http_endpoint_opt(nc, uri_path, handler, opts);
-}
+#endif /* MG_ENABLE_HTTP_SSI && MG_ENABLE_HTTP && MG_ENABLE_FILESYSTEM */
 
-#endif /* MG_ENABLE_HTTP */
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_http_cgi.c"
+#line 1 "mongoose/src/mg_http_webdav.c"
 #endif
 /*
  * Copyright (c) 2014-2016 Cesanta Software Limited
  * All rights reserved
  */
 
-#ifndef _WIN32
-#include <signal.h>
-#endif
-
-#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_CGI
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
 
-#ifndef MG_MAX_CGI_ENVIR_VARS
-#define MG_MAX_CGI_ENVIR_VARS 64
-#endif
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBDAV
 
-#ifndef MG_ENV_EXPORT_TO_CGI
-#define MG_ENV_EXPORT_TO_CGI "MONGOOSE_CGI"
+MG_INTERNAL int mg_is_dav_request(const struct mg_str *s) {
+  static const char *methods[] = {
+    "PUT",
+    "DELETE",
+    "MKCOL",
+    "PROPFIND",
+    "MOVE"
+#if MG_ENABLE_FAKE_DAVLOCK
+    ,
+    "LOCK",
+    "UNLOCK"
 #endif
+  };
+  size_t i;
 
-#define MG_F_HTTP_CGI_PARSE_HEADERS MG_F_USER_1
-
-/*
- * This structure helps to create an environment for the spawned CGI program.
- * Environment is an array of "VARIABLE=VALUE\0" ASCIIZ strings,
- * last element must be NULL.
- * However, on Windows there is a requirement that all these VARIABLE=VALUE\0
- * strings must reside in a contiguous buffer. The end of the buffer is
- * marked by two '\0' characters.
- * We satisfy both worlds: we create an envp array (which is vars), all
- * entries are actually pointers inside buf.
- */
-struct mg_cgi_env_block {
-  struct mg_connection *nc;
-  char buf[MG_CGI_ENVIRONMENT_SIZE];       /* Environment buffer */
-  const char *vars[MG_MAX_CGI_ENVIR_VARS]; /* char *envp[] */
-  int len;                                 /* Space taken */
-  int nvars;                               /* Number of variables in envp[] */
-};
-
-#ifdef _WIN32
-struct mg_threadparam {
-  sock_t s;
-  HANDLE hPipe;
-};
+  for (i = 0; i < ARRAY_SIZE(methods); i++) {
+    if (mg_vcmp(s, methods[i]) == 0) {
+      return 1;
+    }
+  }
 
-static int mg_wait_until_ready(sock_t sock, int for_read) {
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(sock, &set);
-  return select(sock + 1, for_read ? &set : 0, for_read ? 0 : &set, 0, 0) == 1;
+  return 0;
 }
 
-static void *mg_push_to_stdin(void *arg) {
-  struct mg_threadparam *tp = (struct mg_threadparam *) arg;
-  int n, sent, stop = 0;
-  DWORD k;
-  char buf[BUFSIZ];
+static int mg_mkdir(const char *path, uint32_t mode) {
+#ifndef _WIN32
+  return mkdir(path, mode);
+#else
+  (void) mode;
+  return _mkdir(path);
+#endif
+}
 
-  while (!stop && mg_wait_until_ready(tp->s, 1) &&
-         (n = recv(tp->s, buf, sizeof(buf), 0)) > 0) {
-    if (n == -1 && GetLastError() == WSAEWOULDBLOCK) continue;
-    for (sent = 0; !stop && sent < n; sent += k) {
-      if (!WriteFile(tp->hPipe, buf + sent, n - sent, &k, 0)) stop = 1;
-    }
-  }
-  DBG(("%s", "FORWARED EVERYTHING TO CGI"));
-  CloseHandle(tp->hPipe);
-  MG_FREE(tp);
-  return NULL;
+static void mg_print_props(struct mg_connection *nc, const char *name,
+                           cs_stat_t *stp) {
+  char mtime[64];
+  time_t t = stp->st_mtime; /* store in local variable for NDK compile */
+  struct mg_str name_esc = mg_url_encode(mg_mk_str(name));
+  mg_gmt_time_string(mtime, sizeof(mtime), &t);
+  mg_printf(nc,
+            "<d:response>"
+            "<d:href>%s</d:href>"
+            "<d:propstat>"
+            "<d:prop>"
+            "<d:resourcetype>%s</d:resourcetype>"
+            "<d:getcontentlength>%" INT64_FMT
+            "</d:getcontentlength>"
+            "<d:getlastmodified>%s</d:getlastmodified>"
+            "</d:prop>"
+            "<d:status>HTTP/1.1 200 OK</d:status>"
+            "</d:propstat>"
+            "</d:response>\n",
+            name_esc.p, S_ISDIR(stp->st_mode) ? "<d:collection/>" : "",
+            (int64_t) stp->st_size, mtime);
+  free((void *) name_esc.p);
 }
 
-static void *mg_pull_from_stdout(void *arg) {
-  struct mg_threadparam *tp = (struct mg_threadparam *) arg;
-  int k = 0, stop = 0;
-  DWORD n, sent;
-  char buf[BUFSIZ];
+MG_INTERNAL void mg_handle_propfind(struct mg_connection *nc, const char *path,
+                                    cs_stat_t *stp, struct http_message *hm,
+                                    struct mg_serve_http_opts *opts) {
+  static const char header[] =
+      "HTTP/1.1 207 Multi-Status\r\n"
+      "Connection: close\r\n"
+      "Content-Type: text/xml; charset=utf-8\r\n\r\n"
+      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+      "<d:multistatus xmlns:d='DAV:'>\n";
+  static const char footer[] = "</d:multistatus>\n";
+  const struct mg_str *depth = mg_get_http_header(hm, "Depth");
 
-  while (!stop && ReadFile(tp->hPipe, buf, sizeof(buf), &n, NULL)) {
-    for (sent = 0; !stop && sent < n; sent += k) {
-      if (mg_wait_until_ready(tp->s, 0) &&
-          (k = send(tp->s, buf + sent, n - sent, 0)) <= 0)
-        stop = 1;
+  /* Print properties for the requested resource itself */
+  if (S_ISDIR(stp->st_mode) &&
+      strcmp(opts->enable_directory_listing, "yes") != 0) {
+    mg_printf(nc, "%s", "HTTP/1.1 403 Directory Listing Denied\r\n\r\n");
+  } else {
+    char uri[MG_MAX_PATH];
+    mg_send(nc, header, sizeof(header) - 1);
+    snprintf(uri, sizeof(uri), "%.*s", (int) hm->uri.len, hm->uri.p);
+    mg_print_props(nc, uri, stp);
+    if (S_ISDIR(stp->st_mode) && (depth == NULL || mg_vcmp(depth, "0") != 0)) {
+      mg_scan_directory(nc, path, opts, mg_print_props);
     }
+    mg_send(nc, footer, sizeof(footer) - 1);
+    nc->flags |= MG_F_SEND_AND_CLOSE;
   }
-  DBG(("%s", "EOF FROM CGI"));
-  CloseHandle(tp->hPipe);
-  shutdown(tp->s, 2);  // Without this, IO thread may get truncated data
-  closesocket(tp->s);
-  MG_FREE(tp);
-  return NULL;
 }
 
-static void mg_spawn_stdio_thread(sock_t sock, HANDLE hPipe,
-                                  void *(*func)(void *)) {
-  struct mg_threadparam *tp = (struct mg_threadparam *) MG_MALLOC(sizeof(*tp));
-  if (tp != NULL) {
-    tp->s = sock;
-    tp->hPipe = hPipe;
-    mg_start_thread(func, tp);
-  }
+#if MG_ENABLE_FAKE_DAVLOCK
+/*
+ * Windows explorer (probably there are another WebDav clients like it)
+ * requires LOCK support in webdav. W/out this, it still works, but fails
+ * to save file: shows error message and offers "Save As".
+ * "Save as" works, but this message is very annoying.
+ * This is fake lock, which doesn't lock something, just returns LOCK token,
+ * UNLOCK always answers "OK".
+ * With this fake LOCK Windows Explorer looks happy and saves file.
+ * NOTE: that is not DAV LOCK imlementation, it is just a way to shut up
+ * Windows native DAV client. This is why FAKE LOCK is not enabed by default
+ */
+MG_INTERNAL void mg_handle_lock(struct mg_connection *nc, const char *path) {
+  static const char *reply =
+      "HTTP/1.1 207 Multi-Status\r\n"
+      "Connection: close\r\n"
+      "Content-Type: text/xml; charset=utf-8\r\n\r\n"
+      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+      "<d:multistatus xmlns:d='DAV:'>\n"
+      "<D:lockdiscovery>\n"
+      "<D:activelock>\n"
+      "<D:locktoken>\n"
+      "<D:href>\n"
+      "opaquelocktoken:%s%u"
+      "</D:href>"
+      "</D:locktoken>"
+      "</D:activelock>\n"
+      "</D:lockdiscovery>"
+      "</d:multistatus>\n";
+  mg_printf(nc, reply, path, (unsigned int) mg_time());
+  nc->flags |= MG_F_SEND_AND_CLOSE;
 }
+#endif
 
-static void mg_abs_path(const char *utf8_path, char *abs_path, size_t len) {
-  wchar_t buf[MG_MAX_PATH], buf2[MG_MAX_PATH];
-  to_wchar(utf8_path, buf, ARRAY_SIZE(buf));
-  GetFullPathNameW(buf, ARRAY_SIZE(buf2), buf2, NULL);
-  WideCharToMultiByte(CP_UTF8, 0, buf2, wcslen(buf2) + 1, abs_path, len, 0, 0);
+MG_INTERNAL void mg_handle_mkcol(struct mg_connection *nc, const char *path,
+                                 struct http_message *hm) {
+  int status_code = 500;
+  if (hm->body.len != (size_t) ~0 && hm->body.len > 0) {
+    status_code = 415;
+  } else if (!mg_mkdir(path, 0755)) {
+    status_code = 201;
+  } else if (errno == EEXIST) {
+    status_code = 405;
+  } else if (errno == EACCES) {
+    status_code = 403;
+  } else if (errno == ENOENT) {
+    status_code = 409;
+  } else {
+    status_code = 500;
+  }
+  mg_http_send_error(nc, status_code, NULL);
 }
 
-static int mg_start_process(const char *interp, const char *cmd,
-                            const char *env, const char *envp[],
-                            const char *dir, sock_t sock) {
-  STARTUPINFOW si;
-  PROCESS_INFORMATION pi;
-  HANDLE a[2], b[2], me = GetCurrentProcess();
-  wchar_t wcmd[MG_MAX_PATH], full_dir[MG_MAX_PATH];
-  char buf[MG_MAX_PATH], buf2[MG_MAX_PATH], buf5[MG_MAX_PATH],
-      buf4[MG_MAX_PATH], cmdline[MG_MAX_PATH];
-  DWORD flags = DUPLICATE_CLOSE_SOURCE | DUPLICATE_SAME_ACCESS;
-  FILE *fp;
+static int mg_remove_directory(const struct mg_serve_http_opts *opts,
+                               const char *dir) {
+  char path[MG_MAX_PATH];
+  struct dirent *dp;
+  cs_stat_t st;
+  DIR *dirp;
 
-  memset(&si, 0, sizeof(si));
-  memset(&pi, 0, sizeof(pi));
+  if ((dirp = opendir(dir)) == NULL) return 0;
 
-  si.cb = sizeof(si);
-  si.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
-  si.wShowWindow = SW_HIDE;
-  si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+  while ((dp = readdir(dirp)) != NULL) {
+    if (mg_is_file_hidden((const char *) dp->d_name, opts, 1)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
+    mg_stat(path, &st);
+    if (S_ISDIR(st.st_mode)) {
+      mg_remove_directory(opts, path);
+    } else {
+      remove(path);
+    }
+  }
+  closedir(dirp);
+  rmdir(dir);
 
-  CreatePipe(&a[0], &a[1], NULL, 0);
-  CreatePipe(&b[0], &b[1], NULL, 0);
-  DuplicateHandle(me, a[0], me, &si.hStdInput, 0, TRUE, flags);
-  DuplicateHandle(me, b[1], me, &si.hStdOutput, 0, TRUE, flags);
+  return 1;
+}
 
-  if (interp == NULL && (fp = mg_fopen(cmd, "r")) != NULL) {
-    buf[0] = buf[1] = '\0';
-    fgets(buf, sizeof(buf), fp);
-    buf[sizeof(buf) - 1] = '\0';
-    if (buf[0] == '#' && buf[1] == '!') {
-      interp = buf + 2;
-      /* Trim leading spaces: https://github.com/cesanta/mongoose/issues/489 */
-      while (*interp != '\0' && isspace(*(unsigned char *) interp)) {
-        interp++;
+MG_INTERNAL void mg_handle_move(struct mg_connection *c,
+                                const struct mg_serve_http_opts *opts,
+                                const char *path, struct http_message *hm) {
+  const struct mg_str *dest = mg_get_http_header(hm, "Destination");
+  if (dest == NULL) {
+    mg_http_send_error(c, 411, NULL);
+  } else {
+    const char *p = (char *) memchr(dest->p, '/', dest->len);
+    if (p != NULL && p[1] == '/' &&
+        (p = (char *) memchr(p + 2, '/', dest->p + dest->len - p)) != NULL) {
+      char buf[MG_MAX_PATH];
+      snprintf(buf, sizeof(buf), "%s%.*s", opts->dav_document_root,
+               (int) (dest->p + dest->len - p), p);
+      if (rename(path, buf) == 0) {
+        mg_http_send_error(c, 200, NULL);
+      } else {
+        mg_http_send_error(c, 418, NULL);
       }
+    } else {
+      mg_http_send_error(c, 500, NULL);
     }
-    fclose(fp);
   }
+}
 
-  snprintf(buf, sizeof(buf), "%s/%s", dir, cmd);
-  mg_abs_path(buf, buf2, ARRAY_SIZE(buf2));
-
-  mg_abs_path(dir, buf5, ARRAY_SIZE(buf5));
-  to_wchar(dir, full_dir, ARRAY_SIZE(full_dir));
-
-  if (interp != NULL) {
-    mg_abs_path(interp, buf4, ARRAY_SIZE(buf4));
-    snprintf(cmdline, sizeof(cmdline), "%s \"%s\"", buf4, buf2);
+MG_INTERNAL void mg_handle_delete(struct mg_connection *nc,
+                                  const struct mg_serve_http_opts *opts,
+                                  const char *path) {
+  cs_stat_t st;
+  if (mg_stat(path, &st) != 0) {
+    mg_http_send_error(nc, 404, NULL);
+  } else if (S_ISDIR(st.st_mode)) {
+    mg_remove_directory(opts, path);
+    mg_http_send_error(nc, 204, NULL);
+  } else if (remove(path) == 0) {
+    mg_http_send_error(nc, 204, NULL);
   } else {
-    snprintf(cmdline, sizeof(cmdline), "\"%s\"", buf2);
+    mg_http_send_error(nc, 423, NULL);
   }
-  to_wchar(cmdline, wcmd, ARRAY_SIZE(wcmd));
-
-  if (CreateProcessW(NULL, wcmd, NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP,
-                     (void *) env, full_dir, &si, &pi) != 0) {
-    mg_spawn_stdio_thread(sock, a[1], mg_push_to_stdin);
-    mg_spawn_stdio_thread(sock, b[0], mg_pull_from_stdout);
+}
 
-    CloseHandle(si.hStdOutput);
-    CloseHandle(si.hStdInput);
+/* Return -1 on error, 1 on success. */
+static int mg_create_itermediate_directories(const char *path) {
+  const char *s;
 
-    CloseHandle(pi.hThread);
-    CloseHandle(pi.hProcess);
-  } else {
-    CloseHandle(a[1]);
-    CloseHandle(b[0]);
-    closesocket(sock);
+  /* Create intermediate directories if they do not exist */
+  for (s = path + 1; *s != '\0'; s++) {
+    if (*s == '/') {
+      char buf[MG_MAX_PATH];
+      cs_stat_t st;
+      snprintf(buf, sizeof(buf), "%.*s", (int) (s - path), path);
+      buf[sizeof(buf) - 1] = '\0';
+      if (mg_stat(buf, &st) != 0 && mg_mkdir(buf, 0755) != 0) {
+        return -1;
+      }
+    }
   }
-  DBG(("CGI command: [%ls] -> %p", wcmd, pi.hProcess));
 
-  /* Not closing a[0] and b[1] because we've used DUPLICATE_CLOSE_SOURCE */
-  (void) envp;
-  return (pi.hProcess != NULL);
+  return 1;
 }
-#else
-static int mg_start_process(const char *interp, const char *cmd,
-                            const char *env, const char *envp[],
-                            const char *dir, sock_t sock) {
-  char buf[500];
-  pid_t pid = fork();
-  (void) env;
-
-  if (pid == 0) {
-    /*
-     * In Linux `chdir` declared with `warn_unused_result` attribute
-     * To shutup compiler we have yo use result in some way
-     */
-    int tmp = chdir(dir);
-    (void) tmp;
-    (void) dup2(sock, 0);
-    (void) dup2(sock, 1);
-    closesocket(sock);
 
-    /*
-     * After exec, all signal handlers are restored to their default values,
-     * with one exception of SIGCHLD. According to POSIX.1-2001 and Linux's
-     * implementation, SIGCHLD's handler will leave unchanged after exec
-     * if it was set to be ignored. Restore it to default action.
-     */
-    signal(SIGCHLD, SIG_DFL);
+MG_INTERNAL void mg_handle_put(struct mg_connection *nc, const char *path,
+                               struct http_message *hm) {
+  struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
+  cs_stat_t st;
+  const struct mg_str *cl_hdr = mg_get_http_header(hm, "Content-Length");
+  int rc, status_code = mg_stat(path, &st) == 0 ? 200 : 201;
 
-    if (interp == NULL) {
-      execle(cmd, cmd, (char *) 0, envp); /* (char *) 0 to squash warning */
-    } else {
-      execle(interp, interp, cmd, (char *) 0, envp);
+  mg_http_free_proto_data_file(&pd->file);
+  if ((rc = mg_create_itermediate_directories(path)) == 0) {
+    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
+  } else if (rc == -1) {
+    mg_http_send_error(nc, 500, NULL);
+  } else if (cl_hdr == NULL) {
+    mg_http_send_error(nc, 411, NULL);
+  } else if ((pd->file.fp = mg_fopen(path, "w+b")) == NULL) {
+    mg_http_send_error(nc, 500, NULL);
+  } else {
+    const struct mg_str *range_hdr = mg_get_http_header(hm, "Content-Range");
+    int64_t r1 = 0, r2 = 0;
+    pd->file.type = DATA_PUT;
+    mg_set_close_on_exec((sock_t) fileno(pd->file.fp));
+    pd->file.cl = to64(cl_hdr->p);
+    if (range_hdr != NULL &&
+        mg_http_parse_range_header(range_hdr, &r1, &r2) > 0) {
+      status_code = 206;
+      fseeko(pd->file.fp, r1, SEEK_SET);
+      pd->file.cl = r2 > r1 ? r2 - r1 + 1 : pd->file.cl - r1;
     }
-    snprintf(buf, sizeof(buf),
-             "Status: 500\r\n\r\n"
-             "500 Server Error: %s%s%s: %s",
-             interp == NULL ? "" : interp, interp == NULL ? "" : " ", cmd,
-             strerror(errno));
-    send(1, buf, strlen(buf), 0);
-    _exit(EXIT_FAILURE); /* exec call failed */
+    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
+    /* Remove HTTP request from the mbuf, leave only payload */
+    mbuf_remove(&nc->recv_mbuf, hm->message.len - hm->body.len);
+    mg_http_transfer_file_data(nc);
   }
-
-  return (pid != 0);
 }
-#endif /* _WIN32 */
 
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBDAV */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http_websocket.c"
+#endif
 /*
- * Append VARIABLE=VALUE\0 string to the buffer, and add a respective
- * pointer into the vars array.
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
  */
-static char *mg_addenv(struct mg_cgi_env_block *block, const char *fmt, ...) {
-  int n, space;
-  char *added = block->buf + block->len;
-  va_list ap;
-
-  /* Calculate how much space is left in the buffer */
-  space = sizeof(block->buf) - (block->len + 2);
-  if (space > 0) {
-    /* Copy VARIABLE=VALUE\0 string into the free space */
-    va_start(ap, fmt);
-    n = vsnprintf(added, (size_t) space, fmt, ap);
-    va_end(ap);
-
-    /* Make sure we do not overflow buffer and the envp array */
-    if (n > 0 && n + 1 < space &&
-        block->nvars < (int) ARRAY_SIZE(block->vars) - 2) {
-      /* Append a pointer to the added string into the envp array */
-      block->vars[block->nvars++] = added;
-      /* Bump up used length counter. Include \0 terminator */
-      block->len += n + 1;
-    }
-  }
-
-  return added;
-}
 
-static void mg_addenv2(struct mg_cgi_env_block *blk, const char *name) {
-  const char *s;
-  if ((s = getenv(name)) != NULL) mg_addenv(blk, "%s=%s", name, s);
-}
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
 
-static void mg_prepare_cgi_environment(struct mg_connection *nc,
-                                       const char *prog,
-                                       const struct mg_str *path_info,
-                                       const struct http_message *hm,
-                                       const struct mg_serve_http_opts *opts,
-                                       struct mg_cgi_env_block *blk) {
-  const char *s;
-  struct mg_str *h;
-  char *p;
-  size_t i;
-  char buf[100];
-  size_t path_info_len = path_info != NULL ? path_info->len : 0;
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET
 
-  blk->len = blk->nvars = 0;
-  blk->nc = nc;
+/* Amalgamated: #include "common/cs_sha1.h" */
 
-  if ((s = getenv("SERVER_NAME")) != NULL) {
-    mg_addenv(blk, "SERVER_NAME=%s", s);
-  } else {
-    mg_sock_to_str(nc->sock, buf, sizeof(buf), 3);
-    mg_addenv(blk, "SERVER_NAME=%s", buf);
-  }
-  mg_addenv(blk, "SERVER_ROOT=%s", opts->document_root);
-  mg_addenv(blk, "DOCUMENT_ROOT=%s", opts->document_root);
-  mg_addenv(blk, "SERVER_SOFTWARE=%s/%s", "Mongoose", MG_VERSION);
+#ifndef MG_WEBSOCKET_PING_INTERVAL_SECONDS
+#define MG_WEBSOCKET_PING_INTERVAL_SECONDS 5
+#endif
 
-  /* Prepare the environment block */
-  mg_addenv(blk, "%s", "GATEWAY_INTERFACE=CGI/1.1");
-  mg_addenv(blk, "%s", "SERVER_PROTOCOL=HTTP/1.1");
-  mg_addenv(blk, "%s", "REDIRECT_STATUS=200"); /* For PHP */
+#define FLAGS_MASK_FIN (1 << 7)
+#define FLAGS_MASK_OP 0x0f
 
-  mg_addenv(blk, "REQUEST_METHOD=%.*s", (int) hm->method.len, hm->method.p);
+static int mg_is_ws_fragment(unsigned char flags) {
+  return (flags & FLAGS_MASK_FIN) == 0 ||
+         (flags & FLAGS_MASK_OP) == WEBSOCKET_OP_CONTINUE;
+}
 
-  mg_addenv(blk, "REQUEST_URI=%.*s%s%.*s", (int) hm->uri.len, hm->uri.p,
-            hm->query_string.len == 0 ? "" : "?", (int) hm->query_string.len,
-            hm->query_string.p);
+static int mg_is_ws_first_fragment(unsigned char flags) {
+  return (flags & FLAGS_MASK_FIN) == 0 &&
+         (flags & FLAGS_MASK_OP) != WEBSOCKET_OP_CONTINUE;
+}
 
-  mg_conn_addr_to_str(nc, buf, sizeof(buf),
-                      MG_SOCK_STRINGIFY_REMOTE | MG_SOCK_STRINGIFY_IP);
-  mg_addenv(blk, "REMOTE_ADDR=%s", buf);
-  mg_conn_addr_to_str(nc, buf, sizeof(buf), MG_SOCK_STRINGIFY_PORT);
-  mg_addenv(blk, "SERVER_PORT=%s", buf);
+static int mg_is_ws_control_frame(unsigned char flags) {
+  unsigned char op = (flags & FLAGS_MASK_OP);
+  return op == WEBSOCKET_OP_CLOSE || op == WEBSOCKET_OP_PING ||
+         op == WEBSOCKET_OP_PONG;
+}
 
-  s = hm->uri.p + hm->uri.len - path_info_len - 1;
-  if (*s == '/') {
-    const char *base_name = strrchr(prog, DIRSEP);
-    mg_addenv(blk, "SCRIPT_NAME=%.*s/%s", (int) (s - hm->uri.p), hm->uri.p,
-              (base_name != NULL ? base_name + 1 : prog));
+static void mg_handle_incoming_websocket_frame(struct mg_connection *nc,
+                                               struct websocket_message *wsm) {
+  if (wsm->flags & 0x8) {
+    mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_CONTROL_FRAME, wsm);
   } else {
-    mg_addenv(blk, "SCRIPT_NAME=%.*s", (int) (s - hm->uri.p + 1), hm->uri.p);
+    mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_FRAME, wsm);
   }
-  mg_addenv(blk, "SCRIPT_FILENAME=%s", prog);
+}
 
-  if (path_info != NULL && path_info->len > 0) {
-    mg_addenv(blk, "PATH_INFO=%.*s", (int) path_info->len, path_info->p);
-    /* Not really translated... */
-    mg_addenv(blk, "PATH_TRANSLATED=%.*s", (int) path_info->len, path_info->p);
+static struct mg_ws_proto_data *mg_ws_get_proto_data(struct mg_connection *nc) {
+  struct mg_http_proto_data *htd = mg_http_get_proto_data(nc);
+  return (htd != NULL ? &htd->ws_data : NULL);
+}
+
+/*
+ * Sends a Close websocket frame with the given data, and closes the underlying
+ * connection. If `len` is ~0, strlen(data) is used.
+ */
+static void mg_ws_close(struct mg_connection *nc, const void *data,
+                        size_t len) {
+  if ((int) len == ~0) {
+    len = strlen((const char *) data);
   }
+  mg_send_websocket_frame(nc, WEBSOCKET_OP_CLOSE, data, len);
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
 
-#if MG_ENABLE_SSL
-  mg_addenv(blk, "HTTPS=%s", (nc->flags & MG_F_SSL ? "on" : "off"));
-#else
-  mg_addenv(blk, "HTTPS=off");
-#endif
+static int mg_deliver_websocket_data(struct mg_connection *nc) {
+  /* Using unsigned char *, cause of integer arithmetic below */
+  uint64_t i, data_len = 0, frame_len = 0, new_data_len = nc->recv_mbuf.len,
+              len, mask_len = 0, header_len = 0;
+  struct mg_ws_proto_data *wsd = mg_ws_get_proto_data(nc);
+  unsigned char *new_data = (unsigned char *) nc->recv_mbuf.buf,
+                *e = (unsigned char *) nc->recv_mbuf.buf + nc->recv_mbuf.len;
+  uint8_t flags;
+  int ok, reass;
 
-  if ((h = mg_get_http_header((struct http_message *) hm, "Content-Type")) !=
-      NULL) {
-    mg_addenv(blk, "CONTENT_TYPE=%.*s", (int) h->len, h->p);
-  }
+  if (wsd->reass_len > 0) {
+    /*
+     * We already have some previously received data which we need to
+     * reassemble and deliver to the client code when we get the final
+     * fragment.
+     *
+     * NOTE: it doesn't mean that the current message must be a continuation:
+     * it might be a control frame (Close, Ping or Pong), which should be
+     * handled without breaking the fragmented message.
+     */
 
-  if (hm->query_string.len > 0) {
-    mg_addenv(blk, "QUERY_STRING=%.*s", (int) hm->query_string.len,
-              hm->query_string.p);
-  }
+    size_t existing_len = wsd->reass_len;
+    assert(new_data_len >= existing_len);
 
-  if ((h = mg_get_http_header((struct http_message *) hm, "Content-Length")) !=
-      NULL) {
-    mg_addenv(blk, "CONTENT_LENGTH=%.*s", (int) h->len, h->p);
+    new_data += existing_len;
+    new_data_len -= existing_len;
   }
 
-  mg_addenv2(blk, "PATH");
-  mg_addenv2(blk, "TMP");
-  mg_addenv2(blk, "TEMP");
-  mg_addenv2(blk, "TMPDIR");
-  mg_addenv2(blk, "PERLLIB");
-  mg_addenv2(blk, MG_ENV_EXPORT_TO_CGI);
+  flags = new_data[0];
 
-#ifdef _WIN32
-  mg_addenv2(blk, "COMSPEC");
-  mg_addenv2(blk, "SYSTEMROOT");
-  mg_addenv2(blk, "SystemDrive");
-  mg_addenv2(blk, "ProgramFiles");
-  mg_addenv2(blk, "ProgramFiles(x86)");
-  mg_addenv2(blk, "CommonProgramFiles(x86)");
-#else
-  mg_addenv2(blk, "LD_LIBRARY_PATH");
-#endif /* _WIN32 */
+  reass = new_data_len > 0 && mg_is_ws_fragment(flags) &&
+          !(nc->flags & MG_F_WEBSOCKET_NO_DEFRAG);
 
-  /* Add all headers as HTTP_* variables */
-  for (i = 0; hm->header_names[i].len > 0; i++) {
-    p = mg_addenv(blk, "HTTP_%.*s=%.*s", (int) hm->header_names[i].len,
-                  hm->header_names[i].p, (int) hm->header_values[i].len,
-                  hm->header_values[i].p);
+  if (reass && mg_is_ws_control_frame(flags)) {
+    /*
+     * Control frames can't be fragmented, so if we encounter fragmented
+     * control frame, close connection immediately.
+     */
+    mg_ws_close(nc, "fragmented control frames are illegal", ~0);
+    return 0;
+  } else if (new_data_len > 0 && !reass && !mg_is_ws_control_frame(flags) &&
+             wsd->reass_len > 0) {
+    /*
+     * When in the middle of a fragmented message, only the continuations
+     * and control frames are allowed.
+     */
+    mg_ws_close(nc, "non-continuation in the middle of a fragmented message",
+                ~0);
+    return 0;
+  }
 
-    /* Convert variable name into uppercase, and change - to _ */
-    for (; *p != '=' && *p != '\0'; p++) {
-      if (*p == '-') *p = '_';
-      *p = (char) toupper(*(unsigned char *) p);
+  if (new_data_len >= 2) {
+    len = new_data[1] & 0x7f;
+    mask_len = new_data[1] & FLAGS_MASK_FIN ? 4 : 0;
+    if (len < 126 && new_data_len >= mask_len) {
+      data_len = len;
+      header_len = 2 + mask_len;
+    } else if (len == 126 && new_data_len >= 4 + mask_len) {
+      header_len = 4 + mask_len;
+      data_len = (uint64_t) new_data[2] << 8 | new_data[3];
+    } else if (new_data_len >= 10 + mask_len) {
+      header_len = 10 + mask_len;
+      /* Byte by byte: the header is not aligned in the receive buffer */
+      for (data_len = 0, i = 2; i < 10; i++) {
+        data_len = data_len << 8 | new_data[i];
+      }
     }
   }
 
-  blk->vars[blk->nvars++] = NULL;
-  blk->buf[blk->len++] = '\0';
-}
-
-static void mg_cgi_ev_handler(struct mg_connection *cgi_nc, int ev,
-                              void *ev_data MG_UD_ARG(void *user_data)) {
-#if !MG_ENABLE_CALLBACK_USERDATA
-  void *user_data = cgi_nc->user_data;
-#endif
-  struct mg_connection *nc = (struct mg_connection *) user_data;
-  (void) ev_data;
-
-  if (nc == NULL) {
-    /* The corresponding network connection was closed. */
-    cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-    return;
+  frame_len = header_len + data_len;
+  ok = (frame_len > 0 && frame_len <= new_data_len);
+
+  /* Check for overflow */
+  if (frame_len < header_len || frame_len < data_len) {
+    ok = 0;
+    mg_ws_close(nc, "overflowed message", ~0);
   }
 
-  switch (ev) {
-    case MG_EV_RECV:
-      /*
-       * CGI script does not output reply line, like "HTTP/1.1 CODE XXXXX\n"
-       * It outputs headers, then body. Headers might include "Status"
-       * header, which changes CODE, and it might include "Location" header
-       * which changes CODE to 302.
-       *
-       * Therefore we do not send the output from the CGI script to the user
-       * until all CGI headers are received.
-       *
-       * Here we parse the output from the CGI script, and if all headers has
-       * been received, send appropriate reply line, and forward all
-       * received headers to the client.
-       */
-      if (nc->flags & MG_F_HTTP_CGI_PARSE_HEADERS) {
-        struct mbuf *io = &cgi_nc->recv_mbuf;
-        int len = mg_http_get_request_len(io->buf, io->len);
+  if (ok) {
+    size_t cleanup_len = 0;
+    struct websocket_message wsm;
 
-        if (len == 0) break;
-        if (len < 0 || io->len > MG_MAX_HTTP_REQUEST_SIZE) {
-          cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-          mg_http_send_error(nc, 500, "Bad headers");
-        } else {
-          struct http_message hm;
-          struct mg_str *h;
-          mg_http_parse_headers(io->buf, io->buf + io->len, io->len, &hm);
-          if (mg_get_http_header(&hm, "Location") != NULL) {
-            mg_printf(nc, "%s", "HTTP/1.1 302 Moved\r\n");
-          } else if ((h = mg_get_http_header(&hm, "Status")) != NULL) {
-            mg_printf(nc, "HTTP/1.1 %.*s\r\n", (int) h->len, h->p);
-          } else {
-            mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\n");
-          }
-        }
-        nc->flags &= ~MG_F_HTTP_CGI_PARSE_HEADERS;
+    wsm.size = (size_t) data_len;
+    wsm.data = new_data + header_len;
+    wsm.flags = flags;
+
+    /* Apply mask if necessary */
+    if (mask_len > 0) {
+      for (i = 0; i < data_len; i++) {
+        new_data[i + header_len] ^= (new_data + header_len - mask_len)[i % 4];
       }
-      if (!(nc->flags & MG_F_HTTP_CGI_PARSE_HEADERS)) {
-        mg_forward(cgi_nc, nc);
+    }
+
+    if (reass) {
+      /* This is a message fragment */
+
+      if (mg_is_ws_first_fragment(flags)) {
+        /*
+         * On the first fragmented frame, skip the first byte (op) and also
+         * reset size to 1 (op), it'll be incremented with the data len below.
+         */
+        new_data += 1;
+        wsd->reass_len = 1 /* op */;
       }
-      break;
-    case MG_EV_CLOSE:
-      DBG(("%p CLOSE", cgi_nc));
-      mg_http_free_proto_data_cgi(&mg_http_get_proto_data(nc)->cgi);
-      nc->flags |= MG_F_SEND_AND_CLOSE;
-      break;
-  }
-}
 
-MG_INTERNAL void mg_handle_cgi(struct mg_connection *nc, const char *prog,
-                               const struct mg_str *path_info,
-                               const struct http_message *hm,
-                               const struct mg_serve_http_opts *opts) {
-  struct mg_cgi_env_block blk;
-  char dir[MG_MAX_PATH];
-  const char *p;
-  sock_t fds[2];
+      /* Append this frame to the reassembled buffer */
+      memmove(new_data, wsm.data, e - wsm.data);
+      wsd->reass_len += wsm.size;
+      nc->recv_mbuf.len -= wsm.data - new_data;
 
-  DBG(("%p [%s]", nc, prog));
-  mg_prepare_cgi_environment(nc, prog, path_info, hm, opts, &blk);
-  /*
-   * CGI must be executed in its own directory. 'dir' must point to the
-   * directory containing executable program, 'p' must point to the
-   * executable program name relative to 'dir'.
-   */
-  if ((p = strrchr(prog, DIRSEP)) == NULL) {
-    snprintf(dir, sizeof(dir), "%s", ".");
-  } else {
-    snprintf(dir, sizeof(dir), "%.*s", (int) (p - prog), prog);
-    prog = p + 1;
-  }
+      if (flags & FLAGS_MASK_FIN) {
+        /* On last fragmented frame - call user handler and remove data */
+        wsm.flags = FLAGS_MASK_FIN | nc->recv_mbuf.buf[0];
+        wsm.data = (unsigned char *) nc->recv_mbuf.buf + 1 /* op */;
+        wsm.size = wsd->reass_len - 1 /* op */;
+        cleanup_len = wsd->reass_len;
+        wsd->reass_len = 0;
 
-  if (!mg_socketpair(fds, SOCK_STREAM)) {
-    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-    return;
-  }
+        /* Pass reassembled message to the client code. */
+        mg_handle_incoming_websocket_frame(nc, &wsm);
+        mbuf_remove(&nc->recv_mbuf, cleanup_len); /* Cleanup frame */
+      }
+    } else {
+      /*
+       * This is a complete message, not a fragment. It might happen in between
+       * of a fragmented message (in this case, WebSocket protocol requires
+       * current message to be a control frame).
+       */
+      cleanup_len = (size_t) frame_len;
 
-#ifndef _WIN32
-  struct sigaction sa;
+      /* First of all, check if we need to react on a control frame. */
+      switch (flags & FLAGS_MASK_OP) {
+        case WEBSOCKET_OP_PING:
+          mg_send_websocket_frame(nc, WEBSOCKET_OP_PONG, wsm.data, wsm.size);
+          break;
 
-  sigemptyset(&sa.sa_mask);
-  sa.sa_handler = SIG_IGN;
-  sa.sa_flags = 0;
-  sigaction(SIGCHLD, &sa, NULL);
-#endif
+        case WEBSOCKET_OP_CLOSE:
+          mg_ws_close(nc, wsm.data, wsm.size);
+          break;
+      }
 
-  if (mg_start_process(opts->cgi_interpreter, prog, blk.buf, blk.vars, dir,
-                       fds[1]) != 0) {
-    size_t n = nc->recv_mbuf.len - (hm->message.len - hm->body.len);
-    struct mg_connection *cgi_nc =
-        mg_add_sock(nc->mgr, fds[0], mg_cgi_ev_handler MG_UD_ARG(nc));
-    struct mg_http_proto_data *cgi_pd = mg_http_get_proto_data(nc);
-    cgi_pd->cgi.cgi_nc = cgi_nc;
-#if !MG_ENABLE_CALLBACK_USERDATA
-    cgi_pd->cgi.cgi_nc->user_data = nc;
-#endif
-    nc->flags |= MG_F_HTTP_CGI_PARSE_HEADERS;
-    /* Push POST data to the CGI */
-    if (n > 0 && n < nc->recv_mbuf.len) {
-      mg_send(cgi_pd->cgi.cgi_nc, hm->body.p, n);
+      /* Pass received message to the client code. */
+      mg_handle_incoming_websocket_frame(nc, &wsm);
+
+      /* Cleanup frame */
+      memmove(nc->recv_mbuf.buf + wsd->reass_len,
+              nc->recv_mbuf.buf + wsd->reass_len + cleanup_len,
+              nc->recv_mbuf.len - wsd->reass_len - cleanup_len);
+      nc->recv_mbuf.len -= cleanup_len;
     }
-    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
-  } else {
-    closesocket(fds[0]);
-    mg_http_send_error(nc, 500, "CGI failure");
   }
 
-#ifndef _WIN32
-  closesocket(fds[1]); /* On Windows, CGI stdio thread closes that socket */
-#endif
+  return ok;
 }
 
-MG_INTERNAL void mg_http_free_proto_data_cgi(struct mg_http_proto_data_cgi *d) {
-  if (d == NULL) return;
-  if (d->cgi_nc != NULL) {
-    d->cgi_nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-    d->cgi_nc->user_data = NULL;
-  }
-  memset(d, 0, sizeof(*d));
-}
+struct ws_mask_ctx {
+  size_t pos; /* zero means unmasked */
+  uint32_t mask;
+};
 
-#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_CGI */
-#ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_http_ssi.c"
-#endif
+static uint32_t mg_ws_random_mask(void) {
+  uint32_t mask;
 /*
- * Copyright (c) 2014-2016 Cesanta Software Limited
- * All rights reserved
+ * The spec requires WS client to generate hard to
+ * guess mask keys. From RFC6455, Section 5.3:
+ *
+ * The unpredictability of the masking key is essential to prevent
+ * authors of malicious applications from selecting the bytes that appear on
+ * the wire.
+ *
+ * Hence this feature is essential when the actual end user of this API
+ * is untrusted code that wouldn't have access to a lower level net API
+ * anyway (e.g. web browsers). Hence this feature is low prio for most
+ * mongoose use cases and thus can be disabled, e.g. when porting to a platform
+ * that lacks rand().
  */
-
-#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_SSI && MG_ENABLE_FILESYSTEM
-
-static void mg_send_ssi_file(struct mg_connection *nc, struct http_message *hm,
-                             const char *path, FILE *fp, int include_level,
-                             const struct mg_serve_http_opts *opts);
-
-static void mg_send_file_data(struct mg_connection *nc, FILE *fp) {
-  char buf[BUFSIZ];
-  size_t n;
-  while ((n = mg_fread(buf, 1, sizeof(buf), fp)) > 0) {
-    mg_send(nc, buf, n);
+#if MG_DISABLE_WS_RANDOM_MASK
+  mask = 0xefbeadde; /* generated with a random number generator, I swear */
+#else
+  if (sizeof(long) >= 4) {
+    mask = (uint32_t) rand();
+  } else if (sizeof(long) == 2) {
+    mask = (uint32_t) rand() << 16 | (uint32_t) rand();
   }
+#endif
+  return mask;
 }
 
-static void mg_do_ssi_include(struct mg_connection *nc, struct http_message *hm,
-                              const char *ssi, char *tag, int include_level,
-                              const struct mg_serve_http_opts *opts) {
-  char file_name[MG_MAX_PATH], path[MG_MAX_PATH], *p;
-  FILE *fp;
+/* Fills in frame header (without mask), returns its length. */
+MG_INTERNAL int mg_ws_build_header(unsigned char *header, int op, size_t len) {
+  int header_len;
 
-  /*
-   * sscanf() is safe here, since send_ssi_file() also uses buffer
-   * of size MG_BUF_LEN to get the tag. So strlen(tag) is always < MG_BUF_LEN.
-   */
-  if (sscanf(tag, " virtual=\"%[^\"]\"", file_name) == 1) {
-    /* File name is relative to the webserver root */
-    snprintf(path, sizeof(path), "%s/%s", opts->document_root, file_name);
-  } else if (sscanf(tag, " abspath=\"%[^\"]\"", file_name) == 1) {
-    /*
-     * File name is relative to the webserver working directory
-     * or it is absolute system path
-     */
-    snprintf(path, sizeof(path), "%s", file_name);
-  } else if (sscanf(tag, " file=\"%[^\"]\"", file_name) == 1 ||
-             sscanf(tag, " \"%[^\"]\"", file_name) == 1) {
-    /* File name is relative to the currect document */
-    snprintf(path, sizeof(path), "%s", ssi);
-    if ((p = strrchr(path, DIRSEP)) != NULL) {
-      p[1] = '\0';
-    }
-    snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s", file_name);
+  header[0] =
+      (op & WEBSOCKET_DONT_FIN ? 0x0 : FLAGS_MASK_FIN) | (op & FLAGS_MASK_OP);
+  if (len < 126) {
+    header[1] = (unsigned char) len;
+    header_len = 2;
+  } else if (len < 65535) {
+    uint16_t tmp = htons((uint16_t) len);
+    header[1] = 126;
+    memcpy(&header[2], &tmp, sizeof(tmp));
+    header_len = 4;
   } else {
-    mg_printf(nc, "Bad SSI #include: [%s]", tag);
-    return;
+    uint32_t tmp;
+    header[1] = 127;
+    tmp = htonl((uint32_t)((uint64_t) len >> 32));
+    memcpy(&header[2], &tmp, sizeof(tmp));
+    tmp = htonl((uint32_t)(len & 0xffffffff));
+    memcpy(&header[6], &tmp, sizeof(tmp));
+    header_len = 10;
   }
+  return header_len;
+}
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
-    mg_printf(nc, "SSI include error: mg_fopen(%s): %s", path,
-              strerror(mg_get_errno()));
+static void mg_send_ws_header(struct mg_connection *nc, int op, size_t len,
+                              struct ws_mask_ctx *ctx) {
+  unsigned char header[10];
+  int header_len = mg_ws_build_header(header, op, len);
+
+  /* client connections enable masking */
+  if (nc->listener == NULL) {
+    header[1] |= 1 << 7; /* set masking flag */
+    mg_send(nc, header, header_len);
+    ctx->mask = mg_ws_random_mask();
+    mg_send(nc, &ctx->mask, sizeof(ctx->mask));
+    ctx->pos = nc->send_mbuf.len;
   } else {
-    mg_set_close_on_exec((sock_t) fileno(fp));
-    if (mg_match_prefix(opts->ssi_pattern, strlen(opts->ssi_pattern), path) >
-        0) {
-      mg_send_ssi_file(nc, hm, path, fp, include_level + 1, opts);
-    } else {
-      mg_send_file_data(nc, fp);
-    }
-    fclose(fp);
+    mg_send(nc, header, header_len);
+    ctx->pos = 0;
   }
 }
 
-#if MG_ENABLE_HTTP_SSI_EXEC
-static void do_ssi_exec(struct mg_connection *nc, char *tag) {
-  char cmd[BUFSIZ];
-  FILE *fp;
-
-  if (sscanf(tag, " \"%[^\"]\"", cmd) != 1) {
-    mg_printf(nc, "Bad SSI #exec: [%s]", tag);
-  } else if ((fp = popen(cmd, "r")) == NULL) {
-    mg_printf(nc, "Cannot SSI #exec: [%s]: %s", cmd, strerror(mg_get_errno()));
-  } else {
-    mg_send_file_data(nc, fp);
-    pclose(fp);
+static void mg_ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
+  size_t i;
+  if (ctx->pos == 0) return;
+  for (i = 0; i < (mbuf->len - ctx->pos); i++) {
+    mbuf->buf[ctx->pos + i] ^= ((char *) &ctx->mask)[i % 4];
   }
 }
-#endif /* MG_ENABLE_HTTP_SSI_EXEC */
 
-/*
- * SSI directive has the following format:
- * <!--#directive parameter=value parameter=value -->
- */
-static void mg_send_ssi_file(struct mg_connection *nc, struct http_message *hm,
-                             const char *path, FILE *fp, int include_level,
-                             const struct mg_serve_http_opts *opts) {
-  static const struct mg_str btag = MG_MK_STR("<!--#");
-  static const struct mg_str d_include = MG_MK_STR("include");
-  static const struct mg_str d_call = MG_MK_STR("call");
-#if MG_ENABLE_HTTP_SSI_EXEC
-  static const struct mg_str d_exec = MG_MK_STR("exec");
-#endif
-  char buf[BUFSIZ], *p = buf + btag.len; /* p points to SSI directive */
-  int ch, len, in_ssi_tag;
+void mg_send_websocket_frame(struct mg_connection *nc, int op, const void *data,
+                             size_t len) {
+  struct ws_mask_ctx ctx;
+  DBG(("%p %d %d", nc, op, (int) len));
+  mg_send_ws_header(nc, op, len, &ctx);
+  mg_send(nc, data, len);
 
-  if (include_level > 10) {
-    mg_printf(nc, "SSI #include level is too deep (%s)", path);
-    return;
+  mg_ws_mask_frame(&nc->send_mbuf, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= MG_F_SEND_AND_CLOSE;
   }
+}
 
-  in_ssi_tag = len = 0;
-  while ((ch = fgetc(fp)) != EOF) {
-    if (in_ssi_tag && ch == '>' && buf[len - 1] == '-' && buf[len - 2] == '-') {
-      size_t i = len - 2;
-      in_ssi_tag = 0;
+void mg_send_websocket_framev(struct mg_connection *nc, int op,
+                              const struct mg_str *strv, int strvcnt) {
+  struct ws_mask_ctx ctx;
+  int i;
+  int len = 0;
+  for (i = 0; i < strvcnt; i++) {
+    len += strv[i].len;
+  }
 
-      /* Trim closing --> */
-      buf[i--] = '\0';
-      while (i > 0 && buf[i] == ' ') {
-        buf[i--] = '\0';
-      }
+  mg_send_ws_header(nc, op, len, &ctx);
 
-      /* Handle known SSI directives */
-      if (strncmp(p, d_include.p, d_include.len) == 0) {
-        mg_do_ssi_include(nc, hm, path, p + d_include.len + 1, include_level,
-                          opts);
-      } else if (strncmp(p, d_call.p, d_call.len) == 0) {
-        struct mg_ssi_call_ctx cctx;
-        memset(&cctx, 0, sizeof(cctx));
-        cctx.req = hm;
-        cctx.file = mg_mk_str(path);
-        cctx.arg = mg_mk_str(p + d_call.len + 1);
-        mg_call(nc, NULL, nc->user_data, MG_EV_SSI_CALL,
-                (void *) cctx.arg.p); /* NUL added above */
-        mg_call(nc, NULL, nc->user_data, MG_EV_SSI_CALL_CTX, &cctx);
-#if MG_ENABLE_HTTP_SSI_EXEC
-      } else if (strncmp(p, d_exec.p, d_exec.len) == 0) {
-        do_ssi_exec(nc, p + d_exec.len + 1);
-#endif
-      } else {
-        /* Silently ignore unknown SSI directive. */
-      }
-      len = 0;
-    } else if (ch == '<') {
-      in_ssi_tag = 1;
-      if (len > 0) {
-        mg_send(nc, buf, (size_t) len);
-      }
-      len = 0;
-      buf[len++] = ch & 0xff;
-    } else if (in_ssi_tag) {
-      if (len == (int) btag.len && strncmp(buf, btag.p, btag.len) != 0) {
-        /* Not an SSI tag */
-        in_ssi_tag = 0;
-      } else if (len == (int) sizeof(buf) - 2) {
-        mg_printf(nc, "%s: SSI tag is too large", path);
-        len = 0;
-      }
-      buf[len++] = ch & 0xff;
-    } else {
-      buf[len++] = ch & 0xff;
-      if (len == (int) sizeof(buf)) {
-        mg_send(nc, buf, (size_t) len);
-        len = 0;
-      }
-    }
+  for (i = 0; i < strvcnt; i++) {
+    mg_send(nc, strv[i].p, strv[i].len);
   }
 
-  /* Send the rest of buffered data */
-  if (len > 0) {
-    mg_send(nc, buf, (size_t) len);
+  mg_ws_mask_frame(&nc->send_mbuf, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= MG_F_SEND_AND_CLOSE;
   }
 }
 
-MG_INTERNAL void mg_handle_ssi_request(struct mg_connection *nc,
-                                       struct http_message *hm,
-                                       const char *path,
-                                       const struct mg_serve_http_opts *opts) {
-  FILE *fp;
-  struct mg_str mime_type;
-  DBG(("%p %s", nc, path));
+/*
+ * Formats a frame directly into the send buffer. The payload is measured
+ * first, so that the header it needs can be reserved up front. Formatted
+ * data is only moved if the measurement was off (a non-compliant
+ * vsnprintf() that can't tell the length).
+ */
+static void mg_vprintf_websocket_frame_direct(struct mg_connection *nc,
+                                              struct mbuf *mb, int op,
+                                              const char *fmt, va_list ap) {
+  unsigned char header[14];
+  size_t off = mb->len, reserved;
+  struct ws_mask_ctx ctx;
+  int header_len, len;
+
+  len = mbuf_vprintf_len(fmt, ap);
+  reserved = mg_ws_build_header(header, op, len > 0 ? (size_t) len : 0);
+  if (nc->listener == NULL) reserved += sizeof(ctx.mask);
+  mbuf_append(mb, NULL, reserved);
+  if (mb->len != off + reserved ||
+      (len = mbuf_vprintf(mb, fmt, ap)) <= 0) {
+    mb->len = off;
+    return;
+  }
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
-    mg_http_send_error(nc, 404, NULL);
-  } else {
-    mg_set_close_on_exec((sock_t) fileno(fp));
+  header_len = mg_ws_build_header(header, op, len);
+  if (nc->listener == NULL) {
+    header[1] |= 1 << 7; /* set masking flag */
+    ctx.mask = mg_ws_random_mask();
+    memcpy(header + header_len, &ctx.mask, sizeof(ctx.mask));
+    header_len += sizeof(ctx.mask);
+  }
+  if ((size_t) header_len > reserved) {
+    size_t gap = header_len - reserved;
+    if (mbuf_insert(mb, off + reserved, NULL, gap) != gap) {
+      mb->len = off;
+      return;
+    }
+  } else if ((size_t) header_len < reserved) {
+    size_t gap = reserved - header_len;
+    memmove(mb->buf + off + header_len, mb->buf + off + reserved, len);
+    mb->len -= gap;
+  }
+  memcpy(mb->buf + off, header, header_len);
 
-    mime_type = mg_get_mime_type(path, "text/plain", opts);
-    mg_send_response_line(nc, 200, opts->extra_headers);
-    mg_printf(nc,
-              "Content-Type: %.*s\r\n"
-              "Connection: close\r\n\r\n",
-              (int) mime_type.len, mime_type.p);
-    mg_send_ssi_file(nc, hm, path, fp, 0, opts);
-    fclose(fp);
+  ctx.pos = (nc->listener == NULL ? off + header_len : 0);
+  mg_ws_mask_frame(mb, &ctx);
+
+  if (op == WEBSOCKET_OP_CLOSE) {
     nc->flags |= MG_F_SEND_AND_CLOSE;
   }
 }
 
-#endif /* MG_ENABLE_HTTP_SSI && MG_ENABLE_HTTP && MG_ENABLE_FILESYSTEM */
-#ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_http_webdav.c"
-#endif
-/*
- * Copyright (c) 2014-2016 Cesanta Software Limited
- * All rights reserved
- */
+void mg_printf_websocket_frame(struct mg_connection *nc, int op,
+                               const char *fmt, ...) {
+  char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
+  struct mbuf *mb;
+  va_list ap;
+  int len;
 
-#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBDAV
+  if ((mb = mg_send_mbuf(nc)) != NULL) {
+    va_start(ap, fmt);
+    mg_vprintf_websocket_frame_direct(nc, mb, op, fmt, ap);
+    va_end(ap);
+    return;
+  }
 
-MG_INTERNAL int mg_is_dav_request(const struct mg_str *s) {
-  static const char *methods[] = {
-    "PUT",
-    "DELETE",
-    "MKCOL",
-    "PROPFIND",
-    "MOVE"
-#if MG_ENABLE_FAKE_DAVLOCK
-    ,
-    "LOCK",
-    "UNLOCK"
-#endif
-  };
-  size_t i;
+  va_start(ap, fmt);
+  if ((len = mg_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
+    mg_send_websocket_frame(nc, op, buf, len);
+  }
+  va_end(ap);
 
-  for (i = 0; i < ARRAY_SIZE(methods); i++) {
-    if (mg_vcmp(s, methods[i]) == 0) {
-      return 1;
-    }
+  if (buf != mem && buf != NULL) {
+    MG_FREE(buf);
   }
+}
 
-  return 0;
+MG_INTERNAL void mg_ws_handler(struct mg_connection *nc, int ev,
+                               void *ev_data MG_UD_ARG(void *user_data)) {
+  mg_call(nc, nc->handler, nc->user_data, ev, ev_data);
+
+  switch (ev) {
+    case MG_EV_RECV:
+      do {
+      } while (mg_deliver_websocket_data(nc));
+      break;
+    case MG_EV_POLL:
+      /* Ping idle websocket connections */
+      {
+        time_t now = *(time_t *) ev_data;
+        if (nc->flags & MG_F_IS_WEBSOCKET &&
+            now > nc->last_io_time + MG_WEBSOCKET_PING_INTERVAL_SECONDS) {
+          mg_send_websocket_frame(nc, WEBSOCKET_OP_PING, "", 0);
+        }
+      }
+      break;
+    case MG_EV_DRAIN:
+      /* 1001: the endpoint is going away */
+      if (!(nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY))) {
+        mg_ws_close(nc, "\x03\xe9", 2);
+      }
+      break;
+    default:
+      break;
+  }
+#if MG_ENABLE_CALLBACK_USERDATA
+  (void) user_data;
+#endif
 }
 
-static int mg_mkdir(const char *path, uint32_t mode) {
-#ifndef _WIN32
-  return mkdir(path, mode);
+#ifndef MG_EXT_SHA1
+void mg_hash_sha1_v(size_t num_msgs, const uint8_t *msgs[],
+                    const size_t *msg_lens, uint8_t *digest) {
+  size_t i;
+  cs_sha1_ctx sha_ctx;
+  cs_sha1_init(&sha_ctx);
+  for (i = 0; i < num_msgs; i++) {
+    cs_sha1_update(&sha_ctx, msgs[i], msg_lens[i]);
+  }
+  cs_sha1_final(digest, &sha_ctx);
+}
 #else
-  (void) mode;
-  return _mkdir(path);
+extern void mg_hash_sha1_v(size_t num_msgs, const uint8_t *msgs[],
+                           const size_t *msg_lens, uint8_t *digest);
 #endif
-}
 
-static void mg_print_props(struct mg_connection *nc, const char *name,
-                           cs_stat_t *stp) {
-  char mtime[64];
-  time_t t = stp->st_mtime; /* store in local variable for NDK compile */
-  struct mg_str name_esc = mg_url_encode(mg_mk_str(name));
-  mg_gmt_time_string(mtime, sizeof(mtime), &t);
-  mg_printf(nc,
-            "<d:response>"
-            "<d:href>%s</d:href>"
-            "<d:propstat>"
-            "<d:prop>"
-            "<d:resourcetype>%s</d:resourcetype>"
-            "<d:getcontentlength>%" INT64_FMT
-            "</d:getcontentlength>"
-            "<d:getlastmodified>%s</d:getlastmodified>"
-            "</d:prop>"
-            "<d:status>HTTP/1.1 200 OK</d:status>"
-            "</d:propstat>"
-            "</d:response>\n",
-            name_esc.p, S_ISDIR(stp->st_mode) ? "<d:collection/>" : "",
-            (int64_t) stp->st_size, mtime);
-  free((void *) name_esc.p);
-}
+MG_INTERNAL void mg_ws_handshake(struct mg_connection *nc,
+                                 const struct mg_str *key,
+                                 struct http_message *hm) {
+  static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  const uint8_t *msgs[2] = {(const uint8_t *) key->p, (const uint8_t *) magic};
+  const size_t msg_lens[2] = {key->len, 36};
+  unsigned char sha[20];
+  char b64_sha[30];
+  struct mg_str *s;
 
-MG_INTERNAL void mg_handle_propfind(struct mg_connection *nc, const char *path,
-                                    cs_stat_t *stp, struct http_message *hm,
-                                    struct mg_serve_http_opts *opts) {
-  static const char header[] =
-      "HTTP/1.1 207 Multi-Status\r\n"
-      "Connection: close\r\n"
-      "Content-Type: text/xml; charset=utf-8\r\n\r\n"
-      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-      "<d:multistatus xmlns:d='DAV:'>\n";
-  static const char footer[] = "</d:multistatus>\n";
-  const struct mg_str *depth = mg_get_http_header(hm, "Depth");
+  mg_hash_sha1_v(2, msgs, msg_lens, sha);
+  mg_base64_encode(sha, sizeof(sha), b64_sha);
+  mg_printf(nc, "%s",
+            "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n");
 
-  /* Print properties for the requested resource itself */
-  if (S_ISDIR(stp->st_mode) &&
-      strcmp(opts->enable_directory_listing, "yes") != 0) {
-    mg_printf(nc, "%s", "HTTP/1.1 403 Directory Listing Denied\r\n\r\n");
-  } else {
-    char uri[MG_MAX_PATH];
-    mg_send(nc, header, sizeof(header) - 1);
-    snprintf(uri, sizeof(uri), "%.*s", (int) hm->uri.len, hm->uri.p);
-    mg_print_props(nc, uri, stp);
-    if (S_ISDIR(stp->st_mode) && (depth == NULL || mg_vcmp(depth, "0") != 0)) {
-      mg_scan_directory(nc, path, opts, mg_print_props);
-    }
-    mg_send(nc, footer, sizeof(footer) - 1);
-    nc->flags |= MG_F_SEND_AND_CLOSE;
+  s = mg_get_http_header(hm, "Sec-WebSocket-Protocol");
+  if (s != NULL) {
+    mg_printf(nc, "Sec-WebSocket-Protocol: %.*s\r\n", (int) s->len, s->p);
   }
+  mg_printf(nc, "Sec-WebSocket-Accept: %s%s", b64_sha, "\r\n\r\n");
+
+  DBG(("%p %.*s %s", nc, (int) key->len, key->p, b64_sha));
 }
 
-#if MG_ENABLE_FAKE_DAVLOCK
-/*
- * Windows explorer (probably there are another WebDav clients like it)
- * requires LOCK support in webdav. W/out this, it still works, but fails
- * to save file: shows error message and offers "Save As".
- * "Save as" works, but this message is very annoying.
- * This is fake lock, which doesn't lock something, just returns LOCK token,
- * UNLOCK always answers "OK".
- * With this fake LOCK Windows Explorer looks happy and saves file.
- * NOTE: that is not DAV LOCK imlementation, it is just a way to shut up
- * Windows native DAV client. This is why FAKE LOCK is not enabed by default
- */
-MG_INTERNAL void mg_handle_lock(struct mg_connection *nc, const char *path) {
-  static const char *reply =
-      "HTTP/1.1 207 Multi-Status\r\n"
-      "Connection: close\r\n"
-      "Content-Type: text/xml; charset=utf-8\r\n\r\n"
-      "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-      "<d:multistatus xmlns:d='DAV:'>\n"
-      "<D:lockdiscovery>\n"
-      "<D:activelock>\n"
-      "<D:locktoken>\n"
-      "<D:href>\n"
-      "opaquelocktoken:%s%u"
-      "</D:href>"
-      "</D:locktoken>"
-      "</D:activelock>\n"
-      "</D:lockdiscovery>"
-      "</d:multistatus>\n";
-  mg_printf(nc, reply, path, (unsigned int) mg_time());
-  nc->flags |= MG_F_SEND_AND_CLOSE;
+void mg_send_websocket_handshake2(struct mg_connection *nc, const char *path,
+                                  const char *host, const char *protocol,
+                                  const char *extra_headers) {
+  mg_send_websocket_handshake3(nc, path, host, protocol, extra_headers, NULL,
+                               NULL);
 }
-#endif
 
-MG_INTERNAL void mg_handle_mkcol(struct mg_connection *nc, const char *path,
-                                 struct http_message *hm) {
-  int status_code = 500;
-  if (hm->body.len != (size_t) ~0 && hm->body.len > 0) {
-    status_code = 415;
-  } else if (!mg_mkdir(path, 0755)) {
-    status_code = 201;
-  } else if (errno == EEXIST) {
-    status_code = 405;
-  } else if (errno == EACCES) {
-    status_code = 403;
-  } else if (errno == ENOENT) {
-    status_code = 409;
-  } else {
-    status_code = 500;
-  }
-  mg_http_send_error(nc, status_code, NULL);
+void mg_send_websocket_handshake3(struct mg_connection *nc, const char *path,
+                                  const char *host, const char *protocol,
+                                  const char *extra_headers, const char *user,
+                                  const char *pass) {
+  mg_send_websocket_handshake3v(nc, mg_mk_str(path), mg_mk_str(host),
+                                mg_mk_str(protocol), mg_mk_str(extra_headers),
+                                mg_mk_str(user), mg_mk_str(pass));
 }
 
-static int mg_remove_directory(const struct mg_serve_http_opts *opts,
-                               const char *dir) {
-  char path[MG_MAX_PATH];
-  struct dirent *dp;
-  cs_stat_t st;
-  DIR *dirp;
+void mg_send_websocket_handshake3v(struct mg_connection *nc,
+                                   const struct mg_str path,
+                                   const struct mg_str host,
+                                   const struct mg_str protocol,
+                                   const struct mg_str extra_headers,
+                                   const struct mg_str user,
+                                   const struct mg_str pass) {
+  struct mbuf auth;
+  char key[25];
+  uint32_t nonce[4];
+  nonce[0] = mg_ws_random_mask();
+  nonce[1] = mg_ws_random_mask();
+  nonce[2] = mg_ws_random_mask();
+  nonce[3] = mg_ws_random_mask();
+  mg_base64_encode((unsigned char *) &nonce, sizeof(nonce), key);
 
-  if ((dirp = opendir(dir)) == NULL) return 0;
+  mbuf_init(&auth, 0);
+  if (user.len > 0) {
+    mg_basic_auth_header(user, pass, &auth);
+  }
 
-  while ((dp = readdir(dirp)) != NULL) {
-    if (mg_is_file_hidden((const char *) dp->d_name, opts, 1)) {
-      continue;
-    }
-    snprintf(path, sizeof(path), "%s%c%s", dir, '/', dp->d_name);
-    mg_stat(path, &st);
-    if (S_ISDIR(st.st_mode)) {
-      mg_remove_directory(opts, path);
-    } else {
-      remove(path);
-    }
+  /*
+   * NOTE: the  (auth.buf == NULL ? "" : auth.buf) is because cc3200 libc is
+   * broken: it doesn't like zero length to be passed to %.*s
+   * i.e. sprintf("f%.*so", (int)0, NULL), yields `f\0o`.
+   * because it handles NULL specially (and incorrectly).
+   */
+  mg_printf(nc,
+            "GET %.*s HTTP/1.1\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "%.*s"
+            "Sec-WebSocket-Version: 13\r\n"
+            "Sec-WebSocket-Key: %s\r\n",
+            (int) path.len, path.p, (int) auth.len,
+            (auth.buf == NULL ? "" : auth.buf), key);
+
+  /* TODO(mkm): take default hostname from http proto data if host == NULL */
+  if (host.len > 0) {
+    int host_len = (int) (path.p - host.p); /* Account for possible :PORT */
+    mg_printf(nc, "Host: %.*s\r\n", host_len, host.p);
   }
-  closedir(dirp);
-  rmdir(dir);
+  if (protocol.len > 0) {
+    mg_printf(nc, "Sec-WebSocket-Protocol: %.*s\r\n", (int) protocol.len,
+              protocol.p);
+  }
+  if (extra_headers.len > 0) {
+    mg_printf(nc, "%.*s", (int) extra_headers.len, extra_headers.p);
+  }
+  mg_printf(nc, "\r\n");
 
-  return 1;
+  mbuf_free(&auth);
 }
 
-MG_INTERNAL void mg_handle_move(struct mg_connection *c,
-                                const struct mg_serve_http_opts *opts,
-                                const char *path, struct http_message *hm) {
-  const struct mg_str *dest = mg_get_http_header(hm, "Destination");
-  if (dest == NULL) {
-    mg_http_send_error(c, 411, NULL);
-  } else {
-    const char *p = (char *) memchr(dest->p, '/', dest->len);
-    if (p != NULL && p[1] == '/' &&
-        (p = (char *) memchr(p + 2, '/', dest->p + dest->len - p)) != NULL) {
-      char buf[MG_MAX_PATH];
-      snprintf(buf, sizeof(buf), "%s%.*s", opts->dav_document_root,
-               (int) (dest->p + dest->len - p), p);
-      if (rename(path, buf) == 0) {
-        mg_http_send_error(c, 200, NULL);
-      } else {
-        mg_http_send_error(c, 418, NULL);
-      }
-    } else {
-      mg_http_send_error(c, 500, NULL);
-    }
+void mg_send_websocket_handshake(struct mg_connection *nc, const char *path,
+                                 const char *extra_headers) {
+  struct mg_str null_str = MG_NULL_STR;
+  mg_send_websocket_handshake3v(
+      nc, mg_mk_str(path), null_str /* host */, null_str /* protocol */,
+      mg_mk_str(extra_headers), null_str /* user */, null_str /* pass */);
+}
+
+struct mg_connection *mg_connect_ws_opt(
+    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
+    struct mg_connect_opts opts, const char *url, const char *protocol,
+    const char *extra_headers) {
+  struct mg_str null_str = MG_NULL_STR;
+  struct mg_str host = MG_NULL_STR, path = MG_NULL_STR, user_info = MG_NULL_STR;
+  struct mg_connection *nc =
+      mg_connect_http_base(mgr, MG_CB(ev_handler, user_data), opts, "http",
+                           "ws", "https", "wss", url, &path, &user_info, &host);
+  if (nc != NULL) {
+    mg_send_websocket_handshake3v(nc, path, host, mg_mk_str(protocol),
+                                  mg_mk_str(extra_headers), user_info,
+                                  null_str);
   }
+  return nc;
 }
 
-MG_INTERNAL void mg_handle_delete(struct mg_connection *nc,
-                                  const struct mg_serve_http_opts *opts,
-                                  const char *path) {
-  cs_stat_t st;
-  if (mg_stat(path, &st) != 0) {
-    mg_http_send_error(nc, 404, NULL);
-  } else if (S_ISDIR(st.st_mode)) {
-    mg_remove_directory(opts, path);
-    mg_http_send_error(nc, 204, NULL);
-  } else if (remove(path) == 0) {
-    mg_http_send_error(nc, 204, NULL);
-  } else {
-    mg_http_send_error(nc, 423, NULL);
-  }
+struct mg_connection *mg_connect_ws(
+    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
+    const char *url, const char *protocol, const char *extra_headers) {
+  struct mg_connect_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  return mg_connect_ws_opt(mgr, MG_CB(ev_handler, user_data), opts, url,
+                           protocol, extra_headers);
 }
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET */
 
-/* Return -1 on error, 1 on success. */
-static int mg_create_itermediate_directories(const char *path) {
-  const char *s;
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
+#ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_http_sse.c"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
 
-  /* Create intermediate directories if they do not exist */
-  for (s = path + 1; *s != '\0'; s++) {
-    if (*s == '/') {
-      char buf[MG_MAX_PATH];
-      cs_stat_t st;
-      snprintf(buf, sizeof(buf), "%.*s", (int) (s - path), path);
-      buf[sizeof(buf) - 1] = '\0';
-      if (mg_stat(buf, &st) != 0 && mg_mkdir(buf, 0755) != 0) {
-        return -1;
-      }
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
+
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_SSE
+
+/* Amalgamated: #include "mg_http_sse.h" */
+/* Amalgamated: #include "mg_internal.h" */
+
+struct mg_sse_sub {
+  LIST_ENTRY(mg_sse_sub) link; /* mg_sse_channel::subs linkage */
+  struct mg_sse_channel *ch;   /* NULL once the channel is freed */
+  struct mg_connection *nc;
+  unsigned long last_id; /* Of the last event queued on `nc` */
+};
+
+/* Header of an event in the replay buffer, followed by the event text. */
+struct mg_sse_rec {
+  unsigned long id;
+  size_t len;
+};
+
+void mg_sse_channel_init(struct mg_sse_channel *ch) {
+  memset(ch, 0, sizeof(*ch));
+  LIST_INIT(&ch->subs);
+  mbuf_init(&ch->replay, 0);
+}
+
+void mg_sse_channel_free(struct mg_sse_channel *ch) {
+  struct mg_sse_sub *sub;
+  while ((sub = LIST_FIRST(&ch->subs)) != NULL) {
+    LIST_REMOVE(sub, link);
+    sub->ch = NULL;
+    sub->nc->flags |= MG_F_SEND_AND_CLOSE;
+    mg_mark_closing(sub->nc);
+  }
+  mbuf_free(&ch->replay);
+}
+
+/* Queues the events following `last_id`, as far as the backlog allows. */
+MG_INTERNAL void mg_sse_send_pending(struct mg_sse_sub *sub) {
+  struct mg_sse_channel *ch = sub->ch;
+  struct mg_sse_rec rec;
+  size_t off = 0;
+  if (ch == NULL) return;
+  while (sub->last_id != ch->last_id &&
+         sub->nc->send_mbuf.len < MG_SSE_MAX_BACKLOG) {
+    for (; off < ch->replay.len; off += sizeof(rec) + rec.len) {
+      memcpy(&rec, ch->replay.buf + off, sizeof(rec));
+      if (rec.id > sub->last_id) break;
+    }
+    if (off >= ch->replay.len) {
+      /* The rest is not kept anymore */
+      sub->last_id = ch->last_id;
+      break;
     }
+    mg_send(sub->nc, ch->replay.buf + off + sizeof(rec), rec.len);
+    sub->last_id = rec.id;
+    off += sizeof(rec) + rec.len;
   }
+}
 
-  return 1;
+MG_INTERNAL void mg_sse_unsubscribe(struct mg_sse_sub *sub) {
+  if (sub == NULL) return;
+  if (sub->ch != NULL) LIST_REMOVE(sub, link);
+  MG_FREE(sub);
 }
 
-MG_INTERNAL void mg_handle_put(struct mg_connection *nc, const char *path,
-                               struct http_message *hm) {
+void mg_sse_subscribe(struct mg_connection *nc, struct mg_sse_channel *ch,
+                      struct http_message *hm) {
   struct mg_http_proto_data *pd = mg_http_get_proto_data(nc);
-  cs_stat_t st;
-  const struct mg_str *cl_hdr = mg_get_http_header(hm, "Content-Length");
-  int rc, status_code = mg_stat(path, &st) == 0 ? 200 : 201;
-
-  mg_http_free_proto_data_file(&pd->file);
-  if ((rc = mg_create_itermediate_directories(path)) == 0) {
-    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
-  } else if (rc == -1) {
-    mg_http_send_error(nc, 500, NULL);
-  } else if (cl_hdr == NULL) {
-    mg_http_send_error(nc, 411, NULL);
-  } else if ((pd->file.fp = mg_fopen(path, "w+b")) == NULL) {
-    mg_http_send_error(nc, 500, NULL);
-  } else {
-    const struct mg_str *range_hdr = mg_get_http_header(hm, "Content-Range");
-    int64_t r1 = 0, r2 = 0;
-    pd->file.type = DATA_PUT;
-    mg_set_close_on_exec((sock_t) fileno(pd->file.fp));
-    pd->file.cl = to64(cl_hdr->p);
-    if (range_hdr != NULL &&
-        mg_http_parse_range_header(range_hdr, &r1, &r2) > 0) {
-      status_code = 206;
-      fseeko(pd->file.fp, r1, SEEK_SET);
-      pd->file.cl = r2 > r1 ? r2 - r1 + 1 : pd->file.cl - r1;
+  struct mg_str *hdr = mg_get_http_header(hm, "Last-Event-ID");
+  struct mg_sse_sub *sub;
+  unsigned long id = ch->last_id;
+  char buf[24];
+
+  if (pd->sse != NULL) return;
+  sub = (struct mg_sse_sub *) MG_CALLOC(1, sizeof(*sub));
+  if (sub == NULL) {
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  if (hdr != NULL && hdr->len > 0 && hdr->len < sizeof(buf)) {
+    memcpy(buf, hdr->p, hdr->len);
+    buf[hdr->len] = '\0';
+    id = strtoul(buf, NULL, 10);
+    /* An ID from before a restart cannot be replayed */
+    if (id > ch->last_id) id = ch->last_id;
+  }
+  sub->ch = ch;
+  sub->nc = nc;
+  sub->last_id = id;
+  pd->sse = sub;
+  LIST_INSERT_HEAD(&ch->subs, sub, link);
+
+  mg_send_response_line(nc, 200,
+                        "Content-Type: text/event-stream\r\n"
+                        "Cache-Control: no-cache");
+  mg_send(nc, "\r\n", 2);
+  mg_sse_send_pending(sub);
+}
+
+unsigned long mg_sse_publish(struct mg_sse_channel *ch, const char *event,
+                             const char *data) {
+  struct mbuf *io = &ch->replay;
+  struct mg_sse_rec rec;
+  struct mg_sse_sub *sub;
+  const char *p = (data != NULL ? data : ""), *eol;
+  size_t start, off, n;
+  char buf[30];
+
+  /* Format the event once, at the end of the replay buffer */
+  rec.id = ++ch->last_id;
+  rec.len = 0;
+  start = io->len;
+  if (mbuf_append(io, &rec, sizeof(rec)) == 0) return rec.id;
+  n = snprintf(buf, sizeof(buf), "id: %lu\n", rec.id);
+  mbuf_append(io, buf, n);
+  if (event != NULL) {
+    mbuf_append(io, "event: ", 7);
+    mbuf_append(io, event, strcspn(event, "\r\n"));
+    mbuf_append(io, "\n", 1);
+  }
+  for (;;) {
+    /* A line ends with CR, LF or CRLF, as the client parses it */
+    n = strcspn(p, "\r\n");
+    eol = p + n;
+    mbuf_append(io, "data: ", 6);
+    mbuf_append(io, p, n);
+    mbuf_append(io, "\n", 1);
+    if (*eol == '\0') break;
+    p = eol + (eol[0] == '\r' && eol[1] == '\n' ? 2 : 1);
+  }
+  mbuf_append(io, "\n", 1);
+  rec.len = io->len - start - sizeof(rec);
+  memcpy(io->buf + start, &rec, sizeof(rec));
+
+  /* Drop the oldest events to stay within the limit, keeping this one */
+  for (off = 0; off < start && io->len - off > MG_SSE_REPLAY_SIZE;) {
+    struct mg_sse_rec old;
+    memcpy(&old, io->buf + off, sizeof(old));
+    off += sizeof(old) + old.len;
+  }
+  mbuf_remove(io, off);
+  start -= off;
+
+  LIST_FOREACH(sub, &ch->subs, link) {
+    if (sub->last_id + 1 == rec.id &&
+        sub->nc->send_mbuf.len < MG_SSE_MAX_BACKLOG) {
+      mg_send(sub->nc, io->buf + start + sizeof(rec), rec.len);
+      sub->last_id = rec.id;
+    } else {
+      mg_sse_send_pending(sub);
     }
-    mg_printf(nc, "HTTP/1.1 %d OK\r\nContent-Length: 0\r\n\r\n", status_code);
-    /* Remove HTTP request from the mbuf, leave only payload */
-    mbuf_remove(&nc->recv_mbuf, hm->message.len - hm->body.len);
-    mg_http_transfer_file_data(nc);
   }
+  return rec.id;
 }
 
-#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBDAV */
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_SSE */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
-#line 1 "mongoose/src/mg_http_websocket.c"
+#line 1 "mongoose/src/mg_http2.c"
 #endif
 /*
- * Copyright (c) 2014 Cesanta Software Limited
+ * Copyright (c) 2014-2018 Cesanta Software Limited
  * All rights reserved
  */
 
-#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_HTTP
 
-/* Amalgamated: #include "common/cs_sha1.h" */
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP2
 
-#ifndef MG_WEBSOCKET_PING_INTERVAL_SECONDS
-#define MG_WEBSOCKET_PING_INTERVAL_SECONDS 5
-#endif
+/* Amalgamated: #include "mg_http2.h" */
+/* Amalgamated: #include "mg_internal.h" */
 
-#define FLAGS_MASK_FIN (1 << 7)
-#define FLAGS_MASK_OP 0x0f
+#define MG_H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define MG_H2_PREFACE_LEN 24
+#define MG_H2_FRAME_HDR_LEN 9
 
-static int mg_is_ws_fragment(unsigned char flags) {
-  return (flags & FLAGS_MASK_FIN) == 0 ||
-         (flags & FLAGS_MASK_OP) == WEBSOCKET_OP_CONTINUE;
-}
+/* Protocol defaults, which also apply to our side unless advertised. */
+#define MG_H2_DEFAULT_WINDOW 65535
+#define MG_H2_DEFAULT_FRAME_SIZE 16384
+#define MG_H2_DEFAULT_TABLE_SIZE 4096
+#define MG_H2_MAX_WINDOW 0x7fffffff
 
-static int mg_is_ws_first_fragment(unsigned char flags) {
-  return (flags & FLAGS_MASK_FIN) == 0 &&
-         (flags & FLAGS_MASK_OP) != WEBSOCKET_OP_CONTINUE;
-}
+/*
+ * Response data is framed in small pieces, and only while there is not much
+ * queued on the connection already, so that streams can be interleaved.
+ */
+#define MG_H2_MAX_DATA_FRAME MG_MAX_HTTP_SEND_MBUF
+#define MG_H2_SEND_HIGH_WATER (2 * MG_MAX_HTTP_SEND_MBUF)
+
+#define MG_H2_FRAME_DATA 0
+#define MG_H2_FRAME_HEADERS 1
+#define MG_H2_FRAME_PRIORITY 2
+#define MG_H2_FRAME_RST_STREAM 3
+#define MG_H2_FRAME_SETTINGS 4
+#define MG_H2_FRAME_PUSH_PROMISE 5
+#define MG_H2_FRAME_PING 6
+#define MG_H2_FRAME_GOAWAY 7
+#define MG_H2_FRAME_WINDOW_UPDATE 8
+#define MG_H2_FRAME_CONTINUATION 9
+
+#define MG_H2_FLAG_END_STREAM 0x1
+#define MG_H2_FLAG_ACK 0x1
+#define MG_H2_FLAG_END_HEADERS 0x4
+#define MG_H2_FLAG_PADDED 0x8
+#define MG_H2_FLAG_PRIORITY 0x20
+
+#define MG_H2_NO_ERROR 0x0
+#define MG_H2_PROTOCOL_ERROR 0x1
+#define MG_H2_INTERNAL_ERROR 0x2
+#define MG_H2_FLOW_CONTROL_ERROR 0x3
+#define MG_H2_STREAM_CLOSED 0x5
+#define MG_H2_FRAME_SIZE_ERROR 0x6
+#define MG_H2_REFUSED_STREAM 0x7
+#define MG_H2_CANCEL 0x8
+#define MG_H2_COMPRESSION_ERROR 0x9
+#define MG_H2_ENHANCE_YOUR_CALM 0xb
+
+#define MG_H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define MG_H2_SETTINGS_ENABLE_PUSH 0x2
+#define MG_H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define MG_H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define MG_H2_SETTINGS_MAX_FRAME_SIZE 0x5
 
-static int mg_is_ws_control_frame(unsigned char flags) {
-  unsigned char op = (flags & FLAGS_MASK_OP);
-  return op == WEBSOCKET_OP_CLOSE || op == WEBSOCKET_OP_PING ||
-         op == WEBSOCKET_OP_PONG;
+/*
+ * HPACK Huffman code (RFC 7541 appendix B) in canonical form: the number of
+ * codes of each bit length, EOS not included, and symbols in code order.
+ */
+static const uint8_t s_h2_huff_counts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26,
+    29, 12, 4, 15, 19, 29, 0, 3,
+};
+static const uint8_t s_h2_huff_syms[256] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53,
+    54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114,
+    117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82,
+    83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44,
+    59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+    94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226,
+    153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132,
+    133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185,
+    186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+    141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+    180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+    206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221,
+    222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+    30, 31, 127, 220, 249, 10, 13, 22,
+};
+
+static const struct mg_h2_static_hdr {
+  const char *name, *value;
+} s_h2_static[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+enum mg_h2_resp_state {
+  MG_H2_RESP_HEAD, /* Waiting for the status line and headers */
+  MG_H2_RESP_BODY, /* Headers sent, framing the body */
+  MG_H2_RESP_DONE
+};
+
+enum mg_h2_body_mode {
+  MG_H2_BODY_NONE,
+  MG_H2_BODY_LENGTH,  /* Content-Length is known */
+  MG_H2_BODY_CHUNKED, /* Chunked encoding, stripped as we go */
+  MG_H2_BODY_CLOSE    /* Delimited by closing the stream connection */
+};
+
+struct mg_h2_stream {
+  struct mg_h2_stream *next;
+  struct mg_connection *nc; /* Connection the stream is presented as */
+  uint32_t id;
+  uint32_t dep;         /* Stream this one depends on, 0 if none */
+  int weight;           /* 1 to 256 */
+  unsigned long vtime;  /* Virtual finish time, for fair queueing */
+  int64_t send_window;  /* Can go negative after SETTINGS */
+  int64_t recv_window;  /* Receive credit the peer has left */
+  size_t body_left;      /* Of the body, or of the current chunk */
+  enum mg_h2_resp_state resp_state;
+  enum mg_h2_body_mode body_mode;
+  unsigned int head_req : 1;     /* HEAD request, no response body */
+  unsigned int req_chunked : 1;  /* Request body is passed chunk-encoded */
+  unsigned int req_discard : 1;  /* Request body is dropped */
+  unsigned int chunk_crlf : 1;   /* CRLF of the previous chunk is pending */
+  unsigned int remote_closed : 1;
+  unsigned int local_closed : 1;
+  unsigned int stalled : 1; /* Can't make progress in this round */
+};
+
+struct mg_h2_conn {
+  struct mg_iface *iface; /* Virtual interface of the stream connections */
+  struct mg_h2_stream *streams;
+  int num_streams;
+  uint32_t last_stream_id;
+  unsigned long vtime;
+  int64_t send_window;
+  uint32_t recv_unacked;
+  uint32_t peer_window; /* Peer's SETTINGS_INITIAL_WINDOW_SIZE */
+  uint32_t peer_max_frame;
+
+  /* HPACK decoder state */
+  struct mbuf hpack;   /* Dynamic table, see mg_h2_hpack_add() */
+  size_t hpack_size;   /* As defined in RFC 7541 4.1 */
+  size_t hpack_max;    /* Current max size */
+  size_t hpack_limit;  /* Max size the peer may set */
+  uint32_t hpack_count;
+
+  /* Header block being received */
+  struct mbuf hdr_block;
+  uint32_t hdr_stream_id; /* Non-zero while CONTINUATION frames are due */
+  int hdr_flags;
+  uint32_t hdr_dep;
+  int hdr_weight;
+
+  unsigned int settings_acked : 1; /* Our stream window is in effect */
+  unsigned int goaway : 1;
+  unsigned int closing : 1;
+};
+
+/* Synthesized HTTP/1.1 request */
+struct mg_h2_req {
+  struct mbuf method, path, authority, cookie;
+  struct mbuf headers; /* Regular header lines */
+  int has_host, has_length, bad;
+};
+
+static uint32_t mg_h2_get32(const unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void mg_h2_put32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+}
+
+static void mg_h2_send_frame(struct mg_connection *nc, int type, int flags,
+                             uint32_t id, const void *data, size_t len) {
+  unsigned char hdr[MG_H2_FRAME_HDR_LEN];
+  hdr[0] = (unsigned char) (len >> 16);
+  hdr[1] = (unsigned char) (len >> 8);
+  hdr[2] = (unsigned char) len;
+  hdr[3] = (unsigned char) type;
+  hdr[4] = (unsigned char) flags;
+  mg_h2_put32(hdr + 5, id);
+  mg_send(nc, hdr, sizeof(hdr));
+  if (len > 0) mg_send(nc, data, len);
+}
+
+/* Sends RST_STREAM or WINDOW_UPDATE, which carry a single 32-bit value. */
+static void mg_h2_send_u32(struct mg_connection *nc, int type, uint32_t id,
+                           uint32_t v) {
+  unsigned char buf[4];
+  mg_h2_put32(buf, v);
+  mg_h2_send_frame(nc, type, 0, id, buf, sizeof(buf));
+}
+
+static void mg_h2_conn_error(struct mg_connection *nc, uint32_t code) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  unsigned char buf[8];
+  if (nc->flags & MG_F_SEND_AND_CLOSE) return;
+  LOG(LL_INFO, ("%p HTTP/2 error %d", nc, (int) code));
+  mg_h2_put32(buf, h2->last_stream_id);
+  mg_h2_put32(buf + 4, code);
+  mg_h2_send_frame(nc, MG_H2_FRAME_GOAWAY, 0, 0, buf, sizeof(buf));
+  h2->goaway = 1;
+  nc->flags |= MG_F_SEND_AND_CLOSE;
 }
 
-static void mg_handle_incoming_websocket_frame(struct mg_connection *nc,
-                                               struct websocket_message *wsm) {
-  if (wsm->flags & 0x8) {
-    mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_CONTROL_FRAME, wsm);
-  } else {
-    mg_call(nc, nc->handler, nc->user_data, MG_EV_WEBSOCKET_FRAME, wsm);
+static struct mg_h2_stream *mg_h2_find_stream(struct mg_h2_conn *h2,
+                                              uint32_t id) {
+  struct mg_h2_stream *s;
+  for (s = h2->streams; s != NULL && s->id != id; s = s->next) {
   }
+  return s;
 }
 
-static struct mg_ws_proto_data *mg_ws_get_proto_data(struct mg_connection *nc) {
-  struct mg_http_proto_data *htd = mg_http_get_proto_data(nc);
-  return (htd != NULL ? &htd->ws_data : NULL);
+/* Response is over: closing the connection ends the stream. */
+static void mg_h2_stream_done(struct mg_h2_stream *s) {
+  s->resp_state = MG_H2_RESP_DONE;
+  s->local_closed = 1;
+  s->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  mg_mark_closing(s->nc);
+}
+
+static void mg_h2_reset_stream(struct mg_connection *nc,
+                               struct mg_h2_stream *s, uint32_t code) {
+  mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, s->id, code);
+  mg_h2_stream_done(s);
+  s->remote_closed = 1;
 }
 
 /*
- * Sends a Close websocket frame with the given data, and closes the underlying
- * connection. If `len` is ~0, strlen(data) is used.
+ * Credits received data back to the peer once half of the window is used.
+ * For a stream, only while its receive buffer is within the limit.
  */
-static void mg_ws_close(struct mg_connection *nc, const void *data,
-                        size_t len) {
-  if ((int) len == ~0) {
-    len = strlen((const char *) data);
+static void mg_h2_conn_ack(struct mg_connection *nc) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  if (h2->recv_unacked >= MG_H2_DEFAULT_WINDOW / 2) {
+    mg_h2_send_u32(nc, MG_H2_FRAME_WINDOW_UPDATE, 0, h2->recv_unacked);
+    h2->recv_unacked = 0;
   }
-  mg_send_websocket_frame(nc, WEBSOCKET_OP_CLOSE, data, len);
-  nc->flags |= MG_F_SEND_AND_CLOSE;
 }
 
-static int mg_deliver_websocket_data(struct mg_connection *nc) {
-  /* Using unsigned char *, cause of integer arithmetic below */
-  uint64_t i, data_len = 0, frame_len = 0, new_data_len = nc->recv_mbuf.len,
-              len, mask_len = 0, header_len = 0;
-  struct mg_ws_proto_data *wsd = mg_ws_get_proto_data(nc);
-  unsigned char *new_data = (unsigned char *) nc->recv_mbuf.buf,
-                *e = (unsigned char *) nc->recv_mbuf.buf + nc->recv_mbuf.len;
-  uint8_t flags;
-  int ok, reass;
+static void mg_h2_stream_ack(struct mg_connection *nc,
+                             struct mg_h2_stream *s) {
+  if (s->recv_window <= MG_H2_STREAM_WINDOW / 2 && !s->remote_closed &&
+      s->nc->recv_mbuf.len < s->nc->recv_mbuf_limit) {
+    mg_h2_send_u32(nc, MG_H2_FRAME_WINDOW_UPDATE, s->id,
+                   (uint32_t)(MG_H2_STREAM_WINDOW - s->recv_window));
+    s->recv_window = MG_H2_STREAM_WINDOW;
+  }
+}
 
-  if (wsd->reass_len > 0) {
-    /*
-     * We already have some previously received data which we need to
-     * reassemble and deliver to the client code when we get the final
-     * fragment.
-     *
-     * NOTE: it doesn't mean that the current message must be a continuation:
-     * it might be a control frame (Close, Ping or Pong), which should be
-     * handled without breaking the fragmented message.
-     */
+/*
+ * HPACK decoder.
+ */
 
-    size_t existing_len = wsd->reass_len;
-    assert(new_data_len >= existing_len);
+static int mg_h2_hpack_int(const unsigned char **p, const unsigned char *end,
+                           int prefix, uint32_t *v) {
+  uint32_t mask = (1U << prefix) - 1;
+  unsigned char b;
+  int shift = 0;
+  if (*p >= end) return -1;
+  *v = *(*p)++ & mask;
+  if (*v < mask) return 0;
+  do {
+    if (*p >= end || shift > 21) return -1;
+    b = *(*p)++;
+    *v += (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return 0;
+}
 
-    new_data += existing_len;
-    new_data_len -= existing_len;
+static int mg_h2_huff_decode(const unsigned char *s, size_t len,
+                             struct mbuf *out) {
+  uint32_t code = 0, first = 0, index = 0, count;
+  int bits = 0, ones = 1, bit, j;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    for (j = 7; j >= 0; j--) {
+      bit = (s[i] >> j) & 1;
+      code |= bit;
+      ones &= bit;
+      count = s_h2_huff_counts[++bits];
+      if (code - first < count) {
+        char c = (char) s_h2_huff_syms[index + code - first];
+        mbuf_append(out, &c, 1);
+        code = first = index = 0;
+        bits = 0;
+        ones = 1;
+      } else if (bits == 30) {
+        return -1; /* EOS, or not a code at all */
+      } else {
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+      }
+    }
   }
+  /* Padding must be the shortest possible prefix of EOS, i.e. all ones */
+  return (bits < 8 && ones) ? 0 : -1;
+}
 
-  flags = new_data[0];
+static int mg_h2_hpack_str(const unsigned char **p, const unsigned char *end,
+                           struct mbuf *out) {
+  uint32_t len;
+  int huffman;
+  if (*p >= end) return -1;
+  huffman = (**p & 0x80);
+  if (mg_h2_hpack_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p)) {
+    return -1;
+  }
+  if (huffman) {
+    if (mg_h2_huff_decode(*p, len, out) < 0) return -1;
+  } else {
+    mbuf_append(out, *p, len);
+  }
+  *p += len;
+  return 0;
+}
 
-  reass = new_data_len > 0 && mg_is_ws_fragment(flags) &&
-          !(nc->flags & MG_F_WEBSOCKET_NO_DEFRAG);
+static size_t mg_h2_get16(const struct mbuf *m, size_t off) {
+  return ((size_t)(unsigned char) m->buf[off] << 8) |
+         (unsigned char) m->buf[off + 1];
+}
 
-  if (reass && mg_is_ws_control_frame(flags)) {
-    /*
-     * Control frames can't be fragmented, so if we encounter fragmented
-     * control frame, close connection immediately.
-     */
-    mg_ws_close(nc, "fragmented control frames are illegal", ~0);
-    return 0;
-  } else if (new_data_len > 0 && !reass && !mg_is_ws_control_frame(flags) &&
-             wsd->reass_len > 0) {
-    /*
-     * When in the middle of a fragmented message, only the continuations
-     * and control frames are allowed.
-     */
-    mg_ws_close(nc, "non-continuation in the middle of a fragmented message",
-                ~0);
+/* Evicts the oldest dynamic table entries until the size is within max. */
+static void mg_h2_hpack_evict(struct mg_h2_conn *h2, size_t max) {
+  size_t off = 0, nlen, vlen;
+  while (h2->hpack_size > max) {
+    nlen = mg_h2_get16(&h2->hpack, off);
+    vlen = mg_h2_get16(&h2->hpack, off + 2);
+    off += 4 + nlen + vlen;
+    h2->hpack_size -= nlen + vlen + 32;
+    h2->hpack_count--;
+  }
+  mbuf_remove(&h2->hpack, off);
+}
+
+/*
+ * Dynamic table entries are stored oldest first, each as a 16-bit name
+ * length, 16-bit value length, name and value. Entries can't be larger
+ * than the table, so the lengths always fit.
+ */
+static void mg_h2_hpack_add(struct mg_h2_conn *h2, const struct mg_str *name,
+                            const struct mg_str *value) {
+  size_t size = name->len + value->len + 32;
+  unsigned char hdr[4];
+  if (size > h2->hpack_max) {
+    mg_h2_hpack_evict(h2, 0);
+    return;
+  }
+  mg_h2_hpack_evict(h2, h2->hpack_max - size);
+  hdr[0] = (unsigned char) (name->len >> 8);
+  hdr[1] = (unsigned char) name->len;
+  hdr[2] = (unsigned char) (value->len >> 8);
+  hdr[3] = (unsigned char) value->len;
+  mbuf_append(&h2->hpack, hdr, sizeof(hdr));
+  mbuf_append(&h2->hpack, name->p, name->len);
+  mbuf_append(&h2->hpack, value->p, value->len);
+  h2->hpack_size += size;
+  h2->hpack_count++;
+}
+
+static int mg_h2_hpack_get(struct mg_h2_conn *h2, uint32_t idx,
+                           struct mg_str *name, struct mg_str *value) {
+  size_t off = 0;
+  uint32_t i;
+  if (idx == 0) return -1;
+  if (idx <= ARRAY_SIZE(s_h2_static)) {
+    *name = mg_mk_str(s_h2_static[idx - 1].name);
+    *value = mg_mk_str(s_h2_static[idx - 1].value);
     return 0;
   }
+  /* Dynamic table indices start with the newest entry */
+  idx -= ARRAY_SIZE(s_h2_static);
+  if (idx > h2->hpack_count) return -1;
+  for (i = h2->hpack_count - idx; i > 0; i--) {
+    off += 4 + mg_h2_get16(&h2->hpack, off) + mg_h2_get16(&h2->hpack, off + 2);
+  }
+  name->len = mg_h2_get16(&h2->hpack, off);
+  value->len = mg_h2_get16(&h2->hpack, off + 2);
+  name->p = h2->hpack.buf + off + 4;
+  value->p = name->p + name->len;
+  return 0;
+}
 
-  if (new_data_len >= 2) {
-    len = new_data[1] & 0x7f;
-    mask_len = new_data[1] & FLAGS_MASK_FIN ? 4 : 0;
-    if (len < 126 && new_data_len >= mask_len) {
-      data_len = len;
-      header_len = 2 + mask_len;
-    } else if (len == 126 && new_data_len >= 4 + mask_len) {
-      header_len = 4 + mask_len;
-      data_len = ntohs(*(uint16_t *) &new_data[2]);
-    } else if (new_data_len >= 10 + mask_len) {
-      header_len = 10 + mask_len;
-      data_len = (((uint64_t) ntohl(*(uint32_t *) &new_data[2])) << 32) +
-                 ntohl(*(uint32_t *) &new_data[6]);
+static int mg_h2_is_valid(const struct mg_str *s) {
+  size_t i;
+  for (i = 0; i < s->len; i++) {
+    if (s->p[i] == '\r' || s->p[i] == '\n' || s->p[i] == '\0') return 0;
+  }
+  return 1;
+}
+
+static void mg_h2_req_field(struct mg_h2_req *r, const struct mg_str *name,
+                            const struct mg_str *value) {
+  struct mbuf *dst = NULL;
+  if (!mg_h2_is_valid(name) || !mg_h2_is_valid(value) ||
+      r->headers.len + name->len + value->len > MG_MAX_HTTP_REQUEST_SIZE) {
+    r->bad = 1;
+  }
+  if (r->bad) return;
+  if (name->len > 0 && name->p[0] == ':') {
+    if (mg_vcmp(name, ":method") == 0) {
+      dst = &r->method;
+    } else if (mg_vcmp(name, ":path") == 0) {
+      dst = &r->path;
+    } else if (mg_vcmp(name, ":authority") == 0) {
+      dst = &r->authority;
+    }
+    if (dst != NULL) mbuf_append(dst, value->p, value->len);
+    return;
+  }
+  if (mg_vcmp(name, "cookie") == 0) {
+    /* Cookie may be split into several fields, RFC 7540 8.1.2.5 */
+    if (r->cookie.len > 0) mbuf_append(&r->cookie, "; ", 2);
+    mbuf_append(&r->cookie, value->p, value->len);
+    return;
+  }
+  if (mg_vcmp(name, "host") == 0) r->has_host = 1;
+  if (mg_vcmp(name, "content-length") == 0) r->has_length = 1;
+  mbuf_append(&r->headers, name->p, name->len);
+  mbuf_append(&r->headers, ": ", 2);
+  mbuf_append(&r->headers, value->p, value->len);
+  mbuf_append(&r->headers, "\r\n", 2);
+}
+
+/* Decodes a header block, passing fields to r unless it is NULL. */
+static int mg_h2_hpack_decode(struct mg_h2_conn *h2, const unsigned char *p,
+                              size_t len, struct mg_h2_req *r) {
+  const unsigned char *end = p + len;
+  struct mbuf field; /* Name and value of a literal */
+  struct mg_str name, value;
+  uint32_t idx;
+  size_t name_len;
+  int add, res = -1;
+  mbuf_init(&field, 0);
+  for (;;) {
+    if (p == end) {
+      res = 0;
+      break;
+    }
+    if (*p & 0x80) {
+      /* Indexed field */
+      if (mg_h2_hpack_int(&p, end, 7, &idx) < 0 ||
+          mg_h2_hpack_get(h2, idx, &name, &value) < 0) {
+        break;
+      }
+    } else if ((*p & 0xe0) == 0x20) {
+      /* Dynamic table size update */
+      if (mg_h2_hpack_int(&p, end, 5, &idx) < 0 || idx > h2->hpack_limit) {
+        break;
+      }
+      h2->hpack_max = idx;
+      mg_h2_hpack_evict(h2, idx);
+      continue;
+    } else {
+      /* Literal, added to the table or not */
+      add = ((*p & 0xc0) == 0x40);
+      field.len = 0;
+      if (mg_h2_hpack_int(&p, end, add ? 6 : 4, &idx) < 0) break;
+      if (idx > 0) {
+        if (mg_h2_hpack_get(h2, idx, &name, &value) < 0) break;
+        mbuf_append(&field, name.p, name.len);
+      } else if (mg_h2_hpack_str(&p, end, &field) < 0) {
+        break;
+      }
+      name_len = field.len;
+      if (mg_h2_hpack_str(&p, end, &field) < 0) break;
+      name.p = field.buf;
+      name.len = name_len;
+      value.p = field.buf + name_len;
+      value.len = field.len - name_len;
+      if (add) mg_h2_hpack_add(h2, &name, &value);
     }
+    if (r != NULL) mg_h2_req_field(r, &name, &value);
   }
+  mbuf_free(&field);
+  return res;
+}
 
-  frame_len = header_len + data_len;
-  ok = (frame_len > 0 && frame_len <= new_data_len);
+/*
+ * HPACK encoder. Response headers are sent as literals that are not added
+ * to the peer's table, with names from the static table where possible.
+ */
 
-  /* Check for overflow */
-  if (frame_len < header_len || frame_len < data_len) {
-    ok = 0;
-    mg_ws_close(nc, "overflowed message", ~0);
+static void mg_h2_hpack_put_int(struct mbuf *m, int first, int prefix,
+                                size_t v) {
+  unsigned char buf[8];
+  size_t n = 0, mask = (1U << prefix) - 1;
+  if (v < mask) {
+    buf[n++] = (unsigned char) (first | v);
+  } else {
+    buf[n++] = (unsigned char) (first | mask);
+    for (v -= mask; v >= 0x80; v >>= 7) {
+      buf[n++] = (unsigned char) ((v & 0x7f) | 0x80);
+    }
+    buf[n++] = (unsigned char) v;
   }
+  mbuf_append(m, buf, n);
+}
 
-  if (ok) {
-    size_t cleanup_len = 0;
-    struct websocket_message wsm;
-
-    wsm.size = (size_t) data_len;
-    wsm.data = new_data + header_len;
-    wsm.flags = flags;
-
-    /* Apply mask if necessary */
-    if (mask_len > 0) {
-      for (i = 0; i < data_len; i++) {
-        new_data[i + header_len] ^= (new_data + header_len - mask_len)[i % 4];
-      }
+static void mg_h2_hpack_status(struct mbuf *m, int status) {
+  /* Statuses that have static table entries 8 to 14 */
+  static const int codes[] = {200, 204, 206, 304, 400, 404, 500};
+  char buf[8];
+  size_t i;
+  for (i = 0; i < ARRAY_SIZE(codes); i++) {
+    if (codes[i] == status) {
+      mg_h2_hpack_put_int(m, 0x80, 7, 8 + i);
+      return;
     }
+  }
+  snprintf(buf, sizeof(buf), "%d", status);
+  mg_h2_hpack_put_int(m, 0, 4, 8);
+  mg_h2_hpack_put_int(m, 0, 7, strlen(buf));
+  mbuf_append(m, buf, strlen(buf));
+}
 
-    if (reass) {
-      /* This is a message fragment */
+static void mg_h2_hpack_field(struct mbuf *m, const struct mg_str *name,
+                              const struct mg_str *value) {
+  size_t i, idx = 0;
+  /* Entries from 15 on are regular headers */
+  for (i = 14; i < ARRAY_SIZE(s_h2_static) && idx == 0; i++) {
+    if (mg_vcasecmp(name, s_h2_static[i].name) == 0) idx = i + 1;
+  }
+  mg_h2_hpack_put_int(m, 0, 4, idx);
+  if (idx == 0) {
+    /* Header names are lowercase in HTTP/2 */
+    mg_h2_hpack_put_int(m, 0, 7, name->len);
+    for (i = 0; i < name->len; i++) {
+      char c = (char) tolower(*(unsigned char *) &name->p[i]);
+      mbuf_append(m, &c, 1);
+    }
+  }
+  mg_h2_hpack_put_int(m, 0, 7, value->len);
+  mbuf_append(m, value->p, value->len);
+}
 
-      if (mg_is_ws_first_fragment(flags)) {
-        /*
-         * On the first fragmented frame, skip the first byte (op) and also
-         * reset size to 1 (op), it'll be incremented with the data len below.
-         */
-        new_data += 1;
-        wsd->reass_len = 1 /* op */;
-      }
+/*
+ * Request side.
+ */
 
-      /* Append this frame to the reassembled buffer */
-      memmove(new_data, wsm.data, e - wsm.data);
-      wsd->reass_len += wsm.size;
-      nc->recv_mbuf.len -= wsm.data - new_data;
+static void mg_h2_free_req(struct mg_h2_req *r) {
+  mbuf_free(&r->method);
+  mbuf_free(&r->path);
+  mbuf_free(&r->authority);
+  mbuf_free(&r->cookie);
+  mbuf_free(&r->headers);
+}
 
-      if (flags & FLAGS_MASK_FIN) {
-        /* On last fragmented frame - call user handler and remove data */
-        wsm.flags = FLAGS_MASK_FIN | nc->recv_mbuf.buf[0];
-        wsm.data = (unsigned char *) nc->recv_mbuf.buf + 1 /* op */;
-        wsm.size = wsd->reass_len - 1 /* op */;
-        cleanup_len = wsd->reass_len;
-        wsd->reass_len = 0;
+/* Passes request body data to the stream connection. */
+static void mg_h2_deliver(struct mg_h2_stream *s, const unsigned char *data,
+                          size_t len, int end_stream) {
+  struct mbuf m;
+  char buf[20];
+  if (s->req_discard) return;
+  if (!s->req_chunked) {
+    if (len > 0) mg_if_recv_tcp_cb(s->nc, (void *) data, (int) len, 0);
+    return;
+  }
+  mbuf_init(&m, len + sizeof(buf));
+  if (len > 0) {
+    snprintf(buf, sizeof(buf), "%lx\r\n", (unsigned long) len);
+    mbuf_append(&m, buf, strlen(buf));
+    mbuf_append(&m, data, len);
+    mbuf_append(&m, "\r\n", 2);
+  }
+  if (end_stream) mbuf_append(&m, "0\r\n\r\n", 5);
+  if (m.len > 0) mg_if_recv_tcp_cb(s->nc, m.buf, (int) m.len, 0);
+  mbuf_free(&m);
+}
 
-        /* Pass reassembled message to the client code. */
-        mg_handle_incoming_websocket_frame(nc, &wsm);
-        mbuf_remove(&nc->recv_mbuf, cleanup_len); /* Cleanup frame */
-      }
-    } else {
-      /*
-       * This is a complete message, not a fragment. It might happen in between
-       * of a fragmented message (in this case, WebSocket protocol requires
-       * current message to be a control frame).
-       */
-      cleanup_len = (size_t) frame_len;
+extern const struct mg_iface_vtable mg_h2_stream_iface_vtable;
 
-      /* First of all, check if we need to react on a control frame. */
-      switch (flags & FLAGS_MASK_OP) {
-        case WEBSOCKET_OP_PING:
-          mg_send_websocket_frame(nc, WEBSOCKET_OP_PONG, wsm.data, wsm.size);
-          break;
+static void mg_h2_open_stream(struct mg_connection *nc, uint32_t id,
+                              struct mg_h2_req *r, int end_stream) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  struct mg_h2_stream *s =
+      (struct mg_h2_stream *) MG_CALLOC(1, sizeof(*s));
+  struct mg_connection *c = NULL;
+  struct mg_add_sock_opts opts;
+  struct mg_str method = mg_mk_str_n(r->method.buf, r->method.len);
+  struct mbuf req;
 
-        case WEBSOCKET_OP_CLOSE:
-          mg_ws_close(nc, wsm.data, wsm.size);
-          break;
-      }
+  memset(&opts, 0, sizeof(opts));
+  opts.iface = h2->iface;
+  opts.user_data = nc->user_data;
+  if (s != NULL) c = mg_create_connection(nc->mgr, nc->handler, opts);
+  if (c == NULL) {
+    MG_FREE(s);
+    mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, id, MG_H2_REFUSED_STREAM);
+    return;
+  }
+  s->nc = c;
+  s->id = id;
+  s->dep = (h2->hdr_dep == id ? 0 : h2->hdr_dep);
+  s->weight = h2->hdr_weight;
+  s->vtime = h2->vtime;
+  s->send_window = h2->peer_window;
+  /* Until our SETTINGS is acknowledged, the peer goes by the default */
+  s->recv_window =
+      (h2->settings_acked ? MG_H2_STREAM_WINDOW : MG_H2_DEFAULT_WINDOW);
+  s->remote_closed = (end_stream != 0);
+  s->head_req = (mg_vcmp(&method, "HEAD") == 0);
+  s->next = h2->streams;
+  h2->streams = s;
+  h2->num_streams++;
+
+  c->mgr_data = s;
+  c->listener = nc->listener;
+  c->sa = nc->sa;
+  c->recv_mbuf_limit = nc->recv_mbuf_limit;
+  mg_set_protocol_http_websocket(c);
+  mg_add_conn(nc->mgr, c);
+  mg_call(c, NULL, c->user_data, MG_EV_ACCEPT, &c->sa);
+
+  mbuf_init(&req, r->headers.len + r->path.len + 100);
+  mbuf_append(&req, r->method.buf, r->method.len);
+  mbuf_append(&req, " ", 1);
+  mbuf_append(&req, r->path.buf, r->path.len);
+  mbuf_append(&req, " HTTP/1.1\r\n", 11);
+  if (!r->has_host && r->authority.len > 0) {
+    mbuf_append(&req, "Host: ", 6);
+    mbuf_append(&req, r->authority.buf, r->authority.len);
+    mbuf_append(&req, "\r\n", 2);
+  }
+  mbuf_append(&req, r->headers.buf, r->headers.len);
+  if (r->cookie.len > 0) {
+    mbuf_append(&req, "Cookie: ", 8);
+    mbuf_append(&req, r->cookie.buf, r->cookie.len);
+    mbuf_append(&req, "\r\n", 2);
+  }
+  if (!r->has_length) {
+    /*
+     * Body of unknown length is passed on chunk-encoded, but only for the
+     * methods that mg_parse_http() expects a body of.
+     */
+    if (!end_stream && (mg_vcasecmp(&method, "POST") == 0 ||
+                        mg_vcasecmp(&method, "PUT") == 0)) {
+      mbuf_append(&req, "Transfer-Encoding: chunked\r\n", 28);
+      s->req_chunked = 1;
+    } else {
+      mbuf_append(&req, "Content-Length: 0\r\n", 19);
+      s->req_discard = 1;
+    }
+  }
+  mbuf_append(&req, "\r\n", 2);
+  mg_if_recv_tcp_cb(c, req.buf, (int) req.len, 0);
+  mbuf_free(&req);
+}
 
-      /* Pass received message to the client code. */
-      mg_handle_incoming_websocket_frame(nc, &wsm);
+static void mg_h2_headers_done(struct mg_connection *nc) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  uint32_t id = h2->hdr_stream_id;
+  int end_stream = (h2->hdr_flags & MG_H2_FLAG_END_STREAM);
+  int is_new = (id > h2->last_stream_id);
+  struct mg_h2_stream *s = mg_h2_find_stream(h2, id);
+  struct mg_h2_req r;
+  int res;
 
-      /* Cleanup frame */
-      memmove(nc->recv_mbuf.buf + wsd->reass_len,
-              nc->recv_mbuf.buf + wsd->reass_len + cleanup_len,
-              nc->recv_mbuf.len - wsd->reass_len - cleanup_len);
-      nc->recv_mbuf.len -= cleanup_len;
+  memset(&r, 0, sizeof(r));
+  res = mg_h2_hpack_decode(h2, (unsigned char *) h2->hdr_block.buf,
+                           h2->hdr_block.len, is_new ? &r : NULL);
+  mbuf_free(&h2->hdr_block);
+  h2->hdr_stream_id = 0;
+  if (res < 0) {
+    mg_h2_conn_error(nc, MG_H2_COMPRESSION_ERROR);
+  } else if (!is_new) {
+    /* Trailers, which are dropped, must end the request */
+    if (s == NULL || s->remote_closed) {
+      mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, id, MG_H2_STREAM_CLOSED);
+    } else if (!end_stream) {
+      mg_h2_reset_stream(nc, s, MG_H2_PROTOCOL_ERROR);
+    } else {
+      s->remote_closed = 1;
+      mg_h2_deliver(s, NULL, 0, 1);
+    }
+  } else {
+    h2->last_stream_id = id;
+    if (h2->goaway || h2->num_streams >= MG_H2_MAX_STREAMS) {
+      mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, id, MG_H2_REFUSED_STREAM);
+    } else if (r.bad || r.method.len == 0 || r.path.len == 0 ||
+               memchr(r.method.buf, ' ', r.method.len) != NULL ||
+               memchr(r.path.buf, ' ', r.path.len) != NULL) {
+      mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, id, MG_H2_PROTOCOL_ERROR);
+    } else {
+      mg_h2_open_stream(nc, id, &r, end_stream);
     }
   }
+  mg_h2_free_req(&r);
+}
 
-  return ok;
+static void mg_h2_header_block(struct mg_connection *nc, int flags,
+                               const unsigned char *p, size_t len) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  if (h2->hdr_block.len + len > MG_MAX_HTTP_REQUEST_SIZE) {
+    /* Can't skip it, the HPACK state would go out of sync */
+    mg_h2_conn_error(nc, MG_H2_ENHANCE_YOUR_CALM);
+    return;
+  }
+  mbuf_append(&h2->hdr_block, p, len);
+  if (flags & MG_H2_FLAG_END_HEADERS) mg_h2_headers_done(nc);
 }
 
-struct ws_mask_ctx {
-  size_t pos; /* zero means unmasked */
-  uint32_t mask;
-};
+static void mg_h2_on_headers(struct mg_connection *nc, int flags, uint32_t id,
+                             const unsigned char *p, size_t len) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  size_t pad = 0;
+  if (id == 0 || (id & 1) == 0) {
+    mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (flags & MG_H2_FLAG_PADDED) {
+    if (len < 1) {
+      mg_h2_conn_error(nc, MG_H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    pad = p[0];
+    p++;
+    len--;
+  }
+  h2->hdr_dep = 0;
+  h2->hdr_weight = 16;
+  if (flags & MG_H2_FLAG_PRIORITY) {
+    if (len < 5) {
+      mg_h2_conn_error(nc, MG_H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    h2->hdr_dep = mg_h2_get32(p) & 0x7fffffff;
+    h2->hdr_weight = p[4] + 1;
+    p += 5;
+    len -= 5;
+  }
+  if (pad > len) {
+    mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+    return;
+  }
+  h2->hdr_stream_id = id;
+  h2->hdr_flags = flags;
+  mg_h2_header_block(nc, flags, p, len - pad);
+}
 
-static uint32_t mg_ws_random_mask(void) {
-  uint32_t mask;
-/*
- * The spec requires WS client to generate hard to
- * guess mask keys. From RFC6455, Section 5.3:
- *
- * The unpredictability of the masking key is essential to prevent
- * authors of malicious applications from selecting the bytes that appear on
- * the wire.
- *
- * Hence this feature is essential when the actual end user of this API
- * is untrusted code that wouldn't have access to a lower level net API
- * anyway (e.g. web browsers). Hence this feature is low prio for most
- * mongoose use cases and thus can be disabled, e.g. when porting to a platform
- * that lacks rand().
- */
-#if MG_DISABLE_WS_RANDOM_MASK
-  mask = 0xefbeadde; /* generated with a random number generator, I swear */
-#else
-  if (sizeof(long) >= 4) {
-    mask = (uint32_t) rand();
-  } else if (sizeof(long) == 2) {
-    mask = (uint32_t) rand() << 16 | (uint32_t) rand();
+static void mg_h2_on_data(struct mg_connection *nc, struct mg_h2_stream *s,
+                          int flags, uint32_t id, const unsigned char *p,
+                          size_t len) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  size_t skip = 0;
+  if (id == 0 || id > h2->last_stream_id) {
+    mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+    return;
   }
-#endif
-  return mask;
+  if (flags & MG_H2_FLAG_PADDED) {
+    if (len < 1 || p[0] >= len) {
+      mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+      return;
+    }
+    skip = p[0];
+  }
+  /* Padding counts towards flow control too */
+  h2->recv_unacked += len;
+  if (h2->recv_unacked > MG_H2_DEFAULT_WINDOW) {
+    mg_h2_conn_error(nc, MG_H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  if (s == NULL || s->remote_closed) {
+    mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, id, MG_H2_STREAM_CLOSED);
+  } else if ((s->recv_window -= len) < 0) {
+    mg_h2_reset_stream(nc, s, MG_H2_FLOW_CONTROL_ERROR);
+  } else {
+    if (flags & MG_H2_FLAG_PADDED) {
+      p++;
+      len -= skip + 1;
+    }
+    s->remote_closed = (flags & MG_H2_FLAG_END_STREAM ? 1 : 0);
+    mg_h2_deliver(s, p, len, s->remote_closed);
+    mg_h2_stream_ack(nc, s);
+  }
+  mg_h2_conn_ack(nc);
 }
 
-static void mg_send_ws_header(struct mg_connection *nc, int op, size_t len,
-                              struct ws_mask_ctx *ctx) {
-  int header_len;
-  unsigned char header[10];
+static void mg_h2_on_settings(struct mg_connection *nc, int flags,
+                              uint32_t id, const unsigned char *p,
+                              size_t len) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  struct mg_h2_stream *s;
+  uint32_t v;
+  size_t i;
+  if (id != 0) {
+    mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (flags & MG_H2_FLAG_ACK) {
+    if (len != 0) {
+      mg_h2_conn_error(nc, MG_H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    /* Our settings are in effect now */
+    if (!h2->settings_acked) {
+      for (s = h2->streams; s != NULL; s = s->next) {
+        s->recv_window -= MG_H2_DEFAULT_WINDOW - MG_H2_STREAM_WINDOW;
+      }
+      h2->settings_acked = 1;
+    }
+    h2->hpack_limit = MG_H2_HPACK_TABLE_SIZE;
+    if (h2->hpack_max > h2->hpack_limit) {
+      h2->hpack_max = h2->hpack_limit;
+      mg_h2_hpack_evict(h2, h2->hpack_max);
+    }
+    return;
+  }
+  if (len % 6 != 0) {
+    mg_h2_conn_error(nc, MG_H2_FRAME_SIZE_ERROR);
+    return;
+  }
+  for (i = 0; i < len; i += 6) {
+    v = mg_h2_get32(p + i + 2);
+    switch ((p[i] << 8) | p[i + 1]) {
+      case MG_H2_SETTINGS_ENABLE_PUSH:
+        if (v > 1) {
+          mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+          return;
+        }
+        break;
+      case MG_H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        if (v > MG_H2_MAX_WINDOW) {
+          mg_h2_conn_error(nc, MG_H2_FLOW_CONTROL_ERROR);
+          return;
+        }
+        for (s = h2->streams; s != NULL; s = s->next) {
+          s->send_window += (int64_t) v - h2->peer_window;
+        }
+        h2->peer_window = v;
+        break;
+      case MG_H2_SETTINGS_MAX_FRAME_SIZE:
+        if (v < MG_H2_DEFAULT_FRAME_SIZE || v > 0xffffff) {
+          mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+          return;
+        }
+        h2->peer_max_frame = v;
+        break;
+      default:
+        /* We don't push or use the peer's HPACK table, the rest is moot */
+        break;
+    }
+  }
+  mg_h2_send_frame(nc, MG_H2_FRAME_SETTINGS, MG_H2_FLAG_ACK, 0, NULL, 0);
+}
 
-  header[0] =
-      (op & WEBSOCKET_DONT_FIN ? 0x0 : FLAGS_MASK_FIN) | (op & FLAGS_MASK_OP);
-  if (len < 126) {
-    header[1] = (unsigned char) len;
-    header_len = 2;
-  } else if (len < 65535) {
-    uint16_t tmp = htons((uint16_t) len);
-    header[1] = 126;
-    memcpy(&header[2], &tmp, sizeof(tmp));
-    header_len = 4;
-  } else {
-    uint32_t tmp;
-    header[1] = 127;
-    tmp = htonl((uint32_t)((uint64_t) len >> 32));
-    memcpy(&header[2], &tmp, sizeof(tmp));
-    tmp = htonl((uint32_t)(len & 0xffffffff));
-    memcpy(&header[6], &tmp, sizeof(tmp));
-    header_len = 10;
+static void mg_h2_on_window_update(struct mg_connection *nc,
+                                   struct mg_h2_stream *s, uint32_t id,
+                                   const unsigned char *p, size_t len) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  uint32_t inc;
+  if (len != 4) {
+    mg_h2_conn_error(nc, MG_H2_FRAME_SIZE_ERROR);
+    return;
   }
+  inc = mg_h2_get32(p) & 0x7fffffff;
+  if (id == 0) {
+    if (inc == 0) {
+      mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+    } else if (h2->send_window + inc > MG_H2_MAX_WINDOW) {
+      mg_h2_conn_error(nc, MG_H2_FLOW_CONTROL_ERROR);
+    } else {
+      h2->send_window += inc;
+    }
+  } else if (s != NULL && !s->local_closed) {
+    if (inc == 0) {
+      mg_h2_reset_stream(nc, s, MG_H2_PROTOCOL_ERROR);
+    } else if (s->send_window + inc > MG_H2_MAX_WINDOW) {
+      mg_h2_reset_stream(nc, s, MG_H2_FLOW_CONTROL_ERROR);
+    } else {
+      s->send_window += inc;
+    }
+  }
+}
 
-  /* client connections enable masking */
-  if (nc->listener == NULL) {
-    header[1] |= 1 << 7; /* set masking flag */
-    mg_send(nc, header, header_len);
-    ctx->mask = mg_ws_random_mask();
-    mg_send(nc, &ctx->mask, sizeof(ctx->mask));
-    ctx->pos = nc->send_mbuf.len;
-  } else {
-    mg_send(nc, header, header_len);
-    ctx->pos = 0;
+static void mg_h2_frame(struct mg_connection *nc, int type, int flags,
+                        uint32_t id, const unsigned char *p, size_t len) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  struct mg_h2_stream *s = (id == 0 ? NULL : mg_h2_find_stream(h2, id));
+  if (h2->hdr_stream_id != 0 &&
+      (type != MG_H2_FRAME_CONTINUATION || id != h2->hdr_stream_id)) {
+    /* Header block must be contiguous */
+    mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+    return;
+  }
+  switch (type) {
+    case MG_H2_FRAME_DATA:
+      mg_h2_on_data(nc, s, flags, id, p, len);
+      break;
+    case MG_H2_FRAME_HEADERS:
+      mg_h2_on_headers(nc, flags, id, p, len);
+      break;
+    case MG_H2_FRAME_PRIORITY:
+      if (id == 0 || len != 5) {
+        mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+      } else if (s != NULL) {
+        s->dep = mg_h2_get32(p) & 0x7fffffff;
+        if (s->dep == id) s->dep = 0;
+        s->weight = p[4] + 1;
+      }
+      break;
+    case MG_H2_FRAME_RST_STREAM:
+      if (id == 0 || len != 4) {
+        mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+      } else if (s != NULL) {
+        mg_h2_stream_done(s);
+        s->remote_closed = 1;
+      }
+      break;
+    case MG_H2_FRAME_SETTINGS:
+      mg_h2_on_settings(nc, flags, id, p, len);
+      break;
+    case MG_H2_FRAME_PING:
+      if (id != 0 || len != 8) {
+        mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+      } else if (!(flags & MG_H2_FLAG_ACK)) {
+        mg_h2_send_frame(nc, MG_H2_FRAME_PING, MG_H2_FLAG_ACK, 0, p, len);
+      }
+      break;
+    case MG_H2_FRAME_GOAWAY:
+      /* Streams in progress are finished, no new ones are coming */
+      h2->goaway = 1;
+      break;
+    case MG_H2_FRAME_WINDOW_UPDATE:
+      mg_h2_on_window_update(nc, s, id, p, len);
+      break;
+    case MG_H2_FRAME_CONTINUATION:
+      if (h2->hdr_stream_id == 0) {
+        mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+      } else {
+        mg_h2_header_block(nc, flags, p, len);
+      }
+      break;
+    case MG_H2_FRAME_PUSH_PROMISE:
+      /* Clients can't push */
+      mg_h2_conn_error(nc, MG_H2_PROTOCOL_ERROR);
+      break;
+    default:
+      /* Unknown frame types are ignored */
+      break;
   }
 }
 
-static void mg_ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
-  size_t i;
-  if (ctx->pos == 0) return;
-  for (i = 0; i < (mbuf->len - ctx->pos); i++) {
-    mbuf->buf[ctx->pos + i] ^= ((char *) &ctx->mask)[i % 4];
+static void mg_h2_process(struct mg_connection *nc) {
+  struct mbuf *io = &nc->recv_mbuf;
+  const unsigned char *p;
+  size_t off = 0, len;
+  while (io->len - off >= MG_H2_FRAME_HDR_LEN &&
+         !(nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY))) {
+    p = (const unsigned char *) io->buf + off;
+    len = ((size_t) p[0] << 16) | ((size_t) p[1] << 8) | p[2];
+    if (len > MG_H2_DEFAULT_FRAME_SIZE) {
+      mg_h2_conn_error(nc, MG_H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if (io->len - off < MG_H2_FRAME_HDR_LEN + len) break;
+    mg_h2_frame(nc, p[3], p[4], mg_h2_get32(p + 5) & 0x7fffffff,
+                p + MG_H2_FRAME_HDR_LEN, len);
+    off += MG_H2_FRAME_HDR_LEN + len;
   }
+  /* Nothing else is going to be read on a failed connection */
+  if (nc->flags & MG_F_SEND_AND_CLOSE) off = io->len;
+  mbuf_remove(io, off);
 }
 
-void mg_send_websocket_frame(struct mg_connection *nc, int op, const void *data,
-                             size_t len) {
-  struct ws_mask_ctx ctx;
-  DBG(("%p %d %d", nc, op, (int) len));
-  mg_send_ws_header(nc, op, len, &ctx);
-  mg_send(nc, data, len);
+/*
+ * Response side: the stream connection's output is HTTP/1.1, which is
+ * translated into frames on the parent connection.
+ */
 
-  mg_ws_mask_frame(&nc->send_mbuf, &ctx);
+static void mg_h2_send_headers(struct mg_connection *nc, uint32_t id,
+                               const struct mbuf *block, int end_stream) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  int type = MG_H2_FRAME_HEADERS, flags;
+  size_t off = 0, n;
+  do {
+    n = MIN(block->len - off, h2->peer_max_frame);
+    flags = (off + n == block->len ? MG_H2_FLAG_END_HEADERS : 0);
+    if (type == MG_H2_FRAME_HEADERS && end_stream) {
+      flags |= MG_H2_FLAG_END_STREAM;
+    }
+    mg_h2_send_frame(nc, type, flags, id, block->buf + off, n);
+    type = MG_H2_FRAME_CONTINUATION;
+    off += n;
+  } while (off < block->len);
+}
 
-  if (op == WEBSOCKET_OP_CLOSE) {
-    nc->flags |= MG_F_SEND_AND_CLOSE;
-  }
+static int mg_h2_is_conn_header(const struct mg_str *name) {
+  return mg_vcasecmp(name, "Connection") == 0 ||
+         mg_vcasecmp(name, "Keep-Alive") == 0 ||
+         mg_vcasecmp(name, "Proxy-Connection") == 0 ||
+         mg_vcasecmp(name, "Transfer-Encoding") == 0 ||
+         mg_vcasecmp(name, "Upgrade") == 0;
 }
 
-void mg_send_websocket_framev(struct mg_connection *nc, int op,
-                              const struct mg_str *strv, int strvcnt) {
-  struct ws_mask_ctx ctx;
-  int i;
-  int len = 0;
-  for (i = 0; i < strvcnt; i++) {
-    len += strv[i].len;
+/* Sends the response headers, returns bytes sent or -1 if not complete. */
+static int mg_h2_send_head(struct mg_connection *nc, struct mg_h2_stream *s) {
+  struct mg_connection *c = s->nc;
+  struct http_message hm;
+  struct mbuf block;
+  int i, chunked = 0, end_stream, res;
+  int len = mg_parse_http(c->send_mbuf.buf, c->send_mbuf.len, &hm, 0);
+
+  if (len == 0) return -1;
+  if (len < 0) {
+    LOG(LL_ERROR, ("%p stream %u: bad response", c, (unsigned) s->id));
+    mg_h2_reset_stream(nc, s, MG_H2_INTERNAL_ERROR);
+    return MG_H2_FRAME_HDR_LEN + 4;
+  }
+
+  mbuf_init(&block, 0);
+  mg_h2_hpack_status(&block, hm.resp_code);
+  for (i = 0; hm.header_names[i].len > 0; i++) {
+    struct mg_str *name = &hm.header_names[i], *value = &hm.header_values[i];
+    if (mg_h2_is_conn_header(name)) {
+      if (mg_vcasecmp(name, "Transfer-Encoding") == 0 &&
+          mg_vcasecmp(value, "chunked") == 0) {
+        chunked = 1;
+      }
+      continue;
+    }
+    mg_h2_hpack_field(&block, name, value);
   }
 
-  mg_send_ws_header(nc, op, len, &ctx);
+  if (s->head_req || hm.resp_code < 200 || hm.resp_code == 204 ||
+      hm.resp_code == 304) {
+    s->body_mode = MG_H2_BODY_NONE;
+  } else if (chunked) {
+    s->body_mode = MG_H2_BODY_CHUNKED;
+    s->body_left = 0;
+  } else if (hm.body.len != (size_t) ~0) {
+    s->body_mode = (hm.body.len > 0 ? MG_H2_BODY_LENGTH : MG_H2_BODY_NONE);
+    s->body_left = hm.body.len;
+  } else {
+    s->body_mode = MG_H2_BODY_CLOSE;
+  }
+  /* Informational responses are followed by the real one */
+  if (hm.resp_code >= 200) s->resp_state = MG_H2_RESP_BODY;
+  end_stream = (hm.resp_code >= 200 && s->body_mode == MG_H2_BODY_NONE);
 
-  for (i = 0; i < strvcnt; i++) {
-    mg_send(nc, strv[i].p, strv[i].len);
+  mg_h2_send_headers(nc, s->id, &block, end_stream);
+  res = MG_H2_FRAME_HDR_LEN + (int) block.len;
+  mbuf_free(&block);
+  if (end_stream) {
+    mg_h2_stream_done(s);
+    len = (int) c->send_mbuf.len;
   }
+  mg_if_sent_cb(c, len);
+  return res;
+}
 
-  mg_ws_mask_frame(&nc->send_mbuf, &ctx);
+/*
+ * Parses chunk framing at the start of the buffer: the CRLF that ends the
+ * previous chunk, and the size line. Returns its length, 0 if incomplete.
+ */
+static size_t mg_h2_chunk_header(struct mg_h2_stream *s, const struct mbuf *io,
+                                 int *last) {
+  size_t i = (s->chunk_crlf ? 2 : 0), size;
+  const char *nl;
+  if (io->len <= i ||
+      (nl = (const char *) memchr(io->buf + i, '\n', io->len - i)) == NULL) {
+    return 0;
+  }
+  size = (size_t) strtoul(io->buf + i, NULL, 16);
+  i = nl - io->buf + 1;
+  if (size == 0) {
+    /* Last chunk, skip trailers up to the empty line */
+    do {
+      const char *line = io->buf + i;
+      nl = (const char *) memchr(line, '\n', io->len - i);
+      if (nl == NULL) return 0;
+      i = nl - io->buf + 1;
+      if (nl - line <= 1) break;
+    } while (1);
+    *last = 1;
+  }
+  s->body_left = size;
+  s->chunk_crlf = 1;
+  return i;
+}
 
-  if (op == WEBSOCKET_OP_CLOSE) {
-    nc->flags |= MG_F_SEND_AND_CLOSE;
+/* Sends up to one DATA frame of the body. Returns bytes sent, or -1. */
+static int mg_h2_send_body(struct mg_connection *nc, struct mg_h2_stream *s) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  struct mg_connection *c = s->nc;
+  struct mbuf *io = &c->send_mbuf;
+  int64_t window = MIN(h2->send_window, s->send_window);
+  size_t off = 0, n;
+  int last = 0;
+
+  if (s->body_mode == MG_H2_BODY_CHUNKED && s->body_left == 0) {
+    off = mg_h2_chunk_header(s, io, &last);
+    if (off == 0) return -1;
+  }
+  n = io->len - off;
+  if (s->body_mode != MG_H2_BODY_CLOSE) n = MIN(n, s->body_left);
+  n = MIN(n, MIN(h2->peer_max_frame, MG_H2_MAX_DATA_FRAME));
+  if (window <= 0) {
+    n = 0;
+  } else if ((int64_t) n > window) {
+    n = (size_t) window;
+  }
+  if (s->body_mode == MG_H2_BODY_LENGTH && n == s->body_left) last = 1;
+  if (s->body_mode == MG_H2_BODY_CLOSE && n == io->len &&
+      (c->flags & MG_F_SEND_AND_CLOSE)) {
+    last = 1;
+  }
+  if (n == 0 && !last) {
+    /* Out of window. Chunk framing doesn't count, drop it anyway. */
+    if (off > 0) mg_if_sent_cb(c, (int) off);
+    return off > 0 ? (int) off : -1;
+  }
+
+  mg_h2_send_frame(nc, MG_H2_FRAME_DATA, last ? MG_H2_FLAG_END_STREAM : 0,
+                   s->id, io->buf + off, n);
+  h2->send_window -= n;
+  s->send_window -= n;
+  if (s->body_mode != MG_H2_BODY_CLOSE) s->body_left -= n;
+  if (last) {
+    /* Whatever follows the body is dropped */
+    mg_h2_stream_done(s);
+    n = io->len - off;
+  }
+  mg_if_sent_cb(c, (int) (off + n));
+  return MG_H2_FRAME_HDR_LEN + (int) n;
+}
+
+static int mg_h2_stream_ready(struct mg_h2_stream *s) {
+  struct mg_connection *c = s->nc;
+  if (s->local_closed || s->stalled || (c->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    return 0;
   }
+  return c->send_mbuf.len > 0 || (s->resp_state == MG_H2_RESP_BODY &&
+                                  s->body_mode == MG_H2_BODY_CLOSE &&
+                                  (c->flags & MG_F_SEND_AND_CLOSE));
 }
 
-void mg_printf_websocket_frame(struct mg_connection *nc, int op,
-                               const char *fmt, ...) {
-  char mem[MG_VPRINTF_BUFFER_SIZE], *buf = mem;
-  va_list ap;
-  int len;
+/*
+ * Moves output of the streams to the connection, a frame at a time, while
+ * there is not much queued already. Streams are served in weighted fair
+ * order, and a stream waits while the stream it depends on has data to send.
+ */
+static void mg_h2_schedule(struct mg_connection *nc) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  struct mg_h2_stream *s, *best, *any, *d;
+  int n;
 
-  va_start(ap, fmt);
-  if ((len = mg_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
-    mg_send_websocket_frame(nc, op, buf, len);
+  while (nc->send_mbuf.len < MG_H2_SEND_HIGH_WATER &&
+         !(nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY))) {
+    best = any = NULL;
+    for (s = h2->streams; s != NULL; s = s->next) {
+      if (!mg_h2_stream_ready(s)) continue;
+      if (any == NULL || (long) (s->vtime - any->vtime) < 0) any = s;
+      d = (s->dep != 0 ? mg_h2_find_stream(h2, s->dep) : NULL);
+      if (d != NULL && mg_h2_stream_ready(d)) continue;
+      if (best == NULL || (long) (s->vtime - best->vtime) < 0) best = s;
+    }
+    /* Dependency loops are not supposed to happen, but would stall us */
+    if (best == NULL) best = any;
+    if (best == NULL) break;
+    if (best->resp_state == MG_H2_RESP_HEAD) {
+      n = mg_h2_send_head(nc, best);
+    } else {
+      n = mg_h2_send_body(nc, best);
+    }
+    if (n < 0) {
+      best->stalled = 1;
+    } else {
+      best->vtime += (unsigned long) n * 256 / best->weight;
+      h2->vtime = best->vtime;
+    }
   }
-  va_end(ap);
 
-  if (buf != mem && buf != NULL) {
-    MG_FREE(buf);
+  for (s = h2->streams; s != NULL; s = s->next) {
+    s->stalled = 0;
+    mg_h2_stream_ack(nc, s);
+    /* Backends don't all close these, and the stream needs to end anyway */
+    if ((s->nc->flags & MG_F_SEND_AND_CLOSE) && s->nc->send_mbuf.len == 0) {
+      s->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mg_mark_closing(s->nc);
+    }
   }
 }
 
-MG_INTERNAL void mg_ws_handler(struct mg_connection *nc, int ev,
-                               void *ev_data MG_UD_ARG(void *user_data)) {
-  mg_call(nc, nc->handler, nc->user_data, ev, ev_data);
-
+static void mg_h2_handler(struct mg_connection *nc, int ev,
+                          void *ev_data MG_UD_ARG(void *user_data)) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
   switch (ev) {
     case MG_EV_RECV:
-      do {
-      } while (mg_deliver_websocket_data(nc));
+      mg_h2_process(nc);
+      mg_h2_schedule(nc);
       break;
+    case MG_EV_DRAIN:
+      /* NO_ERROR: no new streams, the open ones are completed */
+      if (!h2->goaway) {
+        unsigned char buf[8];
+        mg_h2_put32(buf, h2->last_stream_id);
+        mg_h2_put32(buf + 4, 0);
+        mg_h2_send_frame(nc, MG_H2_FRAME_GOAWAY, 0, 0, buf, sizeof(buf));
+        h2->goaway = 1;
+      }
+    /* fall through */
     case MG_EV_POLL:
-      /* Ping idle websocket connections */
-      {
-        time_t now = *(time_t *) ev_data;
-        if (nc->flags & MG_F_IS_WEBSOCKET &&
-            now > nc->last_io_time + MG_WEBSOCKET_PING_INTERVAL_SECONDS) {
-          mg_send_websocket_frame(nc, WEBSOCKET_OP_PING, "", 0);
-        }
+    case MG_EV_SEND:
+      mg_h2_schedule(nc);
+      if (nc->mgr->drain_deadline > 0 && h2->streams == NULL) {
+        nc->flags |= MG_F_SEND_AND_CLOSE;
       }
       break;
-    default:
+    case MG_EV_CLOSE:
+      /* Streams are ahead of us in the list, it's safe to close them */
+      h2->closing = 1;
+      while (h2->streams != NULL) mg_close_conn(h2->streams->nc);
       break;
   }
-#if MG_ENABLE_CALLBACK_USERDATA
-  (void) user_data;
-#endif
+  mg_call(nc, nc->handler, nc->user_data, ev, ev_data);
 }
 
-#ifndef MG_EXT_SHA1
-void mg_hash_sha1_v(size_t num_msgs, const uint8_t *msgs[],
-                    const size_t *msg_lens, uint8_t *digest) {
-  size_t i;
-  cs_sha1_ctx sha_ctx;
-  cs_sha1_init(&sha_ctx);
-  for (i = 0; i < num_msgs; i++) {
-    cs_sha1_update(&sha_ctx, msgs[i], msg_lens[i]);
+static void mg_h2_conn_destructor(void *proto_data) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) proto_data;
+  mbuf_free(&h2->hpack);
+  mbuf_free(&h2->hdr_block);
+  MG_FREE(h2->iface);
+  MG_FREE(h2);
+}
+
+MG_INTERNAL int mg_h2_check_preface(const struct mbuf *io) {
+  size_t n = MIN(io->len, MG_H2_PREFACE_LEN);
+  if (n == 0 || memcmp(io->buf, MG_H2_PREFACE, n) != 0) return 0;
+  return n == MG_H2_PREFACE_LEN ? 1 : -1;
+}
+
+MG_INTERNAL void mg_h2_accept(struct mg_connection *nc) {
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) MG_CALLOC(1, sizeof(*h2));
+  unsigned char settings[18];
+  if (h2 == NULL) {
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
   }
-  cs_sha1_final(digest, &sha_ctx);
+  h2->iface = mg_if_create_iface(&mg_h2_stream_iface_vtable, nc->mgr);
+  if (h2->iface == NULL) {
+    /* Still HTTP/1.x, but the preface can't be answered, so give up */
+    MG_FREE(h2);
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  h2->iface->data = nc;
+  h2->send_window = MG_H2_DEFAULT_WINDOW;
+  h2->peer_window = MG_H2_DEFAULT_WINDOW;
+  h2->peer_max_frame = MG_H2_DEFAULT_FRAME_SIZE;
+  h2->hpack_max = h2->hpack_limit = MG_H2_DEFAULT_TABLE_SIZE;
+
+  /* HTTP/1.x state is of no use from now on */
+  if (nc->proto_data != NULL && nc->proto_data_destructor != NULL) {
+    nc->proto_data_destructor(nc->proto_data);
+  }
+  nc->proto_data = h2;
+  nc->proto_data_destructor = mg_h2_conn_destructor;
+  nc->proto_handler = mg_h2_handler;
+  nc->flags |= MG_F_IS_H2;
+  mbuf_remove(&nc->recv_mbuf, MG_H2_PREFACE_LEN);
+  DBG(("%p switched to HTTP/2", nc));
+
+  settings[0] = 0;
+  settings[1] = MG_H2_SETTINGS_HEADER_TABLE_SIZE;
+  mg_h2_put32(settings + 2, MG_H2_HPACK_TABLE_SIZE);
+  settings[6] = 0;
+  settings[7] = MG_H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  mg_h2_put32(settings + 8, MG_H2_MAX_STREAMS);
+  settings[12] = 0;
+  settings[13] = MG_H2_SETTINGS_INITIAL_WINDOW_SIZE;
+  mg_h2_put32(settings + 14, MG_H2_STREAM_WINDOW);
+  mg_h2_send_frame(nc, MG_H2_FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+  mg_h2_process(nc);
+  mg_h2_schedule(nc);
+}
+
+#if MG_ENABLE_SSL
+MG_INTERNAL void mg_h2_set_alpn(struct mg_connection *nc) {
+  static const char *protos[] = {"h2", "http/1.1", NULL};
+  mg_ssl_if_set_alpn(nc, protos);
 }
-#else
-extern void mg_hash_sha1_v(size_t num_msgs, const uint8_t *msgs[],
-                           const size_t *msg_lens, uint8_t *digest);
 #endif
 
-MG_INTERNAL void mg_ws_handshake(struct mg_connection *nc,
-                                 const struct mg_str *key,
-                                 struct http_message *hm) {
-  static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-  const uint8_t *msgs[2] = {(const uint8_t *) key->p, (const uint8_t *) magic};
-  const size_t msg_lens[2] = {key->len, 36};
-  unsigned char sha[20];
-  char b64_sha[30];
-  struct mg_str *s;
+/*
+ * Stream connections live on a virtual interface, which has the parent
+ * connection as its data.
+ */
 
-  mg_hash_sha1_v(2, msgs, msg_lens, sha);
-  mg_base64_encode(sha, sizeof(sha), b64_sha);
-  mg_printf(nc, "%s",
-            "HTTP/1.1 101 Switching Protocols\r\n"
-            "Upgrade: websocket\r\n"
-            "Connection: Upgrade\r\n");
+static void mg_h2_if_init(struct mg_iface *iface) {
+  (void) iface;
+}
 
-  s = mg_get_http_header(hm, "Sec-WebSocket-Protocol");
-  if (s != NULL) {
-    mg_printf(nc, "Sec-WebSocket-Protocol: %.*s\r\n", (int) s->len, s->p);
-  }
-  mg_printf(nc, "Sec-WebSocket-Accept: %s%s", b64_sha, "\r\n\r\n");
+static void mg_h2_if_free(struct mg_iface *iface) {
+  (void) iface;
+}
 
-  DBG(("%p %.*s %s", nc, (int) key->len, key->p, b64_sha));
+static void mg_h2_if_add_conn(struct mg_connection *c) {
+  (void) c;
 }
 
-void mg_send_websocket_handshake2(struct mg_connection *nc, const char *path,
-                                  const char *host, const char *protocol,
-                                  const char *extra_headers) {
-  mg_send_websocket_handshake3(nc, path, host, protocol, extra_headers, NULL,
-                               NULL);
+static void mg_h2_if_remove_conn(struct mg_connection *c) {
+  (void) c;
 }
 
-void mg_send_websocket_handshake3(struct mg_connection *nc, const char *path,
-                                  const char *host, const char *protocol,
-                                  const char *extra_headers, const char *user,
-                                  const char *pass) {
-  mg_send_websocket_handshake3v(nc, mg_mk_str(path), mg_mk_str(host),
-                                mg_mk_str(protocol), mg_mk_str(extra_headers),
-                                mg_mk_str(user), mg_mk_str(pass));
+static time_t mg_h2_if_poll(struct mg_iface *iface, int timeout_ms) {
+  (void) iface;
+  (void) timeout_ms;
+  return (time_t) cs_time();
 }
 
-void mg_send_websocket_handshake3v(struct mg_connection *nc,
-                                   const struct mg_str path,
-                                   const struct mg_str host,
-                                   const struct mg_str protocol,
-                                   const struct mg_str extra_headers,
-                                   const struct mg_str user,
-                                   const struct mg_str pass) {
-  struct mbuf auth;
-  char key[25];
-  uint32_t nonce[4];
-  nonce[0] = mg_ws_random_mask();
-  nonce[1] = mg_ws_random_mask();
-  nonce[2] = mg_ws_random_mask();
-  nonce[3] = mg_ws_random_mask();
-  mg_base64_encode((unsigned char *) &nonce, sizeof(nonce), key);
+static int mg_h2_if_listen_tcp(struct mg_connection *c,
+                               union socket_address *sa) {
+  (void) c;
+  (void) sa;
+  return -1;
+}
 
-  mbuf_init(&auth, 0);
-  if (user.len > 0) {
-    mg_basic_auth_header(user, pass, &auth);
-  }
+static int mg_h2_if_listen_udp(struct mg_connection *c,
+                               union socket_address *sa) {
+  (void) c;
+  (void) sa;
+  return -1;
+}
 
-  /*
-   * NOTE: the  (auth.buf == NULL ? "" : auth.buf) is because cc3200 libc is
-   * broken: it doesn't like zero length to be passed to %.*s
-   * i.e. sprintf("f%.*so", (int)0, NULL), yields `f\0o`.
-   * because it handles NULL specially (and incorrectly).
-   */
-  mg_printf(nc,
-            "GET %.*s HTTP/1.1\r\n"
-            "Upgrade: websocket\r\n"
-            "Connection: Upgrade\r\n"
-            "%.*s"
-            "Sec-WebSocket-Version: 13\r\n"
-            "Sec-WebSocket-Key: %s\r\n",
-            (int) path.len, path.p, (int) auth.len,
-            (auth.buf == NULL ? "" : auth.buf), key);
+static void mg_h2_if_connect_tcp(struct mg_connection *c,
+                                 const union socket_address *sa) {
+  (void) c;
+  (void) sa;
+}
 
-  /* TODO(mkm): take default hostname from http proto data if host == NULL */
-  if (host.len > 0) {
-    int host_len = (int) (path.p - host.p); /* Account for possible :PORT */
-    mg_printf(nc, "Host: %.*s\r\n", host_len, host.p);
-  }
-  if (protocol.len > 0) {
-    mg_printf(nc, "Sec-WebSocket-Protocol: %.*s\r\n", (int) protocol.len,
-              protocol.p);
-  }
-  if (extra_headers.len > 0) {
-    mg_printf(nc, "%.*s", (int) extra_headers.len, extra_headers.p);
-  }
-  mg_printf(nc, "\r\n");
+static void mg_h2_if_connect_udp(struct mg_connection *c) {
+  (void) c;
+}
 
-  mbuf_free(&auth);
+static void mg_h2_if_tcp_send(struct mg_connection *c, const void *buf,
+                              size_t len) {
+  /* Picked up by mg_h2_schedule() when the parent is polled */
+  mbuf_append(&c->send_mbuf, buf, len);
 }
 
-void mg_send_websocket_handshake(struct mg_connection *nc, const char *path,
-                                 const char *extra_headers) {
-  struct mg_str null_str = MG_NULL_STR;
-  mg_send_websocket_handshake3v(
-      nc, mg_mk_str(path), null_str /* host */, null_str /* protocol */,
-      mg_mk_str(extra_headers), null_str /* user */, null_str /* pass */);
+static void mg_h2_if_udp_send(struct mg_connection *c, const void *buf,
+                              size_t len) {
+  (void) c;
+  (void) buf;
+  (void) len;
 }
 
-struct mg_connection *mg_connect_ws_opt(
-    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
-    struct mg_connect_opts opts, const char *url, const char *protocol,
-    const char *extra_headers) {
-  struct mg_str null_str = MG_NULL_STR;
-  struct mg_str host = MG_NULL_STR, path = MG_NULL_STR, user_info = MG_NULL_STR;
-  struct mg_connection *nc =
-      mg_connect_http_base(mgr, MG_CB(ev_handler, user_data), opts, "http",
-                           "ws", "https", "wss", url, &path, &user_info, &host);
-  if (nc != NULL) {
-    mg_send_websocket_handshake3v(nc, path, host, mg_mk_str(protocol),
-                                  mg_mk_str(extra_headers), user_info,
-                                  null_str);
+static void mg_h2_if_recved(struct mg_connection *c, size_t len) {
+  struct mg_h2_stream *s = (struct mg_h2_stream *) c->mgr_data;
+  if (s != NULL) mg_h2_stream_ack((struct mg_connection *) c->iface->data, s);
+  (void) len;
+}
+
+static int mg_h2_if_create_conn(struct mg_connection *c) {
+  (void) c;
+  return 1;
+}
+
+static void mg_h2_if_destroy_conn(struct mg_connection *c) {
+  struct mg_connection *nc = (struct mg_connection *) c->iface->data;
+  struct mg_h2_conn *h2 = (struct mg_h2_conn *) nc->proto_data;
+  struct mg_h2_stream *s = (struct mg_h2_stream *) c->mgr_data, **sp;
+  if (s == NULL) return;
+  if (h2->closing) {
+    /* Nothing to tell the peer */
+  } else if (!s->local_closed) {
+    if (s->resp_state == MG_H2_RESP_BODY && s->body_mode == MG_H2_BODY_CLOSE &&
+        c->send_mbuf.len == 0) {
+      mg_h2_send_frame(nc, MG_H2_FRAME_DATA, MG_H2_FLAG_END_STREAM, s->id,
+                       NULL, 0);
+    } else {
+      /* Closed before the response was complete */
+      mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, s->id, MG_H2_CANCEL);
+    }
+  } else if (!s->remote_closed) {
+    /* Response is complete, the rest of the request is not needed */
+    mg_h2_send_u32(nc, MG_H2_FRAME_RST_STREAM, s->id, MG_H2_NO_ERROR);
+  }
+  for (sp = &h2->streams; *sp != s; sp = &(*sp)->next) {
+  }
+  *sp = s->next;
+  h2->num_streams--;
+  MG_FREE(s);
+  c->mgr_data = NULL;
+}
+
+static void mg_h2_if_sock_set(struct mg_connection *c, sock_t sock) {
+  (void) c;
+  (void) sock;
+}
+
+static void mg_h2_if_get_conn_addr(struct mg_connection *c, int remote,
+                                   union socket_address *sa) {
+  struct mg_connection *nc = (struct mg_connection *) c->iface->data;
+  if (nc->sock == INVALID_SOCKET) {
+    memset(sa, 0, sizeof(*sa));
+    return;
   }
-  return nc;
+  nc->iface->vtable->get_conn_addr(nc, remote, sa);
 }
 
-struct mg_connection *mg_connect_ws(
-    struct mg_mgr *mgr, MG_CB(mg_event_handler_t ev_handler, void *user_data),
-    const char *url, const char *protocol, const char *extra_headers) {
-  struct mg_connect_opts opts;
-  memset(&opts, 0, sizeof(opts));
-  return mg_connect_ws_opt(mgr, MG_CB(ev_handler, user_data), opts, url,
-                           protocol, extra_headers);
+static struct mbuf *mg_h2_if_tcp_send_mbuf(struct mg_connection *c) {
+  return &c->send_mbuf;
 }
-#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET */
+
+const struct mg_iface_vtable mg_h2_stream_iface_vtable = {
+    mg_h2_if_init,        mg_h2_if_free,
+    mg_h2_if_add_conn,    mg_h2_if_remove_conn,
+    mg_h2_if_poll,        mg_h2_if_listen_tcp,
+    mg_h2_if_listen_udp,  mg_h2_if_connect_tcp,
+    mg_h2_if_connect_udp, mg_h2_if_tcp_send,
+    mg_h2_if_udp_send,    mg_h2_if_recved,
+    mg_h2_if_create_conn, mg_h2_if_destroy_conn,
+    mg_h2_if_sock_set,    mg_h2_if_get_conn_addr,
+    mg_h2_if_tcp_send_mbuf,
+    NULL /* get_wait_sock */,
+    NULL /* recv_view */,
+    NULL /* recv_consume */,
+};
+
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP2 */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_util.c"
 #endif
@@ -10061,6 +15067,21 @@ int mg_sock_addr_to_str(const union socket_address *sa, char *buf, size_t len,
   int is_v6;
   if (buf == NULL || len <= 0) return 0;
   memset(buf, 0, len);
+#if MG_ENABLE_UNIX_SOCKETS
+  if (sa->sa.sa_family == AF_UNIX) {
+    /* Path only, abstract names get an "@" prefix */
+    if (flags & MG_SOCK_STRINGIFY_IP) {
+      const char *path = sa->un.sun_path;
+      int n = (int) sizeof(sa->un.sun_path);
+      if (path[0] == '\0' && path[1] != '\0') {
+        snprintf(buf, len, "@%.*s", n - 1, path + 1);
+      } else {
+        snprintf(buf, len, "%.*s", n, path);
+      }
+    }
+    return strlen(buf);
+  }
+#endif
 #if MG_ENABLE_IPV6
   is_v6 = sa->sa.sa_family == AF_INET6;
 #else
@@ -10124,6 +15145,36 @@ int mg_conn_addr_to_str(struct mg_connection *nc, char *buf, size_t len,
   return mg_sock_addr_to_str(&sa, buf, len, flags);
 }
 
+#if MG_ENABLE_UNIX_SOCKETS
+int mg_conn_get_peer_cred(struct mg_connection *nc, struct mg_peer_cred *cred) {
+#if defined(SO_PEERCRED) && defined(__linux__)
+  /* Same layout as struct ucred, which needs _GNU_SOURCE */
+  struct {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+  } uc;
+  socklen_t len = sizeof(uc);
+  const union socket_address *sa =
+      nc->listener != NULL ? &nc->listener->sa : &nc->sa;
+  /* Linux has listeners report their own credentials, there is no peer */
+  if (nc->sock == INVALID_SOCKET || (nc->flags & MG_F_LISTENING) ||
+      sa->sa.sa_family != AF_UNIX ||
+      getsockopt(nc->sock, SOL_SOCKET, SO_PEERCRED, &uc, &len) != 0) {
+    return -1;
+  }
+  cred->pid = uc.pid;
+  cred->uid = uc.uid;
+  cred->gid = uc.gid;
+  return 0;
+#else
+  (void) nc;
+  (void) cred;
+  return -1;
+#endif
+}
+#endif
+
 #if MG_ENABLE_HEXDUMP
 static int mg_hexdump_n(const void *buf, int len, char *dst, int dst_len,
                         int offset) {
@@ -10291,6 +15342,9 @@ struct mg_str mg_url_encode(const struct mg_str src) {
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_MQTT
+
 #if MG_ENABLE_MQTT
 
 #include <string.h>
@@ -10514,12 +15568,14 @@ void mg_set_protocol_mqtt(struct mg_connection *nc) {
   nc->proto_handler = mqtt_handler;
   nc->proto_data = MG_CALLOC(1, sizeof(struct mg_mqtt_proto_data));
   nc->proto_data_destructor = mg_mqtt_proto_data_destructor;
+  /* Polls are only needed for keep-alive, see mg_send_mqtt_handshake_opt() */
+  nc->proto_ev_mask &= ~(MG_EV_MASK(MG_EV_POLL) | MG_EV_MASK(MG_EV_SEND));
 }
 
 static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
                                    uint8_t flags, size_t len) {
   struct mg_mqtt_proto_data *pd = (struct mg_mqtt_proto_data *) nc->proto_data;
-  size_t off = nc->send_mbuf.len - len;
+  size_t off = nc->send_mbuf.len - len, body_len = len;
   uint8_t header = cmd << 4 | (uint8_t) flags;
 
   uint8_t buf[1 + sizeof(size_t)];
@@ -10537,6 +15593,20 @@ static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
     vlen++;
   } while (len > 0);
 
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET
+  if ((nc->flags & MG_F_IS_WEBSOCKET) && nc->listener != NULL) {
+    /* Served over WebSocket: frame the packet along with its header */
+    unsigned char ws[10 + sizeof(buf)];
+    int ws_len = mg_ws_build_header(ws, WEBSOCKET_OP_BINARY,
+                                    (vlen - buf) + body_len);
+    memcpy(ws + ws_len, buf, vlen - buf);
+    mbuf_insert(&nc->send_mbuf, off, ws, ws_len + (vlen - buf));
+    return;
+  }
+#else
+  (void) body_len;
+#endif
+
   mbuf_insert(&nc->send_mbuf, off, buf, vlen - buf);
   pd->last_control_time = mg_time();
 }
@@ -10613,6 +15683,7 @@ void mg_send_mqtt_handshake_opt(struct mg_connection *nc, const char *client_id,
 
   if (pd != NULL) {
     pd->keep_alive = opts.keep_alive;
+    nc->proto_ev_mask |= MG_EV_MASK(MG_EV_POLL);
   }
 }
 
@@ -10752,6 +15823,9 @@ void mg_mqtt_disconnect(struct mg_connection *nc) {
 }
 
 #endif /* MG_ENABLE_MQTT */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_mqtt_server.c"
 #endif
@@ -10760,6 +15834,9 @@ void mg_mqtt_disconnect(struct mg_connection *nc) {
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_MQTT
+
 /* Amalgamated: #include "mg_internal.h" */
 /* Amalgamated: #include "mg_mqtt_server.h" */
 
@@ -10896,21 +15973,11 @@ static void mg_mqtt_broker_handle_publish(struct mg_mqtt_broker *brk,
   }
 }
 
-void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
-  struct mg_mqtt_message *msg = (struct mg_mqtt_message *) data;
-  struct mg_mqtt_broker *brk;
-
-  if (nc->listener) {
-    brk = (struct mg_mqtt_broker *) nc->listener->priv_2;
-  } else {
-    brk = (struct mg_mqtt_broker *) nc->priv_2;
-  }
-
+/* Handles a client packet, for MQTT and MQTT over WebSocket alike. */
+static void mg_mqtt_broker_handle(struct mg_mqtt_broker *brk,
+                                  struct mg_connection *nc, int ev,
+                                  struct mg_mqtt_message *msg) {
   switch (ev) {
-    case MG_EV_ACCEPT:
-      if (nc->proto_data == NULL) mg_set_protocol_mqtt(nc);
-      nc->priv_2 = NULL; /* Clear up the inherited pointer to broker */
-      break;
     case MG_EV_MQTT_CONNECT:
       if (nc->priv_2 == NULL) {
         mg_mqtt_broker_handle_connect(brk, nc);
@@ -10935,11 +16002,40 @@ void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
         nc->flags |= MG_F_CLOSE_IMMEDIATELY;
       }
       break;
+    case MG_EV_MQTT_PINGREQ:
+      if (nc->priv_2 != NULL) {
+        mg_mqtt_pong(nc);
+      } else {
+        /* Ping before CONNECT */
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      break;
+  }
+}
+
+void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
+  struct mg_mqtt_message *msg = (struct mg_mqtt_message *) data;
+  struct mg_mqtt_broker *brk;
+
+  if (nc->listener) {
+    brk = (struct mg_mqtt_broker *) nc->listener->priv_2;
+  } else {
+    brk = (struct mg_mqtt_broker *) nc->priv_2;
+  }
+
+  switch (ev) {
+    case MG_EV_ACCEPT:
+      if (nc->proto_data == NULL) mg_set_protocol_mqtt(nc);
+      nc->priv_2 = NULL; /* Clear up the inherited pointer to broker */
+      break;
     case MG_EV_CLOSE:
       if (nc->listener && nc->priv_2 != NULL) {
         mg_mqtt_close_session((struct mg_mqtt_session *) nc->priv_2);
       }
       break;
+    default:
+      mg_mqtt_broker_handle(brk, nc, ev, msg);
+      break;
   }
 }
 
@@ -10948,7 +16044,117 @@ struct mg_mqtt_session *mg_mqtt_next(struct mg_mqtt_broker *brk,
   return s == NULL ? LIST_FIRST(&brk->sessions) : LIST_NEXT(s, link);
 }
 
+#if MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET
+/*
+ * Checks that the client offers the "mqtt" subprotocol. The header is then
+ * narrowed down to it, as the handshake response echoes it back.
+ */
+static int mg_mqtt_ws_select_protocol(struct http_message *hm) {
+  struct mg_str *hdr = mg_get_http_header(hm, "Sec-WebSocket-Protocol");
+  struct mg_str list, v;
+  if (hdr == NULL) return 0;
+  list = *hdr;
+  while ((list = mg_next_comma_list_entry_n(list, &v, NULL)).p != NULL) {
+    while (v.len > 0 && v.p[0] == ' ') v.p++, v.len--;
+    while (v.len > 0 && v.p[v.len - 1] == ' ') v.len--;
+    if (mg_vcasecmp(&v, "mqtt") == 0) {
+      *hdr = v;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Feeds a websocket message to the broker. Packets are parsed in place;
+ * only a packet split across messages is copied, to be completed later.
+ */
+static void mg_mqtt_ws_recv(struct mg_connection *nc,
+                            struct mg_ws_proto_data *wsd,
+                            struct websocket_message *wm) {
+  struct mbuf frame, *io = &frame;
+  struct mg_mqtt_message mm;
+  int len;
+
+  frame.buf = (char *) wm->data;
+  frame.len = frame.size = wm->size;
+  if (wsd->mqtt_buf.len > 0) {
+    mbuf_append(&wsd->mqtt_buf, wm->data, wm->size);
+    io = &wsd->mqtt_buf;
+  }
+
+  while (io->len > 0 && !(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
+    memset(&mm, 0, sizeof(mm));
+    if ((len = parse_mqtt(io, &mm)) == MG_MQTT_ERROR_INCOMPLETE_MSG) break;
+    if (len < 0) {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      return;
+    }
+    mg_mqtt_broker_handle(wsd->mqtt_broker, nc, MG_MQTT_EVENT_BASE + mm.cmd,
+                          &mm);
+    if (io == &frame) {
+      frame.buf += len;
+      frame.len -= len;
+    } else {
+      mbuf_remove(io, len);
+    }
+  }
+
+  if (io == &frame && frame.len > 0) {
+    mbuf_append(&wsd->mqtt_buf, frame.buf, frame.len);
+  }
+  if (nc->recv_mbuf_limit > 0 && wsd->mqtt_buf.len >= nc->recv_mbuf_limit) {
+    LOG(LL_ERROR, ("%p MQTT packet exceeds %lu bytes, closing", nc,
+                   (unsigned long) nc->recv_mbuf_limit));
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void mg_mqtt_ws_handler(struct mg_connection *nc, int ev,
+                               void *ev_data MG_UD_ARG(void *user_data)) {
+  struct mg_ws_proto_data *wsd = &mg_http_get_proto_data(nc)->ws_data;
+
+  switch (ev) {
+    case MG_EV_HTTP_REQUEST:
+      mg_http_send_error(nc, 400, "WebSocket upgrade required");
+      break;
+    case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST:
+      if (wsd->mqtt_broker == NULL ||
+          !mg_mqtt_ws_select_protocol((struct http_message *) ev_data)) {
+        mg_http_send_error(nc, 400, "MQTT subprotocol required");
+      }
+      nc->priv_2 = NULL; /* No session until CONNECT */
+      break;
+    case MG_EV_WEBSOCKET_FRAME:
+      mg_mqtt_ws_recv(nc, wsd, (struct websocket_message *) ev_data);
+      break;
+    case MG_EV_CLOSE:
+      if (nc->priv_2 != NULL) {
+        mg_mqtt_close_session((struct mg_mqtt_session *) nc->priv_2);
+        nc->priv_2 = NULL;
+      }
+      break;
+  }
+#if MG_ENABLE_CALLBACK_USERDATA
+  (void) user_data;
+#endif
+}
+
+void mg_register_mqtt_ws_endpoint(struct mg_connection *nc,
+                                  const char *uri_path,
+                                  struct mg_mqtt_broker *brk) {
+  struct mg_http_endpoint_opts opts;
+  struct mg_http_endpoint *ep;
+  memset(&opts, 0, sizeof(opts));
+  ep = mg_http_add_endpoint(nc, uri_path, mg_mqtt_ws_handler, opts);
+  if (ep != NULL) ep->mqtt_broker = brk;
+}
+#endif /* MG_ENABLE_HTTP && MG_ENABLE_HTTP_WEBSOCKET */
+
 #endif /* MG_ENABLE_MQTT_BROKER */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_dns.c"
 #endif
@@ -10957,6 +16163,9 @@ struct mg_mqtt_session *mg_mqtt_next(struct mg_mqtt_broker *brk,
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_DNS
+
 #if MG_ENABLE_DNS
 
 /* Amalgamated: #include "mg_internal.h" */
@@ -11329,6 +16538,9 @@ void mg_set_protocol_dns(struct mg_connection *nc) {
 }
 
 #endif /* MG_ENABLE_DNS */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_dns_server.c"
 #endif
@@ -11337,6 +16549,9 @@ void mg_set_protocol_dns(struct mg_connection *nc) {
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_DNS
+
 #if MG_ENABLE_DNS_SERVER
 
 /* Amalgamated: #include "mg_internal.h" */
@@ -11403,6 +16618,9 @@ int mg_dns_reply_record(struct mg_dns_reply *reply,
 }
 
 #endif /* MG_ENABLE_DNS_SERVER */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_resolv.c"
 #endif
@@ -11411,6 +16629,9 @@ int mg_dns_reply_record(struct mg_dns_reply *reply,
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_DNS
+
 #if MG_ENABLE_ASYNC_RESOLVER
 
 /* Amalgamated: #include "mg_internal.h" */
@@ -11698,6 +16919,9 @@ void mg_set_nameserver(struct mg_mgr *mgr, const char *nameserver) {
 }
 
 #endif /* MG_ENABLE_ASYNC_RESOLVER */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "mongoose/src/mg_coap.c"
 #endif
@@ -12633,27 +17857,47 @@ static void disband(struct mg_connection *c) {
   struct mg_connection *c2 = (struct mg_connection *) c->user_data;
   if (c2 != NULL) {
     c2->flags |= MG_F_SEND_AND_CLOSE;
+    mg_mark_closing(c2);
     c2->user_data = NULL;
   }
   c->flags |= MG_F_SEND_AND_CLOSE;
   c->user_data = NULL;
 }
 
+/*
+ * Data is held in the receive buffer while the peer has a full send queue,
+ * which stops reads once the receive buffer limit is reached.
+ */
 static void relay_data(struct mg_connection *c) {
   struct mg_connection *c2 = (struct mg_connection *) c->user_data;
   if (c2 != NULL) {
-    mg_send(c2, c->recv_mbuf.buf, c->recv_mbuf.len);
-    mbuf_remove(&c->recv_mbuf, c->recv_mbuf.len);
+    mg_relay(&c->recv_mbuf, c2, MG_SOCKS_RELAY_WATERMARK);
   } else {
     c->flags |= MG_F_SEND_AND_CLOSE;
   }
 }
 
+/*
+ * Called when `c` has sent data: takes in what its peer has held back. That
+ * happens outside of the peer's handler, so the peer's interface is told
+ * about the consumed data here.
+ */
+static void resume_relay(struct mg_connection *c) {
+  struct mg_connection *c2 = (struct mg_connection *) c->user_data;
+  size_t n;
+  if (c2 != NULL &&
+      (n = mg_relay(&c2->recv_mbuf, c, MG_SOCKS_RELAY_WATERMARK)) > 0) {
+    c2->iface->vtable->recved(c2, n);
+  }
+}
+
 static void serv_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_CLOSE) {
     disband(c);
   } else if (ev == MG_EV_RECV) {
     relay_data(c);
+  } else if (ev == MG_EV_SEND) {
+    resume_relay(c);
   } else if (ev == MG_EV_CONNECT) {
     int res = *(int *) ev_data;
     if (res != 0) LOG(LL_ERROR, ("connect error: %d", res));
@@ -12664,6 +17908,12 @@ static void mg_socks5_connect(struct mg_connection *c, const char *addr) {
   struct mg_connection *serv = mg_connect(c->mgr, addr, serv_ev_handler);
   serv->user_data = c;
   c->user_data = serv;
+  if (serv->recv_mbuf_limit > MG_SOCKS_RELAY_WATERMARK) {
+    serv->recv_mbuf_limit = MG_SOCKS_RELAY_WATERMARK;
+  }
+  if (c->recv_mbuf_limit > MG_SOCKS_RELAY_WATERMARK) {
+    c->recv_mbuf_limit = MG_SOCKS_RELAY_WATERMARK;
+  }
 }
 
 /*
@@ -12741,6 +17991,8 @@ static void socks_handler(struct mg_connection *c, int ev, void *ev_data) {
       mg_socks5_handle_request(c);
     }
     if (c->flags & MG_SOCKS_CONNECT_DONE) relay_data(c);
+  } else if (ev == MG_EV_SEND) {
+    if (c->flags & MG_SOCKS_CONNECT_DONE) resume_relay(c);
   } else if (ev == MG_EV_CLOSE) {
     disband(c);
   }
@@ -12752,6 +18004,299 @@ void mg_set_protocol_socks(struct mg_connection *c) {
 }
 #endif
 #ifdef MG_MODULE_LINES
+#line 1 "mongoose/src/mg_mem_prof.c"
+#endif
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ */
+
+#if MG_ENABLE_MEM_PROFILER
+
+/* Amalgamated: #include "mg_internal.h" */
+/* Amalgamated: #include "mg_mem_prof.h" */
+
+#if CS_PLATFORM == CS_P_ESP32
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#endif
+
+#ifndef MG_MEM_PROF_MALLOC
+#define MG_MEM_PROF_MALLOC malloc
+#endif
+
+#ifndef MG_MEM_PROF_CALLOC
+#define MG_MEM_PROF_CALLOC calloc
+#endif
+
+#ifndef MG_MEM_PROF_REALLOC
+#define MG_MEM_PROF_REALLOC realloc
+#endif
+
+#ifndef MG_MEM_PROF_FREE
+#define MG_MEM_PROF_FREE free
+#endif
+
+/*
+ * Several managers may be polled from different threads, and the SSL
+ * library may allocate from other tasks, so table updates are locked: with
+ * a mutex on Unix, a spinlock elsewhere. Targets without threads can define
+ * MG_MEM_PROF_LOCK() and MG_MEM_PROF_UNLOCK() to nothing.
+ */
+#ifndef MG_MEM_PROF_LOCK
+#if CS_PLATFORM == CS_P_ESP32
+static portMUX_TYPE s_mem_prof_mux = portMUX_INITIALIZER_UNLOCKED;
+#define MG_MEM_PROF_LOCK() portENTER_CRITICAL(&s_mem_prof_mux)
+#define MG_MEM_PROF_UNLOCK() portEXIT_CRITICAL(&s_mem_prof_mux)
+#elif CS_PLATFORM == CS_P_UNIX
+static pthread_mutex_t s_mem_prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define MG_MEM_PROF_LOCK() pthread_mutex_lock(&s_mem_prof_mutex)
+#define MG_MEM_PROF_UNLOCK() pthread_mutex_unlock(&s_mem_prof_mutex)
+#elif defined(__GNUC__)
+static volatile char s_mem_prof_busy;
+#define MG_MEM_PROF_LOCK() \
+  while (__atomic_test_and_set(&s_mem_prof_busy, __ATOMIC_ACQUIRE))
+#define MG_MEM_PROF_UNLOCK() __atomic_clear(&s_mem_prof_busy, __ATOMIC_RELEASE)
+#else
+#define MG_MEM_PROF_LOCK()
+#define MG_MEM_PROF_UNLOCK()
+#endif
+#endif
+
+#define MG_MEM_PROF_TAG_BITS 4
+#define MG_MEM_PROF_MAX_SIZE (0xffffffffUL >> MG_MEM_PROF_TAG_BITS)
+#define MG_MEM_PROF_MASK (MG_MEM_PROF_TABLE_SIZE - 1)
+
+/* Live allocation. Open addressing, linear probing, 8 bytes on 32-bit MCUs */
+struct mg_mem_prof_entry {
+  void *ptr;
+  uint32_t size_tag; /* size << MG_MEM_PROF_TAG_BITS | tag */
+};
+
+static struct mg_mem_prof_entry s_mem_prof_table[MG_MEM_PROF_TABLE_SIZE];
+static size_t s_mem_prof_table_len;
+static struct mg_mem_prof_snapshot s_mem_prof;
+
+static size_t mg_mem_prof_slot(const void *ptr) {
+  uint32_t h = (uint32_t)((uintptr_t) ptr >> 3);
+  h ^= h >> 16;
+  h *= 0x45d9f3bU;
+  h ^= h >> 16;
+  return h & MG_MEM_PROF_MASK;
+}
+
+static void mg_mem_prof_inc(struct mg_mem_prof_stats *st, size_t size) {
+  st->live_bytes += size;
+  st->live_allocs++;
+  if (st->live_bytes > st->peak_bytes) st->peak_bytes = st->live_bytes;
+}
+
+static void mg_mem_prof_dec(struct mg_mem_prof_stats *st, size_t size) {
+  st->live_bytes -= size;
+  st->live_allocs--;
+}
+
+/* Removes the entry for `ptr`. Returns 0 if there is none. */
+static int mg_mem_prof_remove(void *ptr, int *tag, size_t *size) {
+  size_t i = mg_mem_prof_slot(ptr), j, k;
+  while (s_mem_prof_table[i].ptr != ptr) {
+    if (s_mem_prof_table[i].ptr == NULL) return 0;
+    i = (i + 1) & MG_MEM_PROF_MASK;
+  }
+  *tag = s_mem_prof_table[i].size_tag & ((1 << MG_MEM_PROF_TAG_BITS) - 1);
+  *size = s_mem_prof_table[i].size_tag >> MG_MEM_PROF_TAG_BITS;
+  mg_mem_prof_dec(&s_mem_prof.tags[*tag], *size);
+  mg_mem_prof_dec(&s_mem_prof.total, *size);
+  s_mem_prof_table_len--;
+
+  /* Shift back entries that would become unreachable. */
+  s_mem_prof_table[i].ptr = NULL;
+  for (j = (i + 1) & MG_MEM_PROF_MASK; s_mem_prof_table[j].ptr != NULL;
+       j = (j + 1) & MG_MEM_PROF_MASK) {
+    k = mg_mem_prof_slot(s_mem_prof_table[j].ptr);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    s_mem_prof_table[i] = s_mem_prof_table[j];
+    s_mem_prof_table[j].ptr = NULL;
+    i = j;
+  }
+  return 1;
+}
+
+static void mg_mem_prof_add(void *ptr, int tag, size_t size, int is_new) {
+  size_t i;
+  int old_tag;
+  size_t old_size;
+  if (is_new) {
+    s_mem_prof.tags[tag].num_allocs++;
+    s_mem_prof.tags[tag].num_bytes += size;
+    s_mem_prof.total.num_allocs++;
+    s_mem_prof.total.num_bytes += size;
+  }
+  /* Stale entry: memory was released bypassing MG_FREE. */
+  mg_mem_prof_remove(ptr, &old_tag, &old_size);
+  if (size > MG_MEM_PROF_MAX_SIZE ||
+      s_mem_prof_table_len >= MG_MEM_PROF_TABLE_SIZE / 8 * 7) {
+    s_mem_prof.num_untracked++;
+    return;
+  }
+  for (i = mg_mem_prof_slot(ptr); s_mem_prof_table[i].ptr != NULL;
+       i = (i + 1) & MG_MEM_PROF_MASK) {
+  }
+  s_mem_prof_table[i].ptr = ptr;
+  s_mem_prof_table[i].size_tag =
+      (uint32_t) size << MG_MEM_PROF_TAG_BITS | (uint32_t) tag;
+  s_mem_prof_table_len++;
+  mg_mem_prof_inc(&s_mem_prof.tags[tag], size);
+  mg_mem_prof_inc(&s_mem_prof.total, size);
+}
+
+static void mg_mem_prof_track(void *ptr, int tag, size_t size) {
+  if (tag < 0 || tag >= MG_MEM_NUM_TAGS) tag = MG_MEM_TAG_OTHER;
+  MG_MEM_PROF_LOCK();
+  if (ptr != NULL) {
+    mg_mem_prof_add(ptr, tag, size, 1);
+  } else {
+    s_mem_prof.tags[tag].num_failed++;
+    s_mem_prof.total.num_failed++;
+  }
+  MG_MEM_PROF_UNLOCK();
+}
+
+void *mg_mem_prof_malloc(int tag, size_t size) {
+  void *ptr = MG_MEM_PROF_MALLOC(size);
+  mg_mem_prof_track(ptr, tag, size);
+  return ptr;
+}
+
+void *mg_mem_prof_calloc(int tag, size_t count, size_t size) {
+  void *ptr = MG_MEM_PROF_CALLOC(count, size);
+  mg_mem_prof_track(ptr, tag, count * size);
+  return ptr;
+}
+
+void *mg_mem_prof_realloc(int tag, void *ptr, size_t size) {
+  void *new_ptr;
+  int old_tag = 0, found = 0;
+  size_t old_size = 0;
+
+  /* Forget the old block before it's released, another task may reuse it. */
+  if (ptr != NULL) {
+    MG_MEM_PROF_LOCK();
+    found = mg_mem_prof_remove(ptr, &old_tag, &old_size);
+    MG_MEM_PROF_UNLOCK();
+  }
+  new_ptr = MG_MEM_PROF_REALLOC(ptr, size);
+  if (new_ptr == NULL && size > 0 && found) {
+    /* Old block is intact */
+    MG_MEM_PROF_LOCK();
+    mg_mem_prof_add(ptr, old_tag, old_size, 0);
+    MG_MEM_PROF_UNLOCK();
+  }
+  if (new_ptr != NULL || size > 0) mg_mem_prof_track(new_ptr, tag, size);
+  return new_ptr;
+}
+
+void mg_mem_prof_free(void *ptr) {
+  int tag;
+  size_t size;
+  if (ptr == NULL) return;
+  MG_MEM_PROF_LOCK();
+  if (!mg_mem_prof_remove(ptr, &tag, &size)) s_mem_prof.num_unknown_frees++;
+  MG_MEM_PROF_UNLOCK();
+  MG_MEM_PROF_FREE(ptr);
+}
+
+void mg_mem_prof_snapshot(struct mg_mem_prof_snapshot *s) {
+  MG_MEM_PROF_LOCK();
+  memcpy(s, &s_mem_prof, sizeof(*s));
+  MG_MEM_PROF_UNLOCK();
+  s->time = mg_time();
+}
+
+void mg_mem_prof_reset_peak(void) {
+  int i;
+  MG_MEM_PROF_LOCK();
+  for (i = 0; i < MG_MEM_NUM_TAGS; i++) {
+    s_mem_prof.tags[i].peak_bytes = s_mem_prof.tags[i].live_bytes;
+  }
+  s_mem_prof.total.peak_bytes = s_mem_prof.total.live_bytes;
+  MG_MEM_PROF_UNLOCK();
+}
+
+const char *mg_mem_prof_tag_name(int tag) {
+  static const char *names[MG_MEM_NUM_TAGS] = {"other", "mbuf", "conn", "http",
+                                               "mqtt",  "dns",  "ssl"};
+  return (tag >= 0 && tag < MG_MEM_NUM_TAGS) ? names[tag] : "unknown";
+}
+
+#if MG_ENABLE_HTTP
+static void mg_mem_prof_print_stats(struct mg_connection *nc, const char *name,
+                                    const struct mg_mem_prof_stats *cur,
+                                    const struct mg_mem_prof_stats *prev,
+                                    double interval) {
+  double allocs = (double) (unsigned long) (cur->num_allocs - prev->num_allocs);
+  double bytes = (double) (unsigned long) (cur->num_bytes - prev->num_bytes);
+  if (interval <= 0) {
+    interval = 1;
+    allocs = bytes = 0;
+  }
+  mg_printf_http_chunk(
+      nc,
+      "\"%s\": {\"live_bytes\": %lu, \"peak_bytes\": %lu, "
+      "\"live_allocs\": %lu, \"allocs\": %lu, \"bytes\": %lu, "
+      "\"failed\": %lu, \"allocs_per_sec\": %.1f, \"bytes_per_sec\": %.1f}",
+      name, (unsigned long) cur->live_bytes, (unsigned long) cur->peak_bytes,
+      cur->live_allocs, cur->num_allocs, cur->num_bytes, cur->num_failed,
+      allocs / interval, bytes / interval);
+}
+
+void mg_mem_prof_http_handler(struct mg_connection *nc, int ev,
+                              void *ev_data MG_UD_ARG(void *user_data)) {
+  /* Rates are reported over the time since the previous request. */
+  static struct mg_mem_prof_snapshot prev;
+  struct mg_mem_prof_snapshot cur;
+  double interval;
+  int i;
+
+  if (ev != MG_EV_HTTP_REQUEST) return;
+
+  mg_mem_prof_snapshot(&cur);
+  interval = (prev.time > 0 ? cur.time - prev.time : 0);
+  mg_send_head(nc, 200, -1,
+               "Content-Type: application/json\r\nCache-Control: no-cache");
+  mg_printf_http_chunk(nc,
+                       "{\"interval\": %.3f, \"untracked\": %lu, "
+                       "\"unknown_frees\": %lu, ",
+                       interval, cur.num_untracked, cur.num_unknown_frees);
+#if CS_PLATFORM == CS_P_ESP32
+  /* Largest block vs. free heap shows how fragmented the heap is. */
+  mg_printf_http_chunk(
+      nc, "\"heap\": {\"free\": %u, \"min_free\": %u, \"largest_block\": %u}, ",
+      (unsigned) esp_get_free_heap_size(),
+      (unsigned) esp_get_minimum_free_heap_size(),
+      (unsigned) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+#endif
+  mg_mem_prof_print_stats(nc, "total", &cur.total, &prev.total, interval);
+  mg_printf_http_chunk(nc, "%s", ", \"tags\": {");
+  for (i = 0; i < MG_MEM_NUM_TAGS; i++) {
+    if (i > 0) mg_printf_http_chunk(nc, "%s", ", ");
+    mg_mem_prof_print_stats(nc, mg_mem_prof_tag_name(i), &cur.tags[i],
+                            &prev.tags[i], interval);
+  }
+  mg_printf_http_chunk(nc, "%s", "}}\n");
+  mg_send_http_chunk(nc, "", 0);
+  memcpy(&prev, &cur, sizeof(prev));
+
+  (void) ev_data;
+#if MG_ENABLE_CALLBACK_USERDATA
+  (void) user_data;
+#endif
+}
+#endif /* MG_ENABLE_HTTP */
+
+#endif /* MG_ENABLE_MEM_PROFILER */
+#ifdef MG_MODULE_LINES
 #line 1 "common/platforms/cc3200/cc3200_libc.c"
 #endif
 /*
@@ -13815,6 +19360,10 @@ void mg_sl_if_tcp_send(struct mg_connection *nc, const void *buf, size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
 }
 
+struct mbuf *mg_sl_if_tcp_send_mbuf(struct mg_connection *nc) {
+  return &nc->send_mbuf;
+}
+
 void mg_sl_if_udp_send(struct mg_connection *nc, const void *buf, size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
 }
@@ -14203,6 +19752,10 @@ void sl_restart_cb(struct mg_mgr *mgr) {
     mg_sl_if_destroy_conn,                                              \
     mg_sl_if_sock_set,                                                  \
     mg_sl_if_get_conn_addr,                                             \
+    mg_sl_if_tcp_send_mbuf,                                             \
+    NULL /* get_wait_sock */,                                           \
+    NULL /* recv_view */,                                               \
+    NULL /* recv_consume */,                                            \
   }
 /* clang-format on */
 
@@ -14220,6 +19773,9 @@ const struct mg_iface_vtable mg_default_iface_vtable = MG_SL_IFACE_VTABLE;
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_SSL
+
 #if MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_SIMPLELINK
 
 /* Amalgamated: #include "common/mg_mem.h" */
@@ -14288,6 +19844,12 @@ void mg_ssl_if_conn_free(struct mg_connection *nc) {
   MG_FREE(ctx);
 }
 
+void mg_ssl_if_set_alpn(struct mg_connection *nc, const char **protos) {
+  /* Not supported by the SimpleLink TLS stack */
+  (void) nc;
+  (void) protos;
+}
+
 bool pem_to_der(const char *pem_file, const char *der_file) {
   bool ret = false;
   FILE *pf = NULL, *df = NULL;
@@ -14426,6 +19988,9 @@ int sl_set_ssl_opts(int sock, struct mg_connection *nc) {
 }
 
 #endif /* MG_ENABLE_SSL && MG_SSL_IF == MG_SSL_IF_SIMPLELINK */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "common/platforms/lwip/mg_lwip_net_if.h"
 #endif
@@ -14460,21 +20025,29 @@ struct mg_lwip_conn_state {
   size_t rx_offset; /* Offset within the first pbuf (if partially consumed) */
   /* Last SSL write size, for retries. */
   int last_ssl_write_size;
-  /* Whether MG_SIG_RECV is already pending for this connection */
-  int recv_pending : 1;
   /* Whether the connection is about to close, just `rx_chain` needs to drain */
   int draining_rx_chain : 1;
+  /* Bytes of `rx_chain` already reported in receive view mode */
+  size_t rx_view_len;
+  /* Consumed bytes not yet reported to LWIP, see mg_lwip_if_recved() */
+  size_t recved_pending;
+  /* Signals pending delivery, a bit per mg_sig_type */
+  unsigned int sig_pending;
+  /* Next connection with pending signals, see mg_lwip_post_signal() */
+  struct mg_lwip_conn_state *sig_next;
 };
 
 enum mg_sig_type {
   MG_SIG_CONNECT_RESULT = 1,
   MG_SIG_RECV = 2,
   MG_SIG_CLOSE_CONN = 3,
-  MG_SIG_TOMBSTONE = 4,
+  MG_SIG_TOMBSTONE = 4, /* Connection is gone, free the state */
   MG_SIG_ACCEPT = 5,
 };
 
 void mg_lwip_post_signal(enum mg_sig_type sig, struct mg_connection *nc);
+/* Drops pending signals and frees the connection's state. */
+void mg_lwip_free_conn_state(struct mg_connection *nc);
 
 /* To be implemented by the platform. */
 void mg_lwip_mgr_schedule_poll(struct mg_mgr *mgr);
@@ -14490,6 +20063,9 @@ void mg_lwip_mgr_schedule_poll(struct mg_mgr *mgr);
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_CONN
+
 #if MG_ENABLE_NET_IF_LWIP_LOW_LEVEL
 
 /* Amalgamated: #include "common/mg_mem.h" */
@@ -14563,6 +20139,7 @@ extern void mgos_unlock();
 #endif
 
 static void mg_lwip_recv_common(struct mg_connection *nc, struct pbuf *p);
+static void mg_lwip_send_more(struct mg_connection *nc);
 
 #if LWIP_TCP_KEEPALIVE
 void mg_lwip_set_keepalive_params(struct mg_connection *nc, int idle,
@@ -14616,6 +20193,17 @@ static void mg_lwip_tcp_error_cb(void *arg, err_t err) {
   }
 }
 
+/*
+ * Once rx_chain holds this many pbufs, new segments are copied into RAM pbufs
+ * and released, so that a slow reader does not hog the pool: the ESP SDK has
+ * only 5 pbufs. This applies to MG_F_RECV_VIEW connections too, which keep
+ * their pbufs until mg_recv_consume(): past this point their data is copied
+ * once after all. Targets with a larger pool can raise it.
+ */
+#ifndef MG_LWIP_RX_CHAIN_MAX_PBUFS
+#define MG_LWIP_RX_CHAIN_MAX_PBUFS 4
+#endif
+
 static err_t mg_lwip_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb,
                                  struct pbuf *p, err_t err) {
   struct mg_connection *nc = (struct mg_connection *) arg;
@@ -14652,10 +20240,10 @@ static err_t mg_lwip_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb,
   mgos_lock();
   if (cs->rx_chain == NULL) {
     cs->rx_offset = 0;
-  } else if (pbuf_clen(cs->rx_chain) >= 4) {
+  } else if (pbuf_clen(cs->rx_chain) >= MG_LWIP_RX_CHAIN_MAX_PBUFS) {
     /* ESP SDK has a limited pool of 5 pbufs. We must not hog them all or RX
-     * will be completely blocked. We already have at least 4 in the chain,
-     * this one is, so we have to make a copy and release this one. */
+     * will be completely blocked. The chain is long enough already, so we
+     * have to make a copy and release this one. */
     struct pbuf *np = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
     if (np != NULL) {
       pbuf_copy(np, p);
@@ -14668,8 +20256,31 @@ static err_t mg_lwip_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb,
   return ERR_OK;
 }
 
+/*
+ * Releases up to `len` bytes from the start of `rx_chain`, returns the number
+ * of bytes released. Must be called with the lock held.
+ */
+static size_t mg_lwip_rx_chain_consume(struct mg_lwip_conn_state *cs,
+                                       size_t len) {
+  size_t consumed = 0;
+  while (cs->rx_chain != NULL && consumed < len) {
+    struct pbuf *seg = cs->rx_chain;
+    size_t seg_len = seg->len - cs->rx_offset;
+    if (len - consumed < seg_len) {
+      cs->rx_offset += len - consumed;
+      return len;
+    }
+    consumed += seg_len;
+    cs->rx_chain = pbuf_dechain(seg);
+    pbuf_free(seg);
+    cs->rx_offset = 0;
+  }
+  return consumed;
+}
+
 static void mg_lwip_consume_rx_chain_tcp(struct mg_connection *nc) {
   struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  size_t budget = MG_RECV_BUDGET;
   if (cs->rx_chain == NULL) return;
 #if MG_ENABLE_SSL
   if (nc->flags & MG_F_SSL) {
@@ -14681,13 +20292,32 @@ static void mg_lwip_consume_rx_chain_tcp(struct mg_connection *nc) {
     return;
   }
 #endif
+  if (nc->flags & MG_F_RECV_VIEW) {
+    /* Data stays in the chain, only announce what is new. */
+    size_t avail;
+    mgos_lock();
+    avail = (cs->rx_chain != NULL ? cs->rx_chain->tot_len - cs->rx_offset : 0);
+    mgos_unlock();
+    if (avail > cs->rx_view_len) {
+      size_t len = avail - cs->rx_view_len;
+      cs->rx_view_len = avail;
+      mg_if_recv_view_cb(nc, len);
+    }
+    return;
+  }
+  /*
+   * Copy out as much of the chain as fits, in one go, but no more than
+   * MG_RECV_BUDGET per poll. The rest is picked up by the next poll.
+   */
   mgos_lock();
   while (cs->rx_chain != NULL && nc->recv_mbuf.len < nc->recv_mbuf_limit) {
-    struct pbuf *seg = cs->rx_chain;
-
-    size_t seg_len = (seg->len - cs->rx_offset);
+    size_t chain_len = (cs->rx_chain->tot_len - cs->rx_offset);
     size_t buf_avail = (nc->recv_mbuf_limit - nc->recv_mbuf.len);
-    size_t len = MIN(seg_len, buf_avail);
+    size_t len = MIN(MIN(chain_len, buf_avail), budget);
+    if (len == 0) {
+      mg_lwip_mgr_schedule_poll(nc->mgr);
+      break;
+    }
 
     char *data = (char *) MG_MALLOC(len);
     if (data == NULL) {
@@ -14695,18 +20325,19 @@ static void mg_lwip_consume_rx_chain_tcp(struct mg_connection *nc) {
       DBG(("OOM"));
       return;
     }
-    pbuf_copy_partial(seg, data, len, cs->rx_offset);
-    cs->rx_offset += len;
-    if (cs->rx_offset == cs->rx_chain->len) {
-      cs->rx_chain = pbuf_dechain(cs->rx_chain);
-      pbuf_free(seg);
-      cs->rx_offset = 0;
-    }
+    pbuf_copy_partial(cs->rx_chain, data, len, cs->rx_offset);
+    mg_lwip_rx_chain_consume(cs, len);
     mgos_unlock();
+    budget -= len;
     mg_if_recv_tcp_cb(nc, data, len, 1 /* own */);
     mgos_lock();
   }
   mgos_unlock();
+  /* Send the reply right away rather than on the next poll */
+  if ((nc->flags & MG_F_WRITE_THROUGH) && nc->send_mbuf.len > 0 &&
+      !(nc->flags & (MG_F_CONNECTING | MG_F_CLOSE_IMMEDIATELY))) {
+    mg_lwip_send_more(nc);
+  }
 }
 
 static void mg_lwip_handle_recv_tcp(struct mg_connection *nc) {
@@ -14722,6 +20353,8 @@ static err_t mg_lwip_tcp_sent_cb(void *arg, struct tcp_pcb *tpcb,
   struct mg_connection *nc = (struct mg_connection *) arg;
   DBG(("%p %p %u %p %p", nc, tpcb, num_sent, tpcb->unsent, tpcb->unacked));
   if (nc == NULL) return ERR_OK;
+  /* Room has been freed in the send buffer, queue more. */
+  if (nc->send_mbuf.len > 0) mg_lwip_mgr_schedule_poll(nc->mgr);
   if ((nc->flags & MG_F_SEND_AND_CLOSE) && !(nc->flags & MG_F_WANT_WRITE) &&
       nc->send_mbuf.len == 0 && tpcb->unsent == NULL && tpcb->unacked == NULL) {
     mg_lwip_post_signal(MG_SIG_CLOSE_CONN, nc);
@@ -14812,10 +20445,7 @@ static void mg_lwip_recv_common(struct mg_connection *nc, struct pbuf *p) {
   } else {
     pbuf_chain(cs->rx_chain, p);
   }
-  if (!cs->recv_pending) {
-    cs->recv_pending = 1;
-    mg_lwip_post_signal(MG_SIG_RECV, nc);
-  }
+  mg_lwip_post_signal(MG_SIG_RECV, nc);
   mgos_unlock();
 }
 
@@ -14992,30 +20622,21 @@ int mg_lwip_if_listen_udp(struct mg_connection *nc, union socket_address *sa) {
 struct mg_lwip_tcp_write_ctx {
   struct mg_connection *nc;
   const void *data;
-  uint16_t len;
+  size_t len;
   int ret;
 };
 
-static void tcp_output_tcpip(void *arg) {
-  tcp_output((struct tcp_pcb *) arg);
-}
-
 static void mg_lwip_tcp_write_tcpip(void *arg) {
   struct mg_lwip_tcp_write_ctx *ctx = (struct mg_lwip_tcp_write_ctx *) arg;
   struct mg_connection *nc = ctx->nc;
   struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
   struct tcp_pcb *tpcb = cs->pcb.tcp;
-  size_t len = MIN(tpcb->mss, MIN(ctx->len, tpcb->snd_buf));
-  size_t unsent, unacked;
-  if (len == 0) {
-    DBG(("%p no buf avail %u %u %p %p", tpcb, tpcb->snd_buf, tpcb->snd_queuelen,
-         tpcb->unsent, tpcb->unacked));
-    tcpip_callback(tcp_output_tcpip, tpcb);
-    ctx->ret = 0;
-    return;
-  }
-  unsent = (tpcb->unsent != NULL ? tpcb->unsent->len : 0);
-  unacked = (tpcb->unacked != NULL ? tpcb->unacked->len : 0);
+  const char *data = (const char *) ctx->data;
+  size_t max_len = ctx->len, max_chunk = 0xffff, total = 0;
+  size_t unsent = (tpcb->unsent != NULL ? tpcb->unsent->len : 0);
+  size_t unacked = (tpcb->unacked != NULL ? tpcb->unacked->len : 0);
+  err_t err = ERR_OK;
+  ctx->ret = 0;
 /*
  * On ESP8266 we only allow one TCP segment in flight at any given time.
  * This may increase latency and reduce efficiency of tcp windowing,
@@ -15023,29 +20644,46 @@ static void mg_lwip_tcp_write_tcpip(void *arg) {
  * reduce footprint.
  */
 #if CS_PLATFORM == CS_P_ESP8266
-  if (unacked > 0) {
-    ctx->ret = 0;
-    return;
-  }
-  len = MIN(len, (TCP_MSS - unsent));
+  if (unacked > 0) return;
+  max_len = MIN(max_len, MIN(tpcb->mss, TCP_MSS - unsent));
 #endif
-  cs->err = tcp_write(tpcb, ctx->data, len, TCP_WRITE_FLAG_COPY);
+  /*
+   * Queue as much as the send buffer and the segment queue will take in one
+   * go: every trip to the tcpip thread costs a task switch, so a single
+   * write per poll is what limits throughput.
+   */
+  while (total < max_len && tcp_sndbuf(tpcb) > 0 &&
+         tcp_sndqueuelen(tpcb) < TCP_SND_QUEUELEN) {
+    size_t len = MIN(max_len - total, MIN(tcp_sndbuf(tpcb), max_chunk));
+    u8_t flags = TCP_WRITE_FLAG_COPY;
+    if (total + len < max_len) flags |= TCP_WRITE_FLAG_MORE;
+    err = cs->err = tcp_write(tpcb, data + total, len, flags);
+    if (err == ERR_MEM && len > tpcb->mss) {
+      /* Not enough segments left for all of it, try one at a time. */
+      max_chunk = tpcb->mss;
+      continue;
+    }
+    if (err != ERR_OK) break;
+    total += len;
+  }
   unsent = (tpcb->unsent != NULL ? tpcb->unsent->len : 0);
   unacked = (tpcb->unacked != NULL ? tpcb->unacked->len : 0);
-  DBG(("%p tcp_write %u = %d, %u %u", tpcb, len, cs->err, unsent, unacked));
-  if (cs->err != ERR_OK) {
+  DBG(("%p tcp_write %u/%u = %d, %u %u %u", tpcb, total, ctx->len, err,
+       unsent, unacked, tpcb->snd_queuelen));
+  if (tpcb->unsent != NULL) tcp_output(tpcb);
+  if (total == 0 && err != ERR_OK && err != ERR_MEM) {
     /*
      * We ignore ERR_MEM because memory will be freed up when the data is sent
      * and we'll retry.
      */
-    ctx->ret = (cs->err == ERR_MEM ? 0 : -1);
+    ctx->ret = -1;
     return;
   }
-  ctx->ret = len;
+  ctx->ret = total;
 }
 
 static int mg_lwip_tcp_write(struct mg_connection *nc, const void *data,
-                             uint16_t len) {
+                             size_t len) {
   struct mg_lwip_tcp_write_ctx ctx = {.nc = nc, .data = data, .len = len};
   struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
   struct tcp_pcb *tpcb = cs->pcb.tcp;
@@ -15125,20 +20763,63 @@ void mg_lwip_if_tcp_send(struct mg_connection *nc, const void *buf,
   mg_lwip_mgr_schedule_poll(nc->mgr);
 }
 
+struct mbuf *mg_lwip_if_tcp_send_mbuf(struct mg_connection *nc) {
+  /* The caller is about to append, make sure it gets flushed. */
+  mg_lwip_mgr_schedule_poll(nc->mgr);
+  return &nc->send_mbuf;
+}
+
 void mg_lwip_if_udp_send(struct mg_connection *nc, const void *buf,
                          size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
   mg_lwip_mgr_schedule_poll(nc->mgr);
 }
 
+/*
+ * Window updates are batched: consumed bytes are handed to tcp_recved() once
+ * they add up to MG_LWIP_RECVED_THRESHOLD, or at the end of a poll.
+ */
+#ifndef MG_LWIP_RECVED_THRESHOLD
+#define MG_LWIP_RECVED_THRESHOLD (TCP_WND / 2)
+#endif
+
+/*
+ * The receive buffer is only shrunk when less than a quarter of it is used,
+ * and never below this size, so that it is not reallocated for every segment.
+ */
+#ifndef MG_LWIP_RECV_MBUF_MIN_SIZE
+#define MG_LWIP_RECV_MBUF_MIN_SIZE TCP_MSS
+#endif
+
 struct tcp_recved_ctx {
-  struct tcp_pcb *tpcb;
+  struct mg_lwip_conn_state *cs;
   size_t len;
 };
 
 void tcp_recved_tcpip(void *arg) {
   struct tcp_recved_ctx *ctx = (struct tcp_recved_ctx *) arg;
-  tcp_recved(ctx->tpcb, ctx->len);
+  size_t len = ctx->len;
+  /* PCB is cleared by the error callback, which runs in this thread. */
+  if (ctx->cs->pcb.tcp == NULL) return;
+  while (len > 0) {
+    u16_t n = (u16_t) MIN(len, 0xffff);
+    tcp_recved(ctx->cs->pcb.tcp, n);
+    len -= n;
+  }
+}
+
+static void mg_lwip_flush_recved(struct mg_connection *nc) {
+  struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  struct tcp_recved_ctx ctx = {.cs = cs, .len = cs->recved_pending};
+  if (ctx.len == 0 || cs->pcb.tcp == NULL) return;
+  cs->recved_pending = 0;
+  tcpip_callback(tcp_recved_tcpip, &ctx);
+}
+
+static void mg_lwip_recv_mbuf_shrink(struct mbuf *mb) {
+  if (mb->size <= MG_LWIP_RECV_MBUF_MIN_SIZE || mb->len > mb->size / 4) return;
+  /* Leave room to grow back without a realloc. */
+  mbuf_resize(mb, MAX(mb->len * 2, MG_LWIP_RECV_MBUF_MIN_SIZE));
 }
 
 void mg_lwip_if_recved(struct mg_connection *nc, size_t len) {
@@ -15148,20 +20829,22 @@ void mg_lwip_if_recved(struct mg_connection *nc, size_t len) {
     DBG(("%p invalid socket", nc));
     return;
   }
-  DBG(("%p %p %u %u", nc, cs->pcb.tcp, len,
+  DBG(("%p %p %u %u %u", nc, cs->pcb.tcp, len, cs->recved_pending,
        (cs->rx_chain ? cs->rx_chain->tot_len : 0)));
-  struct tcp_recved_ctx ctx = {.tpcb = cs->pcb.tcp, .len = len};
 #if MG_ENABLE_SSL
   if (!(nc->flags & MG_F_SSL)) {
-    tcpip_callback(tcp_recved_tcpip, &ctx);
+    cs->recved_pending += len;
   } else {
     /* Currently SSL acknowledges data immediately.
      * TODO(rojer): Find a way to propagate mg_lwip_if_recved. */
   }
 #else
-  tcpip_callback(tcp_recved_tcpip, &ctx);
+  cs->recved_pending += len;
 #endif
-  mbuf_trim(&nc->recv_mbuf);
+  if (cs->recved_pending >= MG_LWIP_RECVED_THRESHOLD) {
+    mg_lwip_flush_recved(nc);
+  }
+  mg_lwip_recv_mbuf_shrink(&nc->recv_mbuf);
 }
 
 int mg_lwip_if_create_conn(struct mg_connection *nc) {
@@ -15193,8 +20876,7 @@ void mg_lwip_if_destroy_conn(struct mg_connection *nc) {
       cs->rx_chain = pbuf_dechain(cs->rx_chain);
       pbuf_free(seg);
     }
-    memset(cs, 0, sizeof(*cs));
-    MG_FREE(cs);
+    mg_lwip_free_conn_state(nc);
   } else if (nc->listener == NULL) {
     /* Only close outgoing UDP pcb or listeners. */
     struct udp_pcb *upcb = cs->pcb.udp;
@@ -15202,8 +20884,7 @@ void mg_lwip_if_destroy_conn(struct mg_connection *nc) {
       DBG(("%p udp_remove %p", nc, upcb));
       tcpip_callback(udp_remove_tcpip, upcb);
     }
-    memset(cs, 0, sizeof(*cs));
-    MG_FREE(cs);
+    mg_lwip_free_conn_state(nc);
   }
   nc->sock = INVALID_SOCKET;
 }
@@ -15236,6 +20917,40 @@ void mg_lwip_if_sock_set(struct mg_connection *nc, sock_t sock) {
   nc->sock = sock;
 }
 
+int mg_lwip_if_recv_view(struct mg_connection *nc, struct mg_str *iov,
+                         int max_iov) {
+  struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  struct pbuf *seg;
+  size_t offset;
+  int n = 0;
+  if (nc->sock == INVALID_SOCKET || (nc->flags & (MG_F_UDP | MG_F_SSL))) {
+    return 0;
+  }
+  /* Segments are only ever released by us, so payloads stay valid. */
+  mgos_lock();
+  for (seg = cs->rx_chain, offset = cs->rx_offset; seg != NULL && n < max_iov;
+       seg = seg->next, offset = 0) {
+    if (seg->len <= offset) continue;
+    iov[n].p = (const char *) seg->payload + offset;
+    iov[n].len = seg->len - offset;
+    n++;
+  }
+  mgos_unlock();
+  return n;
+}
+
+void mg_lwip_if_recv_consume(struct mg_connection *nc, size_t len) {
+  struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  if (nc->sock == INVALID_SOCKET || (nc->flags & (MG_F_UDP | MG_F_SSL))) {
+    return;
+  }
+  mgos_lock();
+  len = mg_lwip_rx_chain_consume(cs, len);
+  mgos_unlock();
+  cs->rx_view_len -= MIN(len, cs->rx_view_len);
+  mg_lwip_if_recved(nc, len);
+}
+
 /* clang-format off */
 #define MG_LWIP_IFACE_VTABLE                                          \
   {                                                                   \
@@ -15255,6 +20970,10 @@ void mg_lwip_if_sock_set(struct mg_connection *nc, sock_t sock) {
     mg_lwip_if_destroy_conn,                                          \
     mg_lwip_if_sock_set,                                              \
     mg_lwip_if_get_conn_addr,                                         \
+    mg_lwip_if_tcp_send_mbuf,                                         \
+    NULL /* get_wait_sock */,                                         \
+    mg_lwip_if_recv_view,                                             \
+    mg_lwip_if_recv_consume,                                          \
   }
 /* clang-format on */
 
@@ -15264,6 +20983,9 @@ const struct mg_iface_vtable mg_default_iface_vtable = MG_LWIP_IFACE_VTABLE;
 #endif
 
 #endif /* MG_ENABLE_NET_IF_LWIP_LOW_LEVEL */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "common/platforms/lwip/mg_lwip_ev_mgr.c"
 #endif
@@ -15274,93 +20996,266 @@ const struct mg_iface_vtable mg_default_iface_vtable = MG_LWIP_IFACE_VTABLE;
 
 #if MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL
 
-#ifndef MG_SIG_QUEUE_LEN
-#define MG_SIG_QUEUE_LEN 32
+#if MG_ENABLE_LWIP_TASK_WAIT
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #endif
 
-struct mg_ev_mgr_lwip_signal {
-  int sig;
-  struct mg_connection *nc;
-};
-
+/*
+ * Signals from LWIP callbacks to the Mongoose task are delivered through
+ * an intrusive list of connection states: a state is pushed when its first
+ * signal becomes pending, further ones just set bits. Nothing is allocated,
+ * so signals cannot be lost, and repeated ones coalesce.
+ */
 struct mg_ev_mgr_lwip_data {
-  struct mg_ev_mgr_lwip_signal sig_queue[MG_SIG_QUEUE_LEN];
-  int sig_queue_len;
-  int start_index;
+  struct mg_lwip_conn_state *sig_head; /* Pushed by any task, LIFO */
+  struct mg_lwip_sig_stats stats;
+  double min_timer; /* Earliest timer seen by the last poll */
+  int num_timers;   /* Timers seen by the last poll */
+#if MG_ENABLE_LWIP_TASK_WAIT
+  SemaphoreHandle_t wakeup; /* Given when there is something to do */
+#endif
 };
 
+#if defined(RTOS_SDK)
+/* ESP8266 has no atomic instructions, use the lock. */
+static unsigned int mg_lwip_sig_fetch_or(unsigned int *p, unsigned int v) {
+  unsigned int old;
+  mgos_lock();
+  old = *p;
+  *p |= v;
+  mgos_unlock();
+  return old;
+}
+
+static unsigned int mg_lwip_sig_take(unsigned int *p) {
+  unsigned int old;
+  mgos_lock();
+  old = *p;
+  *p = 0;
+  mgos_unlock();
+  return old;
+}
+
+static void mg_lwip_sig_push(struct mg_ev_mgr_lwip_data *md,
+                             struct mg_lwip_conn_state *cs) {
+  mgos_lock();
+  cs->sig_next = md->sig_head;
+  md->sig_head = cs;
+  mgos_unlock();
+}
+
+static struct mg_lwip_conn_state *mg_lwip_sig_take_all(
+    struct mg_ev_mgr_lwip_data *md) {
+  struct mg_lwip_conn_state *head;
+  mgos_lock();
+  head = md->sig_head;
+  md->sig_head = NULL;
+  mgos_unlock();
+  return head;
+}
+
+#define MG_LWIP_SIG_STAT_INC(md, field) ((md)->stats.field++)
+#else
+static unsigned int mg_lwip_sig_fetch_or(unsigned int *p, unsigned int v) {
+  return __atomic_fetch_or(p, v, __ATOMIC_ACQ_REL);
+}
+
+static unsigned int mg_lwip_sig_take(unsigned int *p) {
+  return __atomic_exchange_n(p, 0, __ATOMIC_ACQ_REL);
+}
+
+static void mg_lwip_sig_push(struct mg_ev_mgr_lwip_data *md,
+                             struct mg_lwip_conn_state *cs) {
+  struct mg_lwip_conn_state *head = __atomic_load_n(&md->sig_head,
+                                                    __ATOMIC_RELAXED);
+  do {
+    cs->sig_next = head;
+  } while (!__atomic_compare_exchange_n(&md->sig_head, &head, cs, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct mg_lwip_conn_state *mg_lwip_sig_take_all(
+    struct mg_ev_mgr_lwip_data *md) {
+  return __atomic_exchange_n(&md->sig_head, NULL, __ATOMIC_ACQUIRE);
+}
+
+#define MG_LWIP_SIG_STAT_INC(md, field) \
+  __atomic_fetch_add(&(md)->stats.field, 1, __ATOMIC_RELAXED)
+#endif
+
 void mg_lwip_post_signal(enum mg_sig_type sig, struct mg_connection *nc) {
   struct mg_ev_mgr_lwip_data *md =
       (struct mg_ev_mgr_lwip_data *) nc->iface->data;
-  mgos_lock();
-  if (md->sig_queue_len >= MG_SIG_QUEUE_LEN) {
-    mgos_unlock();
+  struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  if (nc->sock == INVALID_SOCKET || cs->nc != nc) {
+    /*
+     * UDP "connections" share the state of their listener. They are only
+     * ever signalled by the Mongoose task, to be closed.
+     */
+    if (sig == MG_SIG_CLOSE_CONN) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  MG_LWIP_SIG_STAT_INC(md, num_posted);
+  if (mg_lwip_sig_fetch_or(&cs->sig_pending, 1U << sig) != 0) {
+    /* Already queued, delivered along with the pending ones. */
+    MG_LWIP_SIG_STAT_INC(md, num_coalesced);
     return;
   }
-  int end_index = (md->start_index + md->sig_queue_len) % MG_SIG_QUEUE_LEN;
-  md->sig_queue[end_index].sig = sig;
-  md->sig_queue[end_index].nc = nc;
-  md->sig_queue_len++;
+  mg_lwip_sig_push(md, cs);
   mg_lwip_mgr_schedule_poll(nc->mgr);
-  mgos_unlock();
 }
 
-void mg_ev_mgr_lwip_process_signals(struct mg_mgr *mgr) {
-  struct mg_ev_mgr_lwip_data *md =
-      (struct mg_ev_mgr_lwip_data *) mgr->ifaces[MG_MAIN_IFACE]->data;
-  while (md->sig_queue_len > 0) {
-    mgos_lock();
-    int sig = md->sig_queue[md->start_index].sig;
-    struct mg_connection *nc = md->sig_queue[md->start_index].nc;
-    struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
-    md->start_index = (md->start_index + 1) % MG_SIG_QUEUE_LEN;
-    md->sig_queue_len--;
-    mgos_unlock();
-    if (nc->iface == NULL || nc->mgr == NULL) continue;
-    switch (sig) {
-      case MG_SIG_CONNECT_RESULT: {
+static void mg_lwip_handle_signal(struct mg_connection *nc,
+                                  struct mg_lwip_conn_state *cs, int sig) {
+  switch (sig) {
+    case MG_SIG_CONNECT_RESULT: {
 #if MG_ENABLE_SSL
-        if (cs->err == 0 && (nc->flags & MG_F_SSL) &&
-            !(nc->flags & MG_F_SSL_HANDSHAKE_DONE)) {
-          mg_lwip_ssl_do_hs(nc);
-        } else
+      if (cs->err == 0 && (nc->flags & MG_F_SSL) &&
+          !(nc->flags & MG_F_SSL_HANDSHAKE_DONE)) {
+        mg_lwip_ssl_do_hs(nc);
+      } else
 #endif
-        {
-          mg_if_connect_cb(nc, cs->err);
-        }
-        break;
-      }
-      case MG_SIG_CLOSE_CONN: {
-        nc->flags |= MG_F_SEND_AND_CLOSE;
-        mg_close_conn(nc);
-        break;
-      }
-      case MG_SIG_RECV: {
-        cs->recv_pending = 0;
-        if (nc->flags & MG_F_UDP) {
-          mg_lwip_handle_recv_udp(nc);
-        } else {
-          mg_lwip_handle_recv_tcp(nc);
-        }
-        break;
-      }
-      case MG_SIG_TOMBSTONE: {
-        break;
+      {
+        mg_if_connect_cb(nc, cs->err);
       }
-      case MG_SIG_ACCEPT: {
-        mg_lwip_handle_accept(nc);
-        break;
+      break;
+    }
+    case MG_SIG_CLOSE_CONN: {
+      nc->flags |= MG_F_SEND_AND_CLOSE;
+      mg_close_conn(nc);
+      break;
+    }
+    case MG_SIG_RECV: {
+      if (nc->flags & MG_F_UDP) {
+        mg_lwip_handle_recv_udp(nc);
+      } else {
+        mg_lwip_handle_recv_tcp(nc);
       }
+      break;
+    }
+    case MG_SIG_ACCEPT: {
+      mg_lwip_handle_accept(nc);
+      break;
+    }
+  }
+}
+
+void mg_ev_mgr_lwip_process_signals(struct mg_mgr *mgr) {
+  /* Order in which coalesced signals of a connection are handled */
+  static const int order[] = {MG_SIG_CONNECT_RESULT, MG_SIG_ACCEPT,
+                              MG_SIG_RECV, MG_SIG_CLOSE_CONN};
+  struct mg_ev_mgr_lwip_data *md =
+      (struct mg_ev_mgr_lwip_data *) mgr->ifaces[MG_MAIN_IFACE]->data;
+  struct mg_lwip_conn_state *cs, *next, *list = NULL;
+  unsigned long n = 0;
+
+  /* Take everything posted so far, and restore the posting order. */
+  for (cs = mg_lwip_sig_take_all(md); cs != NULL; cs = next) {
+    next = cs->sig_next;
+    cs->sig_next = list;
+    list = cs;
+    n++;
+  }
+  if (n > md->stats.max_batch) md->stats.max_batch = n;
+
+  for (cs = list; cs != NULL; cs = next) {
+    /* Once the bits are taken, the state may be pushed again. */
+    unsigned int sigs;
+    size_t i;
+    next = cs->sig_next;
+    sigs = mg_lwip_sig_take(&cs->sig_pending);
+    if (sigs & (1U << MG_SIG_TOMBSTONE)) {
+      MG_FREE(cs);
+      continue;
     }
+    for (i = 0; i < ARRAY_SIZE(order); i++) {
+      /* Handler may close the connection, which tombstones the state. */
+      if (!(sigs & (1U << order[i])) || cs->nc == NULL) continue;
+      mg_lwip_handle_signal(cs->nc, cs, order[i]);
+    }
+  }
+}
+
+/*
+ * State may still be queued for signal delivery, even be in the batch being
+ * processed, so it is freed by mg_ev_mgr_lwip_process_signals().
+ */
+void mg_lwip_free_conn_state(struct mg_connection *nc) {
+  struct mg_ev_mgr_lwip_data *md =
+      (struct mg_ev_mgr_lwip_data *) nc->iface->data;
+  struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  cs->nc = cs->lc = NULL;
+  cs->pcb.tcp = NULL;
+  if (mg_lwip_sig_fetch_or(&cs->sig_pending, 1U << MG_SIG_TOMBSTONE) == 0) {
+    mg_lwip_sig_push(md, cs);
+  }
+}
+
+void mg_lwip_get_sig_stats(struct mg_mgr *mgr, struct mg_lwip_sig_stats *st) {
+  struct mg_ev_mgr_lwip_data *md =
+      (struct mg_ev_mgr_lwip_data *) mgr->ifaces[MG_MAIN_IFACE]->data;
+  *st = md->stats;
+}
+
+#if MG_ENABLE_LWIP_TASK_WAIT
+void mg_lwip_mgr_schedule_poll(struct mg_mgr *mgr) {
+  struct mg_ev_mgr_lwip_data *md =
+      (struct mg_ev_mgr_lwip_data *) mgr->ifaces[MG_MAIN_IFACE]->data;
+  if (md->wakeup != NULL) xSemaphoreGive(md->wakeup);
+}
+
+static uint32_t mg_lwip_next_poll_delay_ms(struct mg_mgr *mgr);
+
+/*
+ * Sleeps until a signal is posted or the nearest timer is due, but no longer
+ * than timeout_ms. A wakeup given since the last wait makes it return at
+ * once, so nothing posted between the delay calculation and here is missed.
+ * Without the semaphore it just sleeps, and signals wait for the next poll.
+ */
+static void mg_lwip_if_wait(struct mg_iface *iface, int timeout_ms) {
+  struct mg_ev_mgr_lwip_data *md = (struct mg_ev_mgr_lwip_data *) iface->data;
+  uint32_t delay_ms;
+  TickType_t ticks;
+  if (timeout_ms <= 0) return;
+  delay_ms = mg_lwip_next_poll_delay_ms(iface->mgr);
+  if (delay_ms > (uint32_t) timeout_ms) delay_ms = timeout_ms;
+  if (delay_ms == 0) return;
+  /* Round up, waking before the timer is due would just spin. */
+  ticks = (delay_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+  if (md->wakeup != NULL) {
+    xSemaphoreTake(md->wakeup, ticks);
+  } else {
+    vTaskDelay(ticks);
   }
 }
+#endif /* MG_ENABLE_LWIP_TASK_WAIT */
 
 void mg_lwip_if_init(struct mg_iface *iface) {
+  struct mg_ev_mgr_lwip_data *md;
   LOG(LL_INFO, ("%p Mongoose init", iface));
-  iface->data = MG_CALLOC(1, sizeof(struct mg_ev_mgr_lwip_data));
+  md = (struct mg_ev_mgr_lwip_data *) MG_CALLOC(1, sizeof(*md));
+  iface->data = md;
+#if MG_ENABLE_LWIP_TASK_WAIT
+  if (md != NULL && (md->wakeup = xSemaphoreCreateBinary()) == NULL) {
+    /* Polls still work, they just sleep out their timeout */
+    LOG(LL_ERROR, ("%p wakeup semaphore alloc failed", iface));
+  }
+#endif
 }
 
 void mg_lwip_if_free(struct mg_iface *iface) {
+  struct mg_ev_mgr_lwip_data *md = (struct mg_ev_mgr_lwip_data *) iface->data;
+  struct mg_lwip_conn_state *cs, *next;
+  /* All connections are closed by now, release their states. */
+  for (cs = mg_lwip_sig_take_all(md); cs != NULL; cs = next) {
+    next = cs->sig_next;
+    if (cs->sig_pending & (1U << MG_SIG_TOMBSTONE)) MG_FREE(cs);
+  }
+#if MG_ENABLE_LWIP_TASK_WAIT
+  if (md->wakeup != NULL) vSemaphoreDelete(md->wakeup);
+#endif
   MG_FREE(iface->data);
   iface->data = NULL;
 }
@@ -15370,18 +21265,13 @@ void mg_lwip_if_add_conn(struct mg_connection *nc) {
 }
 
 void mg_lwip_if_remove_conn(struct mg_connection *nc) {
-  struct mg_ev_mgr_lwip_data *md =
-      (struct mg_ev_mgr_lwip_data *) nc->iface->data;
-  /* Walk the queue and null-out further signals for this conn. */
-  for (int i = 0; i < MG_SIG_QUEUE_LEN; i++) {
-    if (md->sig_queue[i].nc == nc) {
-      md->sig_queue[i].sig = MG_SIG_TOMBSTONE;
-    }
-  }
+  /* Pending signals are dropped by mg_lwip_if_destroy_conn(). */
+  (void) nc;
 }
 
 time_t mg_lwip_if_poll(struct mg_iface *iface, int timeout_ms) {
   struct mg_mgr *mgr = iface->mgr;
+  struct mg_ev_mgr_lwip_data *md = (struct mg_ev_mgr_lwip_data *) iface->data;
   int n = 0;
   double now = mg_time();
   struct mg_connection *nc, *tmp;
@@ -15389,8 +21279,17 @@ time_t mg_lwip_if_poll(struct mg_iface *iface, int timeout_ms) {
   int num_timers = 0;
 #if 0
   DBG(("begin poll @%u", (unsigned int) (now * 1000)));
+#endif
+#if MG_ENABLE_LWIP_TASK_WAIT
+  mg_lwip_if_wait(iface, timeout_ms);
+  now = mg_time();
 #endif
   mg_ev_mgr_lwip_process_signals(mgr);
+  /* All timers are counted below, those set after that go on the list */
+  for (nc = LIST_FIRST(&mgr->work); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, work_link);
+    if (mg_if_owns_conn(iface, nc)) mg_unmark_work(nc);
+  }
   for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
     struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
     tmp = nc->next;
@@ -15431,21 +21330,27 @@ time_t mg_lwip_if_poll(struct mg_iface *iface, int timeout_ms) {
         mg_lwip_send_more(nc);
       }
     }
-    if (nc->sock != INVALID_SOCKET &&
-        !(nc->flags & (MG_F_UDP | MG_F_LISTENING)) && cs->pcb.tcp != NULL &&
-        cs->pcb.tcp->unsent != NULL) {
-      tcpip_callback(tcp_output_tcpip, cs->pcb.tcp);
-    }
     if (nc->ev_timer_time > 0) {
       if (num_timers == 0 || nc->ev_timer_time < min_timer) {
         min_timer = nc->ev_timer_time;
       }
       num_timers++;
     }
+    /* Could have been flagged, or sent to, by another connection's handler */
+    if (nc->flags & MG_F_CLOSING_MASK) mg_mark_closing(nc);
+    if (nc->send_mbuf.len > 0
+#if MG_ENABLE_SSL
+        || (nc->flags & MG_F_WANT_WRITE)
+#endif
+            ) {
+      mg_mark_writing(nc);
+    }
 
     if (nc->sock != INVALID_SOCKET) {
       /* Try to consume data from cs->rx_chain */
       mg_lwip_consume_rx_chain_tcp(nc);
+      /* Report what has been consumed by now in one window update. */
+      if (!(nc->flags & MG_F_UDP)) mg_lwip_flush_recved(nc);
 
       /*
        * If the connection is about to close, and rx_chain is finally empty,
@@ -15461,47 +21366,68 @@ time_t mg_lwip_if_poll(struct mg_iface *iface, int timeout_ms) {
        (unsigned int) (now * 1000), n, num_timers,
        (unsigned int) (min_timer * 1000), timeout_ms));
 #endif
+  md->min_timer = min_timer;
+  md->num_timers = num_timers;
   (void) timeout_ms;
   return now;
 }
 
-uint32_t mg_lwip_get_poll_delay_ms(struct mg_mgr *mgr) {
-  struct mg_connection *nc;
-  double now;
-  double min_timer = 0;
-  int num_timers = 0;
-  mg_ev_mgr_lwip_process_signals(mgr);
-  for (nc = mg_next(mgr, NULL); nc != NULL; nc = mg_next(mgr, nc)) {
-    struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+/*
+ * Looks only at what may have changed since the last poll: the timers it
+ * has seen, those set since (on mg_mgr::work), and connections on
+ * mg_mgr::closing and mg_mgr::writing.
+ */
+static uint32_t mg_lwip_next_poll_delay_ms(struct mg_mgr *mgr) {
+  struct mg_iface *iface = mgr->ifaces[MG_MAIN_IFACE];
+  struct mg_ev_mgr_lwip_data *md = (struct mg_ev_mgr_lwip_data *) iface->data;
+  struct mg_connection *nc, *tmp;
+  double now, min_timer = md->min_timer;
+  int num_timers = md->num_timers;
+  uint32_t timeout_ms = ~0;
+  for (nc = LIST_FIRST(&mgr->closing); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, closing_link);
+    /* Closed by a handler after the poll loop went past it. */
+    if (nc->flags & MG_F_CLOSE_IMMEDIATELY) return 0;
+  }
+  for (nc = LIST_FIRST(&mgr->work); nc != NULL; nc = tmp) {
+    tmp = LIST_NEXT(nc, work_link);
     if (nc->ev_timer_time > 0) {
       if (num_timers == 0 || nc->ev_timer_time < min_timer) {
         min_timer = nc->ev_timer_time;
       }
       num_timers++;
     }
-    if (nc->send_mbuf.len > 0
+  }
+  for (nc = LIST_FIRST(&mgr->writing); nc != NULL; nc = tmp) {
+    struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+    int can_send = 0;
+    tmp = LIST_NEXT(nc, writing_link);
+    if (nc->send_mbuf.len == 0
 #if MG_ENABLE_SSL
-        || (nc->flags & MG_F_WANT_WRITE)
+        && !(nc->flags & MG_F_WANT_WRITE)
 #endif
             ) {
-      int can_send = 0;
-      /* We have stuff to send, but can we? */
-      if (nc->flags & MG_F_UDP) {
-        /* UDP is always ready for sending. */
-        can_send = (cs->pcb.udp != NULL);
-      } else {
-        can_send = (cs->pcb.tcp != NULL && cs->pcb.tcp->snd_buf > 0);
-      }
-      /* We want and can send, request a poll immediately. */
-      if (can_send) return 0;
+      mg_unmark_writing(nc);
+      continue;
+    }
+    /* Not ours, e.g. HTTP/2 streams. Their output goes out on a poll. */
+    if (nc->sock == INVALID_SOCKET) continue;
+    /* We have stuff to send, but can we? */
+    if (nc->flags & MG_F_UDP) {
+      /* UDP is always ready for sending. */
+      can_send = (cs->pcb.udp != NULL);
+    } else {
+      can_send = (cs->pcb.tcp != NULL && cs->pcb.tcp->snd_buf > 0);
     }
+    /* We want and can send, request a poll immediately. */
+    if (can_send) return 0;
   }
-  uint32_t timeout_ms = ~0;
   now = mg_time();
   if (num_timers > 0) {
+    double timer_timeout_ms;
     /* If we have a timer that is past due, do a poll ASAP. */
     if (min_timer < now) return 0;
-    double timer_timeout_ms = (min_timer - now) * 1000 + 1 /* rounding */;
+    timer_timeout_ms = (min_timer - now) * 1000 + 1 /* rounding */;
     if (timer_timeout_ms < timeout_ms) {
       timeout_ms = timer_timeout_ms;
     }
@@ -15509,6 +21435,11 @@ uint32_t mg_lwip_get_poll_delay_ms(struct mg_mgr *mgr) {
   return timeout_ms;
 }
 
+uint32_t mg_lwip_get_poll_delay_ms(struct mg_mgr *mgr) {
+  mg_ev_mgr_lwip_process_signals(mgr);
+  return mg_lwip_next_poll_delay_ms(mgr);
+}
+
 #endif /* MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL */
 #ifdef MG_MODULE_LINES
 #line 1 "common/platforms/lwip/mg_lwip_ssl_if.c"
@@ -15518,6 +21449,9 @@ uint32_t mg_lwip_get_poll_delay_ms(struct mg_mgr *mgr) {
  * All rights reserved
  */
 
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_SSL
+
 #if MG_ENABLE_SSL && MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL
 
 /* Amalgamated: #include "common/mg_mem.h" */
@@ -15608,13 +21542,22 @@ void mg_lwip_ssl_send(struct mg_connection *nc) {
 
 void mg_lwip_ssl_recv(struct mg_connection *nc) {
   struct mg_lwip_conn_state *cs = (struct mg_lwip_conn_state *) nc->sock;
+  size_t budget = MG_RECV_BUDGET;
   /* Don't deliver data before connect callback */
   if (nc->flags & MG_F_CONNECTING) return;
   while (nc->recv_mbuf.len < nc->recv_mbuf_limit) {
-    char *buf = (char *) MG_MALLOC(MG_LWIP_SSL_IO_SIZE);
-    if (buf == NULL) return;
-    int ret = mg_ssl_if_read(nc, buf, MG_LWIP_SSL_IO_SIZE);
-    DBG(("%p %p SSL_read %u = %d", nc, cs->rx_chain, MG_LWIP_SSL_IO_SIZE, ret));
+    size_t size = mg_recv_size(nc);
+    char *buf;
+    int ret;
+    if (budget == 0) {
+      /* The library may still have data buffered, come back on next poll. */
+      nc->flags |= MG_F_WANT_READ;
+      mg_lwip_mgr_schedule_poll(nc->mgr);
+      return;
+    }
+    if ((buf = (char *) MG_MALLOC(size)) == NULL) return;
+    ret = mg_ssl_if_read(nc, buf, size);
+    DBG(("%p %p SSL_read %u = %d", nc, cs->rx_chain, (unsigned) size, ret));
     if (ret <= 0) {
       MG_FREE(buf);
       if (ret == MG_SSL_WANT_WRITE) {
@@ -15633,6 +21576,8 @@ void mg_lwip_ssl_recv(struct mg_connection *nc) {
         return;
       }
     } else {
+      mg_recv_size_update(nc, size, (size_t) ret);
+      budget -= MIN(budget, (size_t) ret);
       mg_if_recv_tcp_cb(nc, buf, ret, 1 /* own */);
     }
   }
@@ -15710,6 +21655,9 @@ int ssl_socket_recv(void *ctx, unsigned char *buf, size_t len) {
 #endif
 
 #endif /* MG_ENABLE_SSL && MG_NET_IF == MG_NET_IF_LWIP_LOW_LEVEL */
+
+#undef MG_MEM_TAG
+#define MG_MEM_TAG MG_MEM_TAG_OTHER
 #ifdef MG_MODULE_LINES
 #line 1 "common/platforms/wince/wince_libc.c"
 #endif
@@ -15888,6 +21836,10 @@ void mg_pic32_if_tcp_send(struct mg_connection *nc, const void *buf,
   mbuf_append(&nc->send_mbuf, buf, len);
 }
 
+struct mbuf *mg_pic32_if_tcp_send_mbuf(struct mg_connection *nc) {
+  return &nc->send_mbuf;
+}
+
 int mg_pic32_if_listen_tcp(struct mg_connection *nc, union socket_address *sa) {
   nc->sock = TCPIP_TCP_ServerOpen(
       sa->sin.sin_family == AF_INET ? IP_ADDRESS_TYPE_IPV4
@@ -16101,6 +22053,10 @@ void mg_pic32_if_connect_udp(struct mg_connection *nc) {
     mg_pic32_if_destroy_conn,                                   \
     mg_pic32_if_sock_set,                                       \
     mg_pic32_if_get_conn_addr,                                  \
+    mg_pic32_if_tcp_send_mbuf,                                  \
+    NULL /* get_wait_sock */,                                   \
+    NULL /* recv_view */,                                       \
+    NULL /* recv_consume */,                                    \
   }
 /* clang-format on */
 
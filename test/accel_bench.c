@@ -0,0 +1,75 @@
+/*
+ * Throughput of the SHA1 and base64 primitives. The Makefile builds this
+ * with the x86 acceleration on and off; run `make -C test bench` and compare
+ * the two outputs. Sizes span a WebSocket handshake key up to bulk data.
+ */
+
+#include <time.h>
+
+#include "mongoose.h"
+
+#define MIN_BYTES (64 * 1024 * 1024)
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int size, int iters, double secs) {
+  printf("%-14s %7d bytes: %8.1f MB/s\n", what, size,
+         (double) size * iters / secs / 1e6);
+}
+
+int main(void) {
+  static const int sizes[] = {24, 60, 1024, 65536};
+  unsigned char *src = (unsigned char *) malloc(65536);
+  char *enc = (char *) malloc(65536 / 3 * 4 + 8);
+  char *dec = (char *) malloc(65536 + 8);
+  unsigned char digest[20];
+  volatile unsigned sink = 0;
+  size_t k;
+  int i, iters, n;
+  double t;
+
+#if defined(CS_ENABLE_X86_ACCEL) && !CS_ENABLE_X86_ACCEL
+  printf("x86 acceleration compiled out\n");
+#else
+  printf("x86 acceleration where the CPU has it\n");
+#endif
+  for (i = 0; i < 65536; i++) src[i] = (unsigned char) (i * 131 + 7);
+
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    int size = sizes[k], enc_len = (size + 2) / 3 * 4;
+    iters = MIN_BYTES / size;
+
+    t = now();
+    for (i = 0; i < iters; i++) {
+      cs_sha1_ctx ctx;
+      cs_sha1_init(&ctx);
+      cs_sha1_update(&ctx, src, size);
+      cs_sha1_final(digest, &ctx);
+      sink += digest[0];
+    }
+    report("sha1", size, iters, now() - t);
+
+    t = now();
+    for (i = 0; i < iters; i++) {
+      cs_base64_encode(src, size, enc);
+      sink += (unsigned char) enc[i % enc_len];
+    }
+    report("base64 encode", size, iters, now() - t);
+
+    t = now();
+    for (i = 0; i < iters; i++) {
+      cs_base64_decode((unsigned char *) enc, enc_len, dec, &n);
+      sink += (unsigned char) dec[i % n];
+    }
+    report("base64 decode", enc_len, iters, now() - t);
+  }
+
+  free(src);
+  free(enc);
+  free(dec);
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Starts a graceful drain while HTTP replies are being streamed, a piece
+ * every PIECE_INTERVAL seconds, and checks that they are not cut short:
+ * draining must wait for the last chunk of a chunked reply and for all
+ * Content-Length bytes.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define NUM_PIECES 5
+#define PIECE "0123456789"
+#define PIECE_LEN (sizeof(PIECE) - 1)
+#define PIECE_INTERVAL 0.05
+
+static int s_pieces_sent;
+static double s_next_piece_time;
+static int s_chunked;
+static int s_server_closed;
+static size_t s_got_len;
+static int s_done;
+
+static void send_piece(struct mg_connection *nc) {
+  if (s_chunked) {
+    mg_send_http_chunk(nc, PIECE, PIECE_LEN);
+  } else {
+    mg_send(nc, PIECE, PIECE_LEN);
+  }
+  s_next_piece_time = mg_time() + PIECE_INTERVAL;
+  if (++s_pieces_sent == NUM_PIECES && s_chunked) {
+    mg_send_http_chunk(nc, "", 0);
+  }
+}
+
+static void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_HTTP_REQUEST) {
+    mg_send_head(nc, 200, s_chunked ? -1 : (int64_t) NUM_PIECES * PIECE_LEN,
+                 "Content-Type: text/plain");
+    send_piece(nc);
+  } else if (ev == MG_EV_POLL && nc->listener != NULL && s_pieces_sent > 0 &&
+             s_pieces_sent < NUM_PIECES && mg_time() >= s_next_piece_time) {
+    send_piece(nc);
+  } else if (ev == MG_EV_CLOSE && nc->listener != NULL) {
+    s_server_closed = 1;
+  }
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_HTTP_REPLY) {
+    s_got_len = ((struct http_message *) ev_data)->body.len;
+    s_done = 1;
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  } else if (ev == MG_EV_CLOSE && !s_done) {
+    s_done = -1;
+  }
+}
+
+static void drain_during_reply(int chunked) {
+  struct mg_mgr mgr;
+  struct mg_connection *lc;
+  double deadline = mg_time() + 5;
+  char addr[32], url[48];
+
+  s_chunked = chunked;
+  s_pieces_sent = s_server_closed = s_done = 0;
+  s_got_len = 0;
+  mg_mgr_init(&mgr, NULL);
+  lc = test_bind(&mgr, http_handler, addr, sizeof(addr));
+  CHECK(lc != NULL);
+  if (lc == NULL) return;
+  mg_set_protocol_http_websocket(lc);
+  snprintf(url, sizeof(url), "http://%s/", addr);
+  CHECK(mg_connect_http(&mgr, client_handler, url, NULL, NULL) != NULL);
+
+  while (s_pieces_sent == 0 && mg_time() < deadline) mg_mgr_poll(&mgr, 10);
+  mg_mgr_drain(&mgr, 5);
+  while (mgr.active_connections != NULL && mg_time() < deadline) {
+    mg_mgr_poll(&mgr, 10);
+  }
+
+  CHECK(s_done == 1);
+  CHECK(s_got_len == NUM_PIECES * PIECE_LEN);
+  CHECK(s_server_closed);
+  CHECK(mg_time() < deadline);
+  mg_mgr_free(&mgr);
+}
+
+int main(void) {
+  drain_during_reply(1);
+  drain_during_reply(0);
+  return test_report("drain_test");
+}
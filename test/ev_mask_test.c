@@ -0,0 +1,144 @@
+/*
+ * Echoes with event masks in place. The server's masks come from its
+ * listener: the user handler must not see the events masked out, and must
+ * still get protocol events with every core event masked out. On the client,
+ * a protocol handler that opts out of MG_EV_POLL must not be called for it,
+ * while the user handler is.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define NUM_CORE_EVENTS (MG_EV_TIMER + 1)
+
+static int s_server_evs[NUM_CORE_EVENTS], s_proto_evs[NUM_CORE_EVENTS];
+static int s_client_evs[NUM_CORE_EVENTS];
+static int s_got, s_http_core_evs, s_http_requests, s_http_done;
+
+static void count(int *evs, int ev) {
+  if (ev >= 0 && ev < NUM_CORE_EVENTS) evs[ev]++;
+}
+
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  count(s_server_evs, ev);
+  if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  count(s_client_evs, ev);
+  if (ev == MG_EV_CONNECT) {
+    mg_send(nc, "ping", 4);
+  } else if (ev == MG_EV_RECV) {
+    s_got += (int) nc->recv_mbuf.len;
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+/* Passes everything on, like the built-in protocol handlers do */
+static void proto_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  count(s_proto_evs, ev);
+  nc->handler(nc, ev, ev_data);
+}
+
+static void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev < NUM_CORE_EVENTS) {
+    s_http_core_evs++;
+  } else if (ev == MG_EV_HTTP_REQUEST) {
+    s_http_requests++;
+    mg_send_head(nc, 200, 2, NULL);
+    mg_printf(nc, "ok");
+  }
+  (void) ev_data;
+}
+
+static void http_client_handler(struct mg_connection *nc, int ev,
+                                void *ev_data) {
+  if (ev == MG_EV_HTTP_REPLY) {
+    s_http_done = 1;
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  } else if (ev == MG_EV_CLOSE && !s_http_done) {
+    s_http_done = -1;
+  }
+  (void) ev_data;
+}
+
+static void test_echo(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *lc, *nc;
+  double deadline = mg_time() + 5;
+  char addr[32];
+  int i;
+
+  mg_mgr_init(&mgr, NULL);
+  lc = test_bind(&mgr, server_handler, addr, sizeof(addr));
+  CHECK(lc != NULL);
+  if (lc == NULL) return;
+  lc->ev_mask &= ~(MG_EV_MASK(MG_EV_POLL) | MG_EV_MASK(MG_EV_SEND));
+  nc = mg_connect(&mgr, addr, client_handler);
+  CHECK(nc != NULL);
+  if (nc == NULL) return;
+  nc->proto_handler = proto_handler;
+  nc->proto_ev_mask &= ~MG_EV_MASK(MG_EV_POLL);
+  while (s_got < 4 && mg_time() < deadline) mg_mgr_poll(&mgr, 10);
+  for (i = 0; i < 5; i++) mg_mgr_poll(&mgr, 1);
+
+  CHECK(s_got == 4);
+  CHECK(s_server_evs[MG_EV_ACCEPT] == 1);
+  CHECK(s_server_evs[MG_EV_RECV] > 0);
+  CHECK(s_server_evs[MG_EV_POLL] == 0);
+  CHECK(s_server_evs[MG_EV_SEND] == 0);
+  CHECK(s_proto_evs[MG_EV_RECV] > 0);
+  CHECK(s_proto_evs[MG_EV_POLL] == 0);
+  CHECK(s_client_evs[MG_EV_RECV] == s_proto_evs[MG_EV_RECV]);
+  CHECK(s_client_evs[MG_EV_POLL] > 0);
+  mg_mgr_free(&mgr);
+}
+
+static void test_protocol_events(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *lc;
+  double deadline = mg_time() + 5;
+  char addr[32], url[48];
+
+  mg_mgr_init(&mgr, NULL);
+  lc = test_bind(&mgr, http_handler, addr, sizeof(addr));
+  CHECK(lc != NULL);
+  if (lc == NULL) return;
+  mg_set_protocol_http_websocket(lc);
+  lc->ev_mask = 0;
+  snprintf(url, sizeof(url), "http://%s/", addr);
+  CHECK(mg_connect_http(&mgr, http_client_handler, url, NULL, NULL) != NULL);
+  while (!s_http_done && mg_time() < deadline) mg_mgr_poll(&mgr, 10);
+  CHECK(s_http_done == 1);
+  CHECK(s_http_requests == 1);
+  CHECK(s_http_core_evs == 0);
+  mg_mgr_free(&mgr);
+}
+
+static void test_mqtt(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  mg_mgr_init(&mgr, NULL);
+  nc = mg_add_sock(&mgr, INVALID_SOCKET, client_handler);
+  CHECK(nc != NULL);
+  if (nc == NULL) return;
+  /* Needs polls for keep-alive only, and never MG_EV_SEND */
+  mg_set_protocol_mqtt(nc);
+  CHECK((nc->proto_ev_mask & MG_EV_MASK(MG_EV_POLL)) == 0);
+  CHECK((nc->proto_ev_mask & MG_EV_MASK(MG_EV_SEND)) == 0);
+  CHECK((nc->proto_ev_mask & MG_EV_MASK(MG_EV_RECV)) != 0);
+  mg_send_mqtt_handshake(nc, "client");
+  CHECK((nc->proto_ev_mask & MG_EV_MASK(MG_EV_POLL)) != 0);
+  mg_mgr_free(&mgr);
+}
+
+int main(void) {
+  test_echo();
+  test_protocol_events();
+  test_mqtt();
+  return test_report("ev_mask_test");
+}
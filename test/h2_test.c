@@ -0,0 +1,368 @@
+/*
+ * Talks HTTP/2 with prior knowledge to the built-in server, frame by frame:
+ * connection preface and SETTINGS exchange, HPACK with Huffman literals and
+ * dynamic table eviction, a request body split across DATA frames, a
+ * response stalled on the flow control window until WINDOW_UPDATE, and the
+ * stream and connection errors for malformed or oversized header blocks.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define FRAME_DATA 0
+#define FRAME_HEADERS 1
+#define FRAME_RST_STREAM 3
+#define FRAME_SETTINGS 4
+#define FRAME_PING 6
+#define FRAME_GOAWAY 7
+#define FRAME_WINDOW_UPDATE 8
+#define FRAME_CONTINUATION 9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+
+#define PROTOCOL_ERROR 0x1
+#define COMPRESSION_ERROR 0x9
+#define ENHANCE_YOUR_CALM 0xb
+
+struct frame {
+  int type, flags;
+  uint32_t id;
+  unsigned char data[20000];
+  size_t len;
+};
+
+static struct mg_mgr s_mgr;
+static char s_addr[32];
+static struct mg_connection *s_client;
+static struct mbuf s_got; /* Received and not parsed yet */
+static int s_closed;
+static struct frame s_frame;
+static int s_status_ok; /* Of the last response headers collected */
+
+/*
+ * Replies to /echo with the request headers the test is interested in and
+ * the request body; to anything else with a body of 100 bytes.
+ */
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  static const char *names[] = {"host", "cache-control", "custom-key", "x-a"};
+  struct http_message *hm = (struct http_message *) ev_data;
+  struct mbuf out;
+  size_t i, j;
+  if (ev != MG_EV_HTTP_REQUEST) return;
+  mbuf_init(&out, 0);
+  if (mg_vcmp(&hm->uri, "/echo") == 0) {
+    for (i = 0; hm->header_names[i].len > 0; i++) {
+      for (j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+        if (mg_vcasecmp(&hm->header_names[i], names[j]) != 0) continue;
+        mbuf_printf(&out, "%s=%.*s;", names[j], (int) hm->header_values[i].len,
+                    hm->header_values[i].p);
+      }
+    }
+    mbuf_printf(&out, "body=%.*s", (int) hm->body.len, hm->body.p);
+  } else {
+    mbuf_append(&out, NULL, 100);
+    memset(out.buf, 'x', out.len);
+  }
+  mg_send_head(nc, 200, (int64_t) out.len, "Content-Type: text/plain");
+  mg_send(nc, out.buf, out.len);
+  mbuf_free(&out);
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_RECV) {
+    mbuf_append(&s_got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == MG_EV_CLOSE) {
+    s_closed = 1;
+  }
+  (void) ev_data;
+}
+
+static void send_frame(int type, int flags, uint32_t id, const void *data,
+                       size_t len) {
+  unsigned char hdr[9];
+  hdr[0] = (unsigned char) (len >> 16);
+  hdr[1] = (unsigned char) (len >> 8);
+  hdr[2] = (unsigned char) len;
+  hdr[3] = (unsigned char) type;
+  hdr[4] = (unsigned char) flags;
+  hdr[5] = (unsigned char) (id >> 24);
+  hdr[6] = (unsigned char) (id >> 16);
+  hdr[7] = (unsigned char) (id >> 8);
+  hdr[8] = (unsigned char) id;
+  mg_send(s_client, hdr, sizeof(hdr));
+  if (len > 0) mg_send(s_client, data, len);
+}
+
+static void send_u32(int type, uint32_t id, uint32_t v) {
+  unsigned char buf[4];
+  buf[0] = (unsigned char) (v >> 24);
+  buf[1] = (unsigned char) (v >> 16);
+  buf[2] = (unsigned char) (v >> 8);
+  buf[3] = (unsigned char) v;
+  send_frame(type, 0, id, buf, sizeof(buf));
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 |
+         p[3];
+}
+
+/* Polls until the next frame is in, returns 0 on timeout or close. */
+static int next_frame(double timeout) {
+  double deadline = mg_time() + timeout;
+  for (;;) {
+    const unsigned char *p = (const unsigned char *) s_got.buf;
+    size_t len = 0;
+    if (s_got.len >= 9) len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+    if (s_got.len >= 9 && s_got.len >= 9 + len &&
+        len <= sizeof(s_frame.data)) {
+      s_frame.type = p[3];
+      s_frame.flags = p[4];
+      s_frame.id = get32(p + 5) & 0x7fffffff;
+      s_frame.len = len;
+      memcpy(s_frame.data, p + 9, len);
+      mbuf_remove(&s_got, 9 + len);
+      return 1;
+    }
+    if (s_closed || mg_time() > deadline) return 0;
+    mg_mgr_poll(&s_mgr, 10);
+  }
+}
+
+/* Skips frames until one of `type` arrives. */
+static int wait_frame(int type) {
+  while (next_frame(2)) {
+    if (s_frame.type == type) return 1;
+  }
+  return 0;
+}
+
+/* Polls for a while, returns 1 if the connection got closed */
+static int wait_close(void) {
+  double deadline = mg_time() + 2;
+  while (!s_closed && mg_time() < deadline) mg_mgr_poll(&s_mgr, 10);
+  return s_closed;
+}
+
+/*
+ * Connects and exchanges the preface and SETTINGS, with `settings` (pairs of
+ * id and value) as ours. Returns 1 once both sides have acknowledged.
+ */
+static int h2_open(const uint32_t *settings, size_t num_settings) {
+  unsigned char buf[60];
+  size_t i;
+  int got_settings = 0, got_ack = 0;
+
+  mbuf_free(&s_got);
+  mbuf_init(&s_got, 0);
+  s_closed = 0;
+  s_client = mg_connect(&s_mgr, s_addr, client_handler);
+  if (s_client == NULL) return 0;
+  mg_send(s_client, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  for (i = 0; i < num_settings; i++) {
+    buf[i * 6] = 0;
+    buf[i * 6 + 1] = (unsigned char) settings[i * 2];
+    buf[i * 6 + 2] = (unsigned char) (settings[i * 2 + 1] >> 24);
+    buf[i * 6 + 3] = (unsigned char) (settings[i * 2 + 1] >> 16);
+    buf[i * 6 + 4] = (unsigned char) (settings[i * 2 + 1] >> 8);
+    buf[i * 6 + 5] = (unsigned char) settings[i * 2 + 1];
+  }
+  send_frame(FRAME_SETTINGS, 0, 0, buf, num_settings * 6);
+  while ((!got_settings || !got_ack) && next_frame(2)) {
+    if (s_frame.type != FRAME_SETTINGS || s_frame.id != 0) continue;
+    if (s_frame.flags & FLAG_ACK) {
+      got_ack = (s_frame.len == 0);
+    } else {
+      got_settings = (s_frame.len % 6 == 0);
+      send_frame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    }
+  }
+  return got_settings && got_ack;
+}
+
+/*
+ * Collects the response on stream `id` into `body`. Returns 1 once it is
+ * complete, 0 if nothing comes for `timeout` seconds. Status 200 is encoded
+ * by the server as static entry 8.
+ */
+static int collect(uint32_t id, struct mbuf *body, double timeout) {
+  while (next_frame(timeout)) {
+    if (s_frame.id != id) continue;
+    if (s_frame.type == FRAME_HEADERS) {
+      s_status_ok = (s_frame.len > 0 && s_frame.data[0] == 0x88);
+    } else if (s_frame.type == FRAME_DATA) {
+      mbuf_append(body, s_frame.data, s_frame.len);
+    } else {
+      return 0;
+    }
+    if (s_frame.flags & FLAG_END_STREAM) return 1;
+  }
+  return 0;
+}
+
+static int read_response(uint32_t id, struct mbuf *body) {
+  s_status_ok = 0;
+  return collect(id, body, 2) && s_status_ok;
+}
+
+/*
+ * Polls until the manager has `n` connections. The stream connections that
+ * requests are served on count, until they are closed and freed.
+ */
+static int wait_conns(int n) {
+  double deadline = mg_time() + 2;
+  for (;;) {
+    struct mg_connection *c;
+    int num = 0;
+    for (c = mg_next(&s_mgr, NULL); c != NULL; c = mg_next(&s_mgr, c)) num++;
+    if (num == n || mg_time() > deadline) return num == n;
+    mg_mgr_poll(&s_mgr, 10);
+  }
+}
+
+static int body_is(const struct mbuf *body, const char *want) {
+  return body->len == strlen(want) && memcmp(body->buf, want, body->len) == 0;
+}
+
+/* :method GET, :scheme http, :path /echo, the latter not indexed */
+static const unsigned char s_get_echo[] = {0x82, 0x86, 0x04, 0x05,
+                                           '/',  'e',  'c',  'h',  'o'};
+
+static void test_hpack(void) {
+  /* RFC 7541 C.4: Huffman literals, added to the dynamic table */
+  static const unsigned char req1[] = {
+      0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90,
+      0xf4, 0xff, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf, 0x40, 0x88,
+      0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49,
+      0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf};
+  unsigned char block[100];
+  struct mbuf body;
+  size_t n;
+
+  mbuf_init(&body, 0);
+  CHECK(h2_open(NULL, 0));
+
+  memcpy(block, s_get_echo, sizeof(s_get_echo));
+  memcpy(block + sizeof(s_get_echo), req1, sizeof(req1));
+  send_frame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 1, block,
+             sizeof(s_get_echo) + sizeof(req1));
+  CHECK(read_response(1, &body));
+  CHECK(body_is(&body,
+                "host=www.example.com;cache-control=no-cache;"
+                "custom-key=custom-value;body="));
+  /* The listener and both ends of the connection, the stream is gone */
+  CHECK(wait_conns(3));
+
+  /*
+   * The table holds custom-key (54 bytes), cache-control (53) and
+   * :authority (57). Shrinking it to 110 evicts :authority, adding a 55
+   * byte x-a then evicts cache-control, leaving x-a at 62 and custom-key
+   * at 63.
+   */
+  n = 0;
+  block[n++] = 0x3f; /* Table size update to 110 */
+  block[n++] = 110 - 31;
+  memcpy(block + n, s_get_echo, sizeof(s_get_echo));
+  n += sizeof(s_get_echo);
+  block[n++] = 0xbe; /* 62: custom-key */
+  block[n++] = 0x40;
+  block[n++] = 3;
+  memcpy(block + n, "x-a", 3);
+  n += 3;
+  block[n++] = 20;
+  memset(block + n, 'a', 20);
+  n += 20;
+  block[n++] = 0xbf; /* 63: custom-key again */
+  send_frame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 3, block, n);
+  body.len = 0;
+  CHECK(read_response(3, &body));
+  CHECK(body_is(&body,
+                "custom-key=custom-value;x-a=aaaaaaaaaaaaaaaaaaaa;"
+                "custom-key=custom-value;body="));
+
+  /* 64 is gone, which breaks the shared HPACK state: GOAWAY */
+  memcpy(block, s_get_echo, sizeof(s_get_echo));
+  block[sizeof(s_get_echo)] = 0xc0;
+  send_frame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 5, block,
+             sizeof(s_get_echo) + 1);
+  CHECK(wait_frame(FRAME_GOAWAY));
+  CHECK(s_frame.len == 8 && get32(s_frame.data) == 3 &&
+        get32(s_frame.data + 4) == COMPRESSION_ERROR);
+  CHECK(wait_close());
+  mbuf_free(&body);
+}
+
+static void test_body_and_flow_control(void) {
+  /* SETTINGS_INITIAL_WINDOW_SIZE: 10 bytes per stream */
+  static const uint32_t settings[] = {0x4, 10};
+  /* :method POST, :scheme http, :path /echo, no content-length */
+  static const unsigned char post_echo[] = {0x83, 0x86, 0x04, 0x05,
+                                            '/',  'e',  'c',  'h',  'o'};
+  static const unsigned char no_path[] = {0x82, 0x86};
+  struct mbuf body;
+
+  mbuf_init(&body, 0);
+  CHECK(h2_open(settings, 1));
+
+  send_frame(FRAME_HEADERS, FLAG_END_HEADERS, 1, post_echo, sizeof(post_echo));
+  send_frame(FRAME_DATA, 0, 1, "hello ", 6);
+  send_frame(FRAME_DATA, FLAG_END_STREAM, 1, "world", 5);
+
+  /* 16 bytes of response, only 10 fit the window */
+  s_status_ok = 0;
+  CHECK(!collect(1, &body, 0.3));
+  CHECK(s_status_ok);
+  CHECK(body.len == 10);
+
+  send_u32(FRAME_WINDOW_UPDATE, 1, 100);
+  CHECK(collect(1, &body, 2));
+  CHECK(body_is(&body, "body=hello world"));
+
+  /* No :path: the stream is refused, the connection goes on */
+  send_frame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 3, no_path,
+             sizeof(no_path));
+  CHECK(wait_frame(FRAME_RST_STREAM));
+  CHECK(s_frame.id == 3 && s_frame.len == 4 &&
+        get32(s_frame.data) == PROTOCOL_ERROR);
+  send_frame(FRAME_PING, 0, 0, "12345678", 8);
+  CHECK(wait_frame(FRAME_PING));
+  CHECK((s_frame.flags & FLAG_ACK) && memcmp(s_frame.data, "12345678", 8) == 0);
+
+  s_client->flags |= MG_F_CLOSE_IMMEDIATELY;
+  wait_close();
+  mbuf_free(&body);
+}
+
+static void test_continuation_flood(void) {
+  static unsigned char junk[4000];
+  int i;
+  CHECK(h2_open(NULL, 0));
+  memset(junk, 0x82, sizeof(junk));
+  send_frame(FRAME_HEADERS, 0, 1, junk, sizeof(junk));
+  for (i = 0; i < 10; i++) {
+    send_frame(FRAME_CONTINUATION, 0, 1, junk, sizeof(junk));
+  }
+  CHECK(wait_frame(FRAME_GOAWAY));
+  CHECK(s_frame.len == 8 && get32(s_frame.data + 4) == ENHANCE_YOUR_CALM);
+  CHECK(wait_close());
+}
+
+int main(void) {
+  struct mg_connection *nc;
+  mg_mgr_init(&s_mgr, NULL);
+  mbuf_init(&s_got, 0);
+  nc = test_bind(&s_mgr, server_handler, s_addr, sizeof(s_addr));
+  CHECK(nc != NULL);
+  mg_set_protocol_http_websocket(nc);
+
+  test_hpack();
+  test_body_and_flow_control();
+  test_continuation_flood();
+
+  mg_mgr_free(&s_mgr);
+  mbuf_free(&s_got);
+  return test_report("h2_test");
+}
@@ -0,0 +1,51 @@
+/*
+ * Inherits a listening socket through MG_LISTEN_FDS, as a process started
+ * by mg_mgr_export_listeners() does, and adopts it in mg_bind(). Only the
+ * first manager may look at the variable: one initialised after this
+ * process has exported its own listeners must not take them.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static void handler(struct mg_connection *nc, int ev, void *ev_data) {
+  (void) nc;
+  (void) ev;
+  (void) ev_data;
+}
+
+int main(void) {
+  struct mg_mgr a, b;
+  struct mg_connection *nc;
+  union socket_address sa;
+  socklen_t len = sizeof(sa.sin);
+  sock_t sock = socket(AF_INET, SOCK_STREAM, 0);
+  char buf[32];
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin.sin_family = AF_INET;
+  sa.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(bind(sock, &sa.sa, sizeof(sa.sin)) == 0);
+  CHECK(listen(sock, 8) == 0);
+  CHECK(getsockname(sock, &sa.sa, &len) == 0);
+  snprintf(buf, sizeof(buf), "%d", (int) sock);
+  setenv(MG_LISTEN_FDS_ENV, buf, 1);
+
+  mg_mgr_init(&a, NULL);
+  CHECK(a.num_handoff_socks == 1);
+  CHECK(getenv(MG_LISTEN_FDS_ENV) == NULL);
+  snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int) ntohs(sa.sin.sin_port));
+  nc = mg_bind(&a, buf, handler);
+  CHECK(nc != NULL && nc->sock == sock);
+  CHECK(a.num_handoff_socks == 0);
+
+  /* Exported for a child, this process' next manager must leave it */
+  CHECK(mg_mgr_export_listeners(&a) == 1);
+  mg_mgr_init(&b, NULL);
+  CHECK(b.num_handoff_socks == 0);
+  CHECK(getenv(MG_LISTEN_FDS_ENV) != NULL);
+
+  mg_mgr_free(&b);
+  mg_mgr_free(&a);
+  return test_report("handoff_test");
+}
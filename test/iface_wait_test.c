@@ -0,0 +1,86 @@
+/*
+ * A manager with two interfaces: the client on the main one, the server on
+ * a socket interface next to it. Only the main interface blocks, so every
+ * step of the exchange on the server side must wake it up through the
+ * other's wait socket (get_wait_sock), well before the poll timeout. Run
+ * with the socket and the io_uring interface as the main one; the latter
+ * falls back to select() where io_uring is not available.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define POLL_MS 1000
+
+static const struct mg_iface_vtable *s_socket_vtable;
+static struct mg_mgr s_mgr;
+static struct mbuf s_got;
+static int s_accepted, s_closed;
+
+static void echo_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_ACCEPT) {
+    s_accepted = nc->iface == s_mgr.ifaces[1] ? 1 : -1;
+  } else if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_CONNECT) {
+    if (*(int *) ev_data == 0) mg_send(nc, "hello", 5);
+  } else if (ev == MG_EV_RECV) {
+    mbuf_append(&s_got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == MG_EV_CLOSE) {
+    s_closed = 1;
+  }
+}
+
+static void test_echo(const struct mg_iface_vtable *main_vtable) {
+  const struct mg_iface_vtable *vtables[2];
+  struct mg_mgr_init_opts opts;
+  struct mg_bind_opts bopts;
+  struct mg_connection *nc;
+  double start = mg_time();
+  char addr[32];
+
+  vtables[0] = main_vtable;
+  vtables[1] = s_socket_vtable;
+  memset(&opts, 0, sizeof(opts));
+  opts.num_ifaces = 2;
+  opts.ifaces = vtables;
+  mg_mgr_init_opt(&s_mgr, NULL, opts);
+  mbuf_init(&s_got, 0);
+  s_accepted = s_closed = 0;
+
+  memset(&bopts, 0, sizeof(bopts));
+  bopts.iface = s_mgr.ifaces[1];
+  nc = mg_bind_opt(&s_mgr, "127.0.0.1:0", echo_handler, bopts);
+  CHECK(nc != NULL);
+  if (nc == NULL) return;
+  mg_conn_addr_to_str(nc, addr, sizeof(addr),
+                      MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+  CHECK(mg_connect(&s_mgr, addr, client_handler) != NULL);
+  while (s_got.len < 5 && !s_closed && mg_time() < start + 5) {
+    mg_mgr_poll(&s_mgr, POLL_MS);
+  }
+  CHECK(s_accepted == 1);
+  CHECK(s_got.len == 5 && memcmp(s_got.buf, "hello", 5) == 0);
+  /* Any step on the server side waiting for the timeout shows */
+  CHECK(mg_time() - start < POLL_MS / 1000.0 * 0.9);
+
+  mg_mgr_free(&s_mgr);
+  mbuf_free(&s_got);
+}
+
+int main(void) {
+  /* The default interface is the socket one */
+  s_socket_vtable = mg_ifaces[MG_MAIN_IFACE];
+  test_echo(s_socket_vtable);
+#if MG_ENABLE_NET_IF_URING
+  test_echo(&mg_uring_iface_vtable);
+#endif
+  return test_report("iface_wait_test");
+}
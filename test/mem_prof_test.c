@@ -0,0 +1,104 @@
+/*
+ * Allocates, reallocates and frees through the profiler and checks the
+ * live, peak and total counters, per tag and overall. Then several threads
+ * allocate and free at once, as managers polled by different threads do:
+ * no update may be lost.
+ */
+
+#include <pthread.h>
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define NUM_THREADS 4
+#define NUM_ROUNDS 20000
+
+static void *alloc_thread(void *arg) {
+  int i, tag = (int) (intptr_t) arg;
+  for (i = 0; i < NUM_ROUNDS; i++) {
+    void *p = mg_mem_prof_malloc(tag, 16 + i % 64);
+    void *q = mg_mem_prof_calloc(tag, 2, 8);
+    p = mg_mem_prof_realloc(tag, p, 100);
+    mg_mem_prof_free(q);
+    mg_mem_prof_free(p);
+  }
+  return NULL;
+}
+
+static void test_counters(void) {
+  struct mg_mem_prof_snapshot s0, s;
+  const struct mg_mem_prof_stats *t0 = &s0.tags[MG_MEM_TAG_MQTT];
+  const struct mg_mem_prof_stats *t = &s.tags[MG_MEM_TAG_MQTT];
+  void *a, *b, *c;
+
+  mg_mem_prof_reset_peak();
+  mg_mem_prof_snapshot(&s0);
+  a = mg_mem_prof_malloc(MG_MEM_TAG_MQTT, 100);
+  b = mg_mem_prof_calloc(MG_MEM_TAG_MQTT, 5, 10);
+  mg_mem_prof_snapshot(&s);
+  CHECK(t->live_bytes == t0->live_bytes + 150);
+  CHECK(t->live_allocs == t0->live_allocs + 2);
+  CHECK(t->num_allocs == t0->num_allocs + 2);
+  CHECK(t->num_bytes == t0->num_bytes + 150);
+  CHECK(t->peak_bytes == t0->live_bytes + 150);
+  CHECK(s.total.live_bytes == s0.total.live_bytes + 150);
+  CHECK(s.total.peak_bytes == s0.total.live_bytes + 150);
+
+  /* Peak stays until reset */
+  mg_mem_prof_free(a);
+  mg_mem_prof_snapshot(&s);
+  CHECK(t->live_bytes == t0->live_bytes + 50);
+  CHECK(t->live_allocs == t0->live_allocs + 1);
+  CHECK(t->peak_bytes == t0->live_bytes + 150);
+  mg_mem_prof_reset_peak();
+  mg_mem_prof_snapshot(&s);
+  CHECK(t->peak_bytes == t0->live_bytes + 50);
+  CHECK(s.total.peak_bytes == s.total.live_bytes);
+
+  /* A reallocation replaces the block, it counts as a new allocation */
+  b = mg_mem_prof_realloc(MG_MEM_TAG_MQTT, b, 200);
+  mg_mem_prof_snapshot(&s);
+  CHECK(t->live_bytes == t0->live_bytes + 200);
+  CHECK(t->live_allocs == t0->live_allocs + 1);
+  CHECK(t->num_allocs == t0->num_allocs + 3);
+  CHECK(t->peak_bytes == t0->live_bytes + 200);
+  mg_mem_prof_free(b);
+
+  /* Memory from elsewhere is released, but only counted as unknown */
+  c = malloc(10);
+  mg_mem_prof_free(c);
+  mg_mem_prof_snapshot(&s);
+  CHECK(t->live_bytes == t0->live_bytes);
+  CHECK(t->live_allocs == t0->live_allocs);
+  CHECK(s.total.live_bytes == s0.total.live_bytes);
+  CHECK(s.num_unknown_frees == s0.num_unknown_frees + 1);
+}
+
+static void test_threads(void) {
+  struct mg_mem_prof_snapshot s0, s;
+  pthread_t threads[NUM_THREADS];
+  int i;
+
+  mg_mem_prof_snapshot(&s0);
+  for (i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, alloc_thread, (void *) (intptr_t) i);
+  }
+  for (i = 0; i < NUM_THREADS; i++) pthread_join(threads[i], NULL);
+  mg_mem_prof_snapshot(&s);
+  CHECK(s.total.live_bytes == s0.total.live_bytes);
+  CHECK(s.total.live_allocs == s0.total.live_allocs);
+  CHECK(s.total.num_allocs ==
+        s0.total.num_allocs + (unsigned long) NUM_THREADS * NUM_ROUNDS * 3);
+  CHECK(s.num_unknown_frees == s0.num_unknown_frees);
+  CHECK(s.num_untracked == s0.num_untracked);
+  for (i = 0; i < NUM_THREADS; i++) {
+    CHECK(s.tags[i].num_allocs ==
+          s0.tags[i].num_allocs + (unsigned long) NUM_ROUNDS * 3);
+  }
+}
+
+int main(void) {
+  test_counters();
+  test_threads();
+  return test_report("mem_prof_test");
+}
@@ -0,0 +1,171 @@
+/*
+ * Moves an echo connection to a manager polled by another thread, from the
+ * connection's own event handler, while the source manager keeps polling.
+ * The move must only happen once the source is done with the connection:
+ * every echo is answered, and all of them after the first by the target.
+ * HTTP/2 connections, and connections of other interfaces than the socket
+ * one, must not move at all.
+ */
+
+#include <pthread.h>
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define NUM_ROUNDS 20
+
+static struct mg_mgr s_mgr_a, s_mgr_b;
+static int s_stop;
+static time_t (*s_socket_poll)(struct mg_iface *iface, int timeout_ms);
+
+static void echo_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_RECV) {
+    /* Tag each reply with the manager that handled it */
+    mg_send(nc, nc->mgr == &s_mgr_a ? "A" : "B", 1);
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == MG_EV_SEND && nc->mgr == &s_mgr_a &&
+             nc->send_mbuf.len == 0) {
+    mg_conn_migrate(nc, &s_mgr_b);
+  }
+  (void) ev_data;
+}
+
+static void *poll_thread(void *arg) {
+  while (!__atomic_load_n(&s_stop, __ATOMIC_RELAXED)) {
+    mg_mgr_poll((struct mg_mgr *) arg, 1);
+  }
+  return NULL;
+}
+
+static void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  (void) nc;
+  (void) ev;
+  (void) ev_data;
+}
+
+/* The socket interface under another name */
+static time_t other_poll(struct mg_iface *iface, int timeout_ms) {
+  return s_socket_poll(iface, timeout_ms);
+}
+
+static sock_t connect_to(const char *addr) {
+  union socket_address sa;
+  struct timeval tv = {5, 0};
+  sock_t sock = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin.sin_family = AF_INET;
+  sa.sin.sin_port = htons((uint16_t) atoi(strrchr(addr, ':') + 1));
+  sa.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(sock, &sa.sa, sizeof(sa.sin)) != 0) {
+    closesocket(sock);
+    return INVALID_SOCKET;
+  }
+  return sock;
+}
+
+/* Polls until an accepted connection has `flags` and nothing buffered */
+static struct mg_connection *wait_accepted(struct mg_mgr *mgr,
+                                           unsigned long flags) {
+  double deadline = mg_time() + 5;
+  struct mg_connection *c;
+  while (mg_time() < deadline) {
+    for (c = mg_next(mgr, NULL); c != NULL; c = mg_next(mgr, c)) {
+      if (c->listener != NULL && (c->flags & flags) == flags &&
+          c->recv_mbuf.len == 0 && c->send_mbuf.len == 0) {
+        return c;
+      }
+    }
+    mg_mgr_poll(mgr, 10);
+  }
+  return NULL;
+}
+
+static void test_not_movable(void) {
+  /* Preface and an empty SETTINGS frame */
+  static const char preface[] =
+      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n\0\0\0\4\0\0\0\0\0";
+  struct mg_iface_vtable vtable;
+  struct mg_mgr_init_opts opts;
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  sock_t sock;
+  char addr[32];
+
+  /* The streams of an HTTP/2 connection stay with the manager */
+  mg_mgr_init(&mgr, NULL);
+  nc = test_bind(&mgr, http_handler, addr, sizeof(addr));
+  CHECK(nc != NULL);
+  mg_set_protocol_http_websocket(nc);
+  sock = connect_to(addr);
+  CHECK(sock != INVALID_SOCKET);
+  send(sock, preface, sizeof(preface) - 1, 0);
+  nc = wait_accepted(&mgr, MG_F_IS_H2);
+  CHECK(nc != NULL);
+  if (nc != NULL) CHECK(mg_conn_migrate(nc, &s_mgr_b) == -1);
+  closesocket(sock);
+  mg_mgr_free(&mgr);
+
+  /* Connections can only move between socket interfaces */
+  vtable = *mg_ifaces[MG_MAIN_IFACE];
+  s_socket_poll = vtable.poll;
+  vtable.poll = other_poll;
+  memset(&opts, 0, sizeof(opts));
+  opts.main_iface = &vtable;
+  mg_mgr_init_opt(&mgr, NULL, opts);
+  CHECK(test_bind(&mgr, http_handler, addr, sizeof(addr)) != NULL);
+  sock = connect_to(addr);
+  CHECK(sock != INVALID_SOCKET);
+  nc = wait_accepted(&mgr, 0);
+  CHECK(nc != NULL);
+  if (nc != NULL) CHECK(mg_conn_migrate(nc, &s_mgr_b) == -1);
+  closesocket(sock);
+  mg_mgr_free(&mgr);
+}
+
+static int echo(sock_t sock, char *tag) {
+  char buf[16];
+  int n;
+  if (send(sock, "ping", 4, 0) != 4) return 0;
+  n = recv(sock, buf, sizeof(buf), 0);
+  if (n != 5 || memcmp(buf + 1, "ping", 4) != 0) return 0;
+  *tag = buf[0];
+  return 1;
+}
+
+int main(void) {
+  pthread_t ta, tb;
+  sock_t sock;
+  char tag = 0, addr[32];
+  int i, from_b = 0, ok = 1;
+
+  mg_mgr_init(&s_mgr_a, NULL);
+  mg_mgr_init(&s_mgr_b, NULL);
+  test_not_movable();
+  CHECK(test_bind(&s_mgr_a, echo_handler, addr, sizeof(addr)) != NULL);
+  pthread_create(&ta, NULL, poll_thread, &s_mgr_a);
+  pthread_create(&tb, NULL, poll_thread, &s_mgr_b);
+
+  sock = connect_to(addr);
+  CHECK(sock != INVALID_SOCKET);
+
+  for (i = 0; i < NUM_ROUNDS && ok; i++) {
+    ok = echo(sock, &tag);
+    if (i == 0) CHECK(tag == 'A');
+    if (ok && tag == 'B') from_b++;
+  }
+  CHECK(ok);
+  CHECK(from_b == NUM_ROUNDS - 1);
+  /* Just the listener is left in A */
+  CHECK(__atomic_load_n(&s_mgr_a.num_conns, __ATOMIC_RELAXED) == 1);
+  CHECK(__atomic_load_n(&s_mgr_b.num_conns, __ATOMIC_RELAXED) == 1);
+  closesocket(sock);
+
+  __atomic_store_n(&s_stop, 1, __ATOMIC_RELAXED);
+  pthread_join(ta, NULL);
+  pthread_join(tb, NULL);
+  mg_mgr_free(&s_mgr_a);
+  mg_mgr_free(&s_mgr_b);
+  return test_report("migrate_test");
+}
@@ -0,0 +1,114 @@
+/*
+ * A server streams to several bulk clients, which keep draining, while an
+ * interactive client sends pings. Whenever a ping and bulk output are ready
+ * in the same poll, the ping must be handled before any bulk connection is
+ * serviced, and the bulk class must be held to its share. The bulk
+ * connections are accepted last, so they come first in the connection list.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define NUM_BULK 4
+#define NUM_PINGS 10
+#define CHUNK (256 * 1024)
+
+static char *s_chunk;
+static int s_bulk_sends, s_bulk_sends_before_ping, s_pings;
+
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (nc->prio == MG_PRIO_BULK) {
+    if (ev == MG_EV_SEND) s_bulk_sends++;
+    if ((ev == MG_EV_ACCEPT || ev == MG_EV_SEND) &&
+        nc->send_mbuf.len < CHUNK) {
+      mg_send(nc, s_chunk, CHUNK);
+    }
+  } else if (ev == MG_EV_RECV && (nc->flags & MG_F_LISTENING) == 0) {
+    s_bulk_sends_before_ping = s_bulk_sends;
+    s_pings++;
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  (void) ev_data;
+}
+
+static struct mg_connection *bind_prio(struct mg_mgr *mgr, int prio,
+                                       union socket_address *sa) {
+  struct mg_bind_opts opts;
+  struct mg_connection *nc;
+  socklen_t len = sizeof(sa->sin);
+  memset(&opts, 0, sizeof(opts));
+  opts.prio = prio;
+  nc = mg_bind_opt(mgr, "127.0.0.1:0", server_handler, opts);
+  if (nc != NULL) getsockname(nc->sock, &sa->sa, &len);
+  return nc;
+}
+
+static sock_t connect_to(struct mg_mgr *mgr, union socket_address *sa) {
+  sock_t sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(sock, &sa->sa, sizeof(sa->sin)) != 0) {
+    closesocket(sock);
+    return INVALID_SOCKET;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  mg_mgr_poll(mgr, 10); /* Accept it */
+  return sock;
+}
+
+static void drain(sock_t sock) {
+  char buf[16384];
+  while (recv(sock, buf, sizeof(buf), 0) > 0) {
+  }
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  union socket_address interactive_sa, bulk_sa;
+  sock_t ping_sock, bulk[NUM_BULK];
+  int i, j, first = 0, contended = 0;
+  char buf[8];
+
+  s_chunk = (char *) calloc(1, CHUNK);
+  mg_mgr_init(&mgr, NULL);
+  CHECK(bind_prio(&mgr, MG_PRIO_INTERACTIVE, &interactive_sa) != NULL);
+  CHECK(bind_prio(&mgr, MG_PRIO_BULK, &bulk_sa) != NULL);
+  ping_sock = connect_to(&mgr, &interactive_sa);
+  CHECK(ping_sock != INVALID_SOCKET);
+  for (i = 0; i < NUM_BULK; i++) {
+    bulk[i] = connect_to(&mgr, &bulk_sa);
+    CHECK(bulk[i] != INVALID_SOCKET);
+  }
+
+  for (i = 0; i < NUM_PINGS; i++) {
+    /* Get the bulk transfers going, then have everything ready at once */
+    for (j = 0; j < 3; j++) {
+      int k;
+      for (k = 0; k < NUM_BULK; k++) drain(bulk[k]);
+      mg_mgr_poll(&mgr, 0);
+    }
+    for (j = 0; j < NUM_BULK; j++) drain(bulk[j]);
+    CHECK(send(ping_sock, "ping", 4, 0) == 4);
+    s_bulk_sends = 0;
+    s_bulk_sends_before_ping = -1;
+    mg_mgr_poll(&mgr, 100);
+    CHECK(s_pings == i + 1);
+    if (s_bulk_sends_before_ping == 0) first++;
+    if (s_bulk_sends > 0) contended++;
+    for (j = 0; j < 100 && recv(ping_sock, buf, sizeof(buf), 0) != 4; j++) {
+      mg_mgr_poll(&mgr, 1);
+    }
+    CHECK(j < 100);
+  }
+  CHECK(first == NUM_PINGS);
+  /* Bulk output was ready along with the pings, and had to wait */
+  CHECK(contended > 0);
+  CHECK(mgr.prio[MG_PRIO_BULK].stats.deferred > 0);
+  CHECK(mgr.prio[MG_PRIO_INTERACTIVE].stats.deferred == 0);
+  CHECK(mgr.prio[MG_PRIO_INTERACTIVE].stats.serviced >= NUM_PINGS);
+
+  closesocket(ping_sock);
+  for (i = 0; i < NUM_BULK; i++) closesocket(bulk[i]);
+  mg_mgr_free(&mgr);
+  free(s_chunk);
+  return test_report("prio_test");
+}
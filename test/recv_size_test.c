@@ -0,0 +1,76 @@
+/*
+ * Streams into a server connection from a raw client. With plenty of data
+ * waiting, one poll must read up to MG_RECV_BUDGET and no further, growing
+ * the read size to MG_RECV_SIZE_MAX on the way; the next poll takes the
+ * rest. Once the data trickles in, the read size must shrink back to
+ * MG_RECV_SIZE_MIN.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define TOTAL (MG_RECV_BUDGET + MG_RECV_BUDGET / 2)
+
+static struct mg_connection *s_conn;
+static size_t s_got;
+
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_ACCEPT) {
+    s_conn = nc;
+  } else if (ev == MG_EV_RECV) {
+    int n = *(int *) ev_data;
+    s_got += (size_t) n;
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *lc;
+  union socket_address sa;
+  socklen_t len = sizeof(sa.sin);
+  char *data = (char *) calloc(1, TOTAL);
+  sock_t sock;
+  size_t sent = 0;
+  int i;
+
+  mg_mgr_init(&mgr, NULL);
+  lc = mg_bind(&mgr, "127.0.0.1:0", server_handler);
+  CHECK(lc != NULL);
+  if (lc == NULL) return test_report("recv_size_test");
+  getsockname(lc->sock, &sa.sa, &len);
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(connect(sock, &sa.sa, sizeof(sa.sin)) == 0);
+  for (i = 0; i < 10 && s_conn == NULL; i++) mg_mgr_poll(&mgr, 10);
+  CHECK(s_conn != NULL);
+  if (s_conn == NULL) return test_report("recv_size_test");
+  CHECK(s_conn->recv_size <= MG_RECV_SIZE_MIN);
+
+  /* Loopback takes it all at once, so it is all there for the next poll */
+  while (sent < TOTAL) {
+    int n = (int) send(sock, data + sent, TOTAL - sent, 0);
+    if (n <= 0) break;
+    sent += (size_t) n;
+  }
+  CHECK(sent == TOTAL);
+  mg_mgr_poll(&mgr, 100);
+  /* The budget is checked between reads, the last one may go past it */
+  CHECK(s_got >= MG_RECV_BUDGET);
+  CHECK(s_got < MG_RECV_BUDGET + MG_RECV_SIZE_MAX);
+  CHECK(s_conn->recv_size == MG_RECV_SIZE_MAX);
+  mg_mgr_poll(&mgr, 100);
+  CHECK(s_got == TOTAL);
+
+  /* Mostly empty reads halve the size, one poll at a time */
+  for (i = 0; i < 10 && s_conn->recv_size > MG_RECV_SIZE_MIN; i++) {
+    CHECK(send(sock, "x", 1, 0) == 1);
+    mg_mgr_poll(&mgr, 100);
+  }
+  CHECK(s_conn->recv_size == MG_RECV_SIZE_MIN);
+  CHECK(s_got == TOTAL + (size_t) i);
+
+  closesocket(sock);
+  mg_mgr_free(&mgr);
+  free(data);
+  return test_report("recv_size_test");
+}
@@ -0,0 +1,112 @@
+/*
+ * Zero-copy receive through a stub interface that holds received data in
+ * pieces, as the LWIP interface holds pbufs. MG_EV_RECV must report new
+ * data without copying it or acknowledging it to the interface. The view
+ * must list it piece by piece, and mg_recv_pullup() must move it to
+ * recv_mbuf across pieces, releasing what it moved.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static const char *s_pieces[] = {"hello ", "world"};
+#define NUM_PIECES (int) (sizeof(s_pieces) / sizeof(s_pieces[0]))
+
+static struct mg_iface_vtable s_vtable;
+static int s_num_pieces; /* Received so far */
+static size_t s_consumed, s_recved;
+static int s_recv_ev_len = -1;
+
+static int stub_recv_view(struct mg_connection *nc, struct mg_str *iov,
+                          int max_iov) {
+  size_t skip = s_consumed;
+  int i, n = 0;
+  for (i = 0; i < s_num_pieces && n < max_iov; i++) {
+    size_t len = strlen(s_pieces[i]);
+    if (skip >= len) {
+      skip -= len;
+      continue;
+    }
+    iov[n].p = s_pieces[i] + skip;
+    iov[n].len = len - skip;
+    skip = 0;
+    n++;
+  }
+  (void) nc;
+  return n;
+}
+
+static void stub_recv_consume(struct mg_connection *nc, size_t len) {
+  s_consumed += len;
+  (void) nc;
+}
+
+static void stub_recved(struct mg_connection *nc, size_t len) {
+  s_recved += len;
+  (void) nc;
+}
+
+static void handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_RECV) s_recv_ev_len = *(int *) ev_data;
+  (void) nc;
+}
+
+/* The interface has received the next piece */
+static void receive(struct mg_connection *nc) {
+  const char *p = s_pieces[s_num_pieces++];
+  mg_if_recv_view_cb(nc, strlen(p));
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  struct mg_mgr_init_opts opts;
+  struct mg_connection *nc;
+  struct mg_str iov[4];
+
+  s_vtable = *mg_ifaces[MG_MAIN_IFACE];
+  s_vtable.recv_view = stub_recv_view;
+  s_vtable.recv_consume = stub_recv_consume;
+  s_vtable.recved = stub_recved;
+  memset(&opts, 0, sizeof(opts));
+  opts.main_iface = &s_vtable;
+  mg_mgr_init_opt(&mgr, NULL, opts);
+  nc = mg_add_sock(&mgr, INVALID_SOCKET, handler);
+  CHECK(nc != NULL);
+  if (nc == NULL) return test_report("recv_view_test");
+
+  /* Only in receive view mode */
+  s_num_pieces = NUM_PIECES;
+  CHECK(mg_recv_view(nc, iov, 4) == 0);
+  s_num_pieces = 0;
+  nc->flags |= MG_F_RECV_VIEW;
+
+  receive(nc);
+  receive(nc);
+  CHECK(s_recv_ev_len == 5);
+  CHECK(nc->recv_mbuf.len == 0);
+  CHECK(s_recved == 0);
+  CHECK(mg_recv_view(nc, iov, 4) == 2);
+  CHECK(iov[0].len == 6 && memcmp(iov[0].p, "hello ", 6) == 0);
+  CHECK(iov[1].len == 5 && memcmp(iov[1].p, "world", 5) == 0);
+  CHECK(mg_recv_view(nc, iov, 1) == 1);
+
+  CHECK(mg_recv_pullup(nc, 8) == 8);
+  CHECK(nc->recv_mbuf.len == 8);
+  CHECK(memcmp(nc->recv_mbuf.buf, "hello wo", 8) == 0);
+  CHECK(s_consumed == 8);
+  CHECK(mg_recv_view(nc, iov, 4) == 1);
+  CHECK(iov[0].len == 3 && memcmp(iov[0].p, "rld", 3) == 0);
+
+  /* Asking for more than there is moves what there is */
+  CHECK(mg_recv_pullup(nc, 100) == 3);
+  CHECK(nc->recv_mbuf.len == 11);
+  CHECK(memcmp(nc->recv_mbuf.buf, "hello world", 11) == 0);
+  CHECK(mg_recv_view(nc, iov, 4) == 0);
+
+  mg_recv_consume(nc, 0);
+  CHECK(s_consumed == 11);
+  CHECK(s_recved == 0);
+
+  mg_mgr_free(&mgr);
+  return test_report("recv_view_test");
+}
@@ -0,0 +1,104 @@
+/*
+ * Binds and connects with socket option profiles and reads the options back
+ * from the listening, accepted and client sockets. The server replies with
+ * a few bytes through a corked socket: the cork must be released once the
+ * reply is sent, not left to the kernel's cork timeout (200ms on Linux).
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+#define BUF_SIZE 32768
+
+static int s_accepted, s_connected, s_got;
+static double s_sent_time, s_reply_delay;
+
+static int get_opt(sock_t sock, int level, int name) {
+  int v = 0;
+  socklen_t len = sizeof(v);
+  return getsockopt(sock, level, name, &v, &len) == 0 ? v : -1;
+}
+
+/* Linux reports twice the size set, for its bookkeeping */
+static int is_buf_size(int v) {
+  return v >= BUF_SIZE && v <= 2 * BUF_SIZE;
+}
+
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_ACCEPT) {
+    s_accepted = get_opt(nc->sock, IPPROTO_TCP, TCP_NODELAY) == 1 &&
+                 is_buf_size(get_opt(nc->sock, SOL_SOCKET, SO_SNDBUF)) &&
+                 get_opt(nc->sock, IPPROTO_TCP, TCP_CORK) == 1;
+  } else if (ev == MG_EV_RECV) {
+    mg_send(nc, "pong", 4);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+    s_sent_time = mg_time();
+  }
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_CONNECT) {
+    s_connected = *(int *) ev_data == 0 &&
+                  get_opt(nc->sock, IPPROTO_TCP, TCP_NODELAY) == 1 &&
+                  is_buf_size(get_opt(nc->sock, SOL_SOCKET, SO_RCVBUF));
+#ifdef TCP_FASTOPEN_CONNECT
+    if (get_opt(nc->sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT) != 1) {
+      s_connected = 0;
+    }
+#endif
+    /* With TCP_DEFER_ACCEPT, the server only sees the connection now */
+    mg_send(nc, "ping", 4);
+  } else if (ev == MG_EV_RECV) {
+    s_got += (int) nc->recv_mbuf.len;
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+    if (s_got == 4) s_reply_delay = mg_time() - s_sent_time;
+  }
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  struct mg_bind_opts bopts;
+  struct mg_connect_opts copts;
+  struct mg_connection *lc;
+  double deadline = mg_time() + 5;
+  char addr[32];
+
+  mg_mgr_init(&mgr, NULL);
+  memset(&bopts, 0, sizeof(bopts));
+  bopts.sock_opts.nodelay = 1;
+  bopts.sock_opts.cork = 1;
+  bopts.sock_opts.sndbuf = BUF_SIZE;
+  bopts.sock_opts.rcvbuf = BUF_SIZE;
+  bopts.sock_opts.fastopen = 16;
+  bopts.sock_opts.defer_accept = 5;
+  bopts.sock_opts.backlog = 4;
+  lc = mg_bind_opt(&mgr, "127.0.0.1:0", server_handler, bopts);
+  CHECK(lc != NULL);
+  if (lc == NULL) return test_report("sockopt_test");
+  mg_conn_addr_to_str(lc, addr, sizeof(addr),
+                      MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+  /* Buffer sizes must be set before listen() to apply to the window */
+  CHECK(is_buf_size(get_opt(lc->sock, SOL_SOCKET, SO_RCVBUF)));
+#ifdef TCP_FASTOPEN
+  CHECK(get_opt(lc->sock, IPPROTO_TCP, TCP_FASTOPEN) == 16);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+  /* Rounded to retransmission intervals */
+  CHECK(get_opt(lc->sock, IPPROTO_TCP, TCP_DEFER_ACCEPT) >= 5);
+#endif
+
+  memset(&copts, 0, sizeof(copts));
+  copts.sock_opts.nodelay = 1;
+  copts.sock_opts.rcvbuf = BUF_SIZE;
+  copts.sock_opts.fastopen = 1;
+  CHECK(mg_connect_opt(&mgr, addr, client_handler, copts) != NULL);
+  while (s_got < 4 && mg_time() < deadline) mg_mgr_poll(&mgr, 10);
+  CHECK(s_connected == 1);
+  CHECK(s_accepted == 1);
+  CHECK(s_got == 4);
+  CHECK(s_reply_delay < 0.1);
+
+  mg_mgr_free(&mgr);
+  return test_report("sockopt_test");
+}
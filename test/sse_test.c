@@ -0,0 +1,95 @@
+/*
+ * Publishes an event whose type and data carry CR, LF and CRLF line breaks
+ * to a subscribed client. Every break must start a new "data:" line, so
+ * that no part of the payload can be read by the client as a field of its
+ * own (a bare CR ends a line for EventSource too).
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static struct mg_sse_channel s_channel;
+static struct mbuf s_got;
+static int s_closed;
+
+static void http_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  (void) nc;
+  (void) ev;
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(nc, "GET /events HTTP/1.1\r\nHost: x\r\n\r\n");
+  } else if (ev == MG_EV_RECV) {
+    mbuf_append(&s_got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == MG_EV_CLOSE) {
+    s_closed = 1;
+  }
+  (void) ev_data;
+}
+
+/* Polls until the client has received `what` after the response header */
+static const char *wait_for(struct mg_mgr *mgr, const char *what) {
+  double deadline = mg_time() + 5;
+  while (!s_closed && mg_time() < deadline) {
+    struct mg_str got = mg_mk_str_n(s_got.buf, s_got.len);
+    const char *body = mg_strstr(got, mg_mk_str("\r\n\r\n"));
+    if (body != NULL) {
+      struct mg_str rest = mg_mk_str_n(body + 4, got.p + got.len - body - 4);
+      if (what == NULL || mg_strstr(rest, mg_mk_str(what)) != NULL) {
+        return body + 4;
+      }
+    }
+    mg_mgr_poll(mgr, 10);
+  }
+  return NULL;
+}
+
+int main(void) {
+  static const char want[] =
+      "id: 1\n"
+      "event: ev\n"
+      "data: a\n"
+      "data: b\n"
+      "data: c\n"
+      "data: \n"
+      "data: id: 9\n"
+      "data: \n"
+      "\n";
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  const char *body;
+  char addr[32];
+  double deadline;
+
+  mg_mgr_init(&mgr, NULL);
+  mbuf_init(&s_got, 0);
+  mg_sse_channel_init(&s_channel);
+  nc = test_bind(&mgr, http_handler, addr, sizeof(addr));
+  CHECK(nc != NULL);
+  mg_set_protocol_http_websocket(nc);
+  mg_register_sse_endpoint(nc, "/events", &s_channel, NULL);
+  CHECK(mg_connect(&mgr, addr, client_handler) != NULL);
+
+  /* Subscribed once the response header is there */
+  CHECK(wait_for(&mgr, NULL) != NULL);
+  CHECK(mg_sse_publish(&s_channel, "ev\rretry: 1", "a\rb\r\nc\n\nid: 9\r") ==
+        1);
+  body = wait_for(&mgr, "\n\n");
+  CHECK(body != NULL);
+  if (body != NULL) {
+    CHECK((size_t)(s_got.buf + s_got.len - body) == sizeof(want) - 1);
+    CHECK(memcmp(body, want, sizeof(want) - 1) == 0);
+  }
+
+  /* Subscribers are closed along with the channel */
+  mg_sse_channel_free(&s_channel);
+  deadline = mg_time() + 5;
+  while (!s_closed && mg_time() < deadline) mg_mgr_poll(&mgr, 10);
+  CHECK(s_closed);
+  mg_mgr_free(&mgr);
+  mbuf_free(&s_got);
+  return test_report("sse_test");
+}
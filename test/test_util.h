@@ -0,0 +1,41 @@
+/*
+ * Minimal helpers shared by the host tests in this directory. Include after
+ * mongoose.h.
+ */
+
+#ifndef TEST_UTIL_H_
+#define TEST_UTIL_H_
+
+#include <stdio.h>
+
+static int s_num_tests, s_num_failed;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    s_num_tests++;                                                   \
+    if (!(cond)) {                                                   \
+      s_num_failed++;                                                \
+      fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    }                                                                \
+  } while (0)
+
+static int test_report(const char *name) {
+  printf("%s: %d checks, %d failed\n", name, s_num_tests, s_num_failed);
+  return s_num_failed == 0 ? 0 : 1;
+}
+
+/*
+ * Binds to an ephemeral loopback port, so that tests can run in parallel,
+ * and stores the address actually bound ("127.0.0.1:<port>") in `addr`.
+ */
+static __attribute__((unused)) struct mg_connection *test_bind(
+    struct mg_mgr *mgr, mg_event_handler_t handler, char *addr, size_t len) {
+  struct mg_connection *nc = mg_bind(mgr, "127.0.0.1:0", handler);
+  if (nc != NULL) {
+    mg_conn_addr_to_str(nc, addr, len,
+                        MG_SOCK_STRINGIFY_IP | MG_SOCK_STRINGIFY_PORT);
+  }
+  return nc;
+}
+
+#endif /* TEST_UTIL_H_ */
@@ -0,0 +1,158 @@
+/*
+ * Echoes over Unix-domain sockets: stream and datagram, on a path and on a
+ * Linux abstract name. Both ends of a stream must report this process as
+ * their peer. The socket file must be gone once the listener is closed, a
+ * stale one must not stop a new bind, and a regular file must be left
+ * alone.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static struct mbuf s_got;
+static int s_closed, s_cred_ok;
+
+/* Both ends are in this process */
+static int is_own_cred(struct mg_connection *nc) {
+  struct mg_peer_cred cred;
+  return mg_conn_get_peer_cred(nc, &cred) == 0 && cred.pid == getpid() &&
+         cred.uid == getuid() && cred.gid == getgid();
+}
+
+static void echo_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_ACCEPT) {
+    s_cred_ok += is_own_cred(nc);
+  } else if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_CONNECT) {
+    if (*(int *) ev_data == 0) mg_send(nc, "hello", 5);
+    if (!(nc->flags & MG_F_UDP)) s_cred_ok += is_own_cred(nc);
+  } else if (ev == MG_EV_RECV) {
+    mbuf_append(&s_got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == MG_EV_CLOSE) {
+    s_closed = 1;
+  }
+}
+
+/* Binds to `addr` and echoes "hello" through it, returns the listener */
+static struct mg_connection *echo(struct mg_mgr *mgr, const char *addr) {
+  struct mg_connection *lc = mg_bind(mgr, addr, echo_handler), *nc;
+  double deadline = mg_time() + 5;
+  mbuf_init(&s_got, 0);
+  s_closed = s_cred_ok = 0;
+  CHECK(lc != NULL);
+  nc = mg_connect(mgr, addr, client_handler);
+  CHECK(nc != NULL);
+  while (s_got.len < 5 && !s_closed && mg_time() < deadline) {
+    mg_mgr_poll(mgr, 10);
+  }
+  CHECK(s_got.len == 5 && memcmp(s_got.buf, "hello", 5) == 0);
+  if (nc != NULL) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  mbuf_free(&s_got);
+  return lc;
+}
+
+static void test_path(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *lc;
+  union socket_address sa;
+  struct stat st;
+  char path[64], addr[80], buf[80];
+  int fd;
+
+  snprintf(path, sizeof(path), "/tmp/mg_unix_test_%d.sock", (int) getpid());
+  snprintf(addr, sizeof(addr), "unix://%s", path);
+  mg_mgr_init(&mgr, NULL);
+
+  /* A socket file left behind, e.g. by a crashed process */
+  memset(&sa, 0, sizeof(sa));
+  sa.un.sun_family = AF_UNIX;
+  strcpy(sa.un.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(bind(fd, &sa.sa, sizeof(sa.un)) == 0);
+  close(fd);
+  lc = echo(&mgr, addr);
+  CHECK(s_cred_ok == 2);
+  CHECK(stat(path, &st) == 0 && S_ISSOCK(st.st_mode));
+  if (lc != NULL) {
+    mg_conn_addr_to_str(lc, buf, sizeof(buf), MG_SOCK_STRINGIFY_IP);
+    CHECK(strcmp(buf, path) == 0);
+  }
+
+  mg_mgr_free(&mgr);
+  CHECK(stat(path, &st) != 0 && errno == ENOENT);
+
+  /* Not a socket, must not be removed */
+  fd = open(path, O_CREAT | O_WRONLY, 0600);
+  close(fd);
+  mg_mgr_init(&mgr, NULL);
+  CHECK(mg_bind(&mgr, addr, echo_handler) == NULL);
+  mg_mgr_free(&mgr);
+  CHECK(stat(path, &st) == 0 && S_ISREG(st.st_mode));
+  unlink(path);
+}
+
+static void test_abstract(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *lc;
+  struct mg_peer_cred cred;
+  char addr[64], buf[64];
+
+  snprintf(addr, sizeof(addr), "unix://@mg_unix_test_%d", (int) getpid());
+  mg_mgr_init(&mgr, NULL);
+  lc = echo(&mgr, addr);
+  CHECK(s_cred_ok == 2);
+  if (lc != NULL) {
+    mg_conn_addr_to_str(lc, buf, sizeof(buf), MG_SOCK_STRINGIFY_IP);
+    CHECK(strcmp(buf, addr + 7) == 0);
+    /* Nothing at the other end of a listener */
+    CHECK(mg_conn_get_peer_cred(lc, &cred) != 0);
+  }
+  mg_mgr_free(&mgr);
+}
+
+static void test_datagram(void) {
+  struct mg_mgr mgr;
+  char path[64], addr[80];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "/tmp/mg_unix_test_%d.dgram", (int) getpid());
+  snprintf(addr, sizeof(addr), "unixgram://%s", path);
+  mg_mgr_init(&mgr, NULL);
+  echo(&mgr, addr);
+  mg_mgr_free(&mgr);
+  CHECK(stat(path, &st) != 0 && errno == ENOENT);
+
+  snprintf(addr, sizeof(addr), "unixgram://@mg_unix_test_%d", (int) getpid());
+  mg_mgr_init(&mgr, NULL);
+  echo(&mgr, addr);
+  mg_mgr_free(&mgr);
+}
+
+static void test_tcp_cred(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  struct mg_peer_cred cred;
+  char addr[32];
+
+  mg_mgr_init(&mgr, NULL);
+  nc = test_bind(&mgr, echo_handler, addr, sizeof(addr));
+  CHECK(nc != NULL);
+  if (nc != NULL) CHECK(mg_conn_get_peer_cred(nc, &cred) != 0);
+  mg_mgr_free(&mgr);
+}
+
+int main(void) {
+  test_path();
+  test_abstract();
+  test_datagram();
+  test_tcp_cred();
+  return test_report("unix_test");
+}
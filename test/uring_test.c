@@ -0,0 +1,80 @@
+/*
+ * Echoes through the io_uring interface, with the client connecting through
+ * it too. Both ends must get their socket options and stay non-blocking,
+ * like with the socket interface. Skipped where io_uring is not available
+ * and the interface falls back to plain sockets.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static struct mbuf s_got;
+static int s_connected, s_accepted, s_closed;
+
+static int is_non_blocking(sock_t sock) {
+  return (fcntl(sock, F_GETFL, 0) & O_NONBLOCK) != 0;
+}
+
+static int get_sock_opt(sock_t sock, int level, int name) {
+  int v = 0;
+  socklen_t len = sizeof(v);
+  return getsockopt(sock, level, name, &v, &len) == 0 ? v : -1;
+}
+
+static void echo_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_ACCEPT) {
+    s_accepted = is_non_blocking(nc->sock) ? 1 : -1;
+  } else if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  (void) ev_data;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_CONNECT) {
+    s_connected = *(int *) ev_data == 0 ? 1 : -1;
+    if (!is_non_blocking(nc->sock) ||
+        get_sock_opt(nc->sock, IPPROTO_TCP, TCP_NODELAY) != 1) {
+      s_connected = -1;
+    }
+    mg_send(nc, "hello", 5);
+  } else if (ev == MG_EV_RECV) {
+    mbuf_append(&s_got, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  } else if (ev == MG_EV_CLOSE) {
+    s_closed = 1;
+  }
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  struct mg_mgr_init_opts opts;
+  struct mg_connect_opts copts;
+  double deadline = mg_time() + 5;
+  char addr[32];
+
+  memset(&opts, 0, sizeof(opts));
+  opts.main_iface = &mg_uring_iface_vtable;
+  mg_mgr_init_opt(&mgr, NULL, opts);
+  if (mgr.ifaces[MG_MAIN_IFACE]->data == NULL) {
+    printf("uring_test: io_uring is not available, skipped\n");
+    mg_mgr_free(&mgr);
+    return 0;
+  }
+  mbuf_init(&s_got, 0);
+  CHECK(test_bind(&mgr, echo_handler, addr, sizeof(addr)) != NULL);
+  memset(&copts, 0, sizeof(copts));
+  copts.sock_opts.nodelay = 1;
+  CHECK(mg_connect_opt(&mgr, addr, client_handler, copts) != NULL);
+  while (s_got.len < 5 && !s_closed && mg_time() < deadline) {
+    mg_mgr_poll(&mgr, 10);
+  }
+  CHECK(s_connected == 1);
+  CHECK(s_accepted == 1);
+  CHECK(s_got.len == 5 && memcmp(s_got.buf, "hello", 5) == 0);
+
+  mg_mgr_free(&mgr);
+  mbuf_free(&s_got);
+  return test_report("uring_test");
+}
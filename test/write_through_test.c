@@ -0,0 +1,56 @@
+/*
+ * A request comes in and the handler replies to it. With MG_F_WRITE_THROUGH
+ * on the listener, inherited by the accepted connection, the reply must be
+ * on the wire after the poll that read the request. Without it, the reply
+ * waits for the next poll.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static void echo_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+  (void) ev_data;
+}
+
+/* Returns the number of polls it took to get the reply */
+static int polls_to_reply(struct mg_mgr *mgr, unsigned long flags) {
+  struct mg_connection *lc;
+  union socket_address sa;
+  socklen_t len = sizeof(sa.sin);
+  sock_t sock;
+  char buf[8];
+  int n = 0;
+
+  lc = mg_bind(mgr, "127.0.0.1:0", echo_handler);
+  CHECK(lc != NULL);
+  if (lc == NULL) return -1;
+  lc->flags |= flags;
+  getsockname(lc->sock, &sa.sa, &len);
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(connect(sock, &sa.sa, sizeof(sa.sin)) == 0);
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  mg_mgr_poll(mgr, 100); /* Accept */
+
+  CHECK(send(sock, "ping", 4, 0) == 4);
+  while (n < 10 && recv(sock, buf, sizeof(buf), 0) != 4) {
+    mg_mgr_poll(mgr, 100);
+    n++;
+  }
+  closesocket(sock);
+  lc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  mg_mgr_poll(mgr, 0);
+  return n;
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr, NULL);
+  CHECK(polls_to_reply(&mgr, MG_F_WRITE_THROUGH) == 1);
+  CHECK(polls_to_reply(&mgr, 0) == 2);
+  mg_mgr_free(&mgr);
+  return test_report("write_through_test");
+}
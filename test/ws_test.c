@@ -0,0 +1,79 @@
+/*
+ * Sends frames of every header size (7-bit, 16-bit and 64-bit length) with
+ * mg_printf_websocket_frame(), masked from the client and unmasked from the
+ * server, through both the plain and the vsnprintf() format paths. Each
+ * frame must arrive intact.
+ */
+
+#include "mongoose.h"
+#include "test_util.h"
+
+static const size_t s_sizes[] = {1, 124, 125, 126, 127, 65534, 65535, 65536,
+                                 70000};
+#define NUM_SIZES (sizeof(s_sizes) / sizeof(s_sizes[0]))
+
+static char *s_payload;
+static size_t s_next; /* Index of the size being echoed */
+static int s_bad, s_done;
+
+static void send_next(struct mg_connection *nc) {
+  int n = (int) s_sizes[s_next];
+  mg_printf_websocket_frame(nc, WEBSOCKET_OP_TEXT, "%.*s", n, s_payload);
+}
+
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_WEBSOCKET_FRAME) {
+    struct websocket_message *wm = (struct websocket_message *) ev_data;
+    /* %c forces the format through vsnprintf() */
+    mg_printf_websocket_frame(nc, WEBSOCKET_OP_TEXT, "%.*s%c", (int) wm->size,
+                              wm->data, '!');
+  }
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev == MG_EV_WEBSOCKET_HANDSHAKE_DONE) {
+    send_next(nc);
+  } else if (ev == MG_EV_WEBSOCKET_FRAME) {
+    struct websocket_message *wm = (struct websocket_message *) ev_data;
+    size_t n = s_sizes[s_next];
+    if (wm->size != n + 1 || memcmp(wm->data, s_payload, n) != 0 ||
+        wm->data[n] != '!') {
+      s_bad++;
+    }
+    if (++s_next < NUM_SIZES) {
+      send_next(nc);
+    } else {
+      s_done = 1;
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    }
+  } else if (ev == MG_EV_CLOSE && !s_done) {
+    s_done = -1;
+  }
+}
+
+int main(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  double deadline = mg_time() + 5;
+  char addr[32], url[48];
+  size_t i;
+
+  s_payload = (char *) malloc(s_sizes[NUM_SIZES - 1]);
+  for (i = 0; i < s_sizes[NUM_SIZES - 1]; i++) {
+    s_payload[i] = (char) ('a' + i % 26);
+  }
+  mg_mgr_init(&mgr, NULL);
+  nc = test_bind(&mgr, server_handler, addr, sizeof(addr));
+  CHECK(nc != NULL);
+  mg_set_protocol_http_websocket(nc);
+  snprintf(url, sizeof(url), "ws://%s/", addr);
+  CHECK(mg_connect_ws(&mgr, client_handler, url, NULL, NULL) != NULL);
+  while (!s_done && mg_time() < deadline) mg_mgr_poll(&mgr, 10);
+  CHECK(s_done == 1);
+  CHECK(s_next == NUM_SIZES);
+  CHECK(s_bad == 0);
+
+  mg_mgr_free(&mgr);
+  free(s_payload);
+  return test_report("ws_test");
+}